@@ -2,115 +2,46 @@
 // Licensed under the MIT License.
 
 #include <cmath>
+#include <cctype>
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <numeric>
+#include <optional>
+#include <random>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "ort_genai.h"
 
 #include "options.h"
+#include "replay.h"
 #include "resource_utils.h"
+#include "statistics.h"
 
 namespace {
 
-using Clock = std::chrono::steady_clock;
-
-using Duration = Clock::duration;
-using DurationFp = std::chrono::duration<float, Duration::period>;
-
-class Timing {
- public:
-  Timing(const Timing&) = delete;
-  Timing& operator=(const Timing&) = delete;
-
-  Timing(std::vector<Duration>& measurements)
-      : measurements_{measurements}, start_{Clock::now()} {
-  }
-
-  ~Timing() {
-    const auto measurement = Clock::now() - start_;
-    measurements_.push_back(measurement);
-  }
-
- private:
-  std::vector<Duration>& measurements_;
-  const Clock::time_point start_;
-};
-
-struct Statistics {
-  DurationFp average{};
-  DurationFp stddev{};
-  DurationFp p50{};
-  DurationFp p90{};
-  DurationFp p99{};
-  size_t n{};
-};
-
-Statistics ComputeStats(const std::vector<Duration>& measurements) {
-  Statistics stats{};
-  if (measurements.empty()) {
-    return stats;
-  }
-
-  stats.n = measurements.size();
-
-  const auto sum = std::accumulate(measurements.begin(), measurements.end(), Duration{0});
-  stats.average = DurationFp{sum} / stats.n;
-
-  std::vector<Duration> sorted = measurements;
-  std::sort(sorted.begin(), sorted.end());
-
-  stats.p50 = sorted[static_cast<size_t>(stats.n * 0.5)];
-  stats.p90 = sorted[static_cast<size_t>(stats.n * 0.9)];
-  stats.p99 = sorted[static_cast<size_t>(stats.n * 0.99)];
-
-  if (stats.n > 1) {
-    const float variance =
-        std::accumulate(
-            measurements.begin(), measurements.end(),
-            0.0f,
-            [mean = stats.average.count()](float accumulator, const Duration& m) -> float {
-              const float distance_from_mean = m.count() - mean;
-              return accumulator + distance_from_mean * distance_from_mean;
-            }) /
-        (stats.n - 1);
-
-    const float stddev = std::sqrt(variance);
-    stats.stddev = DurationFp{stddev};
-  }
-
-  return stats;
-}
-
-void WritePerTokenStats(std::string_view label,
-                        const Statistics& stats,
-                        const size_t tokens_per_measurement) {
-  using MicrosecondsFp = std::chrono::duration<float, std::chrono::microseconds::period>;
-  const auto avg_us = MicrosecondsFp{stats.average};
-  std::cout << label << ":"
-            << "\n\tavg (us):       " << avg_us.count()
-            << "\n\tavg (tokens/s): " << 1.0e6f / avg_us.count() * tokens_per_measurement
-            << "\n\tp50 (us):       " << MicrosecondsFp{stats.p50}.count()
-            << "\n\tstddev (us):    " << MicrosecondsFp{stats.stddev}.count()
-            << "\n\tn:              " << stats.n << " * " << tokens_per_measurement << " token(s)"
-            << "\n";
-}
-
-void WriteE2EStats(std::string_view label,
-                   const Statistics& stats) {
-  using MillisecondsFp = std::chrono::duration<float, std::chrono::milliseconds::period>;
-  std::cout << label << ":"
-            << "\n\tavg (ms):       " << MillisecondsFp{stats.average}.count()
-            << "\n\tp50 (ms):       " << MillisecondsFp{stats.p50}.count()
-            << "\n\tstddev (ms):    " << MillisecondsFp{stats.stddev}.count()
-            << "\n\tn:              " << stats.n
-            << "\n";
-}
+using benchmark::Clock;
+using benchmark::ComputeStats;
+using benchmark::Duration;
+using benchmark::DurationFp;
+using benchmark::Statistics;
+using benchmark::Timing;
+using benchmark::WriteE2EStats;
+using benchmark::WriteLatencyStats;
+using benchmark::WritePerTokenStats;
+using benchmark::WriteThroughputStats;
 
 std::string GeneratePrompt(size_t num_prompt_tokens, const OgaModel& model, const OgaTokenizer& tokenizer) {
   const char* const base_prompt = "A";
@@ -133,26 +64,120 @@ std::string GeneratePrompt(size_t num_prompt_tokens, const OgaModel& model, cons
   return std::string{tokenizer.Decode(output_sequence_data, output_sequence_length)};
 }
 
-void RunBenchmark(const benchmark::Options& opts) {
-  auto model = OgaModel::Create(opts.model_path.c_str());
-  auto tokenizer = OgaTokenizer::Create(*model);
+// Returns the first number named 'name' in the JSON text, or 0 when there is none
+size_t GetJsonNumber(std::string_view json, std::string_view name) {
+  const auto key = std::string{"\""}.append(name).append("\"");
+  const auto position = json.find(key);
+  if (position == std::string_view::npos) {
+    return 0;
+  }
+  const auto value = json.find_first_not_of(" \t\r\n:", position + key.size());
+  if (value == std::string_view::npos || !std::isdigit(static_cast<unsigned char>(json[value]))) {
+    return 0;
+  }
+  return std::stoull(std::string{json.substr(value, 32)});
+}
 
-  const std::string prompt = GeneratePrompt(opts.num_prompt_tokens, *model, *tokenizer);
-  auto prompt_sequences = OgaSequences::Create();
+// The decoder's shape from genai_config.json and the size of the weights on disk, for the roofline estimates
+struct ModelShape {
+  size_t num_layers{};
+  size_t hidden_size{};
+  size_t num_heads{};
+  size_t num_kv_heads{};
+  size_t head_size{};
+  size_t vocab_size{};
+  size_t weight_bytes{};
+  double parameter_count{};
+  size_t kv_element_size{};
+};
+
+ModelShape LoadModelShape(const std::string& model_path) {
+  const auto config_path = std::filesystem::path{model_path} / "genai_config.json";
+  std::ifstream file{config_path};
+  if (!file) {
+    throw std::runtime_error("Failed to open " + config_path.string());
+  }
+  const std::string config{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+  const std::string_view decoder = std::string_view{config}.substr(std::min(config.find("\"decoder\""), config.size()));
 
-  if (opts.batch_size < 1) {
-    throw std::runtime_error("Batch size must be at least 1.");
+  ModelShape shape;
+  shape.num_layers = GetJsonNumber(decoder, "num_hidden_layers");
+  shape.num_kv_heads = GetJsonNumber(decoder, "num_key_value_heads");
+  shape.num_heads = GetJsonNumber(decoder, "num_attention_heads");
+  shape.head_size = GetJsonNumber(decoder, "head_size");
+  shape.hidden_size = GetJsonNumber(decoder, "hidden_size");
+  shape.vocab_size = GetJsonNumber(config, "vocab_size");
+  if (shape.num_heads == 0) {
+    shape.num_heads = shape.num_kv_heads;
+  }
+  if (shape.num_kv_heads == 0) {
+    shape.num_kv_heads = shape.num_heads;
+  }
+  if (shape.hidden_size == 0) {
+    shape.hidden_size = shape.num_heads * shape.head_size;
+  }
+  if (shape.head_size == 0 && shape.num_heads != 0) {
+    shape.head_size = shape.hidden_size / shape.num_heads;
   }
 
-  for (size_t i = 0; i < opts.batch_size; ++i) {
-    tokenizer->Encode(prompt.c_str(), *prompt_sequences);
+  for (const auto& entry : std::filesystem::directory_iterator{model_path}) {
+    const auto extension = entry.path().extension();
+    if (entry.is_regular_file() && (extension == ".onnx" || extension == ".data")) {
+      shape.weight_bytes += static_cast<size_t>(entry.file_size());
+    }
   }
 
-  const size_t num_prompt_tokens = prompt_sequences->SequenceCount(0);
-  const size_t num_tokens = num_prompt_tokens + opts.num_tokens_to_generate;
+  // The config has no intermediate size, so the MLP is assumed to be 4 * hidden_size wide like in most decoders
+  const double h = static_cast<double>(shape.hidden_size);
+  const double kv_hidden_size = static_cast<double>(shape.num_kv_heads * shape.head_size);
+  const double layer_parameters = 2 * h * h + 2 * h * kv_hidden_size + 8 * h * h;
+  shape.parameter_count = shape.num_layers * layer_parameters + static_cast<double>(shape.vocab_size) * h;
+
+  // fp32 models have fp32 key-value caches, quantized and fp16 models fp16 ones
+  const bool is_fp32 = shape.parameter_count > 0 && shape.weight_bytes / shape.parameter_count > 3;
+  shape.kv_element_size = is_fp32 ? 4 : 2;
+  return shape;
+}
+
+// Work of one model run over 'new_tokens' tokens of each of 'batch_size' sequences, which already hold 'past_tokens'
+struct Work {
+  double flops{};
+  double bytes{};
+};
+
+Work EstimateWork(const ModelShape& shape, size_t batch_size, double past_tokens, double new_tokens) {
+  const double attention_width = static_cast<double>(shape.num_heads * shape.head_size);
+  const double kv_bytes_per_token = 2.0 * shape.num_layers * shape.num_kv_heads * shape.head_size * shape.kv_element_size;
+
+  // Every token multiplies by every weight, and attends to the ones before it (Q*K^T and the weighted sum of V)
+  const double linear_flops = 2 * shape.parameter_count * new_tokens;
+  const double attended_tokens = new_tokens * past_tokens + new_tokens * (new_tokens + 1) / 2;
+  const double attention_flops = 4 * shape.num_layers * attention_width * attended_tokens;
+
+  // The weights are read once per run, the key-value cache of every sequence is read and the new entries written
+  Work work;
+  work.flops = batch_size * (linear_flops + attention_flops);
+  work.bytes = shape.weight_bytes + batch_size * kv_bytes_per_token * (past_tokens + new_tokens);
+  return work;
+}
+
+struct BenchmarkResult {
+  size_t batch_size{};
+  size_t num_prompt_tokens{};
+  size_t num_tokens_to_generate{};
+  Statistics e2e_gen_stats;
+  Statistics prompt_processing_stats;
+  Statistics token_gen_stats;
+  Statistics sampling_stats;
+};
+
+BenchmarkResult MeasureGeneration(const benchmark::Options& opts, const OgaModel& model, const OgaTokenizer& tokenizer,
+                                  const OgaSequences& prompt_sequences, size_t num_tokens_to_generate) {
+  const size_t num_prompt_tokens = prompt_sequences.SequenceCount(0);
+  const size_t num_tokens = num_prompt_tokens + num_tokens_to_generate;
 
   auto make_generator_params = [&] {
-    auto params = OgaGeneratorParams::Create(*model);
+    auto params = OgaGeneratorParams::Create(model);
     params->SetSearchOption("max_length", static_cast<double>(num_tokens));
     params->SetSearchOption("min_length", static_cast<double>(num_tokens));
     return params;
@@ -163,18 +188,19 @@ void RunBenchmark(const benchmark::Options& opts) {
   // warmup
   if (opts.verbose) std::cout << "Running warmup iterations (" << opts.num_warmup_iterations << ")...\n";
   for (size_t i = 0; i < opts.num_warmup_iterations; ++i) {
-    auto generator = OgaGenerator::Create(*model, *generator_params);
-    generator->AppendTokenSequences(*prompt_sequences);
+    auto generator = OgaGenerator::Create(model, *generator_params);
+    generator->AppendTokenSequences(prompt_sequences);
     while (!generator->IsDone()) {
       generator->GenerateNextToken();
     }
 
     if (opts.verbose && i == 0) {
       // show prompt and output on first iteration
+      const auto prompt = tokenizer.Decode(prompt_sequences.SequenceData(0), num_prompt_tokens);
       std::cout << "Prompt:\n\t" << prompt << "\n";
       const auto output_sequence_length = generator->GetSequenceCount(0);
       const auto* output_sequence_data = generator->GetSequenceData(0);
-      const auto output = tokenizer->Decode(output_sequence_data, output_sequence_length);
+      const auto output = tokenizer.Decode(output_sequence_data, output_sequence_length);
       std::cout << "Output:\n\t" << output << "\n";
     }
   }
@@ -183,19 +209,19 @@ void RunBenchmark(const benchmark::Options& opts) {
   // note: be sure to reserve enough to avoid vector reallocations in the measured code
   e2e_gen_times.reserve(opts.num_iterations);
   prompt_processing_times.reserve(opts.num_iterations);
-  token_gen_times.reserve(opts.num_iterations * (opts.num_tokens_to_generate - 1));
-  sampling_times.reserve(opts.num_iterations * opts.num_tokens_to_generate);
+  token_gen_times.reserve(opts.num_iterations * (num_tokens_to_generate - 1));
+  sampling_times.reserve(opts.num_iterations * num_tokens_to_generate);
 
   if (opts.verbose) std::cout << "Running iterations (" << opts.num_iterations << ")...\n";
   for (size_t i = 0; i < opts.num_iterations; ++i) {
-    auto generator = OgaGenerator::Create(*model, *generator_params);
+    auto generator = OgaGenerator::Create(model, *generator_params);
 
     {
       Timing e2e_gen_timing{e2e_gen_times};
 
       {
         Timing prompt_processing_timing{prompt_processing_times};
-        generator->AppendTokenSequences(*prompt_sequences);
+        generator->AppendTokenSequences(prompt_sequences);
       }
 
       {
@@ -212,24 +238,1124 @@ void RunBenchmark(const benchmark::Options& opts) {
     }
   }
 
+  BenchmarkResult result;
+  result.batch_size = prompt_sequences.Count();
+  result.num_prompt_tokens = num_prompt_tokens;
+  result.num_tokens_to_generate = num_tokens_to_generate;
+  result.e2e_gen_stats = ComputeStats(e2e_gen_times);
+  result.prompt_processing_stats = ComputeStats(prompt_processing_times);
+  result.token_gen_stats = ComputeStats(token_gen_times);
+  result.sampling_stats = ComputeStats(sampling_times);
+  return result;
+}
+
+// The achieved FLOP/s and bandwidth of the prompt processing and of the average token generation step
+struct Roofline {
+  Work prefill;
+  Work decode;
+  double prefill_tflops{};
+  double prefill_gbps{};
+  double decode_tflops{};
+  double decode_gbps{};
+};
+
+Roofline ComputeRoofline(const ModelShape& shape, const BenchmarkResult& result) {
+  using SecondsFp = std::chrono::duration<double>;
+  const double prefill_seconds = SecondsFp{result.prompt_processing_stats.average}.count();
+  const double decode_seconds = SecondsFp{result.token_gen_stats.average}.count();
+
+  Roofline roofline;
+  roofline.prefill = EstimateWork(shape, result.batch_size, 0, static_cast<double>(result.num_prompt_tokens));
+  // The generation steps attend to between num_prompt_tokens and num_tokens - 2 past tokens, on average the middle
+  const double average_past_tokens = result.num_prompt_tokens + (static_cast<double>(result.num_tokens_to_generate) - 1) / 2;
+  roofline.decode = EstimateWork(shape, result.batch_size, average_past_tokens, 1);
+  if (prefill_seconds > 0) {
+    roofline.prefill_tflops = roofline.prefill.flops / prefill_seconds / 1e12;
+    roofline.prefill_gbps = roofline.prefill.bytes / prefill_seconds / 1e9;
+  }
+  if (decode_seconds > 0) {
+    roofline.decode_tflops = roofline.decode.flops / decode_seconds / 1e12;
+    roofline.decode_gbps = roofline.decode.bytes / decode_seconds / 1e9;
+  }
+  return roofline;
+}
+
+// A run is memory bound when its FLOP per byte is below the device's, which is only known with both peaks
+std::string_view GetBound(const benchmark::Options& opts, const Work& work) {
+  if (opts.peak_bandwidth_gbps <= 0 || opts.peak_tflops <= 0 || work.bytes <= 0) {
+    return "unknown";
+  }
+  const double device_intensity = opts.peak_tflops * 1e12 / (opts.peak_bandwidth_gbps * 1e9);
+  return work.flops / work.bytes < device_intensity ? "memory" : "compute";
+}
+
+double GetUtilization(double achieved, double peak) {
+  return peak > 0 ? achieved / peak : 0;
+}
+
+void WriteRooflineStats(std::string_view label,
+                        const benchmark::Options& opts,
+                        const Work& work,
+                        double tflops,
+                        double gbps) {
+  std::cout << label << ":"
+            << "\n\tTFLOP/s:        " << tflops;
+  if (opts.peak_tflops > 0) {
+    std::cout << " (" << 100 * GetUtilization(tflops, opts.peak_tflops) << "% of peak)";
+  }
+  std::cout << "\n\tGB/s:           " << gbps;
+  if (opts.peak_bandwidth_gbps > 0) {
+    std::cout << " (" << 100 * GetUtilization(gbps, opts.peak_bandwidth_gbps) << "% of peak)";
+  }
+  std::cout << "\n\tFLOP/byte:      " << (work.bytes > 0 ? work.flops / work.bytes : 0)
+            << "\n\tbound:          " << GetBound(opts, work)
+            << "\n";
+}
+
+// The columns of the CSV and JSON output, in order
+std::vector<std::pair<std::string_view, double>> GetResultColumns(const benchmark::Options& opts,
+                                                                  const BenchmarkResult& result,
+                                                                  const Roofline& roofline) {
+  using MillisecondsFp = std::chrono::duration<double, std::chrono::milliseconds::period>;
+  const auto milliseconds = [](const DurationFp& duration) { return MillisecondsFp{duration}.count(); };
+  const auto tokens_per_second = [&](const DurationFp& duration, size_t tokens) {
+    return duration.count() > 0 ? tokens * 1e3 / milliseconds(duration) : 0;
+  };
+
+  return {
+      {"batch_size", static_cast<double>(result.batch_size)},
+      {"prompt_tokens", static_cast<double>(result.num_prompt_tokens)},
+      {"generation_tokens", static_cast<double>(result.num_tokens_to_generate)},
+      {"prompt_processing_avg_ms", milliseconds(result.prompt_processing_stats.average)},
+      {"prompt_processing_p50_ms", milliseconds(result.prompt_processing_stats.p50)},
+      {"prompt_tokens_per_s", tokens_per_second(result.prompt_processing_stats.average, result.batch_size * result.num_prompt_tokens)},
+      {"token_generation_avg_ms", milliseconds(result.token_gen_stats.average)},
+      {"token_generation_p50_ms", milliseconds(result.token_gen_stats.p50)},
+      {"token_generation_p90_ms", milliseconds(result.token_gen_stats.p90)},
+      {"generated_tokens_per_s", tokens_per_second(result.token_gen_stats.average, result.batch_size)},
+      {"token_sampling_avg_ms", milliseconds(result.sampling_stats.average)},
+      {"e2e_avg_ms", milliseconds(result.e2e_gen_stats.average)},
+      {"prefill_tflops", roofline.prefill_tflops},
+      {"prefill_gbps", roofline.prefill_gbps},
+      {"prefill_compute_utilization", GetUtilization(roofline.prefill_tflops, opts.peak_tflops)},
+      {"decode_tflops", roofline.decode_tflops},
+      {"decode_gbps", roofline.decode_gbps},
+      {"decode_bandwidth_utilization", GetUtilization(roofline.decode_gbps, opts.peak_bandwidth_gbps)},
+      {"decode_flop_per_byte", roofline.decode.bytes > 0 ? roofline.decode.flops / roofline.decode.bytes : 0},
+  };
+}
+
+void WriteCsv(const std::string& path, const benchmark::Options& opts,
+              const std::vector<BenchmarkResult>& results, const std::vector<Roofline>& rooflines) {
+  std::ofstream file{path};
+  if (!file) {
+    throw std::runtime_error("Failed to open CSV output file: " + path);
+  }
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto columns = GetResultColumns(opts, results[i], rooflines[i]);
+    if (i == 0) {
+      for (const auto& [name, value] : columns) {
+        file << name << ",";
+      }
+      file << "prefill_bound,decode_bound\n";
+    }
+    for (const auto& [name, value] : columns) {
+      file << value << ",";
+    }
+    file << GetBound(opts, rooflines[i].prefill) << "," << GetBound(opts, rooflines[i].decode) << "\n";
+  }
+}
+
+void WriteJson(const std::string& path, const benchmark::Options& opts, const ModelShape& shape,
+               const std::vector<BenchmarkResult>& results, const std::vector<Roofline>& rooflines) {
+  std::ofstream file{path};
+  if (!file) {
+    throw std::runtime_error("Failed to open JSON output file: " + path);
+  }
+  file << "{\"model\":{\"num_layers\":" << shape.num_layers
+       << ",\"hidden_size\":" << shape.hidden_size
+       << ",\"num_heads\":" << shape.num_heads
+       << ",\"num_kv_heads\":" << shape.num_kv_heads
+       << ",\"head_size\":" << shape.head_size
+       << ",\"vocab_size\":" << shape.vocab_size
+       << ",\"weight_bytes\":" << shape.weight_bytes
+       << ",\"estimated_parameters\":" << shape.parameter_count
+       << "},\"peak_bandwidth_gbps\":" << opts.peak_bandwidth_gbps
+       << ",\"peak_tflops\":" << opts.peak_tflops
+       << ",\"results\":[";
+  for (size_t i = 0; i < results.size(); ++i) {
+    file << (i == 0 ? "{" : ",{");
+    for (const auto& [name, value] : GetResultColumns(opts, results[i], rooflines[i])) {
+      file << "\"" << name << "\":" << value << ",";
+    }
+    file << "\"prefill_bound\":\"" << GetBound(opts, rooflines[i].prefill)
+         << "\",\"decode_bound\":\"" << GetBound(opts, rooflines[i].decode) << "\"}";
+  }
+  file << "]}\n";
+}
+
+// Benchmarks every combination of the batch sizes, prompt and generation lengths
+void RunBenchmark(const benchmark::Options& opts) {
+  auto model = OgaModel::Create(opts.model_path.c_str());
+  auto tokenizer = OgaTokenizer::Create(*model);
+  const auto shape = LoadModelShape(opts.model_path);
+
+  for (const auto batch_size : opts.batch_sizes) {
+    if (batch_size < 1) {
+      throw std::runtime_error("Batch size must be at least 1.");
+    }
+  }
+
+  std::vector<BenchmarkResult> results;
+  std::vector<Roofline> rooflines;
+  for (const auto num_prompt_tokens : opts.prompt_lengths) {
+    auto prompt_tokens = OgaSequences::Create();
+    tokenizer->Encode(GeneratePrompt(num_prompt_tokens, *model, *tokenizer).c_str(), *prompt_tokens);
+
+    for (const auto batch_size : opts.batch_sizes) {
+      auto prompt_sequences = OgaSequences::Create();
+      for (size_t i = 0; i < batch_size; ++i) {
+        prompt_sequences->Append(prompt_tokens->SequenceData(0), prompt_tokens->SequenceCount(0));
+      }
+
+      for (const auto num_tokens_to_generate : opts.generation_lengths) {
+        const auto result = MeasureGeneration(opts, *model, *tokenizer, *prompt_sequences, num_tokens_to_generate);
+        const auto roofline = ComputeRoofline(shape, result);
+
+        std::cout << "Batch size: " << result.batch_size
+                  << ", prompt tokens: " << result.num_prompt_tokens
+                  << ", tokens to generate: " << result.num_tokens_to_generate
+                  << "\n";
+
+        WritePerTokenStats("Prompt processing (time to first token)",
+                           result.prompt_processing_stats, result.batch_size * result.num_prompt_tokens);
+        WritePerTokenStats("Token generation", result.token_gen_stats, result.batch_size);
+        WritePerTokenStats("Token sampling", result.sampling_stats, result.batch_size);
+        WriteE2EStats("E2E generation (entire generation loop)", result.e2e_gen_stats);
+        WriteRooflineStats("Prompt processing roofline", opts, roofline.prefill, roofline.prefill_tflops, roofline.prefill_gbps);
+        WriteRooflineStats("Token generation roofline", opts, roofline.decode, roofline.decode_tflops, roofline.decode_gbps);
+
+        results.push_back(result);
+        rooflines.push_back(roofline);
+      }
+    }
+  }
+
+  std::cout << "Peak working set size (bytes): " << benchmark::utils::GetPeakWorkingSetSizeInBytes() << "\n";
+
+  if (!opts.csv_path.empty()) {
+    WriteCsv(opts.csv_path, opts, results, rooflines);
+  }
+  if (!opts.json_path.empty()) {
+    WriteJson(opts.json_path, opts, shape, results, rooflines);
+  }
+}
+
+// Reads a JSON object of prompt strings, like benchmark/python/prompts.json which is keyed by the prompt's token count
+std::vector<std::string> LoadPrompts(const std::string& path) {
+  std::ifstream file{path};
+  if (!file) {
+    throw std::runtime_error("Failed to open prompts file: " + path);
+  }
+  const std::string json{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+
+  auto error = [&path](const char* message) { return std::runtime_error(path + ": " + message); };
+
+  // Returns the string starting at json[i] == '"' and moves i past it
+  auto parse_string = [&](size_t& i) {
+    std::string s;
+    for (i++; i < json.size() && json[i] != '"'; i++) {
+      if (json[i] != '\\') {
+        s += json[i];
+        continue;
+      }
+      if (++i == json.size()) {
+        break;
+      }
+      switch (json[i]) {
+        case 'n':
+          s += '\n';
+          break;
+        case 't':
+          s += '\t';
+          break;
+        case 'r':
+          s += '\r';
+          break;
+        case 'b':
+          s += '\b';
+          break;
+        case 'f':
+          s += '\f';
+          break;
+        case 'u': {
+          if (i + 4 >= json.size()) {
+            throw error("Incomplete \\u escape");
+          }
+          const auto code_point = static_cast<uint32_t>(std::stoul(json.substr(i + 1, 4), nullptr, 16));
+          i += 4;
+          if (code_point < 0x80) {
+            s += static_cast<char>(code_point);
+          } else if (code_point < 0x800) {
+            s += static_cast<char>(0xC0 | (code_point >> 6));
+            s += static_cast<char>(0x80 | (code_point & 0x3F));
+          } else {  // Surrogate pairs aren't combined, prompts are expected to be mostly ASCII
+            s += static_cast<char>(0xE0 | (code_point >> 12));
+            s += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+            s += static_cast<char>(0x80 | (code_point & 0x3F));
+          }
+          break;
+        }
+        default:  // '"', '\\' and '/'
+          s += json[i];
+      }
+    }
+    if (i == json.size()) {
+      throw error("Unterminated string");
+    }
+    i++;
+    return s;
+  };
+
+  std::vector<std::string> prompts;
+  bool is_value = false;  // Alternates between the keys and the prompts
+  for (size_t i = json.find_first_not_of(" \t\r\n"); i < json.size();) {
+    if (json[i] == '"') {
+      auto s = parse_string(i);
+      if (is_value) {
+        prompts.push_back(std::move(s));
+      }
+      is_value = !is_value;
+    } else if (json[i] == '{' || json[i] == '}' || json[i] == ':' || json[i] == ',' || std::isspace(static_cast<unsigned char>(json[i]))) {
+      i++;
+    } else {
+      throw error("Expected an object of strings");
+    }
+  }
+
+  if (prompts.empty()) {
+    throw error("No prompts found");
+  }
+  return prompts;
+}
+
+struct Request {
+  std::vector<int32_t> prompt_tokens;
+  size_t num_tokens_to_generate{};
+};
+
+struct RequestTimings {
+  Duration time_to_first_token{};
+  std::vector<Duration> inter_token_latencies;
+  size_t num_prompt_tokens{};
+  size_t num_generated_tokens{};
+};
+
+// The model's live memory (see OgaModel_GetMemoryUsage) sampled from a background thread
+class MemorySampler {
+ public:
+  struct Sample {
+    Duration time;
+    size_t total_bytes;
+    size_t kv_cache_bytes;
+  };
+
+  MemorySampler(const OgaModel& model, std::chrono::milliseconds interval)
+      : model_{model}, interval_{interval}, start_{Clock::now()}, thread_{[this] { Run(); }} {
+  }
+
+  ~MemorySampler() { Stop(); }
+
+  void Stop() {
+    {
+      std::scoped_lock lock{mutex_};
+      stop_ = true;
+    }
+    stopped_.notify_one();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  const std::vector<Sample>& GetSamples() const { return samples_; }  // Call after Stop
+
+ private:
+  void Run() {
+    std::unique_lock lock{mutex_};
+    do {
+      const std::string usage{model_.GetMemoryUsage()};
+      samples_.push_back({Clock::now() - start_, GetJsonNumber(usage, "total_bytes"), GetJsonNumber(usage, "kv_cache_bytes")});
+    } while (!stopped_.wait_for(lock, interval_, [this] { return stop_; }));
+  }
+
+  const OgaModel& model_;
+  const std::chrono::milliseconds interval_;
+  const Clock::time_point start_;
+  std::vector<Sample> samples_;
+  std::mutex mutex_;
+  std::condition_variable stopped_;
+  bool stop_{};
+  std::thread thread_;
+};
+
+std::vector<Request> CreateRequests(const benchmark::Options& opts, const OgaModel& model, const OgaTokenizer& tokenizer) {
+  std::mt19937 rng{opts.seed};
+  auto draw = [&rng](size_t min, size_t max) {
+    return std::uniform_int_distribution<size_t>{min, std::max(min, max)}(rng);
+  };
+
+  // Either prompts of their own lengths from the file, or prefixes of one generated prompt of the longest length
+  std::vector<std::vector<int32_t>> prompts;
+  if (!opts.prompts_path.empty()) {
+    for (const auto& prompt : LoadPrompts(opts.prompts_path)) {
+      auto sequences = OgaSequences::Create();
+      tokenizer.Encode(prompt.c_str(), *sequences);
+      prompts.emplace_back(sequences->SequenceData(0), sequences->SequenceData(0) + sequences->SequenceCount(0));
+    }
+  } else {
+    const size_t max_prompt_tokens = std::max(opts.num_prompt_tokens, opts.max_prompt_tokens);
+    auto sequences = OgaSequences::Create();
+    tokenizer.Encode(GeneratePrompt(max_prompt_tokens, model, tokenizer).c_str(), *sequences);
+    prompts.emplace_back(sequences->SequenceData(0), sequences->SequenceData(0) + sequences->SequenceCount(0));
+  }
+
+  std::vector<Request> requests(opts.num_requests);
+  for (auto& request : requests) {
+    if (!opts.prompts_path.empty()) {
+      request.prompt_tokens = prompts[draw(0, prompts.size() - 1)];
+    } else {
+      const size_t length = std::min(draw(opts.num_prompt_tokens, opts.max_prompt_tokens), prompts[0].size());
+      request.prompt_tokens.assign(prompts[0].begin(), prompts[0].begin() + length);
+    }
+    request.num_tokens_to_generate = draw(opts.num_tokens_to_generate, opts.max_tokens_to_generate);
+  }
+  return requests;
+}
+
+RequestTimings RunRequest(const OgaModel& model, const Request& request) {
+  const size_t num_tokens = request.prompt_tokens.size() + request.num_tokens_to_generate;
+  auto params = OgaGeneratorParams::Create(model);
+  params->SetSearchOption("max_length", static_cast<double>(num_tokens));
+  params->SetSearchOption("min_length", static_cast<double>(num_tokens));
+
+  RequestTimings timings;
+  timings.num_prompt_tokens = request.prompt_tokens.size();
+  timings.inter_token_latencies.reserve(request.num_tokens_to_generate);
+
+  const auto start = Clock::now();
+  auto generator = OgaGenerator::Create(model, *params);
+  generator->AppendTokens(request.prompt_tokens.data(), request.prompt_tokens.size());
+  generator->GenerateNextToken();
+  auto last_token_time = Clock::now();
+  timings.time_to_first_token = last_token_time - start;
+  timings.num_generated_tokens = 1;
+
+  while (!generator->IsDone()) {
+    generator->GenerateNextToken();
+    const auto now = Clock::now();
+    timings.inter_token_latencies.push_back(now - last_token_time);
+    last_token_time = now;
+    timings.num_generated_tokens++;
+  }
+  return timings;
+}
+
+// Runs num_requests generators, 'concurrency' at a time, each on its own thread
+void RunThroughputBenchmark(const benchmark::Options& opts) {
+  auto model = OgaModel::Create(opts.model_path.c_str());
+  auto tokenizer = OgaTokenizer::Create(*model);
+
+  const auto requests = CreateRequests(opts, *model, *tokenizer);
+
+  if (opts.verbose) std::cout << "Running warmup iterations (" << opts.num_warmup_iterations << ")...\n";
+  for (size_t i = 0; i < opts.num_warmup_iterations; ++i) {
+    RunRequest(*model, requests[i % requests.size()]);
+  }
+
+  if (opts.verbose) std::cout << "Running " << requests.size() << " requests on " << opts.concurrency << " threads...\n";
+  std::vector<RequestTimings> timings(requests.size());
+  std::atomic<size_t> next_request{};
+  std::mutex error_mutex;
+  std::string error;
+
+  MemorySampler memory_sampler{*model, std::chrono::milliseconds{opts.memory_sample_interval_ms}};
+  const auto start = Clock::now();
+  {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < opts.concurrency; ++i) {
+      threads.emplace_back([&] {
+        for (size_t index; (index = next_request++) < requests.size();) {
+          try {
+            timings[index] = RunRequest(*model, requests[index]);
+          } catch (const std::exception& e) {
+            std::scoped_lock lock{error_mutex};
+            error = e.what();
+            next_request = requests.size();  // Let the other threads finish their current request and stop
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+  const auto elapsed = DurationFp{Clock::now() - start};
+  memory_sampler.Stop();
+
+  if (!error.empty()) {
+    throw std::runtime_error(error);
+  }
+
+  std::vector<Duration> time_to_first_token_times, inter_token_latencies;
+  size_t num_prompt_tokens = 0, num_generated_tokens = 0;
+  for (const auto& request_timings : timings) {
+    time_to_first_token_times.push_back(request_timings.time_to_first_token);
+    inter_token_latencies.insert(inter_token_latencies.end(), request_timings.inter_token_latencies.begin(),
+                                 request_timings.inter_token_latencies.end());
+    num_prompt_tokens += request_timings.num_prompt_tokens;
+    num_generated_tokens += request_timings.num_generated_tokens;
+  }
+
+  using SecondsFp = std::chrono::duration<float>;
+  const float seconds = SecondsFp{elapsed}.count();
+  std::cout << "Concurrency: " << opts.concurrency
+            << ", requests: " << requests.size()
+            << ", prompt tokens: " << num_prompt_tokens
+            << ", generated tokens: " << num_generated_tokens
+            << "\n"
+            << "Aggregate throughput:"
+            << "\n\telapsed (s):        " << seconds
+            << "\n\tgenerated tokens/s: " << num_generated_tokens / seconds
+            << "\n\ttotal tokens/s:     " << (num_prompt_tokens + num_generated_tokens) / seconds
+            << "\n\trequests/s:         " << requests.size() / seconds
+            << "\n";
+
+  WriteLatencyStats("Time to first token", ComputeStats(time_to_first_token_times));
+  WriteLatencyStats("Inter-token latency", ComputeStats(inter_token_latencies));
+
+  const auto& samples = memory_sampler.GetSamples();
+  const auto peak = std::max_element(samples.begin(), samples.end(),
+                                     [](const auto& a, const auto& b) { return a.total_bytes < b.total_bytes; });
+  std::cout << "Generator memory (bytes, see OgaModel_GetMemoryUsage):"
+            << "\n\tpeak total:    " << (peak != samples.end() ? peak->total_bytes : 0)
+            << "\n\tpeak kv_cache: " << (peak != samples.end() ? peak->kv_cache_bytes : 0)
+            << "\n\tover time (s, total, kv_cache):";
+  for (const auto& sample : samples) {
+    std::cout << "\n\t\t" << SecondsFp{sample.time}.count() << ", " << sample.total_bytes << ", " << sample.kv_cache_bytes;
+  }
+  std::cout << "\n";
+
+  std::cout << "Peak working set size (bytes): " << benchmark::utils::GetPeakWorkingSetSizeInBytes() << "\n";
+}
+
+struct TurnTimings {
+  std::vector<Duration> continued_ttft;  // Appending the turn to the session and generating its first token
+  std::vector<Duration> prefilled_ttft;  // Prefilling the whole conversation up to the turn in a new generator
+  std::vector<Duration> rewind;          // Rewinding the session to before the turn
+  std::vector<Duration> rewound_ttft;    // Appending the turn again after the rewind and generating its first token
+  size_t context_tokens{};               // Tokens before the turn
+};
+
+// Simulates a chat session: every turn appends user tokens to the generator and generates the answer, as continuous
+// decoding allows, and is compared with what a client without it would do, prefilling the conversation again
+void RunMultiTurnBenchmark(const benchmark::Options& opts) {
+  auto model = OgaModel::Create(opts.model_path.c_str());
+  auto tokenizer = OgaTokenizer::Create(*model);
+
+  auto turn_sequences = OgaSequences::Create();
+  tokenizer->Encode(GeneratePrompt(opts.num_prompt_tokens, *model, *tokenizer).c_str(), *turn_sequences);
+  const std::vector<int32_t> turn_tokens(turn_sequences->SequenceData(0),
+                                         turn_sequences->SequenceData(0) + turn_sequences->SequenceCount(0));
+
+  const size_t num_tokens = opts.num_turns * (turn_tokens.size() + opts.num_tokens_to_generate);
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", static_cast<double>(num_tokens));
+  params->SetSearchOption("min_length", static_cast<double>(num_tokens));
+
+  auto generate_answer = [&](OgaGenerator& generator) {
+    for (size_t i = 1; i < opts.num_tokens_to_generate; ++i) {
+      generator.GenerateNextToken();
+    }
+  };
+
+  std::vector<TurnTimings> turns(opts.num_turns);
+  auto run_session = [&](bool measure) {
+    auto generator = OgaGenerator::Create(*model, *params);
+    for (auto& turn : turns) {
+      const size_t context_tokens = generator->GetSequenceCount(0);
+      turn.context_tokens = context_tokens;
+
+      {
+        const auto start = Clock::now();
+        generator->AppendTokens(turn_tokens.data(), turn_tokens.size());
+        generator->GenerateNextToken();
+        if (measure) turn.continued_ttft.push_back(Clock::now() - start);
+      }
+      generate_answer(*generator);
+
+      // A client without continuous decoding sends the whole conversation again
+      {
+        const std::vector<int32_t> conversation(generator->GetSequenceData(0),
+                                                generator->GetSequenceData(0) + context_tokens + turn_tokens.size());
+        auto prefill_generator = OgaGenerator::Create(*model, *params);
+        const auto start = Clock::now();
+        prefill_generator->AppendTokens(conversation.data(), conversation.size());
+        prefill_generator->GenerateNextToken();
+        if (measure) turn.prefilled_ttft.push_back(Clock::now() - start);
+      }
+
+      // Regenerating the turn, e.g. after the user edited it, drops it from the key-value cache
+      {
+        auto start = Clock::now();
+        generator->RewindTo(context_tokens);
+        if (measure) turn.rewind.push_back(Clock::now() - start);
+
+        start = Clock::now();
+        generator->AppendTokens(turn_tokens.data(), turn_tokens.size());
+        generator->GenerateNextToken();
+        if (measure) turn.rewound_ttft.push_back(Clock::now() - start);
+      }
+      generate_answer(*generator);
+    }
+  };
+
+  if (opts.verbose) std::cout << "Running warmup iterations (" << opts.num_warmup_iterations << ")...\n";
+  for (size_t i = 0; i < opts.num_warmup_iterations; ++i) {
+    run_session(false);
+  }
+
+  if (opts.verbose) std::cout << "Running iterations (" << opts.num_iterations << ")...\n";
+  for (size_t i = 0; i < opts.num_iterations; ++i) {
+    run_session(true);
+  }
+
+  using MillisecondsFp = std::chrono::duration<float, std::chrono::milliseconds::period>;
+  std::cout << "Turns: " << opts.num_turns
+            << ", user tokens per turn: " << turn_tokens.size()
+            << ", generated tokens per turn: " << opts.num_tokens_to_generate
+            << "\n"
+            << "Time to first token per turn (avg ms; continued, prefilled, saved %, rewind, continued after rewind):";
+  std::vector<Duration> continued_ttft, prefilled_ttft;
+  for (size_t i = 0; i < turns.size(); ++i) {
+    const auto& turn = turns[i];
+    const float continued = MillisecondsFp{ComputeStats(turn.continued_ttft).average}.count();
+    const float prefilled = MillisecondsFp{ComputeStats(turn.prefilled_ttft).average}.count();
+    std::cout << "\n\tturn " << i + 1 << " (" << turn.context_tokens << " context tokens): "
+              << continued << ", " << prefilled << ", "
+              << (prefilled > 0 ? 100 * (1 - continued / prefilled) : 0) << "%, "
+              << MillisecondsFp{ComputeStats(turn.rewind).average}.count() << ", "
+              << MillisecondsFp{ComputeStats(turn.rewound_ttft).average}.count();
+    continued_ttft.insert(continued_ttft.end(), turn.continued_ttft.begin(), turn.continued_ttft.end());
+    prefilled_ttft.insert(prefilled_ttft.end(), turn.prefilled_ttft.begin(), turn.prefilled_ttft.end());
+  }
+  std::cout << "\n";
+
+  WriteLatencyStats("Time to first token, continued session", ComputeStats(continued_ttft));
+  WriteLatencyStats("Time to first token, prefilled conversation", ComputeStats(prefilled_ttft));
+
+  std::cout << "Peak working set size (bytes): " << benchmark::utils::GetPeakWorkingSetSizeInBytes() << "\n";
+}
+
+// A setting that the tuner tries, value is the JSON value it is set to (provider options are strings)
+struct TuningSetting {
+  enum class Section { SessionOption, ProviderOption, SearchOption } section;
+  std::string name;
+  std::string value;
+};
+
+// The candidates of one setting, tuned one after another. An empty candidate keeps the value of genai_config.json.
+struct TuningDimension {
+  std::vector<std::optional<TuningSetting>> candidates;
+};
+
+// The first execution provider of the decoder's session options in genai_config.json, or "" for the CPU
+std::string GetConfigProvider(const std::string& model_path) {
+  const auto config_path = std::filesystem::path{model_path} / "genai_config.json";
+  std::ifstream file{config_path};
+  if (!file) {
+    throw std::runtime_error("Failed to open " + config_path.string());
+  }
+  const std::string config{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+  const std::string_view provider_options = std::string_view{config}.substr(std::min(config.find("\"provider_options\""), config.size()));
+  std::string provider;
+  size_t first = std::string_view::npos;
+  for (const char* name : {"cuda", "dml", "rocm", "qnn", "webgpu", "openvino"}) {
+    const auto position = provider_options.find(std::string{"\""}.append(name).append("\""));
+    if (position < first) {
+      first = position;
+      provider = name;
+    }
+  }
+  return provider;
+}
+
+std::string MakeConfigOverlay(const std::string& provider, const std::vector<TuningSetting>& settings) {
+  auto join = [&](TuningSetting::Section section, bool quote) {
+    std::string members;
+    for (const auto& setting : settings) {
+      if (setting.section != section) {
+        continue;
+      }
+      if (!members.empty()) {
+        members += ", ";
+      }
+      members += "\"" + setting.name + "\": " + (quote ? "\"" + setting.value + "\"" : setting.value);
+    }
+    return members;
+  };
+
+  auto session_options = join(TuningSetting::Section::SessionOption, false);
+  const auto provider_options = join(TuningSetting::Section::ProviderOption, true);
+  if (!provider_options.empty()) {
+    session_options += std::string{session_options.empty() ? "" : ", "} + "\"provider_options\": [{\"" + provider + "\": {" + provider_options + "}}]";
+  }
+  const auto search = join(TuningSetting::Section::SearchOption, false);
+
+  std::string overlay = "{";
+  if (!session_options.empty()) {
+    overlay += "\"model\": {\"decoder\": {\"session_options\": {" + session_options + "}}}";
+  }
+  if (!search.empty()) {
+    overlay += std::string{session_options.empty() ? "" : ", "} + "\"search\": {" + search + "}";
+  }
+  return overlay + "}";
+}
+
+// The sum of the average generation times over every combination of the batch sizes, prompt and generation lengths
+double MeasureConfigOverlay(const benchmark::Options& opts, const std::string& overlay) {
+  auto config = OgaConfig::Create(opts.model_path.c_str());
+  config->Overlay(overlay.c_str());
+  auto model = OgaModel::Create(*config);
+  auto tokenizer = OgaTokenizer::Create(*model);
+
+  double seconds{};
+  for (const auto num_prompt_tokens : opts.prompt_lengths) {
+    auto prompt_tokens = OgaSequences::Create();
+    tokenizer->Encode(GeneratePrompt(num_prompt_tokens, *model, *tokenizer).c_str(), *prompt_tokens);
+    for (const auto batch_size : opts.batch_sizes) {
+      auto prompt_sequences = OgaSequences::Create();
+      for (size_t i = 0; i < batch_size; ++i) {
+        prompt_sequences->Append(prompt_tokens->SequenceData(0), prompt_tokens->SequenceCount(0));
+      }
+      for (const auto num_tokens_to_generate : opts.generation_lengths) {
+        const auto result = MeasureGeneration(opts, *model, *tokenizer, *prompt_sequences, num_tokens_to_generate);
+        seconds += std::chrono::duration<double>{result.e2e_gen_stats.average}.count();
+      }
+    }
+  }
+  return seconds;
+}
+
+// Tunes the settings one at a time: every candidate of a setting is measured with the best values found for the
+// settings before it, and the fastest is kept. Candidates that fail (like graph capture without a shared buffer) are
+// skipped. The fastest overlay is written to opts.tune_path.
+void RunTuning(const benchmark::Options& opts) {
+  using Section = TuningSetting::Section;
+  const auto provider = GetConfigProvider(opts.model_path);
+  const size_t num_threads = std::thread::hardware_concurrency();
+
+  std::vector<TuningDimension> dimensions;
+  auto& threads = dimensions.emplace_back().candidates;
+  threads.emplace_back();
+  for (const size_t count : {num_threads / 2, num_threads}) {
+    if (count > 0 && (threads.size() == 1 || threads.back()->value != std::to_string(count))) {
+      threads.emplace_back(TuningSetting{Section::SessionOption, "intra_op_num_threads", std::to_string(count)});
+    }
+  }
+  dimensions.push_back({{std::nullopt, TuningSetting{Section::SessionOption, "graph_optimization_level", "\"ORT_ENABLE_EXTENDED\""}}});
+  dimensions.push_back({{TuningSetting{Section::SearchOption, "past_present_share_buffer", "false"},
+                         TuningSetting{Section::SearchOption, "past_present_share_buffer", "true"}}});
+  if (provider == "cuda") {
+    dimensions.push_back({{TuningSetting{Section::ProviderOption, "enable_cuda_graph", "0"},
+                           TuningSetting{Section::ProviderOption, "enable_cuda_graph", "1"}}});
+  } else if (provider == "dml") {
+    dimensions.push_back({{TuningSetting{Section::ProviderOption, "enable_graph_capture", "0"},
+                           TuningSetting{Section::ProviderOption, "enable_graph_capture", "1"}}});
+  }
+
+  std::cout << "Tuning " << (provider.empty() ? "cpu" : provider) << " session options (overlay, seconds)\n";
+  std::unordered_map<std::string, double> measured;  // By overlay, so the best settings aren't measured again
+  std::vector<TuningSetting> best;
+  double best_seconds = std::numeric_limits<double>::infinity();
+  for (const auto& dimension : dimensions) {
+    std::optional<TuningSetting> best_candidate;
+    for (const auto& candidate : dimension.candidates) {
+      auto settings = best;
+      if (candidate) {
+        settings.push_back(*candidate);
+      }
+      const auto overlay = MakeConfigOverlay(provider, settings);
+      auto it = measured.find(overlay);
+      if (it == measured.end()) {
+        double seconds = std::numeric_limits<double>::infinity();
+        try {
+          seconds = MeasureConfigOverlay(opts, overlay);
+          std::cout << overlay << ", " << seconds << "\n";
+        } catch (const std::exception& e) {
+          std::cout << overlay << ", failed: " << e.what() << "\n";
+        }
+        it = measured.emplace(overlay, seconds).first;
+      }
+      if (it->second < best_seconds) {
+        best_seconds = it->second;
+        best_candidate = candidate;
+      }
+    }
+    if (best_candidate) {
+      best.push_back(*best_candidate);
+    }
+  }
+
+  if (best_seconds == std::numeric_limits<double>::infinity()) {
+    throw std::runtime_error("Every tuning candidate failed.");
+  }
+
+  const auto overlay = MakeConfigOverlay(provider, best);
+  std::cout << "Fastest: " << overlay << ", " << best_seconds << " seconds\n";
+  std::ofstream file{opts.tune_path};
+  if (!file) {
+    throw std::runtime_error("Failed to open " + opts.tune_path);
+  }
+  file << overlay << "\n";
+}
+
+// The phases of one model load in the order they ended, each with the time since the end of the phase before it
+using LoadPhases = std::vector<std::pair<std::string, Duration>>;
+
+// Creates the model (through OgaCreateModelAsync, so every session is created up front), its tokenizer and the adapter
+// if given, and generates the first token of a prompt_length prompt. The phases of the model creation are its progress
+// steps: the session options and every session. Sessions created in parallel overlap, so each one is measured from the
+// end of the step before it.
+LoadPhases MeasureModelLoad(const benchmark::Options& opts) {
+  struct ModelLoad {
+    std::mutex mutex;
+    std::condition_variable completed;
+    bool done{};
+    OgaResult* result{};
+    OgaModel* model{};
+    LoadPhases phases;
+    Clock::time_point phase_start{Clock::now()};
+
+    void EndPhase(std::string name) {  // Under mutex while the model is created on the library's thread
+      const auto now = Clock::now();
+      phases.emplace_back(std::move(name), now - phase_start);
+      phase_start = now;
+    }
+  } load;
+
+  OgaConfig::Create(opts.model_path.c_str());
+  load.EndPhase("Config parse");
+
+  auto on_progress = [](const char* step, void* user_data) {
+    auto& load = *static_cast<ModelLoad*>(user_data);
+    std::scoped_lock lock{load.mutex};
+    load.EndPhase(step);
+  };
+  auto on_completion = [](OgaResult* result, OgaModel* model, void* user_data) {
+    auto& load = *static_cast<ModelLoad*>(user_data);
+    std::scoped_lock lock{load.mutex};
+    load.result = result;
+    load.model = model;
+    load.done = true;
+    load.completed.notify_one();
+  };
+  OgaCheckResult(OgaCreateModelAsync(opts.model_path.c_str(), nullptr, on_progress, on_completion, &load));
   {
-    std::cout << "Batch size: " << opts.batch_size
-              << ", prompt tokens: " << num_prompt_tokens
-              << ", tokens to generate: " << opts.num_tokens_to_generate
-              << "\n";
+    std::unique_lock lock{load.mutex};
+    load.completed.wait(lock, [&] { return load.done; });
+  }
+  OgaCheckResult(load.result);
+  std::unique_ptr<OgaModel> model{load.model};
+  load.EndPhase("Model creation (rest)");
+
+  auto tokenizer = OgaTokenizer::Create(*model);
+  load.EndPhase("Tokenizer load");
+
+  // A prompt of prompt_length copies of one token, without running the model to make it up like GeneratePrompt does
+  auto base_tokens = OgaSequences::Create();
+  tokenizer->Encode("A", *base_tokens);
+  const std::vector<int32_t> prompt(opts.num_prompt_tokens, base_tokens->SequenceData(0)[base_tokens->SequenceCount(0) - 1]);
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", static_cast<double>(opts.num_prompt_tokens + 1));
+  load.phase_start = Clock::now();
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  load.EndPhase("Generator creation");
+
+  std::unique_ptr<OgaAdapters> adapters;
+  if (!opts.adapter_path.empty()) {
+    adapters = OgaAdapters::Create(*model);
+    adapters->LoadAdapter(opts.adapter_path.c_str(), "cold_start");
+    generator->SetActiveAdapter(*adapters, "cold_start");  // Waits for the load
+    load.EndPhase("Adapter load");
+  }
 
-    const auto e2e_gen_stats = ComputeStats(e2e_gen_times);
-    const auto prompt_processing_stats = ComputeStats(prompt_processing_times);
-    const auto token_gen_stats = ComputeStats(token_gen_times);
-    const auto sampling_stats = ComputeStats(sampling_times);
+  generator->AppendTokens(prompt.data(), prompt.size());
+  generator->GenerateNextToken();
+  load.EndPhase("First token");
+  return load.phases;
+}
 
-    WritePerTokenStats("Prompt processing (time to first token)",
-                       prompt_processing_stats, opts.batch_size * num_prompt_tokens);
-    WritePerTokenStats("Token generation", token_gen_stats, opts.batch_size);
-    WritePerTokenStats("Token sampling", sampling_stats, opts.batch_size);
-    WriteE2EStats("E2E generation (entire generation loop)", e2e_gen_stats);
+// The model directory's files and the adapter, without their cached pages
+size_t EvictModelFiles(const benchmark::Options& opts) {
+  size_t evicted = 0;
+  for (const auto& entry : std::filesystem::recursive_directory_iterator{opts.model_path}) {
+    if (entry.is_regular_file() && benchmark::utils::EvictFileFromPageCache(entry.path().string())) {
+      evicted++;
+    }
+  }
+  if (!opts.adapter_path.empty() && benchmark::utils::EvictFileFromPageCache(opts.adapter_path)) {
+    evicted++;
+  }
+  return evicted;
+}
 
-    std::cout << "Peak working set size (bytes): " << benchmark::utils::GetPeakWorkingSetSizeInBytes() << "\n";
+// Measures the model load 'repetitions' times with the model files evicted from the page cache before each load, then
+// as many times with them cached. The model of a load is released before the next, so every load creates its sessions.
+void RunColdStartBenchmark(const benchmark::Options& opts) {
+  for (const bool cold : {true, false}) {
+    std::vector<std::string> names;  // In the order of the first load, pipeline sessions created in parallel can reorder
+    std::unordered_map<std::string, std::vector<Duration>> measurements;
+    std::vector<Duration> totals;
+    for (size_t i = 0; i < opts.num_iterations; ++i) {
+      if (cold && EvictModelFiles(opts) == 0) {
+        throw std::runtime_error("The model files can't be dropped from the page cache on this platform.");
+      }
+      Duration total{};
+      for (auto& [name, duration] : MeasureModelLoad(opts)) {
+        if (measurements.find(name) == measurements.end()) {
+          names.push_back(name);
+        }
+        measurements[name].push_back(duration);
+        total += duration;
+      }
+      totals.push_back(total);
+    }
+
+    std::cout << (cold ? "Cold start (model files not cached)" : "Warm start (model files cached)") << "\n";
+    for (const auto& name : names) {
+      WriteE2EStats(name, ComputeStats(measurements[name]));
+    }
+    WriteE2EStats("Total (to the first token)", ComputeStats(totals));
+  }
+}
+
+// Measures the tokenizer on batches of every batch size, cycling through the prompts. The single string paths run on
+// this thread, the batch paths on the thread pool of the tokenizer.
+void RunTokenizerBenchmark(const benchmark::Options& opts) {
+  auto model = OgaModel::Create(opts.model_path.c_str());
+  auto tokenizer = OgaTokenizer::Create(*model);
+
+  std::vector<std::string> prompts;
+  if (!opts.prompts_path.empty()) {
+    prompts = LoadPrompts(opts.prompts_path);
+  } else {
+    for (size_t prompt_length : opts.prompt_lengths) {
+      prompts.push_back(GeneratePrompt(prompt_length, *model, *tokenizer));
+    }
+  }
+  if (prompts.empty()) {
+    throw std::runtime_error("No prompts to tokenize.");
+  }
+
+  for (size_t batch_size : opts.batch_sizes) {
+    std::vector<const char*> batch(batch_size);
+    size_t bytes = 0;
+    auto sequences = OgaSequences::Create();
+    for (size_t i = 0; i < batch_size; ++i) {
+      batch[i] = prompts[i % prompts.size()].c_str();
+      bytes += prompts[i % prompts.size()].size();
+      tokenizer->Encode(batch[i], *sequences);
+    }
+    size_t tokens = 0;
+    for (size_t i = 0; i < batch_size; ++i) {
+      tokens += sequences->SequenceCount(i);
+    }
+    auto padded = tokenizer->EncodeBatch(batch.data(), batch.size());
+
+    auto measure = [&opts](auto&& run) {
+      for (size_t i = 0; i < opts.num_warmup_iterations; ++i) {
+        run();
+      }
+      std::vector<Duration> measurements;
+      for (size_t i = 0; i < opts.num_iterations; ++i) {
+        Timing timing{measurements};
+        run();
+      }
+      return ComputeStats(measurements);
+    };
+
+    std::cout << "Batch size " << batch_size << ", " << bytes << " bytes, " << tokens << " tokens\n";
+    WriteThroughputStats("Encode (single-threaded)", measure([&] {
+                           auto encoded = OgaSequences::Create();
+                           for (const char* text : batch) {
+                             tokenizer->Encode(text, *encoded);
+                           }
+                         }),
+                         bytes, tokens);
+    WriteThroughputStats("EncodeBatch (thread pool)", measure([&] {
+                           tokenizer->EncodeBatch(batch.data(), batch.size());
+                         }),
+                         bytes, tokens);
+    WriteThroughputStats("Decode (single-threaded)", measure([&] {
+                           for (size_t i = 0; i < batch_size; ++i) {
+                             tokenizer->Decode(sequences->SequenceData(i), sequences->SequenceCount(i));
+                           }
+                         }),
+                         bytes, tokens);
+    // Decodes the padded batch, the padding tokens are decoded too but not counted
+    WriteThroughputStats("DecodeBatch (thread pool)", measure([&] {
+                           tokenizer->DecodeBatch(*padded);
+                         }),
+                         bytes, tokens);
+    WriteThroughputStats("TokenizerStream decode (single-threaded)", measure([&] {
+                           for (size_t i = 0; i < batch_size; ++i) {
+                             auto stream = OgaTokenizerStream::Create(*tokenizer);
+                             const auto* sequence = sequences->SequenceData(i);
+                             for (size_t j = 0; j < sequences->SequenceCount(i); ++j) {
+                               stream->Decode(sequence[j]);
+                             }
+                           }
+                         }),
+                         bytes, tokens);
+  }
+}
+
+// The memory of one generator of the matrix, see OgaGenerator_GetMemoryUsage and OgaModel_GetMemoryUsage
+struct MemoryMeasurement {
+  std::string mode;
+  size_t batch_size{};
+  size_t prompt_length{};
+  size_t generation_length{};
+  size_t host_model_bytes{};     // Working set growth of creating the model: host weights and sessions
+  size_t host_rss_bytes{};       // Working set of the process with the generator at its max_length
+  size_t kv_cache_bytes{};       // At max_length, for a paged cache the blocks the generator holds
+  size_t logits_bytes{};
+  size_t transient_bytes{};      // The generator's peak beyond its key-value cache and logits at max_length
+  size_t generator_peak_bytes{};
+  size_t kv_pool_bytes{};        // The paged key-value cache pool of the model
+  size_t device_cached_bytes{};  // Freed blocks the device arena and pools keep after the generator's runs
+};
+
+// The KV cache modes of the matrix as config overlays, the empty one keeps genai_config.json. The quantized cache
+// depends on the type of the model's past tensors, so it's the mode of the config of a quantized KV model.
+std::vector<std::pair<std::string, std::string>> GetMemoryModes(const std::string& provider) {
+  using Section = TuningSetting::Section;
+  const TuningSetting share_buffer_off{Section::SearchOption, "past_present_share_buffer", "false"};
+  const TuningSetting share_buffer_on{Section::SearchOption, "past_present_share_buffer", "true"};
+  std::vector<std::pair<std::string, std::string>> modes{
+      {"config", ""},
+      {"share_buffer_off", MakeConfigOverlay(provider, {share_buffer_off})},
+      {"share_buffer_on", MakeConfigOverlay(provider, {share_buffer_on})},
+  };
+  if (provider == "cuda") {
+    modes.emplace_back("graph_capture", MakeConfigOverlay(provider, {share_buffer_on, {Section::ProviderOption, "enable_cuda_graph", "1"}}));
+  } else if (provider == "dml") {
+    modes.emplace_back("graph_capture", MakeConfigOverlay(provider, {share_buffer_on, {Section::ProviderOption, "enable_graph_capture", "1"}}));
+  }
+  modes.emplace_back("paged", R"({"model": {"decoder": {"paged_kv_cache": {}}}})");
+  return modes;
+}
+
+// Generates every combination of the batch sizes, prompt and generation lengths once in every KV cache mode and
+// measures the memory with the generator at its max_length. Modes the model doesn't support are reported and skipped.
+void RunMemoryMatrix(const benchmark::Options& opts) {
+  const auto shape = LoadModelShape(opts.model_path);
+  std::vector<MemoryMeasurement> measurements;
+  for (const auto& [mode, overlay] : GetMemoryModes(GetConfigProvider(opts.model_path))) {
+    try {
+      auto config = OgaConfig::Create(opts.model_path.c_str());
+      if (!overlay.empty()) {
+        config->Overlay(overlay.c_str());
+      }
+      const size_t rss_before_model = benchmark::utils::GetWorkingSetSizeInBytes();
+      auto model = OgaModel::Create(*config);
+      const size_t rss_after_model = benchmark::utils::GetWorkingSetSizeInBytes();
+      auto tokenizer = OgaTokenizer::Create(*model);
+
+      for (const auto prompt_length : opts.prompt_lengths) {
+        auto prompt_tokens = OgaSequences::Create();
+        tokenizer->Encode(GeneratePrompt(prompt_length, *model, *tokenizer).c_str(), *prompt_tokens);
+        for (const auto generation_length : opts.generation_lengths) {
+          for (const auto batch_size : opts.batch_sizes) {
+            model->ReleaseCachedMemory();
+
+            auto prompt_sequences = OgaSequences::Create();
+            for (size_t i = 0; i < batch_size; ++i) {
+              prompt_sequences->Append(prompt_tokens->SequenceData(0), prompt_tokens->SequenceCount(0));
+            }
+            const size_t max_length = prompt_tokens->SequenceCount(0) + generation_length;
+            auto params = OgaGeneratorParams::Create(*model);
+            params->SetSearchOption("max_length", static_cast<double>(max_length));
+            params->SetSearchOption("min_length", static_cast<double>(max_length));
+            auto generator = OgaGenerator::Create(*model, *params);
+            generator->AppendTokenSequences(*prompt_sequences);
+            while (!generator->IsDone()) {
+              generator->GenerateNextToken();
+            }
+
+            const std::string generator_usage{generator->GetMemoryUsage()};
+            const std::string model_usage{model->GetMemoryUsage()};
+            MemoryMeasurement& m = measurements.emplace_back();
+            m.mode = mode;
+            m.batch_size = batch_size;
+            m.prompt_length = prompt_length;
+            m.generation_length = generation_length;
+            m.host_model_bytes = rss_after_model > rss_before_model ? rss_after_model - rss_before_model : 0;
+            m.host_rss_bytes = benchmark::utils::GetWorkingSetSizeInBytes();
+            m.kv_cache_bytes = GetJsonNumber(generator_usage, "kv_cache_bytes");
+            m.logits_bytes = GetJsonNumber(generator_usage, "logits_bytes");
+            m.generator_peak_bytes = GetJsonNumber(generator_usage, "peak_bytes");
+            m.transient_bytes = m.generator_peak_bytes - std::min(m.generator_peak_bytes, m.kv_cache_bytes + m.logits_bytes);
+            m.kv_pool_bytes = GetJsonNumber(model_usage, "paged_kv_cache_pool_bytes");
+            m.device_cached_bytes = GetJsonNumber(model_usage, "device_arena_cached_bytes") + GetJsonNumber(model_usage, "device_pool_cached_bytes");
+          }
+        }
+      }
+    } catch (const std::exception& e) {
+      std::cout << mode << " failed: " << e.what() << "\n";
+    }
+  }
+
+  const std::vector<std::pair<std::string_view, size_t MemoryMeasurement::*>> columns{
+      {"batch_size", &MemoryMeasurement::batch_size},
+      {"prompt_length", &MemoryMeasurement::prompt_length},
+      {"generation_length", &MemoryMeasurement::generation_length},
+      {"host_model_bytes", &MemoryMeasurement::host_model_bytes},
+      {"host_rss_bytes", &MemoryMeasurement::host_rss_bytes},
+      {"kv_cache_bytes", &MemoryMeasurement::kv_cache_bytes},
+      {"logits_bytes", &MemoryMeasurement::logits_bytes},
+      {"transient_bytes", &MemoryMeasurement::transient_bytes},
+      {"generator_peak_bytes", &MemoryMeasurement::generator_peak_bytes},
+      {"kv_pool_bytes", &MemoryMeasurement::kv_pool_bytes},
+      {"device_cached_bytes", &MemoryMeasurement::device_cached_bytes},
+  };
+  auto write_table = [&](std::ostream& stream, std::string_view separator) {
+    stream << "mode" << separator << "weights_bytes";
+    for (const auto& [name, member] : columns) {
+      stream << separator << name;
+    }
+    stream << "\n";
+    for (const auto& m : measurements) {
+      stream << m.mode << separator << shape.weight_bytes;
+      for (const auto& [name, member] : columns) {
+        stream << separator << m.*member;
+      }
+      stream << "\n";
+    }
+  };
+
+  std::cout << "Memory (bytes, weights are the model files, see OgaGenerator_GetMemoryUsage for the rest):\n";
+  write_table(std::cout, "\t");
+  if (!opts.csv_path.empty()) {
+    std::ofstream file{opts.csv_path};
+    if (!file) {
+      throw std::runtime_error("Failed to open CSV output file: " + opts.csv_path);
+    }
+    write_table(file, ",");
+  }
+  if (measurements.empty()) {
+    throw std::runtime_error("Every KV cache mode failed.");
   }
 }
 
@@ -239,7 +1365,23 @@ int main(int argc, char** argv) {
   OgaHandle handle;
   try {
     const auto opts = benchmark::ParseOptionsFromCommandLine(argc, argv);
-    RunBenchmark(opts);
+    if (opts.memory_matrix) {
+      RunMemoryMatrix(opts);
+    } else if (opts.tokenizer_benchmark) {
+      RunTokenizerBenchmark(opts);
+    } else if (opts.cold_start) {
+      RunColdStartBenchmark(opts);
+    } else if (!opts.tune_path.empty()) {
+      RunTuning(opts);
+    } else if (!opts.replay_path.empty()) {
+      benchmark::RunReplayBenchmark(opts);
+    } else if (opts.concurrency > 0) {
+      RunThroughputBenchmark(opts);
+    } else if (opts.num_turns > 0) {
+      RunMultiTurnBenchmark(opts);
+    } else {
+      RunBenchmark(opts);
+    }
     return 0;
   } catch (const std::exception& e) {
     std::cerr << "Exception: " << e.what() << "\n";
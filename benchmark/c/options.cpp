@@ -3,6 +3,7 @@
 
 #include "options.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <charconv>
 #include <iostream>
@@ -24,16 +25,67 @@ namespace {
     << "  Options:\n"
     << "    -i,--input_folder <path>\n"
     << "      Path to the ONNX model directory to benchmark, compatible with onnxruntime-genai.\n"
-    << "    -b,--batch_size <number>\n"
+    << "    -b,--batch_size <number>[,<number>...]\n"
     << "      Number of sequences to generate in parallel. Default: " << defaults.batch_size << "\n"
-    << "    -l,--prompt_length <number>\n"
+    << "    -l,--prompt_length <number>[,<number>...]\n"
     << "      Number of tokens in the prompt. Default: " << defaults.num_prompt_tokens << "\n"
-    << "    -g,--generation_length <number>\n"
+    << "    -g,--generation_length <number>[,<number>...]\n"
     << "      Number of tokens to generate. Default: " << defaults.num_tokens_to_generate << "\n"
+    << "      With lists of batch sizes, prompt or generation lengths, every combination is benchmarked.\n"
     << "    -r,--repetitions <number>\n"
     << "      Number of times to repeat the benchmark. Default: " << defaults.num_iterations << "\n"
     << "    -w,--warmup <number>\n"
     << "      Number of warmup runs before benchmarking. Default: " << defaults.num_warmup_iterations << "\n"
+    << "    -c,--concurrency <number>\n"
+    << "      Run the throughput benchmark with this many concurrent generators instead of a single one.\n"
+    << "    --peak_bandwidth <number>\n"
+    << "      Peak memory bandwidth of the device in GB/s, to report the achieved bandwidth as a fraction of it.\n"
+    << "    --peak_tflops <number>\n"
+    << "      Peak TFLOP/s of the device for the model's data type, to report the achieved FLOP/s as a fraction of it.\n"
+    << "    --output_csv <path>\n"
+    << "      Write the results of every combination to this CSV file.\n"
+    << "    --output_json <path>\n"
+    << "      Write the results of every combination to this JSON file.\n"
+    << "    -t,--turns <number>\n"
+    << "      Run the multi-turn benchmark: a chat session of this many turns of prompt_length user tokens and\n"
+    << "      generation_length generated tokens, continued with every turn instead of prefilled again.\n"
+    << "    --replay <path>\n"
+    << "      Replay the requests of a recorded trace (JSON Lines) at their arrival times, on up to concurrency threads.\n"
+    << "    --tune <path>\n"
+    << "      Measure candidate session, provider and search options on the batch sizes, prompt and generation lengths,\n"
+    << "      and write the fastest to this file as a config overlay.\n"
+    << "    --cold_start\n"
+    << "      Measure the phases of the model creation up to the first token, repetitions times with the model files\n"
+    << "      dropped from the page cache (cold) and as many times with them cached (warm).\n"
+    << "    --tokenizer\n"
+    << "      Measure the encoding and decoding throughput of the model's tokenizer on batches of batch_size prompts,\n"
+    << "      from the prompts file or generated of every prompt length.\n"
+    << "    --memory_matrix\n"
+    << "      Report the memory of every combination of the KV cache modes, batch sizes, prompt and generation lengths,\n"
+    << "      split into weights, KV cache, logits and transient buffers. Written to the CSV file if given.\n"
+    << "  Cold start options:\n"
+    << "    --adapter <path>\n"
+    << "      Also load this adapter and generate the first token with it.\n"
+    << "  Replay options:\n"
+    << "    --replay_speed <number>\n"
+    << "      Divide the arrival times of the trace by this factor. Default: " << defaults.replay_speed << "\n"
+    << "    --slo_ttft <number>\n"
+    << "      Time to first token SLO in milliseconds, measured from the arrival of the request.\n"
+    << "    --slo_tpot <number>\n"
+    << "      Time per output token SLO in milliseconds, the average over the tokens after the first.\n"
+    << "  Throughput benchmark options:\n"
+    << "    -n,--num_requests <number>\n"
+    << "      Number of requests to generate. Default: " << defaults.num_requests << "\n"
+    << "    --max_prompt_length <number>\n"
+    << "      Draw the prompt lengths uniformly from [prompt_length, max_prompt_length]. Default: prompt_length\n"
+    << "    --max_generation_length <number>\n"
+    << "      Draw the generation lengths uniformly from [generation_length, max_generation_length]. Default: generation_length\n"
+    << "    --prompts_file <path>\n"
+    << "      JSON object of prompts to draw from instead of generated ones, like benchmark/python/prompts.json.\n"
+    << "    --seed <number>\n"
+    << "      Seed of the random lengths and prompts. Default: " << defaults.seed << "\n"
+    << "    --memory_sample_interval <number>\n"
+    << "      Milliseconds between the samples of the memory usage. Default: " << defaults.memory_sample_interval_ms << "\n"
     << "    -v,--verbose\n"
     << "      Show more informational output.\n"
     << "    -h,--help\n"
@@ -54,10 +106,103 @@ T ParseNumber(std::string_view s) {
   return n;
 }
 
+template <typename T>
+std::vector<T> ParseNumberList(std::string_view s) {
+  std::vector<T> numbers;
+  for (size_t begin = 0; begin <= s.size();) {
+    const size_t end = std::min(s.find(',', begin), s.size());
+    numbers.push_back(ParseNumber<T>(s.substr(begin, end - begin)));
+    begin = end + 1;
+  }
+  return numbers;
+}
+
+double ParseDouble(std::string_view s) {
+  size_t length{};
+  double n{};
+  try {
+    n = std::stod(std::string{s}, &length);
+  } catch (const std::exception&) {
+  }
+  if (length == 0 || length != s.size()) {
+    throw std::runtime_error(std::string{"Failed to parse option value as number: "}.append(s));
+  }
+  return n;
+}
+
 void VerifyOptions(const Options& opts) {
   if (opts.model_path.empty()) {
     throw std::runtime_error("ONNX model directory path must be provided.");
   }
+  if (opts.tokenizer_benchmark && (opts.cold_start || !opts.tune_path.empty() || !opts.replay_path.empty() || opts.concurrency > 0 || opts.num_turns > 0)) {
+    throw std::runtime_error("The tokenizer benchmark can't be combined with tuning or the other benchmarks.");
+  }
+  if (opts.memory_matrix) {
+    if (opts.tokenizer_benchmark || opts.cold_start || !opts.tune_path.empty() || !opts.replay_path.empty() || opts.concurrency > 0 || opts.num_turns > 0) {
+      throw std::runtime_error("The memory matrix can't be combined with tuning or the other benchmarks.");
+    }
+    if (std::any_of(opts.batch_sizes.begin(), opts.batch_sizes.end(), [](size_t size) { return size < 1; }) ||
+        std::any_of(opts.prompt_lengths.begin(), opts.prompt_lengths.end(), [](size_t length) { return length < 1; }) ||
+        std::any_of(opts.generation_lengths.begin(), opts.generation_lengths.end(), [](size_t length) { return length < 1; })) {
+      throw std::runtime_error("Batch sizes, prompt and generation lengths must be at least 1.");
+    }
+  }
+  if (opts.tokenizer_benchmark) {
+    if (std::any_of(opts.batch_sizes.begin(), opts.batch_sizes.end(), [](size_t size) { return size < 1; })) {
+      throw std::runtime_error("Batch size must be at least 1.");
+    }
+    if (opts.prompts_path.empty() &&
+        std::any_of(opts.prompt_lengths.begin(), opts.prompt_lengths.end(), [](size_t length) { return length < 1; })) {
+      throw std::runtime_error("Prompt length must be at least 1.");
+    }
+  }
+  if (opts.cold_start && (!opts.tune_path.empty() || !opts.replay_path.empty() || opts.concurrency > 0 || opts.num_turns > 0)) {
+    throw std::runtime_error("The cold start benchmark can't be combined with tuning or the replay, throughput or multi-turn benchmarks.");
+  }
+  if (!opts.adapter_path.empty() && !opts.cold_start) {
+    throw std::runtime_error("An adapter is only used by the cold start benchmark.");
+  }
+  if (!opts.tune_path.empty() && (!opts.replay_path.empty() || opts.concurrency > 0 || opts.num_turns > 0)) {
+    throw std::runtime_error("Tuning can't be combined with the replay, throughput or multi-turn benchmarks.");
+  }
+  if (!opts.replay_path.empty()) {
+    if (opts.num_turns > 0) {
+      throw std::runtime_error("The replay and multi-turn benchmarks can't be combined.");
+    }
+    if (opts.replay_speed <= 0) {
+      throw std::runtime_error("Replay speed must be greater than 0.");
+    }
+  } else if (opts.concurrency > 0) {
+    if (opts.batch_sizes.size() > 1 || opts.prompt_lengths.size() > 1 || opts.generation_lengths.size() > 1) {
+      throw std::runtime_error("The throughput benchmark takes a single batch size, prompt and generation length.");
+    }
+    if (opts.num_turns > 0) {
+      throw std::runtime_error("The throughput and multi-turn benchmarks can't be combined.");
+    }
+    if (opts.num_requests < 1) {
+      throw std::runtime_error("Number of requests must be at least 1.");
+    }
+    if (opts.max_prompt_tokens != 0 && opts.max_prompt_tokens < opts.num_prompt_tokens) {
+      throw std::runtime_error("Max prompt length must not be less than the prompt length.");
+    }
+    if (opts.max_tokens_to_generate != 0 && opts.max_tokens_to_generate < opts.num_tokens_to_generate) {
+      throw std::runtime_error("Max generation length must not be less than the generation length.");
+    }
+    if (opts.num_tokens_to_generate < 1) {
+      throw std::runtime_error("Generation length must be at least 1.");
+    }
+  }
+  if (opts.num_turns > 0) {
+    if (opts.batch_sizes.size() > 1 || opts.prompt_lengths.size() > 1 || opts.generation_lengths.size() > 1) {
+      throw std::runtime_error("The multi-turn benchmark takes a single prompt and generation length.");
+    }
+    if (opts.batch_size != 1) {
+      throw std::runtime_error("The multi-turn benchmark runs a single sequence, batch size must be 1.");
+    }
+    if (opts.num_prompt_tokens < 1 || opts.num_tokens_to_generate < 1) {
+      throw std::runtime_error("Prompt and generation length must be at least 1.");
+    }
+  }
 }
 
 }  // namespace
@@ -80,15 +225,60 @@ Options ParseOptionsFromCommandLine(int argc, const char* const* argv) {
       if (arg == "-i" || arg == "--input_folder") {
         opts.model_path = next_arg(i);
       } else if (arg == "-b" || arg == "--batch_size") {
-        opts.batch_size = ParseNumber<size_t>(next_arg(i));
+        opts.batch_sizes = ParseNumberList<size_t>(next_arg(i));
+        opts.batch_size = opts.batch_sizes.front();
       } else if (arg == "-l" || arg == "--prompt_length") {
-        opts.num_prompt_tokens = ParseNumber<size_t>(next_arg(i));
+        opts.prompt_lengths = ParseNumberList<size_t>(next_arg(i));
+        opts.num_prompt_tokens = opts.prompt_lengths.front();
       } else if (arg == "-g" || arg == "--generation_length") {
-        opts.num_tokens_to_generate = ParseNumber<size_t>(next_arg(i));
+        opts.generation_lengths = ParseNumberList<size_t>(next_arg(i));
+        opts.num_tokens_to_generate = opts.generation_lengths.front();
       } else if (arg == "-r" || arg == "--repetitions") {
         opts.num_iterations = ParseNumber<size_t>(next_arg(i));
       } else if (arg == "-w" || arg == "--warmup") {
         opts.num_warmup_iterations = ParseNumber<size_t>(next_arg(i));
+      } else if (arg == "--peak_bandwidth") {
+        opts.peak_bandwidth_gbps = ParseDouble(next_arg(i));
+      } else if (arg == "--peak_tflops") {
+        opts.peak_tflops = ParseDouble(next_arg(i));
+      } else if (arg == "--output_csv") {
+        opts.csv_path = next_arg(i);
+      } else if (arg == "--output_json") {
+        opts.json_path = next_arg(i);
+      } else if (arg == "-c" || arg == "--concurrency") {
+        opts.concurrency = ParseNumber<size_t>(next_arg(i));
+      } else if (arg == "-t" || arg == "--turns") {
+        opts.num_turns = ParseNumber<size_t>(next_arg(i));
+      } else if (arg == "--replay") {
+        opts.replay_path = next_arg(i);
+      } else if (arg == "--tune") {
+        opts.tune_path = next_arg(i);
+      } else if (arg == "--cold_start") {
+        opts.cold_start = true;
+      } else if (arg == "--memory_matrix") {
+        opts.memory_matrix = true;
+      } else if (arg == "--tokenizer") {
+        opts.tokenizer_benchmark = true;
+      } else if (arg == "--adapter") {
+        opts.adapter_path = next_arg(i);
+      } else if (arg == "--replay_speed") {
+        opts.replay_speed = ParseDouble(next_arg(i));
+      } else if (arg == "--slo_ttft") {
+        opts.slo_ttft_ms = ParseDouble(next_arg(i));
+      } else if (arg == "--slo_tpot") {
+        opts.slo_tpot_ms = ParseDouble(next_arg(i));
+      } else if (arg == "-n" || arg == "--num_requests") {
+        opts.num_requests = ParseNumber<size_t>(next_arg(i));
+      } else if (arg == "--max_prompt_length") {
+        opts.max_prompt_tokens = ParseNumber<size_t>(next_arg(i));
+      } else if (arg == "--max_generation_length") {
+        opts.max_tokens_to_generate = ParseNumber<size_t>(next_arg(i));
+      } else if (arg == "--prompts_file") {
+        opts.prompts_path = next_arg(i);
+      } else if (arg == "--seed") {
+        opts.seed = ParseNumber<uint32_t>(next_arg(i));
+      } else if (arg == "--memory_sample_interval") {
+        opts.memory_sample_interval_ms = ParseNumber<size_t>(next_arg(i));
       } else if (arg == "-v" || arg == "--verbose") {
         opts.verbose = true;
       } else if (arg == "-h" || arg == "--help") {
@@ -98,6 +288,16 @@ Options ParseOptionsFromCommandLine(int argc, const char* const* argv) {
       }
     }
 
+    if (opts.batch_sizes.empty()) {
+      opts.batch_sizes = {opts.batch_size};
+    }
+    if (opts.prompt_lengths.empty()) {
+      opts.prompt_lengths = {opts.num_prompt_tokens};
+    }
+    if (opts.generation_lengths.empty()) {
+      opts.generation_lengths = {opts.num_tokens_to_generate};
+    }
+
     VerifyOptions(opts);
 
     return opts;
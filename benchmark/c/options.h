@@ -3,7 +3,9 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace benchmark {
 
@@ -15,6 +17,60 @@ struct Options {
   size_t num_iterations{5};
   size_t num_warmup_iterations{1};
   bool verbose{};
+
+  // Sweep: -b, -l and -g take comma separated lists and every combination is measured. The fields above hold the first
+  // value of each list. The roofline estimates are reported against these peaks of the device, when they are set.
+  std::vector<size_t> batch_sizes;
+  std::vector<size_t> prompt_lengths;
+  std::vector<size_t> generation_lengths;
+  double peak_bandwidth_gbps{};  // GB/s
+  double peak_tflops{};          // TFLOP/s
+  std::string csv_path;
+  std::string json_path;
+
+  // Multi-turn mode, used when num_turns is set: a chat session appends a user turn of num_prompt_tokens and generates
+  // num_tokens_to_generate tokens, num_turns times, and every turn is compared with a fresh generator that prefills the
+  // whole conversation and with rewinding the turn and appending it again.
+  size_t num_turns{};
+
+  // Replay mode, used when replay_path is set: the requests of a recorded trace start at their arrival times (scaled by
+  // 1 / replay_speed) on up to 'concurrency' threads (unlimited if 0) and the latencies are checked against the SLOs.
+  std::string replay_path;  // JSON Lines, see readme.md
+  double replay_speed{1.0};
+  double slo_ttft_ms{};  // Time to first token, measured from the arrival time
+  double slo_tpot_ms{};  // Average time per output token after the first
+
+  // Throughput mode, used when concurrency is set: num_requests generators run on 'concurrency' threads. The prompt and
+  // generation lengths of the requests are drawn uniformly from [num_prompt_tokens, max_prompt_tokens] and
+  // [num_tokens_to_generate, max_tokens_to_generate], or the prompts are drawn from the prompts file.
+  size_t concurrency{};
+  size_t num_requests{32};
+  size_t max_prompt_tokens{};
+  size_t max_tokens_to_generate{};
+  std::string prompts_path;  // JSON object of prompts, like benchmark/python/prompts.json
+  uint32_t seed{};
+  size_t memory_sample_interval_ms{100};
+
+  // Tuning mode, used when tune_path is set: candidate session, provider and search options are measured on every
+  // combination of the batch sizes, prompt and generation lengths, and the fastest are written to tune_path as a JSON
+  // config overlay.
+  std::string tune_path;
+
+  // Cold start mode, used when cold_start is set: the model is created, with its tokenizer and the adapter if given, and
+  // generates its first token num_iterations times with the model files dropped from the page cache, then as many
+  // times with them cached, and the time of every phase of the load is reported.
+  bool cold_start{};
+  std::string adapter_path;
+
+  // Tokenizer mode, used when tokenizer_benchmark is set: batches of every batch size, of the prompts from the prompts
+  // file or of generated prompts of every prompt length, are encoded and decoded one string at a time, as a batch on
+  // the thread pool and one token at a time with a tokenizer stream.
+  bool tokenizer_benchmark{};
+
+  // Memory matrix mode, used when memory_matrix is set: every KV cache mode (the config's, past_present_share_buffer
+  // off and on, graph capture and the paged cache) generates every combination of the batch sizes, prompt and
+  // generation lengths once, and the host and generator memory is reported, split by what it holds.
+  bool memory_matrix{};
 };
 
 Options ParseOptionsFromCommandLine(int argc, const char* const* argv);
@@ -3,9 +3,16 @@
 
 #include "resource_utils.h"
 
+#include <fcntl.h>
 #include <sys/resource.h>
+#include <unistd.h>
+
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#endif
 
 #include <cerrno>
+#include <fstream>
 #include <stdexcept>
 #include <string>
 
@@ -26,4 +33,39 @@ size_t GetPeakWorkingSetSizeInBytes() {
   return static_cast<size_t>(rusage.ru_maxrss) * kBytesPerMaxRssUnit;
 }
 
+size_t GetWorkingSetSizeInBytes() {
+#if defined(__APPLE__)
+  mach_task_basic_info_data_t info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS) {
+    throw std::runtime_error("task_info failed");
+  }
+  return static_cast<size_t>(info.resident_size);
+#else
+  // The second field of statm is the resident set in pages
+  std::ifstream statm{"/proc/self/statm"};
+  size_t size_pages{}, resident_pages{};
+  if (!(statm >> size_pages >> resident_pages)) {
+    throw std::runtime_error("Failed to read /proc/self/statm");
+  }
+  return resident_pages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+bool EvictFileFromPageCache(const std::string& path) {
+#if defined(__APPLE__)
+  // There is no POSIX_FADV_DONTNEED and F_NOCACHE doesn't drop the pages already cached
+  return false;
+#else
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  // Only drops the pages no process has mapped, so the model has to be released first
+  const bool evicted = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+  close(fd);
+  return evicted;
+#endif
+}
+
 }  // namespace benchmark::utils
@@ -0,0 +1,301 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "replay.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "ort_genai.h"
+#include "json.h"
+
+#include "resource_utils.h"
+#include "statistics.h"
+
+namespace benchmark {
+
+namespace {
+
+// One line of the trace:
+// {"arrival_time_ms": 12.5, "prompt_tokens": [1, 2, 3], "output_tokens": 64, "search": {"do_sample": true, "top_k": 50}}
+// The search options are passed to OgaGeneratorParams as is, max_length and min_length are set from the token counts.
+struct TraceRequest {
+  double arrival_time_ms{};
+  std::vector<int32_t> prompt_tokens;
+  size_t output_tokens{};
+  std::vector<std::pair<std::string, double>> number_options;
+  std::vector<std::pair<std::string, bool>> bool_options;
+};
+
+struct TokensElement : JSON::Element {
+  explicit TokensElement(std::vector<int32_t>& v) : v_{v} {}
+
+  void OnValue(std::string_view /*name*/, JSON::Value value) override {
+    v_.push_back(static_cast<int32_t>(JSON::Get<double>(value)));
+  }
+
+ private:
+  std::vector<int32_t>& v_;
+};
+
+struct SearchElement : JSON::Element {
+  explicit SearchElement(TraceRequest& v) : v_{v} {}
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    if (std::holds_alternative<bool>(value))
+      v_.bool_options.emplace_back(name, std::get<bool>(value));
+    else
+      v_.number_options.emplace_back(name, JSON::Get<double>(value));
+  }
+
+ private:
+  TraceRequest& v_;
+};
+
+struct TraceRequestElement : JSON::Element {
+  explicit TraceRequestElement(TraceRequest& v) : v_{v} {}
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    if (name == "arrival_time_ms")
+      v_.arrival_time_ms = JSON::Get<double>(value);
+    else if (name == "output_tokens")
+      v_.output_tokens = static_cast<size_t>(JSON::Get<double>(value));
+    else
+      throw JSON::unknown_value_error{};
+  }
+
+  JSON::Element& OnArray(std::string_view name) override {
+    if (name == "prompt_tokens")
+      return prompt_tokens_;
+    throw JSON::unknown_value_error{};
+  }
+
+  JSON::Element& OnObject(std::string_view name) override {
+    if (name == "search")
+      return search_;
+    throw JSON::unknown_value_error{};
+  }
+
+ private:
+  TraceRequest& v_;
+  TokensElement prompt_tokens_{v_.prompt_tokens};
+  SearchElement search_{v_};
+};
+
+std::vector<TraceRequest> LoadTrace(const std::string& path, uint32_t seed) {
+  std::ifstream file{path};
+  if (!file) {
+    throw std::runtime_error("Failed to open trace file: " + path);
+  }
+
+  std::vector<TraceRequest> requests;
+  std::string line;
+  for (size_t line_number = 1; std::getline(file, line); line_number++) {
+    if (line.find_first_not_of(" \t\r") == std::string::npos) {
+      continue;
+    }
+    auto& request = requests.emplace_back();
+    TraceRequestElement element{request};
+    try {
+      JSON::Parse(element, line);
+    } catch (const std::exception& e) {
+      throw std::runtime_error(path + ":" + std::to_string(line_number) + ": " + e.what());
+    }
+    if (request.prompt_tokens.empty() || request.output_tokens < 1) {
+      throw std::runtime_error(path + ":" + std::to_string(line_number) + ": A request needs prompt_tokens and output_tokens");
+    }
+
+    // Sampled requests without a seed of their own still replay the same tokens every run
+    const bool has_seed = std::any_of(request.number_options.begin(), request.number_options.end(),
+                                      [](const auto& option) { return option.first == "random_seed"; });
+    if (!has_seed) {
+      request.number_options.emplace_back("random_seed", static_cast<double>(seed + requests.size() - 1));
+    }
+  }
+
+  if (requests.empty()) {
+    throw std::runtime_error("No requests found in trace file: " + path);
+  }
+  std::stable_sort(requests.begin(), requests.end(),
+                   [](const auto& a, const auto& b) { return a.arrival_time_ms < b.arrival_time_ms; });
+  return requests;
+}
+
+struct ReplayTimings {
+  Duration queue_delay{};          // From the arrival time to the start of the request
+  Duration time_to_first_token{};  // From the arrival time
+  Duration time_per_output_token{};
+  Duration e2e{};  // From the arrival time
+  size_t num_generated_tokens{};
+};
+
+// Runs the request once its arrival time has come, the latencies include any time it waited for a thread
+ReplayTimings ReplayRequest(const OgaModel& model, const TraceRequest& request, Clock::time_point arrival_time) {
+  std::this_thread::sleep_until(arrival_time);
+
+  const size_t num_tokens = request.prompt_tokens.size() + request.output_tokens;
+  auto params = OgaGeneratorParams::Create(model);
+  for (const auto& [name, value] : request.number_options) {
+    params->SetSearchOption(name.c_str(), value);
+  }
+  for (const auto& [name, value] : request.bool_options) {
+    params->SetSearchOptionBool(name.c_str(), value);
+  }
+  params->SetSearchOption("max_length", static_cast<double>(num_tokens));
+  params->SetSearchOption("min_length", static_cast<double>(num_tokens));
+
+  ReplayTimings timings;
+  timings.queue_delay = Clock::now() - arrival_time;
+
+  auto generator = OgaGenerator::Create(model, *params);
+  generator->AppendTokens(request.prompt_tokens.data(), request.prompt_tokens.size());
+  generator->GenerateNextToken();
+  const auto first_token_time = Clock::now();
+  timings.time_to_first_token = first_token_time - arrival_time;
+  timings.num_generated_tokens = 1;
+
+  while (!generator->IsDone()) {
+    generator->GenerateNextToken();
+    timings.num_generated_tokens++;
+  }
+  const auto end_time = Clock::now();
+  timings.e2e = end_time - arrival_time;
+  if (timings.num_generated_tokens > 1) {
+    timings.time_per_output_token = (end_time - first_token_time) / (timings.num_generated_tokens - 1);
+  }
+  return timings;
+}
+
+void WriteCsv(const std::string& path, const std::vector<TraceRequest>& requests, const std::vector<ReplayTimings>& timings) {
+  std::ofstream file{path};
+  if (!file) {
+    throw std::runtime_error("Failed to open CSV output file: " + path);
+  }
+  using MillisecondsFp = std::chrono::duration<double, std::chrono::milliseconds::period>;
+  file << "arrival_time_ms,prompt_tokens,output_tokens,queue_delay_ms,time_to_first_token_ms,time_per_output_token_ms,e2e_ms\n";
+  for (size_t i = 0; i < requests.size(); ++i) {
+    file << requests[i].arrival_time_ms << ","
+         << requests[i].prompt_tokens.size() << ","
+         << timings[i].num_generated_tokens << ","
+         << MillisecondsFp{timings[i].queue_delay}.count() << ","
+         << MillisecondsFp{timings[i].time_to_first_token}.count() << ","
+         << MillisecondsFp{timings[i].time_per_output_token}.count() << ","
+         << MillisecondsFp{timings[i].e2e}.count() << "\n";
+  }
+}
+
+}  // namespace
+
+void RunReplayBenchmark(const Options& opts) {
+  auto model = OgaModel::Create(opts.model_path.c_str());
+  const auto requests = LoadTrace(opts.replay_path, opts.seed);
+
+  if (opts.verbose) std::cout << "Running warmup iterations (" << opts.num_warmup_iterations << ")...\n";
+  for (size_t i = 0; i < opts.num_warmup_iterations; ++i) {
+    ReplayRequest(*model, requests[i % requests.size()], Clock::now());
+  }
+
+  const size_t num_threads = opts.concurrency > 0 ? std::min(opts.concurrency, requests.size()) : requests.size();
+  if (opts.verbose) std::cout << "Replaying " << requests.size() << " requests on " << num_threads << " threads...\n";
+  std::vector<ReplayTimings> timings(requests.size());
+  std::atomic<size_t> next_request{};
+  std::mutex error_mutex;
+  std::string error;
+
+  // The threads take the requests in arrival order, so a request waits when all of them are busy
+  const auto start = Clock::now();
+  auto get_arrival_time = [&](const TraceRequest& request) {
+    const std::chrono::duration<double, std::milli> arrival{request.arrival_time_ms / opts.replay_speed};
+    return start + std::chrono::duration_cast<Duration>(arrival);
+  };
+  {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < num_threads; ++i) {
+      threads.emplace_back([&] {
+        for (size_t index; (index = next_request++) < requests.size();) {
+          try {
+            timings[index] = ReplayRequest(*model, requests[index], get_arrival_time(requests[index]));
+          } catch (const std::exception& e) {
+            std::scoped_lock lock{error_mutex};
+            error = e.what();
+            next_request = requests.size();  // Let the other threads finish their current request and stop
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+  const auto elapsed = DurationFp{Clock::now() - start};
+
+  if (!error.empty()) {
+    throw std::runtime_error(error);
+  }
+
+  using MillisecondsFp = std::chrono::duration<double, std::chrono::milliseconds::period>;
+  std::vector<Duration> queue_delays, times_to_first_token, times_per_output_token, e2e_times;
+  size_t num_generated_tokens = 0, ttft_attained = 0, tpot_attained = 0, both_attained = 0;
+  for (const auto& request_timings : timings) {
+    queue_delays.push_back(request_timings.queue_delay);
+    times_to_first_token.push_back(request_timings.time_to_first_token);
+    times_per_output_token.push_back(request_timings.time_per_output_token);
+    e2e_times.push_back(request_timings.e2e);
+    num_generated_tokens += request_timings.num_generated_tokens;
+
+    const bool meets_ttft = opts.slo_ttft_ms <= 0 || MillisecondsFp{request_timings.time_to_first_token}.count() <= opts.slo_ttft_ms;
+    const bool meets_tpot = opts.slo_tpot_ms <= 0 || MillisecondsFp{request_timings.time_per_output_token}.count() <= opts.slo_tpot_ms;
+    ttft_attained += meets_ttft;
+    tpot_attained += meets_tpot;
+    both_attained += meets_ttft && meets_tpot;
+  }
+
+  using SecondsFp = std::chrono::duration<float>;
+  const float seconds = SecondsFp{elapsed}.count();
+  const auto percent = [&](size_t count) { return 100.0 * count / requests.size(); };
+  std::cout << "Requests: " << requests.size()
+            << ", threads: " << num_threads
+            << ", replay speed: " << opts.replay_speed
+            << "\n"
+            << "Aggregate throughput:"
+            << "\n\telapsed (s):        " << seconds
+            << "\n\tgenerated tokens/s: " << num_generated_tokens / seconds
+            << "\n\trequests/s:         " << requests.size() / seconds
+            << "\n";
+
+  WriteLatencyStats("Queue delay", ComputeStats(queue_delays));
+  WriteLatencyStats("Time to first token", ComputeStats(times_to_first_token));
+  WriteLatencyStats("Time per output token", ComputeStats(times_per_output_token));
+  WriteLatencyStats("E2E latency", ComputeStats(e2e_times));
+
+  std::cout << "SLO attainment:";
+  if (opts.slo_ttft_ms > 0) {
+    std::cout << "\n\tTTFT <= " << opts.slo_ttft_ms << " ms: " << percent(ttft_attained) << "%";
+  }
+  if (opts.slo_tpot_ms > 0) {
+    std::cout << "\n\tTPOT <= " << opts.slo_tpot_ms << " ms: " << percent(tpot_attained) << "%";
+  }
+  std::cout << "\n\tall SLOs:      " << percent(both_attained) << "%"
+            << "\n\tgoodput (requests/s): " << both_attained / seconds
+            << "\n";
+
+  std::cout << "Peak working set size (bytes): " << benchmark::utils::GetPeakWorkingSetSizeInBytes() << "\n";
+
+  if (!opts.csv_path.empty()) {
+    WriteCsv(opts.csv_path, requests, timings);
+  }
+}
+
+}  // namespace benchmark
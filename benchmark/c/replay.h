@@ -0,0 +1,13 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include "options.h"
+
+namespace benchmark {
+
+// Replays the requests of a recorded trace at their arrival times and reports their latencies and SLO attainment
+void RunReplayBenchmark(const Options& opts);
+
+}  // namespace benchmark
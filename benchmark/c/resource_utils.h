@@ -4,9 +4,16 @@
 #pragma once
 
 #include <cstddef>
+#include <string>
 
 namespace benchmark::utils {
 
 size_t GetPeakWorkingSetSizeInBytes();
 
+// The current resident set of the process, unlike the peak it goes down when memory is released
+size_t GetWorkingSetSizeInBytes();
+
+// Drops the cached pages of the file, so the next read comes from the disk. Returns false if the platform can't.
+bool EvictFileFromPageCache(const std::string& path);
+
 }  // namespace benchmark::utils
@@ -0,0 +1,103 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "statistics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+
+namespace benchmark {
+
+Statistics ComputeStats(const std::vector<Duration>& measurements) {
+  Statistics stats{};
+  if (measurements.empty()) {
+    return stats;
+  }
+
+  stats.n = measurements.size();
+
+  const auto sum = std::accumulate(measurements.begin(), measurements.end(), Duration{0});
+  stats.average = DurationFp{sum} / stats.n;
+
+  std::vector<Duration> sorted = measurements;
+  std::sort(sorted.begin(), sorted.end());
+
+  stats.p50 = sorted[static_cast<size_t>(stats.n * 0.5)];
+  stats.p90 = sorted[static_cast<size_t>(stats.n * 0.9)];
+  stats.p99 = sorted[static_cast<size_t>(stats.n * 0.99)];
+
+  if (stats.n > 1) {
+    const float variance =
+        std::accumulate(
+            measurements.begin(), measurements.end(),
+            0.0f,
+            [mean = stats.average.count()](float accumulator, const Duration& m) -> float {
+              const float distance_from_mean = m.count() - mean;
+              return accumulator + distance_from_mean * distance_from_mean;
+            }) /
+        (stats.n - 1);
+
+    const float stddev = std::sqrt(variance);
+    stats.stddev = DurationFp{stddev};
+  }
+
+  return stats;
+}
+
+void WritePerTokenStats(std::string_view label,
+                        const Statistics& stats,
+                        const size_t tokens_per_measurement) {
+  using MicrosecondsFp = std::chrono::duration<float, std::chrono::microseconds::period>;
+  const auto avg_us = MicrosecondsFp{stats.average};
+  std::cout << label << ":"
+            << "\n\tavg (us):       " << avg_us.count()
+            << "\n\tavg (tokens/s): " << 1.0e6f / avg_us.count() * tokens_per_measurement
+            << "\n\tp50 (us):       " << MicrosecondsFp{stats.p50}.count()
+            << "\n\tstddev (us):    " << MicrosecondsFp{stats.stddev}.count()
+            << "\n\tn:              " << stats.n << " * " << tokens_per_measurement << " token(s)"
+            << "\n";
+}
+
+void WriteE2EStats(std::string_view label,
+                   const Statistics& stats) {
+  using MillisecondsFp = std::chrono::duration<float, std::chrono::milliseconds::period>;
+  std::cout << label << ":"
+            << "\n\tavg (ms):       " << MillisecondsFp{stats.average}.count()
+            << "\n\tp50 (ms):       " << MillisecondsFp{stats.p50}.count()
+            << "\n\tstddev (ms):    " << MillisecondsFp{stats.stddev}.count()
+            << "\n\tn:              " << stats.n
+            << "\n";
+}
+
+void WriteThroughputStats(std::string_view label,
+                          const Statistics& stats,
+                          const size_t bytes_per_measurement,
+                          const size_t tokens_per_measurement) {
+  using MillisecondsFp = std::chrono::duration<float, std::chrono::milliseconds::period>;
+  const auto avg_s = std::chrono::duration<double>{stats.average}.count();
+  std::cout << label << ":"
+            << "\n\tavg (ms):       " << MillisecondsFp{stats.average}.count()
+            << "\n\tavg (MB/s):     " << bytes_per_measurement / 1.0e6 / avg_s
+            << "\n\tavg (tokens/s): " << tokens_per_measurement / avg_s
+            << "\n\tp50 (ms):       " << MillisecondsFp{stats.p50}.count()
+            << "\n\tstddev (ms):    " << MillisecondsFp{stats.stddev}.count()
+            << "\n\tn:              " << stats.n << " * " << bytes_per_measurement << " byte(s), "
+            << tokens_per_measurement << " token(s)"
+            << "\n";
+}
+
+void WriteLatencyStats(std::string_view label,
+                       const Statistics& stats) {
+  using MillisecondsFp = std::chrono::duration<float, std::chrono::milliseconds::period>;
+  std::cout << label << ":"
+            << "\n\tavg (ms):       " << MillisecondsFp{stats.average}.count()
+            << "\n\tp50 (ms):       " << MillisecondsFp{stats.p50}.count()
+            << "\n\tp90 (ms):       " << MillisecondsFp{stats.p90}.count()
+            << "\n\tp99 (ms):       " << MillisecondsFp{stats.p99}.count()
+            << "\n\tn:              " << stats.n
+            << "\n";
+}
+
+}  // namespace benchmark
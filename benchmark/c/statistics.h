@@ -0,0 +1,62 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <chrono>
+#include <string_view>
+#include <vector>
+
+namespace benchmark {
+
+using Clock = std::chrono::steady_clock;
+
+using Duration = Clock::duration;
+using DurationFp = std::chrono::duration<float, Duration::period>;
+
+class Timing {
+ public:
+  Timing(const Timing&) = delete;
+  Timing& operator=(const Timing&) = delete;
+
+  Timing(std::vector<Duration>& measurements)
+      : measurements_{measurements}, start_{Clock::now()} {
+  }
+
+  ~Timing() {
+    const auto measurement = Clock::now() - start_;
+    measurements_.push_back(measurement);
+  }
+
+ private:
+  std::vector<Duration>& measurements_;
+  const Clock::time_point start_;
+};
+
+struct Statistics {
+  DurationFp average{};
+  DurationFp stddev{};
+  DurationFp p50{};
+  DurationFp p90{};
+  DurationFp p99{};
+  size_t n{};
+};
+
+Statistics ComputeStats(const std::vector<Duration>& measurements);
+
+void WritePerTokenStats(std::string_view label,
+                        const Statistics& stats,
+                        size_t tokens_per_measurement);
+
+void WriteE2EStats(std::string_view label,
+                   const Statistics& stats);
+
+void WriteLatencyStats(std::string_view label,
+                       const Statistics& stats);
+
+void WriteThroughputStats(std::string_view label,
+                          const Statistics& stats,
+                          size_t bytes_per_measurement,
+                          size_t tokens_per_measurement);
+
+}  // namespace benchmark
@@ -20,4 +20,23 @@ size_t GetPeakWorkingSetSizeInBytes() {
   return pmc.PeakWorkingSetSize;
 }
 
+size_t GetWorkingSetSizeInBytes() {
+  PROCESS_MEMORY_COUNTERS pmc;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+    throw std::runtime_error("GetProcessMemoryInfo failed with error code " + std::to_string(GetLastError()));
+  }
+
+  return pmc.WorkingSetSize;
+}
+
+bool EvictFileFromPageCache(const std::string& path) {
+  // Opening a file without buffering purges its cached pages, when no other handle or mapping holds the file
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  CloseHandle(file);
+  return true;
+}
+
 }  // namespace benchmark::utils
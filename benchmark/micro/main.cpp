@@ -0,0 +1,297 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// Microbenchmarks of the per token hot paths: softmax, token selection, the beam search scorer, device input updates,
+// the decode step of a tiny model (logits gathering, key-value cache updates and position/attention mask updates) and
+// the handoff of work to a worker thread.
+// Run with --benchmark_filter=<regex> to select benchmarks, see the Google Benchmark documentation for more options.
+
+#include <chrono>
+#include <random>
+#include <thread>
+
+#include <benchmark/benchmark.h>
+
+#include "generators.h"
+#include "models/model.h"
+#include "search.h"
+#include "softmax.h"
+#include "worker_thread.h"
+
+#ifndef MODEL_PATH
+#define MODEL_PATH "../../test/test_models/"
+#endif
+
+namespace {
+
+using Generators::DeviceType;
+
+const std::vector<int64_t> vocab_sizes{32000, 128256, 256000};
+const std::vector<int64_t> batch_sizes{1, 8, 32};
+constexpr int max_length = 64;  // Generators are recreated (outside of the timing) when their sequences are full
+
+std::shared_ptr<Generators::Model> g_model;  // Released before Shutdown in main
+
+const Generators::Model& GetModel() {
+  if (!g_model)
+    g_model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  return *g_model;
+}
+
+// Normally distributed scores, like the logits of a model
+std::vector<float> CreateRandomScores(size_t count) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> distribution{0.0f, 4.0f};
+  std::vector<float> scores(count);
+  for (auto& score : scores)
+    score = distribution(engine);
+  return scores;
+}
+
+void SoftMax(benchmark::State& state) {
+  auto scores = CreateRandomScores(static_cast<size_t>(state.range(0)));
+  for (auto _ : state) {
+    Generators::SoftMax(scores, 1.0f);  // The softmax of probabilities is as much work, so the scores aren't reset
+    benchmark::DoNotOptimize(scores.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void LogSoftMax(benchmark::State& state) {
+  auto scores = CreateRandomScores(static_cast<size_t>(state.range(0)));
+  for (auto _ : state) {
+    Generators::LogSoftMax(scores, 1.0f);
+    benchmark::DoNotOptimize(scores.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(SoftMax)->ArgName("vocab_size")->ArgsProduct({vocab_sizes});
+BENCHMARK(LogSoftMax)->ArgName("vocab_size")->ArgsProduct({vocab_sizes});
+
+enum struct SearchFunction {
+  Greedy,
+  TopK,
+  TopP,
+  TopKTopP,
+  BeamSearch
+};
+
+// Times one token selection from fresh logits of shape [batch_size * num_beams, vocab_size]
+void Search(benchmark::State& state, DeviceType device_type, SearchFunction function) {
+  const int vocab_size = static_cast<int>(state.range(0));
+  const int batch_size = static_cast<int>(state.range(1));
+  const int num_beams = function == SearchFunction::BeamSearch ? 4 : 1;
+
+  // The search only depends on the config's vocab_size, so the tiny model serves any vocabulary
+  Generators::Config config;
+  config.model.vocab_size = vocab_size;
+  auto params = Generators::CreateGeneratorParams(config);
+  params->search.max_length = max_length;
+  params->search.batch_size = batch_size;
+  params->search.num_beams = num_beams;
+  params->p_device = Generators::GetDeviceInterface(device_type);
+
+  const auto scores = CreateRandomScores(static_cast<size_t>(vocab_size) * batch_size * num_beams);
+  auto logits = params->p_device->Allocate<float>(scores.size());
+  std::unique_ptr<Generators::Generator> generator;
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    if (!generator || generator->search_->GetSequenceLength() >= max_length - 1 || generator->search_->IsDone())
+      generator = Generators::CreateGenerator(GetModel(), *params);
+    std::copy(scores.begin(), scores.end(), logits.CpuSpan().begin());  // The search modifies the logits
+    logits.CopyCpuToDevice();
+    generator->search_->SetLogits(logits);
+    params->p_device->Synchronize();
+    state.ResumeTiming();
+
+    auto& search = *generator->search_;
+    switch (function) {
+      case SearchFunction::Greedy:
+      case SearchFunction::BeamSearch:
+        search.SelectTop();
+        break;
+      case SearchFunction::TopK:
+        search.SampleTopK(50, 1.0f);
+        break;
+      case SearchFunction::TopP:
+        search.SampleTopP(0.95f, 1.0f);
+        break;
+      case SearchFunction::TopKTopP:
+        search.SampleTopKTopP(50, 0.95f, 1.0f);
+        break;
+    }
+    params->p_device->Synchronize();
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+
+#define SEARCH_BENCHMARK(device, function)                                                     \
+  BENCHMARK_CAPTURE(Search, device##_##function, DeviceType::device, SearchFunction::function) \
+      ->ArgNames({"vocab_size", "batch_size"})                                                 \
+      ->ArgsProduct({vocab_sizes, batch_sizes})                                                \
+      ->UseRealTime()
+
+SEARCH_BENCHMARK(CPU, Greedy);
+SEARCH_BENCHMARK(CPU, TopK);
+SEARCH_BENCHMARK(CPU, TopP);
+SEARCH_BENCHMARK(CPU, TopKTopP);
+SEARCH_BENCHMARK(CPU, BeamSearch);
+#if USE_CUDA
+SEARCH_BENCHMARK(CUDA, Greedy);
+SEARCH_BENCHMARK(CUDA, TopK);
+SEARCH_BENCHMARK(CUDA, TopP);
+SEARCH_BENCHMARK(CUDA, TopKTopP);
+SEARCH_BENCHMARK(CUDA, BeamSearch);
+#endif
+
+// The scorer alone, with the 2 * num_beams candidates per batch entry that BeamSearch_Cpu::SelectTop hands it
+void BeamSearchScorerProcess(benchmark::State& state) {
+  const int batch_size = static_cast<int>(state.range(0));
+  const int num_beams = static_cast<int>(state.range(1));
+
+  Generators::Config config;
+  config.model.vocab_size = 32000;
+  config.model.eos_token_id = 0;
+  auto params = Generators::CreateGeneratorParams(config);
+  params->search.max_length = max_length;
+  params->search.batch_size = batch_size;
+  params->search.num_beams = num_beams;
+  params->p_device = Generators::GetDeviceInterface(DeviceType::CPU);
+
+  Generators::Sequences sequences{*params};
+  Generators::BeamSearchScorer scorer{*params};
+
+  const size_t candidate_count = static_cast<size_t>(batch_size) * 2 * num_beams;
+  std::mt19937 engine{0};
+  std::uniform_int_distribution<int32_t> token_distribution{1, config.model.vocab_size - 1};  // Never EOS, no beam finishes
+  std::vector<float> next_scores(candidate_count);
+  std::vector<int32_t> next_tokens(candidate_count), next_indices(candidate_count);
+  for (size_t i = 0; i < candidate_count; i++) {
+    next_scores[i] = -static_cast<float>(i % (2 * num_beams));  // Best first within each batch entry
+    next_tokens[i] = token_distribution(engine);
+    next_indices[i] = static_cast<int32_t>(i % (2 * num_beams) % num_beams);
+  }
+
+  for (auto _ : state)
+    scorer.Process(sequences, next_scores, next_tokens, next_indices);
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+
+BENCHMARK(BeamSearchScorerProcess)->ArgNames({"batch_size", "num_beams"})->ArgsProduct({batch_sizes, {4, 8}});
+
+#if USE_CUDA
+// The CUDA kernels behind DefaultPositionInputs::Update and the attention mask update of every decode step
+void CudaPositionInputsUpdate(benchmark::State& state) {
+  const int batch_size = static_cast<int>(state.range(0));
+  const int total_length = 1024;
+  auto& device = *Generators::GetDeviceInterface(DeviceType::CUDA);
+
+  auto position_ids = device.Allocate<int64_t>(batch_size);
+  auto mask = device.Allocate<int64_t>(static_cast<size_t>(batch_size) * total_length);
+  auto next_mask = device.Allocate<int64_t>(static_cast<size_t>(batch_size) * total_length);
+  mask.Zero();
+
+  for (auto _ : state) {
+    device.UpdatePositionIds(position_ids.Span().data(), batch_size, total_length, 1, Ort::TypeToTensorType<int64_t>);
+    device.UpdateAttentionMask(next_mask.Span().data(), mask.Span().data(), batch_size, 1, total_length, total_length, false,
+                               Ort::TypeToTensorType<int64_t>);
+    device.Synchronize();
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+
+BENCHMARK(CudaPositionInputsUpdate)->ArgName("batch_size")->ArgsProduct({batch_sizes})->UseRealTime();
+
+// Moves the highest EOS score to the primary EOS token, done by Logits::Get for models with several EOS tokens
+void CudaHandleEOSArray(benchmark::State& state) {
+  const int vocab_size = static_cast<int>(state.range(0));
+  const int batch_size = static_cast<int>(state.range(1));
+  auto& device = *Generators::GetDeviceInterface(DeviceType::CUDA);
+
+  const auto scores = CreateRandomScores(static_cast<size_t>(vocab_size) * batch_size);
+  auto logits = device.Allocate<float>(scores.size());
+  std::copy(scores.begin(), scores.end(), logits.CpuSpan().begin());
+  logits.CopyCpuToDevice();
+  auto eos_token_ids = device.Allocate<int32_t>(3);
+  std::vector<int32_t> eos_token_ids_cpu{2, 32000 - 1, 32000 - 2};
+  std::copy(eos_token_ids_cpu.begin(), eos_token_ids_cpu.end(), eos_token_ids.CpuSpan().begin());
+  eos_token_ids.CopyCpuToDevice();
+
+  for (auto _ : state) {
+    device.LaunchHandleEOSArray(logits.Span().data(), batch_size, vocab_size, eos_token_ids.Span().data(),
+                                static_cast<int>(eos_token_ids.size()));
+    device.Synchronize();
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+
+BENCHMARK(CudaHandleEOSArray)->ArgNames({"vocab_size", "batch_size"})->ArgsProduct({vocab_sizes, batch_sizes})->UseRealTime();
+#endif
+
+// One GenerateNextToken of the tiny GPT-2 model: besides its (small) session run, this is the time of Logits::Get, the
+// position and attention mask updates and the key-value cache update, which picks the past state of every beam
+// (CombinedKeyValueCache::PickPastState) when num_beams > 1
+void DecodeStep(benchmark::State& state) {
+  const int batch_size = static_cast<int>(state.range(0));
+  const int num_beams = static_cast<int>(state.range(1));
+  const auto& model = GetModel();
+
+  auto params = Generators::CreateGeneratorParams(model);
+  params->search.max_length = max_length;
+  params->search.min_length = max_length;  // Never done early
+  params->search.batch_size = batch_size;
+  params->search.num_beams = num_beams;
+
+  const std::vector<int32_t> prompt(static_cast<size_t>(batch_size) * 8, 1);
+  std::unique_ptr<Generators::Generator> generator;
+
+  for (auto _ : state) {
+    if (!generator || generator->IsDone()) {
+      state.PauseTiming();
+      generator = Generators::CreateGenerator(model, *params);
+      generator->AppendTokens(Generators::cpu_span<const int32_t>{prompt.data(), prompt.size()});
+      state.ResumeTiming();
+    }
+    generator->GenerateNextToken();
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+
+BENCHMARK(DecodeStep)->ArgNames({"batch_size", "num_beams"})->ArgsProduct({{1, 8}, {1, 4}})->UseRealTime();
+
+// The time from enqueueing a work item to it starting, with the worker spinning (work items back to back) or sleeping
+// (a pause longer than its spin before every work item)
+void WorkerThreadEnqueueToExecute(benchmark::State& state) {
+  const auto pause = std::chrono::microseconds(state.range(0));
+  Generators::WorkerThread worker;
+
+  for (auto _ : state) {
+    std::this_thread::sleep_for(pause);
+    std::chrono::steady_clock::time_point started;
+    const auto enqueued = std::chrono::steady_clock::now();
+    worker.Enqueue([&started]() { started = std::chrono::steady_clock::now(); }).get();
+    state.SetIterationTime(std::chrono::duration<double>(started - enqueued).count());
+  }
+}
+
+BENCHMARK(WorkerThreadEnqueueToExecute)->ArgName("pause_us")->Arg(0)->Arg(500)->UseManualTime();
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+  try {
+    benchmark::RunSpecifiedBenchmarks();
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  benchmark::Shutdown();
+  g_model.reset();
+  Generators::Shutdown();
+  return 0;
+}
@@ -15,6 +15,7 @@
 
 import onnxruntime_genai as og
 import os
+import tempfile
 import time
 import argparse
 from tqdm import tqdm
@@ -25,6 +26,8 @@ def save_results(results, filename):
     df = pd.DataFrame(
         results,
         columns=[
+            "Image Count",
+            "Resolution",
             "Tokens Generated",
             "Max Length",
             "Processing Latency (ms)",
@@ -35,20 +38,26 @@ def save_results(results, filename):
             "Sampling Latency (ms)",
             "Wall Clock Throughput (tps)",
             "Wall Clock Time (s)",
+            "Vision Model Latency (ms)",
+            "Embedding Model Prefill Latency (ms)",
+            "Decoder Prefill Latency (ms)",
+            "Embedding Model Decode Latency (ms)",
+            "Decoder Decode Latency (ms)",
         ],
     )
     # df = df.transpose()  # This line swaps the rows and columns
     df.to_csv(filename, header=True, index=False)
     print(f"Results saved in {filename}!")
 
-def run_benchmark(args, model, processor, image, generation_length, max_length):
+def run_benchmark(args, model, processor, image, num_images, generation_length, max_length):
     # Get user arguments
     num_repetitions = args.repetitions
     temperature = 1.0
 
     # Process prompt and image
     if args.verbose: print("Processing image and prompt...")
-    prompt = "<|user|>\n<|image_1|>\nWhat is shown in this image?<|end|>\n<|assistant|>\n"
+    image_tags = "".join(f"<|image_{i + 1}|>\n" for i in range(num_images))
+    prompt = f"<|user|>\n{image_tags}What is shown in this image?<|end|>\n<|assistant|>\n"
     inputs = processor(prompt, images=image)
 
     params = og.GeneratorParams(model)
@@ -73,6 +82,12 @@ def run_benchmark(args, model, processor, image, generation_length, max_length):
     token_gen_times = []
     sampling_times = []
     wall_clock_times = []
+    # The native stage times of the generator (see generator.get_metrics), per repetition
+    vision_times = []
+    embedding_prefill_times = []
+    decoder_prefill_times = []
+    embedding_decode_times = []
+    decoder_decode_times = []
     if args.verbose: print(f"Done with warmup, running benchmark for {num_repetitions} repetitions...")
     for _ in tqdm(range(num_repetitions)):
         wall_clock_start_time = time.time()
@@ -117,6 +132,15 @@ def run_benchmark(args, model, processor, image, generation_length, max_length):
         wall_clock_times.append(wall_clock_end_time - wall_clock_start_time)
         if args.print_model_output: print(processor.decode(generator.get_sequence(0)))
 
+        metrics = generator.get_metrics()
+        prefill, decode = metrics["prefill"], metrics["decode"]
+        vision_times.append(prefill["vision_run_seconds"])
+        embedding_prefill_times.append(prefill["embedding_run_seconds"])
+        decoder_prefill_times.append(prefill["session_run_seconds"])
+        decode_tokens = max(decode["tokens"], 1)
+        embedding_decode_times.append(decode["embedding_run_seconds"] / decode_tokens)
+        decoder_decode_times.append(decode["session_run_seconds"] / decode_tokens)
+
         # Delete the generator to free the captured graph for the next generator, if graph capture is enabled
         del generator
 
@@ -150,6 +174,21 @@ def run_benchmark(args, model, processor, image, generation_length, max_length):
     print(f"Average Wall Clock Time: {avg_wall_clock_time} s")
     print(f"Average Wall Clock Throughput: {avg_wall_clock_thrpt} tps")
 
+    # The stages of the pipeline. The image preprocessing is the processing latency above, on the CPU.
+    def average_ms(times):
+        return sum(times) / len(times) * 1000
+
+    avg_vision_latency_ms = average_ms(vision_times)
+    avg_embedding_prefill_latency_ms = average_ms(embedding_prefill_times)
+    avg_decoder_prefill_latency_ms = average_ms(decoder_prefill_times)
+    avg_embedding_decode_latency_ms = average_ms(embedding_decode_times)
+    avg_decoder_decode_latency_ms = average_ms(decoder_decode_times)
+    print(f"Average Vision Model Latency: {avg_vision_latency_ms} ms")
+    print(f"Average Embedding Model Prefill Latency: {avg_embedding_prefill_latency_ms} ms")
+    print(f"Average Decoder Prefill Latency: {avg_decoder_prefill_latency_ms} ms")
+    print(f"Average Embedding Model Decode Latency (per token): {avg_embedding_decode_latency_ms} ms")
+    print(f"Average Decoder Decode Latency (per token): {avg_decoder_decode_latency_ms} ms")
+
     metrics = [
         generation_length,
         max_length,
@@ -161,9 +200,25 @@ def run_benchmark(args, model, processor, image, generation_length, max_length):
         avg_sampling_latency_ms,
         avg_wall_clock_thrpt,
         avg_wall_clock_time,
+        avg_vision_latency_ms,
+        avg_embedding_prefill_latency_ms,
+        avg_decoder_prefill_latency_ms,
+        avg_embedding_decode_latency_ms,
+        avg_decoder_decode_latency_ms,
     ]
     return metrics
 
+def resize_images(image_paths, resolution, directory):
+    # Writes copies of the images at the given resolution ("<width>x<height>") to the directory and returns their paths
+    from PIL import Image
+    width, height = (int(v) for v in resolution.split('x'))
+    resized_paths = []
+    for i, image_path in enumerate(image_paths):
+        resized_path = os.path.join(directory, f"{i}_{resolution}{os.path.splitext(image_path)[1]}")
+        Image.open(image_path).resize((width, height)).save(resized_path)
+        resized_paths.append(resized_path)
+    return resized_paths
+
 def main(args):
     all_csv_metrics = []
     # Get tokenizer, and model
@@ -172,21 +227,27 @@ def main(args):
     model=og.Model(f'{model_path}')
     if args.verbose: print("Model loaded, loading processor...")
     processor = model.create_multimodal_processor()
-    if args.verbose: print("Processor loaded, loading image...")
-    # Get image
-    image_path = args.image_path
-    if not os.path.exists(image_path):
-        raise FileNotFoundError(f"Image file not found: {image_path}")
-    image = og.Images.open(image_path)
-    if args.verbose: print("Image loaded, starting benchmark...")
-    for g, gen_length in enumerate(args.generation_lengths):
-        if args.max_lengths:
-            max_length = args.max_lengths[g]
-        else:
-            max_length = 3072
-        print(f"Args: tokens = {gen_length}, max_length = {max_length}")
-        metrics = run_benchmark(args, model, processor, image, gen_length, max_length)
-        all_csv_metrics.append(metrics)
+    # Get images, the first num_images of them are used with every image count
+    image_paths = args.image_path
+    for image_path in image_paths:
+        if not os.path.exists(image_path):
+            raise FileNotFoundError(f"Image file not found: {image_path}")
+    if max(args.num_images) > len(image_paths):
+        raise ValueError(f"{max(args.num_images)} images requested, but only {len(image_paths)} image paths given")
+    with tempfile.TemporaryDirectory() as resized_directory:
+        for resolution in args.resolutions or ["original"]:
+            resolution_paths = image_paths if resolution == "original" else resize_images(image_paths, resolution, resized_directory)
+            for num_images in args.num_images:
+                if args.verbose: print(f"Loading {num_images} image(s) at {resolution} resolution...")
+                image = og.Images.open(*resolution_paths[:num_images])
+                for g, gen_length in enumerate(args.generation_lengths):
+                    if args.max_lengths:
+                        max_length = args.max_lengths[g]
+                    else:
+                        max_length = 3072
+                    print(f"Args: images = {num_images}, resolution = {resolution}, tokens = {gen_length}, max_length = {max_length}")
+                    metrics = run_benchmark(args, model, processor, image, num_images, gen_length, max_length)
+                    all_csv_metrics.append([num_images, resolution] + metrics)
     # Add metrics to CSV
     if args.verbose: print("Adding results to CSV")
     filename = args.output
@@ -201,7 +262,9 @@ def str2strlist(value):
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(description="End-to-end benchmarking for gen-ai")
     parser.add_argument('-i', '--input_folder', type=str, required=True, help='Onnx model folder path (must contain genai_config.json and model.onnx)')
-    parser.add_argument('-im', '--image_path', type=str, required=True, help='Path to the image')
+    parser.add_argument('-im', '--image_path', type=str2strlist, required=True, help='Paths to the images, comma separated')
+    parser.add_argument('-n', '--num_images', type=str2intlist, default=[1], help='Numbers of images in the prompt, the first ones of the image paths')
+    parser.add_argument('-res', '--resolutions', type=str2strlist, default=[], help='Resolutions to resize the images to, like 336x336,1344x1344 (requires Pillow). Default: the original size')
     parser.add_argument('-g', '--generation_lengths', type=str2intlist, default=[256], help='Number of tokens to generate after prompt')
     parser.add_argument('-m', '--max_lengths', type=str2intlist, default=[3072], help='Max length buffer sizes... User should supply one for every Generation length')
     parser.add_argument('-r', '--repetitions', type=int, default=10, help='Number of times to repeat the benchmark')
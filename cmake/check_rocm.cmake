@@ -6,4 +6,49 @@ if(USE_ROCM)
   add_compile_definitions(USE_ROCM=1)
 else()
   add_compile_definitions(USE_ROCM=0)
-endif()
\ No newline at end of file
+endif()
+
+# The search and sampling kernels of src/cuda are translated to HIP with hipify-perl at build time, and built into the
+# same dynamically loaded library as with CUDA, which then provides the CUDA device interface on AMD GPUs
+if(USE_ROCM AND NOT USE_CUDA)
+  find_program(HIPIFY_PERL hipify-perl HINTS "$ENV{ROCM_PATH}/bin" /opt/rocm/bin)
+endif()
+
+if(USE_ROCM AND NOT USE_CUDA AND HIPIFY_PERL)
+  enable_language(HIP)
+  message(STATUS "Building the search kernels with HIP, hipify-perl: ${HIPIFY_PERL}")
+
+  file(GLOB generator_cuda_kernel_srcs CONFIGURE_DEPENDS
+    "${GENERATORS_ROOT}/cuda/*.cpp"
+    "${GENERATORS_ROOT}/cuda/*.h"
+    "${GENERATORS_ROOT}/cuda/*.cu"
+    "${GENERATORS_ROOT}/cuda/*.cuh"
+  )
+
+  set(generator_hiplib_srcs "")
+  foreach(cuda_src ${generator_cuda_kernel_srcs})
+    get_filename_component(cuda_src_name ${cuda_src} NAME)
+    set(hip_src "${CMAKE_BINARY_DIR}/hipified/cuda/${cuda_src_name}")
+    add_custom_command(
+      OUTPUT ${hip_src}
+      COMMAND ${CMAKE_COMMAND} -E make_directory "${CMAKE_BINARY_DIR}/hipified/cuda"
+      COMMAND ${HIPIFY_PERL} ${cuda_src} -o=${hip_src}
+      DEPENDS ${cuda_src}
+      COMMENT "Hipifying ${cuda_src_name}"
+    )
+    if(cuda_src_name MATCHES "\\.cu$")
+      set_source_files_properties(${hip_src} PROPERTIES LANGUAGE HIP)
+    endif()
+    list(APPEND generator_hiplib_srcs ${hip_src})
+  endforeach()
+
+  find_package(hip REQUIRED)
+  find_package(hipcub REQUIRED)
+  find_package(hiprand REQUIRED)
+  find_package(hipfft REQUIRED)
+  find_package(hipblas REQUIRED)
+  find_package(hipblaslt REQUIRED)
+  add_compile_definitions(USE_ROCM_KERNELS=1)
+else()
+  add_compile_definitions(USE_ROCM_KERNELS=0)
+endif()
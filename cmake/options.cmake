@@ -13,6 +13,8 @@ cmake_dependent_option(BUILD_WHEEL "Build the python wheel" ON "ENABLE_PYTHON" O
 # testing
 option(ENABLE_TESTS "Enable tests" ON)
 option(TEST_PHI2 "Enable tests for Phi2" OFF)
+option(TEST_WHISPER "Enable tests for Whisper (whisper-tiny under the test models)" OFF)
 
 # performance
 option(ENABLE_MODEL_BENCHMARK "Build model benchmark program" ON)
+option(ENABLE_MICROBENCHMARKS "Build the search, sampling and key-value cache microbenchmarks (needs an installed Google Benchmark)" OFF)
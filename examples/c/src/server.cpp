@@ -0,0 +1,685 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// An OpenAI compatible HTTP server on top of the request scheduling engine (OgaEngine). Every HTTP request becomes an
+// OgaRequest that becomes active on the next engine step, and its tokens are streamed back as server-sent
+// events while the other requests keep generating. Supports /v1/completions, /v1/chat/completions, /v1/models and a
+// Prometheus /metrics endpoint fed by the runtime metrics sink.
+
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "ort_genai.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+using Socket = SOCKET;
+#else
+#include <arpa/inet.h>
+#include <csignal>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+using Socket = int;
+constexpr Socket INVALID_SOCKET = -1;
+inline int closesocket(Socket socket) { return close(socket); }
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+// Just enough JSON to read the request bodies
+struct JsonValue {
+  enum struct Type { Null,
+                     Bool,
+                     Number,
+                     String,
+                     Array,
+                     Object };
+
+  const JsonValue* Find(const std::string& key) const {
+    for (auto& [name, value] : object)
+      if (name == key)
+        return &value;
+    return nullptr;
+  }
+
+  Type type{Type::Null};
+  bool boolean{};
+  double number{};
+  std::string string;
+  std::vector<JsonValue> array;
+  std::vector<std::pair<std::string, JsonValue>> object;
+};
+
+struct JsonParser {
+  explicit JsonParser(const std::string& text) : text_{text} {}
+
+  JsonValue Parse() {
+    auto value = ParseValue();
+    SkipWhitespace();
+    if (pos_ != text_.size())
+      throw std::runtime_error("Unexpected characters after the JSON value");
+    return value;
+  }
+
+ private:
+  void SkipWhitespace() {
+    while (pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_])))
+      pos_++;
+  }
+
+  char Next() {
+    if (pos_ == text_.size())
+      throw std::runtime_error("Unexpected end of the JSON");
+    return text_[pos_++];
+  }
+
+  void Expect(const char* literal) {
+    for (; *literal; literal++)
+      if (Next() != *literal)
+        throw std::runtime_error("Invalid JSON literal");
+  }
+
+  JsonValue ParseValue() {
+    SkipWhitespace();
+    JsonValue value;
+    char c = pos_ < text_.size() ? text_[pos_] : '\0';
+    if (c == '{') {
+      value.type = JsonValue::Type::Object;
+      pos_++;
+      SkipWhitespace();
+      if (pos_ < text_.size() && text_[pos_] == '}') {
+        pos_++;
+        return value;
+      }
+      while (true) {
+        SkipWhitespace();
+        if (Next() != '"')
+          throw std::runtime_error("Expected a JSON object key");
+        auto key = ParseString();
+        SkipWhitespace();
+        if (Next() != ':')
+          throw std::runtime_error("Expected ':' in a JSON object");
+        value.object.emplace_back(std::move(key), ParseValue());
+        SkipWhitespace();
+        c = Next();
+        if (c == '}')
+          return value;
+        if (c != ',')
+          throw std::runtime_error("Expected ',' or '}' in a JSON object");
+      }
+    }
+    if (c == '[') {
+      value.type = JsonValue::Type::Array;
+      pos_++;
+      SkipWhitespace();
+      if (pos_ < text_.size() && text_[pos_] == ']') {
+        pos_++;
+        return value;
+      }
+      while (true) {
+        value.array.push_back(ParseValue());
+        SkipWhitespace();
+        c = Next();
+        if (c == ']')
+          return value;
+        if (c != ',')
+          throw std::runtime_error("Expected ',' or ']' in a JSON array");
+      }
+    }
+    if (c == '"') {
+      pos_++;
+      value.type = JsonValue::Type::String;
+      value.string = ParseString();
+    } else if (c == 't') {
+      Expect("true");
+      value.type = JsonValue::Type::Bool;
+      value.boolean = true;
+    } else if (c == 'f') {
+      Expect("false");
+      value.type = JsonValue::Type::Bool;
+    } else if (c == 'n') {
+      Expect("null");
+    } else {
+      size_t length{};
+      value.type = JsonValue::Type::Number;
+      value.number = std::stod(text_.substr(pos_), &length);
+      pos_ += length;
+    }
+    return value;
+  }
+
+  // Called after the opening quote
+  std::string ParseString() {
+    std::string result;
+    while (true) {
+      char c = Next();
+      if (c == '"')
+        return result;
+      if (c != '\\') {
+        result += c;
+        continue;
+      }
+      c = Next();
+      switch (c) {
+        case 'n': result += '\n'; break;
+        case 't': result += '\t'; break;
+        case 'r': result += '\r'; break;
+        case 'b': result += '\b'; break;
+        case 'f': result += '\f'; break;
+        case 'u': {
+          if (pos_ + 4 > text_.size())
+            throw std::runtime_error("Invalid JSON unicode escape");
+          unsigned code = std::stoul(text_.substr(pos_, 4), nullptr, 16);
+          pos_ += 4;
+          if (code >= 0xD800 && code < 0xDC00 && text_.compare(pos_, 2, "\\u") == 0) {  // Surrogate pair
+            unsigned low = std::stoul(text_.substr(pos_ + 2, 4), nullptr, 16);
+            pos_ += 6;
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          }
+          AppendUtf8(result, code);
+          break;
+        }
+        default: result += c; break;  // '"', '\\' and '/'
+      }
+    }
+  }
+
+  static void AppendUtf8(std::string& out, unsigned code) {
+    if (code < 0x80) {
+      out += static_cast<char>(code);
+    } else if (code < 0x800) {
+      out += static_cast<char>(0xC0 | (code >> 6));
+      out += static_cast<char>(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+      out += static_cast<char>(0xE0 | (code >> 12));
+      out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+      out += static_cast<char>(0x80 | (code & 0x3F));
+    } else {
+      out += static_cast<char>(0xF0 | (code >> 18));
+      out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+      out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+      out += static_cast<char>(0x80 | (code & 0x3F));
+    }
+  }
+
+  const std::string& text_;
+  size_t pos_{};
+};
+
+std::string JsonString(const std::string& value) {
+  std::string result = "\"";
+  for (char c : value) {
+    switch (c) {
+      case '"': result += "\\\""; break;
+      case '\\': result += "\\\\"; break;
+      case '\n': result += "\\n"; break;
+      case '\r': result += "\\r"; break;
+      case '\t': result += "\\t"; break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          char escape[8];
+          std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+          result += escape;
+        } else {
+          result += c;
+        }
+    }
+  }
+  return result + "\"";
+}
+
+// Collects the runtime metrics (see OgaSetMetricsSink) for the /metrics endpoint
+struct MetricsRegistry {
+  static void OGA_API_CALL Sink(const char* name, OgaMetricType type, double value, void* user_data) {
+    auto& registry = *static_cast<MetricsRegistry*>(user_data);
+    std::scoped_lock lock{registry.mutex_};
+    auto& metric = registry.metrics_[name];
+    metric.type = type;
+    if (type == OgaMetricType_Gauge)
+      metric.value = value;
+    else
+      metric.value += value;
+    metric.count++;
+  }
+
+  // Prometheus text format, histograms are reported as summaries without quantiles
+  std::string Render() const {
+    std::scoped_lock lock{mutex_};
+    std::ostringstream out;
+    for (auto& [name, metric] : metrics_) {
+      switch (metric.type) {
+        case OgaMetricType_Counter:
+          out << "# TYPE " << name << " counter\n"
+              << name << " " << metric.value << "\n";
+          break;
+        case OgaMetricType_Gauge:
+          out << "# TYPE " << name << " gauge\n"
+              << name << " " << metric.value << "\n";
+          break;
+        case OgaMetricType_Histogram:
+          out << "# TYPE " << name << " summary\n"
+              << name << "_sum " << metric.value << "\n"
+              << name << "_count " << metric.count << "\n";
+          break;
+      }
+    }
+    return out.str();
+  }
+
+ private:
+  struct Metric {
+    OgaMetricType type{};
+    double value{};
+    size_t count{};
+  };
+
+  mutable std::mutex mutex_;
+  std::map<std::string, Metric> metrics_;
+};
+
+struct HttpRequest {
+  std::string method;
+  std::string path;
+  std::string body;
+};
+
+bool SendAll(Socket socket, const std::string& data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    auto result = send(socket, data.data() + sent, static_cast<int>(data.size() - sent), 0);
+    if (result <= 0)
+      return false;
+    sent += static_cast<size_t>(result);
+  }
+  return true;
+}
+
+bool ReadRequest(Socket socket, HttpRequest& request) {
+  std::string data;
+  size_t header_end;
+  char buffer[4096];
+  while ((header_end = data.find("\r\n\r\n")) == std::string::npos) {
+    auto result = recv(socket, buffer, sizeof(buffer), 0);
+    if (result <= 0 || data.size() > 1 << 20)
+      return false;
+    data.append(buffer, static_cast<size_t>(result));
+  }
+
+  std::istringstream headers{data.substr(0, header_end)};
+  std::string line;
+  std::getline(headers, line);
+  std::istringstream request_line{line};
+  request_line >> request.method >> request.path;
+
+  size_t content_length = 0;
+  while (std::getline(headers, line)) {
+    auto colon = line.find(':');
+    if (colon == std::string::npos)
+      continue;
+    std::string name = line.substr(0, colon);
+    for (auto& c : name)
+      c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    if (name == "content-length")
+      content_length = std::stoul(line.substr(colon + 1));
+  }
+
+  request.body = data.substr(header_end + 4);
+  while (request.body.size() < content_length) {
+    auto result = recv(socket, buffer, sizeof(buffer), 0);
+    if (result <= 0)
+      return false;
+    request.body.append(buffer, static_cast<size_t>(result));
+  }
+  return true;
+}
+
+void SendResponse(Socket socket, int status, const char* content_type, const std::string& body) {
+  const char* reason = status == 200 ? "OK" : status == 404 ? "Not Found"
+                                          : status == 400   ? "Bad Request"
+                                                            : "Internal Server Error";
+  SendAll(socket, "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\nContent-Type: " + content_type +
+                      "\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body);
+}
+
+void SendError(Socket socket, int status, const std::string& message) {
+  SendResponse(socket, status, "application/json", "{\"error\":{\"message\":" + JsonString(message) + ",\"type\":\"invalid_request_error\"}}");
+}
+
+struct Options {
+  std::string model_path;
+  std::string execution_provider{"cpu"};
+  std::string model_name{"onnxruntime-genai"};
+  int port{8080};
+  int max_active_requests{16};
+  size_t token_budget{};
+  size_t step_token_budget{};
+  size_t kv_cache_budget{};
+  OgaPreemptionMode preemption_mode{OgaPreemptionMode_Swap};
+  bool prefix_cache{};
+  int default_max_tokens{256};
+};
+
+struct Server {
+  explicit Server(const Options& options) : options_{options} {
+    Oga::SetMetricsSink(&MetricsRegistry::Sink, &metrics_);
+
+    std::cout << "Creating model..." << std::endl;
+    auto config = OgaConfig::Create(options.model_path.c_str());
+    config->ClearProviders();
+    if (options.execution_provider != "cpu")
+      config->AppendProvider(options.execution_provider.c_str());
+    if (options.prefix_cache)
+      config->Overlay(R"({"model": {"decoder": {"paged_kv_cache": {"enable_prefix_cache": true}}}})");
+    model_ = OgaModel::Create(*config);
+    tokenizer_ = OgaTokenizer::Create(*model_);
+
+    engine_ = OgaEngine::Create(*model_, options.max_active_requests);
+    engine_->SetTokenBudget(options.token_budget);
+    engine_->SetStepTokenBudget(options.step_token_budget);
+    engine_->SetKeyValueCacheBudget(options.kv_cache_budget);
+    engine_->SetPreemptionMode(options.preemption_mode);
+    engine_thread_ = std::thread([this] { RunEngine(); });
+  }
+
+  ~Server() {
+    {
+      std::scoped_lock lock{mutex_};
+      running_ = false;
+    }
+    work_cv_.notify_one();
+    engine_thread_.join();
+    Oga::SetMetricsSink(nullptr, nullptr);
+  }
+
+  void HandleConnection(Socket socket) {
+    HttpRequest request;
+    try {
+      if (!ReadRequest(socket, request)) {
+        // The client went away or sent a malformed request
+      } else if (request.method == "GET" && request.path == "/health") {
+        SendResponse(socket, 200, "text/plain", "ok");
+      } else if (request.method == "GET" && request.path == "/metrics") {
+        SendResponse(socket, 200, "text/plain; version=0.0.4", metrics_.Render());
+      } else if (request.method == "GET" && request.path == "/v1/models") {
+        SendResponse(socket, 200, "application/json",
+                     "{\"object\":\"list\",\"data\":[{\"id\":" + JsonString(options_.model_name) + ",\"object\":\"model\",\"owned_by\":\"onnxruntime-genai\"}]}");
+      } else if (request.method == "POST" && request.path == "/v1/completions") {
+        HandleCompletion(socket, JsonParser{request.body}.Parse(), false);
+      } else if (request.method == "POST" && request.path == "/v1/chat/completions") {
+        HandleCompletion(socket, JsonParser{request.body}.Parse(), true);
+      } else {
+        SendError(socket, 404, "Unknown endpoint " + request.method + " " + request.path);
+      }
+    } catch (const std::exception& e) {
+      SendError(socket, 400, e.what());
+    }
+    closesocket(socket);
+  }
+
+ private:
+  // Steps the engine while it has requests, and wakes the connections up after each step
+  void RunEngine() {
+    while (true) {
+      {
+        std::unique_lock lock{mutex_};
+        work_cv_.wait(lock, [this] { return !running_ || engine_->HasPendingRequests(); });
+        if (!running_)
+          return;
+      }
+      try {
+        engine_->Step();
+      } catch (const std::exception& e) {
+        std::cerr << "Engine step failed: " << e.what() << std::endl;
+        std::exit(1);
+      }
+      {
+        std::scoped_lock lock{mutex_};
+        steps_++;
+      }
+      step_cv_.notify_all();
+    }
+  }
+
+  // Uses the Phi-3 chat format of the other examples
+  static std::string ChatPrompt(const JsonValue& messages) {
+    std::string prompt;
+    for (auto& message : messages.array) {
+      auto* role = message.Find("role");
+      auto* content = message.Find("content");
+      if (!role || !content || content->type != JsonValue::Type::String)
+        throw std::runtime_error("Every message needs a 'role' and a string 'content'");
+      prompt += "<|" + role->string + "|>\n" + content->string + "<|end|>\n";
+    }
+    return prompt + "<|assistant|>";
+  }
+
+  void HandleCompletion(Socket socket, const JsonValue& body, bool chat) {
+    std::string prompt;
+    if (chat) {
+      auto* messages = body.Find("messages");
+      if (!messages || messages->type != JsonValue::Type::Array)
+        throw std::runtime_error("'messages' must be an array");
+      prompt = ChatPrompt(*messages);
+    } else {
+      auto* value = body.Find("prompt");
+      if (!value || value->type != JsonValue::Type::String)
+        throw std::runtime_error("'prompt' must be a string");
+      prompt = value->string;
+    }
+    auto number = [&](const char* name, double default_value) {
+      auto* value = body.Find(name);
+      return value && value->type == JsonValue::Type::Number ? value->number : default_value;
+    };
+    auto* stream_value = body.Find("stream");
+    const bool stream = stream_value && stream_value->boolean;
+    const int max_tokens = static_cast<int>(number("max_tokens", options_.default_max_tokens));
+
+    auto start = Clock::now();
+    auto sequences = OgaSequences::Create();
+    tokenizer_->Encode(prompt.c_str(), *sequences);
+    const size_t prompt_tokens = sequences->SequenceCount(0);
+
+    auto params = OgaGeneratorParams::Create(*model_);
+    params->SetSearchOption("max_length", static_cast<double>(prompt_tokens + max_tokens));
+    if (double temperature = number("temperature", 0.0); temperature > 0.0) {
+      params->SetSearchOptionBool("do_sample", true);
+      params->SetSearchOption("temperature", temperature);
+      if (body.Find("top_p"))
+        params->SetSearchOption("top_p", number("top_p", 1.0));
+      if (body.Find("top_k"))
+        params->SetSearchOption("top_k", number("top_k", 0.0));
+    }
+
+    auto request = OgaRequest::Create(*params);
+    // Non standard: "priority": "batch" lets interactive requests preempt this one
+    if (auto* priority = body.Find("priority"); priority && priority->string == "batch")
+      request->SetPriority(OgaRequestPriority_Batch);
+    request->AddTokens(sequences->SequenceData(0), prompt_tokens);
+
+    uint64_t seen_steps;
+    {
+      std::scoped_lock lock{mutex_};
+      seen_steps = steps_;
+    }
+    engine_->AddRequest(*request);
+    {
+      std::scoped_lock lock{mutex_};  // Orders the notification after the engine thread's check
+    }
+    work_cv_.notify_one();
+
+    const std::string id = std::string(chat ? "chatcmpl-" : "cmpl-") + std::to_string(next_id_++);
+    const std::string created = std::to_string(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+    auto chunk = [&](const std::string& text, const char* finish_reason) {
+      std::string choice = chat ? "{\"index\":0,\"delta\":{\"content\":" + JsonString(text) + "}"
+                                : "{\"index\":0,\"text\":" + JsonString(text);
+      choice += std::string(",\"finish_reason\":") + (finish_reason ? JsonString(finish_reason) : "null") + "}";
+      return "data: {\"id\":\"" + id + "\",\"object\":\"" + (chat ? "chat.completion.chunk" : "text_completion") +
+             "\",\"created\":" + created + ",\"model\":" + JsonString(options_.model_name) + ",\"choices\":[" + choice + "]}\n\n";
+    };
+
+    if (stream && !SendAll(socket, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n")) {
+      request->Cancel();
+      return;
+    }
+
+    auto tokenizer_stream = OgaTokenizerStream::Create(*tokenizer_);
+    std::string text;
+    size_t completion_tokens = 0;
+    double time_to_first_token = 0.0;
+    while (true) {
+      {
+        std::unique_lock lock{mutex_};
+        step_cv_.wait(lock, [&] { return steps_ != seen_steps; });
+        seen_steps = steps_;
+      }
+      const bool done = request->IsDone();  // Checked first, so the tokens read next include the last ones
+      auto tokens = request->GetUnseenTokens();
+      std::string new_text;
+      for (size_t i = 0; i < tokens->SequenceCount(0); i++)
+        new_text += tokenizer_stream->Decode(tokens->SequenceData(0)[i]);
+      if (completion_tokens == 0 && tokens->SequenceCount(0) > 0)
+        time_to_first_token = std::chrono::duration<double>(Clock::now() - start).count();
+      completion_tokens += tokens->SequenceCount(0);
+
+      if (stream && !new_text.empty() && !SendAll(socket, chunk(new_text, nullptr))) {
+        request->Cancel();  // The client went away
+        return;
+      }
+      text += new_text;
+      if (done)
+        break;
+    }
+
+    const char* finish_reason = completion_tokens >= static_cast<size_t>(max_tokens) ? "length" : "stop";
+    if (stream) {
+      SendAll(socket, chunk("", finish_reason) + "data: [DONE]\n\n");
+    } else {
+      std::string choice = chat ? "{\"index\":0,\"message\":{\"role\":\"assistant\",\"content\":" + JsonString(text) + "}"
+                                : "{\"index\":0,\"text\":" + JsonString(text);
+      choice += std::string(",\"finish_reason\":\"") + finish_reason + "\"}";
+      SendResponse(socket, 200, "application/json",
+                   "{\"id\":\"" + id + "\",\"object\":\"" + (chat ? "chat.completion" : "text_completion") + "\",\"created\":" + created +
+                       ",\"model\":" + JsonString(options_.model_name) + ",\"choices\":[" + choice + "],\"usage\":{\"prompt_tokens\":" +
+                       std::to_string(prompt_tokens) + ",\"completion_tokens\":" + std::to_string(completion_tokens) +
+                       ",\"total_tokens\":" + std::to_string(prompt_tokens + completion_tokens) + "}}");
+    }
+
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    std::cout << id << ": " << prompt_tokens << " prompt tokens, " << completion_tokens << " generated tokens, "
+              << time_to_first_token * 1000 << " ms to first token, " << completion_tokens / seconds << " tokens/s" << std::endl;
+  }
+
+  const Options& options_;
+  MetricsRegistry metrics_;
+  std::unique_ptr<OgaModel> model_;
+  std::unique_ptr<OgaTokenizer> tokenizer_;
+  std::unique_ptr<OgaEngine> engine_;
+  std::atomic<uint64_t> next_id_{};
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;  // Signalled when a request is added
+  std::condition_variable step_cv_;  // Signalled after each engine step
+  uint64_t steps_{};                 // Protected by mutex_
+  bool running_{true};               // Protected by mutex_
+  std::thread engine_thread_;
+};
+
+void PrintUsage(const char* program) {
+  std::cerr << "usage: " << program << " <model_path> <execution_provider> [options]" << std::endl
+            << "  --port <port>                  Port to listen on (default 8080)" << std::endl
+            << "  --model_name <name>            Model id reported by the API (default onnxruntime-genai)" << std::endl
+            << "  --max_active_requests <count>  Requests generated at once (default 16)" << std::endl
+            << "  --token_budget <tokens>        Tokens the active requests may hold (default no limit)" << std::endl
+            << "  --step_token_budget <tokens>   Tokens each engine step runs, prompts are prefilled in chunks (default no limit)" << std::endl
+            << "  --kv_cache_budget <bytes>      Key-value cache bytes before requests are preempted (default no limit)" << std::endl
+            << "  --preemption_mode <mode>       swap or recompute (default swap)" << std::endl
+            << "  --prefix_cache                 Share common prompt prefixes, for models with a paged key-value cache" << std::endl
+            << "  --max_tokens <tokens>          Default max_tokens of a request (default 256)" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    PrintUsage(argv[0]);
+    return -1;
+  }
+
+  Options options;
+  options.model_path = argv[1];
+  options.execution_provider = argv[2];
+  for (int i = 3; i < argc; i++) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc)
+        throw std::runtime_error("Missing value for " + arg);
+      return argv[++i];
+    };
+    if (arg == "--port")
+      options.port = std::stoi(value());
+    else if (arg == "--model_name")
+      options.model_name = value();
+    else if (arg == "--max_active_requests")
+      options.max_active_requests = std::stoi(value());
+    else if (arg == "--token_budget")
+      options.token_budget = std::stoull(value());
+    else if (arg == "--step_token_budget")
+      options.step_token_budget = std::stoull(value());
+    else if (arg == "--kv_cache_budget")
+      options.kv_cache_budget = std::stoull(value());
+    else if (arg == "--preemption_mode")
+      options.preemption_mode = value() == "recompute" ? OgaPreemptionMode_Recompute : OgaPreemptionMode_Swap;
+    else if (arg == "--prefix_cache")
+      options.prefix_cache = true;
+    else if (arg == "--max_tokens")
+      options.default_max_tokens = std::stoi(value());
+    else {
+      PrintUsage(argv[0]);
+      return -1;
+    }
+  }
+
+#ifdef _WIN32
+  WSADATA wsa_data;
+  WSAStartup(MAKEWORD(2, 2), &wsa_data);
+#else
+  std::signal(SIGPIPE, SIG_IGN);  // A client that goes away fails the send instead
+#endif
+
+  {
+    OgaHandle handle;
+    Server server{options};
+
+    Socket listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(static_cast<uint16_t>(options.port));
+    if (listener == INVALID_SOCKET || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+      std::cerr << "Failed to listen on port " << options.port << std::endl;
+      return -1;
+    }
+    std::cout << "Listening on http://0.0.0.0:" << options.port << std::endl;
+
+    while (true) {
+      Socket connection = accept(listener, nullptr, nullptr);
+      if (connection == INVALID_SOCKET)
+        continue;
+      std::thread([&server, connection] { server.HandleConnection(connection); }).detach();
+    }
+  }
+}
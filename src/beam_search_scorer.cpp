@@ -5,31 +5,55 @@
 #include "search.h"
 #include "beam_search_scorer.h"
 
+#include <algorithm>
 #include <cmath>
 
 namespace Generators {
 
-void BeamHypotheses::Init(float length_penalty, std::span<HypothesisScore> beams) {
+namespace {
+
+// Runs fn(index) for every index in [0, count), spread over the shared thread pool when there is more than one
+template <typename Fn>
+void ParallelFor(size_t count, Fn&& fn) {
+  if (count == 1)
+    fn(0);
+  else
+    GetThreadPool().ParallelFor(count, std::forward<Fn>(fn));
+}
+
+}  // namespace
+
+void BeamHypotheses::Init(float length_penalty, std::span<HypothesisScore> beams, std::span<int32_t> storage, size_t max_length) {
   beams_ = beams;
+  storage_ = storage;
+  max_length_ = max_length;
   beams_used_ = 0;
   length_penalty_ = length_penalty;
   done_ = false;
 }
 
-void BeamHypotheses::Add(std::span<int32_t> hypothesis, float sum_logprobs) {
-  auto length = hypothesis.size();
+void BeamHypotheses::Add(std::span<const int32_t> sequence, float sum_logprobs) {
+  auto length = sequence.size();
   float const score = sum_logprobs / std::pow(static_cast<float>(length), length_penalty_);
 
   size_t index = beams_used_;
-  // If the array is full, don't add unless it's better than the worst element
+  int32_t* slot;
+  // If the array is full, don't add unless it's better than the worst element, whose storage is then reused
   if (index == beams_.size()) {
     if (score <= beams_[--index].score) {
       return;
     }
+    slot = beams_[index].hypothesis.data();
   } else {
+    // The used hypotheses always occupy the first beams_used_ slots of storage_
+    slot = storage_.data() + beams_used_ * max_length_;
     beams_used_++;
   }
 
+  assert(length <= max_length_);
+  std::span<int32_t> hypothesis{slot, length};
+  std::copy(sequence.begin(), sequence.end(), hypothesis.begin());
+
   // Rotate existing elements over while the new element scores higher
   for (; index > 0 && score > beams_[index - 1].score; index--) {
     beams_[index] = beams_[index - 1];
@@ -45,46 +69,54 @@ bool BeamHypotheses::CanImprove(float best_sum_logprobs, int current_length) con
 
 BeamSearchScorer::BeamSearchScorer(const GeneratorParams& parameters)
     : batch_size_{parameters.search.batch_size},
-      num_beams_{parameters.search.num_beams},
+      num_beam_groups_{parameters.search.num_beam_groups},
+      group_count_{parameters.search.batch_size * parameters.search.num_beam_groups},
+      group_size_{parameters.search.num_beams / parameters.search.num_beam_groups},
       max_length_{parameters.search.max_length},
       pad_token_id_{parameters.config.model.pad_token_id},
       eos_token_id_{parameters.config.model.eos_token_id},
-      early_stopping_{parameters.search.early_stopping},
-      not_done_count_{parameters.search.batch_size} {
+      early_stopping_{parameters.search.early_stopping} {
   auto& device = *parameters.p_device;
-  size_t const batch_beam_size = static_cast<size_t>(batch_size_) * num_beams_;
+  size_t const batch_beam_size = static_cast<size_t>(group_count_) * group_size_;
+
+  // Every group keeps at most group_size_ hypotheses, so a hypothesis that is replaced hands its storage to the one
+  // replacing it and all of the storage is allocated once here
+  hypothesis_buffer_ = device.Allocate<int32_t>(batch_beam_size * max_length_);
+  auto hypothesis_storage = hypothesis_buffer_.Span();
 
   std::span<HypothesisScore> beams;
   hypothesis_scores_ptr_ = AllocateArray<HypothesisScore>(batch_beam_size, &beams);
-  beam_hyps_ptr_ = AllocateArray<BeamHypotheses>(batch_size_, &beam_hyps_);
-  for (size_t i = 0; i < batch_size_; i++) {
-    beam_hyps_[i].Init(parameters.search.length_penalty, beams.subspan(i * num_beams_, num_beams_));
+  beam_hyps_ptr_ = AllocateArray<BeamHypotheses>(group_count_, &beam_hyps_);
+  for (size_t i = 0; i < group_count_; i++) {
+    beam_hyps_[i].Init(parameters.search.length_penalty, beams.subspan(i * group_size_, group_size_),
+                       hypothesis_storage.subspan(i * group_size_ * max_length_, group_size_ * max_length_), max_length_);
   }
 
   next_beam_scores_ = parameters.p_device->Allocate<float>(batch_beam_size);
   next_beam_tokens_ = parameters.p_device->Allocate<int32_t>(batch_beam_size);
   next_beam_indices_ = parameters.p_device->Allocate<int32_t>(batch_beam_size);
 
-  // Space to store intermediate sequence
-  size_t const per_beam = (max_length_ * (max_length_ + 1)) / 2;
-  hypothesis_buffer_ = device.Allocate<int32_t>(batch_beam_size * per_beam);
-
   memset(next_beam_scores_.Span().data(), 0, next_beam_scores_.Span().size_bytes());
 
   // Initialize score of first beam of each group with 0 and the rest with -1e9.
   // This ensures that the beams in the same group don't produce same tokens every time.
   std::span<float> const beam_scores = next_beam_scores_.Span();
-  for (int i = 0; i < parameters.search.batch_size; i++) {
-    for (int j = 1; j < parameters.search.num_beams; j++) {
-      beam_scores[i * parameters.search.num_beams + j] = -1e9;
+  for (int i = 0; i < group_count_; i++) {
+    for (int j = 1; j < group_size_; j++) {
+      beam_scores[i * group_size_ + j] = -1e9;
     }
   }
 }
 
-void BeamSearchScorer::Process(Sequences& sequences,
-                               std::span<const float> next_scores,
-                               std::span<const int32_t> next_tokens,
-                               std::span<const int32_t> next_indices) {
+bool BeamSearchScorer::IsDone() const {
+  return std::all_of(beam_hyps_.begin(), beam_hyps_.end(), [](const BeamHypotheses& beam_hyp) { return beam_hyp.done_; });
+}
+
+void BeamSearchScorer::ProcessGroup(Sequences& sequences,
+                                    size_t group,
+                                    std::span<const float> next_scores,
+                                    std::span<const int32_t> next_tokens,
+                                    std::span<const int32_t> next_indices) {
   // Sequences shape is (batch_size * num_beams, total_sequence_length)
   // It contains word ID of whole sequence generated so far.
   // It is different from subgraph input_ids, which only need one word when past state is not empty.
@@ -98,76 +130,66 @@ void BeamSearchScorer::Process(Sequences& sequences,
   assert(next_scores.size() == next_tokens.size());
   assert(next_scores.size() == next_indices.size());
 
-  for (size_t batch = 0; batch < batch_size_; batch++) {
-    BeamHypotheses& beam_hyp = beam_hyps_[batch];
-    if (beam_hyp.done_) {
-      assert(beam_hyp.beams_used_ == num_beams_);  // Batch can only be done if all beams have been generated
+  BeamHypotheses& beam_hyp = beam_hyps_[group];
+  if (beam_hyp.done_) {
+    assert(beam_hyp.beams_used_ == group_size_);  // Group can only be done if all beams have been generated
 
-      // Pad the batch.
-      for (size_t j = 0; j < num_beams_; j++) {
-        next_beam_scores[batch * num_beams_ + j] = 0.0f;
-        next_beam_tokens[batch * num_beams_ + j] = pad_token_id_;
-        next_beam_indices[batch * num_beams_ + j] = 0;
-      }
-      continue;
+    // Pad the group.
+    for (size_t j = 0; j < group_size_; j++) {
+      next_beam_scores[group * group_size_ + j] = 0.0f;
+      next_beam_tokens[group * group_size_ + j] = pad_token_id_;
+      next_beam_indices[group * group_size_ + j] = 0;
     }
+    return;
+  }
 
-    // Next tokens for this sentence.
-    size_t beam_idx = 0;
-    size_t const top_k = 2 * num_beams_;
-    for (size_t j = 0; j < top_k; j++) {
-      int32_t const next_token = next_tokens[batch * top_k + j];
-      float const next_score = next_scores[batch * top_k + j];
-      int32_t const next_index = next_indices[batch * top_k + j];
-
-      int const batch_beam_idx = static_cast<int>(batch * num_beams_) + next_index;
-      // Add to generated hypotheses if end of sentence.
-      if ((eos_token_id_ >= 0) && (next_token == eos_token_id_)) {
-        bool const is_beam_token_worse_than_top_num_beams = (j >= num_beams_);
-        if (is_beam_token_worse_than_top_num_beams) {
-          continue;
-        }
-
-        // Clone the sequence and append to buffer.
-        std::span<const int32_t> src = sequences.GetSequence(batch_beam_idx).Span();
-        auto clone = hypothesis_buffer_.Span().subspan(hypothesis_buffer_used_, src.size());
-        hypothesis_buffer_used_ += clone.size();
-
-        copy(cpu_span{src}, cpu_span{clone});
-        beam_hyp.Add(clone, next_score);
-      } else {
-        // Add next predicted token since it is not eos_token.
-        next_beam_scores[batch * num_beams_ + beam_idx] = next_score;
-        next_beam_tokens[batch * num_beams_ + beam_idx] = next_token;
-        next_beam_indices[batch * num_beams_ + beam_idx] = batch_beam_idx;
-        ++beam_idx;
+  // Next tokens for this sentence.
+  size_t beam_idx = 0;
+  size_t const top_k = 2 * group_size_;
+  for (size_t j = 0; j < top_k; j++) {
+    int32_t const next_token = next_tokens[group * top_k + j];
+    float const next_score = next_scores[group * top_k + j];
+    int32_t const next_index = next_indices[group * top_k + j];
+
+    int const batch_beam_idx = static_cast<int>(group * group_size_) + next_index;
+    // Add to generated hypotheses if end of sentence.
+    if ((eos_token_id_ >= 0) && (next_token == eos_token_id_)) {
+      bool const is_beam_token_worse_than_top_num_beams = (j >= group_size_);
+      if (is_beam_token_worse_than_top_num_beams) {
+        continue;
       }
 
-      // Once the beam for next step is full, don't add more tokens to it.
-      if (beam_idx == num_beams_) {
-        break;
-      }
+      beam_hyp.Add(sequences.GetSequence(batch_beam_idx).Span(), next_score);
+    } else {
+      // Add next predicted token since it is not eos_token.
+      next_beam_scores[group * group_size_ + beam_idx] = next_score;
+      next_beam_tokens[group * group_size_ + beam_idx] = next_token;
+      next_beam_indices[group * group_size_ + beam_idx] = batch_beam_idx;
+      ++beam_idx;
     }
 
-    assert(beam_idx == num_beams_);
-    assert(static_cast<size_t>(hypothesis_buffer_used_) <= hypothesis_buffer_.size());
-
-    //  Check if we are done so that we can save a pad step if all(done)
-    if (static_cast<size_t>(beam_hyp.beams_used_) < num_beams_) {
-      continue;
+    // Once the beam for next step is full, don't add more tokens to it.
+    if (beam_idx == group_size_) {
+      break;
     }
+  }
 
-    if (!early_stopping_) {
-      std::span<const float> const topk_scores = next_scores.subspan(batch * num_beams_, top_k);
-      const auto best_sum_logprobs = std::max_element(topk_scores.begin(), topk_scores.end());
-      if (beam_hyp.CanImprove(*best_sum_logprobs, static_cast<int>(sequence_length))) {
-        continue;
-      }
-    }
+  assert(beam_idx == group_size_);
 
-    beam_hyp.done_ = true;
-    not_done_count_--;
+  //  Check if we are done so that we can save a pad step if all(done)
+  if (static_cast<size_t>(beam_hyp.beams_used_) < group_size_) {
+    return;
+  }
+
+  if (!early_stopping_) {
+    std::span<const float> const topk_scores = next_scores.subspan(group * top_k, top_k);
+    const auto best_sum_logprobs = std::max_element(topk_scores.begin(), topk_scores.end());
+    if (beam_hyp.CanImprove(*best_sum_logprobs, static_cast<int>(sequence_length))) {
+      return;
+    }
   }
+
+  beam_hyp.done_ = true;
 }
 
 void BeamSearchScorer::Finalize(Sequences& sequences,
@@ -175,28 +197,37 @@ void BeamSearchScorer::Finalize(Sequences& sequences,
   auto next_beam_scores = next_beam_scores_.Span();
 
   // Finalize all open beam hypotheses and add to generated hypotheses.
-  for (size_t batch_index = 0; batch_index < batch_size_; batch_index++) {
-    BeamHypotheses& beam_hyp = beam_hyps_[batch_index];
+  ParallelFor(group_count_, [&](size_t group) {
+    BeamHypotheses& beam_hyp = beam_hyps_[group];
     if (beam_hyp.done_) {
-      continue;
+      return;
     }
 
-    for (size_t beam_index = 0; beam_index < num_beams_; beam_index++) {
-      size_t const batch_beam_index = batch_index * num_beams_ + beam_index;
-      float const final_score = next_beam_scores[batch_beam_index];
-
-      // Clone the sequence and append to buffer.
-      std::span<const int32_t> src = sequences.GetSequence(batch_beam_index).Span();
-      auto clone = hypothesis_buffer_.Span().subspan(hypothesis_buffer_used_, src.size());
-      hypothesis_buffer_used_ += clone.size();
-      copy(cpu_span{src}, cpu_span{clone});
-      beam_hyp.Add(clone, final_score);
+    for (size_t beam_index = 0; beam_index < group_size_; beam_index++) {
+      size_t const batch_beam_index = group * group_size_ + beam_index;
+      beam_hyp.Add(sequences.GetSequence(batch_beam_index).Span(), next_beam_scores[batch_beam_index]);
     }
-  }
+  });
 }
 
 DeviceSpan<int32_t> BeamSearchScorer::GetBeamHypotheses(size_t batch_id, size_t beam_id) {
-  auto hypothesis = beam_hyps_[batch_id].GetHypothesis(beam_id);
+  std::span<int32_t> hypothesis;
+  if (num_beam_groups_ == 1) {
+    hypothesis = beam_hyps_[batch_id].GetHypothesis(beam_id);
+  } else {
+    // The best hypotheses of the batch entry over all of its groups, each group's are already sorted by score
+    std::vector<HypothesisScore> candidates;
+    for (size_t group = batch_id * num_beam_groups_; group < (batch_id + 1) * num_beam_groups_; group++) {
+      const auto& beam_hyp = beam_hyps_[group];
+      candidates.insert(candidates.end(), beam_hyp.beams_.begin(), beam_hyp.beams_.begin() + beam_hyp.beams_used_);
+    }
+    if (beam_id >= candidates.size())
+      throw std::runtime_error("Beam hypothesis " + std::to_string(beam_id) + " of batch entry " + std::to_string(batch_id) + " doesn't exist");
+    // Stable, so that ties are in the same order for every beam_id
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](const HypothesisScore& a, const HypothesisScore& b) { return a.score > b.score; });
+    hypothesis = candidates[beam_id].hypothesis;
+  }
   // Translate the hypothesis span back to the original device buffer span
   return hypothesis_buffer_.subspan(hypothesis.data() - hypothesis_buffer_.Span().data(), hypothesis.size());
 }
@@ -11,11 +11,12 @@ struct HypothesisScore {
 };
 
 struct BeamHypotheses {
-  // As these are constructed as an uninitialized array of memory, we need an Init method
-  void Init(float length_penalty, std::span<HypothesisScore> beams);
+  // As these are constructed as an uninitialized array of memory, we need an Init method.
+  // 'storage' holds beams.size() hypotheses of up to max_length tokens each.
+  void Init(float length_penalty, std::span<HypothesisScore> beams, std::span<int32_t> storage, size_t max_length);
 
-  // Add a new hypothesis
-  void Add(std::span<int32_t> hypothesis, float sum_logprobs);
+  // Add a copy of 'sequence' as a new hypothesis, if it scores high enough to be kept
+  void Add(std::span<const int32_t> sequence, float sum_logprobs);
 
   // Return true if this beats the worst score in the hypothesis
   bool CanImprove(float best_sum_logprobs, int current_length) const;
@@ -25,23 +26,32 @@ struct BeamHypotheses {
   // TODO(aciddelgado): Methods to get all hypotheses and scores
 
   std::span<HypothesisScore> beams_;  // Beam width sized array of hypotheses, sorted by highest scoring
+  std::span<int32_t> storage_;        // Token storage of the hypotheses in beams_, max_length_ tokens per hypothesis
+  size_t max_length_;
   int beams_used_;                    // Number of elements used in beams_
   float length_penalty_;
   bool done_;
 };
 
+// The num_beams beams of a batch entry are split into num_beam_groups groups of consecutive beams (diverse beam search).
+// Every group is searched like a batch entry of its own, with its own hypotheses, and the final hypotheses of a batch
+// entry are the best ones of all of its groups. Without groups, a group is a batch entry.
 struct BeamSearchScorer {
   BeamSearchScorer(const GeneratorParams& parameters);
 
-  void Process(Sequences& sequences,
-               std::span<const float> next_scores,
-               std::span<const int32_t> next_tokens,
-               std::span<const int32_t> next_indices);
+  // Selects the beams of the next step of group 'group_index' (batch_index * num_beam_groups + group) from its
+  // 2 * group size candidates at the same offset of next_scores/tokens/indices, next_indices being beam indices within
+  // the group. Different groups can be processed in parallel.
+  void ProcessGroup(Sequences& sequences,
+                    size_t group_index,
+                    std::span<const float> next_scores,
+                    std::span<const int32_t> next_tokens,
+                    std::span<const int32_t> next_indices);
 
   void Finalize(Sequences& sequences,
                 size_t num_return_sequences);
 
-  bool IsDone() const { return not_done_count_ == 0; }
+  bool IsDone() const;
 
   DeviceSpan<float> GetNextScores() { return next_beam_scores_; }
   DeviceSpan<int32_t> GetNextTokens() { return next_beam_tokens_; }
@@ -50,23 +60,23 @@ struct BeamSearchScorer {
 
  private:
   int batch_size_;
-  int num_beams_;
+  int num_beam_groups_;
+  int group_count_;  // batch_size_ * num_beam_groups_
+  int group_size_;   // num_beams / num_beam_groups_
   int max_length_;
   int pad_token_id_;
   int eos_token_id_;
   bool early_stopping_;
-  int not_done_count_;  // When zero, every batch entry is done (starts at batch_size_)
 
   DeviceSpan<float> next_beam_scores_;
   DeviceSpan<int32_t> next_beam_tokens_;
   DeviceSpan<int32_t> next_beam_indices_;
 
-  DeviceSpan<int32_t> hypothesis_buffer_;  // Allocated buffer to hold all hypotheses
-  size_t hypothesis_buffer_used_{};        // Offset of available buffer, or length of used buffer.
+  DeviceSpan<int32_t> hypothesis_buffer_;  // group_size_ hypotheses of max_length_ tokens for every group, see BeamHypotheses::storage_
 
-  std::unique_ptr<HypothesisScore[]> hypothesis_scores_ptr_;  // num_beams_ * batch_size_, divided into num_beams_ chunks per BeamHypothesis in beam_hyps_
+  std::unique_ptr<HypothesisScore[]> hypothesis_scores_ptr_;  // group_size_ * group_count_, divided into group_size_ chunks per BeamHypothesis in beam_hyps_
   std::unique_ptr<BeamHypotheses[]> beam_hyps_ptr_;
-  std::span<BeamHypotheses> beam_hyps_;  // Shape is batch_size_
+  std::span<BeamHypotheses> beam_hyps_;  // Shape is group_count_
 };
 
 }  // namespace Generators
\ No newline at end of file
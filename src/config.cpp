@@ -3,7 +3,10 @@
 #include "generators.h"
 #include "runtime_settings.h"
 #include "json.h"
+#include "models/model.h"
 #include <fstream>
+#include <limits>
+#include <mutex>
 #include <sstream>
 
 namespace Generators {
@@ -87,12 +90,16 @@ struct SessionOptions_Element : JSON::Element {
       v_.ep_context_embed_mode = JSON::Get<std::string_view>(value);
     else if (name == "ep_context_file_path")
       v_.ep_context_file_path = JSON::Get<std::string_view>(value);
+    else if (name == "optimized_model_cache_dir")
+      v_.optimized_model_cache_dir = JSON::Get<std::string_view>(value);
     else if (name == "intra_op_num_threads")
       v_.intra_op_num_threads = static_cast<int>(JSON::Get<double>(value));
     else if (name == "inter_op_num_threads")
       v_.inter_op_num_threads = static_cast<int>(JSON::Get<double>(value));
     else if (name == "log_severity_level")
       v_.log_severity_level = static_cast<int>(JSON::Get<double>(value));
+    else if (name == "numa_node")
+      v_.numa_node = static_cast<int>(JSON::Get<double>(value));
     else if (name == "enable_cpu_mem_arena")
       v_.enable_cpu_mem_arena = JSON::Get<bool>(value);
     else if (name == "enable_mem_pattern")
@@ -107,6 +114,16 @@ struct SessionOptions_Element : JSON::Element {
       v_.ep_context_enable = JSON::Get<bool>(value);
     else if (name == "use_env_allocators")
       v_.use_env_allocators = JSON::Get<bool>(value);
+    else if (name == "mmap_external_data")
+      v_.mmap_external_data = JSON::Get<bool>(value);
+    else if (name == "save_prepacked_weights")
+      v_.save_prepacked_weights = JSON::Get<bool>(value);
+    else if (name == "share_weights")
+      v_.share_weights = JSON::Get<bool>(value);
+    else if (name == "active_performance_mode")
+      v_.active_performance_mode = JSON::Get<std::string_view>(value);
+    else if (name == "idle_performance_mode")
+      v_.idle_performance_mode = JSON::Get<std::string_view>(value);
     else if (name == "graph_optimization_level")
       v_.graph_optimization_level = GetGraphOptimizationLevel(JSON::Get<std::string_view>(value));
     else
@@ -164,6 +181,18 @@ struct Inputs_Element : JSON::Element {
       v_.current_sequence_length = JSON::Get<std::string_view>(value);
     } else if (name == "past_sequence_length") {
       v_.past_sequence_length = JSON::Get<std::string_view>(value);
+    } else if (name == "block_table") {
+      v_.block_table = JSON::Get<std::string_view>(value);
+    } else if (name == "last_token_indices") {
+      v_.last_token_indices = JSON::Get<std::string_view>(value);
+    } else if (name == "cache_indirection") {
+      v_.cache_indirection = JSON::Get<std::string_view>(value);
+    } else if (name == "adapter_ids") {
+      v_.adapter_ids = JSON::Get<std::string_view>(value);
+    } else if (name == "seqlens_k") {
+      v_.seqlens_k = JSON::Get<std::string_view>(value);
+    } else if (name == "total_sequence_length") {
+      v_.total_sequence_length = JSON::Get<std::string_view>(value);
     } else
       throw JSON::unknown_value_error{};
   }
@@ -184,6 +213,16 @@ struct Outputs_Element : JSON::Element {
       v_.present_value_names = JSON::Get<std::string_view>(value);
     } else if (name == "present_names") {
       v_.present_names = JSON::Get<std::string_view>(value);
+    } else if (name == "medusa_logits") {
+      v_.medusa_logits = JSON::Get<std::string_view>(value);
+    } else if (name == "logits_top_k_values") {
+      v_.logits_top_k_values = JSON::Get<std::string_view>(value);
+    } else if (name == "logits_top_k_indices") {
+      v_.logits_top_k_indices = JSON::Get<std::string_view>(value);
+    } else if (name == "exit_logits") {
+      v_.exit_logits = JSON::Get<std::string_view>(value);
+    } else if (name == "hidden_states") {
+      v_.hidden_states = JSON::Get<std::string_view>(value);
     } else if (name == "cross_present_key_names") {
       v_.cross_present_key_names = JSON::Get<std::string_view>(value);
     } else if (name == "cross_present_value_names") {
@@ -286,6 +325,39 @@ struct Pipeline_Element : JSON::Element {
   PipelineModelObject_Element object_{v_};
 };
 
+// Set before each array, as the arrays may live in optionals that are only created when they're parsed.
+// The array replaces the existing values.
+struct IntArray_Element : JSON::Element {
+  IntArray_Element& Set(std::vector<int>& v) {
+    v_ = &v;
+    v_->clear();
+    return *this;
+  }
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    v_->push_back(static_cast<int>(JSON::Get<double>(value)));
+  }
+
+ private:
+  std::vector<int>* v_{};
+};
+
+// Like IntArray_Element, set before each array
+struct FloatArray_Element : JSON::Element {
+  FloatArray_Element& Set(std::vector<float>& v) {
+    v_ = &v;
+    v_->clear();
+    return *this;
+  }
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    v_->push_back(static_cast<float>(JSON::Get<double>(value)));
+  }
+
+ private:
+  std::vector<float>* v_{};
+};
+
 struct SlidingWindow_Element : JSON::Element {
   explicit SlidingWindow_Element(std::optional<Config::Model::Decoder::SlidingWindow>& v) : v_{v} {}
 
@@ -298,8 +370,114 @@ struct SlidingWindow_Element : JSON::Element {
       throw JSON::unknown_value_error{};
   }
 
+  Element& OnArray(std::string_view name) override {
+    if (name == "window_sizes")
+      return window_sizes_.Set(v_->window_sizes);
+    throw JSON::unknown_value_error{};
+  }
+
  private:
   std::optional<Config::Model::Decoder::SlidingWindow>& v_;
+  IntArray_Element window_sizes_;
+};
+
+struct TensorParallel_Element : JSON::Element {
+  explicit TensorParallel_Element(std::optional<Config::Model::Decoder::TensorParallel>& v) : v_{v} {}
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    if (name == "world_size") {
+      v_->world_size = static_cast<int>(JSON::Get<double>(value));
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+ private:
+  std::optional<Config::Model::Decoder::TensorParallel>& v_;
+};
+
+struct PagedKeyValueCache_Element : JSON::Element {
+  explicit PagedKeyValueCache_Element(std::optional<Config::Model::Decoder::PagedKeyValueCache>& v) : v_{v} {}
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    if (name == "block_size") {
+      v_->block_size = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "num_blocks") {
+      v_->num_blocks = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "enable_prefix_cache") {
+      v_->enable_prefix_cache = JSON::Get<bool>(value);
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+ private:
+  std::optional<Config::Model::Decoder::PagedKeyValueCache>& v_;
+};
+
+struct KeyValueCacheQuantization_Element : JSON::Element {
+  explicit KeyValueCacheQuantization_Element(std::optional<Config::Model::Decoder::KeyValueCacheQuantization>& v) : v_{v} {}
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    if (name == "type") {
+      v_->type = JSON::Get<std::string_view>(value);
+      if (v_->type != "int8" && v_->type != "fp8")
+        throw std::runtime_error("kv_cache_quantization type must be \"int8\" or \"fp8\", is \"" + v_->type + "\"");
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+ private:
+  std::optional<Config::Model::Decoder::KeyValueCacheQuantization>& v_;
+};
+
+struct EarlyExit_Element : JSON::Element {
+  explicit EarlyExit_Element(std::optional<Config::Model::Decoder::EarlyExit>& v) : v_{v} {}
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    if (name == "threshold") {
+      v_->threshold = static_cast<float>(JSON::Get<double>(value));
+    } else if (name == "num_draft_tokens") {
+      v_->num_draft_tokens = static_cast<int>(JSON::Get<double>(value));
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+ private:
+  std::optional<Config::Model::Decoder::EarlyExit>& v_;
+};
+
+struct RotaryEmbedding_Element : JSON::Element {
+  explicit RotaryEmbedding_Element(std::optional<Config::Model::Decoder::RotaryEmbedding>& v) : v_{v} {}
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    if (name == "theta") {
+      v_->theta = static_cast<float>(JSON::Get<double>(value));
+    } else if (name == "dim") {
+      v_->dim = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "interleaved") {
+      v_->interleaved = JSON::Get<bool>(value);
+    } else if (name == "position_scale") {
+      v_->position_scale = static_cast<float>(JSON::Get<double>(value));
+    } else if (name == "short_mscale") {
+      v_->short_mscale = static_cast<float>(JSON::Get<double>(value));
+    } else if (name == "long_mscale") {
+      v_->long_mscale = static_cast<float>(JSON::Get<double>(value));
+    } else if (name == "original_context_length") {
+      v_->original_context_length = static_cast<int>(JSON::Get<double>(value));
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+  Element& OnArray(std::string_view name) override {
+    if (name == "short_factor")
+      return factor_.Set(v_->short_factor);
+    if (name == "long_factor")
+      return factor_.Set(v_->long_factor);
+    throw JSON::unknown_value_error{};
+  }
+
+ private:
+  std::optional<Config::Model::Decoder::RotaryEmbedding>& v_;
+  FloatArray_Element factor_;
 };
 
 struct Decoder_Element : JSON::Element {
@@ -318,6 +496,14 @@ struct Decoder_Element : JSON::Element {
       v_.num_hidden_layers = static_cast<int>(JSON::Get<double>(value));
     } else if (name == "head_size") {
       v_.head_size = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "cross_cache_per_batch_entry") {
+      v_.cross_cache_per_batch_entry = JSON::Get<bool>(value);
+    } else if (name == "run_pipeline_concurrently") {
+      v_.run_pipeline_concurrently = JSON::Get<bool>(value);
+    } else if (name == "pipeline_micro_batches") {
+      v_.pipeline_micro_batches = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "logits_top_k") {
+      v_.logits_top_k = static_cast<int>(JSON::Get<double>(value));
     } else
       throw JSON::unknown_value_error{};
   }
@@ -336,22 +522,50 @@ struct Decoder_Element : JSON::Element {
       v_.sliding_window = Config::Model::Decoder::SlidingWindow{};
       return sliding_window_;
     }
+    if (name == "paged_kv_cache") {
+      v_.paged_kv_cache = Config::Model::Decoder::PagedKeyValueCache{};
+      return paged_kv_cache_;
+    }
+    if (name == "kv_cache_quantization") {
+      v_.kv_cache_quantization = Config::Model::Decoder::KeyValueCacheQuantization{};
+      return kv_cache_quantization_;
+    }
+    if (name == "tensor_parallel") {
+      v_.tensor_parallel = Config::Model::Decoder::TensorParallel{};
+      return tensor_parallel_;
+    }
+    if (name == "early_exit") {
+      v_.early_exit = Config::Model::Decoder::EarlyExit{};
+      return early_exit_;
+    }
+    if (name == "rotary_embedding") {
+      v_.rotary_embedding = Config::Model::Decoder::RotaryEmbedding{};
+      return rotary_embedding_;
+    }
     throw JSON::unknown_value_error{};
   }
 
   Element& OnArray(std::string_view name) override {
     if (name == "pipeline")
       return pipeline_;
+    if (name == "adapter_names")
+      return adapter_names_;
     throw JSON::unknown_value_error{};
   }
 
  private:
   Config::Model::Decoder& v_;
+  StringArray_Element adapter_names_{v_.adapter_names};
   SessionOptions_Element session_options_{v_.session_options};
   Inputs_Element inputs_{v_.inputs};
   Outputs_Element outputs_{v_.outputs};
   Pipeline_Element pipeline_{v_.pipeline};
   SlidingWindow_Element sliding_window_{v_.sliding_window};
+  PagedKeyValueCache_Element paged_kv_cache_{v_.paged_kv_cache};
+  KeyValueCacheQuantization_Element kv_cache_quantization_{v_.kv_cache_quantization};
+  TensorParallel_Element tensor_parallel_{v_.tensor_parallel};
+  EarlyExit_Element early_exit_{v_.early_exit};
+  RotaryEmbedding_Element rotary_embedding_{v_.rotary_embedding};
 };
 
 struct VisionInputs_Element : JSON::Element {
@@ -390,6 +604,10 @@ struct Vision_Element : JSON::Element {
   void OnValue(std::string_view name, JSON::Value value) override {
     if (name == "filename") {
       v_.filename = JSON::Get<std::string_view>(value);
+    } else if (name == "feature_cache_size") {
+      v_.feature_cache_size = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "device_preprocessing") {
+      v_.device_preprocessing = JSON::Get<bool>(value);
     } else
       throw JSON::unknown_value_error{};
   }
@@ -519,6 +737,43 @@ struct PromptTemplates_Element : JSON::Element {
   }
 };
 
+struct Warmup_Element : JSON::Element {
+  explicit Warmup_Element(std::optional<Config::Model::Warmup>& v) : v_{v} {}
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    if (name == "decode_steps") {
+      v_->decode_steps = static_cast<int>(JSON::Get<double>(value));
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+  Element& OnArray(std::string_view name) override {
+    if (name == "batch_sizes")
+      return lengths_.Set(v_->batch_sizes);
+    if (name == "prompt_lengths")
+      return lengths_.Set(v_->prompt_lengths);
+    throw JSON::unknown_value_error{};
+  }
+
+ private:
+  std::optional<Config::Model::Warmup>& v_;
+  IntArray_Element lengths_;
+};
+
+struct DeviceMemoryPool_Element : JSON::Element {
+  explicit DeviceMemoryPool_Element(std::optional<Config::Model::DeviceMemoryPool>& v) : v_{v} {}
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    if (name == "release_threshold") {
+      v_->release_threshold = static_cast<int64_t>(JSON::Get<double>(value));
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+ private:
+  std::optional<Config::Model::DeviceMemoryPool>& v_;
+};
+
 struct Model_Element : JSON::Element {
   explicit Model_Element(Config::Model& v) : v_{v} {}
 
@@ -539,6 +794,10 @@ struct Model_Element : JSON::Element {
       v_.decoder_start_token_id = static_cast<int>(JSON::Get<double>(value));
     } else if (name == "sep_token_id") {
       v_.sep_token_id = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "device_arena") {
+      v_.device_arena = JSON::Get<bool>(value);
+    } else if (name == "tokenizer_cache_size") {
+      v_.tokenizer_cache_size = static_cast<int>(JSON::Get<double>(value));
     } else
       throw JSON::unknown_value_error{};
   }
@@ -565,6 +824,14 @@ struct Model_Element : JSON::Element {
     if (name == "prompt_templates") {
       return prompt_templates_;
     }
+    if (name == "warmup") {
+      v_.warmup = Config::Model::Warmup{};
+      return warmup_;
+    }
+    if (name == "device_memory_pool") {
+      v_.device_memory_pool = Config::Model::DeviceMemoryPool{};
+      return device_memory_pool_;
+    }
     throw JSON::unknown_value_error{};
   }
 
@@ -576,6 +843,55 @@ struct Model_Element : JSON::Element {
   Vision_Element vision_{v_.vision};
   Embedding_Element embedding_{v_.embedding};
   PromptTemplates_Element prompt_templates_{v_.prompt_templates};
+  Warmup_Element warmup_{v_.warmup};
+  DeviceMemoryPool_Element device_memory_pool_{v_.device_memory_pool};
+};
+
+struct LogitBias_Element : JSON::Element {
+  explicit LogitBias_Element(std::vector<std::pair<int32_t, float>>& v) : v_{v} {}
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    v_.emplace_back(std::stoi(std::string{name}), static_cast<float>(JSON::Get<double>(value)));
+  }
+
+ private:
+  std::vector<std::pair<int32_t, float>>& v_;
+};
+
+struct StopTokenSequence_Element : JSON::Element {
+  explicit StopTokenSequence_Element(std::vector<std::vector<int32_t>>& v) : v_{v} {}
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    v_.back().push_back(static_cast<int32_t>(JSON::Get<double>(value)));
+  }
+
+ private:
+  std::vector<std::vector<int32_t>>& v_;
+};
+
+// "stop_token_sequences": [[token_id, ...], ...]
+struct StopTokenSequences_Element : JSON::Element {
+  explicit StopTokenSequences_Element(std::vector<std::vector<int32_t>>& v) : v_{v} {}
+
+  Element& OnArray(std::string_view name) override {
+    v_.emplace_back();
+    return sequence_;
+  }
+
+ private:
+  std::vector<std::vector<int32_t>>& v_;
+  StopTokenSequence_Element sequence_{v_};
+};
+
+struct StopStrings_Element : JSON::Element {
+  explicit StopStrings_Element(std::vector<std::string>& v) : v_{v} {}
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    v_.emplace_back(JSON::Get<std::string_view>(value));
+  }
+
+ private:
+  std::vector<std::string>& v_;
 };
 
 struct Search_Element : JSON::Element {
@@ -596,32 +912,89 @@ struct Search_Element : JSON::Element {
       v_.top_k = static_cast<int>(JSON::Get<double>(value));
     } else if (name == "top_p") {
       v_.top_p = static_cast<float>(JSON::Get<double>(value));
+    } else if (name == "min_p") {
+      v_.min_p = static_cast<float>(JSON::Get<double>(value));
+    } else if (name == "typical_p") {
+      v_.typical_p = static_cast<float>(JSON::Get<double>(value));
     } else if (name == "temperature") {
       v_.temperature = static_cast<float>(JSON::Get<double>(value));
     } else if (name == "repetition_penalty") {
       v_.repetition_penalty = static_cast<float>(JSON::Get<double>(value));
     } else if (name == "length_penalty") {
       v_.length_penalty = static_cast<float>(JSON::Get<double>(value));
+    } else if (name == "frequency_penalty") {
+      v_.frequency_penalty = static_cast<float>(JSON::Get<double>(value));
+    } else if (name == "presence_penalty") {
+      v_.presence_penalty = static_cast<float>(JSON::Get<double>(value));
     } else if (name == "no_repeat_ngram_size") {
       v_.no_repeat_ngram_size = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "top_logprobs") {
+      v_.top_logprobs = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "num_beam_groups") {
+      v_.num_beam_groups = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "beam_done_check_interval") {
+      v_.beam_done_check_interval = static_cast<int>(JSON::Get<double>(value));
     } else if (name == "diversity_penalty") {
       v_.diversity_penalty = static_cast<float>(JSON::Get<double>(value));
     } else if (name == "length_penalty") {
       v_.length_penalty = static_cast<float>(JSON::Get<double>(value));
     } else if (name == "random_seed") {
       v_.random_seed = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "prefill_chunk_size") {
+      v_.prefill_chunk_size = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "prompt_lookup_num_tokens") {
+      v_.prompt_lookup_num_tokens = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "prompt_lookup_ngram_size") {
+      v_.prompt_lookup_ngram_size = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "attention_sinks") {
+      v_.attention_sinks = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "attention_sink_window") {
+      v_.attention_sink_window = static_cast<int>(JSON::Get<double>(value));
+    } else if (name == "stream_priority") {
+      v_.stream_priority = static_cast<int>(JSON::Get<double>(value));
     } else if (name == "do_sample") {
       v_.do_sample = JSON::Get<bool>(value);
     } else if (name == "past_present_share_buffer") {
       v_.past_present_share_buffer = JSON::Get<bool>(value);
     } else if (name == "early_stopping") {
       v_.early_stopping = JSON::Get<bool>(value);
+    } else if (name == "compact_finished_sequences") {
+      v_.compact_finished_sequences = JSON::Get<bool>(value);
+    } else if (name == "ragged_prefill") {
+      v_.ragged_prefill = JSON::Get<bool>(value);
+    } else if (name == "pipelined_decode") {
+      v_.pipelined_decode = JSON::Get<bool>(value);
+    } else if (name == "graph_capture_batch_buckets") {
+      v_.graph_capture_batch_buckets = JSON::Get<bool>(value);
     } else
       throw JSON::unknown_value_error{};
   }
 
+  Element& OnObject(std::string_view name) override {
+    if (name == "logit_bias") {
+      v_.logit_bias.clear();
+      return logit_bias_;
+    }
+    throw JSON::unknown_value_error{};
+  }
+
+  Element& OnArray(std::string_view name) override {
+    if (name == "stop_token_sequences") {
+      v_.stop_token_sequences.clear();
+      return stop_token_sequences_;
+    }
+    if (name == "stop_strings") {
+      v_.stop_strings.clear();
+      return stop_strings_;
+    }
+    throw JSON::unknown_value_error{};
+  }
+
  private:
   Config::Search& v_;
+  LogitBias_Element logit_bias_{v_.logit_bias};
+  StopTokenSequences_Element stop_token_sequences_{v_.stop_token_sequences};
+  StopStrings_Element stop_strings_{v_.stop_strings};
 };
 
 void SetSearchNumber(Config::Search& search, std::string_view name, double value) {
@@ -647,7 +1020,7 @@ void SetProviderOption(Config& config, std::string_view provider_name, std::stri
   JSON::Parse(element, json.str());
 }
 
-bool IsCudaGraphEnabled(Config::SessionOptions& session_options) {
+bool IsCudaGraphEnabled(const Config::SessionOptions& session_options) {
   for (const auto& provider_options : session_options.provider_options) {
     if (provider_options.name == "cuda") {
       for (const auto& value : provider_options.options) {
@@ -656,7 +1029,11 @@ bool IsCudaGraphEnabled(Config::SessionOptions& session_options) {
         }
       }
     } else if (provider_options.name == "dml") {
-      return true;
+      for (const auto& value : provider_options.options) {
+        if (value.first == "enable_graph_capture") {
+          return value.second == "1";
+        }
+      }
     }
   }
   return false;
@@ -693,48 +1070,87 @@ struct RootObject_Element : JSON::Element {
   JSON::Element& t_;
 };
 
-void ParseConfig(const fs::path& filename, std::string_view json_overlay, Config& config) {
-  std::ifstream file = filename.open(std::ios::binary | std::ios::ate);
-  if (!file.is_open()) {
+// The file is mapped rather than read, the parser only copies the names and values the config keeps
+std::unique_ptr<MappedFile> MapConfigFile(const fs::path& filename) {
+  if (!filename.exists())
     throw std::runtime_error("Error opening " + filename.string());
-  }
-  std::streamsize const size = file.tellg();
-  file.seekg(0, std::ios::beg);
+  return std::make_unique<MappedFile>(filename);
+}
 
-  std::vector<char> buffer(size);
-  if (!file.read(buffer.data(), size)) {
-    throw std::runtime_error("Error reading " + filename.string());
+void OverlayConfig(Config& config, std::string_view json_overlay) {
+  Root_Element root{config};
+  RootObject_Element root_object{root};
+  try {
+    JSON::Parse(root_object, json_overlay);
+  } catch (const std::exception& message) {
+    std::ostringstream oss;
+    oss << "Error encountered while parsing config overlay: " << message.what();
+    throw std::runtime_error(oss.str());
   }
+}
 
+void ParseConfig(const fs::path& filename, std::string_view document, std::string_view json_overlay, Config& config) {
   Root_Element root{config};
   RootObject_Element root_object{root};
   try {
-    JSON::Parse(root_object, std::string_view(buffer.data(), buffer.size()));
+    JSON::Parse(root_object, document);
   } catch (const std::exception& message) {
     std::ostringstream oss;
     oss << "Error encountered while parsing '" << filename.string() << "' " << message.what();
     throw std::runtime_error(oss.str());
   }
 
-  if (!json_overlay.empty()) {
-    try {
-      JSON::Parse(root_object, json_overlay);
-    } catch (const std::exception& message) {
-      std::ostringstream oss;
-      oss << "Error encountered while parsing config overlay: " << message.what();
-      throw std::runtime_error(oss.str());
-    }
-  }
+  if (!json_overlay.empty())
+    OverlayConfig(config, json_overlay);
+
+  if (config.model.context_length == 0)
+    throw std::runtime_error("model context_length is 0 or was not set. It must be greater than 0");
+
+  if (config.search.max_length == 0)
+    config.search.max_length = config.model.context_length;
 }
 
 Config::Config(const fs::path& path, std::string_view json_overlay) : config_path{path} {
-  ParseConfig(path / "genai_config.json", json_overlay, *this);
+  const auto filename = path / "genai_config.json";
+  const auto file = MapConfigFile(filename);
+  ParseConfig(filename, {file->data_.data(), file->data_.size()}, json_overlay, *this);
+}
 
-  if (model.context_length == 0)
-    throw std::runtime_error("model context_length is 0 or was not set. It must be greater than 0");
+namespace {
+
+// The configs that LoadConfig parsed, keyed by their path and overlay, with the genai_config.json they were parsed from
+struct ConfigCache {
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::pair<std::string, std::shared_ptr<const Config>>> configs_;
+};
+
+ConfigCache& GetConfigCache() {
+  static ConfigCache cache;
+  return cache;
+}
+
+}  // namespace
+
+std::unique_ptr<Config> LoadConfig(const fs::path& path, std::string_view json_overlay) {
+  const auto filename = path / "genai_config.json";
+  const auto file = MapConfigFile(filename);
+  const std::string_view document{file->data_.data(), file->data_.size()};
+  const auto key = path.string() + '\n' + std::string{json_overlay};
+
+  auto& cache = GetConfigCache();
+  {
+    std::scoped_lock lock{cache.mutex_};
+    if (auto it = cache.configs_.find(key); it != cache.configs_.end() && it->second.first == document)
+      return std::make_unique<Config>(*it->second.second);
+  }
+
+  auto config = std::make_unique<Config>();
+  config->config_path = path;
+  ParseConfig(filename, document, json_overlay, *config);
 
-  if (search.max_length == 0)
-    search.max_length = model.context_length;
+  std::scoped_lock lock{cache.mutex_};
+  cache.configs_[key] = {std::string{document}, std::make_shared<const Config>(*config)};
+  return config;
 }
 
 void Config::AddMapping(const std::string& nominal_name, const std::string& graph_name) {
@@ -755,4 +1171,50 @@ std::pair<std::string, bool> Config::GetGraphName(const std::string& nominal_nam
   return {it->second, true};
 }
 
+std::vector<int> GetPromptWindowSizes(const Config::Model::Decoder::SlidingWindow& sliding_window, size_t prompt_length) {
+  const size_t window_size = static_cast<size_t>(sliding_window.window_size);
+  std::vector<int> prompt_window_sizes(prompt_length / window_size, sliding_window.window_size);
+  const size_t remainder = prompt_length % window_size;
+  if (remainder == 0)
+    return prompt_window_sizes;
+
+  std::vector<size_t> sizes{window_size};
+  for (int size : sliding_window.window_sizes) {
+    if (size <= 0 || size >= sliding_window.window_size)
+      throw std::runtime_error("sliding_window window_sizes must be positive and smaller than window_size, got " + std::to_string(size));
+    sizes.push_back(static_cast<size_t>(size));
+  }
+  std::sort(sizes.begin(), sizes.end(), std::greater<>{});
+
+  // window_counts[total] is the fewest windows adding up to exactly total tokens. A single full size window always
+  // covers the remainder, so larger totals are never needed.
+  constexpr size_t c_no_windows = std::numeric_limits<size_t>::max();
+  std::vector<size_t> window_counts(window_size + 1, c_no_windows);
+  window_counts[0] = 0;
+  for (size_t total = 1; total <= window_size; ++total) {
+    for (size_t size : sizes) {
+      if (size <= total && window_counts[total - size] != c_no_windows)
+        window_counts[total] = std::min(window_counts[total], window_counts[total - size] + 1);
+    }
+  }
+
+  // The least padding first, then the fewest windows
+  size_t total = remainder;
+  while (window_counts[total] == c_no_windows)
+    total++;
+
+  // Taking the largest fitting window each time orders them largest first, which keeps all of the padding in front of
+  // the prompt in the first window
+  while (total > 0) {
+    for (size_t size : sizes) {
+      if (size <= total && window_counts[total - size] == window_counts[total] - 1) {
+        prompt_window_sizes.push_back(static_cast<int>(size));
+        total -= size;
+        break;
+      }
+    }
+  }
+  return prompt_window_sizes;
+}
+
 }  // namespace Generators
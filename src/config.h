@@ -46,6 +46,16 @@ struct Config {
     // TODO(baijumeswani): Sharing env allocators across sessions leads to crashes on windows and iOS.
     //                     Identify the reason for the crash to enable allocator sharing by default.
     bool use_env_allocators{};
+    bool mmap_external_data{};  // Map the model's external data file (<filename>.data) into memory instead of reading it
+    std::optional<std::string> optimized_model_cache_dir;  // Directory to save the optimized model (or EP context model) in and load it from on the next start
+    bool save_prepacked_weights{};  // With optimized_model_cache_dir, the cache entry also stores the weights prepacked for the EP's kernels
+    bool share_weights{};           // The weights in the external data file are shared with every model of the process that loads the file with share_weights, whatever its other session options
+    std::optional<int> numa_node;   // (Linux) The session's threads run on the CPUs of this NUMA node, and its weights are loaded into the node's memory
+    // (QNN, decoder only) The HTP performance mode (like "burst") while the model runs, and the one (like "low_power_saver")
+    // it drops to once no generator is running it (only used with an active mode). Unset, the htp_performance_mode
+    // provider option applies all along.
+    std::optional<std::string> active_performance_mode;
+    std::optional<std::string> idle_performance_mode;
 
     std::vector<ProviderOptions> provider_options;
     std::optional<GraphOptimizationLevel> graph_optimization_level;
@@ -62,6 +72,8 @@ struct Config {
     int decoder_start_token_id{};    // If an encoder-decoder model starts decoding with a different token than bos, the id of that token.
     int vocab_size{};
     int context_length{};
+    bool device_arena{};  // Generator buffers are cached in a model-level arena and reused by later generators
+    int tokenizer_cache_size{};  // Number of encoded texts the tokenizer keeps for reuse (least recently used first out), 0 disables it
 
     // For models like whisper
     struct EncoderDecoderInit {
@@ -87,6 +99,10 @@ struct Config {
 
     struct Vision {
       std::string filename;
+      int feature_cache_size{};  // The image features of this many recent images are cached to skip the vision model, 0 = disabled
+      // The image processor uploads pixel_values and converts them to the vision model's type on the device, instead of
+      // converting on the CPU and uploading in the vision model's run. Device pixel values bypass the feature cache.
+      bool device_preprocessing{};
 
       struct Inputs {
         std::string pixel_values{Defaults::PixelValuesName};
@@ -108,12 +124,70 @@ struct Config {
       int num_hidden_layers{};
       int head_size{};
 
+      // Encoder-decoder models whose decoder broadcasts each batch entry's cross attention key-values over its beams.
+      // The encoder then runs once per batch entry and the cross cache is [batch_size, ...] instead of [batch_size * num_beams, ...].
+      bool cross_cache_per_batch_entry{};
+
       struct SlidingWindow {  // Sliding window parameters for models that process input prompt in chunks
         int window_size{};    // The size of the window to slide over the input prompt
         int pad_value{};      // The key-value cache padding value to use for the sliding window for inactive tokens
+        // Smaller window sizes the model also takes. The end of the prompt is covered with the windows that pad it the least.
+        std::vector<int> window_sizes;
       };
       std::optional<SlidingWindow> sliding_window;
 
+      struct PagedKeyValueCache {    // Paged key-value cache parameters for models that address the cache through a block table
+        int block_size{16};          // The number of tokens stored in each block
+        int num_blocks{};            // The number of blocks in the pool shared by all generators of the model (including the unused block 0), 0 = enough for one context_length sequence
+        bool enable_prefix_cache{};  // Share the blocks of common prompt prefixes between generators
+      };
+      std::optional<PagedKeyValueCache> paged_kv_cache;
+
+      struct KeyValueCacheQuantization {  // The model stores its key-value cache as 8-bit values with per-head scales
+        std::string type;                 // "int8" or "fp8" (float8 e4m3fn), must match the past/present tensor type of the model
+      };
+      std::optional<KeyValueCacheQuantization> kv_cache_quantization;
+
+      // The decoder is sharded across GPUs, run by one process per rank (e.g. through mpirun). Each rank loads its own
+      // shard, the filenames of the models contain {rank}, and the shards all-reduce between them through NCCL in the
+      // model. The key-value heads (and num_attention_heads) are the full model's, each rank caches 1/world_size of them.
+      struct TensorParallel {
+        int world_size{};
+      };
+      std::optional<TensorParallel> tensor_parallel;
+
+      // The model ends in a TopK node that keeps the best logits_top_k scores of every token instead of outputting the full
+      // vocabulary logits, see Logits::GetTopK. 0 = the model outputs logits.
+      int logits_top_k{};
+
+      // Self-speculative decoding for pipeline models with an early exit head (outputs.exit_logits) inside one of the
+      // pipeline models: tokens are drafted from the exit head, skipping the later pipeline models, while the head is at
+      // least 'threshold' confident (softmax probability of its top token). The full model then verifies the drafts.
+      struct EarlyExit {
+        float threshold{0.9f};
+        int num_draft_tokens{4};  // The most tokens drafted per round
+      };
+      std::optional<EarlyExit> early_exit;
+
+      // The rotary position embedding applied to the keys before they're cached, so cached entries can be moved to other
+      // positions (see Generator::AppendState). Only position-linear RoPE: rotation angle = position * position_scale *
+      // theta^(-2i / dim) for each pair i of the first 'dim' dimensions of a head.
+      struct RotaryEmbedding {
+        float theta{10000.0f};
+        int dim{};                  // 0 = head_size
+        bool interleaved{};         // The pairs are dimensions (2i, 2i + 1) instead of (i, i + dim / 2)
+        float position_scale{1.0f};
+        // LongRoPE (phi3): the frequencies are divided by short_factor while the sequence is at most
+        // original_context_length tokens and by long_factor past it, and the embeddings are scaled by short_mscale or
+        // long_mscale. The keys cached before the switch are re-encoded for the long factors (see State::SwitchRotaryFactors).
+        std::vector<float> short_factor, long_factor;  // dim / 2 values each, empty without LongRoPE
+        float short_mscale{1.0f}, long_mscale{1.0f};
+        int original_context_length{};
+      };
+      std::optional<RotaryEmbedding> rotary_embedding;
+
+      std::vector<std::string> adapter_names;  // Multi-LoRA models: the adapters stacked in the model, adapter_ids entry n selects adapter_names[n - 1]
+
       struct Inputs {
         std::string input_ids{Defaults::InputIdsName};
         std::string embeddings{"inputs_embeds"};
@@ -124,6 +198,12 @@ struct Config {
         std::string cross_past_key_names, cross_past_value_names;
         std::string current_sequence_length{Defaults::CurrentSequenceLengthName};
         std::string past_sequence_length{Defaults::PastSequenceLengthName};
+        std::string block_table{"block_table"};
+        std::string last_token_indices{"last_token_indices"};  // Optional, for models that only produce logits for the last token
+        std::string cache_indirection{"cache_indirection"};    // Optional, [batch_size, num_beams, max_length] beam to read each past position from
+        std::string adapter_ids{"adapter_ids"};                // Optional, [batch_size * num_beams] adapter of each sequence of a multi-LoRA model
+        std::string seqlens_k{"seqlens_k"};                    // Optional, [batch_size * num_beams] int32 GroupQueryAttention sequence lengths minus one, replaces attention_mask
+        std::string total_sequence_length{"total_sequence_length"};  // Optional, [1] int32 on the CPU, used together with seqlens_k
       } inputs;
 
       struct Outputs {
@@ -131,6 +211,12 @@ struct Config {
         std::string present_key_names{"present.%d.key"}, present_value_names{"present.%d.value"};
         std::string present_names;  // When key/value pairs are combined
         std::string cross_present_key_names, cross_present_value_names;
+        std::string medusa_logits{"medusa_logits"};  // Optional Medusa heads [batch_size, sequence_length, num_heads, vocab_size], head i predicts the token i + 2 positions ahead
+        // Models with a logits_top_k head output these instead of logits, both [batch_size, sequence_length, logits_top_k]
+        std::string logits_top_k_values{"logits_top_k_values"};
+        std::string logits_top_k_indices{"logits_top_k_indices"};  // int64 token ids of the values
+        std::string exit_logits{"exit_logits"};  // Optional early exit head [batch_size, sequence_length, vocab_size] after an intermediate layer
+        std::string hidden_states{"hidden_states"};  // Optional final hidden states [batch_size, sequence_length, hidden_size], used by Model::Embed
       } outputs;
 
       struct PipelineModel {
@@ -146,6 +232,8 @@ struct Config {
       };
 
       std::vector<PipelineModel> pipeline;
+      bool run_pipeline_concurrently{};  // Pipeline models that don't use each other's outputs run at the same time
+      int pipeline_micro_batches{};      // If > 1, the batch moves through the pipeline models in this many parts, so consecutive models run at the same time
 
     } decoder;
 
@@ -156,6 +244,20 @@ struct Config {
       std::string user{Defaults::promptTemplate};
     };
     std::optional<PromptTemplates> prompt_templates;
+
+    struct Warmup {  // Dummy generations to run when the model is created, so the first requests see steady state latency
+      std::vector<int> batch_sizes{1};
+      std::vector<int> prompt_lengths{16};
+      int decode_steps{4};  // Per batch size and prompt length
+    };
+    std::optional<Warmup> warmup;
+
+    // CUDA: generator buffers and the tensors created with the device allocator come from a stream ordered memory pool
+    // (cudaMallocFromPoolAsync) per device, so creating and destroying generators doesn't synchronize the device
+    struct DeviceMemoryPool {
+      int64_t release_threshold{-1};  // Bytes of freed memory the pool keeps at a synchronization, -1 keeps all of it
+    };
+    std::optional<DeviceMemoryPool> device_memory_pool;
   } model;
 
   struct Search {
@@ -166,15 +268,42 @@ struct Config {
     int num_beams{1};  // 1 means no beam search.
     int num_return_sequences{1};
     float repetition_penalty{1.0f};  // 1.0 means no penalty.
+    float frequency_penalty{};       // Subtracted from a token's logit once for every time the token is in the sequence (OpenAI style)
+    float presence_penalty{};        // Subtracted from a token's logit if the token is in the sequence (OpenAI style)
     int top_k{};                     // Number of highest probability vocabulary tokens to keep for top-k-filtering that will be used by default in the generate method of the model.
     float top_p{};                   // If set to float >0 and <1, only the most probable tokens with probabilities that add up to top_p or higher are kept for generation.
+    float min_p{};                   // If > 0, sampling only keeps tokens with a probability of at least min_p times the most probable token's
+    float typical_p{};               // If set to float >0 and <1, sampling keeps the tokens closest to the expected information content that add up to typical_p (locally typical sampling)
     float temperature{1.0f};
     bool early_stopping{true};  //  Whether to stop the beam search when at least num_beams sentences are finished per batch or not.
-    int no_repeat_ngram_size{};
-    float diversity_penalty{};
-    float length_penalty{1.0f};        // Exponential penalty to the length that is used with beam-based generation. length_penalty > 0.0 promotes longer sequences, while length_penalty < 0.0 encourages shorter sequences.
-    bool past_present_share_buffer{};  // The past/present kv tensors are shared and allocated once to max_length (cuda only)
-    int random_seed{-1};               // -1 = Seed with random device, otherwise use value to seed RNG
+    int no_repeat_ngram_size{};  // If > 0, tokens that would repeat an n-gram of this size already in the sequence are banned
+    int top_logprobs{};          // If > 0 (up to 64), every token selection keeps the log-probabilities of this many most likely tokens, see Generator::GetTopLogProbs
+    std::vector<std::pair<int32_t, float>> logit_bias;  // Added to the logits of the given token ids, "logit_bias": { "token_id": bias, ... }
+    std::vector<std::vector<int32_t>> stop_token_sequences;  // A batch entry is done once its generated tokens end with one of these
+    std::vector<std::string> stop_strings;                   // A batch entry is done once its generated text ends with one of these
+    int num_beam_groups{1};       // If > 1, diverse beam search: num_beams is split into this many groups that are searched one after the other (cpu only)
+    float diversity_penalty{};    // Subtracted from a token's score in a beam group once for every earlier group that picked it in the same step
+    int beam_done_check_interval{1};  // The CUDA beam search waits for the device to report if every beam is done only every this many steps, later steps just pad
+    float length_penalty{1.0f};         // Exponential penalty to the length that is used with beam-based generation. length_penalty > 0.0 promotes longer sequences, while length_penalty < 0.0 encourages shorter sequences.
+    bool past_present_share_buffer{};   // The past/present kv tensors are shared, growing by 512 tokens up to max_length (allocated once to max_length with graph capture) (cuda only)
+    int random_seed{-1};                // -1 = Seed with random device, otherwise use value to seed RNG
+    int prefill_chunk_size{};           // If > 0, prompts are processed in chunks of at most this many tokens to cap peak memory
+    int prompt_lookup_num_tokens{};     // If > 0, speculative decoding without a draft model: proposes up to this many tokens that follow an earlier match of the sequence's last tokens
+    int prompt_lookup_ngram_size{3};    // Longest n-gram at the end of the sequence that prompt lookup tries to match
+    // If > 0, streaming generation past max_length (StreamingLLM): a batch size 1 sequence about to reach max_length keeps
+    // its first attention_sinks tokens and its last attention_sink_window tokens (0 = half the rest), the tokens between
+    // them are dropped from the sequence and the KV cache. The kept entries are re-encoded for their new positions.
+    int attention_sinks{};
+    int attention_sink_window{};
+    bool compact_finished_sequences{};  // Greedy search with batch_size > 1 drops sequences that hit EOS from the model's batch
+    bool ragged_prefill{};              // The prompts of a batch_size > 1 greedy search are run one by one without their left padding
+    bool pipelined_decode{};            // Greedy search on CUDA queues the model run on the selected tokens before GenerateNextToken returns
+    bool graph_capture_batch_buckets{};  // Graph capture rounds max_batch_size up to a power of two and pads the batch to it, so generators of different batch sizes share captured graphs
+    // CUDA with model.device_memory_pool: the generator's own work (search, sampling, input updates and copies) runs on
+    // a stream shared by the generators of this priority instead of the model's stream, so generators overlap and the
+    // more urgent ones (lower values, as in cudaStreamCreateWithPriority) are scheduled first. Model runs stay on the
+    // model's stream.
+    std::optional<int> stream_priority;
   } search;
 
   void AddMapping(const std::string& nominal_name, const std::string& graph_name);
@@ -188,7 +317,15 @@ struct Config {
 void SetSearchNumber(Config::Search& search, std::string_view name, double value);
 void SetSearchBool(Config::Search& search, std::string_view name, bool value);
 void ClearProviders(Config& config);
+void OverlayConfig(Config& config, std::string_view json_overlay);  // Parses the JSON on top of the config, like a json_overlay
 void SetProviderOption(Config& config, std::string_view provider_name, std::string_view option_name, std::string_view option_value);
-bool IsCudaGraphEnabled(Config::SessionOptions& session_options);
+bool IsCudaGraphEnabled(const Config::SessionOptions& session_options);  // cuda enable_cuda_graph or dml enable_graph_capture
+
+// Same as Config{path, json_overlay}, but a config that was loaded before from the same path and overlay is copied
+// instead of parsed again while its genai_config.json hasn't changed
+std::unique_ptr<Config> LoadConfig(const fs::path& path, std::string_view json_overlay);
+
+// The sizes of the windows a prompt of prompt_length tokens is processed in, largest first. Their sum is the padded prompt length.
+std::vector<int> GetPromptWindowSizes(const Config::Model::Decoder::SlidingWindow& sliding_window, size_t prompt_length);
 
 }  // namespace Generators
@@ -0,0 +1,918 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "json.h"
+#include "models/model.h"
+#include "search.h"
+#include "constrained_decoding.h"
+
+namespace Generators {
+
+namespace {
+
+constexpr size_t max_nfa_states = 1 << 20;
+constexpr size_t max_dfa_states = 1 << 16;
+constexpr int max_repeat_count = 1000;
+
+std::bitset<256> ByteRange(uint8_t first, uint8_t last) {
+  std::bitset<256> bytes;
+  for (int byte = first; byte <= last; byte++)
+    bytes.set(byte);
+  return bytes;
+}
+
+std::bitset<256> DigitBytes() { return ByteRange('0', '9'); }
+
+std::bitset<256> WordBytes() {
+  auto bytes = DigitBytes() | ByteRange('a', 'z') | ByteRange('A', 'Z');
+  bytes.set('_');
+  return bytes;
+}
+
+std::bitset<256> SpaceBytes() {
+  std::bitset<256> bytes;
+  for (char c : {' ', '\t', '\n', '\v', '\f', '\r'})
+    bytes.set(static_cast<uint8_t>(c));
+  return bytes;
+}
+
+}  // namespace
+
+Regex::Regex(std::string_view pattern) : pattern_{pattern} {
+  Node root = ParseAlternation();
+  if (position_ != pattern_.size())
+    throw std::runtime_error("Unmatched ')' at position " + std::to_string(position_) + " of regex: " + std::string{pattern_});
+
+  const int32_t accept = AddNfaState();
+  nfa_states_[accept].accepting = true;
+  const int32_t start = Compile(root, accept);
+
+  std::vector<int32_t> states;
+  std::vector<bool> visited(nfa_states_.size());
+  AddClosure(start, states, visited);
+  AddDfaState(std::move(states));  // start_state
+  pattern_ = {};                   // Only used while parsing
+}
+
+Regex::Node Regex::ParseAlternation() {
+  Node node{Node::Type::Alternation};
+  node.children.push_back(ParseConcat());
+  while (position_ < pattern_.size() && pattern_[position_] == '|') {
+    position_++;
+    node.children.push_back(ParseConcat());
+  }
+  if (node.children.size() == 1)
+    return std::move(node.children[0]);
+  return node;
+}
+
+Regex::Node Regex::ParseConcat() {
+  Node node{Node::Type::Concat};
+  while (position_ < pattern_.size() && pattern_[position_] != '|' && pattern_[position_] != ')') {
+    Node atom = ParseAtom();
+    int min, max;
+    while (ParseQuantifier(min, max)) {
+      if (position_ < pattern_.size() && pattern_[position_] == '?')
+        position_++;  // A lazy quantifier matches the same texts
+      Node repeat{Node::Type::Repeat};
+      repeat.min = min;
+      repeat.max = max;
+      repeat.children.push_back(std::move(atom));
+      atom = std::move(repeat);
+    }
+    node.children.push_back(std::move(atom));
+  }
+  return node;
+}
+
+bool Regex::ParseQuantifier(int& min, int& max) {
+  if (position_ >= pattern_.size())
+    return false;
+
+  switch (pattern_[position_]) {
+    case '*':
+      min = 0, max = -1;
+      break;
+    case '+':
+      min = 1, max = -1;
+      break;
+    case '?':
+      min = 0, max = 1;
+      break;
+    case '{': {
+      auto parse_count = [&]() {
+        const size_t begin = position_;
+        int count = 0;
+        while (position_ < pattern_.size() && std::isdigit(static_cast<unsigned char>(pattern_[position_])))
+          count = std::min(count * 10 + (pattern_[position_++] - '0'), max_repeat_count + 1);
+        return position_ == begin ? -1 : count;
+      };
+
+      position_++;
+      min = max = parse_count();
+      if (min >= 0 && position_ < pattern_.size() && pattern_[position_] == ',') {
+        position_++;
+        max = parse_count();
+      }
+      if (min < 0 || position_ >= pattern_.size() || pattern_[position_] != '}' || (max >= 0 && max < min))
+        throw std::runtime_error("Invalid quantifier at position " + std::to_string(position_) + " of regex: " + std::string{pattern_});
+      if (min > max_repeat_count || max > max_repeat_count)
+        throw std::runtime_error("Regex quantifiers are limited to " + std::to_string(max_repeat_count) + " repetitions");
+      break;
+    }
+    default:
+      return false;
+  }
+  position_++;
+  return true;
+}
+
+Regex::Node Regex::ParseAtom() {
+  const uint8_t c = static_cast<uint8_t>(pattern_[position_++]);
+  switch (c) {
+    case '(': {
+      if (pattern_.substr(position_, 2) == "?:")
+        position_ += 2;
+      else if (position_ < pattern_.size() && pattern_[position_] == '?')
+        throw std::runtime_error("Only (...) and (?:...) groups are supported, at position " + std::to_string(position_) + " of regex: " + std::string{pattern_});
+      Node node = ParseAlternation();
+      if (position_ >= pattern_.size())
+        throw std::runtime_error("Missing ')' in regex: " + std::string{pattern_});
+      position_++;
+      return node;
+    }
+    case '[':
+      return ParseClass();
+    case '.': {
+      Node node{Node::Type::Bytes};
+      node.bytes.set();
+      node.bytes.reset('\n');
+      return node;
+    }
+    case '^':
+    case '$':
+      return Node{Node::Type::Concat};  // The whole text always has to match
+    case '\\':
+      return ParseEscape();
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+      throw std::runtime_error("Nothing to repeat at position " + std::to_string(position_ - 1) + " of regex: " + std::string{pattern_});
+  }
+
+  // A multibyte UTF-8 character is a sequence of bytes, grouped so that a quantifier repeats all of them
+  Node node{Node::Type::Concat};
+  node.children.push_back(Node{Node::Type::Bytes});
+  node.children.back().bytes.set(c);
+  while (c >= 0xC0 && position_ < pattern_.size() && (static_cast<uint8_t>(pattern_[position_]) & 0xC0) == 0x80) {
+    node.children.push_back(Node{Node::Type::Bytes});
+    node.children.back().bytes.set(static_cast<uint8_t>(pattern_[position_++]));
+  }
+  if (node.children.size() == 1)
+    return std::move(node.children[0]);
+  return node;
+}
+
+Regex::Node Regex::ParseEscape() {
+  if (position_ >= pattern_.size())
+    throw std::runtime_error("Regex ends with a '\\': " + std::string{pattern_});
+
+  if (pattern_[position_] == 'u') {
+    // Outside of a character class, \uXXXX is any code point, as its UTF-8 bytes
+    position_++;
+    const uint32_t code_point = ParseHex(4);
+    std::string bytes;
+    if (code_point < 0x80) {
+      bytes += static_cast<char>(code_point);
+    } else if (code_point < 0x800) {
+      bytes += static_cast<char>(0xC0 | (code_point >> 6));
+      bytes += static_cast<char>(0x80 | (code_point & 0x3F));
+    } else {
+      bytes += static_cast<char>(0xE0 | (code_point >> 12));
+      bytes += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+      bytes += static_cast<char>(0x80 | (code_point & 0x3F));
+    }
+    Node node{Node::Type::Concat};
+    for (char byte : bytes) {
+      node.children.push_back(Node{Node::Type::Bytes});
+      node.children.back().bytes.set(static_cast<uint8_t>(byte));
+    }
+    return node;
+  }
+
+  position_--;  // ParseClassAtom starts at the '\\'
+  Node node{Node::Type::Bytes};
+  const int byte = ParseClassAtom(node.bytes, false);
+  if (byte >= 0)
+    node.bytes.set(byte);
+  return node;
+}
+
+// Parses one character or escape of a character class (or an escape outside of one): a set like \d is added to
+// 'bytes' and -1 returned, otherwise the character is returned
+int Regex::ParseClassAtom(std::bitset<256>& bytes, bool in_class) {
+  const uint8_t c = static_cast<uint8_t>(pattern_[position_++]);
+  if (c >= 0x80)
+    throw std::runtime_error("Character classes only support ASCII characters, in regex: " + std::string{pattern_});
+  if (c != '\\')
+    return c;
+
+  if (position_ >= pattern_.size())
+    throw std::runtime_error("Regex ends with a '\\': " + std::string{pattern_});
+  const char escape = pattern_[position_++];
+  switch (escape) {
+    case 'd':
+      bytes |= DigitBytes();
+      return -1;
+    case 'D':
+      bytes |= ~DigitBytes();
+      return -1;
+    case 'w':
+      bytes |= WordBytes();
+      return -1;
+    case 'W':
+      bytes |= ~WordBytes();
+      return -1;
+    case 's':
+      bytes |= SpaceBytes();
+      return -1;
+    case 'S':
+      bytes |= ~SpaceBytes();
+      return -1;
+    case 'n':
+      return '\n';
+    case 't':
+      return '\t';
+    case 'r':
+      return '\r';
+    case 'f':
+      return '\f';
+    case 'v':
+      return '\v';
+    case '0':
+      return 0;
+    case 'x':
+      return static_cast<int>(ParseHex(2));
+    case 'u': {
+      const uint32_t code_point = ParseHex(4);
+      if (code_point >= 0x80)
+        throw std::runtime_error("Character classes only support ASCII characters, in regex: " + std::string{pattern_});
+      return static_cast<int>(code_point);
+    }
+    case 'b':
+    case 'B':
+      throw std::runtime_error("Word boundaries are not supported, in regex: " + std::string{pattern_});
+    default:
+      if (std::isdigit(static_cast<unsigned char>(escape)) && !in_class)
+        throw std::runtime_error("Backreferences are not supported, in regex: " + std::string{pattern_});
+      return static_cast<uint8_t>(escape);
+  }
+}
+
+uint32_t Regex::ParseHex(size_t digits) {
+  uint32_t value = 0;
+  for (size_t i = 0; i < digits; i++, position_++) {
+    if (position_ >= pattern_.size() || !std::isxdigit(static_cast<unsigned char>(pattern_[position_])))
+      throw std::runtime_error("Invalid hexadecimal escape at position " + std::to_string(position_) + " of regex: " + std::string{pattern_});
+    const char c = static_cast<char>(std::tolower(static_cast<unsigned char>(pattern_[position_])));
+    value = value * 16 + (c <= '9' ? c - '0' : c - 'a' + 10);
+  }
+  return value;
+}
+
+Regex::Node Regex::ParseClass() {
+  Node node{Node::Type::Bytes};
+  const bool negated = position_ < pattern_.size() && pattern_[position_] == '^';
+  if (negated)
+    position_++;
+
+  for (bool first = true;; first = false) {
+    if (position_ >= pattern_.size())
+      throw std::runtime_error("Missing ']' in regex: " + std::string{pattern_});
+    if (pattern_[position_] == ']' && !first) {
+      position_++;
+      break;
+    }
+
+    const int low = ParseClassAtom(node.bytes, true);
+    if (low >= 0 && position_ + 1 < pattern_.size() && pattern_[position_] == '-' && pattern_[position_ + 1] != ']') {
+      position_++;
+      const int high = ParseClassAtom(node.bytes, true);
+      if (high < low)
+        throw std::runtime_error("Invalid character class range in regex: " + std::string{pattern_});
+      node.bytes |= ByteRange(static_cast<uint8_t>(low), static_cast<uint8_t>(high));
+    } else if (low >= 0) {
+      node.bytes.set(low);
+    }
+  }
+
+  if (negated)
+    node.bytes.flip();  // Includes every byte of a multibyte UTF-8 character, so negated classes match non-ASCII text
+  return node;
+}
+
+int32_t Regex::AddNfaState() {
+  if (nfa_states_.size() >= max_nfa_states)
+    throw std::runtime_error("The regex is too large, it compiles to more than " + std::to_string(max_nfa_states) + " states");
+  nfa_states_.emplace_back();
+  return static_cast<int32_t>(nfa_states_.size() - 1);
+}
+
+// The NFA is built back to front, so every node knows the state that follows it
+int32_t Regex::Compile(const Node& node, int32_t next) {
+  switch (node.type) {
+    case Node::Type::Bytes: {
+      const int32_t state = AddNfaState();
+      nfa_states_[state].bytes = node.bytes;
+      nfa_states_[state].next = next;
+      return state;
+    }
+    case Node::Type::Concat:
+      for (auto child = node.children.rbegin(); child != node.children.rend(); ++child)
+        next = Compile(*child, next);
+      return next;
+    case Node::Type::Alternation: {
+      const int32_t state = AddNfaState();
+      for (auto& child : node.children) {
+        const int32_t child_start = Compile(child, next);
+        nfa_states_[state].epsilon.push_back(child_start);
+      }
+      return state;
+    }
+    case Node::Type::Repeat: {
+      const Node& child = node.children[0];
+      int32_t start = next;
+      if (node.max < 0) {
+        const int32_t loop = AddNfaState();
+        const int32_t body = Compile(child, loop);
+        nfa_states_[loop].epsilon = {body, next};
+        start = loop;
+      } else {
+        // Each optional copy either matches and continues with the remaining copies, or skips to 'next'
+        for (int i = node.min; i < node.max; i++) {
+          const int32_t skip = AddNfaState();
+          const int32_t body = Compile(child, start);
+          nfa_states_[skip].epsilon = {body, next};
+          start = skip;
+        }
+      }
+      for (int i = 0; i < node.min; i++)
+        start = Compile(child, start);
+      return start;
+    }
+  }
+  return next;
+}
+
+// Adds the states reachable from 'nfa_state' without consuming a byte, keeping only those that consume one or accept
+void Regex::AddClosure(int32_t nfa_state, std::vector<int32_t>& states, std::vector<bool>& visited) const {
+  std::vector<int32_t> stack{nfa_state};
+  while (!stack.empty()) {
+    const int32_t state = stack.back();
+    stack.pop_back();
+    if (visited[state])
+      continue;
+    visited[state] = true;
+
+    const auto& nfa = nfa_states_[state];
+    if (nfa.accepting || nfa.next >= 0)
+      states.push_back(state);
+    stack.insert(stack.end(), nfa.epsilon.rbegin(), nfa.epsilon.rend());
+  }
+}
+
+int32_t Regex::AddDfaState(std::vector<int32_t> nfa_states) {
+  std::sort(nfa_states.begin(), nfa_states.end());
+  auto it = dfa_index_.find(nfa_states);
+  if (it != dfa_index_.end())
+    return it->second;
+
+  if (dfa_states_.size() >= max_dfa_states)
+    throw std::runtime_error("The regex is too complex, it needs more than " + std::to_string(max_dfa_states) + " DFA states");
+
+  const int32_t state = static_cast<int32_t>(dfa_states_.size());
+  auto& dfa = dfa_states_.emplace_back();
+  dfa.next.fill(unknown_state);
+  dfa.accepting = std::any_of(nfa_states.begin(), nfa_states.end(), [&](int32_t s) { return nfa_states_[s].accepting; });
+  dfa.nfa_states = nfa_states;
+  dfa_index_.emplace(std::move(nfa_states), state);
+  return state;
+}
+
+int32_t Regex::Step(int32_t state, uint8_t byte) {
+  int32_t next = dfa_states_[state].next[byte];
+  if (next != unknown_state)
+    return next;
+
+  std::vector<int32_t> states;
+  std::vector<bool> visited(nfa_states_.size());
+  for (int32_t nfa_state : dfa_states_[state].nfa_states) {
+    if (nfa_states_[nfa_state].bytes[byte])
+      AddClosure(nfa_states_[nfa_state].next, states, visited);
+  }
+  next = states.empty() ? dead_state : AddDfaState(std::move(states));
+  dfa_states_[state].next[byte] = next;
+  return next;
+}
+
+namespace {
+
+// A whole JSON document, JSON::Parse only hands out one element at a time
+struct JsonValue : JSON::Element {
+  enum struct Type { Null,
+                     Bool,
+                     Number,
+                     String,
+                     Array,
+                     Object } type{Type::Null};
+  bool boolean{};
+  double number{};
+  std::string string;
+  std::vector<std::pair<std::string, std::unique_ptr<JsonValue>>> members;  // Of an object in order, or an array without names
+
+  const JsonValue* Find(std::string_view name) const {
+    for (auto& [member_name, value] : members) {
+      if (member_name == name)
+        return value.get();
+    }
+    return nullptr;
+  }
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    auto& member = Add(name);
+    if (auto* v = std::get_if<std::string_view>(&value)) {
+      member.type = Type::String;
+      member.string = *v;
+    } else if (auto* d = std::get_if<double>(&value)) {
+      member.type = Type::Number;
+      member.number = *d;
+    } else if (auto* b = std::get_if<bool>(&value)) {
+      member.type = Type::Bool;
+      member.boolean = *b;
+    }
+  }
+
+  JSON::Element& OnArray(std::string_view name) override {
+    auto& member = Add(name);
+    member.type = Type::Array;
+    return member;
+  }
+
+  JSON::Element& OnObject(std::string_view name) override {
+    auto& member = Add(name);
+    member.type = Type::Object;
+    return member;
+  }
+
+ private:
+  JsonValue& Add(std::string_view name) {
+    members.emplace_back(std::string{name}, std::make_unique<JsonValue>());
+    return *members.back().second;
+  }
+};
+
+std::string ToJsonString(std::string_view text) {
+  std::string json{"\""};
+  for (char c : text) {
+    switch (c) {
+      case '"':
+        json += "\\\"";
+        break;
+      case '\\':
+        json += "\\\\";
+        break;
+      case '\n':
+        json += "\\n";
+        break;
+      case '\r':
+        json += "\\r";
+        break;
+      case '\t':
+        json += "\\t";
+        break;
+      default:
+        if (static_cast<uint8_t>(c) < 0x20) {
+          char escape[7];
+          snprintf(escape, sizeof(escape), "\\u%04x", c);
+          json += escape;
+        } else {
+          json += c;
+        }
+    }
+  }
+  return json + '"';
+}
+
+std::string ToJson(const JsonValue& value) {
+  switch (value.type) {
+    case JsonValue::Type::Null:
+      return "null";
+    case JsonValue::Type::Bool:
+      return value.boolean ? "true" : "false";
+    case JsonValue::Type::Number: {
+      char number[32];
+      if (value.number == std::floor(value.number) && std::abs(value.number) < 1e15)
+        snprintf(number, sizeof(number), "%.0f", value.number);
+      else
+        snprintf(number, sizeof(number), "%.17g", value.number);
+      return number;
+    }
+    case JsonValue::Type::String:
+      return ToJsonString(value.string);
+    case JsonValue::Type::Array:
+    case JsonValue::Type::Object: {
+      const bool is_object = value.type == JsonValue::Type::Object;
+      std::string json{is_object ? "{" : "["};
+      for (auto& [name, member] : value.members) {
+        if (json.size() > 1)
+          json += ',';
+        if (is_object)
+          json += ToJsonString(name) + ':';
+        json += ToJson(*member);
+      }
+      return json + (is_object ? "}" : "]");
+    }
+  }
+  return {};
+}
+
+std::string EscapeRegex(std::string_view text) {
+  std::string escaped;
+  for (char c : text) {
+    if (std::string_view{"\\.^$|?*+()[]{}"}.find(c) != std::string_view::npos)
+      escaped += '\\';
+    escaped += c;
+  }
+  return escaped;
+}
+
+// A quantifier for lo to hi repetitions, hi < 0 is unbounded
+std::string Quantifier(int64_t lo, int64_t hi) {
+  if (hi < 0)
+    return lo == 0 ? "*" : lo == 1 ? "+" : "{" + std::to_string(lo) + ",}";
+  if (lo == hi)
+    return "{" + std::to_string(lo) + "}";
+  return "{" + std::to_string(lo) + "," + std::to_string(hi) + "}";
+}
+
+constexpr std::string_view json_string_character = R"((?:[^"\\\x00-\x1f]|\\["\\/bfnrt]|\\u[0-9a-fA-F]{4}))";
+constexpr std::string_view json_integer = R"(-?(?:0|[1-9][0-9]*))";
+constexpr std::string_view json_number = R"(-?(?:0|[1-9][0-9]*)(?:\.[0-9]+)?(?:[eE][+-]?[0-9]+)?)";
+constexpr std::string_view json_comma = ", ?";
+constexpr std::string_view json_colon = ": ?";
+
+std::string JsonString() {
+  return "\"" + std::string{json_string_character} + "*\"";
+}
+
+// Any JSON value with arrays and objects nested up to 'depth' levels
+std::string AnyJsonRegex(int depth) {
+  std::string regex = "(?:" + JsonString() + "|" + std::string{json_number} + "|true|false|null";
+  if (depth > 0) {
+    const std::string value = AnyJsonRegex(depth - 1);
+    const std::string member = JsonString() + std::string{json_colon} + value;
+    regex += "|\\[(?:" + value + "(?:" + std::string{json_comma} + value + ")*)?\\]";
+    regex += "|\\{(?:" + member + "(?:" + std::string{json_comma} + member + ")*)?\\}";
+  }
+  return regex + ")";
+}
+
+int64_t GetInteger(const JsonValue& schema, std::string_view name, int64_t default_value) {
+  auto* value = schema.Find(name);
+  if (!value)
+    return default_value;
+  if (value->type != JsonValue::Type::Number || value->number < 0)
+    throw std::runtime_error("JSON schema " + std::string{name} + " must be a non-negative number");
+  return static_cast<int64_t>(value->number);
+}
+
+std::string SchemaToRegex(const JsonValue& schema);
+
+std::string TypeToRegex(const JsonValue& schema, std::string_view type) {
+  if (type == "string") {
+    if (auto* pattern = schema.Find("pattern")) {
+      std::string_view text = pattern->string;  // Matched against the whole string, with or without anchors
+      if (!text.empty() && text.front() == '^')
+        text.remove_prefix(1);
+      if (!text.empty() && text.back() == '$' && (text.size() < 2 || text[text.size() - 2] != '\\'))
+        text.remove_suffix(1);
+      return "\"(?:" + std::string{text} + ")\"";
+    }
+    return "\"" + std::string{json_string_character} +
+           Quantifier(GetInteger(schema, "minLength", 0), GetInteger(schema, "maxLength", -1)) + "\"";
+  }
+  if (type == "integer")
+    return std::string{json_integer};
+  if (type == "number")
+    return std::string{json_number};
+  if (type == "boolean")
+    return "(?:true|false)";
+  if (type == "null")
+    return "null";
+
+  if (type == "array") {
+    auto* items = schema.Find("items");
+    const std::string item = items ? SchemaToRegex(*items) : AnyJsonRegex(2);
+    const int64_t min_items = GetInteger(schema, "minItems", 0);
+    const int64_t max_items = GetInteger(schema, "maxItems", -1);
+    if (max_items == 0)
+      return "\\[\\]";
+    const std::string rest = "(?:" + std::string{json_comma} + item + ")" +
+                             Quantifier(std::max<int64_t>(min_items - 1, 0), max_items < 0 ? -1 : max_items - 1);
+    if (min_items == 0)
+      return "\\[(?:" + item + rest + ")?\\]";
+    return "\\[" + item + rest + "\\]";
+  }
+
+  if (type == "object") {
+    auto* properties = schema.Find("properties");
+    if (!properties || properties->members.empty()) {
+      auto* additional = schema.Find("additionalProperties");
+      const std::string value = additional && additional->type == JsonValue::Type::Object ? SchemaToRegex(*additional) : AnyJsonRegex(2);
+      const std::string member = JsonString() + std::string{json_colon} + value;
+      return "\\{(?:" + member + "(?:" + std::string{json_comma} + member + ")*)?\\}";
+    }
+
+    std::vector<std::string> members;
+    std::vector<bool> required(properties->members.size());
+    auto* required_names = schema.Find("required");
+    for (size_t i = 0; i < properties->members.size(); i++) {
+      auto& [name, property] = properties->members[i];
+      members.push_back(EscapeRegex(ToJsonString(name)) + std::string{json_colon} + SchemaToRegex(*property));
+      required[i] = required_names && std::any_of(required_names->members.begin(), required_names->members.end(),
+                                                   [&](auto& required_name) { return required_name.second->string == name; });
+    }
+
+    // The properties are in their declared order. One alternative per property that can be the first one present:
+    // the optional properties before the first required one, and the first required one itself.
+    std::string regex = "\\{(?:";
+    size_t first = 0;
+    for (; first < members.size(); first++) {
+      if (first > 0)
+        regex += "|";
+      regex += members[first];
+      for (size_t i = first + 1; i < members.size(); i++)
+        regex += required[i] ? std::string{json_comma} + members[i] : "(?:" + std::string{json_comma} + members[i] + ")?";
+      if (required[first])
+        break;
+    }
+    if (first == members.size())
+      regex += "|";  // No required properties, so the object can be empty
+    return regex + ")\\}";
+  }
+
+  throw std::runtime_error("Unsupported JSON schema type: " + std::string{type});
+}
+
+std::string SchemaToRegex(const JsonValue& schema) {
+  if (schema.type == JsonValue::Type::Bool && schema.boolean)
+    return AnyJsonRegex(3);
+  if (schema.type != JsonValue::Type::Object)
+    throw std::runtime_error("A JSON schema must be an object");
+
+  if (schema.Find("$ref"))
+    throw std::runtime_error("JSON schema references ($ref) are not supported");
+
+  if (auto* value = schema.Find("const"))
+    return EscapeRegex(ToJson(*value));
+
+  auto alternatives = [](const JsonValue& list, auto&& to_regex) {
+    std::string regex = "(?:";
+    for (auto& [name, value] : list.members)
+      regex += (regex.size() > 3 ? "|" : "") + to_regex(*value);
+    return regex + ")";
+  };
+
+  if (auto* values = schema.Find("enum"))
+    return alternatives(*values, [](const JsonValue& value) { return EscapeRegex(ToJson(value)); });
+  for (auto* name : {"anyOf", "oneOf"}) {
+    if (auto* schemas = schema.Find(name))
+      return alternatives(*schemas, [](const JsonValue& value) { return SchemaToRegex(value); });
+  }
+  if (auto* schemas = schema.Find("allOf")) {
+    if (schemas->members.size() != 1)
+      throw std::runtime_error("JSON schema allOf is only supported with a single schema");
+    return SchemaToRegex(*schemas->members[0].second);
+  }
+
+  auto* type = schema.Find("type");
+  if (!type) {
+    if (schema.Find("properties"))
+      return TypeToRegex(schema, "object");
+    if (schema.Find("items"))
+      return TypeToRegex(schema, "array");
+    return AnyJsonRegex(3);
+  }
+  if (type->type == JsonValue::Type::Array)
+    return alternatives(*type, [&](const JsonValue& value) { return TypeToRegex(schema, value.string); });
+  return TypeToRegex(schema, type->string);
+}
+
+}  // namespace
+
+std::string JsonSchemaToRegex(std::string_view schema) {
+  JsonValue document;
+  JSON::Parse(document, schema);
+  if (document.members.size() != 1)
+    throw std::runtime_error("The JSON schema must be a single JSON value");
+  return SchemaToRegex(*document.members[0].second);
+}
+
+TokenVocabulary::TokenVocabulary(const Model& model)
+    : TokenVocabulary{*model.CreateTokenizer(), static_cast<size_t>(model.config_->model.vocab_size)} {
+}
+
+TokenVocabulary::TokenVocabulary(const Tokenizer& tokenizer, size_t vocab_size) {
+  tokens_.resize(vocab_size);
+
+  // Decoding a token by itself drops the leading space of SentencePiece tokens, so each token is decoded after an
+  // anchor token and the anchor's text is removed
+  const auto anchor_tokens = tokenizer.Encode("a");
+  if (anchor_tokens.empty())
+    throw std::runtime_error("The tokenizer encoded 'a' to no tokens");
+  const int32_t anchor = anchor_tokens.back();  // After the BOS token of tokenizers that add one
+  const std::string anchor_text = tokenizer.Decode(std::span<const int32_t>{&anchor, 1});
+
+  GetThreadPool().ParallelFor(vocab_size, [&](size_t token) {
+    const std::array<int32_t, 2> tokens{anchor, static_cast<int32_t>(token)};
+    std::string text;
+    try {
+      text = tokenizer.Decode(tokens);
+    } catch (const std::exception&) {
+      return;  // Past the tokenizer's vocabulary, the model's vocab_size can be padded
+    }
+    if (text.compare(0, anchor_text.size(), anchor_text) != 0)
+      return;
+    text.erase(0, anchor_text.size());
+    if (text.find("\xEF\xBF\xBD") != std::string::npos)
+      return;  // Part of a multibyte character, which decodes to U+FFFD by itself
+    tokens_[token] = std::move(text);
+  });
+
+  for (size_t token = 0; token < vocab_size; token++) {
+    if (!tokens_[token].empty())
+      sorted_tokens_.push_back(static_cast<int32_t>(token));
+  }
+  std::sort(sorted_tokens_.begin(), sorted_tokens_.end(), [&](int32_t a, int32_t b) { return tokens_[a] < tokens_[b]; });
+
+  common_prefix_.resize(sorted_tokens_.size());
+  for (size_t i = 1; i < sorted_tokens_.size(); i++) {
+    const auto& previous = tokens_[sorted_tokens_[i - 1]];
+    const auto& current = tokens_[sorted_tokens_[i]];
+    const size_t length = std::min(previous.size(), current.size());
+    common_prefix_[i] = static_cast<uint32_t>(std::mismatch(previous.begin(), previous.begin() + length, current.begin()).first - previous.begin());
+  }
+}
+
+std::shared_ptr<const TokenVocabulary> Model::GetTokenVocabulary() const {
+  std::lock_guard lock{token_vocabulary_mutex_};
+  if (!token_vocabulary_)
+    token_vocabulary_ = std::make_shared<TokenVocabulary>(*this);
+  return token_vocabulary_;
+}
+
+std::shared_ptr<const TokenVocabulary> Tokenizer::GetTokenVocabulary() const {
+  std::lock_guard lock{token_vocabulary_mutex_};
+  if (!token_vocabulary_)
+    token_vocabulary_ = std::make_shared<TokenVocabulary>(*this, vocab_size_);
+  return token_vocabulary_;
+}
+
+TokenGrammar::TokenGrammar(const Model& model, std::string_view pattern)
+    : vocabulary_{model.GetTokenVocabulary()}, regex_{pattern} {
+  const auto& config = model.config_->model;
+  eos_token_ids_.assign(config.eos_token_ids.begin(), config.eos_token_ids.end());
+  if (eos_token_ids_.empty())
+    eos_token_ids_.push_back(config.eos_token_id);
+
+  const size_t word_count = (static_cast<size_t>(config.vocab_size) + 31) / 32;
+  all_tokens_mask_.assign(word_count, ~0U);
+  eos_mask_.assign(word_count, 0);
+  for (int32_t token : eos_token_ids_)
+    eos_mask_[token / 32] |= 1U << (token % 32);
+}
+
+int32_t TokenGrammar::Advance(int32_t state, int32_t token) {
+  if (state == finished_state || std::find(eos_token_ids_.begin(), eos_token_ids_.end(), token) != eos_token_ids_.end())
+    return finished_state;
+  if (state == Regex::dead_state || token < 0 || static_cast<size_t>(token) >= vocabulary_->tokens_.size())
+    return Regex::dead_state;
+
+  for (char byte : vocabulary_->tokens_[token]) {
+    state = regex_.Step(state, static_cast<uint8_t>(byte));
+    if (state == Regex::dead_state)
+      break;
+  }
+  return state;
+}
+
+std::span<const uint32_t> TokenGrammar::GetMask(int32_t state) {
+  if (state == finished_state)
+    return all_tokens_mask_;
+  if (state == Regex::dead_state)
+    return eos_mask_;
+
+  if (masks_.size() <= static_cast<size_t>(state))
+    masks_.resize(state + 1);
+  if (masks_[state].empty())
+    masks_[state] = ComputeMask(state);
+  return masks_[state];
+}
+
+// Walks the tokens in sorted order, so a token continues from the DFA states of the prefix it shares with the previous
+// token, which is a walk of the vocabulary's trie without building it
+std::vector<uint32_t> TokenGrammar::ComputeMask(int32_t state) {
+  std::vector<uint32_t> mask(eos_mask_.size());
+  const auto& tokens = vocabulary_->tokens_;
+  const auto& sorted_tokens = vocabulary_->sorted_tokens_;
+
+  std::vector<int32_t> states{state};  // states[i] is the state after the first i bytes of the previous token
+  size_t valid_length = 0;             // The number of bytes of the previous token that states holds
+  bool any_allowed = false;
+  for (size_t i = 0; i < sorted_tokens.size(); i++) {
+    const int32_t token = sorted_tokens[i];
+    const auto& bytes = tokens[token];
+    size_t length = std::min<size_t>(vocabulary_->common_prefix_[i], valid_length);
+    states.resize(bytes.size() + 1);
+    for (; length < bytes.size(); length++) {
+      const int32_t next = regex_.Step(states[length], static_cast<uint8_t>(bytes[length]));
+      if (next == Regex::dead_state)
+        break;
+      states[length + 1] = next;
+    }
+    valid_length = length;
+    if (length == bytes.size()) {
+      mask[token / 32] |= 1U << (token % 32);
+      any_allowed = true;
+    }
+  }
+
+  if (regex_.IsAccepting(state) || !any_allowed) {
+    for (size_t i = 0; i < mask.size(); i++)
+      mask[i] |= eos_mask_[i];
+  }
+  return mask;
+}
+
+void GeneratorParams::SetGuidance(std::string_view type, std::string_view data) {
+  if (type.empty()) {
+    guidance_pattern.clear();
+    return;
+  }
+
+  std::string pattern;
+  if (type == "regex")
+    pattern = data;
+  else if (type == "json_schema")
+    pattern = JsonSchemaToRegex(data);
+  else
+    throw std::runtime_error("Unknown guidance type '" + std::string{type} + "', the supported types are regex and json_schema");
+
+  Regex{pattern};  // Reports syntax errors here rather than when the generator is created
+  guidance_pattern = std::move(pattern);
+}
+
+// The mask for the next token only depends on the grammar states, so it is computed on the worker thread while the
+// model runs on the current tokens
+void Generator::StartGuidanceMask() {
+  const size_t word_count = (static_cast<size_t>(model_->config_->model.vocab_size) + 31) / 32;
+  grammar_mask_.resize(grammar_states_.size() * word_count);
+  grammar_mask_ready_ = grammar_worker_->Enqueue([this, states = grammar_states_, word_count]() {
+    for (size_t i = 0; i < states.size(); i++) {
+      auto mask = grammar_->GetMask(states[i]);
+      std::copy(mask.begin(), mask.end(), grammar_mask_.begin() + i * word_count);
+    }
+  });
+}
+
+void Generator::ApplyGuidance() {
+  if (grammar_mask_ready_.valid())
+    grammar_mask_ready_.get();
+  search_->ApplyTokenMask(grammar_mask_);
+}
+
+void Generator::AdvanceGuidance() {
+  if (grammar_mask_ready_.valid())
+    grammar_mask_ready_.get();  // The worker reads the grammar, which Advance updates
+
+  grammar_history_.emplace_back(search_->GetSequenceLength() - 1, grammar_states_);
+  auto next_tokens = search_->GetNextTokens().CopyDeviceToCpu();
+  for (size_t i = 0; i < grammar_states_.size(); i++)
+    grammar_states_[i] = grammar_->Advance(grammar_states_[i], next_tokens[i]);
+  StartGuidanceMask();
+}
+
+void Generator::RewindGuidance(size_t length) {
+  if (grammar_mask_ready_.valid())
+    grammar_mask_ready_.get();
+
+  while (!grammar_history_.empty() && grammar_history_.back().first >= length) {
+    grammar_states_ = std::move(grammar_history_.back().second);
+    grammar_history_.pop_back();
+  }
+  StartGuidanceMask();
+}
+
+}  // namespace Generators
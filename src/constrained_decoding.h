@@ -0,0 +1,116 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// Grammar constrained decoding: the generated text is forced to match a regular expression, or the JSON of a JSON schema
+// (see GeneratorParams::SetGuidance). The pattern is compiled into a byte level DFA, and the tokens that keep the text in
+// a live state are precomputed as a bit mask over the vocabulary per DFA state, which the search applies before selecting.
+#pragma once
+
+#include <bitset>
+#include <map>
+
+namespace Generators {
+
+// The bytes of every token of a model's vocabulary, built once per model (see Model::GetTokenVocabulary)
+struct TokenVocabulary {
+  TokenVocabulary(const Model& model);
+  TokenVocabulary(const Tokenizer& tokenizer, size_t vocab_size);
+
+  std::vector<std::string> tokens_;      // Indexed by token id, empty for special tokens and tokens that aren't complete UTF-8 text
+  std::vector<int32_t> sorted_tokens_;   // The ids of the non empty tokens, ordered by their bytes
+  std::vector<uint32_t> common_prefix_;  // The number of leading bytes each token of sorted_tokens_ shares with the one before it
+};
+
+// A regular expression compiled into a DFA over bytes, whose states are built the first time they are reached.
+// Supports literals, '.', character classes ([a-z], [^"], \d \w \s and their negations), groups ((...) and (?:...)),
+// alternation and the *, +, ?, {n}, {n,} and {n,m} quantifiers. The whole text must match, as if anchored by ^ and $.
+struct Regex {
+  Regex(std::string_view pattern);
+
+  static constexpr int32_t dead_state = -1;  // No continuation of the text can match
+  static constexpr int32_t start_state = 0;
+
+  int32_t Step(int32_t state, uint8_t byte);
+  bool IsAccepting(int32_t state) const { return dfa_states_[state].accepting; }
+
+ private:
+  struct Node {
+    enum struct Type { Bytes,
+                       Concat,
+                       Alternation,
+                       Repeat } type;
+    std::bitset<256> bytes;      // Bytes
+    std::vector<Node> children;  // Concat, Alternation and Repeat (one child)
+    int min{}, max{};            // Repeat, max is -1 when unbounded
+  };
+
+  struct NfaState {
+    std::bitset<256> bytes;        // The bytes that move to 'next'
+    int32_t next{-1};
+    std::vector<int32_t> epsilon;  // States reached without consuming a byte
+    bool accepting{};
+  };
+
+  struct DfaState {
+    std::vector<int32_t> nfa_states;  // Sorted, only the states with byte transitions and the accepting state
+    std::array<int32_t, 256> next;    // unknown_state until computed
+    bool accepting{};
+  };
+
+  static constexpr int32_t unknown_state = -2;
+
+  // The parser, each returns the node of what it consumed from pattern_[position_]
+  Node ParseAlternation();
+  Node ParseConcat();
+  Node ParseAtom();
+  Node ParseClass();
+  Node ParseEscape();
+  int ParseClassAtom(std::bitset<256>& bytes, bool in_class);
+  uint32_t ParseHex(size_t digits);
+  bool ParseQuantifier(int& min, int& max);
+
+  int32_t Compile(const Node& node, int32_t next);  // Returns the start of the NFA states matching 'node' followed by 'next'
+  int32_t AddNfaState();
+  int32_t AddDfaState(std::vector<int32_t> nfa_states);
+  void AddClosure(int32_t nfa_state, std::vector<int32_t>& states, std::vector<bool>& visited) const;
+
+  std::string_view pattern_;
+  size_t position_{};
+
+  std::vector<NfaState> nfa_states_;
+  std::vector<DfaState> dfa_states_;
+  std::map<std::vector<int32_t>, int32_t> dfa_index_;
+};
+
+// Returns a Regex pattern matching the JSON of the values valid for the JSON schema 'schema'. Supports the types
+// (including lists of them), properties (in their declared order, required or not), items, enum, const, anyOf, oneOf,
+// minLength/maxLength, minItems/maxItems and string patterns. The JSON is compact, except for an optional space
+// after each ':' and ','. Schemas without a type allow any JSON value up to a nesting depth of 3.
+std::string JsonSchemaToRegex(std::string_view schema);
+
+// The tokens allowed in every state of a Regex, as bit masks over the vocabulary. Masks are computed the first time
+// a state is reached and then reused, so in a repetitive grammar (like JSON) almost every step is a lookup.
+struct TokenGrammar {
+  TokenGrammar(const Model& model, std::string_view pattern);
+
+  static constexpr int32_t finished_state = -2;  // After an EOS token every token is allowed, the search pads the sequence
+
+  int32_t GetStartState() const { return Regex::start_state; }
+  // The state after 'token', which is Regex::dead_state if the grammar doesn't allow it
+  int32_t Advance(int32_t state, int32_t token);
+  // shape ((vocab_size + 31) / 32), bit t % 32 of word t / 32 is set if token t is allowed. EOS is allowed once the
+  // text matches, and is the only token allowed when the grammar can't be continued by any token.
+  std::span<const uint32_t> GetMask(int32_t state);
+
+ private:
+  std::vector<uint32_t> ComputeMask(int32_t state);
+
+  std::shared_ptr<const TokenVocabulary> vocabulary_;
+  std::vector<int32_t> eos_token_ids_;
+  Regex regex_;
+
+  std::vector<std::vector<uint32_t>> masks_;  // Indexed by state, empty until computed
+  std::vector<uint32_t> all_tokens_mask_, eos_mask_;
+};
+
+}  // namespace Generators
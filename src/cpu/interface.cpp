@@ -79,15 +79,13 @@ struct CpuInterface : DeviceInterface {
       throw std::runtime_error("Cast - input and output types are the same");
 
     if (input_type == Ort::TypeToTensorType<float> && output_type == Ort::TypeToTensorType<Ort::Float16_t>) {
-      auto* fp32 = input.GetTensorData<float>();
-      auto* fp16 = output.GetTensorMutableData<uint16_t>();
-      for (size_t i = 0; i < element_count; i++)
-        fp16[i] = FastFloat32ToFloat16(fp32[i]);
+      ConvertFloat32ToFloat16({input.GetTensorData<float>(), element_count}, {output.GetTensorMutableData<uint16_t>(), element_count});
     } else if (input_type == Ort::TypeToTensorType<Ort::Float16_t> && output_type == Ort::TypeToTensorType<float>) {
-      auto* fp16 = input.GetTensorData<uint16_t>();
-      auto* fp32 = output.GetTensorMutableData<float>();
-      for (size_t i = 0; i < element_count; i++)
-        fp32[i] = FastFloat16ToFloat32(fp16[i]);
+      ConvertFloat16ToFloat32({input.GetTensorData<uint16_t>(), element_count}, {output.GetTensorMutableData<float>(), element_count});
+    } else if (input_type == Ort::TypeToTensorType<float> && output_type == Ort::TypeToTensorType<Ort::BFloat16_t>) {
+      ConvertFloat32ToBFloat16({input.GetTensorData<float>(), element_count}, {output.GetTensorMutableData<uint16_t>(), element_count});
+    } else if (input_type == Ort::TypeToTensorType<Ort::BFloat16_t> && output_type == Ort::TypeToTensorType<float>) {
+      ConvertBFloat16ToFloat32({input.GetTensorData<uint16_t>(), element_count}, {output.GetTensorMutableData<float>(), element_count});
     } else if (input_type == Ort::TypeToTensorType<int32_t> && output_type == Ort::TypeToTensorType<int64_t>) {
       auto* input_data = input.GetTensorData<int32_t>();
       auto* output_data = output.GetTensorMutableData<int64_t>();
@@ -3,6 +3,8 @@
 
 namespace Generators {
 
+extern const char* label_cpu;  // The GetType of CPU device buffers
+
 DeviceInterface* GetCpuInterface();
 
 }
\ No newline at end of file
@@ -51,6 +51,42 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
             Result.VerifySuccess(NativeMethods.OgaGenerator_RewindTo(_generatorHandle, (UIntPtr)newLength));
         }
 
+        /// <summary>
+        /// Returns the tokens selected by the last GenerateNextToken call, one per sequence.
+        /// The span is a view of the generator's memory and is only valid until the next call on the generator.
+        /// Throw on error
+        /// </summary>
+        /// <returns>a view of the next tokens</returns>
+        public ReadOnlySpan<int> GetNextTokens()
+        {
+            Result.VerifySuccess(NativeMethods.OgaGenerator_GetNextTokens(_generatorHandle, out IntPtr tokensPtr, out UIntPtr tokenCount));
+            unsafe
+            {
+                return new ReadOnlySpan<int>(tokensPtr.ToPointer(), (int)tokenCount.ToUInt64());
+            }
+        }
+
+        /// <summary>
+        /// Returns the last token logits, batch_size * num_beams rows of vocab_size values, without copying them.
+        /// The span is a view of the generator's memory and is only valid until the next call on the generator.
+        /// Throw on error
+        /// </summary>
+        /// <returns>a view of the logits</returns>
+        public ReadOnlySpan<float> GetLogits()
+        {
+            Result.VerifySuccess(NativeMethods.OgaGenerator_GetLogitsData(_generatorHandle, out IntPtr logitsPtr, out UIntPtr logitsCount));
+            unsafe
+            {
+                return new ReadOnlySpan<float>(logitsPtr.ToPointer(), (int)logitsCount.ToUInt64());
+            }
+        }
+
+        /// <summary>
+        /// Returns the tokens of the sequence at the given index.
+        /// The span is a view of the generator's memory and is only valid until the next call on the generator.
+        /// </summary>
+        /// <param name="index"></param>
+        /// <returns>a view of the sequence</returns>
         public ReadOnlySpan<int> GetSequence(ulong index)
         {
             ulong sequenceLength = NativeMethods.OgaGenerator_GetSequenceCount(_generatorHandle, (UIntPtr)index).ToUInt64();
@@ -54,6 +54,9 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
         public static extern IntPtr /* OgaResult* */ OgaConfigSetProviderOption(IntPtr /* OgaConfig* */ config, byte[] /* const char* */ provider_name,
                                                                                 byte[] /* const char* */ option_name, byte[] /* const char* */ option_value);
 
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern IntPtr /* OgaResult* */ OgaConfigOverlay(IntPtr /* OgaConfig* */ config, byte[] /* const char* */ json);
+
         [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
         public static extern IntPtr /* OgaResult* */ OgaCreateModel(byte[] /* const char* */ configPath,
                                                                     out IntPtr /* OgaModel** */ model);
@@ -140,6 +143,20 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
         public static extern IntPtr /* const in32_t* */ OgaGenerator_GetSequenceData(IntPtr /* const OgaGenerator* */ generator,
                                                                                      UIntPtr /* size_t */ index);
 
+        // This function returns the tokens selected by the last OgaGenerator_GenerateNextToken call, one per sequence.
+        // The returned pointer is owned by the OgaGenerator object and is valid until its next call.
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern IntPtr /* OgaResult* */ OgaGenerator_GetNextTokens(IntPtr /* OgaGenerator* */ generator,
+                                                                                out IntPtr /* const int32_t** */ tokens,
+                                                                                out UIntPtr /* size_t* */ tokenCount);
+
+        // This function returns the last token logits on the CPU without copying them into a new OgaTensor.
+        // The returned pointer is owned by the OgaGenerator object and is valid until its next call.
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern IntPtr /* OgaResult* */ OgaGenerator_GetLogitsData(IntPtr /* OgaGenerator* */ generator,
+                                                                                out IntPtr /* const float** */ logits,
+                                                                                out UIntPtr /* size_t* */ logitsCount);
+
         [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
         public static extern IntPtr /* OgaResult* */ OgaGenerator_GetOutput(IntPtr /* cosnt OgaGenerator* */ generator,
                                                      byte[] outputName, out IntPtr tensor);
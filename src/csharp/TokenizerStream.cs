@@ -24,6 +24,27 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
             return StringUtils.FromUtf8(decodedStr);
         }
 
+        /// <summary>
+        /// Decodes the token like Decode, but returns the UTF-8 bytes without allocating a string, so they can be
+        /// written straight to a stream or pipe. The span is a view of the tokenizer stream's memory and is only
+        /// valid until the next call on the tokenizer stream.
+        /// Throw on error
+        /// </summary>
+        /// <param name="token"></param>
+        /// <returns>the UTF-8 bytes of the decoded text, empty if the token does not complete any characters</returns>
+        public ReadOnlySpan<byte> DecodeUtf8(int token)
+        {
+            IntPtr decodedStr = IntPtr.Zero;
+            Result.VerifySuccess(NativeMethods.OgaTokenizerStreamDecode(_tokenizerStreamHandle, token, out decodedStr));
+            unsafe
+            {
+                var bytes = (byte*)decodedStr;
+                int length = 0;
+                while (bytes[length] != 0) ++length;
+                return new ReadOnlySpan<byte>(bytes, length);
+            }
+        }
+
         ~TokenizerStream()
         {
             Dispose(false);
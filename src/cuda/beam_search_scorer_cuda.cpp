@@ -11,7 +11,8 @@
 namespace Generators {
 
 BeamSearchScorer_Cuda::BeamSearchScorer_Cuda(const GeneratorParams& parameters)
-    : stream_{GetStream()} {
+    : stream_{GetStream()},
+      done_check_interval_{parameters.search.beam_done_check_interval} {
   state_cpu_ = CudaMallocHostArray<cuda::BeamScorerState>(1);
   state_cpu_->batch_size_ = static_cast<size_t>(parameters.search.batch_size);
   state_cpu_->num_beams_ = static_cast<size_t>(parameters.search.num_beams);
@@ -63,6 +64,7 @@ void BeamSearchScorer_Cuda::Process(Sequences& sequences,
                                        next_indices,
                                        stream_);
   cudaEventRecord(event_process_complete_, stream_);
+  steps_since_done_check_++;
 
   cuda::LaunchBeamSearchScorer_AppendNextTokenToSequences(*state_cpu_,
                                                           *state_gpu_,
@@ -75,8 +77,17 @@ void BeamSearchScorer_Cuda::Process(Sequences& sequences,
 }
 
 bool BeamSearchScorer_Cuda::IsDoneLater() const {
+  if (steps_since_done_check_ < done_check_interval_)
+    return false;
   cudaEventSynchronize(event_process_complete_);
-  return state_cpu_->not_done_count_ == 0;
+  if (state_cpu_->not_done_count_ == 0)
+    return true;
+  steps_since_done_check_ = 0;
+  return false;
+}
+
+bool BeamSearchScorer_Cuda::IsDoneLaterReady() const {
+  return steps_since_done_check_ < done_check_interval_ || cudaEventQuery(event_process_complete_) != cudaErrorNotReady;
 }
 
 void BeamSearchScorer_Cuda::Finalize(Sequences& sequences,
@@ -15,7 +15,10 @@ struct BeamSearchScorer_Cuda {
                 size_t num_return_sequences);
 
   bool IsDone() const { return false; }  // For CUDA we speculatively run the next step while we wait for the GPU to report status. We use 'IsDoneLater()' for this
+  // Only waits for the device every beam_done_check_interval steps, in between the launches of the steps aren't held up
+  // by the host, and the steps after every beam is done only append padding
   bool IsDoneLater() const;
+  bool IsDoneLaterReady() const;  // True if IsDoneLater won't block
 
   DeviceSpan<float> GetNextScores() { return next_beam_scores_; }
   DeviceSpan<int32_t> GetNextTokens() { return next_beam_tokens_; }
@@ -27,6 +30,8 @@ struct BeamSearchScorer_Cuda {
   cuda_host_unique_ptr<cuda::BeamScorerState> state_cpu_;
   cuda_unique_ptr<cuda::BeamScorerState> state_gpu_;
   cudaStream_t stream_;
+  int done_check_interval_;
+  mutable int steps_since_done_check_{};  // Process calls since IsDoneLater last waited for the device
 
   DeviceSpan<float> next_beam_scores_;
   DeviceSpan<int32_t> next_beam_tokens_;
@@ -37,6 +37,11 @@ struct cuda_stream_holder {
     cudaStreamCreate(&v_);
   }
 
+  void CreateWithPriority(int priority) {
+    assert(!v_);
+    cudaStreamCreateWithPriority(&v_, cudaStreamNonBlocking, priority);
+  }
+
   ~cuda_stream_holder() {
     if (v_)
       (void)cudaStreamDestroy(v_);
@@ -67,10 +72,19 @@ cuda_host_unique_ptr<T> CudaMallocHostArray(size_t count, std::span<T>* p_span =
   return cuda_host_unique_ptr<T>{p};
 }
 
+// The stream ordered memory pool of the current device (see Config::Model::device_memory_pool), null when disabled
+cudaMemPool_t GetMemoryPool();
+
 struct CudaDeleter {
   void operator()(void* p) {
-    cudaFree(p);
+    // Unlike cudaFree, freeing on the stream doesn't synchronize the device
+    if (pooled_)
+      ::cudaFreeAsync(p, GetStream());
+    else
+      cudaFree(p);
   }
+
+  bool pooled_{};  // Allocated from the memory pool
 };
 
 template <typename T>
@@ -79,10 +93,14 @@ using cuda_unique_ptr = std::unique_ptr<T, CudaDeleter>;
 template <typename T>
 cuda_unique_ptr<T> CudaMallocArray(size_t count, std::span<T>* p_span = nullptr) {
   T* p;
-  ::cudaMalloc(&p, sizeof(T) * count);
+  auto pool = GetMemoryPool();
+  if (pool)
+    ::cudaMallocFromPoolAsync(reinterpret_cast<void**>(&p), sizeof(T) * count, pool, GetStream());
+  else
+    ::cudaMalloc(&p, sizeof(T) * count);
   if (p_span)
     *p_span = std::span<T>(p, count);
-  return cuda_unique_ptr<T>{p};
+  return cuda_unique_ptr<T>{p, CudaDeleter{pool != nullptr}};
 }
 
 }  // namespace Generators
@@ -2,6 +2,7 @@
 // Licensed under the MIT License.
 
 #include <algorithm>
+#include <cfloat>
 #include <memory>
 #include <numeric>
 #include <random>
@@ -36,6 +37,7 @@ SamplingData::SamplingData(unsigned long long random_seed, int batch_size, int v
   thresholds = CudaMallocArray<float>(batch_size);
   indices_in = CudaMallocArray<int>(vocab_size * batch_size);
   offsets = CudaMallocArray<int>(batch_size + 1);
+  candidate_ends = CudaMallocArray<int>(batch_size);
   curand_states = CudaMallocArray<curandState>(batch_size);
   temp_storage_bytes = 0;
   cub::DeviceSegmentedRadixSort::SortPairsDescending(nullptr, temp_storage_bytes, (float*)nullptr, (float*)nullptr,
@@ -386,25 +388,33 @@ void GetTempStorageSize(const T* d_keys_in,
 
 // Sampling Kernels and Launchers
 
+// The number of entries of a batch entry's row of sample_range entries that are sampled from. Without candidate_ends
+// it's the whole row, otherwise only the candidates at its start (see SelectCandidatesKernel).
+__device__ __forceinline__ int GetSampleCount(const int* candidate_ends, int batch, int sample_range) {
+  return candidate_ends ? candidate_ends[batch] - batch * sample_range : sample_range;
+}
+
 template <int kBlockSize>
-__global__ void PrefixSumKernel(float* scores, float* prefix_sums, int sample_range, int batch_size) {
+__global__ void PrefixSumKernel(float* scores, float* prefix_sums, int sample_range, int batch_size, const int* candidate_ends = nullptr) {
   int batch = blockIdx.x;
+  int sample_count = GetSampleCount(candidate_ends, batch, sample_range);
   float prefix_sum = 0.0f;
 
   typedef cub::BlockScan<float, kBlockSize> BlockScan;
   __shared__ typename BlockScan::TempStorage temp_storage;
 
-  for (int i = 0; i < sample_range; i += blockDim.x) {
+  for (int i = 0; i < sample_count; i += blockDim.x) {
     int global_index = threadIdx.x + i + batch * sample_range;
     int local_index = threadIdx.x + i;
-    float score = (local_index < sample_range) ? scores[global_index] : 0.0f;
+    float score = (local_index < sample_count) ? scores[global_index] : 0.0f;
     float sum = score;
-    BlockScan(temp_storage).InclusiveSum(sum, sum);
-    prefix_sum += sum;
+    float block_sum;
+    BlockScan(temp_storage).InclusiveSum(sum, sum, block_sum);
     __syncthreads();
-    if (local_index < sample_range) {
-      prefix_sums[local_index + batch * sample_range] = prefix_sum;
+    if (local_index < sample_count) {
+      prefix_sums[local_index + batch * sample_range] = prefix_sum + sum;
     }
+    prefix_sum += block_sum;
   }
 }
 
@@ -441,12 +451,18 @@ void LaunchGetTopKSubset(cudaStream_t stream, float* scores_in, float* scores_ou
   GetTopKKernel<max_k, 256><<<grid, block, 0, stream>>>(indices_out, scores_in, scores_out, batch_size, vocab_size, k);
 }
 
+// The probability mass of a batch entry's k most likely tokens, or of all of its candidates when there are fewer
+__device__ __forceinline__ float GetTopKMass(const float* prefix_sums, const int* candidate_ends, int batch, int sample_range, int k) {
+  return prefix_sums[batch * sample_range + min(k, GetSampleCount(candidate_ends, batch, sample_range)) - 1];
+}
+
 // Sets up random thresholds for top p or top k sampling
-__global__ void RandomThresholdKernelTopPAndK(curandState* curand_states, float* thresholds, float* prefix_sums, int batch_size, float p, int k) {
+__global__ void RandomThresholdKernelTopPAndK(curandState* curand_states, float* thresholds, float* prefix_sums, int batch_size, float p, int k,
+                                              int sample_range, const int* candidate_ends) {
   int index = threadIdx.x + blockIdx.x * blockDim.x;
 
-  float k_prob = prefix_sums[k - 1];
   if (index < batch_size) {
+    float k_prob = GetTopKMass(prefix_sums, candidate_ends, index, sample_range, k);
     float min_p = fminf(p, k_prob);
     thresholds[index] = min_p * curand_uniform(&curand_states[index]);
   }
@@ -462,30 +478,32 @@ __global__ void RandomThresholdKernelTopP(curandState* curand_states, float* thr
 }
 
 // Sets up random thresholds for top p or top k sampling
-__global__ void RandomThresholdKernelTopK(curandState* curand_states, float* thresholds, float* prefix_sums, int batch_size, int k) {
+__global__ void RandomThresholdKernelTopK(curandState* curand_states, float* thresholds, float* prefix_sums, int batch_size, int k,
+                                          int sample_range, const int* candidate_ends) {
   int index = threadIdx.x + blockIdx.x * blockDim.x;
 
   if (index < batch_size) {
-    thresholds[index] = prefix_sums[k - 1] * curand_uniform(&curand_states[index]);
+    thresholds[index] = GetTopKMass(prefix_sums, candidate_ends, index, sample_range, k) * curand_uniform(&curand_states[index]);
   }
 }
 
 template <int kBlockSize>
-__global__ void SampleKernel(float* prefix_sums, int* indices, int* index_out, int sample_range, float* thresholds) {
+__global__ void SampleKernel(float* prefix_sums, int* indices, int* index_out, int sample_range, float* thresholds, const int* candidate_ends = nullptr) {
   int batch = blockIdx.x;
   int index = threadIdx.x;
+  int sample_count = GetSampleCount(candidate_ends, batch, sample_range);
 
   __shared__ int first_index;
   if (threadIdx.x == 0) {
-    first_index = sample_range - 1;
+    first_index = sample_count - 1;
   }
   __syncthreads();
 
-  for (; index < sample_range; index += blockDim.x) {
+  for (; index < sample_count; index += blockDim.x) {
     if (index + batch * sample_range < blockDim.x * sample_range) {
       float sum = prefix_sums[index + batch * sample_range];
       // TOP P or K
-      if (sum >= thresholds[batch] || index == sample_range - 1) {
+      if (sum >= thresholds[batch] || index == sample_count - 1) {
         atomicMin(&first_index, index);
         break;
       }
@@ -498,22 +516,125 @@ __global__ void SampleKernel(float* prefix_sums, int* indices, int* index_out, i
   }
 }
 
-void LaunchSampleKernel(SamplingData* data, cudaStream_t stream, float* scores, int* indices, int* index_out, int sample_range, int batch_size, float p = 0.0, int k = -1) {
+// 'scores' and 'indices' are rows of sample_range entries, sorted by descending score. With candidate_ends only the
+// candidates at the start of each row are sampled from.
+void LaunchSampleKernel(SamplingData* data, cudaStream_t stream, float* scores, int* indices, int* index_out, int sample_range, int batch_size, float p = 0.0, int k = -1,
+                        const int* candidate_ends = nullptr) {
   dim3 grid(batch_size, 1, 1);
   dim3 block(256, 1, 1);
   // Prefix Sums
   std::span<float> prefix_sums{data->prefix_sums.get(), static_cast<size_t>(sample_range * batch_size)};
-  PrefixSumKernel<256><<<grid, block, 0, stream>>>(scores, prefix_sums.data(), sample_range, batch_size);
+  PrefixSumKernel<256><<<grid, block, 0, stream>>>(scores, prefix_sums.data(), sample_range, batch_size, candidate_ends);
   // Random Thresholds for Top P or Top K Sampling
   std::span<float> thresholds{data->thresholds.get(), static_cast<size_t>(batch_size)};
   if (p > 0.0 && k > 1) {
-    RandomThresholdKernelTopPAndK<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->curand_states.get(), thresholds.data(), prefix_sums.data(), batch_size, p, k);
+    RandomThresholdKernelTopPAndK<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->curand_states.get(), thresholds.data(), prefix_sums.data(), batch_size, p, k, sample_range, candidate_ends);
   } else if (p > 0.0) {
     RandomThresholdKernelTopP<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->curand_states.get(), thresholds.data(), prefix_sums.data(), batch_size, p);
   } else if (k > 1) {
-    RandomThresholdKernelTopK<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->curand_states.get(), thresholds.data(), prefix_sums.data(), batch_size, k);
+    RandomThresholdKernelTopK<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->curand_states.get(), thresholds.data(), prefix_sums.data(), batch_size, k, sample_range, candidate_ends);
+  }
+  SampleKernel<256><<<grid, block, 0, stream>>>(prefix_sums.data(), indices, index_out, sample_range, thresholds.data(), candidate_ends);
+}
+
+// Candidate Selection Kernels and Launchers
+
+// The top 16 bits of a probability's float. Probabilities are never negative, so their keys order like they do.
+__device__ __forceinline__ unsigned int GetProbabilityKey(float probability) {
+  return __float_as_uint(probability) >> 16;
+}
+
+// Finds the candidates of top k and top p sampling without sorting the rows of 'probabilities': a radix select over
+// the probability keys, 8 bits at a time, finds the highest key that the k most likely tokens and the tokens that make
+// up mass p reach down to (k <= 0 or p <= 0 drop the limit). The tokens with a key at least that high are written
+// unsorted to the start of their row of 'scores_out' and 'indices_out', there are at least k of them and their mass is
+// at least p. candidate_ends gets the end offset of every row's candidates.
+template <int kBlockSize>
+__global__ void SelectCandidatesKernel(const float* probabilities, float* scores_out, int* indices_out, int* candidate_ends, int vocab_size, int k, float p) {
+  constexpr int kBins = 256;
+  const int batch = blockIdx.x;
+  const float* row = probabilities + batch * vocab_size;
+
+  __shared__ int counts[kBins];
+  __shared__ float masses[kBins];
+  __shared__ unsigned int key_prefix;  // The key bits selected by the previous passes
+  __shared__ int k_left;               // The count and mass still needed from the keys under the selected bins
+  __shared__ float p_left;
+  __shared__ int candidate_count;
+  if (threadIdx.x == 0) {
+    key_prefix = 0;
+    k_left = max(k, 0);
+    p_left = fmaxf(p, 0.0f);
+    candidate_count = 0;
+  }
+
+  for (int shift = 8; shift >= 0; shift -= 8) {
+    for (int bin = threadIdx.x; bin < kBins; bin += kBlockSize) {
+      counts[bin] = 0;
+      masses[bin] = 0.0f;
+    }
+    __syncthreads();
+
+    for (int i = threadIdx.x; i < vocab_size; i += kBlockSize) {
+      const float probability = row[i];
+      const unsigned int key = GetProbabilityKey(probability);
+      if ((key >> (shift + 8)) == key_prefix) {
+        const int bin = (key >> shift) & (kBins - 1);
+        atomicAdd(&counts[bin], 1);
+        atomicAdd(&masses[bin], probability);
+      }
+    }
+    __syncthreads();
+
+    // The limits stay positive while they're not reached, as each bin is only taken off when it's below them
+    if (threadIdx.x == 0) {
+      int bin = kBins - 1;
+      for (; bin > 0; bin--) {
+        if ((k_left > 0 && counts[bin] >= k_left) || (p_left > 0.0f && masses[bin] >= p_left))
+          break;
+        k_left -= counts[bin];
+        p_left -= masses[bin];
+      }
+      key_prefix = (key_prefix << 8) | bin;
+    }
+    __syncthreads();
   }
-  SampleKernel<256><<<grid, block, 0, stream>>>(prefix_sums.data(), indices, index_out, sample_range, thresholds.data());
+
+  const unsigned int cutoff = key_prefix;
+  for (int i = threadIdx.x; i < vocab_size; i += kBlockSize) {
+    const float probability = row[i];
+    if (GetProbabilityKey(probability) >= cutoff) {
+      const int slot = batch * vocab_size + atomicAdd(&candidate_count, 1);
+      scores_out[slot] = probability;
+      indices_out[slot] = i;
+    }
+  }
+  __syncthreads();
+
+  if (threadIdx.x == 0)
+    candidate_ends[batch] = batch * vocab_size + candidate_count;
+}
+
+// Writes the candidates of SelectCandidatesKernel sorted by descending probability to the start of each row of
+// vocab_size entries of 'scores_out' and 'indices_out', so only they are sorted rather than the whole vocabulary
+void SoftmaxAndSelectCandidates(SamplingData* data, cudaStream_t stream, float* scores_in, float* scores_out, int* indices_out, int vocab_size, int batch_size, int k, float p, float temperature) {
+  std::span<float> scores_softmaxed{data->scores_softmaxed.get(), static_cast<size_t>(vocab_size * batch_size)};
+  DispatchBlockwiseSoftmaxForward<false>(stream, scores_softmaxed.data(), const_cast<const float*>(scores_in), vocab_size, vocab_size, vocab_size, batch_size, temperature);
+
+  // The prefix sums buffer is free until the sample kernel, so it holds the unsorted candidate scores
+  std::span<float> candidate_scores{data->prefix_sums.get(), static_cast<size_t>(vocab_size * batch_size)};
+  std::span<int> candidate_indices{data->indices_in.get(), static_cast<size_t>(vocab_size * batch_size)};
+  std::span<int> candidate_ends{data->candidate_ends.get(), static_cast<size_t>(batch_size)};
+  SelectCandidatesKernel<256><<<batch_size, 256, 0, stream>>>(scores_softmaxed.data(), candidate_scores.data(), candidate_indices.data(), candidate_ends.data(), vocab_size, k, p);
+
+  // The segments run from the start of each row to the end of its candidates, the rest of the rows isn't written
+  std::span<int> offsets_gpu{data->offsets.get(), static_cast<size_t>(batch_size + 1)};
+  LaunchPopulateOffsets(offsets_gpu.data(), vocab_size, batch_size, stream);
+  std::span<float> temp_span{data->temp_buffer.get(), data->temp_storage_bytes / sizeof(float)};
+  size_t temp_storage_bytes = data->temp_storage_bytes;
+  cub::DeviceSegmentedRadixSort::SortPairsDescending(temp_span.data(), temp_storage_bytes, candidate_scores.data(), scores_out,
+                                                     candidate_indices.data(), indices_out, vocab_size * batch_size, batch_size,
+                                                     offsets_gpu.data(), candidate_ends.data(), 0, sizeof(float) * 8, stream);
 }
 
 // Top P+K Kernel Launchers
@@ -534,20 +655,7 @@ void SoftmaxAndSort(SamplingData* data, cudaStream_t stream, float* scores_in, f
                          stream, /*is_descending*/ true);
 }
 
-void LaunchGetTopKSubsetFullSort(SamplingData* data, cudaStream_t stream, float* scores_in, float* scores_out, int* indices_out, int vocab_size, int batch_size, int k) {
-  // Sort indices and scores
-  std::span<float> scores_sorted{data->scores_sorted.get(), static_cast<size_t>(vocab_size * batch_size)};
-  std::span<int> indices_sorted{data->indices_sorted.get(), static_cast<size_t>(vocab_size * batch_size)};
-  std::span<int> offsets_gpu{data->offsets.get(), static_cast<size_t>(batch_size + 1)};
-  LaunchPopulateOffsets(offsets_gpu.data(), vocab_size, batch_size, stream);
-  std::span<int32_t> indices_in{data->indices_in.get(), static_cast<size_t>(vocab_size * batch_size)};
-  LaunchPopulateIndices(indices_in.data(), vocab_size, batch_size, stream);
-  std::span<float> temp_span{data->temp_buffer.get(), data->temp_storage_bytes / sizeof(float)};
-  LaunchSortPairs<float>(temp_span.data(), data->temp_storage_bytes, scores_in, scores_sorted.data(),
-                         indices_in.data(), indices_sorted.data(), vocab_size * batch_size, batch_size, offsets_gpu.data(),
-                         stream, /*is_descending*/ true);
-}
-
+// Up to 64, larger k use SoftmaxAndSelectCandidates
 void GetTopKSubset(SamplingData* data, cudaStream_t stream, float* scores_in, float* scores_out, int* indices_out, int vocab_size, int batch_size, int k, float temperature) {
   // Softmax scores
   std::span<float> scores_softmaxed{data->scores_softmaxed.get(), static_cast<size_t>(vocab_size * batch_size)};
@@ -570,25 +678,200 @@ void GetTopKSubset(SamplingData* data, cudaStream_t stream, float* scores_in, fl
     GetTopK(16);
   } else if (k <= 32) {
     GetTopK(32);
-  } else if (k <= 64) {
+  } else {
+    assert(k <= 64);
     GetTopK(64);
+  }
+}
+
+void GetTopLogProbs(cudaStream_t stream, const float* scores_in, float* log_softmax, float* log_probs_out, int32_t* tokens_out, int vocab_size, int batch_size, int n) {
+  DispatchBlockwiseSoftmaxForward<true>(stream, log_softmax, scores_in, vocab_size, vocab_size, vocab_size, batch_size);
+  if (n <= 4) {
+    LaunchGetTopKSubset<4>(stream, log_softmax, log_probs_out, tokens_out, vocab_size, batch_size, n);
+  } else if (n <= 8) {
+    LaunchGetTopKSubset<8>(stream, log_softmax, log_probs_out, tokens_out, vocab_size, batch_size, n);
+  } else if (n <= 16) {
+    LaunchGetTopKSubset<16>(stream, log_softmax, log_probs_out, tokens_out, vocab_size, batch_size, n);
+  } else if (n <= 32) {
+    LaunchGetTopKSubset<32>(stream, log_softmax, log_probs_out, tokens_out, vocab_size, batch_size, n);
   } else {
-    LaunchGetTopKSubsetFullSort(data, stream, scores_softmaxed.data(), scores_out, indices_out, vocab_size, batch_size, k);
+    assert(n <= 64);
+    LaunchGetTopKSubset<64>(stream, log_softmax, log_probs_out, tokens_out, vocab_size, batch_size, n);
   }
 }
 
 // Kernel launcher for combined (or seperate) top k and top p sampling; where k is the max number of tokens to sample and p is the probability threshold
 void GetSample(SamplingData* data, cudaStream_t stream, int32_t* next_token_out, float* scores_in, int vocab_size, int batch_size, int k, float p, float temperature) {
-  int sample_range = (k > 0 && k <= 64) ? k : vocab_size;
-  std::span<float> scores_sorted(data->scores_sorted.get(), static_cast<size_t>(sample_range * batch_size));
-  std::span<int> indices_sorted(data->indices_sorted.get(), static_cast<size_t>(sample_range * batch_size));
-  if (k > 0 && k < vocab_size) {
+  if (k > 0 && k <= 64 && k < vocab_size) {
+    std::span<float> scores_sorted(data->scores_sorted.get(), static_cast<size_t>(k * batch_size));
+    std::span<int> indices_sorted(data->indices_sorted.get(), static_cast<size_t>(k * batch_size));
     GetTopKSubset(data, stream, scores_in, scores_sorted.data(), indices_sorted.data(), vocab_size, batch_size, k, temperature);
-  } else {
-    SoftmaxAndSort(data, stream, scores_in, scores_sorted.data(), indices_sorted.data(), vocab_size, batch_size, temperature);
+    LaunchSampleKernel(data, stream, scores_sorted.data(), indices_sorted.data(), next_token_out, k, batch_size, p, k);
+    return;
+  }
+
+  // Top p and larger k only sort the candidates that can be sampled
+  if (k >= vocab_size)
+    k = 0;
+  std::span<float> scores_sorted(data->scores_sorted.get(), static_cast<size_t>(vocab_size * batch_size));
+  std::span<int> indices_sorted(data->indices_sorted.get(), static_cast<size_t>(vocab_size * batch_size));
+  SoftmaxAndSelectCandidates(data, stream, scores_in, scores_sorted.data(), indices_sorted.data(), vocab_size, batch_size, k, p, temperature);
+  LaunchSampleKernel(data, stream, scores_sorted.data(), indices_sorted.data(), next_token_out, vocab_size, batch_size, p, k, data->candidate_ends.get());
+}
+
+// Per Batch Entry Sampling Kernels and Launchers
+
+__global__ void ScaleByTemperatureKernel(float* scores_out, const float* scores_in, const float* temperatures, int vocab_size, int batch_size) {
+  int index = threadIdx.x + blockIdx.x * blockDim.x;
+  if (index < vocab_size * batch_size)
+    scores_out[index] = scores_in[index] / temperatures[index / vocab_size];
+}
+
+// Sets up random thresholds within each batch entry's top k and top p probability mass, a threshold of 0 selects the top token
+__global__ void RandomThresholdKernelBatch(curandState* curand_states, float* thresholds, float* prefix_sums, const int32_t* ks, const float* ps, int batch_size, int vocab_size) {
+  int index = threadIdx.x + blockIdx.x * blockDim.x;
+  if (index >= batch_size)
+    return;
+
+  int k = ks[index];
+  float p = ps[index];
+  float mass = prefix_sums[index * vocab_size + vocab_size - 1];
+  if (k == 1 || (k == 0 && p <= 0.0f))
+    mass = 0.0f;
+  else if (k > 1 && k < vocab_size)
+    mass = prefix_sums[index * vocab_size + k - 1];
+  if (p > 0.0f && p < 1.0f)
+    mass = fminf(mass, p);
+  // Always draw, so the random sequence of a batch entry doesn't depend on the other entries' parameters
+  thresholds[index] = mass * curand_uniform(&curand_states[index]);
+}
+
+// Rows with different parameters share one full sort of every row instead of the top k subset GetSample uses for small k
+void GetBatchSample(SamplingData* data, cudaStream_t stream, int32_t* next_token_out, float* scores_in, int vocab_size, int batch_size, const int32_t* ks, const float* ps, const float* temperatures) {
+  // The prefix sums buffer is free until the sample kernel, so it holds the scores scaled by each entry's temperature
+  std::span<float> prefix_sums{data->prefix_sums.get(), static_cast<size_t>(vocab_size * batch_size)};
+  ScaleByTemperatureKernel<<<(batch_size * vocab_size / 256) + 1, 256, 0, stream>>>(prefix_sums.data(), scores_in, temperatures, vocab_size, batch_size);
+  std::span<float> scores_sorted{data->scores_sorted.get(), static_cast<size_t>(vocab_size * batch_size)};
+  std::span<int> indices_sorted{data->indices_sorted.get(), static_cast<size_t>(vocab_size * batch_size)};
+  SoftmaxAndSort(data, stream, prefix_sums.data(), scores_sorted.data(), indices_sorted.data(), vocab_size, batch_size, 1.0f);
+
+  dim3 grid(batch_size, 1, 1);
+  dim3 block(256, 1, 1);
+  PrefixSumKernel<256><<<grid, block, 0, stream>>>(scores_sorted.data(), prefix_sums.data(), vocab_size, batch_size);
+  std::span<float> thresholds{data->thresholds.get(), static_cast<size_t>(batch_size)};
+  RandomThresholdKernelBatch<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->curand_states.get(), thresholds.data(), prefix_sums.data(), ks, ps, batch_size, vocab_size);
+  SampleKernel<256><<<grid, block, 0, stream>>>(prefix_sums.data(), indices_sorted.data(), next_token_out, vocab_size, thresholds.data());
+}
+
+// Sampling Filter Kernels and Launchers
+
+// A token's probability is at least min_p times the top token's when its score is within temperature * log(min_p) of the top score
+template <int kBlockSize>
+__global__ void MinPKernel(float* scores, int vocab_size, float max_distance) {
+  float* row_scores = scores + blockIdx.x * vocab_size;
+
+  float thread_max = -FLT_MAX;
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x)
+    thread_max = fmaxf(thread_max, row_scores[i]);
+
+  typedef cub::BlockReduce<float, kBlockSize> BlockReduce;
+  __shared__ typename BlockReduce::TempStorage temp_storage;
+  __shared__ float threshold;
+  float max_score = BlockReduce(temp_storage).Reduce(thread_max, cub::Max());
+  if (threadIdx.x == 0)
+    threshold = max_score - max_distance;
+  __syncthreads();
+
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x) {
+    if (row_scores[i] < threshold)
+      row_scores[i] = -FLT_MAX;
+  }
+}
+
+void LaunchMinPFilter(cudaStream_t stream, float* scores, int vocab_size, int batch_size, float min_p, float temperature) {
+  dim3 grid(batch_size, 1, 1);
+  dim3 block(256, 1, 1);
+  MinPKernel<256><<<grid, block, 0, stream>>>(scores, vocab_size, -temperature * logf(min_p));
+}
+
+// Writes each token's distance from the row's entropy, negated so the most typical tokens sort first
+template <int kBlockSize>
+__global__ void TypicalShiftKernel(const float* log_probs, float* shifts, int vocab_size) {
+  int offset = blockIdx.x * vocab_size;
+
+  float thread_entropy = 0.0f;
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x) {
+    float log_prob = log_probs[offset + i];
+    float prob = expf(log_prob);
+    if (prob > 0.0f)
+      thread_entropy -= prob * log_prob;
   }
-  // Sample kernel
-  LaunchSampleKernel(data, stream, scores_sorted.data(), indices_sorted.data(), next_token_out, sample_range, batch_size, p, k);
+
+  typedef cub::BlockReduce<float, kBlockSize> BlockReduce;
+  __shared__ typename BlockReduce::TempStorage temp_storage;
+  __shared__ float entropy;
+  float sum = BlockReduce(temp_storage).Sum(thread_entropy);
+  if (threadIdx.x == 0)
+    entropy = sum;
+  __syncthreads();
+
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x)
+    shifts[offset + i] = -fabsf(-log_probs[offset + i] - entropy);
+}
+
+// Keeps the most typical tokens until their probabilities add up to typical_p and masks the rest
+template <int kBlockSize>
+__global__ void TypicalMaskKernel(float* scores, const float* log_probs, const float* shifts, const float* shifts_sorted, const int* indices_sorted, int vocab_size, float typical_p) {
+  int offset = blockIdx.x * vocab_size;
+
+  typedef cub::BlockScan<float, kBlockSize> BlockScan;
+  __shared__ typename BlockScan::TempStorage temp_storage;
+  __shared__ int cutoff_index;
+  if (threadIdx.x == 0)
+    cutoff_index = vocab_size;
+  __syncthreads();
+
+  float prefix_sum = 0.0f;
+  for (int i = 0; i < vocab_size; i += blockDim.x) {
+    int local_index = threadIdx.x + i;
+    float prob = (local_index < vocab_size) ? expf(log_probs[offset + indices_sorted[offset + local_index]]) : 0.0f;
+    float sum, aggregate;
+    BlockScan(temp_storage).InclusiveSum(prob, sum, aggregate);
+    if (local_index < vocab_size && prefix_sum + sum >= typical_p)
+      atomicMin(&cutoff_index, local_index);
+    prefix_sum += aggregate;
+    __syncthreads();
+    if (cutoff_index < vocab_size)
+      break;
+  }
+
+  float cutoff = shifts_sorted[offset + min(cutoff_index, vocab_size - 1)];
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x) {
+    if (shifts[offset + i] < cutoff)
+      scores[offset + i] = -FLT_MAX;
+  }
+}
+
+void LaunchTypicalPFilter(SamplingData* data, cudaStream_t stream, float* scores, int vocab_size, int batch_size, float typical_p, float temperature) {
+  dim3 grid(batch_size, 1, 1);
+  dim3 block(256, 1, 1);
+  std::span<float> log_probs{data->scores_softmaxed.get(), static_cast<size_t>(vocab_size * batch_size)};
+  DispatchBlockwiseSoftmaxForward<true>(stream, log_probs.data(), const_cast<const float*>(scores), vocab_size, vocab_size, vocab_size, batch_size, temperature);
+  // The sampling buffers are free until GetSample runs, prefix_sums holds the shifts in vocabulary order
+  std::span<float> shifts{data->prefix_sums.get(), static_cast<size_t>(vocab_size * batch_size)};
+  TypicalShiftKernel<256><<<grid, block, 0, stream>>>(log_probs.data(), shifts.data(), vocab_size);
+  // Sort indices by shifts, most typical first
+  std::span<int> offsets_gpu{data->offsets.get(), static_cast<size_t>(batch_size + 1)};
+  LaunchPopulateOffsets(offsets_gpu.data(), vocab_size, batch_size, stream);
+  std::span<int32_t> indices_in{data->indices_in.get(), static_cast<size_t>(vocab_size * batch_size)};
+  LaunchPopulateIndices(indices_in.data(), vocab_size, batch_size, stream);
+  std::span<float> shifts_sorted{data->scores_sorted.get(), static_cast<size_t>(vocab_size * batch_size)};
+  std::span<int> indices_sorted{data->indices_sorted.get(), static_cast<size_t>(vocab_size * batch_size)};
+  std::span<float> temp_span{data->temp_buffer.get(), data->temp_storage_bytes / sizeof(float)};
+  LaunchSortPairs<float>(temp_span.data(), data->temp_storage_bytes, shifts.data(), shifts_sorted.data(),
+                         indices_in.data(), indices_sorted.data(), vocab_size * batch_size, batch_size, offsets_gpu.data(),
+                         stream, /*is_descending*/ true);
+  TypicalMaskKernel<256><<<grid, block, 0, stream>>>(scores, log_probs.data(), shifts.data(), shifts_sorted.data(), indices_sorted.data(), vocab_size, typical_p);
 }
 
 }  // namespace cuda
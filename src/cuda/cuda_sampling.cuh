@@ -17,6 +17,7 @@ struct SamplingData {
   cuda_unique_ptr<float> thresholds;
   cuda_unique_ptr<int> indices_in;
   cuda_unique_ptr<int> offsets;
+  cuda_unique_ptr<int> candidate_ends;  // End offsets of the sampling candidates of each batch entry's row
   cuda_unique_ptr<float> temp_buffer;
   cuda_unique_ptr<curandState> curand_states;
   size_t temp_storage_bytes = 0;
@@ -24,6 +25,16 @@ struct SamplingData {
 
 void LaunchPopulateIndices(int* indices, int size, int batch_size, cudaStream_t stream);
 void GetSample(SamplingData* data, cudaStream_t stream, int32_t* d_next_token, float* d_scores, int vocab_size, int batch_size, int k, float p, float temperature);
+// Same as GetSample with a k, p and temperature per batch entry in device memory, entries with a k of 1 select the top token
+void GetBatchSample(SamplingData* data, cudaStream_t stream, int32_t* d_next_token, float* d_scores, int vocab_size, int batch_size, const int32_t* d_k, const float* d_p, const float* d_temperature);
+
+// Sampling filters, these set the scores of the tokens they remove to the lowest float in place before GetSample
+void LaunchMinPFilter(cudaStream_t stream, float* d_scores, int vocab_size, int batch_size, float min_p, float temperature);
+void LaunchTypicalPFilter(SamplingData* data, cudaStream_t stream, float* d_scores, int vocab_size, int batch_size, float typical_p, float temperature);
+
+// Writes the n (up to 64) highest log-softmax values of every row of 'scores_in' and their tokens to 'log_probs_out' and
+// 'tokens_out' [batch_size, n], in descending order. 'log_softmax' is scratch of the size of 'scores_in'.
+void GetTopLogProbs(cudaStream_t stream, const float* scores_in, float* log_softmax, float* log_probs_out, int32_t* tokens_out, int vocab_size, int batch_size, int n);
 
 template <bool is_log_softmax>
 void DispatchBlockwiseSoftmaxForward(cudaStream_t stream, float* output, const float* input, int softmax_elements, int input_stride, int output_stride, int batch_count, float temperature = 1.0);
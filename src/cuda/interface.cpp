@@ -8,6 +8,7 @@
 #include "search_cuda.h"
 #include "kernels.h"
 #include <cstdarg>
+#include <mutex>
 
 namespace Generators {
 
@@ -15,13 +16,125 @@ GenaiInterface* gp_genai{};
 Ort::Allocator* ort_allocator_{};
 const char* device_label = "cuda";
 
-cuda_stream_holder g_stream;
-cudaStream_t GetStream() { return g_stream.get(); }
+cuda_stream_holder g_stream;                    // The model's stream, the sessions run on it
+thread_local cudaStream_t t_stream{};            // The stream of the generator call on this thread, see StreamScope
+cudaStream_t GetStream() { return t_stream ? t_stream : g_stream.get(); }
+
+std::mutex g_priority_streams_mutex;
+std::unordered_map<int, std::unique_ptr<cuda_stream_holder>> g_priority_streams;  // By priority, protected by g_priority_streams_mutex
+
+// Stream ordered allocator of one device (see Config::Model::device_memory_pool). Memory freed on the stream can be
+// handed out again by later allocations on it without synchronizing, the pool only returns memory to the driver past
+// the release threshold. The pools live until exit, like the ORT allocator (see EnsureDeviceOrtInit).
+struct CudaMemoryPool : OrtAllocator {
+  CudaMemoryPool(int device_id, uint64_t release_threshold) : OrtAllocator{} {
+    int supported{};
+    CudaCheck() == cudaDeviceGetAttribute(&supported, cudaDevAttrMemoryPoolsSupported, device_id);
+    if (!supported)
+      throw std::runtime_error("device_memory_pool is not supported by CUDA device " + std::to_string(device_id));
+
+    cudaMemPoolProps props{};
+    props.allocType = cudaMemAllocationTypePinned;
+    props.location.type = cudaMemLocationTypeDevice;
+    props.location.id = device_id;
+    CudaCheck() == cudaMemPoolCreate(&pool_, &props);
+    CudaCheck() == cudaMemPoolSetAttribute(pool_, cudaMemPoolAttrReleaseThreshold, &release_threshold);
+
+    version = ORT_API_VERSION;
+    OrtAllocator::Alloc = [](OrtAllocator* this_, size_t size) -> void* {
+      void* p{};
+      CudaCheck() == cudaMallocFromPoolAsync(&p, size, static_cast<CudaMemoryPool*>(this_)->pool_, GetStream());
+      return p;
+    };
+    OrtAllocator::Free = [](OrtAllocator*, void* p) {
+      if (p)
+        ::cudaFreeAsync(p, GetStream());
+    };
+    OrtAllocator::Info = [](const OrtAllocator*) -> const OrtMemoryInfo* { return &ort_allocator_->GetInfo(); };
+  }
+
+  // The pool as an Ort::Allocator, to pass wherever the device allocator would be used
+  Ort::Allocator& GetAllocator() { return *static_cast<Ort::Allocator*>(static_cast<OrtAllocator*>(this)); }
+
+  cudaMemPool_t pool_{};
+};
+
+std::atomic<bool> g_memory_pools_enabled;
+uint64_t g_memory_pool_release_threshold{};  // Protected by g_memory_pools_mutex
+std::mutex g_memory_pools_mutex;
+std::unordered_map<int, std::unique_ptr<CudaMemoryPool>> g_memory_pools;  // By device id, protected by g_memory_pools_mutex
+
+// The pool of the current device, created on first use. Null until a model enables the pools.
+CudaMemoryPool* GetCurrentMemoryPool() {
+  if (!g_memory_pools_enabled)
+    return nullptr;
+  int device_id{};
+  CudaCheck() == cudaGetDevice(&device_id);
+  std::scoped_lock lock{g_memory_pools_mutex};
+  auto& pool = g_memory_pools[device_id];
+  if (!pool)
+    pool = std::make_unique<CudaMemoryPool>(device_id, g_memory_pool_release_threshold);
+  return pool.get();
+}
+
+cudaMemPool_t GetMemoryPool() {
+  auto* pool = GetCurrentMemoryPool();
+  return pool ? pool->pool_ : nullptr;
+}
+
+// Page-locked host memory for the CPU copies of the device buffers, which the device copies to and from directly and
+// asynchronously. cudaHostAlloc is slow and cudaFreeHost synchronizes the device, so freed blocks are kept by size
+// class (powers of two) and handed to later buffers.
+struct PinnedHostArena {
+  static size_t GetSizeClass(size_t size) {
+    size_t size_class = 256;
+    while (size_class < size)
+      size_class *= 2;
+    return size_class;
+  }
+
+  uint8_t* Allocate(size_t size) {
+    const size_t size_class = GetSizeClass(size);
+    {
+      std::scoped_lock lock{mutex_};
+      auto& blocks = free_blocks_[size_class];
+      if (!blocks.empty()) {
+        auto* p = blocks.back();
+        blocks.pop_back();
+        return p;
+      }
+    }
+    void* p{};
+    CudaCheck() == ::cudaHostAlloc(&p, size_class, 0);
+    return static_cast<uint8_t*>(p);
+  }
+
+  void Free(uint8_t* p, size_t size) {
+    std::scoped_lock lock{mutex_};
+    free_blocks_[GetSizeClass(size)].push_back(p);
+  }
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<size_t, std::vector<uint8_t*>> free_blocks_;  // By size class, protected by mutex_
+};
+
+PinnedHostArena g_pinned_host_arena;
+
+struct CudaEvent final : DeviceEvent {
+  CudaEvent() : event_{cudaEventDisableTiming} {}
+
+  void Record() { CudaCheck() == ::cudaEventRecord(event_, GetStream()); }
+  void Wait() override { CudaCheck() == ::cudaEventSynchronize(event_); }
+
+ private:
+  cuda_event_holder event_;
+};
 
 struct GpuMemory final : DeviceBuffer {
-  GpuMemory(size_t size) : owned_{true} {
+  GpuMemory(Ort::Allocator& allocator, size_t size) : owned_{true}, allocator_{&allocator} {
     size_in_bytes_ = size;
-    p_device_ = static_cast<uint8_t*>(ort_allocator_->Alloc(size));
+    p_device_ = static_cast<uint8_t*>(allocator_->Alloc(size));
   }
 
   GpuMemory(void* p, size_t size) : owned_{false} {
@@ -31,16 +144,20 @@ struct GpuMemory final : DeviceBuffer {
 
   ~GpuMemory() override {
     if (owned_)
-      ort_allocator_->Free(p_device_);
-    if (p_cpu_)
-      ::cudaFreeHost(p_cpu_);
+      allocator_->Free(p_device_);
+    if (p_cpu_) {
+      // The next buffer given the block must not see a copy still in flight
+      if (copy_event_)
+        copy_event_->Wait();
+      g_pinned_host_arena.Free(p_cpu_, size_in_bytes_);
+    }
   }
 
   const char* GetType() const override { return device_label; }
 
   void AllocateCpu() override {
     if (!p_cpu_)
-      ::cudaHostAlloc(&p_cpu_, size_in_bytes_, 0);
+      p_cpu_ = g_pinned_host_arena.Allocate(size_in_bytes_);
   }
 
   void CopyDeviceToCpu() override {
@@ -49,23 +166,47 @@ struct GpuMemory final : DeviceBuffer {
     ::cudaStreamSynchronize(GetStream());
   }
 
+  std::shared_ptr<DeviceEvent> CopyDeviceToCpuAsync() override {
+    AllocateCpu();
+    ::cudaMemcpyAsync(p_cpu_, p_device_, size_in_bytes_, ::cudaMemcpyDeviceToHost, GetStream());
+    if (!copy_event_)
+      copy_event_ = std::make_shared<CudaEvent>();
+    copy_event_->Record();
+    return copy_event_;
+  }
+
   void CopyCpuToDevice() override {
     assert(p_cpu_);
     ::cudaMemcpyAsync(p_device_, p_cpu_, size_in_bytes_, ::cudaMemcpyHostToDevice, GetStream());
   }
 
   void CopyFrom(size_t begin_dest, DeviceBuffer& source, size_t begin_source, size_t size_in_bytes) override {
+    // With unified addressing this also copies between GPUs, peer to peer where the GPUs support it
     if (source.GetType() == device_label)
       ::cudaMemcpyAsync(p_device_ + begin_dest, source.p_device_ + begin_source, size_in_bytes, ::cudaMemcpyDeviceToDevice, GetStream());
+    else if (source.IsCpuAccessible())
+      WriteFromCpu(begin_dest, std::span<const uint8_t>(source.p_device_ + begin_source, size_in_bytes));
     else
       gp_genai->CopyThroughCpu(*this, begin_dest, source, begin_source, size_in_bytes);
   }
 
+  void ReadToCpu(size_t begin, std::span<uint8_t> destination) override {
+    ::cudaMemcpyAsync(destination.data(), p_device_ + begin, destination.size(), ::cudaMemcpyDeviceToHost, GetStream());
+    ::cudaStreamSynchronize(GetStream());
+  }
+
+  void WriteFromCpu(size_t begin, std::span<const uint8_t> source) override {
+    // Pageable source memory is staged by the driver before this returns, so the caller may reuse it right away
+    ::cudaMemcpyAsync(p_device_ + begin, source.data(), source.size(), ::cudaMemcpyHostToDevice, GetStream());
+  }
+
   void Zero() override {
     ::cudaMemsetAsync(p_device_, 0, size_in_bytes_, GetStream());
   }
 
   bool owned_;  // If we own the memory, we delete it on destruction
+  Ort::Allocator* allocator_{};  // The allocator of owned memory, the memory pool may have been enabled since
+  std::shared_ptr<CudaEvent> copy_event_;  // Of the last CopyDeviceToCpuAsync
 };
 
 struct CudaInterfaceImpl final : DeviceInterface {
@@ -84,11 +225,21 @@ struct CudaInterfaceImpl final : DeviceInterface {
   }
 
   Ort::Allocator& GetAllocator() override {
+    if (auto* pool = GetCurrentMemoryPool())
+      return pool->GetAllocator();
     return *ort_allocator_;
   }
 
+  void EnableMemoryPool(uint64_t release_threshold) override {
+    // Every device gets its pool on first use, the first model to enable the pools sets the threshold
+    std::scoped_lock lock{g_memory_pools_mutex};
+    if (!g_memory_pools_enabled)
+      g_memory_pool_release_threshold = release_threshold;
+    g_memory_pools_enabled = true;
+  }
+
   std::shared_ptr<DeviceBuffer> AllocateBase(size_t size) override {
-    return std::make_shared<GpuMemory>(size);
+    return std::make_shared<GpuMemory>(GetAllocator(), size);
   }
 
   std::shared_ptr<DeviceBuffer> WrapMemoryBase(void* p, size_t size) override {
@@ -108,7 +259,32 @@ struct CudaInterfaceImpl final : DeviceInterface {
   }
 
   void* GetCudaStream() override {
-    return GetStream();
+    return g_stream.get();
+  }
+
+  void* GetPriorityStream(int priority) override {
+    int least{}, greatest{};
+    CudaCheck() == cudaDeviceGetStreamPriorityRange(&least, &greatest);
+    priority = std::clamp(priority, greatest, least);  // The greatest priority is the lowest number
+    std::scoped_lock lock{g_priority_streams_mutex};
+    auto& stream = g_priority_streams[priority];
+    if (!stream) {
+      stream = std::make_unique<cuda_stream_holder>();
+      stream->CreateWithPriority(priority);
+    }
+    return stream->get();
+  }
+
+  void* SetCurrentStream(void* stream) override {
+    cudaStream_t previous = t_stream;
+    t_stream = static_cast<cudaStream_t>(stream);
+    return previous;
+  }
+
+  void WaitForStream(void* waiting, void* stream) override {
+    thread_local cuda_event_holder event{cudaEventDisableTiming};
+    CudaCheck() == cudaEventRecord(event, stream ? static_cast<cudaStream_t>(stream) : g_stream.get());
+    CudaCheck() == cudaStreamWaitEvent(waiting ? static_cast<cudaStream_t>(waiting) : g_stream.get(), event);
   }
 
   bool Cast(OrtValue& input, OrtValue& output) override {
@@ -131,6 +307,10 @@ struct CudaInterfaceImpl final : DeviceInterface {
       cuda::LaunchFp32ToFp16(reinterpret_cast<const float*>(input_data), reinterpret_cast<uint16_t*>(output_data), static_cast<int>(element_count), GetStream());
     } else if (input_type == Ort::TypeToTensorType<Ort::Float16_t> && output_type == Ort::TypeToTensorType<float>) {
       cuda::LaunchFp16ToFp32(reinterpret_cast<const uint16_t*>(input_data), reinterpret_cast<float*>(output_data), static_cast<int>(element_count), GetStream());
+    } else if (input_type == Ort::TypeToTensorType<float> && output_type == Ort::TypeToTensorType<Ort::BFloat16_t>) {
+      cuda::LaunchFp32ToBf16(reinterpret_cast<const float*>(input_data), reinterpret_cast<uint16_t*>(output_data), static_cast<int>(element_count), GetStream());
+    } else if (input_type == Ort::TypeToTensorType<Ort::BFloat16_t> && output_type == Ort::TypeToTensorType<float>) {
+      cuda::LaunchBf16ToFp32(reinterpret_cast<const uint16_t*>(input_data), reinterpret_cast<float*>(output_data), static_cast<int>(element_count), GetStream());
     } else if (input_type == Ort::TypeToTensorType<int32_t> && output_type == Ort::TypeToTensorType<int64_t>) {
       cuda::LaunchInt32ToInt64(reinterpret_cast<const int32_t*>(input_data), reinterpret_cast<int64_t*>(output_data), static_cast<int>(element_count), GetStream());
     } else
@@ -152,6 +332,13 @@ struct CudaInterfaceImpl final : DeviceInterface {
       cuda::Launch_UpdateAttentionMask(static_cast<int64_t*>(mask_data), static_cast<const int64_t*>(old_data), batch_beam_size, new_kv_length, total_length, max_length, update_only, GetStream());
   }
 
+  void UpdatePositionInputs(void* position_ids, void* mask_data, const void* old_mask_data, int32_t* seqlens_k, int batch_beam_size, int new_kv_length, int total_length, int max_length, bool update_only, ONNXTensorElementDataType type) override {
+    if (type == Ort::TypeToTensorType<int32_t>)
+      cuda::Launch_UpdatePositionInputs(static_cast<int32_t*>(position_ids), static_cast<int32_t*>(mask_data), static_cast<const int32_t*>(old_mask_data), seqlens_k, batch_beam_size, new_kv_length, total_length, max_length, update_only, GetStream());
+    else
+      cuda::Launch_UpdatePositionInputs(static_cast<int64_t*>(position_ids), static_cast<int64_t*>(mask_data), static_cast<const int64_t*>(old_mask_data), seqlens_k, batch_beam_size, new_kv_length, total_length, max_length, update_only, GetStream());
+  }
+
   void LaunchHandleEOSArray(float* batch_logits, int batch_beam_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count) override {
     cuda::LaunchHandleEOSArray(batch_logits, batch_beam_size, vocab_size, eos_token_ids, eos_token_ids_count, GetStream());
   }
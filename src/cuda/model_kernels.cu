@@ -2,8 +2,10 @@
 // Licensed under the MIT License.
 
 #include <cuda_fp16.h>
+#include <cuda_bf16.h>
 #include <cuda_runtime.h>
 #include <stdint.h>
+#include <algorithm>
 #include <limits>
 #include <assert.h>
 #include <stdio.h>
@@ -82,6 +84,63 @@ void Launch_UpdateAttentionMask(T* mask_data, const T* old_data, int batch_beam_
 template void Launch_UpdateAttentionMask(int32_t* mask_data, const int32_t* old_data, int batch_beam_size, int new_kv_length, int total_length, int max_length, bool update_only, cudaStream_t stream);
 template void Launch_UpdateAttentionMask(int64_t* mask_data, const int64_t* old_data, int batch_beam_size, int new_kv_length, int total_length, int max_length, bool update_only, cudaStream_t stream);
 
+// The UpdatePositionIds, UpdateAttentionMask/CopyAndUpdateAttentionMask and seqlens_k updates of a decoding step in one kernel,
+// each part is skipped when its pointer is null
+template <typename T>
+__global__ void UpdatePositionInputs(T* positions, T* mask_data, const T* old_mask_data, int32_t* seqlens_k, int batch_beam_size,
+                                     int new_kv_length, int total_length, int max_length, bool update_only) {
+  int i = blockIdx.x * blockDim.x + threadIdx.x;
+
+  if (positions) {
+    if (batch_beam_size == 1) {
+      if (i < new_kv_length)
+        positions[i] = i + total_length - new_kv_length;
+    } else if (i < batch_beam_size)
+      positions[i]++;
+  }
+
+  // GroupQueryAttention's seqlens_k is the total length of each sequence minus one
+  if (seqlens_k) {
+    if (batch_beam_size == 1) {
+      if (i == 0)
+        seqlens_k[0] = total_length - 1;
+    } else if (i < batch_beam_size)
+      seqlens_k[i] += new_kv_length;
+  }
+
+  if (mask_data) {
+    if (update_only) {
+      if (i < new_kv_length * batch_beam_size) {
+        int batch_id = i / new_kv_length;
+        int seq_id = i % new_kv_length;
+        mask_data[batch_id * max_length + total_length - seq_id] = 1;
+      }
+    } else if (i < total_length * batch_beam_size) {
+      int batch_id = i / total_length;
+      int seq_id = i % total_length;
+      if (seq_id < total_length - new_kv_length) {
+        mask_data[batch_id * max_length + seq_id] = old_mask_data[batch_id * (total_length - new_kv_length) + seq_id];
+      } else {
+        mask_data[batch_id * max_length + seq_id] = 1;
+      }
+    }
+  }
+}
+
+template <typename T>
+void Launch_UpdatePositionInputs(T* positions, T* mask_data, const T* old_mask_data, int32_t* seqlens_k, int batch_beam_size,
+                                 int new_kv_length, int total_length, int max_length, bool update_only, cudaStream_t stream) {
+  int count = std::max(batch_beam_size, new_kv_length);
+  if (mask_data)
+    count = std::max(count, batch_beam_size * (update_only ? new_kv_length : total_length));
+  int threads = std::min(256, count);
+  int blocks = (count + threads - 1) / threads;
+  UpdatePositionInputs<T><<<blocks, threads, 0, stream>>>(positions, mask_data, old_mask_data, seqlens_k, batch_beam_size, new_kv_length, total_length, max_length, update_only);
+}
+
+template void Launch_UpdatePositionInputs(int32_t* positions, int32_t* mask_data, const int32_t* old_mask_data, int32_t* seqlens_k, int batch_beam_size, int new_kv_length, int total_length, int max_length, bool update_only, cudaStream_t stream);
+template void Launch_UpdatePositionInputs(int64_t* positions, int64_t* mask_data, const int64_t* old_mask_data, int32_t* seqlens_k, int batch_beam_size, int new_kv_length, int total_length, int max_length, bool update_only, cudaStream_t stream);
+
 __global__ void HandleEOSArray(float* batch_logits, int batch_beam_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count) {
   int index = blockIdx.x * blockDim.x + threadIdx.x;
   if (index >= batch_beam_size)
@@ -125,6 +184,30 @@ void LaunchFp32ToFp16(const float* fp32, uint16_t* fp16, int count, cudaStream_t
   ConvertFp32ToFp16<<<num_blocks, block_size, 0, stream>>>(fp32, reinterpret_cast<half*>(fp16), count);
 }
 
+__global__ void ConvertBf16ToFp32(const __nv_bfloat16* src, float* dst, int count) {
+  int idx = threadIdx.x + blockIdx.x * blockDim.x;
+  if (idx < count)
+    dst[idx] = __bfloat162float(src[idx]);
+}
+
+void LaunchBf16ToFp32(const uint16_t* bf16, float* fp32, int count, cudaStream_t stream) {
+  int block_size = 256;
+  int num_blocks = (count + block_size - 1) / block_size;
+  ConvertBf16ToFp32<<<num_blocks, block_size, 0, stream>>>(reinterpret_cast<const __nv_bfloat16*>(bf16), fp32, count);
+}
+
+__global__ void ConvertFp32ToBf16(const float* src, __nv_bfloat16* dst, int count) {
+  int idx = threadIdx.x + blockIdx.x * blockDim.x;
+  if (idx < count)
+    dst[idx] = __float2bfloat16(src[idx]);
+}
+
+void LaunchFp32ToBf16(const float* fp32, uint16_t* bf16, int count, cudaStream_t stream) {
+  int block_size = 256;
+  int num_blocks = (count + block_size - 1) / block_size;
+  ConvertFp32ToBf16<<<num_blocks, block_size, 0, stream>>>(fp32, reinterpret_cast<__nv_bfloat16*>(bf16), count);
+}
+
 __global__ void ConvertInt32ToInt64(const int32_t* src, int64_t* dst, int count) {
   int idx = threadIdx.x + blockIdx.x * blockDim.x;
   if (idx < count) {
@@ -43,6 +43,22 @@ GreedySearch_Cuda::GreedySearch_Cuda(const GeneratorParams& params)
   else
     random_seed = std::random_device{}();
   samplingdata_ = std::make_unique<cuda::SamplingData>(random_seed, params_->search.batch_size, params_->config.model.vocab_size, GetStream());
+
+  if (!params_->batch_top_k.empty()) {
+    const size_t batch_size = params_->search.batch_size;
+    batch_top_k_ = CudaMallocArray<int32_t>(batch_size);
+    batch_top_p_ = CudaMallocArray<float>(batch_size);
+    batch_temperature_ = CudaMallocArray<float>(batch_size);
+    cudaMemcpyAsync(batch_top_k_.get(), params_->batch_top_k.data(), batch_size * sizeof(int32_t), cudaMemcpyHostToDevice, GetStream());
+    cudaMemcpyAsync(batch_top_p_.get(), params_->batch_top_p.data(), batch_size * sizeof(float), cudaMemcpyHostToDevice, GetStream());
+    cudaMemcpyAsync(batch_temperature_.get(), params_->batch_temperature.data(), batch_size * sizeof(float), cudaMemcpyHostToDevice, GetStream());
+  }
+
+  auto& eos_token_ids = params_->config.model.eos_token_ids;
+  if (!eos_token_ids.empty()) {
+    eos_token_ids_ = CudaMallocArray<int32_t>(eos_token_ids.size());
+    cudaMemcpyAsync(eos_token_ids_.get(), eos_token_ids.data(), eos_token_ids.size() * sizeof(int32_t), cudaMemcpyHostToDevice, GetStream());
+  }
 }
 
 BeamSearch_Cuda::BeamSearch_Cuda(const GeneratorParams& params)
@@ -151,11 +167,45 @@ void GreedySearch_Cuda::SampleTopKTopP(int k, float p, float temperature) {
   assert(scores.size() == params_->search.batch_size * params_->config.model.vocab_size);
   cuda::GetSample(samplingdata_.get(), GetStream(), next_tokens_.data(), scores.data(), int(scores.size() / params_->search.batch_size),
                   params_->search.batch_size, k, p, temperature);
+  AppendSampledTokens();
+}
+
+void GreedySearch_Cuda::SelectTop() {
+  // The scores already went through Logits::Get and the penalties, so this is a plain argmax
+  cuda::LaunchSelectTop(next_token_scores_.Span().data(), next_tokens_.data(), params_->search.batch_size, params_->config.model.vocab_size,
+                        nullptr, 0, nullptr, nullptr, 0, 0, 1.0f, GetStream());
+  AppendSampledTokens();
+}
+
+void GreedySearch_Cuda::SelectTopFp16(DeviceSpan<Ort::Float16_t> logits, float repetition_penalty) {
+  const int vocab_size = params_->config.model.vocab_size;
+  assert(logits.size() == params_->search.batch_size * vocab_size);
+  if (repetition_penalty != 1.0f && !seen_bits_)
+    seen_bits_ = CudaMallocArray<uint32_t>(params_->search.batch_size * ((vocab_size + 31) / 32));
+
+  cuda::LaunchSelectTop(logits.Span().data(), next_tokens_.data(), params_->search.batch_size, vocab_size,
+                        eos_token_ids_.get(), static_cast<int>(params_->config.model.eos_token_ids.size()),
+                        sequences_.GetSequences().Span().data(), seen_bits_.get(), params_->search.max_length, GetSequenceLength(),
+                        repetition_penalty, GetStream());
+  AppendSampledTokens();
+}
+
+void GreedySearch_Cuda::SampleTopKTopP(std::span<const int32_t> k, std::span<const float> p, std::span<const float> temperature) {
+  // The parameters are the GeneratorParams' batch arrays, which were copied to the device in the constructor
+  assert(batch_top_k_ && k.data() == params_->batch_top_k.data() && p.data() == params_->batch_top_p.data() && temperature.data() == params_->batch_temperature.data());
+  std::span<float> scores = next_token_scores_.Span();
+  assert(scores.size() == params_->search.batch_size * params_->config.model.vocab_size);
+  cuda::GetBatchSample(samplingdata_.get(), GetStream(), next_tokens_.data(), scores.data(), int(scores.size() / params_->search.batch_size),
+                       params_->search.batch_size, batch_top_k_.get(), batch_top_p_.get(), batch_temperature_.get());
+  AppendSampledTokens();
+}
 
+void GreedySearch_Cuda::AppendSampledTokens() {
   // Check for EOS
   assert(next_tokens_.size() == eos_meet_.size());
   // Don't replace EOS with pad for batch_size == 1 for continuous decoding mode
   cuda::Launch_CheckForEOSAndPad(next_tokens_.data(), static_cast<int>(next_tokens_.size()), eos_meet_.data(), params_->config.model.eos_token_id, params_->search.batch_size > 1 ? params_->config.model.pad_token_id : params_->config.model.eos_token_id, done_cpu_.get(), GetStream());
+  CudaCheck() == cudaEventRecord(done_event_, GetStream());
 
   // Append tokens
   cuda::Launch_AppendNextTokensToSequences(next_tokens_buffer_.Span(), sequences_.GetSequences().Span(), params_->BatchBeamSize(), sequences_.GetSequenceLength(), sequences_.max_length_, GetStream());
@@ -168,6 +218,20 @@ void GreedySearch_Cuda::SampleTopKTopP(int k, float p, float temperature) {
   }
 }
 
+void GreedySearch_Cuda::ApplyMinP(float min_p, float temperature) {
+  if (min_p <= 0.0f)
+    return;
+
+  cuda::LaunchMinPFilter(GetStream(), next_token_scores_.Span().data(), params_->config.model.vocab_size, params_->search.batch_size, min_p, temperature);
+}
+
+void GreedySearch_Cuda::ApplyTypicalP(float typical_p, float temperature) {
+  if (typical_p <= 0.0f || typical_p >= 1.0f)
+    return;
+
+  cuda::LaunchTypicalPFilter(samplingdata_.get(), GetStream(), next_token_scores_.Span().data(), params_->config.model.vocab_size, params_->search.batch_size, typical_p, temperature);
+}
+
 bool BeamSearch_Cuda::IsDone() const {
   if (beam_scorer_->IsDoneLater())
     return true;
@@ -180,6 +244,10 @@ bool BeamSearch_Cuda::IsDone() const {
   return false;
 }
 
+bool BeamSearch_Cuda::IsDoneReady() const {
+  return beam_scorer_->IsDoneLaterReady();
+}
+
 void BeamSearch_Cuda::Finalize(size_t num_return_sequences) {
   if (finalized_)
     return;
@@ -211,6 +279,7 @@ std::span<float> Search_Cuda::GetScores() {
 // Set user input tokens (batch_beam_size, sequence_length)
 void GreedySearch_Cuda::AppendTokens(DeviceSpan<int32_t>& next_tokens) {
   cudaMemsetAsync(eos_meet_.data(), 0, eos_meet_.size_bytes(), GetStream());
+  cudaEventSynchronize(done_event_);  // A pending CheckForEOSAndPad could still set done_cpu_
   *done_cpu_ = false;
 
   auto next_tokens_gpu = next_tokens.Span();
@@ -238,12 +307,24 @@ void BeamSearch_Cuda::AppendTokens(DeviceSpan<int32_t>& next_tokens) {
 
 void GreedySearch_Cuda::RewindTo(size_t index) {
   cudaMemsetAsync(eos_meet_.data(), 0, eos_meet_.size_bytes(), GetStream());
+  cudaEventSynchronize(done_event_);  // A pending CheckForEOSAndPad could still set done_cpu_
   *done_cpu_ = false;
   if (index > 0)
     cuda::Launch_GetLastTokens(next_tokens_.data(), sequences_.GetSequences().Span().data(), static_cast<int>(params_->BatchBeamSize()), static_cast<int>(index), sequences_.max_length_, GetStream());
   else
     cudaMemsetAsync(next_tokens_.data(), 0, params_->search.batch_size * sizeof(int32_t), GetStream());
   sequences_.RewindTo(index);
+  counted_length_ = 0;
+}
+
+void GreedySearch_Cuda::EvictTokens(size_t begin, size_t count) {
+  Search_Cuda::EvictTokens(begin, count);
+  counted_length_ = 0;
+}
+
+void GreedySearch_Cuda::FinishSequence(size_t batch_id) {
+  cuda::Launch_FinishSequence(eos_meet_.data(), static_cast<int>(eos_meet_.size()), static_cast<int>(batch_id), done_cpu_.get(), GetStream());
+  CudaCheck() == cudaEventRecord(done_event_, GetStream());
 }
 
 void Search_Cuda::ApplyMinLength(int min_length) {
@@ -262,4 +343,132 @@ void Search_Cuda::ApplyRepetitionPenalty(float penalty) {
                                          params_->search.max_length, GetSequenceLength(), penalty, GetStream());
 }
 
-}  // namespace Generators
\ No newline at end of file
+void Search_Cuda::ApplyFrequencyPenalty(float frequency_penalty, float presence_penalty) {
+  if (frequency_penalty == 0.0f && presence_penalty == 0.0f)
+    return;
+
+  UpdateTokenCounts();
+  cuda::LaunchFrequencyPenaltyProcessor(token_counts_.get(), GetScores().data(), static_cast<int>(params_->BatchBeamSize()),
+                                        params_->config.model.vocab_size, frequency_penalty, presence_penalty, GetStream());
+}
+
+void Search_Cuda::UpdateTokenCounts() {
+  const int batch_beam_size = static_cast<int>(params_->BatchBeamSize());
+  const int vocab_size = params_->config.model.vocab_size;
+  if (!token_counts_)
+    token_counts_ = CudaMallocArray<int32_t>(static_cast<size_t>(batch_beam_size) * vocab_size);
+
+  const size_t length = GetSequenceLength();
+  if (params_->search.num_beams > 1 || counted_length_ > length)
+    counted_length_ = 0;
+  cuda::LaunchCountTokens(sequences_.GetSequences().Span().data(), token_counts_.get(), batch_beam_size, vocab_size,
+                          params_->search.max_length, static_cast<int>(counted_length_), static_cast<int>(length), GetStream());
+  counted_length_ = length;
+}
+
+// Uploaded again only when the bias changes, see Generator::SetLogitsBias
+void Search_Cuda::UploadLogitBias(std::span<const std::pair<int32_t, float>> logit_bias) {
+  if (std::equal(logit_bias.begin(), logit_bias.end(), logit_bias_.begin(), logit_bias_.end()))
+    return;
+
+  logit_bias_.assign(logit_bias.begin(), logit_bias.end());
+  const int count = static_cast<int>(logit_bias.size());
+  const int vocab_size = params_->config.model.vocab_size;
+  std::vector<int32_t> tokens(count);
+  std::vector<float> biases(count);
+  std::vector<float> dense(vocab_size);
+  for (int i = 0; i < count; i++) {
+    std::tie(tokens[i], biases[i]) = logit_bias[i];
+    dense[tokens[i]] += biases[i];
+  }
+
+  logit_bias_tokens_ = CudaMallocArray<int32_t>(count);
+  logit_bias_values_ = CudaMallocArray<float>(count);
+  if (!logit_bias_dense_)
+    logit_bias_dense_ = CudaMallocArray<float>(vocab_size);
+  cudaMemcpyAsync(logit_bias_tokens_.get(), tokens.data(), count * sizeof(int32_t), cudaMemcpyHostToDevice, GetStream());
+  cudaMemcpyAsync(logit_bias_values_.get(), biases.data(), count * sizeof(float), cudaMemcpyHostToDevice, GetStream());
+  cudaMemcpyAsync(logit_bias_dense_.get(), dense.data(), vocab_size * sizeof(float), cudaMemcpyHostToDevice, GetStream());
+}
+
+void Search_Cuda::UploadTokenMask(std::span<const uint32_t> mask) {
+  if (!token_mask_)
+    token_mask_ = CudaMallocArray<uint32_t>(mask.size());
+  cudaMemcpyAsync(token_mask_.get(), mask.data(), mask.size_bytes(), cudaMemcpyHostToDevice, GetStream());
+}
+
+void Search_Cuda::ApplyLogitBias(std::span<const std::pair<int32_t, float>> logit_bias) {
+  if (logit_bias.empty())
+    return;
+
+  UploadLogitBias(logit_bias);
+  cuda::LaunchLogitBiasProcessor(logit_bias_tokens_.get(), logit_bias_values_.get(), static_cast<int>(logit_bias.size()),
+                                 GetScores().data(), static_cast<int>(params_->BatchBeamSize()), params_->config.model.vocab_size, GetStream());
+}
+
+void Search_Cuda::ApplyTokenMask(std::span<const uint32_t> mask) {
+  UploadTokenMask(mask);
+  cuda::LaunchTokenMaskProcessor(token_mask_.get(), GetScores().data(), static_cast<int>(params_->BatchBeamSize()),
+                                 params_->config.model.vocab_size, GetStream());
+}
+
+void Search_Cuda::ApplyLogitsProcessors(const LogitsProcessors& processors) {
+  const int batch_beam_size = static_cast<int>(params_->BatchBeamSize());
+  const int vocab_size = params_->config.model.vocab_size;
+  cuda::FusedLogitsProcessorParams fused{GetScores().data(), batch_beam_size, vocab_size, params_->config.model.eos_token_id};
+  int enabled = 0;
+
+  if (GetSequenceLength() < processors.min_length)
+    enabled |= cuda::kFusedMinLength;
+  if (processors.repetition_penalty != 1.0f) {
+    enabled |= cuda::kFusedRepetitionPenalty;
+    fused.repetition_penalty = processors.repetition_penalty;
+  }
+  if (processors.frequency_penalty != 0.0f || processors.presence_penalty != 0.0f) {
+    enabled |= cuda::kFusedFrequencyPenalty;
+    fused.frequency_penalty = processors.frequency_penalty;
+    fused.presence_penalty = processors.presence_penalty;
+  }
+  // Both penalties look up the counts instead of searching the sequence for every token
+  if (enabled & (cuda::kFusedRepetitionPenalty | cuda::kFusedFrequencyPenalty)) {
+    UpdateTokenCounts();
+    fused.token_counts = token_counts_.get();
+  }
+  if (!processors.logit_bias.empty()) {
+    UploadLogitBias(processors.logit_bias);
+    enabled |= cuda::kFusedLogitBias;
+    fused.logit_bias = logit_bias_dense_.get();
+  }
+  if (!processors.token_mask.empty()) {
+    UploadTokenMask(processors.token_mask);
+    enabled |= cuda::kFusedTokenMask;
+    fused.token_mask = token_mask_.get();
+  }
+
+  // The n-gram processor only touches the tokens it bans, so it stays a kernel of its own
+  cuda::LaunchFusedLogitsProcessors(fused, enabled, GetStream());
+  ApplyNoRepeatNGram(processors.no_repeat_ngram_size);
+}
+
+void Search_Cuda::ComputeTopLogProbs(int n) {
+  const int batch_beam_size = params_->BatchBeamSize();
+  const int vocab_size = params_->config.model.vocab_size;
+  if (!log_softmax_) {
+    log_softmax_ = CudaMallocArray<float>(static_cast<size_t>(batch_beam_size) * vocab_size);
+    top_logprob_tokens_ = params_->p_device->Allocate<int32_t>(static_cast<size_t>(batch_beam_size) * n);
+    top_logprobs_ = params_->p_device->Allocate<float>(static_cast<size_t>(batch_beam_size) * n);
+  }
+  cuda::GetTopLogProbs(GetStream(), GetScores().data(), log_softmax_.get(), top_logprobs_.Span().data(), top_logprob_tokens_.Span().data(),
+                       vocab_size, batch_beam_size, n);
+}
+
+void Search_Cuda::ApplyNoRepeatNGram(int ngram_size) {
+  if (ngram_size <= 0)
+    return;
+
+  cuda::LaunchNoRepeatNGramProcessor(sequences_.GetSequences().Span().data(),
+                                     GetScores().data(), static_cast<int>(params_->BatchBeamSize()), params_->config.model.vocab_size,
+                                     params_->search.max_length, GetSequenceLength(), ngram_size, GetStream());
+}
+
+}  // namespace Generators
@@ -2,8 +2,10 @@
 // Licensed under the MIT License.
 
 #include <cuda_runtime.h>
+#include <cuda_fp16.h>
 #include <cub/cub.cuh>
 #include <algorithm>
+#include <cfloat>
 #include "../generators.h"
 #include "cuda_common.h"
 #include "interface.h"
@@ -66,6 +68,77 @@ __global__ void ArgMax(cub::KeyValuePair<int, float>* argmaxen, int32_t* next_to
   next_tokens[batch_index] = argmaxen[batch_index].key;
 }
 
+__device__ __forceinline__ float ToFloat(float value) { return value; }
+__device__ __forceinline__ float ToFloat(half value) { return __half2float(value); }
+
+// Greedy selection in one block per batch entry. With a repetition penalty, the block first marks the tokens of its
+// sequence in seen_bits (one bit per vocabulary entry) so every score is penalized at most once while it is read.
+// The EOS tokens map to the first one, which matches Logits::Get giving it the highest score of all EOS tokens.
+template <typename T, int kBlockSize>
+__global__ void SelectTopKernel(const T* logits, int32_t* next_tokens, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count,
+                                const int32_t* sequences, uint32_t* seen_bits, int max_sequence_length, int current_sequence_length, float repetition_penalty) {
+  int batch_index = blockIdx.x;
+  const T* batch_logits = logits + static_cast<size_t>(batch_index) * vocab_size;
+
+  const bool penalize = repetition_penalty != 1.0f;
+  uint32_t* batch_seen_bits = seen_bits + batch_index * ((vocab_size + 31) / 32);
+  if (penalize) {
+    for (int i = threadIdx.x; i < (vocab_size + 31) / 32; i += blockDim.x)
+      batch_seen_bits[i] = 0;
+    __syncthreads();
+    const int32_t* current_sequence = sequences + batch_index * max_sequence_length;
+    for (int i = threadIdx.x; i < current_sequence_length; i += blockDim.x) {
+      int token = current_sequence[i];
+      if (token >= 0 && token < vocab_size)
+        atomicOr(batch_seen_bits + token / 32, 1u << (token % 32));
+    }
+    __syncthreads();
+  }
+
+  cub::KeyValuePair<int, float> thread_top{0, -FLT_MAX};
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x) {
+    float score = ToFloat(batch_logits[i]);
+    if (penalize && (batch_seen_bits[i / 32] >> (i % 32)) & 1)
+      score = score < 0 ? score * repetition_penalty : score / repetition_penalty;
+    if (score > thread_top.value)
+      thread_top = {i, score};
+  }
+
+  // cub reduces within each warp with shuffles first, then across the block's warps
+  typedef cub::BlockReduce<cub::KeyValuePair<int, float>, kBlockSize> BlockReduce;
+  __shared__ typename BlockReduce::TempStorage temp_storage;
+  cub::KeyValuePair<int, float> top = BlockReduce(temp_storage).Reduce(thread_top, cub::ArgMax());
+
+  if (threadIdx.x == 0) {
+    int token = top.key;
+    for (int i = 1; i < eos_token_ids_count; i++) {
+      if (token == eos_token_ids[i])
+        token = eos_token_ids[0];
+    }
+    next_tokens[batch_index] = token;
+  }
+}
+
+template <typename T>
+void LaunchSelectTopKernel(const T* logits, int32_t* next_tokens, int batch_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count,
+                           const int32_t* sequences, uint32_t* seen_bits, int max_sequence_length, int current_sequence_length, float repetition_penalty, cudaStream_t stream) {
+  constexpr int blockSize = 1024;  // Batch size 1 is the common case, so one block has to read the whole vocabulary quickly
+  SelectTopKernel<T, blockSize><<<batch_size, blockSize, 0, stream>>>(logits, next_tokens, vocab_size, eos_token_ids, eos_token_ids_count,
+                                                                     sequences, seen_bits, max_sequence_length, current_sequence_length, repetition_penalty);
+}
+
+void LaunchSelectTop(const float* logits, int32_t* next_tokens, int batch_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count,
+                     const int32_t* sequences, uint32_t* seen_bits, int max_sequence_length, int current_sequence_length, float repetition_penalty, cudaStream_t stream) {
+  LaunchSelectTopKernel(logits, next_tokens, batch_size, vocab_size, eos_token_ids, eos_token_ids_count,
+                        sequences, seen_bits, max_sequence_length, current_sequence_length, repetition_penalty, stream);
+}
+
+void LaunchSelectTop(const Ort::Float16_t* logits, int32_t* next_tokens, int batch_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count,
+                     const int32_t* sequences, uint32_t* seen_bits, int max_sequence_length, int current_sequence_length, float repetition_penalty, cudaStream_t stream) {
+  LaunchSelectTopKernel(reinterpret_cast<const half*>(logits), next_tokens, batch_size, vocab_size, eos_token_ids, eos_token_ids_count,
+                        sequences, seen_bits, max_sequence_length, current_sequence_length, repetition_penalty, stream);
+}
+
 struct ArgMaxDataImpl : ArgMaxData {
   cuda_unique_ptr<uint8_t> temp_storage_;
   size_t temp_storage_element_size_{};  // Size per batch, temp_storage_ is this size * batch_size
@@ -104,6 +177,20 @@ void Launch_CheckForEOSAndPad(int32_t* next_tokens, int next_tokens_count, bool*
   CheckForEOSAndPad<<<1, 1, 0, stream>>>(next_tokens, next_tokens_count, eos_meet, eos_token_id, pad_token_id, done_cpu);
 }
 
+// Marks a batch entry as if it had selected EOS, for a stop sequence found on the CPU
+__global__ void FinishSequence(bool* eos_meet, int count, int batch_id, bool* done_cpu) {
+  eos_meet[batch_id] = true;
+  for (int i = 0; i < count; i++) {
+    if (!eos_meet[i])
+      return;
+  }
+  *done_cpu = true;
+}
+
+void Launch_FinishSequence(bool* eos_meet, int count, int batch_id, bool* done_cpu, cudaStream_t stream) {
+  FinishSequence<<<1, 1, 0, stream>>>(eos_meet, count, batch_id, done_cpu);
+}
+
 __global__ void AddProbsKernel(float* log_probs,
                                float* cum_log_probs,
                                const int vocab_size,
@@ -173,5 +260,171 @@ void LaunchRepetitionPenaltyProcessor(const int32_t* sequences, float* next_toke
   RepetitionPenaltyProcessor<<<gridSize, blockSize, 0, stream>>>(sequences, next_token_scores, max_sequence_length, vocab_size, total_elements, current_sequence_length, repetition_penalty);
 }
 
+__global__ void CountTokensKernel(const int32_t* sequences, int32_t* token_counts, int max_sequence_length, int vocab_size, int begin, int count, int total_elements) {
+  int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index >= total_elements)
+    return;
+
+  int batch_beam_index = index / count;
+  int token = sequences[batch_beam_index * max_sequence_length + begin + index % count];
+  if (token >= 0 && token < vocab_size)
+    atomicAdd(token_counts + batch_beam_index * vocab_size + token, 1);
+}
+
+__global__ void FrequencyPenaltyProcessor(const int32_t* token_counts, float* next_token_scores, int total_elements, float frequency_penalty, float presence_penalty) {
+  int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index >= total_elements)
+    return;
+
+  int count = token_counts[index];
+  if (count > 0)
+    next_token_scores[index] -= frequency_penalty * count + presence_penalty;
+}
+
+void LaunchCountTokens(const int32_t* sequences, int32_t* token_counts, int batch_beam_size, int vocab_size, int max_sequence_length, int begin, int end, cudaStream_t stream) {
+  constexpr int blockSize = 256;
+  if (begin == 0)
+    cudaMemsetAsync(token_counts, 0, static_cast<size_t>(batch_beam_size) * vocab_size * sizeof(int32_t), stream);
+
+  int total_tokens = batch_beam_size * (end - begin);
+  if (total_tokens > 0)
+    CountTokensKernel<<<(total_tokens + blockSize - 1) / blockSize, blockSize, 0, stream>>>(sequences, token_counts, max_sequence_length, vocab_size, begin, end - begin, total_tokens);
+}
+
+void LaunchFrequencyPenaltyProcessor(const int32_t* token_counts, float* next_token_scores, int batch_beam_size, int vocab_size, float frequency_penalty, float presence_penalty, cudaStream_t stream) {
+  constexpr int blockSize = 256;
+  int total_elements = batch_beam_size * vocab_size;
+  FrequencyPenaltyProcessor<<<(total_elements + blockSize - 1) / blockSize, blockSize, 0, stream>>>(token_counts, next_token_scores, total_elements, frequency_penalty, presence_penalty);
+}
+
+// One thread per position an earlier n-gram can start at, if it matches the last ngram_size - 1 tokens its last token is banned
+__global__ void NoRepeatNGramProcessor(const int32_t* sequences, float* next_token_scores, int max_sequence_length, int vocab_size, int current_sequence_length, int ngram_size, int total_elements) {
+  int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index >= total_elements)
+    return;
+
+  int start_count = current_sequence_length - ngram_size + 1;
+  int batch_beam_index = index / start_count;
+  int start = index % start_count;
+
+  const int32_t* current_sequence = sequences + batch_beam_index * max_sequence_length;
+  const int32_t* prefix = current_sequence + current_sequence_length - (ngram_size - 1);
+  for (int i = 0; i < ngram_size - 1; i++) {
+    if (current_sequence[start + i] != prefix[i])
+      return;
+  }
+
+  int token = current_sequence[start + ngram_size - 1];
+  if (token >= 0 && token < vocab_size)
+    next_token_scores[batch_beam_index * vocab_size + token] = -FLT_MAX;
+}
+
+void LaunchNoRepeatNGramProcessor(const int32_t* sequences, float* next_token_scores, int batch_beam_size, int vocab_size, int max_sequence_length, int current_sequence_length, int ngram_size, cudaStream_t stream) {
+  int total_elements = batch_beam_size * (current_sequence_length - ngram_size + 1);
+  if (total_elements <= 0)
+    return;
+
+  constexpr int blockSize = 256;
+  const int gridSize = (total_elements + blockSize - 1) / blockSize;
+  NoRepeatNGramProcessor<<<gridSize, blockSize, 0, stream>>>(sequences, next_token_scores, max_sequence_length, vocab_size, current_sequence_length, ngram_size, total_elements);
+}
+
+// One thread per batch_beam entry and biased token
+__global__ void LogitBiasProcessor(const int32_t* tokens, const float* biases, int count, float* next_token_scores, int vocab_size, int total_elements) {
+  int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index >= total_elements)
+    return;
+
+  int batch_beam_index = index / count;
+  int bias_index = index % count;
+  next_token_scores[batch_beam_index * vocab_size + tokens[bias_index]] += biases[bias_index];
+}
+
+void LaunchLogitBiasProcessor(const int32_t* tokens, const float* biases, int count, float* next_token_scores, int batch_beam_size, int vocab_size, cudaStream_t stream) {
+  int total_elements = batch_beam_size * count;
+  if (total_elements <= 0)
+    return;
+
+  constexpr int blockSize = 256;
+  const int gridSize = (total_elements + blockSize - 1) / blockSize;
+  LogitBiasProcessor<<<gridSize, blockSize, 0, stream>>>(tokens, biases, count, next_token_scores, vocab_size, total_elements);
+}
+
+// One thread per score, the 32 threads of a warp share one word of the mask
+__global__ void TokenMaskProcessor(const uint32_t* mask, float* next_token_scores, int vocab_size, int word_count, int total_elements) {
+  int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index >= total_elements)
+    return;
+
+  int batch_beam_index = index / vocab_size;
+  int token = index % vocab_size;
+  if (!(mask[batch_beam_index * word_count + token / 32] & (1U << (token % 32))))
+    next_token_scores[index] = -FLT_MAX;
+}
+
+void LaunchTokenMaskProcessor(const uint32_t* mask, float* next_token_scores, int batch_beam_size, int vocab_size, cudaStream_t stream) {
+  int total_elements = batch_beam_size * vocab_size;
+  if (total_elements <= 0)
+    return;
+
+  constexpr int blockSize = 256;
+  const int gridSize = (total_elements + blockSize - 1) / blockSize;
+  TokenMaskProcessor<<<gridSize, blockSize, 0, stream>>>(mask, next_token_scores, vocab_size, (vocab_size + 31) / 32, total_elements);
+}
+
+// One thread per score, blockIdx.y is the batch_beam entry. 'Processors' is a constant, so the processors that aren't
+// enabled are compiled out. The token mask and the minimum length leave the lowest float whatever the other processors
+// would have done to the score, so they are checked first.
+template <int Processors>
+__global__ void FusedLogitsProcessorsKernel(FusedLogitsProcessorParams params) {
+  int token = blockIdx.x * blockDim.x + threadIdx.x;
+  if (token >= params.vocab_size)
+    return;
+
+  size_t index = static_cast<size_t>(blockIdx.y) * params.vocab_size + token;
+  if constexpr ((Processors & kFusedTokenMask) != 0) {
+    const int word_count = (params.vocab_size + 31) / 32;
+    if (!(params.token_mask[blockIdx.y * word_count + token / 32] & (1U << (token % 32)))) {
+      params.next_token_scores[index] = -FLT_MAX;
+      return;
+    }
+  }
+  if constexpr ((Processors & kFusedMinLength) != 0) {
+    if (token == params.eos_token_id) {
+      params.next_token_scores[index] = -FLT_MAX;
+      return;
+    }
+  }
+
+  float score = params.next_token_scores[index];
+  if constexpr ((Processors & (kFusedRepetitionPenalty | kFusedFrequencyPenalty)) != 0) {
+    int count = params.token_counts[index];
+    if (count > 0) {
+      if constexpr ((Processors & kFusedRepetitionPenalty) != 0)
+        score = score < 0 ? score * params.repetition_penalty : score / params.repetition_penalty;
+      if constexpr ((Processors & kFusedFrequencyPenalty) != 0)
+        score -= params.frequency_penalty * count + params.presence_penalty;
+    }
+  }
+  if constexpr ((Processors & kFusedLogitBias) != 0)
+    score += params.logit_bias[token];
+  params.next_token_scores[index] = score;
+}
+
+template <int... Processors>
+constexpr auto MakeFusedLogitsProcessorsKernels(std::integer_sequence<int, Processors...>) {
+  return std::array{&FusedLogitsProcessorsKernel<Processors>...};
+}
+
+void LaunchFusedLogitsProcessors(const FusedLogitsProcessorParams& params, int processors, cudaStream_t stream) {
+  static constexpr auto kernels = MakeFusedLogitsProcessorsKernels(std::make_integer_sequence<int, kFusedAll + 1>{});
+  if (processors == 0 || params.batch_beam_size <= 0)
+    return;
+
+  constexpr int blockSize = 256;
+  dim3 grid((params.vocab_size + blockSize - 1) / blockSize, params.batch_beam_size);
+  kernels[processors]<<<grid, blockSize, 0, stream>>>(params);
+}
+
 }  // namespace cuda
 }  // namespace Generators
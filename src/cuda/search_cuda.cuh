@@ -10,13 +10,54 @@ struct ArgMaxData {
 };
 
 void Launch_CheckForEOSAndPad(int32_t* next_tokens, int next_tokens_count, bool* eos_meet, int eos_token_id, int pad_token_id, bool* done_cpu, cudaStream_t stream);
+void Launch_FinishSequence(bool* eos_meet, int count, int batch_id, bool* done_cpu, cudaStream_t stream);
 void Launch_ExpandInputSequences(const std::span<int32_t> input_sequences, std::span<int32_t> sequences, int batch_size, int beam_size, int max_length, cudaStream_t stream);
 void Launch_AppendNextTokensToSequences(std::span<const int32_t> next_tokens, std::span<int32_t> sequences, int batch_beam_size, int past_length, int max_length, cudaStream_t stream);
 void Launch_GetLastTokens(int32_t* next_tokens, const int32_t* sequences, int batch_beam_size, int sequence_length, int max_length, cudaStream_t stream);
+// Writes the highest scoring token of each batch entry to next_tokens. With eos_token_ids, all EOS tokens are selected
+// as the first one. With a repetition_penalty != 1, seen_bits needs batch_size * ((vocab_size + 31) / 32) elements.
+void LaunchSelectTop(const float* logits, int32_t* next_tokens, int batch_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count,
+                     const int32_t* sequences, uint32_t* seen_bits, int max_sequence_length, int current_sequence_length, float repetition_penalty, cudaStream_t stream);
+void LaunchSelectTop(const Ort::Float16_t* logits, int32_t* next_tokens, int batch_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count,
+                     const int32_t* sequences, uint32_t* seen_bits, int max_sequence_length, int current_sequence_length, float repetition_penalty, cudaStream_t stream);
 
 void LaunchAddProbsKernel(float* log_probs, float* cum_log_probs, const int batch_size, const int num_beams, const int vocab_size, cudaStream_t stream);
 void LaunchSetScoreProcessor(float* next_token_scores, int batch_beam_size, int vocab_size, int token, float score, cudaStream_t stream);
 void LaunchRepetitionPenaltyProcessor(const int32_t* sequences, float* next_token_scores, int batch_size, int num_beams, int vocab_size, int max_sequence_length, int current_sequence_length, float repetition_penalty, cudaStream_t stream);
+void LaunchFrequencyPenaltyProcessor(const int32_t* token_counts, float* next_token_scores, int batch_beam_size, int vocab_size, float frequency_penalty, float presence_penalty, cudaStream_t stream);
+void LaunchNoRepeatNGramProcessor(const int32_t* sequences, float* next_token_scores, int batch_beam_size, int vocab_size, int max_sequence_length, int current_sequence_length, int ngram_size, cudaStream_t stream);
+void LaunchLogitBiasProcessor(const int32_t* tokens, const float* biases, int count, float* next_token_scores, int batch_beam_size, int vocab_size, cudaStream_t stream);
+void LaunchTokenMaskProcessor(const uint32_t* mask, float* next_token_scores, int batch_beam_size, int vocab_size, cudaStream_t stream);
+
+// The processors of FusedLogitsProcessorParams that LaunchFusedLogitsProcessors applies
+enum FusedLogitsProcessor {
+  kFusedMinLength = 1,          // Sets the score of eos_token_id to the lowest float
+  kFusedRepetitionPenalty = 2,  // Uses token_counts
+  kFusedFrequencyPenalty = 4,   // Frequency and presence penalty, uses token_counts
+  kFusedLogitBias = 8,          // Adds logit_bias, shape (vocab_size)
+  kFusedTokenMask = 16,         // See LaunchTokenMaskProcessor
+  kFusedAll = 31,
+};
+
+struct FusedLogitsProcessorParams {
+  float* next_token_scores;  // shape (batch_beam_size, vocab_size)
+  int batch_beam_size;
+  int vocab_size;
+  int eos_token_id;
+  const int32_t* token_counts;  // shape (batch_beam_size, vocab_size), see LaunchCountTokens
+  float repetition_penalty;
+  float frequency_penalty;
+  float presence_penalty;
+  const float* logit_bias;
+  const uint32_t* token_mask;
+};
+
+// Adds the tokens at [begin, end) of the sequences to token_counts, which count the tokens before 'begin'. A begin of 0
+// clears the counts first.
+void LaunchCountTokens(const int32_t* sequences, int32_t* token_counts, int batch_beam_size, int vocab_size, int max_sequence_length, int begin, int end, cudaStream_t stream);
+// Applies the 'processors' (a mask of FusedLogitsProcessor values) in one pass over the scores, with a kernel
+// specialized for that combination of processors.
+void LaunchFusedLogitsProcessors(const FusedLogitsProcessorParams& params, int processors, cudaStream_t stream);
 
 void TopPSampling(int32_t* next_token, float* scores, int size, float p, float temperature);
 }  // namespace cuda
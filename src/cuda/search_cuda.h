@@ -15,16 +15,26 @@ struct Search_Cuda : Search {
 
   DeviceSpan<int32_t> GetSequenceLengths() override { return sequence_lengths_; }
 
+  // done_cpu_ is written by the CheckForEOSAndPad kernel, so only wait for it vs. everything queued on the stream
   bool IsDone() const {
-    cudaStreamSynchronize(GetStream());
+    CudaCheck() == cudaEventSynchronize(done_event_);
     return *done_cpu_;
-  }  // TODO: Use an event
+  }
+  bool IsDoneReady() const override { return cudaEventQuery(done_event_) != cudaErrorNotReady; }
 
   DeviceSpan<float> GetLogits() const override;
   void SetLogits(DeviceSpan<float> logits) override;
 
   void ApplyMinLength(int min_length) override;
   void ApplyRepetitionPenalty(float penalty) override;
+  void ApplyFrequencyPenalty(float frequency_penalty, float presence_penalty) override;
+  void ApplyNoRepeatNGram(int ngram_size) override;
+  void ApplyLogitBias(std::span<const std::pair<int32_t, float>> logit_bias) override;
+  void ApplyTokenMask(std::span<const uint32_t> mask) override;
+  // All but the no repeat n-gram processor are fused into one kernel, see cuda::LaunchFusedLogitsProcessors
+  void ApplyLogitsProcessors(const LogitsProcessors& processors) override;
+
+  void ComputeTopLogProbs(int n) override;
 
   std::span<float> GetScores(int batch_beam_index);
   std::span<float> GetScores();
@@ -38,6 +48,26 @@ struct Search_Cuda : Search {
   DeviceSpan<float> next_token_scores_;  // shape (beam_size*batch_size, vocab_size)
 
   cuda_host_unique_ptr<bool> done_cpu_;
+  mutable cuda_event_holder done_event_{cudaEventDisableTiming};  // Recorded after the last kernel that writes done_cpu_
+
+  // Brings token_counts_ up to date with the sequences. Greedy search only counts the tokens appended since the last
+  // update, beam search recounts since its beams are reordered every step.
+  void UpdateTokenCounts();
+
+  cuda_unique_ptr<int32_t> token_counts_;  // shape (beam_size*batch_size, vocab_size), allocated on the first penalty that counts tokens
+  size_t counted_length_{};                // The number of tokens of every sequence in token_counts_, reset when tokens are removed
+
+  void UploadLogitBias(std::span<const std::pair<int32_t, float>> logit_bias);
+  void UploadTokenMask(std::span<const uint32_t> mask);
+
+  std::vector<std::pair<int32_t, float>> logit_bias_;  // The bias uploaded to the three arrays below
+  cuda_unique_ptr<int32_t> logit_bias_tokens_;         // shape (logit_bias.size())
+  cuda_unique_ptr<float> logit_bias_values_;           // shape (logit_bias.size())
+  cuda_unique_ptr<float> logit_bias_dense_;            // shape (vocab_size), the bias of every token for the fused processors
+
+  cuda_unique_ptr<uint32_t> token_mask_;  // shape (beam_size*batch_size, (vocab_size + 31) / 32), allocated on the first ApplyTokenMask
+
+  cuda_unique_ptr<float> log_softmax_;  // shape (beam_size*batch_size, vocab_size), allocated on the first ComputeTopLogProbs
 };
 
 struct GreedySearch_Cuda : Search_Cuda {
@@ -46,17 +76,32 @@ struct GreedySearch_Cuda : Search_Cuda {
   DeviceSpan<int32_t> GetNextTokens() override;
   DeviceSpan<int32_t> GetNextIndices() override { return {}; }
 
-  void SelectTop() override { SampleTopKTopP(1, 0.0, 1.0); }
+  void SelectTop() override;
+  void SelectTopFp16(DeviceSpan<Ort::Float16_t> logits, float repetition_penalty) override;
   void SampleTopK(int k, float t) override { SampleTopKTopP(k, 0.0, t); }
   void SampleTopP(float p, float t) override { SampleTopKTopP(-1, p, t); }
   void SampleTopKTopP(int k, float p, float t) override;
+  void SampleTopKTopP(std::span<const int32_t> k, std::span<const float> p, std::span<const float> t) override;
+  void ApplyMinP(float min_p, float temperature) override;
+  void ApplyTypicalP(float typical_p, float temperature) override;
   void AppendTokens(DeviceSpan<int32_t>& next_tokens) override;  // shape (batch_size, sequence_length)
   void RewindTo(size_t index) override;
+  void EvictTokens(size_t begin, size_t count) override;
+  void FinishSequence(size_t batch_id) override;
 
  private:
+  void AppendSampledTokens();  // Handles EOS and appends the next_tokens_ that were selected
+
   DeviceSpan<int32_t> next_tokens_buffer_;
   std::unique_ptr<cuda::ArgMaxData> argmaxdata_;
   std::unique_ptr<cuda::SamplingData> samplingdata_;
+
+  cuda_unique_ptr<int32_t> batch_top_k_;      // shape (batch_size), set if the GeneratorParams have per batch entry sampling parameters
+  cuda_unique_ptr<float> batch_top_p_;        // shape (batch_size)
+  cuda_unique_ptr<float> batch_temperature_;  // shape (batch_size)
+
+  cuda_unique_ptr<int32_t> eos_token_ids_;  // The config's eos_token_ids, for SelectTopFp16
+  cuda_unique_ptr<uint32_t> seen_bits_;     // shape (batch_size, (vocab_size + 31) / 32), allocated on the first penalized SelectTopFp16
 };
 
 struct BeamSearch_Cuda : Search_Cuda {
@@ -74,6 +119,7 @@ struct BeamSearch_Cuda : Search_Cuda {
   void SelectTop() override;
 
   bool IsDone() const;
+  bool IsDoneReady() const override;
 
  private:
   void Finalize(size_t num_return_sequences);
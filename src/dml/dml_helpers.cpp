@@ -21,7 +21,7 @@ static bool IsSoftwareAdapter(IDXGIAdapter1* adapter) {
   return desc.Flags & DXGI_ADAPTER_FLAG_SOFTWARE || (is_basic_render_driver_vendor_id && is_basic_render_driver_device_id);
 };
 
-static std::vector<ComPtr<IDXGIAdapter1>> EnumerateAdapters(PLUID device_luid = nullptr) {
+static std::vector<ComPtr<IDXGIAdapter1>> EnumerateAdapters(PLUID device_luid = nullptr, DXGI_GPU_PREFERENCE preference = DXGI_GPU_PREFERENCE_HIGH_PERFORMANCE) {
   ComPtr<IDXGIFactory4> dxgi_factory;
   THROW_IF_FAILED(CreateDXGIFactory(IID_PPV_ARGS(&dxgi_factory)));
 
@@ -34,7 +34,7 @@ static std::vector<ComPtr<IDXGIAdapter1>> EnumerateAdapters(PLUID device_luid =
     for (uint32_t adapter_index = 0;
          dxgi_factory6->EnumAdapterByGpuPreference(
              adapter_index,
-             DXGI_GPU_PREFERENCE_HIGH_PERFORMANCE,
+             preference,
              IID_PPV_ARGS(&adapter)) != DXGI_ERROR_NOT_FOUND;
          adapter_index++) {
       // Since we enumerate by performance, we can ignore everything that comes after the first software adapter, which includes the IDD
@@ -92,6 +92,41 @@ static ComPtr<IDXGIAdapter1> CreateAdapter(PLUID device_luid = nullptr) {
   return filtered_adapters.front();
 }
 
+// The local video memory the adapter can still allocate within its budget, shared memory for integrated GPUs
+static uint64_t GetFreeMemory(IDXGIAdapter1* adapter) {
+  ComPtr<IDXGIAdapter3> adapter3;
+  if (FAILED(adapter->QueryInterface(IID_PPV_ARGS(&adapter3))))
+    return 0;
+  DXGI_QUERY_VIDEO_MEMORY_INFO memory_info{};
+  THROW_IF_FAILED(adapter3->QueryVideoMemoryInfo(0, DXGI_MEMORY_SEGMENT_GROUP_LOCAL, &memory_info));
+  return memory_info.Budget > memory_info.CurrentUsage ? memory_info.Budget - memory_info.CurrentUsage : 0;
+}
+
+LUID SelectAdapter(std::string_view selection) {
+  std::vector<ComPtr<IDXGIAdapter1>> adapters;
+  if (selection == "high_performance" || selection == "most_free_memory")
+    adapters = EnumerateAdapters(nullptr, DXGI_GPU_PREFERENCE_HIGH_PERFORMANCE);
+  else if (selection == "minimum_power")
+    adapters = EnumerateAdapters(nullptr, DXGI_GPU_PREFERENCE_MINIMUM_POWER);
+  else
+    throw std::runtime_error("Unknown DML adapter_selection: " + std::string(selection));
+
+  if (adapters.empty()) {
+    throw std::runtime_error("No adapter is available for DML.");
+  }
+
+  auto adapter = adapters.begin();
+  if (selection == "most_free_memory") {
+    adapter = std::max_element(adapters.begin(), adapters.end(), [](const auto& a, const auto& b) {
+      return GetFreeMemory(a.Get()) < GetFreeMemory(b.Get());
+    });
+  }
+
+  DXGI_ADAPTER_DESC1 description = {};
+  THROW_IF_FAILED((*adapter)->GetDesc1(&description));
+  return description.AdapterLuid;
+}
+
 DmlObjects CreateDmlObjects(const std::string& current_module_path, PLUID device_luid) {
   D3D12_COMMAND_QUEUE_DESC command_queue_description = {
       D3D12_COMMAND_LIST_TYPE_COMPUTE,
@@ -33,6 +33,9 @@ struct DmlObjects {
 namespace DmlHelpers {
 DmlObjects CreateDmlObjects(const std::string& current_module_path, PLUID device_luid = nullptr);
 
+// Returns the adapter ranked first by 'selection', see SelectDmlAdapter
+LUID SelectAdapter(std::string_view selection);
+
 DmlReusedCommandListState BuildReusableCommandList(
     IDMLDevice* dml_device,
     IDMLCompiledOperator* compiled_operator,
@@ -0,0 +1,110 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <list>
+#include <vector>
+#include <optional>
+#include <memory>
+#include "../span.h"
+#include "dml_gpu_event.h"
+#include "dml_execution_context.h"
+
+// Implements a non-blocking, ring-buffer style readback heap for copying GPU resources to CPU memory. It mirrors
+// DmlPooledUploadHeap, so several readbacks can be in flight at once and the host only waits when it needs the data.
+class DmlPooledReadbackHeap {
+ public:
+  DmlPooledReadbackHeap(ID3D12Device* device, DmlExecutionContext* execution_context);
+
+  // Begins copying data from the specified GPU resource into the CPU memory pointed-to by the span, and returns a
+  // GpuEvent which will become signaled when the GPU side of the copy is complete. The destination memory is only
+  // written by EndReadbackFromGpu (or any later call that finds the copy done), so it must stay valid until then.
+  DmlGpuEvent BeginReadbackFromGpu(
+      std::span<uint8_t> dst,
+      ID3D12Resource* src,
+      uint64_t src_offset,
+      D3D12_RESOURCE_STATES src_state);
+
+  // Waits for the given event and copies every readback that has completed by then into its destination memory.
+  void EndReadbackFromGpu(const DmlGpuEvent& done_event);
+
+  // Copies data from the specified GPU resource into the CPU memory pointed-to by the span. This method will block
+  // until the copy is complete.
+  void ReadbackFromGpu(
+      std::span<uint8_t> dst,
+      ID3D12Resource* src,
+      uint64_t src_offset,
+      D3D12_RESOURCE_STATES src_state) {
+    EndReadbackFromGpu(BeginReadbackFromGpu(dst, src, src_offset, src_state));
+  }
+
+  // Releases unused capacity.
+  void Trim();
+
+  size_t Capacity() const { return total_capacity_; }
+
+ private:
+  static constexpr size_t c_min_chunk_size = 1024 * 1024;  // 1MB
+  static constexpr size_t c_allocation_alignment = 512;    // In bytes; as per D3D12 requirement for buffers
+
+  // A suballoction from a chunk
+  struct Allocation {
+    size_t size_in_bytes;
+
+    // The offset, in bytes, from the beginning of the chunk to the beginning of this allocation
+    size_t offset_in_chunk;
+
+    // The event that will be signaled to when the GPU is done copying into this allocation
+    DmlGpuEvent done_event;
+
+    // Where the allocation's contents go once the copy is done
+    uint8_t* dst;
+  };
+
+  // Represents a single contiguous readback heap from which we carve out suballocations. Ranges are suballocated
+  // from the readback heap in a ring-buffer fashion.
+  struct Chunk {
+    size_t capacity_in_bytes;  // The total size of the readback heap, in bytes
+    ComPtr<ID3D12Resource> resource;
+
+    // Allocations are sorted by ascending fence value - that is, least to most recently allocated
+    std::list<Allocation> allocations;
+  };
+
+  // Calls AssertInvariants on construction and again on destruction
+  class InvariantChecker {
+   public:
+    InvariantChecker(DmlPooledReadbackHeap* parent)
+        : parent_(parent) {
+      parent_->AssertInvariants();
+    }
+
+    ~InvariantChecker() {
+      parent_->AssertInvariants();
+    }
+
+   private:
+    DmlPooledReadbackHeap* parent_;
+  };
+
+  // Attempts to find enough unused space in the supplied chunk to accommodate the given allocation size.
+  // Returns the offset of that memory if successful, null if there wasn't enough space.
+  static std::optional<size_t> FindOffsetForAllocation(const Chunk& chunk, size_t size_in_bytes);
+
+  static Chunk CreateChunk(ID3D12Device* device, size_t size_in_bytes);
+
+  // Finds or creates a chunk with enough space to accommodate an allocation of the given size, and returns a
+  // pointer to the chunk and allocation offset.
+  std::pair<Chunk*, size_t> Reserve(size_t size_in_bytes);
+
+  // Copies out and frees all allocations which the GPU has finished copying into.
+  void ReclaimAllocations();
+  void AssertInvariants();
+
+  ComPtr<ID3D12Device> device_;
+  DmlExecutionContext* execution_context_;
+
+  std::vector<Chunk> chunks_;  // sorted ascending by capacity (readback heap size)
+  size_t total_capacity_ = 0;  // Total size of all chunks, in bytes
+};
@@ -165,11 +165,10 @@ DmlGpuEvent DmlPooledUploadHeap::BeginUploadToGpu(
       D3D12_RESOURCE_STATE_GENERIC_READ,
       src.size());
 
+  // The copy stays in the open command list with the other uploads of this step, they're submitted together before
+  // the session run that reads them (see SubmitRecordedWork). The event signals once that command list completes.
   DmlGpuEvent done_event = execution_context_->GetCurrentCompletionEvent();
 
-  execution_context_->Flush();
-  done_event.WaitForSignal();
-
   // Add an allocation entry to the chunk
   chunk->allocations.push_back(Allocation{static_cast<size_t>(src.size()), offset_in_chunk, done_event});
 
@@ -12,40 +12,44 @@
 #include "../dml/dml_helpers.h"
 #include "../dml/dml_execution_context.h"
 #include "../dml/dml_pooled_upload_heap.h"
-#include "../dml/dml_readback_heap.h"
+#include "../dml/dml_pooled_readback_heap.h"
 
 std::string CurrentModulePath();
 
 namespace Generators {
 namespace Dml {  // If this was in a shared library it wouldn't need to be in its own namespace
 
-Ort::Allocator* ort_allocator_{};
 const char* device_label = "dml";
 
-wil::unique_hmodule smart_directml_dll_;
-DmlObjects dml_objects_;
 const OrtDmlApi* dml_api_{};
-std::unique_ptr<DmlPooledUploadHeap> dml_pooled_upload_heap_;
-std::unique_ptr<DmlExecutionContext> dml_execution_context_;
-std::unique_ptr<DmlReadbackHeap> dml_readback_heap_;
-ComPtr<IDMLDevice> dml_device_;
+
+// The objects of one adapter, every model on that adapter shares them
+struct DeviceContext {
+  wil::unique_hmodule smart_directml_dll_;  // First, so DirectML.dll is unloaded after the device is released
+  Ort::Allocator* ort_allocator_{};
+  DmlObjects dml_objects_;
+  ComPtr<IDMLDevice> dml_device_;
+  std::unique_ptr<DmlExecutionContext> dml_execution_context_;
+  std::unique_ptr<DmlPooledUploadHeap> dml_pooled_upload_heap_;
+  std::unique_ptr<DmlPooledReadbackHeap> dml_pooled_readback_heap_;
+};
 
 struct GpuMemory final : DeviceBuffer {
-  GpuMemory(size_t size) : owned_{true} {
+  GpuMemory(DeviceContext& context, size_t size) : context_{context}, owned_{true} {
     size_in_bytes_ = size;
-    p_device_ = static_cast<uint8_t*>(ort_allocator_->Alloc(size_in_bytes_));
-    Ort::ThrowOnError(dml_api_->GetD3D12ResourceFromAllocation(ort_allocator_, p_device_, &gpu_resource_));
+    p_device_ = static_cast<uint8_t*>(context_.ort_allocator_->Alloc(size_in_bytes_));
+    Ort::ThrowOnError(dml_api_->GetD3D12ResourceFromAllocation(context_.ort_allocator_, p_device_, &gpu_resource_));
   }
 
-  GpuMemory(void* p, size_t size) : owned_{false} {
+  GpuMemory(DeviceContext& context, void* p, size_t size) : context_{context}, owned_{false} {
     size_in_bytes_ = size;
     p_device_ = static_cast<uint8_t*>(p);
-    Ort::ThrowOnError(dml_api_->GetD3D12ResourceFromAllocation(ort_allocator_, p_device_, &gpu_resource_));
+    Ort::ThrowOnError(dml_api_->GetD3D12ResourceFromAllocation(context_.ort_allocator_, p_device_, &gpu_resource_));
   }
 
   ~GpuMemory() override {
     if (owned_)
-      ort_allocator_->Free(p_device_);
+      context_.ort_allocator_->Free(p_device_);
     if (p_cpu_)
       free(p_cpu_);
   }
@@ -59,19 +63,20 @@ struct GpuMemory final : DeviceBuffer {
 
   void CopyDeviceToCpu() override {
     AllocateCpu();
-    dml_readback_heap_->ReadbackFromGpu(std::span(p_cpu_, size_in_bytes_), gpu_resource_.Get(), 0, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+    context_.dml_pooled_readback_heap_->ReadbackFromGpu(std::span(p_cpu_, size_in_bytes_), gpu_resource_.Get(), 0, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
   }
 
   void CopyCpuToDevice() override {
     assert(p_cpu_);
     auto source = std::span(p_cpu_, size_in_bytes_);
-    dml_pooled_upload_heap_->BeginUploadToGpu(gpu_resource_.Get(), 0, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, source);
+    context_.dml_pooled_upload_heap_->BeginUploadToGpu(gpu_resource_.Get(), 0, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, source);
   }
 
   void CopyFrom(size_t begin_dest, DeviceBuffer& source, size_t begin_source, size_t size_in_bytes) override {
-    if (source.GetType() == device_label) {
+    // Buffers of another adapter can't be copied on this one's queue
+    if (source.GetType() == device_label && &dynamic_cast<GpuMemory&>(source).context_ == &context_) {
       auto& source_gpu = dynamic_cast<GpuMemory&>(source);
-      dml_execution_context_->CopyBufferRegion(
+      context_.dml_execution_context_->CopyBufferRegion(
           gpu_resource_.Get(),
           begin_dest,
           D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
@@ -83,6 +88,15 @@ struct GpuMemory final : DeviceBuffer {
       CopyThroughCpu(*this, begin_dest, source, begin_source, size_in_bytes);
   }
 
+  void ReadToCpu(size_t begin, std::span<uint8_t> destination) override {
+    context_.dml_pooled_readback_heap_->ReadbackFromGpu(destination, gpu_resource_.Get(), begin, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+  }
+
+  void WriteFromCpu(size_t begin, std::span<const uint8_t> source) override {
+    // The upload heap copies the source into its own memory, so the caller may reuse it right away
+    context_.dml_pooled_upload_heap_->BeginUploadToGpu(gpu_resource_.Get(), begin, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, source);
+  }
+
   void Zero() override {
     // TODO: Implement a zeroing that runs directly on DML vs going through CPU
     AllocateCpu();
@@ -90,11 +104,12 @@ struct GpuMemory final : DeviceBuffer {
     CopyCpuToDevice();
   }
 
+  DeviceContext& context_;
   ComPtr<ID3D12Resource> gpu_resource_;
   bool owned_;  // If we own the memory, we delete it on destruction
 };
 
-struct InterfaceImpl : DeviceInterface {
+struct InterfaceImpl : DeviceInterface, DeviceContext {
   InterfaceImpl(LUID* p_device_luid) {
     Ort::ThrowOnError(Ort::api->GetExecutionProviderApi("DML", ORT_API_VERSION, reinterpret_cast<const void**>(&dml_api_)));
     if (!dml_api_) {
@@ -117,6 +132,11 @@ struct InterfaceImpl : DeviceInterface {
 
   DeviceType GetType() const override { return DeviceType::DML; }
 
+  bool IsAdapter(const LUID& luid) const {
+    const auto adapter_luid = dml_objects_.d3d12_device->GetAdapterLuid();
+    return adapter_luid.HighPart == luid.HighPart && adapter_luid.LowPart == luid.LowPart;
+  }
+
   void InitOrt(const OrtApi& api, Ort::Allocator& allocator) override {
     Ort::api = &api;
     assert(!ort_allocator_);
@@ -130,7 +150,7 @@ struct InterfaceImpl : DeviceInterface {
         dml_api_);
 
     dml_pooled_upload_heap_ = std::make_unique<DmlPooledUploadHeap>(dml_objects_.d3d12_device.Get(), dml_execution_context_.get());
-    dml_readback_heap_ = std::make_unique<DmlReadbackHeap>(dml_objects_.d3d12_device.Get(), dml_execution_context_.get());
+    dml_pooled_readback_heap_ = std::make_unique<DmlPooledReadbackHeap>(dml_objects_.d3d12_device.Get(), dml_execution_context_.get());
   }
 
   Ort::Allocator& GetAllocator() override {
@@ -138,11 +158,11 @@ struct InterfaceImpl : DeviceInterface {
   }
 
   std::shared_ptr<DeviceBuffer> AllocateBase(size_t size) override {
-    return std::make_shared<GpuMemory>(size);
+    return std::make_shared<GpuMemory>(*this, size);
   }
 
   std::shared_ptr<DeviceBuffer> WrapMemoryBase(void* p, size_t size) override {
-    return std::make_shared<GpuMemory>(p, size);
+    return std::make_shared<GpuMemory>(*this, p, size);
   }
 
   std::unique_ptr<Search> CreateGreedy(const GeneratorParams& params) override {
@@ -207,23 +227,35 @@ struct InterfaceImpl : DeviceInterface {
 
   void Synchronize() override {
   }
+
+  void SubmitRecordedWork() override {
+    dml_execution_context_->Flush();
+  }
 };
 
 }  // namespace Dml
 
-std::unique_ptr<Dml::InterfaceImpl> g_dml_device;
+std::vector<std::unique_ptr<Dml::InterfaceImpl>> g_dml_devices;
+
+DeviceInterface* InitDmlInterface(LUID* p_device_luid) {
+  for (auto& device : g_dml_devices) {
+    if (!p_device_luid || device->IsAdapter(*p_device_luid))
+      return device.get();
+  }
+  return g_dml_devices.emplace_back(std::make_unique<Dml::InterfaceImpl>(p_device_luid)).get();
+}
 
-void InitDmlInterface(LUID* p_device_luid) {
-  if (!g_dml_device)
-    g_dml_device = std::make_unique<Dml::InterfaceImpl>(p_device_luid);
+void SetDmlProvider(OrtSessionOptions& session_options, DeviceInterface& device) {
+  auto& dml_device = static_cast<Dml::InterfaceImpl&>(device);
+  Ort::ThrowOnError(Dml::dml_api_->SessionOptionsAppendExecutionProvider_DML1(&session_options, dml_device.dml_device_.Get(), dml_device.dml_objects_.command_queue.Get()));
 }
 
-void SetDmlProvider(OrtSessionOptions& session_options) {
-  Ort::ThrowOnError(Dml::dml_api_->SessionOptionsAppendExecutionProvider_DML1(&session_options, Dml::dml_device_.Get(), Dml::dml_objects_.command_queue.Get()));
+LUID SelectDmlAdapter(std::string_view selection) {
+  return DmlHelpers::SelectAdapter(selection);
 }
 
 DeviceInterface* GetDmlInterface() {
-  return g_dml_device.get();
+  return g_dml_devices.empty() ? nullptr : g_dml_devices.front().get();
 }
 
 }  // namespace Generators
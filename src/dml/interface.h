@@ -10,9 +10,13 @@ typedef struct _LUID {
 
 namespace Generators {
 
-void InitDmlInterface(LUID* p_device_luid);
-void SetDmlProvider(OrtSessionOptions& options);
+// Returns the device of the adapter 'p_device_luid', creating it on first use. Null is the first device created, or the
+// default adapter if there is none yet.
+DeviceInterface* InitDmlInterface(LUID* p_device_luid);
+void SetDmlProvider(OrtSessionOptions& options, DeviceInterface& device);
+// Ranks the adapters by 'selection': "high_performance", "minimum_power" or "most_free_memory", and returns the best
+LUID SelectDmlAdapter(std::string_view selection);
 
-DeviceInterface* GetDmlInterface();
+DeviceInterface* GetDmlInterface();  // The first device created
 
 }  // namespace Generators
@@ -0,0 +1,552 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "models/model.h"
+#include "search.h"
+#include "engine.h"
+#include "models/paged_kv_cache.h"
+#include "models/threadpool.h"
+
+namespace Generators {
+
+Request::Request(std::shared_ptr<GeneratorParams> params) : params_{std::move(params)} {
+  if (params_->search.batch_size != 1)
+    throw std::runtime_error("Engine requests must have a batch_size of 1, is " + std::to_string(params_->search.batch_size));
+  if (params_->search.num_beams != 1)
+    throw std::runtime_error("Engine requests do not support beam search, num_beams is " + std::to_string(params_->search.num_beams));
+}
+
+void Request::SetPriority(Priority priority) {
+  std::scoped_lock lock{mutex_};
+  if (status_ != Status::Created)
+    throw std::runtime_error("Request priority must be set before the request is added to an engine");
+  priority_ = priority;
+}
+
+void Request::AddTokens(std::span<const int32_t> tokens) {
+  std::scoped_lock lock{mutex_};
+  if (status_ != Status::Created)
+    throw std::runtime_error("Request tokens must be added before the request is added to an engine");
+  prompt_tokens_.insert(prompt_tokens_.end(), tokens.begin(), tokens.end());
+}
+
+bool Request::IsDone() const {
+  std::scoped_lock lock{mutex_};
+  return status_ == Status::Done;
+}
+
+bool Request::IsPreempted() const {
+  std::scoped_lock lock{mutex_};
+  return status_ == Status::Preempted;
+}
+
+size_t Request::GetTokenCount() const {
+  std::scoped_lock lock{mutex_};
+  return std::max(sequence_.size(), prompt_tokens_.size());
+}
+
+void Request::Cancel() {
+  std::scoped_lock lock{mutex_};
+  cancelled_ = true;
+}
+
+std::vector<int32_t> Request::GetUnseenTokens() {
+  std::scoped_lock lock{mutex_};
+  std::vector<int32_t> tokens(sequence_.begin() + unseen_tokens_begin_, sequence_.end());
+  unseen_tokens_begin_ = sequence_.size();
+  return tokens;
+}
+
+std::vector<int32_t> Request::GetSequence() const {
+  std::scoped_lock lock{mutex_};
+  return sequence_;
+}
+
+void Request::Admit(GeneratorPool& pool) {
+  generator_pool_ = &pool;
+  if (generator_) {
+    generator_->RestoreKeyValueCache();  // Preempted with PreemptionMode::Swap
+  } else {
+    // A new request, or one preempted with PreemptionMode::Recompute that runs its whole sequence again (the tokens
+    // reported so far stay reported)
+    generator_ = pool.Acquire(*params_);
+    prefill_tokens_ = sequence_.empty() ? prompt_tokens_ : sequence_;
+    prefilled_length_ = 0;
+  }
+
+  std::scoped_lock lock{mutex_};
+  status_ = prefilled_length_ < prefill_tokens_.size() ? Status::Prefilling : Status::Decoding;
+}
+
+size_t Request::Prefill(size_t max_tokens) {
+  size_t length = prefill_tokens_.size() - prefilled_length_;
+  if (max_tokens)
+    length = std::min(length, max_tokens);
+  generator_->AppendTokens(cpu_span<const int32_t>{prefill_tokens_.data() + prefilled_length_, length});
+  prefilled_length_ += length;
+  if (prefilled_length_ < prefill_tokens_.size())
+    return length;
+
+  std::scoped_lock lock{mutex_};
+  if (sequence_.empty()) {
+    sequence_ = prompt_tokens_;
+    unseen_tokens_begin_ = sequence_.size();  // The prompt is known to the caller, only report generated tokens
+  }
+  status_ = Status::Decoding;
+  return length;
+}
+
+void Request::Preempt(PreemptionMode mode) {
+  if (shared_) {
+    shared_ = false;  // Its row is dropped when the shared batch is rebuilt, the request is recomputed when it resumes
+  } else if (mode == PreemptionMode::Swap) {
+    try {
+      generator_->OffloadKeyValueCache();
+    } catch (const std::runtime_error&) {
+      ReleaseGenerator();  // The model can't move its cache off the device, so it's recomputed
+    }
+  } else {
+    ReleaseGenerator();
+  }
+
+  std::scoped_lock lock{mutex_};
+  status_ = Status::Preempted;
+}
+
+void Request::GenerateNextToken() {
+  generator_->GenerateNextToken();
+  CollectNewTokens();
+}
+
+void Request::CollectNewTokens() {
+  auto sequence = generator_->GetSequence(0).CopyDeviceToCpu();
+  bool done = generator_->IsDone();
+
+  {
+    std::scoped_lock lock{mutex_};
+    if (sequence.size() > sequence_.size())
+      sequence_.insert(sequence_.end(), sequence.begin() + sequence_.size(), sequence.end());
+    if (done)
+      status_ = Status::Done;
+  }
+  if (done)
+    ReleaseGenerator();  // Release the State (and its KV cache) as soon as possible
+}
+
+void Request::CollectSharedToken(int32_t token) {
+  std::scoped_lock lock{mutex_};
+  sequence_.push_back(token);
+  // The same as the search of a generator of its own, the shared batch runs until the longest max_length
+  if (token == params_->config.model.eos_token_id || sequence_.size() >= static_cast<size_t>(params_->search.max_length))
+    status_ = Status::Done;
+}
+
+void Request::ReleaseGenerator() {
+  if (generator_pool_)
+    generator_pool_->Release(std::move(generator_));
+  generator_.reset();
+}
+
+// Requests decode in the shared batch unless they use options of their own generator, options that read the whole
+// sequence (which is padded in the batch) or a random_seed that makes their samples reproducible
+static bool CanShareBatch(const GeneratorParams& params) {
+  const auto& search = params.search;
+  return !params.draft_model && params.extra_inputs.empty() && params.guidance_pattern.empty() && params.batch_top_k.empty() &&
+         params.batch_adapter_ids.empty() && !params.use_cuda_graph && search.min_length == 0 &&
+         search.repetition_penalty == 1.0f && search.frequency_penalty == 0.0f && search.presence_penalty == 0.0f &&
+         search.no_repeat_ngram_size == 0 && search.min_p == 0.0f && (search.typical_p == 0.0f || search.typical_p >= 1.0f) &&
+         search.top_logprobs == 0 && search.logit_bias.empty() && search.stop_token_sequences.empty() &&
+         search.stop_strings.empty() && !search.past_present_share_buffer && search.prompt_lookup_num_tokens == 0 &&
+         search.attention_sinks == 0 && !search.pipelined_decode && (!search.do_sample || search.random_seed == -1);
+}
+
+Engine::Engine(const Model& model, int max_active_requests)
+    : model_{model.shared_from_this()},
+      generator_pool_{model, static_cast<size_t>(std::max(max_active_requests, 0))},
+      max_active_requests_{max_active_requests} {
+  if (max_active_requests_ < 1)
+    throw std::runtime_error("max_active_requests must be 1 or greater, is " + std::to_string(max_active_requests_));
+}
+
+void Engine::AddRequest(std::shared_ptr<Request> request) {
+  {
+    std::scoped_lock request_lock{request->mutex_};
+    if (request->status_ != Request::Status::Created)
+      throw std::runtime_error("Request was already added to an engine");
+    if (request->prompt_tokens_.empty())
+      throw std::runtime_error("Request has no tokens, call AddTokens before adding it to an engine");
+    if (&request->params_->config != model_->config_.get())
+      throw std::runtime_error("Request was created for a different model");
+    request->status_ = Request::Status::Queued;
+  }
+
+  std::scoped_lock lock{mutex_};
+  queued_requests_[static_cast<size_t>(request->priority_)].push_back(std::move(request));
+}
+
+bool Engine::HasPendingRequests() const {
+  std::scoped_lock lock{mutex_};
+  return !queued_requests_[0].empty() || !queued_requests_[1].empty() || !active_requests_.empty();
+}
+
+size_t Engine::GetActiveRequestCount() const {
+  std::scoped_lock lock{mutex_};
+  return active_requests_.size();
+}
+
+size_t Engine::GetQueuedRequestCount() const {
+  std::scoped_lock lock{mutex_};
+  return queued_requests_[0].size() + queued_requests_[1].size();
+}
+
+bool Engine::IsOutOfKeyValueMemory() const {
+  if (kv_cache_budget_ && model_->memory_usage_->Get(MemoryUsage::KeyValueCache) > kv_cache_budget_)
+    return true;
+  const auto& pool = model_->paged_kv_cache_pool_;
+  return pool && pool->GetFreeBlockCount() < active_requests_.size();
+}
+
+std::shared_ptr<Request> Engine::TakeVictim(bool batch_only) {
+  for (auto priority : {Request::Priority::Batch, Request::Priority::Interactive}) {
+    if (batch_only && priority != Request::Priority::Batch)
+      break;
+    auto it = std::find_if(active_requests_.rbegin(), active_requests_.rend(),
+                           [priority](const std::shared_ptr<Request>& request) { return request->priority_ == priority; });
+    if (it == active_requests_.rend())
+      continue;
+
+    auto victim = *it;
+    active_requests_.erase(std::next(it).base());
+    queued_requests_[static_cast<size_t>(priority)].push_front(victim);
+    return victim;
+  }
+  return {};
+}
+
+void Engine::AdmitRequests() {
+  // Batch requests wait while the key-value cache is out of memory, interactive requests are admitted and push batch
+  // requests out through RelieveMemoryPressure
+  const bool out_of_memory = !active_requests_.empty() && IsOutOfKeyValueMemory();
+  size_t active_tokens = 0;
+  for (auto& request : active_requests_)
+    active_tokens += request->GetTokenCount();
+
+  std::vector<std::shared_ptr<Request>> admitted, preempted;
+  {
+    std::scoped_lock lock{mutex_};
+    auto has_room = [&](size_t tokens) {
+      const size_t active_count = active_requests_.size() + admitted.size();
+      return active_count < static_cast<size_t>(max_active_requests_) &&
+             (!token_budget_ || !active_count || active_tokens + tokens <= token_budget_);
+    };
+
+    for (auto priority : {Request::Priority::Interactive, Request::Priority::Batch}) {
+      auto& queue = queued_requests_[static_cast<size_t>(priority)];
+      const bool interactive = priority == Request::Priority::Interactive;
+      if (!interactive && out_of_memory)
+        break;
+
+      while (!queue.empty()) {
+        const size_t tokens = queue.front()->GetTokenCount();
+        while (interactive && !has_room(tokens)) {
+          auto victim = TakeVictim(/*batch_only*/ true);
+          if (!victim)
+            break;
+          active_tokens -= victim->GetTokenCount();
+          preempted.push_back(std::move(victim));
+        }
+        if (!has_room(tokens))
+          break;
+
+        active_tokens += tokens;
+        admitted.push_back(std::move(queue.front()));
+        queue.pop_front();
+      }
+      if (!queue.empty())
+        break;  // Lower priorities wait for the requests left in this queue
+    }
+  }
+
+  // Preempt and create the generators outside of the lock so new requests can be queued in the meantime
+  for (auto& request : preempted)
+    request->Preempt(preemption_mode_);
+  for (auto& request : admitted) {
+    request->Admit(generator_pool_);
+    std::scoped_lock lock{mutex_};
+    active_requests_.push_back(std::move(request));
+  }
+}
+
+void Engine::RelieveMemoryPressure() {
+  while (active_requests_.size() > 1 && IsOutOfKeyValueMemory()) {
+    std::shared_ptr<Request> victim;
+    {
+      std::scoped_lock lock{mutex_};
+      victim = TakeVictim(/*batch_only*/ false);
+    }
+    const bool shared = victim->shared_;
+    victim->Preempt(preemption_mode_);
+    if (shared)
+      UpdateSharedBatch();  // Releases the victim's row
+  }
+}
+
+void Engine::UpdateSharedBatch() {
+  // The remaining rows keep their order, the requests that finished their first token on their own generator join
+  std::vector<std::shared_ptr<Request>> requests;
+  for (auto& request : shared_requests_) {
+    if (request->shared_ && request->status_ == Request::Status::Decoding)
+      requests.push_back(request);
+  }
+  if (!shared_batch_unsupported_) {
+    for (auto& request : active_requests_) {
+      if (!request->shared_ && request->status_ == Request::Status::Decoding && request->generator_ && CanShareBatch(*request->params_))
+        requests.push_back(request);
+    }
+  }
+  // A lone request keeps its own generator, there's nothing to share
+  if (requests == shared_requests_ || (shared_requests_.empty() && requests.size() < 2))
+    return;
+
+  std::unique_ptr<Generator> generator;
+  if (!requests.empty()) {
+    auto params = CreateGeneratorParams(*model_);
+    params->search = requests.front()->params_->search;
+    params->search.batch_size = static_cast<int>(requests.size());
+    params->search.max_length = model_->config_->model.context_length;  // Each request stops at its own max_length
+    params->search.do_sample = std::any_of(requests.begin(), requests.end(), [](const std::shared_ptr<Request>& request) { return request->params_->search.do_sample; });
+    if (params->search.do_sample) {
+      // A top_k of 1 selects the top token of the greedy requests
+      std::vector<int32_t> top_k;
+      std::vector<float> top_p, temperature;
+      for (auto& request : requests) {
+        const auto& search = request->params_->search;
+        top_k.push_back(search.do_sample ? search.top_k : 1);
+        top_p.push_back(search.do_sample ? search.top_p : 1.0f);
+        temperature.push_back(search.do_sample ? search.temperature : 1.0f);
+      }
+      params->SetBatchSampling(top_k, top_p, temperature);
+    }
+
+    std::vector<Generator::Row> rows;
+    for (auto& request : requests) {
+      if (request->shared_)
+        rows.push_back({shared_generator_.get(), static_cast<size_t>(std::find(shared_requests_.begin(), shared_requests_.end(), request) - shared_requests_.begin())});
+      else
+        rows.push_back({request->generator_.get(), 0});
+    }
+    generator = Generator::Merge(*params, rows);
+    if (!generator) {
+      // The state of the model can't merge rows, which doesn't depend on the requests, so this is the first merge
+      shared_batch_unsupported_ = true;
+      return;
+    }
+  }
+
+  for (auto& request : requests) {
+    if (!request->shared_) {
+      request->ReleaseGenerator();
+      request->shared_ = true;
+    }
+  }
+  shared_generator_ = std::move(generator);
+  shared_requests_ = std::move(requests);
+}
+
+void Engine::StepSharedBatch() {
+  shared_generator_->GenerateNextToken();
+  auto tokens = shared_generator_->GetNextTokens();
+  for (size_t i = 0; i < shared_requests_.size(); i++)
+    shared_requests_[i]->CollectSharedToken(tokens[i]);
+}
+
+void Engine::Step() {
+  if (generator_pool_.GetIdleCount() && IsOutOfKeyValueMemory())
+    generator_pool_.Clear();
+  AdmitRequests();
+  RelieveMemoryPressure();
+  if (Metrics::HasSink()) {
+    Metrics::Emit("oga_engine_queued_requests", MetricType::Gauge, static_cast<double>(GetQueuedRequestCount()));
+    Metrics::Emit("oga_engine_active_requests", MetricType::Gauge, static_cast<double>(active_requests_.size()));
+  }
+
+  for (auto& request : active_requests_) {
+    bool cancelled;
+    {
+      std::scoped_lock lock{request->mutex_};
+      cancelled = request->cancelled_;
+      if (cancelled)
+        request->status_ = Request::Status::Done;
+    }
+    if (cancelled)
+      request->ReleaseGenerator();
+  }
+  UpdateSharedBatch();
+
+  // What the decoding requests leave of the step token budget goes to the prefills, in the order they were admitted
+  size_t prefill_budget = 0;
+  if (step_token_budget_) {
+    const auto decoding_count = static_cast<size_t>(std::count_if(active_requests_.begin(), active_requests_.end(),
+                                                                  [](const std::shared_ptr<Request>& request) { return request->status_ == Request::Status::Decoding; }));
+    prefill_budget = std::max(step_token_budget_, decoding_count + 1) - decoding_count;
+  }
+
+  // The prefill budget is handed out in order first, then the requests with their own generators and the shared batch
+  // run in parallel
+  std::vector<std::pair<Request*, size_t>> runs;  // The request and the prefill tokens it may run, 0 is no limit
+  for (auto& request : active_requests_) {
+    if (request->status_ == Request::Status::Done || request->shared_)
+      continue;  // Cancelled, or decoded by the shared batch
+
+    if (request->status_ == Request::Status::Prefilling && step_token_budget_) {
+      if (!prefill_budget)
+        continue;
+      const size_t length = std::min(request->prefill_tokens_.size() - request->prefilled_length_, prefill_budget);
+      prefill_budget -= length;
+      runs.emplace_back(request.get(), length);
+      continue;
+    }
+    runs.emplace_back(request.get(), 0);
+  }
+
+  GetThreadPool().ParallelFor(runs.size() + (shared_generator_ ? 1 : 0), [&](size_t i) {
+    if (i == runs.size()) {
+      StepSharedBatch();
+      return;
+    }
+    auto [request, prefill_length] = runs[i];
+    if (request->status_ == Request::Status::Prefilling) {
+      request->Prefill(prefill_length);
+      if (request->status_ != Request::Status::Decoding)
+        return;
+    }
+    request->GenerateNextToken();
+  });
+
+  // Retire finished requests so their slots are available on the next step
+  std::scoped_lock lock{mutex_};
+  active_requests_.erase(std::remove_if(active_requests_.begin(), active_requests_.end(),
+                                        [](const std::shared_ptr<Request>& request) { return request->IsDone(); }),
+                         active_requests_.end());
+}
+
+void BatchGenerate(const Model& model, std::span<const std::string> prompts, const GeneratorParams& params,
+                   const BatchGenerateCallback& callback) {
+  if (params.search.num_beams != 1)
+    throw std::runtime_error("BatchGenerate does not support beam search, num_beams is " + std::to_string(params.search.num_beams));
+  const size_t batch_size = static_cast<size_t>(std::max(params.search.batch_size, 1));
+
+  auto tokenizer = model.CreateTokenizer();
+  std::vector<std::vector<int32_t>> tokens(prompts.size());
+  GetThreadPool().ParallelFor(prompts.size(), [&](size_t i) { tokens[i] = tokenizer->Encode(prompts[i].c_str()); });
+  for (size_t i = 0; i < tokens.size(); i++) {
+    if (tokens[i].empty() || tokens[i].size() >= static_cast<size_t>(params.search.max_length))
+      throw std::runtime_error("Prompt " + std::to_string(i) + " has " + std::to_string(tokens[i].size()) +
+                               " tokens, it must have at least 1 and fewer than max_length (" + std::to_string(params.search.max_length) + ")");
+  }
+
+  // The longest batches run first, so the short ones fill in at the end instead of a long one running alone
+  std::vector<size_t> order(prompts.size());
+  std::iota(order.begin(), order.end(), size_t{0});
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return tokens[a].size() > tokens[b].size(); });
+
+  std::vector<int32_t> eos_token_ids{model.config_->model.eos_token_ids.begin(), model.config_->model.eos_token_ids.end()};
+  if (eos_token_ids.empty())
+    eos_token_ids.push_back(model.config_->model.eos_token_id);
+
+  for (size_t begin = 0; begin < order.size(); begin += batch_size) {
+    const size_t count = std::min(batch_size, order.size() - begin);
+    auto batch_params = CreateGeneratorParams(model);
+    batch_params->search = params.search;
+    batch_params->search.batch_size = static_cast<int>(count);
+    if (!batch_params->search.do_sample)
+      batch_params->search.compact_finished_sequences = true;
+
+    std::vector<std::span<const int32_t>> sequences;
+    for (size_t i = 0; i < count; i++)
+      sequences.emplace_back(tokens[order[begin + i]]);
+    auto input_ids = PadInputs(sequences, model.config_->model.pad_token_id);
+    const size_t prompt_length = input_ids.size() / count;
+
+    auto generator = CreateGenerator(model, *batch_params);
+    generator->AppendTokens(input_ids);
+    while (!generator->IsDone())
+      generator->GenerateNextToken();
+
+    for (size_t i = 0; i < count; i++) {
+      auto sequence = generator->GetSequence(i).CopyDeviceToCpu();
+      auto generated = sequence.subspan(std::min(prompt_length, sequence.size()));
+      auto end = std::find_first_of(generated.begin(), generated.end(), eos_token_ids.begin(), eos_token_ids.end());
+      callback(order[begin + i], std::span<const int32_t>{generated.data(), static_cast<size_t>(end - generated.begin())});
+    }
+  }
+}
+
+ModelPool::ModelPool(std::vector<std::shared_ptr<const Model>> replicas, int max_active_requests_per_replica) {
+  if (replicas.empty())
+    throw std::runtime_error("ModelPool needs at least one replica");
+
+  const auto& config = *replicas.front()->config_;
+  for (auto& replica : replicas) {
+    if (replica->config_->model.vocab_size != config.model.vocab_size || replica->config_->model.context_length != config.model.context_length)
+      throw std::runtime_error("ModelPool replicas must be the same model, their vocab_size or context_length differ");
+    engines_.push_back(std::make_unique<Engine>(*replica, max_active_requests_per_replica));
+  }
+}
+
+size_t ModelPool::SelectReplica() const {
+  auto load = [](const Engine& engine) {
+    const auto& pool = engine.model_->paged_kv_cache_pool_;
+    // Fewer requests first, then more free blocks
+    return std::make_pair(engine.GetActiveRequestCount() + engine.GetQueuedRequestCount(),
+                          pool ? std::numeric_limits<size_t>::max() - pool->GetFreeBlockCount() : 0);
+  };
+
+  size_t selected = 0;
+  auto selected_load = load(*engines_[0]);
+  for (size_t i = 1; i < engines_.size(); i++) {
+    if (auto replica_load = load(*engines_[i]); replica_load < selected_load) {
+      selected = i;
+      selected_load = replica_load;
+    }
+  }
+  return selected;
+}
+
+std::shared_ptr<Request> ModelPool::AddRequest(const Config::Search& search, std::span<const int32_t> tokens,
+                                               Request::Priority priority) {
+  std::scoped_lock lock{mutex_};
+  auto& engine = *engines_[SelectReplica()];
+
+  auto params = CreateGeneratorParams(*engine.model_);
+  params->search = search;
+  auto request = std::make_shared<Request>(std::move(params));
+  request->SetPriority(priority);
+  request->AddTokens(tokens);
+  engine.AddRequest(request);
+  return request;
+}
+
+void ModelPool::Step() {
+  std::vector<Engine*> pending;
+  for (auto& engine : engines_) {
+    if (engine->HasPendingRequests())
+      pending.push_back(engine.get());
+  }
+
+  ThreadPool{pending.size()}.Compute([&](size_t i) { pending[i]->Step(); });
+}
+
+bool ModelPool::HasPendingRequests() const {
+  return std::any_of(engines_.begin(), engines_.end(), [](const std::unique_ptr<Engine>& engine) { return engine->HasPendingRequests(); });
+}
+
+std::shared_ptr<Tokenizer> ModelPool::GetTokenizer() const {
+  std::scoped_lock lock{mutex_};
+  if (!tokenizer_)
+    tokenizer_ = engines_.front()->model_->CreateTokenizer();
+  return tokenizer_;
+}
+
+}  // namespace Generators
@@ -0,0 +1,203 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <array>
+#include <deque>
+#include <mutex>
+
+namespace Generators {
+
+// What happens to the request an Engine preempts: Swap moves its key-value cache to host memory and restores it when
+// the request resumes, Recompute releases its generator and runs its whole sequence again when it resumes (that is
+// also what Swap falls back to for models that can't move their cache, and for requests of the shared batch). A
+// recomputed request with sampling doesn't continue its random sequence.
+enum struct PreemptionMode {
+  Swap,
+  Recompute,
+};
+
+// A single sequence that is processed by an Engine. A request becomes active on the first Engine::Step after it was
+// added and leaves as soon as it is done, independently of the other requests in flight.
+struct Request : std::enable_shared_from_this<Request>, LeakChecked<Request> {
+  // Interactive requests are admitted before batch requests and take the place of active batch requests when the
+  // engine is full (see Engine::Step)
+  enum struct Priority {
+    Interactive,
+    Batch,
+  };
+
+  Request(std::shared_ptr<GeneratorParams> params);
+
+  // Must be set before the request is handed to an Engine, the default is Interactive
+  void SetPriority(Priority priority);
+  Priority GetPriority() const { return priority_; }
+
+  // Prompt tokens, must be added before the request is handed to an Engine
+  void AddTokens(std::span<const int32_t> tokens);
+
+  bool IsDone() const;
+  bool IsPreempted() const;  // Made inactive to make room for others, it resumes when there's room again
+  void Cancel();  // The request leaves the engine on the next Engine::Step
+
+  // Returns the tokens generated since the last call. Safe to call while the engine is stepping on another thread.
+  std::vector<int32_t> GetUnseenTokens();
+
+  // Returns the full sequence (prompt + generated tokens) so far
+  std::vector<int32_t> GetSequence() const;
+
+  std::shared_ptr<GeneratorParams> params_;
+  std::shared_ptr<Request> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
+
+ private:
+  friend struct Engine;
+
+  enum struct Status {
+    Created,     // Not yet added to an engine
+    Queued,      // Waiting for a free slot in the engine
+    Prefilling,  // Running the prompt, a chunk per step with a step token budget
+    Decoding,    // Prompt was processed, generating tokens
+    Preempted,   // Waiting to resume, queued in front of the requests of its priority that didn't start yet
+    Done,
+  };
+
+  void Admit(GeneratorPool& pool);  // Takes a generator from the pool, or resumes a preempted request
+  // Runs up to max_tokens (0 is no limit) of the tokens left to prefill and returns how many it ran, the request is
+  // decoding once they're all run
+  size_t Prefill(size_t max_tokens);
+  void Preempt(PreemptionMode mode);
+  void GenerateNextToken();
+  void CollectNewTokens();
+  void CollectSharedToken(int32_t token);  // The token the shared batch selected for this request
+  void ReleaseGenerator();       // Hands the generator back to generator_pool_
+  size_t GetTokenCount() const;  // The prompt and the tokens generated so far
+
+  Priority priority_{Priority::Interactive};
+  mutable std::mutex mutex_;
+  Status status_{Status::Created};
+  bool cancelled_{};
+  std::vector<int32_t> prompt_tokens_;
+  std::vector<int32_t> prefill_tokens_;   // The prompt, or the whole sequence when a preempted request is recomputed
+  size_t prefilled_length_{};             // The prefill_tokens_ appended to the generator so far
+  std::vector<int32_t> sequence_;         // Tokens known so far, protected by mutex_
+  size_t unseen_tokens_begin_{};          // Index into sequence_ of the first token not returned by GetUnseenTokens
+  std::unique_ptr<Generator> generator_;  // Owns this sequence's State (position, attention mask and KV cache)
+  GeneratorPool* generator_pool_{};       // Of the engine that admitted the request
+  bool shared_{};                         // Decoded in a row of the engine's shared batch instead, generator_ is null
+};
+
+// Schedules many independent requests against one model. Requests can be added at any time (from any thread)
+// and are admitted on the next Step as long as fewer than max_active_requests are in flight.
+// Finished and cancelled requests release their slot immediately, so a long request never holds back the others.
+//
+// Requests are batched continuously: a request prefills its prompt and selects its first token with a batch size 1
+// Generator of its own, then joins the shared batch, one Generator whose rows are the decoding requests, so a step runs
+// one forward pass for all of them. Whenever a request joins or leaves (done, cancelled or preempted), the shared batch
+// is rebuilt with Generator::Merge, which copies the KV cache entries of the remaining and joining rows into a new
+// batch left padded to the longest sequence, so a finished request doesn't hold back the others. Requests that use
+// options the batch can't share (see CanShareBatch in engine.cpp) and all requests of models whose state can't merge
+// rows (see State::MergeRows) keep their own generators, whose steps run in parallel on the shared thread pool.
+//
+// Interactive requests are admitted before batch requests. When an interactive request finds no free slot or token
+// budget, the most recently admitted batch requests are preempted to make room, so batch jobs don't add to interactive
+// latency. When the key-value cache runs out of memory the engine preempts too, the lowest priority and most recently
+// admitted requests first. Preempted requests resume ahead of the requests of their priority that didn't start yet.
+struct Engine : LeakChecked<Engine> {
+  Engine(const Model& model, int max_active_requests);
+
+  void AddRequest(std::shared_ptr<Request> request);
+
+  // Admits queued requests, then generates one token for every active request (the shared batch and the requests with
+  // their own generators in parallel) and retires the finished ones
+  void Step();
+
+  // Requests are only admitted while the tokens of the active requests (prompts and generated tokens) stay within
+  // 'tokens', a request that doesn't fit on its own still runs alone. 0, the default, is no limit.
+  void SetTokenBudget(size_t tokens) { token_budget_ = tokens; }
+  // The bytes the model's key-value caches may take (see MemoryUsage::KeyValueCache) before requests are preempted, 0,
+  // the default, is no limit. With a paged key-value cache the engine also preempts when the pool has fewer free
+  // blocks than there are active requests.
+  void SetKeyValueCacheBudget(size_t bytes) { kv_cache_budget_ = bytes; }
+  void SetPreemptionMode(PreemptionMode mode) { preemption_mode_ = mode; }
+  // Every step runs at most 'tokens' tokens: a token for each decoding request, and chunks of the prompts being
+  // prefilled for the rest (at least one token). So a long prompt is spread over several steps instead of stalling the
+  // decoding requests for its whole prefill. 0, the default, prefills every admitted prompt in one go.
+  void SetStepTokenBudget(size_t tokens) { step_token_budget_ = tokens; }
+
+  bool HasPendingRequests() const;
+  size_t GetActiveRequestCount() const;
+  size_t GetQueuedRequestCount() const;  // Including the preempted requests
+
+  std::shared_ptr<const Model> model_;
+  // The generators of the finished requests, up to one per slot. They keep their key-value caches, so they're
+  // destroyed before any request is preempted for memory.
+  GeneratorPool generator_pool_;
+  std::shared_ptr<Engine> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
+
+ private:
+  void AdmitRequests();
+  void RelieveMemoryPressure();
+  bool IsOutOfKeyValueMemory() const;
+  // Moves the most recently admitted active request of the lowest priority (only batch requests with 'batch_only') to
+  // the front of its queue, and returns it or null if there's none. The caller preempts it outside of mutex_.
+  std::shared_ptr<Request> TakeVictim(bool batch_only);
+  // Rebuilds the shared batch if requests joined or left it since the last step
+  void UpdateSharedBatch();
+  void StepSharedBatch();
+
+  const int max_active_requests_;
+  size_t token_budget_{};
+  size_t kv_cache_budget_{};
+  size_t step_token_budget_{};
+  PreemptionMode preemption_mode_{PreemptionMode::Swap};
+
+  mutable std::mutex mutex_;
+  std::array<std::deque<std::shared_ptr<Request>>, 2> queued_requests_;  // By priority, protected by mutex_
+
+  std::vector<std::shared_ptr<Request>> active_requests_;  // Only modified by Step, under mutex_
+
+  // Only used by Step: row n of shared_generator_ decodes shared_requests_[n]
+  std::unique_ptr<Generator> shared_generator_;
+  std::vector<std::shared_ptr<Request>> shared_requests_;
+  bool shared_batch_unsupported_{};  // Set if the model's generators can't be merged
+};
+
+// Offline batch inference over many prompts. The prompts are tokenized in parallel, sorted by length (longest first)
+// and generated in batches of params.search.batch_size neighbors, so each batch pads its prompts (see PadInputs) to a
+// similar length. Greedy batches drop their finished sequences (see compact_finished_sequences), so the batch's tail
+// only computes the sequences still generating. 'callback' is called on this thread as each batch finishes, with the
+// index of every prompt of the batch and its generated tokens, up to the first EOS token.
+using BatchGenerateCallback = std::function<void(size_t index, std::span<const int32_t> tokens)>;
+void BatchGenerate(const Model& model, std::span<const std::string> prompts, const GeneratorParams& params,
+                   const BatchGenerateCallback& callback);
+
+// Replicas of one model (e.g. one per device) with an Engine each, so one process serves them all and admission is
+// decided with every replica in view. New requests go to the replica with the fewest requests in flight (queued or
+// active), ties go to the one with the most free paged key-value cache blocks. The replicas share one tokenizer.
+struct ModelPool : LeakChecked<ModelPool> {
+  ModelPool(std::vector<std::shared_ptr<const Model>> replicas, int max_active_requests_per_replica);
+
+  // Creates a request for the prompt 'tokens' on the least loaded replica and adds it to that replica's engine
+  std::shared_ptr<Request> AddRequest(const Config::Search& search, std::span<const int32_t> tokens,
+                                      Request::Priority priority = Request::Priority::Interactive);
+
+  // Steps the engines that have pending requests, in parallel as the replicas are independent
+  void Step();
+
+  bool HasPendingRequests() const;
+
+  std::shared_ptr<Tokenizer> GetTokenizer() const;  // Created by the first replica on first use
+
+  size_t GetReplicaCount() const { return engines_.size(); }
+  const Engine& GetEngine(size_t replica) const { return *engines_[replica]; }
+
+ private:
+  size_t SelectReplica() const;
+
+  std::vector<std::unique_ptr<Engine>> engines_;
+
+  mutable std::mutex mutex_;  // Makes selecting a replica and adding the request to it one step
+  mutable std::shared_ptr<Tokenizer> tokenizer_;  // Protected by mutex_
+};
+
+}  // namespace Generators
@@ -7,6 +7,9 @@
 #include "models/model.h"
 #include "models/decoder_only.h"
 #include "search.h"
+#include "constrained_decoding.h"
+#include "stop_sequences.h"
+#include "state_blob.h"
 #include "cpu/interface.h"
 #include "cuda/interface.h"
 #include "dml/interface.h"
@@ -47,8 +50,30 @@ static OrtLoggingLevel GetDefaultOrtLoggingLevel() {
   return ort_verbose_logging ? OrtLoggingLevel::ORT_LOGGING_LEVEL_VERBOSE : OrtLoggingLevel::ORT_LOGGING_LEVEL_ERROR;
 }
 
+// Creates the env with intra and inter op thread pools that every session shares (see OrtGlobals::global_thread_pools_)
+static std::unique_ptr<OrtEnv> CreateOrtEnv(bool& global_thread_pools) {
+  GetEnvironmentVariable("ORTGENAI_ORT_GLOBAL_THREAD_POOLS", global_thread_pools);
+  if (!global_thread_pools)
+    return OrtEnv::Create(GetDefaultOrtLoggingLevel());
+
+  // Same default as a session's own intra op pool, half the cores up to 16
+  int intra_op_threads = std::clamp(static_cast<int>(std::thread::hardware_concurrency() / 2), 1, 16);
+  if (auto value = GetEnvironmentVariable("ORTGENAI_ORT_INTRA_OP_THREADS"); !value.empty())
+    intra_op_threads = std::stoi(value);
+  int inter_op_threads = 0;  // ORT's default
+  if (auto value = GetEnvironmentVariable("ORTGENAI_ORT_INTER_OP_THREADS"); !value.empty())
+    inter_op_threads = std::stoi(value);
+  if (intra_op_threads < 0 || inter_op_threads < 0)
+    throw std::runtime_error("ORTGENAI_ORT_INTRA_OP_THREADS and ORTGENAI_ORT_INTER_OP_THREADS must not be negative");
+
+  auto threading_options = OrtThreadingOptions::Create();
+  threading_options->SetGlobalIntraOpNumThreads(intra_op_threads);
+  threading_options->SetGlobalInterOpNumThreads(inter_op_threads);
+  return OrtEnv::Create(threading_options.get(), GetDefaultOrtLoggingLevel());
+}
+
 OrtGlobals::OrtGlobals()
-    : env_{OrtEnv::Create(GetDefaultOrtLoggingLevel())} {
+    : env_{CreateOrtEnv(global_thread_pools_)} {
   auto arena_config = OrtArenaCfg::Create(0, -1, -1, -1);
   Ort::Allocator& allocator_cpu{Ort::Allocator::GetWithDefaultOptions()};
   env_->CreateAndRegisterAllocator(allocator_cpu.GetInfo(), *arena_config);
@@ -82,6 +107,7 @@ bool LeakTypeList<Types...>::Dump() {
 }
 
 void Shutdown() {
+  Trace::Stop();
   if (LeakTypes::Dump()) {
     std::cerr << "    Please see the documentation for the API being used to ensure proper cleanup." << std::endl;
     std::abort();
@@ -94,17 +120,37 @@ OrtEnv& GetOrtEnv() {
   return *GetOrtGlobals()->env_;
 }
 
-// Fallback to copy between two separate device buffers by going through CPU memory (slow unless we're the CPU device)
+WorkerThreadPool& GetThreadPool() {
+  auto& globals = *GetOrtGlobals();
+  std::call_once(globals.thread_pool_once_, [&globals] {
+    // The calling thread takes part in the work, so one less than the number of cores
+    size_t thread_count = std::max(std::thread::hardware_concurrency(), 1U) - 1;
+    if (auto value = GetEnvironmentVariable("ORTGENAI_THREAD_POOL_SIZE"); !value.empty())
+      thread_count = std::stoul(value);
+    globals.thread_pool_ = std::make_unique<WorkerThreadPool>(thread_count);
+  });
+  return *globals.thread_pool_;
+}
+
+// Fallback to copy between two separate device buffers by going through CPU memory. When either side is CPU accessible
+// the other one transfers straight to or from it, otherwise only the copied range goes through a bounce buffer that
+// each thread reuses.
 void CopyThroughCpu(DeviceBuffer& dest, size_t begin_dest, DeviceBuffer& source, size_t begin_source, size_t size_in_bytes) {
-  source.CopyDeviceToCpu();
-  auto source_span = std::span<const uint8_t>(source.p_cpu_ + begin_source, size_in_bytes);
-  // If we're overwriting the entire destination
-  if (dest.size_in_bytes_ == size_in_bytes)
-    dest.AllocateCpu();
-  else
-    dest.CopyDeviceToCpu();  // Overwriting part of destination, so copy over initial contents first
-  std::copy(source_span.begin(), source_span.end(), dest.p_cpu_ + begin_dest);
-  dest.CopyCpuToDevice();
+  if (source.IsCpuAccessible()) {
+    dest.WriteFromCpu(begin_dest, std::span<const uint8_t>(source.p_device_ + begin_source, size_in_bytes));
+    return;
+  }
+  if (dest.IsCpuAccessible()) {
+    source.ReadToCpu(begin_source, std::span<uint8_t>(dest.p_device_ + begin_dest, size_in_bytes));
+    return;
+  }
+
+  thread_local std::vector<uint8_t> bounce_buffer;
+  if (bounce_buffer.size() < size_in_bytes)
+    bounce_buffer.resize(size_in_bytes);
+  auto bounce = std::span<uint8_t>(bounce_buffer.data(), size_in_bytes);
+  source.ReadToCpu(begin_source, bounce);
+  dest.WriteFromCpu(begin_dest, bounce);
 }
 
 struct GenaiInterfaceImpl : GenaiInterface {
@@ -234,6 +280,8 @@ void GeneratorParams::SetInputs(const NamedTensors& named_tensors) {
 
   for (const auto& [name, tensor] : named_tensors) {
     if (name == Config::Defaults::InputIdsName) {
+      if (tensor->ort_tensor_->GetTensorMemoryInfo().GetDeviceType() != OrtMemoryInfoDeviceType_CPU)
+        throw std::runtime_error("input_ids must be a CPU tensor");
       aux_input_ids = cpu_span<int32_t>(tensor->ort_tensor_->GetTensorMutableData<int32_t>(),
                                         tensor->ort_tensor_->GetTensorTypeAndShapeInfo()->GetElementCount());
       if (aux_input_ids.size() / search.batch_size > search.max_length)
@@ -249,6 +297,42 @@ void GeneratorParams::SetInputs(const NamedTensors& named_tensors) {
   }
 }
 
+void GeneratorParams::SetBatchSampling(std::span<const int32_t> top_k, std::span<const float> top_p, std::span<const float> temperature) {
+  if (top_p.size() != top_k.size() || temperature.size() != top_k.size())
+    throw std::runtime_error("The top_k, top_p and temperature arrays must have the same size");
+  for (size_t i = 0; i < top_k.size(); i++) {
+    if (top_k[i] < 0)
+      throw std::runtime_error("top_k must be 0 or greater, batch entry " + std::to_string(i) + " is " + std::to_string(top_k[i]));
+    if (top_p[i] < 0.0f || top_p[i] > 1.0f)
+      throw std::runtime_error("top_p must be between 0.0 and 1.0, batch entry " + std::to_string(i) + " is " + std::to_string(top_p[i]));
+    if (temperature[i] <= 0.0f)
+      throw std::runtime_error("temperature must be greater than 0, batch entry " + std::to_string(i) + " is " + std::to_string(temperature[i]));
+  }
+
+  batch_top_k.assign(top_k.begin(), top_k.end());
+  batch_top_p.assign(top_p.begin(), top_p.end());
+  batch_temperature.assign(temperature.begin(), temperature.end());
+}
+
+void GeneratorParams::SetBatchAdapters(std::span<const std::string> adapter_names) {
+  const auto& names = config.model.decoder.adapter_names;
+  if (names.empty())
+    throw std::runtime_error("Per batch entry adapters need a multi-LoRA model, the model has no adapter_names");
+
+  std::vector<int32_t> adapter_ids;
+  for (const auto& adapter_name : adapter_names) {
+    if (adapter_name.empty()) {
+      adapter_ids.push_back(0);
+      continue;
+    }
+    auto it = std::find(names.begin(), names.end(), adapter_name);
+    if (it == names.end())
+      throw std::runtime_error("Adapter not found in the model's adapter_names: " + adapter_name);
+    adapter_ids.push_back(static_cast<int32_t>(it - names.begin()) + 1);
+  }
+  batch_adapter_ids = std::move(adapter_ids);
+}
+
 std::unique_ptr<Generator> CreateGenerator(const Model& model, const GeneratorParams& params) {
   return std::make_unique<Generator>(model, params);
 }
@@ -259,7 +343,13 @@ std::unique_ptr<Search> CreateSearch(const GeneratorParams& params) {
   return params.p_device->CreateGreedy(params);
 }
 
-Generator::Generator(const Model& model, const GeneratorParams& params) : model_{model.shared_from_this()} {
+// The recent tokens kept by an attention sink eviction, besides the sinks
+static int GetAttentionSinkWindow(const Config::Search& search) {
+  return search.attention_sink_window ? search.attention_sink_window : (search.max_length - search.attention_sinks) / 2;
+}
+
+// Checks the params that don't depend on the generator's state, for the constructor and Reset
+static void ValidateParams(const Model& model, const GeneratorParams& params) {
   if (params.search.max_length == 0)
     throw std::runtime_error("search max_length is 0");
   if (params.search.max_length > model.config_->model.context_length)
@@ -268,10 +358,127 @@ Generator::Generator(const Model& model, const GeneratorParams& params) : model_
     throw std::runtime_error("batch_size must be 1 or greater, is " + std::to_string(params.search.batch_size));
   if (params.config.model.vocab_size < 1)
     throw std::runtime_error("vocab_size must be 1 or greater, is " + std::to_string(params.config.model.vocab_size));
+  for (auto& [token, bias] : params.search.logit_bias) {
+    if (token < 0 || token >= params.config.model.vocab_size)
+      throw std::runtime_error("logit_bias token " + std::to_string(token) + " is outside of the vocabulary");
+  }
+  if (!params.batch_top_k.empty()) {
+    if (params.batch_top_k.size() != static_cast<size_t>(params.search.batch_size))
+      throw std::runtime_error("The per batch entry sampling parameters have " + std::to_string(params.batch_top_k.size()) +
+                               " entries, but batch_size is " + std::to_string(params.search.batch_size));
+    if (params.search.num_beams != 1)
+      throw std::runtime_error("Per batch entry sampling parameters cannot be used with a beam search");
+  }
+  if (!params.batch_adapter_ids.empty()) {
+    if (params.batch_adapter_ids.size() != static_cast<size_t>(params.search.batch_size))
+      throw std::runtime_error("The per batch entry adapters have " + std::to_string(params.batch_adapter_ids.size()) +
+                               " entries, but batch_size is " + std::to_string(params.search.batch_size));
+    if (!model.session_info_->HasInput(model.config_->model.decoder.inputs.adapter_ids))
+      throw std::runtime_error("Per batch entry adapters need a multi-LoRA model with an " +
+                               model.config_->model.decoder.inputs.adapter_ids + " input");
+  }
+  // Every tensor parallel rank has to pick the same tokens, as the next run of each shard takes them
+  if (model.config_->model.decoder.tensor_parallel.has_value() && params.search.do_sample && params.search.random_seed == -1)
+    throw std::runtime_error("Sampling with a tensor_parallel model needs a random_seed, so that every rank samples the same tokens");
+
+  if (!params.guidance_pattern.empty() && params.search.num_beams != 1)
+    throw std::runtime_error("Guidance cannot be used with a beam search");
+  if (params.search.top_logprobs < 0 || params.search.top_logprobs > std::min(64, model.config_->model.vocab_size))
+    throw std::runtime_error("top_logprobs must be between 0 and 64 (and at most vocab_size), is " + std::to_string(params.search.top_logprobs));
+  if (params.search.top_logprobs && (params.draft_model || params.search.prompt_lookup_num_tokens > 0))
+    throw std::runtime_error("top_logprobs cannot be used with speculative decoding, a step can accept several tokens");
+  if ((!params.search.stop_token_sequences.empty() || !params.search.stop_strings.empty()) && params.search.num_beams != 1)
+    throw std::runtime_error("Stop sequences cannot be used with a beam search");
+  if (params.search.num_beam_groups < 1 || params.search.num_beams % params.search.num_beam_groups != 0)
+    throw std::runtime_error("num_beams (" + std::to_string(params.search.num_beams) + ") must be a multiple of num_beam_groups (" +
+                             std::to_string(params.search.num_beam_groups) + ")");
+  if (params.search.num_beam_groups > 1 && params.p_device->GetType() == DeviceType::CUDA)
+    throw std::runtime_error("num_beam_groups is only supported by the CPU beam search");
+  if (params.search.beam_done_check_interval < 1)
+    throw std::runtime_error("beam_done_check_interval must be 1 or greater, is " + std::to_string(params.search.beam_done_check_interval));
+}
+
+Generator::Generator(const Model& model, const GeneratorParams& params)
+    : memory_usage_{std::make_shared<MemoryUsage>(model.memory_usage_)}, model_{model.shared_from_this()} {
+  static std::atomic<uint64_t> next_id{};
+  id_ = next_id++;
+  Memory::Scope memory_scope{*memory_usage_};
+  ValidateParams(model, params);
+  const bool stop_sequences = !params.search.stop_token_sequences.empty() || !params.search.stop_strings.empty();
+
+  if (params.search.stream_priority) {
+    // Only stream ordered frees keep the memory freed on one stream from being reused on another before it's done
+    if (model.p_device_->GetType() != DeviceType::CUDA || !model.config_->model.device_memory_pool)
+      throw std::runtime_error("stream_priority requires the CUDA device and model.device_memory_pool");
+    stream_ = model.p_device_->GetPriorityStream(*params.search.stream_priority);
+  }
+  StreamScope stream_scope{*model.p_device_, stream_};
 
   search_ = CreateSearch(params);
+  logit_bias_ = params.search.logit_bias;
   state_ = model.CreateState(search_->GetSequenceLengths(), params);  // Search sequence lengths set when creating state
 
+  // Medusa heads are used whenever they can be, unlike the explicitly requested modes below that throw if they can't
+  medusa_ = model.session_info_->HasOutput(model.config_->model.decoder.outputs.medusa_logits) && params.BatchBeamSize() == 1 &&
+            !model.session_info_->HasInput(model.config_->model.decoder.inputs.last_token_indices) && params.search.top_logprobs == 0;
+  // Like the Medusa heads, the early exit head is only used when nothing else drafts the tokens and the batch allows it
+  early_exit_ = model.config_->model.decoder.early_exit && !params.draft_model && params.search.prompt_lookup_num_tokens == 0 &&
+                !medusa_ && params.BatchBeamSize() == 1 && params.search.top_logprobs == 0;
+  if (early_exit_) {
+    if (model.config_->model.decoder.pipeline.empty())
+      throw std::runtime_error("early_exit requires a pipeline model, the pipeline models after the exit head are skipped while drafting");
+    if (!params.search.past_present_share_buffer || model.config_->model.decoder.sliding_window)
+      throw std::runtime_error("early_exit requires past_present_share_buffer and no sliding window, the cache of the skipped layers is filled in later");
+    if (model.config_->model.decoder.early_exit->num_draft_tokens < 1)
+      throw std::runtime_error("early_exit num_draft_tokens must be 1 or greater, is " + std::to_string(model.config_->model.decoder.early_exit->num_draft_tokens));
+  }
+  speculative_ = params.draft_model || params.search.prompt_lookup_num_tokens > 0 || medusa_ || early_exit_;
+  if (speculative_ && !medusa_) {
+    if (params.BatchBeamSize() != 1)
+      throw std::runtime_error("Speculative decoding requires batch_size and num_beams to be 1");
+    if (model.session_info_->HasInput(model.config_->model.decoder.inputs.last_token_indices))
+      throw std::runtime_error("Speculative decoding needs the logits of every input token, but the model only produces logits for the last token");
+    if (model.config_->model.decoder.logits_top_k > 0)
+      throw std::runtime_error("Speculative decoding needs the full vocabulary logits, but the model only outputs the top " + std::to_string(model.config_->model.decoder.logits_top_k) + " of them");
+    if (params.draft_model && params.search.prompt_lookup_num_tokens > 0)
+      throw std::runtime_error("prompt_lookup_num_tokens cannot be used together with a draft model");
+    if (params.search.prompt_lookup_num_tokens > 0 && params.search.prompt_lookup_ngram_size < 1)
+      throw std::runtime_error("prompt_lookup_ngram_size must be 1 or greater, is " + std::to_string(params.search.prompt_lookup_ngram_size));
+  }
+
+  if (params.search.attention_sinks > 0) {
+    if (params.BatchBeamSize() != 1 || speculative_ || !params.guidance_pattern.empty())
+      throw std::runtime_error("attention_sinks requires batch_size and num_beams to be 1, without speculative decoding or guidance");
+    if (params.search.attention_sink_window < 0 ||
+        params.search.attention_sinks + GetAttentionSinkWindow(params.search) + 1 >= params.search.max_length)
+      throw std::runtime_error("attention_sinks (" + std::to_string(params.search.attention_sinks) + ") + attention_sink_window (" +
+                               std::to_string(GetAttentionSinkWindow(params.search)) + ") must be less than max_length - 1");
+  }
+
+  if (params.draft_model) {
+    // The draft proposes plain greedy tokens, the search options only apply to the tokens selected from the model's logits
+    auto draft_params = CreateGeneratorParams(*params.draft_model);
+    draft_params->search.max_length = params.search.max_length;
+    draft_params->search.min_length = 0;
+    draft_params->search.do_sample = false;
+    draft_params->search.repetition_penalty = 1.0f;
+    draft_params->search.prompt_lookup_num_tokens = 0;
+    draft_params->search.stop_token_sequences.clear();
+    draft_params->search.stop_strings.clear();
+    draft_ = CreateGenerator(*params.draft_model, *draft_params);
+    draft_->reports_metrics_ = false;
+  }
+
+  if (!params.guidance_pattern.empty()) {
+    grammar_ = std::make_shared<TokenGrammar>(model, params.guidance_pattern);
+    grammar_states_.assign(params.search.batch_size, grammar_->GetStartState());
+    grammar_worker_.emplace();
+    StartGuidanceMask();
+  }
+
+  if (stop_sequences)
+    stop_sequences_ = std::make_shared<StopSequences>(model, params.search);
+
   // Temporary solution for multimodal and whisper models
   if (!params.aux_input_ids.empty() && params.aux_input_ids.data() != nullptr) {
     AuxAppendTokens(params.aux_input_ids);
@@ -280,11 +487,11 @@ Generator::Generator(const Model& model, const GeneratorParams& params) : model_
 
 DeviceSpan<int32_t> Generator::AllocateInputIdsOnDevice(cpu_span<const int32_t> input_ids) {
   size_t padded_input_ids_size = input_ids.size();
-  if (model_->config_->model.decoder.sliding_window.has_value()) {
-    // If the model has a sliding window, pad the input_ids to the next multiple of the window size
-    // so that the input_ids can be divided into window size chunks.
-    const auto window_size = model_->config_->model.decoder.sliding_window->window_size;
-    padded_input_ids_size = ((input_ids.size() + window_size - 1) / window_size) * window_size;
+  if (model_->config_->model.decoder.sliding_window.has_value() && search_->GetSequenceLength() == 0) {
+    // If the model has a sliding window, pad the prompt input_ids to the total size of the windows covering it
+    // so that the input_ids can be divided into window size chunks. Later tokens are processed one at a time.
+    const auto window_sizes = GetPromptWindowSizes(*model_->config_->model.decoder.sliding_window, input_ids.size());
+    padded_input_ids_size = std::accumulate(window_sizes.begin(), window_sizes.end(), size_t{});
   }
   auto input_ids_device = state_->params_->p_device->Allocate<int32_t>(padded_input_ids_size);
   auto cpu_span = input_ids_device.CpuSpan();
@@ -299,6 +506,10 @@ void Generator::AuxAppendTokens(cpu_span<const int32_t> input_ids) {
   ThrowErrorIfSessionTerminated(state_->session_terminated_);
   if (input_ids.size() == 0)
     throw std::runtime_error("input_ids is empty");
+  Metrics::Scope metrics_scope{metrics_, metrics_.prefill, profile_.get()};
+  Memory::Scope memory_scope{*memory_usage_};
+  metrics_.prefill.tokens += input_ids.size();
+  ReportPromptMetrics(input_ids.size());
   if (search_->GetSequenceLength() != 0 && state_->params_->search.batch_size > 1)
     throw std::runtime_error("AppendTokens can only be called once for batch_size > 1. To call AppendTokens again, use RewindToLength(0)");
 
@@ -319,7 +530,16 @@ void Generator::AppendTokens(cpu_span<const int32_t> input_ids) {
   if (search_->GetSequenceLength() != 0 && state_->params_->search.batch_size > 1)
     throw std::runtime_error("AppendTokens can only be called once for batch_size > 1. To call AppendTokens again, use RewindToLength(0)");
 
-  constexpr std::array<DeviceType, 3> devices_supporting_continuous_decoding{DeviceType::CPU, DeviceType::CUDA, DeviceType::WEBGPU};
+  Metrics::Scope metrics_scope{metrics_, metrics_.prefill, profile_.get()};
+  Memory::Scope memory_scope{*memory_usage_};
+  StreamScope stream_scope{*model_->p_device_, stream_};
+  metrics_.prefill.tokens += input_ids.size();
+  ReportPromptMetrics(input_ids.size());
+  EndSpeculativeRound();
+  if (stop_sequences_)
+    stop_sequences_->Reset();
+
+  constexpr std::array<DeviceType, 5> devices_supporting_continuous_decoding{DeviceType::CPU, DeviceType::CUDA, DeviceType::DML, DeviceType::WEBGPU, DeviceType::QNN};
   if (search_->GetSequenceLength() != 0 &&
       std::none_of(devices_supporting_continuous_decoding.begin(), devices_supporting_continuous_decoding.end(),
                    [this](DeviceType device_type) { return device_type == state_->params_->p_device->GetType(); }))
@@ -330,27 +550,132 @@ void Generator::AppendTokens(cpu_span<const int32_t> input_ids) {
     ComputeLogits(search_->GetNextTokens());
   }
 
+  // Prompt tokens already in the KV cache (shared by the prefix cache) are appended to the sequence without running the model
+  if (search_->GetSequenceLength() == 0 && state_->params_->BatchBeamSize() == 1) {
+    if (size_t reused_length = state_->ReusePrefix(input_ids)) {
+      auto reused_ids_device = AllocateInputIdsOnDevice(cpu_span<const int32_t>{input_ids.subspan(0, reused_length)});
+      search_->AppendTokens(reused_ids_device);
+      input_ids = cpu_span<const int32_t>{input_ids.subspan(reused_length)};
+    }
+  }
+
+  // Long prompts are run in prefill_chunk_size pieces against the growing KV cache, which caps the size of the model's
+  // activations and logits. Only the logits of the last chunk are kept. Sliding window models already split the prompt.
+  const auto chunk_size = static_cast<size_t>(std::max(state_->params_->search.prefill_chunk_size, 0));
+  if (chunk_size && state_->params_->BatchBeamSize() == 1 && !model_->config_->model.decoder.sliding_window.has_value() &&
+      std::any_of(devices_supporting_continuous_decoding.begin(), devices_supporting_continuous_decoding.end(),
+                  [this](DeviceType device_type) { return device_type == state_->params_->p_device->GetType(); })) {
+    RestoreKeyValueCache();
+    while (input_ids.size() > chunk_size) {
+      auto chunk_device = AllocateInputIdsOnDevice(cpu_span<const int32_t>{input_ids.subspan(0, chunk_size)});
+      search_->AppendTokens(chunk_device);
+      const auto length = static_cast<size_t>(search_->GetSequenceLength());
+      SwitchRotaryFactors(length - chunk_size, length - chunk_size, length);
+      state_->Run(search_->GetSequenceLength(), chunk_device, search_->GetNextIndices());
+      input_ids = cpu_span<const int32_t>{input_ids.subspan(chunk_size)};
+    }
+  }
+
   auto input_ids_device = AllocateInputIdsOnDevice(input_ids);
   search_->AppendTokens(input_ids_device);
   computed_logits_ = false;
   ComputeLogits(input_ids_device);
 }
 
-void Generator::ComputeLogits(DeviceSpan<int32_t> next_tokens) {
+void Generator::ComputeLogits(DeviceSpan<int32_t> next_tokens, bool defer_logits) {
   if (computed_logits_)
     throw std::runtime_error("ComputeLogits called again without calling AppendTokens or GenerateNextToken first");
+  logits_ahead_ = false;
+
+  RestoreKeyValueCache();
+
+  if (last_action_ == Action::generated && state_->params_->search.compact_finished_sequences)
+    next_tokens = CompactFinishedSequences(next_tokens);
 
+  const auto length = static_cast<size_t>(search_->GetSequenceLength());
+  const size_t state_rows = active_rows_.empty() ? state_->params_->BatchBeamSize() : active_rows_.size();
+  const size_t past_length = length - next_tokens.size() / state_rows;
+  SwitchRotaryFactors(past_length, past_length, length);
+
+  state_->defer_logits_ = defer_logits;
   auto logits = state_->Run(search_->GetSequenceLength(), next_tokens, search_->GetNextIndices());
+  state_->defer_logits_ = false;
+  state_->UpdateMemoryUsage(*memory_usage_);
+  if (state_->raw_logits_ || !state_->top_k_values_.empty()) {
+    // The logits stay in state_->raw_logits_ for SelectTopFp16, or the candidates in state_ for SelectFromCandidates
+    last_action_ = Action::standard;
+    computed_logits_ = true;
+    return;
+  }
   if (g_log.enabled && g_log.model_logits) {
     auto& stream = Log("model_logits");
     DumpSpan(stream, logits.CopyDeviceToCpu());
     stream << std::endl;
   }
+  if (active_rows_.size() < static_cast<size_t>(state_->params_->search.batch_size) && !active_rows_.empty())
+    logits = ExpandCompactedLogits(logits);
   SetLogits(logits);
+  if (medusa_)
+    UpdateMedusaTokens(next_tokens.size() - 1);
   last_action_ = Action::standard;
   computed_logits_ = true;
 }
 
+// Drops the sequences that just selected the EOS token (or completed a stop sequence) from the model's batch, the search
+// only appends pad tokens to them from now on. Returns the next tokens of the sequences the model still computes.
+DeviceSpan<int32_t> Generator::CompactFinishedSequences(DeviceSpan<int32_t> next_tokens) {
+  const auto& search = state_->params_->search;
+  const auto batch_size = static_cast<size_t>(search.batch_size);
+  if (batch_size == 1 || search.num_beams != 1 || compaction_unsupported_)
+    return next_tokens;
+
+  if (active_rows_.empty()) {
+    active_rows_.resize(batch_size);
+    std::iota(active_rows_.begin(), active_rows_.end(), 0);
+  }
+
+  auto tokens = next_tokens.CopyDeviceToCpu();
+  std::vector<int32_t> rows;  // Indices into active_rows_ of the sequences that keep running
+  for (size_t i = 0; i < active_rows_.size(); i++) {
+    if (tokens[active_rows_[i]] != model_->config_->model.eos_token_id && (!stop_sequences_ || !stop_sequences_->IsFinished(active_rows_[i])))
+      rows.push_back(static_cast<int32_t>(i));
+  }
+
+  if (!rows.empty() && rows.size() < active_rows_.size()) {
+    if (!state_->CompactBatch(rows)) {
+      compaction_unsupported_ = true;
+      active_rows_.clear();
+      return next_tokens;
+    }
+    for (size_t i = 0; i < rows.size(); i++)
+      active_rows_[i] = active_rows_[rows[i]];
+    active_rows_.resize(rows.size());
+    active_tokens_ = state_->params_->p_device->Allocate<int32_t>(rows.size());
+  }
+
+  if (active_rows_.size() == batch_size)
+    return next_tokens;
+
+  auto active_tokens = active_tokens_.CpuSpan();
+  for (size_t i = 0; i < active_rows_.size(); i++)
+    active_tokens[i] = tokens[active_rows_[i]];
+  active_tokens_.CopyCpuToDevice();
+  return active_tokens_;
+}
+
+DeviceSpan<float> Generator::ExpandCompactedLogits(DeviceSpan<float> logits) {
+  const size_t vocab_size = model_->config_->model.vocab_size;
+  if (batch_logits_.empty()) {
+    // The finished sequences' rows stay zero, the search pads them regardless of their logits
+    batch_logits_ = model_->p_device_inputs_->Allocate<float>(state_->params_->search.batch_size * vocab_size);
+    batch_logits_.Zero();
+  }
+
+  for (size_t i = 0; i < active_rows_.size(); i++)
+    batch_logits_.subspan(active_rows_[i] * vocab_size, vocab_size).CopyFrom(logits.subspan(i * vocab_size, vocab_size));
+  return batch_logits_;
+}
+
 void Generator::SetRuntimeOption(const char* key, const char* value) {
   // TODO: Need a better way to handle different keys
   // We can create a config manager to host all configurations and do comparison at that point
@@ -363,6 +688,11 @@ void Generator::SetRuntimeOption(const char* key, const char* value) {
       // Value not expected
       throw std::runtime_error(std::string("terminate_session key value unexpected: ") + value);
     }
+  } else if (strcmp(key, "enable_profiling") == 0) {
+    // Writes the profile in progress, if any. The value is the file prefix of a new one, empty or "0" to stop.
+    profile_.reset();
+    if (*value && strcmp(value, "0") != 0)
+      profile_ = std::make_unique<Trace::Profile>(std::string(value) + "_" + std::to_string(id_) + ".json");
   } else {
     throw std::runtime_error(std::string("SetRuntimeOption key is not expected: ") + key);
   }
@@ -370,7 +700,7 @@ void Generator::SetRuntimeOption(const char* key, const char* value) {
 
 bool Generator::IsDone() const {
   ThrowErrorIfSessionTerminated(state_->session_terminated_);
-  if (computed_logits_) {
+  if (computed_logits_ && !logits_ahead_) {
     return false;
   }
 
@@ -382,43 +712,270 @@ bool Generator::IsDone() const {
   return is_done;
 }
 
+bool Generator::IsDoneReady() const {
+  return (computed_logits_ && !logits_ahead_) || state_->session_terminated_ || search_->IsDoneReady();
+}
+
 bool Generator::IsSessionTerminated() const {
   return state_->session_terminated_;
 }
 
 void Generator::SetLogits(DeviceSpan<float> logits) {
+  StreamScope stream_scope{*model_->p_device_, stream_};
+  EndSpeculativeRound();
   search_->SetLogits(logits);
   computed_logits_ = true;
+  logits_ahead_ = false;
+}
+
+void Generator::SetLogitsBias(std::span<const std::pair<int32_t, float>> logit_bias) {
+  const int32_t vocab_size = model_->config_->model.vocab_size;
+  std::map<int32_t, float> biases;  // The CUDA kernel adds every entry in parallel, so each token must appear once
+  for (auto& [token, bias] : logit_bias) {
+    if (token < 0 || token >= vocab_size)
+      throw std::runtime_error("logit_bias token " + std::to_string(token) + " is outside of the vocabulary");
+    biases[token] += bias;
+  }
+  logit_bias_.assign(biases.begin(), biases.end());
+}
+
+void Generator::SetAllowedTokens(std::span<const int32_t> tokens) {
+  if (tokens.empty()) {
+    allowed_tokens_mask_.clear();
+    return;
+  }
+
+  const int32_t vocab_size = model_->config_->model.vocab_size;
+  const size_t word_count = (static_cast<size_t>(vocab_size) + 31) / 32;
+  std::vector<uint32_t> row(word_count);
+  for (int32_t token : tokens) {
+    if (token < 0 || token >= vocab_size)
+      throw std::runtime_error("Allowed token " + std::to_string(token) + " is outside of the vocabulary");
+    row[token / 32] |= 1U << (token % 32);
+  }
+
+  const size_t batch_beam_size = search_->params_->BatchBeamSize();
+  allowed_tokens_mask_.resize(batch_beam_size * word_count);
+  for (size_t i = 0; i < batch_beam_size; i++)
+    std::copy(row.begin(), row.end(), allowed_tokens_mask_.begin() + i * word_count);
 }
 
 void Generator::GenerateNextToken() {
+  Metrics::Scope metrics_scope{metrics_, metrics_.decode, profile_.get()};
+  Memory::Scope memory_scope{*memory_usage_};
+  StreamScope stream_scope{*model_->p_device_, stream_};
+  metrics_.decode.tokens++;
+  SelectNextTokens();
+  if (grammar_)
+    AdvanceGuidance();
+  if (stop_sequences_)
+    stop_sequences_->Advance(GetNextTokens(), search_->GetSequenceLength(), *search_);
+  ComputeLogitsAhead();
+  ReportTokenMetrics();
+}
+
+void Generator::ReportPromptMetrics(size_t token_count) {
+  if (!reports_metrics_ || !Metrics::HasSink())
+    return;
+  Metrics::Emit("oga_prompt_tokens_total", MetricType::Counter, static_cast<double>(token_count));
+  if (!awaiting_first_token_) {
+    awaiting_first_token_ = true;
+    prompt_time_ = Metrics::Clock::now();
+  }
+}
+
+void Generator::ReportTokenMetrics() {
+  if (!reports_metrics_ || !Metrics::HasSink())
+    return;
+  const auto now = Metrics::Clock::now();
+  Metrics::Emit("oga_generated_tokens_total", MetricType::Counter, static_cast<double>(state_->params_->search.batch_size));
+  if (awaiting_first_token_)
+    Metrics::Emit("oga_time_to_first_token_seconds", MetricType::Histogram, std::chrono::duration<double>(now - prompt_time_).count());
+  else if (token_time_ != Metrics::Clock::time_point{})  // Not the first token since the sink was set
+    Metrics::Emit("oga_inter_token_latency_seconds", MetricType::Histogram, std::chrono::duration<double>(now - token_time_).count());
+  awaiting_first_token_ = false;
+  token_time_ = now;
+  Metrics::Emit("oga_kv_cache_bytes", MetricType::Gauge, static_cast<double>(model_->memory_usage_->Get(MemoryUsage::KeyValueCache)));
+}
+
+// StreamingLLM style eviction, called with the KV cache holding the whole sequence
+void Generator::EvictAttentionSinkWindow() {
+  const auto& search = search_->params_->search;
+  const auto length = static_cast<size_t>(search_->GetSequenceLength());
+  const auto sinks = static_cast<size_t>(search.attention_sinks);
+  const size_t count = length - sinks - static_cast<size_t>(GetAttentionSinkWindow(search));
+  RestoreKeyValueCache();
+  if (!state_->EvictKeyValueCache(length, sinks, count))
+    throw std::runtime_error("attention_sinks is not supported by the key-value cache of this model");
+  search_->EvictTokens(sinks, count);
+  if (stop_sequences_)
+    stop_sequences_->Evict(sinks, count);
+  state_->UpdateMemoryUsage(*memory_usage_);
+}
+
+// The model picks the short or long factors from the length of the attention mask, the keys cached before a Run that
+// crosses original_context_length are re-encoded for the factors of that Run instead of running the sequence again
+void Generator::SwitchRotaryFactors(size_t length, size_t from_length, size_t to_length) {
+  const auto& rotary_embedding = model_->config_->model.decoder.rotary_embedding;
+  if (!rotary_embedding || rotary_embedding->long_factor.empty() || length == 0)
+    return;
+  const auto original_length = static_cast<size_t>(rotary_embedding->original_context_length);
+  const bool long_factors = to_length > original_length;
+  if ((from_length > original_length) == long_factors)
+    return;
+
+  // The positions of a row start after its left padding, the rows of the state are the active ones once compacted
+  const size_t batch_size = state_->params_->search.batch_size;
+  std::vector<int32_t> rows = active_rows_;
+  if (rows.empty() || rows.size() == batch_size) {
+    rows.resize(state_->params_->BatchBeamSize());
+    std::iota(rows.begin(), rows.end(), 0);
+  }
+  const auto pad_token_id = model_->config_->model.pad_token_id;
+  std::vector<size_t> padding;
+  for (auto row : rows) {
+    auto sequence = search_->GetSequence(row).CopyDeviceToCpu();
+    sequence = sequence.first(std::min(length, sequence.size()));
+    auto first_token = std::find_if(sequence.begin(), sequence.end(), [pad_token_id](int32_t token) { return token != pad_token_id; });
+    padding.push_back(static_cast<size_t>(first_token - sequence.begin()));
+  }
+  if (!state_->SwitchRotaryFactors(length, padding, long_factors))
+    throw std::runtime_error("Switching the rotary embedding factors at original_context_length (" + std::to_string(original_length) +
+                             ") is not supported by the key-value cache of this model");
+}
+
+size_t Generator::GenerateTokens(size_t max_new_tokens, std::span<int32_t> tokens, size_t interval,
+                                 const std::function<bool(std::span<const int32_t>)>& on_tokens) {
+  const auto& search = search_->params_->search;
+  if (search.num_beams != 1)
+    throw std::runtime_error("GenerateTokens does not support beam search, the tokens of a step can change until the search is done");
+  const size_t batch_size = search.batch_size;
+  if (tokens.size() < max_new_tokens * batch_size)
+    throw std::runtime_error("GenerateTokens needs room for max_new_tokens * batch_size (" + std::to_string(max_new_tokens * batch_size) +
+                             ") tokens, the buffer holds " + std::to_string(tokens.size()));
+
+  size_t count = 0, reported = 0;
+  while (count < max_new_tokens && !IsDone()) {
+    GenerateNextToken();
+    auto next_tokens = GetNextTokens();
+    std::copy(next_tokens.begin(), next_tokens.end(), tokens.begin() + count * batch_size);
+    count++;
+
+    if (on_tokens && interval && count - reported == interval) {
+      bool keep_going = on_tokens(tokens.subspan(reported * batch_size, (count - reported) * batch_size));
+      reported = count;
+      if (!keep_going)
+        return count;
+    }
+  }
+
+  if (on_tokens && reported < count)
+    on_tokens(tokens.subspan(reported * batch_size, (count - reported) * batch_size));
+  return count;
+}
+
+// Queues the model run on the tokens just selected, so the GPU works on the next step while the caller handles them.
+// The search's done state isn't known without waiting for the GPU, so the last step's run is wasted.
+void Generator::ComputeLogitsAhead() {
+  const auto& params = *search_->params_;
+  if (!params.search.pipelined_decode || params.p_device->GetType() != DeviceType::CUDA || params.search.num_beams != 1 ||
+      speculative_ || last_action_ != Action::generated || search_->GetSequenceLength() >= params.search.max_length)
+    return;
+
+  // The copy is queued ahead of the run, so the run is launched without waiting for the selection
+  auto next_tokens = search_->GetNextTokens();
+  auto copied = next_tokens.CopyDeviceToCpuAsync();
+  ComputeLogits(next_tokens, CanSelectTopFp16());
+  if (copied)
+    copied->Wait();
+  auto next_tokens_cpu = next_tokens.CpuSpan();
+  next_tokens_cpu_.assign(next_tokens_cpu.begin(), next_tokens_cpu.end());
+  logits_ahead_ = true;
+}
+
+LogitsProcessors Generator::GetLogitsProcessors() const {
+  auto& search = search_->params_->search;
+  return {search.min_length, search.repetition_penalty, search.frequency_penalty, search.presence_penalty,
+          search.no_repeat_ngram_size, logit_bias_, allowed_tokens_mask_};
+}
+
+void Generator::SelectNextTokens() {
   ThrowErrorIfSessionTerminated(state_->session_terminated_);
   if (search_->GetSequenceLength() == 0 && !computed_logits_)
     throw std::runtime_error("GenerateNextToken called with no prior state. Please call AppendTokens, SetLogits, or params.SetInputs before calling GenerateNextToken.");
 
+  // Models with the LongRoPE factors in their rotary_embedding config re-encode the cached keys instead (see
+  // SwitchRotaryFactors), this is the fallback for older configs.
   // TODO: Extend the solution to make it work for batch size > 1, num beams > 1, multimodal and DML
   // Phi3 model switches from short factor to long factor at 4097 (original_max_position_embeddings+1) token, needs Recomputation of Position IDs and KV Cache
   // at this stage which is achieved by rewinding to zero and appending the current sequence
   // Scenarios where this solution works: Batch size = 1, Num beams = 1, decoder model, EP is either CPU or CUDA
   // Scenarios where it doesn't work: Batch size > 1 OR Num beams > 1 OR Multimodal model (like phi3 vision) OR EP is DML
-  if (search_->params_->BatchBeamSize() == 1) {
+  const auto& rotary_embedding = model_->config_->model.decoder.rotary_embedding;
+  if (search_->params_->BatchBeamSize() == 1 && (!rotary_embedding || rotary_embedding->long_factor.empty())) {
     if (((search_->GetSequenceLength() == 4097) && (model_->config_->model.type == "phi3" || model_->config_->model.type == "phimoe")) || ((search_->GetSequenceLength() == 8197) && (model_->config_->model.type == "phi3small"))) {
       auto current_seq = cpu_span<int32_t>(GetSequence(0).CopyDeviceToCpu());
+      auto grammar_history = grammar_history_;  // The sequence is the same, so the guidance continues where it was
+      auto grammar_states = grammar_states_;
+      auto stop_sequences = std::move(stop_sequences_);  // The same goes for the stop sequences
       RewindToLength(0);
       AppendTokens(current_seq);
+      if (grammar_) {
+        grammar_history_ = std::move(grammar_history);
+        grammar_states_ = std::move(grammar_states);
+        StartGuidanceMask();
+      }
+      stop_sequences_ = std::move(stop_sequences);
     }
   }
 
+  // With speculative decoding the pending token is run together with the draft tokens (greedy search only)
+  if (speculative_ && (IsSpeculating() || (!computed_logits_ && last_action_ == Action::generated)) &&
+      (!search_->params_->search.do_sample || (search_->params_->search.top_k == 1 && search_->params_->batch_top_k.empty()))) {
+    GenerateNextTokenSpeculative();
+    return;
+  }
+
   if (!computed_logits_) {
     auto next_tokens = search_->GetNextTokens();
     if (last_action_ == Action::rewound)
       search_->AppendTokens(next_tokens);
-    ComputeLogits(next_tokens);
+    ComputeLogits(next_tokens, CanSelectTopFp16() || CanSelectFromTopK());
   }
   computed_logits_ = false;
+  logits_ahead_ = false;
   auto& search = search_->params_->search;
-  search_->ApplyMinLength(search.min_length);
-  search_->ApplyRepetitionPenalty(search.repetition_penalty);
+  // The token about to be selected would fill the sequence, the logits of the full sequence are already computed
+  if (search.attention_sinks > 0 && search_->GetSequenceLength() + 1 >= search.max_length)
+    EvictAttentionSinkWindow();
+  Metrics::Timer metrics_timer{GeneratorMetrics::Search};
+
+  if (state_->raw_logits_) {
+    if (CanSelectTopFp16()) {
+      last_action_ = Action::generated;
+      search_->SelectTopFp16(WrapTensor<Ort::Float16_t>(*model_->p_device_inputs_, *state_->raw_logits_), search.repetition_penalty);
+      state_->raw_logits_ = nullptr;
+      return;
+    }
+    ConvertRawLogits();  // SetLogitsBias or SetAllowedTokens was called after the (pipelined) model run
+  }
+
+  if (!state_->top_k_values_.empty()) {
+    if (CanSelectFromTopK()) {
+      last_action_ = Action::generated;
+      search_->SelectFromCandidates(state_->top_k_values_, state_->top_k_tokens_);
+      state_->top_k_values_ = {};
+      state_->top_k_tokens_ = {};
+      return;
+    }
+    ExpandTopKCandidates();
+  }
+
+  search_->ApplyLogitsProcessors(GetLogitsProcessors());
+  if (grammar_)
+    ApplyGuidance();
+  if (search.top_logprobs)
+    search_->ComputeTopLogProbs(search.top_logprobs);
 
   if (g_log.enabled && g_log.generate_next_token) {
     auto& stream = Log("generate_next_token");
@@ -431,6 +988,14 @@ void Generator::GenerateNextToken() {
   }
 
   last_action_ = Action::generated;
+  auto& params = *search_->params_;
+  if (search.do_sample && !params.batch_top_k.empty()) {
+    if (search.min_p > 0.0f || (search.typical_p > 0.0f && search.typical_p < 1.0f))
+      throw std::runtime_error("min_p and typical_p cannot be used with per batch entry sampling parameters");
+    search_->SampleTopKTopP(params.batch_top_k, params.batch_top_p, params.batch_temperature);
+    return;
+  }
+
   if (!search.do_sample || search.top_k == 1) {
     search_->SelectTop();
     return;
@@ -447,6 +1012,15 @@ void Generator::GenerateNextToken() {
     throw std::runtime_error("top_k must be 0 or greater");
   if (search.temperature <= 0.0f)
     throw std::runtime_error("temperature must be greater than 0");
+  if (search.min_p < 0.0f || search.min_p > 1.0f)
+    throw std::runtime_error("min_p must be between 0.0 and 1.0");
+  if (search.typical_p < 0.0f || search.typical_p > 1.0f)
+    throw std::runtime_error("typical_p must be between 0.0 and 1.0");
+
+  // The filters mask the tokens they remove, so the remaining tokens are sampled by the regular top k / top p code
+  search_->ApplyMinP(search.min_p, search.temperature);
+  search_->ApplyTypicalP(search.typical_p, search.temperature);
+  const bool filtered = search.min_p > 0.0f || (search.typical_p > 0.0f && search.typical_p < 1.0f);
 
   if (search.top_p > 0.0f && search.top_p < 1.0f && search.top_k > 1) {
     search_->SampleTopKTopP(search.top_k, search.top_p, search.temperature);
@@ -454,27 +1028,482 @@ void Generator::GenerateNextToken() {
     search_->SampleTopK(search.top_k, search.temperature);
   } else {
     assert(search.top_k == 0);
-    search_->SampleTopP(search.top_p, search.temperature);
+    search_->SampleTopP(search.top_p == 0.0f && filtered ? 1.0f : search.top_p, search.temperature);
   }
 }
 
+// Greedy search selects the tokens straight from fp16 logits when the only logits processing it needs is the EOS handling
+// and the repetition penalty, which saves the full vocabulary fp32 conversion (and on CUDA several kernel launches) per
+// token. The CPU search, which the other devices use too, also samples the top k from them when the sampling doesn't need
+// the probabilities of the whole vocabulary.
+bool Generator::CanSelectTopFp16() const {
+  const auto& params = *search_->params_;
+  const auto& search = params.search;
+  const bool top_k_sampling = params.p_device->GetType() != DeviceType::CUDA && search.top_k > 1 && search.temperature > 0.0f &&
+                              (search.top_p <= 0.0f || search.top_p >= 1.0f) && search.min_p == 0.0f &&
+                              (search.typical_p <= 0.0f || search.typical_p >= 1.0f);
+  return search.num_beams == 1 && (!search.do_sample || ((search.top_k == 1 || top_k_sampling) && params.batch_top_k.empty())) &&
+         search_->GetSequenceLength() >= search.min_length && search.frequency_penalty == 0.0f && search.presence_penalty == 0.0f &&
+         search.no_repeat_ngram_size <= 0 && logit_bias_.empty() && allowed_tokens_mask_.empty() && !speculative_ && !grammar_ &&
+         (!search.compact_finished_sequences || search.batch_size == 1) && search.top_logprobs == 0 &&
+         !(g_log.enabled && (g_log.model_logits || g_log.generate_next_token));
+}
+
+// The same as Logits::Get does for a run that isn't deferred: the fp32 conversion and the EOS handling
+void Generator::ConvertRawLogits() {
+  auto& device = *model_->p_device_inputs_;
+  Cast(*state_->raw_logits_, raw_logits_fp32_, device, Ort::TypeToTensorType<float>);
+  state_->raw_logits_ = nullptr;
+  auto logits = WrapTensor<float>(device, *raw_logits_fp32_);
+
+  const auto& eos_token_ids = model_->config_->model.eos_token_ids;
+  if (!eos_token_ids.empty()) {
+    if (device.GetType() == DeviceType::CUDA) {
+      if (eos_token_ids_device_.empty()) {
+        eos_token_ids_device_ = device.Allocate<int32_t>(eos_token_ids.size());
+        copy(std::span<const int32_t>{eos_token_ids}, eos_token_ids_device_.CpuSpan());
+        eos_token_ids_device_.CopyCpuToDevice();
+      }
+      device.LaunchHandleEOSArray(logits.Span().data(), static_cast<int>(search_->params_->BatchBeamSize()),
+                                  model_->config_->model.vocab_size, eos_token_ids_device_.Span().data(),
+                                  static_cast<int>(eos_token_ids_device_.size()));
+    } else {
+      // The other devices' logits get the EOS handling on the CPU, as in Logits::HandleEOSArray
+      auto logits_cpu = logits.CopyDeviceToCpu();
+      const size_t vocab_size = static_cast<size_t>(model_->config_->model.vocab_size);
+      for (size_t offset = 0; offset < logits_cpu.size(); offset += vocab_size) {
+        auto row = logits_cpu.subspan(offset, vocab_size);
+        float max = std::numeric_limits<float>::lowest();
+        for (auto id : eos_token_ids) {
+          max = std::max(max, row[id]);
+          row[id] = std::numeric_limits<float>::lowest();
+        }
+        row[model_->config_->model.eos_token_id] = max;
+      }
+      logits.CopyCpuToDevice();
+    }
+  }
+  search_->SetLogits(logits);
+}
+
+// A model with a logits_top_k head only outputs each sequence's best scores. Greedy search and top k sampling on the CPU
+// select from them directly when no logits processing needs the scores of the other tokens and the sampling doesn't need
+// the probabilities of the whole vocabulary (top p, min p and typical p).
+bool Generator::CanSelectFromTopK() const {
+  const auto& params = *search_->params_;
+  const auto& search = params.search;
+  const int logits_top_k = model_->config_->model.decoder.logits_top_k;
+  const bool top_k_sampling = search.top_k > 1 && search.top_k <= logits_top_k && search.temperature > 0.0f &&
+                              (search.top_p <= 0.0f || search.top_p >= 1.0f) && search.min_p == 0.0f &&
+                              (search.typical_p <= 0.0f || search.typical_p >= 1.0f);
+  return logits_top_k > 0 && params.p_device->GetType() == DeviceType::CPU && search.num_beams == 1 &&
+         params.batch_top_k.empty() && (!search.do_sample || search.top_k == 1 || top_k_sampling) &&
+         search_->GetSequenceLength() >= search.min_length && search.repetition_penalty == 1.0f &&
+         search.frequency_penalty == 0.0f && search.presence_penalty == 0.0f && search.no_repeat_ngram_size <= 0 &&
+         logit_bias_.empty() && allowed_tokens_mask_.empty() && !speculative_ && !grammar_ && !medusa_ &&
+         (!search.compact_finished_sequences || search.batch_size == 1) && search.top_logprobs == 0 &&
+         !(g_log.enabled && (g_log.model_logits || g_log.generate_next_token));
+}
+
+// The same as Logits::GetTopK does for a run that isn't deferred, the candidates already had the EOS handling
+void Generator::ExpandTopKCandidates() {
+  const size_t rows = state_->top_k_values_.size() / model_->config_->model.decoder.logits_top_k;
+  const size_t vocab_size = static_cast<size_t>(model_->config_->model.vocab_size);
+  if (top_k_logits_.size() != rows * vocab_size)
+    top_k_logits_ = model_->p_device_inputs_->Allocate<float>(rows * vocab_size);
+  ExpandTopKLogits(state_->top_k_values_, state_->top_k_tokens_, top_k_logits_.CpuSpan(), rows);
+  top_k_logits_.CopyCpuToDevice();
+  state_->top_k_values_ = {};
+  state_->top_k_tokens_ = {};
+  search_->SetLogits(top_k_logits_);
+}
+
 void Generator::RewindToLength(size_t new_length) {
-  if (model_->config_->model.type == "whisper" || model_->config_->model.type == "phi3v" || model_->config_->model.type == "decoder-pipeline")
+  if (model_->config_->model.type == "whisper" || model_->config_->model.type == "phi3v")
     throw std::runtime_error("RewindTo is currently not supported for " + model_->config_->model.type + ".");
   if (new_length > search_->GetSequenceLength())
     throw std::runtime_error("Cannot rewind to a length greater than the current sequence length");
+  EndSpeculativeRound();
   if (new_length == search_->GetSequenceLength())
     return;
   size_t batch_size = search_->params_->search.batch_size;
   if (batch_size > 1 && new_length != 0)
     throw std::runtime_error("RewindToLength must be called with new_length=0 when batch_size > 1");
+  if (!active_rows_.empty() && active_rows_.size() < batch_size)
+    throw std::runtime_error("RewindToLength is not supported once compact_finished_sequences removed finished sequences from the batch");
+  StreamScope stream_scope{*model_->p_device_, stream_};
+  RestoreKeyValueCache();
+  const auto length = static_cast<size_t>(search_->GetSequenceLength());
+  state_->CheckRewindTo(new_length);
   search_->RewindTo(new_length);
   state_->RewindTo(new_length);
+  SwitchRotaryFactors(new_length, length, new_length);
+  RewindDraft(new_length);
+  if (grammar_)
+    RewindGuidance(new_length);
+  if (stop_sequences_)
+    stop_sequences_->RewindTo(new_length);
   computed_logits_ = false;
+  logits_ahead_ = false;
   last_action_ = Action::rewound;
 }
 
+void Generator::SetTokens(cpu_span<const int32_t> tokens) {
+  if (state_->params_->BatchBeamSize() != 1)
+    throw std::runtime_error("SetTokens is only supported for batch_size 1 without beam search");
+  if (tokens.empty())
+    throw std::runtime_error("tokens is empty");
+
+  auto sequence = GetSequence(0).CopyDeviceToCpu();
+  size_t prefix_length = std::mismatch(tokens.begin(), tokens.end(), sequence.begin(), sequence.end()).first - tokens.begin();
+  if (prefix_length == tokens.size()) {
+    if (prefix_length == sequence.size())
+      return;  // Already the sequence, after AppendTokens its logits are computed and after GenerateNextToken they will be
+    prefix_length--;
+  }
+  RewindToLength(prefix_length);
+  AppendTokens(tokens.subspan(prefix_length));
+}
+
+std::unique_ptr<Generator> Generator::Fork() {
+  ThrowErrorIfSessionTerminated(state_->session_terminated_);
+  if (state_->params_->BatchBeamSize() != 1)
+    throw std::runtime_error("Fork is only supported for batch_size 1 without beam search");
+  if (grammar_)
+    throw std::runtime_error("Fork is not supported with guidance");
+  const size_t length = search_->GetSequenceLength();
+  if (length == 0)
+    throw std::runtime_error("Fork requires a sequence, call AppendTokens first");
+
+  EndSpeculativeRound();
+  RestoreKeyValueCache();
+
+  auto fork = CreateGenerator(*model_, *state_->params_);
+  // The copied KV cache is part of the fork's prefill
+  Metrics::Scope metrics_scope{fork->metrics_, fork->metrics_.prefill};
+  Memory::Scope memory_scope{*fork->memory_usage_};
+  StreamScope stream_scope{*model_->p_device_, fork->stream_};
+  auto sequence = search_->GetSequence(0).CopyDeviceToCpu();
+  std::vector<int32_t> tokens(sequence.begin(), sequence.begin() + length);
+  cpu_span<const int32_t> input_ids{tokens};
+
+  // The last token is always run by the fork, as its logits are needed. A draft model would have to be forked as well.
+  if (length > 1 && !speculative_ && fork->state_->ForkFrom(*state_, length - 1)) {
+    auto forked_ids_device = fork->AllocateInputIdsOnDevice(cpu_span<const int32_t>{input_ids.subspan(0, length - 1)});
+    fork->search_->AppendTokens(forked_ids_device);
+    input_ids = cpu_span<const int32_t>{input_ids.subspan(length - 1)};
+  }
+  fork->AppendTokens(input_ids);
+  return fork;
+}
+
+std::unique_ptr<Generator> Generator::Merge(const GeneratorParams& params, std::span<const Row> rows) {
+  if (rows.empty() || params.search.batch_size != static_cast<int>(rows.size()) || params.search.num_beams != 1)
+    throw std::runtime_error("Merge needs params with a batch_size of the number of rows and without beam search");
+  const auto& model = *rows.front().generator->model_;
+
+  // The tokens of every row without its padding. The last one was just selected, the KV cache holds the ones before it.
+  std::vector<std::vector<int32_t>> sequences;
+  size_t length = 0;
+  for (const auto& [generator, index] : rows) {
+    if (generator->model_.get() != &model)
+      throw std::runtime_error("Merge needs generators of the same model");
+    if (generator->last_action_ != Action::generated || generator->computed_logits_)
+      throw std::runtime_error("Merge needs generators that just selected a token with GenerateNextToken");
+    if (generator->speculative_ || generator->grammar_ || generator->stop_sequences_)
+      return nullptr;
+    generator->RestoreKeyValueCache();
+    auto sequence = generator->GetSequence(index).CopyDeviceToCpu();
+    const size_t padding = generator->row_padding_.empty() ? 0 : generator->row_padding_[index];
+    sequences.emplace_back(sequence.begin() + padding, sequence.end());
+    length = std::max(length, sequences.back().size());
+  }
+  if (length >= static_cast<size_t>(params.search.max_length))
+    throw std::runtime_error("Merge needs a max_length (" + std::to_string(params.search.max_length) + ") greater than the longest sequence (" + std::to_string(length) + ")");
+
+  auto merged = CreateGenerator(model, params);
+  if (merged->speculative_)
+    return nullptr;
+  // The copied KV cache is part of the merged generator's prefill, like a fork's
+  Metrics::Scope metrics_scope{merged->metrics_, merged->metrics_.prefill};
+  Memory::Scope memory_scope{*merged->memory_usage_};
+  StreamScope stream_scope{*model.p_device_, merged->stream_};
+
+  const size_t batch_size = rows.size();
+  auto tokens = params.p_device->Allocate<int32_t>(batch_size * length);
+  auto past_tokens = params.p_device->Allocate<int32_t>(batch_size * (length - 1));
+  auto next_tokens = params.p_device->Allocate<int32_t>(batch_size);
+  std::vector<StateRow> state_rows;
+  merged->row_padding_.resize(batch_size);
+  for (size_t i = 0; i < batch_size; i++) {
+    const auto& sequence = sequences[i];
+    const size_t padding = length - sequence.size();
+    auto row = tokens.CpuSpan().subspan(i * length, length);
+    std::fill_n(row.begin(), padding, model.config_->model.pad_token_id);
+    std::copy(sequence.begin(), sequence.end(), row.begin() + padding);
+    std::copy_n(row.begin(), length - 1, past_tokens.CpuSpan().begin() + i * (length - 1));
+    next_tokens.CpuSpan()[i] = row.back();
+    merged->row_padding_[i] = padding;
+
+    const auto& source = *rows[i].generator;
+    const size_t source_padding = source.row_padding_.empty() ? 0 : source.row_padding_[rows[i].index];
+    state_rows.push_back({source.state_.get(), rows[i].index, source_padding, sequence.size() - 1});
+  }
+  tokens.CopyCpuToDevice();
+  past_tokens.CopyCpuToDevice();
+  next_tokens.CopyCpuToDevice();
+
+  if (!merged->state_->MergeRows(past_tokens, static_cast<int>(length - 1), state_rows))
+    return nullptr;
+  merged->search_->AppendTokens(tokens);
+  merged->ComputeLogits(next_tokens, merged->CanSelectTopFp16() || merged->CanSelectFromTopK());
+  return merged;
+}
+
+bool Generator::CanReset(const GeneratorParams& params) const {
+  const auto& current = *state_->params_;
+  if (model_->config_->model.type == "whisper" || model_->config_->model.type == "phi3v")
+    return false;
+  if (!active_rows_.empty() && active_rows_.size() < static_cast<size_t>(current.search.batch_size))
+    return false;
+  // Set up once by the constructor, from the model's inputs or the speculative decoding and guidance options
+  if (draft_ || grammar_ || params.draft_model || !params.guidance_pattern.empty() || !params.extra_inputs.empty() ||
+      !params.aux_input_ids.empty())
+    return false;
+  return &params.config == &current.config && params.p_device == current.p_device &&
+         params.search.batch_size == current.search.batch_size && params.search.num_beams == current.search.num_beams &&
+         params.search.max_length == current.search.max_length &&
+         params.search.past_present_share_buffer == current.search.past_present_share_buffer &&
+         params.max_batch_size == current.max_batch_size && params.use_cuda_graph == current.use_cuda_graph &&
+         params.search.top_logprobs == current.search.top_logprobs &&
+         params.search.prompt_lookup_num_tokens == current.search.prompt_lookup_num_tokens &&
+         params.search.attention_sinks == current.search.attention_sinks &&
+         params.search.attention_sink_window == current.search.attention_sink_window &&
+         params.search.stream_priority == current.search.stream_priority &&
+         params.batch_adapter_ids == current.batch_adapter_ids;
+}
+
+void Generator::Reset(const GeneratorParams& params) {
+  if (!CanReset(params))
+    throw std::runtime_error("Reset needs params with the same batch_size, num_beams, max_length and other options the generator's buffers depend on");
+  ValidateParams(*model_, params);
+  Memory::Scope memory_scope{*memory_usage_};
+  RewindToLength(0);
+
+  StreamScope stream_scope{*model_->p_device_, stream_};
+  // The search is small next to the state, but its sampling state and the scorer depend on the search options
+  state_->params_ = params.shared_from_this();
+  search_ = CreateSearch(params);
+  search_->GetSequenceLengths().Zero();  // Like the state did when it was created
+
+  logit_bias_ = params.search.logit_bias;
+  allowed_tokens_mask_.clear();
+  stop_sequences_.reset();
+  if (!params.search.stop_token_sequences.empty() || !params.search.stop_strings.empty())
+    stop_sequences_ = std::make_shared<StopSequences>(*model_, params.search);
+  active_rows_.clear();
+  medusa_tokens_.clear();
+  next_tokens_cpu_.clear();
+  last_action_ = Action::standard;
+  metrics_ = {};
+}
+
+GeneratorPool::GeneratorPool(const Model& model, size_t max_idle_count)
+    : model_{model.shared_from_this()}, max_idle_count_{max_idle_count} {}
+
+std::unique_ptr<Generator> GeneratorPool::Acquire(const GeneratorParams& params) {
+  std::unique_ptr<Generator> generator;
+  {
+    std::scoped_lock lock{mutex_};
+    auto it = std::find_if(idle_.begin(), idle_.end(), [&](const std::unique_ptr<Generator>& idle) { return idle->CanReset(params); });
+    if (it != idle_.end()) {
+      generator = std::move(*it);
+      idle_.erase(it);
+    }
+  }
+  if (!generator)
+    return CreateGenerator(*model_, params);
+
+  generator->Reset(params);
+  return generator;
+}
+
+void GeneratorPool::Release(std::unique_ptr<Generator> generator) {
+  if (!generator || generator->model_ != model_ || !generator->CanReset(*generator->state_->params_))
+    return;
+  {
+    std::scoped_lock lock{mutex_};
+    if (idle_.size() >= max_idle_count_)
+      return;
+  }
+
+  generator->RewindToLength(0);
+  std::scoped_lock lock{mutex_};
+  if (idle_.size() < max_idle_count_)
+    idle_.push_back(std::move(generator));
+}
+
+void GeneratorPool::Clear() {
+  std::vector<std::unique_ptr<Generator>> idle;
+  {
+    std::scoped_lock lock{mutex_};
+    idle.swap(idle_);
+  }
+}
+
+size_t GeneratorPool::GetIdleCount() const {
+  std::scoped_lock lock{mutex_};
+  return idle_.size();
+}
+
+namespace {
+constexpr std::array<uint8_t, 8> generator_state_magic{'O', 'G', 'A', 'S', 'T', 'A', 'T', 'E'};
+constexpr uint32_t generator_state_version = 1;
+
+struct SavedState {
+  std::vector<int32_t> tokens;
+  bool done{};
+  std::string random_state;
+  StateReader cache_reader{{}};  // The KV cache section, empty if the state has no KV cache
+};
+
+SavedState ReadState(std::span<const uint8_t> state, const Config& config, int max_length) {
+  StateReader reader{state};
+  auto magic = reader.ReadBytes(generator_state_magic.size());
+  if (!std::equal(magic.begin(), magic.end(), generator_state_magic.begin()))
+    throw std::runtime_error("The data is not a generator state");
+  if (auto version = reader.Read<uint32_t>(); version != generator_state_version)
+    throw std::runtime_error("Unsupported generator state version " + std::to_string(version) + ", expected " +
+                             std::to_string(generator_state_version));
+  if (reader.Read<int32_t>() != config.model.vocab_size ||
+      reader.Read<int32_t>() != config.model.decoder.num_hidden_layers)
+    throw std::runtime_error("The generator state was saved with a different model");
+
+  SavedState saved;
+  const auto length = static_cast<size_t>(reader.Read<uint64_t>());
+  auto bytes = reader.ReadBytes(length * sizeof(int32_t));
+  saved.tokens.resize(length);
+  std::memcpy(saved.tokens.data(), bytes.data(), bytes.size());
+  saved.done = reader.Read<uint8_t>() != 0;
+  saved.random_state = reader.ReadString();
+  saved.cache_reader = reader.ReadSection();
+  if (length > static_cast<size_t>(max_length))
+    throw std::runtime_error("The generator state sequence length (" + std::to_string(length) + ") exceeds max length (" +
+                             std::to_string(max_length) + ")");
+  return saved;
+}
+}  // namespace
+
+std::vector<uint8_t> Generator::SaveState(bool quantize_kv_cache) {
+  ThrowErrorIfSessionTerminated(state_->session_terminated_);
+  if (state_->params_->BatchBeamSize() != 1)
+    throw std::runtime_error("SaveState is only supported for batch_size 1 without beam search");
+  if (grammar_)
+    throw std::runtime_error("SaveState is not supported with guidance");
+
+  EndSpeculativeRound();
+  RestoreKeyValueCache();
+
+  const size_t length = search_->GetSequenceLength();
+  auto sequence = search_->GetSequence(0).CopyDeviceToCpu();
+
+  StateWriter writer;
+  writer.quantize_key_value_cache_ = quantize_kv_cache;
+  writer.WriteBytes(generator_state_magic);
+  writer.Write<uint32_t>(generator_state_version);
+  writer.Write<int32_t>(model_->config_->model.vocab_size);
+  writer.Write<int32_t>(model_->config_->model.decoder.num_hidden_layers);
+  writer.Write<uint64_t>(length);
+  writer.WriteBytes(std::span<const uint8_t>{reinterpret_cast<const uint8_t*>(sequence.data()), length * sizeof(int32_t)});
+  writer.Write<uint8_t>(IsDone());
+  writer.WriteString(search_->GetRandomState());
+
+  // The KV cache of every token but the last, which is run again on load (see Fork)
+  const size_t cache_length = length > 1 && !speculative_ ? length - 1 : 0;
+  auto cache_section = writer.BeginSection();
+  writer.Write<uint64_t>(cache_length);
+  if (!cache_length || !state_->SaveKeyValueCache(writer, cache_length))
+    writer.blob_.resize(cache_section);  // An empty section, the whole sequence is run on load
+  writer.EndSection(cache_section);
+  return std::move(writer.blob_);
+}
+
+void Generator::LoadState(std::span<const uint8_t> state) {
+  ThrowErrorIfSessionTerminated(state_->session_terminated_);
+  if (search_->GetSequenceLength() != 0)
+    throw std::runtime_error("LoadState requires a new generator");
+  if (state_->params_->BatchBeamSize() != 1)
+    throw std::runtime_error("LoadState is only supported for batch_size 1 without beam search");
+
+  auto saved = ReadState(state, *model_->config_, state_->params_->search.max_length);
+  search_->SetRandomState(saved.random_state);
+  if (saved.tokens.empty())
+    return;
+
+  AppendSavedTokens(saved.tokens, saved.cache_reader);
+  if (saved.done)
+    search_->FinishSequence(0);
+}
+
+void Generator::AppendState(std::span<const uint8_t> state) {
+  ThrowErrorIfSessionTerminated(state_->session_terminated_);
+  if (state_->params_->BatchBeamSize() != 1)
+    throw std::runtime_error("AppendState is only supported for batch_size 1 without beam search");
+
+  auto saved = ReadState(state, *model_->config_, state_->params_->search.max_length);
+  if (saved.tokens.empty())
+    return;
+  if (saved.tokens.size() + search_->GetSequenceLength() > static_cast<size_t>(state_->params_->search.max_length))
+    throw std::runtime_error("The generator state sequence length (" + std::to_string(saved.tokens.size()) +
+                             ") + current sequence length (" + std::to_string(search_->GetSequenceLength()) +
+                             ") exceeds max length (" + std::to_string(state_->params_->search.max_length) + ")");
+
+  // The KV cache has to hold the whole sequence before the saved entries go after it
+  EndSpeculativeRound();
+  if (last_action_ == Action::generated)
+    ComputeLogits(search_->GetNextTokens());
+  AppendSavedTokens(saved.tokens, saved.cache_reader);
+}
+
+void Generator::AppendSavedTokens(cpu_span<const int32_t> input_ids, StateReader& cache_reader) {
+  const size_t position = search_->GetSequenceLength();
+  {
+    Memory::Scope memory_scope{*memory_usage_};
+    StreamScope stream_scope{*model_->p_device_, stream_};
+    RestoreKeyValueCache();
+    const auto cache_length = cache_reader.IsEmpty() ? 0 : static_cast<size_t>(cache_reader.Read<uint64_t>());
+    if (cache_length && cache_length < input_ids.size() && !speculative_ &&
+        (position == 0 ? state_->LoadKeyValueCache(cache_reader, cache_length)
+                       : state_->AppendKeyValueCache(cache_reader, cache_length, position))) {
+      auto loaded_ids_device = AllocateInputIdsOnDevice(cpu_span<const int32_t>{input_ids.subspan(0, cache_length)});
+      search_->AppendTokens(loaded_ids_device);
+      input_ids = cpu_span<const int32_t>{input_ids.subspan(cache_length)};
+    }
+  }
+  AppendTokens(input_ids);
+}
+
+void Generator::OffloadKeyValueCache(const char* path) {
+  if (kv_cache_offloaded_)
+    throw std::runtime_error("The key-value cache is already offloaded");
+  StreamScope stream_scope{*model_->p_device_, stream_};
+  kv_cache_offloaded_ = state_->OffloadKeyValueCache(fs::path{path ? path : ""});
+  state_->UpdateMemoryUsage(*memory_usage_);
+}
+
+void Generator::RestoreKeyValueCache() {
+  if (!kv_cache_offloaded_)
+    return;
+  state_->RestoreKeyValueCache();
+  kv_cache_offloaded_ = false;
+  state_->UpdateMemoryUsage(*memory_usage_);
+}
+
 DeviceSpan<float> Generator::GetLogits() {
+  Metrics::Scope metrics_scope{metrics_, metrics_.decode, profile_.get()};
+  Memory::Scope memory_scope{*memory_usage_};
+  StreamScope stream_scope{*model_->p_device_, stream_};
+  EndSpeculativeRound();
   if (!computed_logits_) {
     ComputeLogits(search_->GetNextTokens());
   }
@@ -485,4 +1514,27 @@ DeviceSpan<int32_t> Generator::GetSequence(size_t index) const {
   return search_->GetSequence(index);
 }
 
+std::span<const int32_t> Generator::GetNextTokens() {
+  if (logits_ahead_)
+    return next_tokens_cpu_;
+  return search_->GetNextTokens().CopyDeviceToCpu();
+}
+
+std::span<const int32_t> Generator::GetTopLogProbTokens() {
+  if (search_->top_logprob_tokens_.empty())
+    throw std::runtime_error("GetTopLogProbs requires search.top_logprobs > 0 and a token generated with GenerateNextToken");
+  return search_->top_logprob_tokens_.CopyDeviceToCpu();
+}
+
+std::span<const float> Generator::GetTopLogProbs() {
+  if (search_->top_logprobs_.empty())
+    throw std::runtime_error("GetTopLogProbs requires search.top_logprobs > 0 and a token generated with GenerateNextToken");
+  return search_->top_logprobs_.CopyDeviceToCpu();
+}
+
+std::string Generator::GetMemoryUsage() const {
+  state_->UpdateMemoryUsage(*memory_usage_);
+  return memory_usage_->ToJson();
+}
+
 }  // namespace Generators
@@ -12,6 +12,7 @@
 #include <functional>
 #include <iostream>
 #include "span.h"
+#include <map>
 #include <memory>
 #include <numeric>
 #include <optional>
@@ -29,18 +30,24 @@
 #include "models/onnxruntime_api.h"
 #include "smartptrs.h"
 #include "models/debugging.h"
+#include "models/device_arena.h"
 #include "config.h"
 #include "logging.h"
 #include "runtime_settings.h"
 #include "tensor.h"
+#include "worker_thread.h"
 
 void ThrowErrorIfSessionTerminated(bool is_session_terminated);
 
 namespace Generators {
 struct Model;
 struct State;
+struct StateReader;
 struct Search;
+struct LogitsProcessors;
 struct Tokenizer;
+struct TokenGrammar;
+struct StopSequences;
 
 template <typename T>
 DeviceSpan<T> WrapTensor(DeviceInterface& device, OrtValue& value) {
@@ -50,6 +57,7 @@ DeviceSpan<T> WrapTensor(DeviceInterface& device, OrtValue& value) {
 }
 
 DeviceSpan<uint8_t> ByteWrapTensor(DeviceInterface& device, OrtValue& value);
+size_t GetTensorSizeInBytes(OrtValue* value);  // 0 if value is null
 
 template <typename T>
 struct OrtTensor {
@@ -85,7 +93,8 @@ struct GeneratorParams : std::enable_shared_from_this<GeneratorParams>, LeakChec
 
   struct Whisper {
     std::shared_ptr<Tensor> input_features;   // float32 [batch_size, number_of_mels, number_of_frames]
-    std::shared_ptr<Tensor> alignment_heads;  // int32 [num_alignment_heads, 2]
+    std::shared_ptr<Tensor> alignment_heads;  // int32 [num_alignment_heads, 2], cross QK is only collected when set
+    bool sparse_cross_qk{};                   // Only record the frame with the highest cross QK per alignment head and token
   };
 
   std::variant<Whisper> inputs;
@@ -104,6 +113,30 @@ struct GeneratorParams : std::enable_shared_from_this<GeneratorParams>, LeakChec
 
   void SetInputs(const NamedTensors& inputs);
 
+  // Speculative decoding: the draft model (a smaller model with the same vocabulary) proposes num_draft_tokens tokens
+  // that the model verifies in a single run. Only used for greedy search with a batch_beam_size of 1.
+  void SetDraftModel(const Model& model, int draft_token_count);
+  std::shared_ptr<const Model> draft_model;
+  int num_draft_tokens{};
+
+  // Per batch entry sampling parameters, so requests with different settings can share a batch. When set, they replace
+  // search.top_k, top_p and temperature if do_sample is true, and entries with a top_k of 1 select the top token.
+  void SetBatchSampling(std::span<const int32_t> top_k, std::span<const float> top_p, std::span<const float> temperature);
+  std::vector<int32_t> batch_top_k;      // shape (batch_size), or empty to use search.top_k for the whole batch
+  std::vector<float> batch_top_p;        // shape (batch_size)
+  std::vector<float> batch_temperature;  // shape (batch_size)
+
+  // Per batch entry adapters of a multi-LoRA model (see model.decoder.adapter_names), so requests for different adapters
+  // can share a batch. An empty name selects the base model.
+  void SetBatchAdapters(std::span<const std::string> adapter_names);
+  std::vector<int32_t> batch_adapter_ids;  // shape (batch_size), 0 for the base model and n for adapter_names[n - 1]
+
+  // Constrains the generated tokens to text that matches a grammar (see constrained_decoding.h). 'type' is "regex" or
+  // "json_schema", an empty type removes the constraint. Prompt tokens aren't constrained, the grammar starts with
+  // the first generated token.
+  void SetGuidance(std::string_view type, std::string_view data);
+  std::string guidance_pattern;  // The regex the generated text must match, empty if unconstrained
+
  private:
   bool is_cuda_graph_enabled_{};
 };
@@ -112,15 +145,91 @@ struct Generator : LeakChecked<Generator> {
   Generator(const Model& model, const GeneratorParams& params);
 
   bool IsDone() const;
+  bool IsDoneReady() const;  // True if IsDone can return without waiting for the device
   void AppendTokens(cpu_span<const int32_t> input_ids);
   void GenerateNextToken();
+  // Runs up to max_new_tokens GenerateNextToken steps without leaving native code and writes every step's tokens, batch_size
+  // per step, to 'tokens'. 'on_tokens' gets the tokens of every 'interval' steps and the remaining ones at the end, returning
+  // false stops the generation. Returns the number of steps run.
+  size_t GenerateTokens(size_t max_new_tokens, std::span<int32_t> tokens, size_t interval = 0,
+                        const std::function<bool(std::span<const int32_t>)>& on_tokens = {});
   void RewindToLength(size_t new_length);  // Rewind state to new_length
+  // Makes 'tokens' the sequence of a batch size 1 generator, rewinding to the prefix they share with the current
+  // sequence and appending the rest. A prompt that is still being typed can be appended tentatively as it grows, and
+  // the final prompt then only runs the tokens that changed. The last token is always run, for the next token's logits.
+  void SetTokens(cpu_span<const int32_t> tokens);
+  // Returns a new generator with the same params and sequence that continues independently of this one, for parallel
+  // samples of one prompt. Only batch size 1 is supported. The KV cache entries are copied (or shared, with a paged KV
+  // cache) where the model supports it, so only the last token is run again. With a fixed random_seed every fork samples
+  // the same tokens, set a different seed through the params of separate generators to get distinct samples.
+  std::unique_ptr<Generator> Fork();
+  // Shared batches (see Engine): returns a generator created with 'params', whose batch_size is the number of rows, that
+  // continues rows[n] in row n of its batch. Every row's generator must have just selected a token with
+  // GenerateNextToken. The rows are left padded to the longest and their KV cache entries are copied (the generators
+  // are left as they are), then the selected tokens of all rows are run as one batch. Returns null if the generators
+  // can't be merged, e.g. as the model's state doesn't support it (see State::MergeRows) or they use guidance, stop
+  // sequences or speculative decoding.
+  struct Row {
+    Generator* generator;
+    size_t index;  // Into the generator's batch
+  };
+  static std::unique_ptr<Generator> Merge(const GeneratorParams& params, std::span<const Row> rows);
+  // Starts over with an empty sequence and 'params', keeping the KV cache, logits, position inputs and captured graph
+  // of the state so a new request doesn't allocate them again. The search options can change, but the batch_size,
+  // num_beams, max_length and the other params the state's buffers depend on have to be the same (see CanReset).
+  // Like RewindToLength, not supported for whisper and phi3v or once compact_finished_sequences shrank the batch.
+  bool CanReset(const GeneratorParams& params) const;
+  void Reset(const GeneratorParams& params);
+
+  // Snapshots of batch size 1 generators that can be loaded in another process: the sequence, whether it's done, the
+  // sampling random number generator state and the KV cache entries where the model supports saving them. LoadState is
+  // called on a new generator created with the same model and params, without the KV cache it runs the whole sequence.
+  // Like Fork, the last token of the sequence is run again on load for its logits. The cache is written layer by layer,
+  // with quantize_kv_cache as int8 with a scale per token and head, about half the size of a float16 cache.
+  std::vector<uint8_t> SaveState(bool quantize_kv_cache = false);
+  void LoadState(std::span<const uint8_t> state);
+  // Cached documents for retrieval prompts: appends the tokens of a state saved by SaveState, along with their saved KV
+  // cache entries so only the last token is run. A document is saved once (without a BOS token) and appended after any
+  // tokens, several documents one after another. The entries are re-encoded for their new positions where the model's
+  // config has a decoder rotary_embedding, otherwise the tokens are run. The tokens of a document only attend to each
+  // other, unlike the tokens appended after it. The random state and done flag of the saved state are ignored.
+  void AppendState(std::span<const uint8_t> state);
+
+  // Moves the KV cache to host memory (or to the file at 'path' when set) to free device memory while the generator is idle.
+  // The next call that needs the cache restores it without recomputation, RestoreKeyValueCache does so ahead of time.
+  void OffloadKeyValueCache(const char* path = nullptr);
+  void RestoreKeyValueCache();
+  bool IsKeyValueCacheOffloaded() const { return kv_cache_offloaded_; }
   DeviceSpan<float> GetLogits();
   void SetLogits(DeviceSpan<float> logits);
+  // Replaces the search's logit_bias from the next token selection on, an empty span removes the bias. The biases of a
+  // token given more than once are added.
+  void SetLogitsBias(std::span<const std::pair<int32_t, float>> logit_bias);
+  // Only the given tokens can be selected from the next token selection on (EOS too, if it's included), an empty span
+  // allows every token again. Cheaper than masking the logits through SetLogits, the mask stays on the device.
+  void SetAllowedTokens(std::span<const int32_t> tokens);
   void SetRuntimeOption(const char* key, const char* value);
   bool IsSessionTerminated() const;
 
   DeviceSpan<int32_t> GetSequence(size_t index) const;
+  std::span<const int32_t> GetNextTokens();  // On the CPU, with pipelined_decode without waiting for the model run in flight
+  // With search.top_logprobs, the most likely tokens of the last GenerateNextToken and their log-probabilities, both
+  // [batch_size * num_beams, top_logprobs] on the CPU in descending order. They are taken from the scores after the
+  // penalties, biases and masks, before the sampling filters and the temperature.
+  std::span<const int32_t> GetTopLogProbTokens();
+  std::span<const float> GetTopLogProbs();
+
+  // Measures the key-value cache and logits of the state, then returns memory_usage_ as JSON (see MemoryUsage::ToJson)
+  std::string GetMemoryUsage() const;
+
+  // Accumulated since the generator was created, assign {} to start over
+  GeneratorMetrics metrics_;
+  uint64_t id_{};                            // Unique in the process, names the profile
+  std::unique_ptr<Trace::Profile> profile_;  // Set by the "enable_profiling" runtime option
+  // Live memory of the generator, charged to its model's usage too. Buffers are counted as they are allocated, the
+  // key-value cache and logits are measured after every model run.
+  std::shared_ptr<MemoryUsage> memory_usage_;
+  void* stream_{};  // The stream of search.stream_priority, null for the model's stream (see StreamScope)
 
   std::shared_ptr<const Model> model_;
   std::unique_ptr<State> state_;
@@ -130,18 +239,119 @@ struct Generator : LeakChecked<Generator> {
  private:
   DeviceSpan<int32_t> AllocateInputIdsOnDevice(cpu_span<const int32_t> input_ids);
   void AuxAppendTokens(cpu_span<const int32_t> input_ids);
-  void ComputeLogits(DeviceSpan<int32_t> next_tokens);
+  void AppendSavedTokens(cpu_span<const int32_t> input_ids, StateReader& cache_reader);  // See LoadState and AppendState
+  // The prompt and token metrics of the metrics sink (see Metrics::SetSink)
+  void ReportPromptMetrics(size_t token_count);
+  void ReportTokenMetrics();
+  void EvictAttentionSinkWindow();                                                       // See search.attention_sinks
+  // LongRoPE: re-encodes the keys of the first 'length' tokens in the KV cache, encoded for a sequence of 'from_length'
+  // tokens, for one of 'to_length' tokens when that crosses original_context_length
+  void SwitchRotaryFactors(size_t length, size_t from_length, size_t to_length);
+  void ComputeLogits(DeviceSpan<int32_t> next_tokens, bool defer_logits = false);  // See State::defer_logits_
+  bool CanSelectTopFp16() const;
+  bool CanSelectFromTopK() const;
+  void ConvertRawLogits();  // Hands the fp16 logits of a deferred run to the search as fp32 logits
+  void ExpandTopKCandidates();  // Hands the candidates of a deferred run to the search as full vocabulary logits
+  void SelectNextTokens();
+  LogitsProcessors GetLogitsProcessors() const;  // The search options, logit_bias_ and allowed_tokens_mask_
+  void ComputeLogitsAhead();
+  DeviceSpan<int32_t> CompactFinishedSequences(DeviceSpan<int32_t> next_tokens);
+  DeviceSpan<float> ExpandCompactedLogits(DeviceSpan<float> logits);
   enum Action { standard,   // Default, set in any other case
                 generated,  // Set after GenerateNextToken
                 rewound };  // Set after RewindToLength
   Action last_action_{standard};
+  bool kv_cache_offloaded_{};
+
+  bool reports_metrics_{true};  // Cleared for the draft generator of speculative decoding
+  bool awaiting_first_token_{};  // Set from AppendTokens to the next GenerateNextToken, for the time to first token
+  Metrics::Clock::time_point prompt_time_, token_time_;  // Of the AppendTokens awaiting its first token and of the last token
+
+  // pipelined_decode: GenerateNextToken already ran the model on the tokens it selected (computed_logits_ is set too),
+  // but unlike after an explicit ComputeLogits the search may be done
+  bool logits_ahead_{};
+  std::vector<int32_t> next_tokens_cpu_;  // The tokens the run in flight processes
+
+  // compact_finished_sequences: the batch entries the model still computes (see State::CompactBatch)
+  std::vector<int32_t> active_rows_;  // Empty until the first generated token
+  bool compaction_unsupported_{};     // Set if the state can't change its batch size
+  std::vector<size_t> row_padding_;   // Set by Merge, the pad tokens each sequence of the batch starts with
+  DeviceSpan<int32_t> active_tokens_;  // The next tokens of active_rows_
+  DeviceSpan<float> batch_logits_;     // The logits of active_rows_ spread back over the whole batch for the search
+
+  // Speculative decoding (see speculative_decoding.cpp). A round proposes draft tokens, from the draft model, by prompt
+  // lookup, from the Medusa heads or from the early exit head, then runs the model once on the pending token plus the draft tokens. Every GenerateNextToken call then selects
+  // one token from the verified logits, until a selected token differs from the draft token and the round ends.
+  bool IsSpeculating() const;
+  void GenerateNextTokenSpeculative();
+  void StartSpeculativeRound();
+  void SelectVerifiedToken();
+  void EndSpeculativeRound();  // Also called by anything that needs the regular state while verified tokens are left
+  void ProposeDraftModelTokens(size_t max_count);
+  void ProposePromptLookupTokens(size_t max_count);
+  void ProposeMedusaTokens(size_t max_count);
+  void ProposeEarlyExitTokens(size_t max_count);
+  void UpdateMedusaTokens(size_t row);
+  void SyncDraft();
+  void RewindDraft(size_t length);
+
+  bool speculative_{};                        // Set if there is a draft model, prompt lookup is enabled or the model has Medusa heads or an early exit head
+  bool medusa_{};                             // Set if the model has a medusa_logits output
+  bool early_exit_{};                         // Set if the config has early_exit and no other way to draft tokens is used
+  std::unique_ptr<Generator> draft_;
+  std::vector<int32_t> draft_tokens_;         // Proposed this round
+  std::vector<float> verified_logits_;        // Model logits after the pending token and each draft token, vocab_size each
+  size_t verified_index_{};                   // Next row of verified_logits_ to select a token from
+  size_t round_start_length_{};               // Sequence length (including the pending token) when the round started
+  DeviceSpan<float> verified_logits_device_;  // The row handed to the search
+  std::vector<int32_t> medusa_tokens_;        // Top token of every Medusa head after the last token the model processed
+
+  // SetLogitsBias and SetAllowedTokens, applied before every token selection
+  std::vector<std::pair<int32_t, float>> logit_bias_;  // search.logit_bias until SetLogitsBias
+  std::vector<uint32_t> allowed_tokens_mask_;          // shape (batch_beam_size, (vocab_size + 31) / 32), empty if every token is allowed
+  std::unique_ptr<OrtValue> raw_logits_fp32_;          // See ConvertRawLogits
+  DeviceSpan<float> top_k_logits_;                     // See ExpandTopKCandidates
+  DeviceSpan<int32_t> eos_token_ids_device_;
+
+  std::shared_ptr<StopSequences> stop_sequences_;  // Advanced by every generated token, before the next model run
+
+  // Guidance (see constrained_decoding.cpp). The grammar state of every batch entry advances with each generated token,
+  // then the worker computes the mask of the tokens allowed next while the model runs.
+  void StartGuidanceMask();
+  void ApplyGuidance();
+  void AdvanceGuidance();
+  void RewindGuidance(size_t length);
+
+  std::shared_ptr<TokenGrammar> grammar_;
+  std::vector<int32_t> grammar_states_;                                   // shape (batch_size)
+  std::vector<std::pair<size_t, std::vector<int32_t>>> grammar_history_;  // Sequence length and states before each generated token
+  std::vector<uint32_t> grammar_mask_;                                    // shape (batch_size, (vocab_size + 31) / 32)
+  std::future<void> grammar_mask_ready_;
+  std::optional<WorkerThread> grammar_worker_;  // Last, so it stops before the members it uses are destroyed
 };
 
 struct OrtGlobals {
   OrtGlobals();
 
+  // Sessions run on the env's intra and inter op thread pools unless their config sets a thread count, so the sessions of
+  // a pipeline (or of several models) don't each start a pool per core. ORTGENAI_ORT_INTRA_OP_THREADS and
+  // ORTGENAI_ORT_INTER_OP_THREADS size the pools, ORTGENAI_ORT_GLOBAL_THREAD_POOLS=0 gives every session its own again.
+  bool global_thread_pools_{true};
   std::unique_ptr<OrtEnv> env_;
-  std::unique_ptr<Ort::Allocator> allocator_device_[static_cast<int>(DeviceType::MAX)];
+  std::unordered_map<const DeviceInterface*, std::unique_ptr<Ort::Allocator>> allocator_device_;  // See EnsureDeviceOrtInit
+
+  std::once_flag thread_pool_once_;
+  std::unique_ptr<WorkerThreadPool> thread_pool_;  // See GetThreadPool
+
+  // The Identity model session that WebGPU buffer copies run through, created on first use (see webgpu/interface.cpp).
+  // The copies of all threads share the binding, so they hold webgpu_copy_mutex_ from binding to clearing it.
+  std::once_flag webgpu_copy_session_once_;
+  std::unique_ptr<OrtSession> webgpu_copy_session_;
+  std::mutex webgpu_copy_mutex_;
+  std::unique_ptr<OrtIoBinding> webgpu_copy_binding_;
+  std::unique_ptr<DeviceArena> webgpu_buffer_pool_;  // Declared after allocator_device_, so its buffers are freed first
+  std::mutex webgpu_zero_mutex_;
+  std::shared_ptr<DeviceBuffer> webgpu_zero_buffer_;  // Zeros that WebGPU buffers are cleared from, see WebGPUMemory::Zero
 
  private:
   OrtGlobals(const OrtGlobals&) = delete;
@@ -151,9 +361,38 @@ struct OrtGlobals {
 std::unique_ptr<OrtGlobals>& GetOrtGlobals();
 void Shutdown();  // Do this once at exit, Ort code will fail after this call
 OrtEnv& GetOrtEnv();
+// Idle generators of one model kept for reuse. Acquire resets an idle generator that can take the params (see
+// Generator::Reset) and only creates a new one when there is none, so a serving path that creates a generator per
+// request mostly reuses the device allocations of the requests that finished before it.
+struct GeneratorPool : LeakChecked<GeneratorPool> {
+  GeneratorPool(const Model& model, size_t max_idle_count);
+
+  std::unique_ptr<Generator> Acquire(const GeneratorParams& params);
+  // Rewinds the generator to an empty sequence, which returns its paged KV cache blocks, and keeps it if the pool has
+  // room for it and it can be reset later. Otherwise it's destroyed.
+  void Release(std::unique_ptr<Generator> generator);
+  void Clear();  // Destroys the idle generators, freeing the memory they hold
+
+  size_t GetIdleCount() const;
+
+  std::shared_ptr<const Model> model_;
+
+ private:
+  const size_t max_idle_count_;
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Generator>> idle_;  // Protected by mutex_
+};
+
+// Shared by all of the library's parallel CPU work (the CPU search's batch entries, ThreadPool::Compute), created on first use.
+// ORTGENAI_THREAD_POOL_SIZE sets its number of worker threads, which defaults to one less than the number of cores.
+WorkerThreadPool& GetThreadPool();
 
 std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, const char* config_path, const RuntimeSettings* settings = nullptr);
-std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, std::unique_ptr<Config> config);
+// Receives a description of each step of a model creation once it's done, the sessions are created on several threads
+// and may report at the same time. With a progress callback the model is ready to run once CreateModel returns, the
+// sessions a model would otherwise load on first use are loaded too.
+using ModelLoadProgress = std::function<void(std::string_view step)>;
+std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, std::unique_ptr<Config> config, const ModelLoadProgress* progress = nullptr);
 std::shared_ptr<GeneratorParams> CreateGeneratorParams(const Model& model);
 std::shared_ptr<GeneratorParams> CreateGeneratorParams(const Config& config);  // For benchmarking purposes only
 std::unique_ptr<Generator> CreateGenerator(const Model& model, const GeneratorParams& params);
@@ -3,6 +3,11 @@
  */
 package ai.onnxruntime.genai;
 
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.FloatBuffer;
+import java.nio.IntBuffer;
+
 /**
  * The Generator class generates output using a model and generator parameters.
  *
@@ -75,6 +80,30 @@ public final class Generator implements AutoCloseable, Iterable<Integer> {
     appendTokens(nativeHandle, inputIDs);
   }
 
+  /**
+   * Appends the remaining tokens of a direct buffer to the generator. The tokens are read in place,
+   * which avoids the copy appendTokens(int[]) makes. The buffer position is not changed.
+   *
+   * @param inputIDs The tokens to append. Must be a direct buffer with native byte order, such as
+   *     one from ByteBuffer.allocateDirect(n * 4).order(ByteOrder.nativeOrder()).asIntBuffer().
+   * @throws GenAIException If the call to the GenAI native API fails.
+   */
+  public void appendTokens(IntBuffer inputIDs) throws GenAIException {
+    if (nativeHandle == 0) {
+      throw new IllegalStateException("Instance has been freed and is invalid");
+    }
+
+    if (!inputIDs.isDirect()) {
+      throw new IllegalArgumentException("inputIDs must be a direct buffer");
+    }
+
+    if (inputIDs.order() != ByteOrder.nativeOrder()) {
+      throw new IllegalArgumentException("inputIDs must have native byte order");
+    }
+
+    appendTokensDirect(nativeHandle, inputIDs, inputIDs.position(), inputIDs.remaining());
+  }
+
   /**
    * Appends token sequences to the generator.
    *
@@ -137,6 +166,41 @@ public final class Generator implements AutoCloseable, Iterable<Integer> {
     return getSequenceNative(nativeHandle, sequenceIndex);
   }
 
+  /**
+   * Returns a read-only view of the token ids of the specified sequence without copying them. The
+   * buffer maps the generator's memory, so it is only valid until the next call that changes the
+   * generator (appendTokens, generateNextToken, rewindTo, close). Use getSequence to keep a copy.
+   *
+   * @param sequenceIndex The index of the sequence.
+   * @return A direct IntBuffer over the sequence token ids.
+   * @throws GenAIException If the call to the GenAI native API fails.
+   */
+  public IntBuffer getSequenceBuffer(long sequenceIndex) throws GenAIException {
+    if (nativeHandle == 0) {
+      throw new IllegalStateException("Instance has been freed and is invalid");
+    }
+
+    ByteBuffer buffer = getSequenceBufferNative(nativeHandle, sequenceIndex);
+    return buffer.asReadOnlyBuffer().order(ByteOrder.nativeOrder()).asIntBuffer();
+  }
+
+  /**
+   * Returns a read-only view of the last token logits without copying them into a Tensor. The
+   * buffer holds batch_size * num_beams rows of vocab_size values and is only valid until the next
+   * call that changes the generator (appendTokens, generateNextToken, rewindTo, close).
+   *
+   * @return A direct FloatBuffer over the logits.
+   * @throws GenAIException If the call to the GenAI native API fails.
+   */
+  public FloatBuffer getLogitsBuffer() throws GenAIException {
+    if (nativeHandle == 0) {
+      throw new IllegalStateException("Instance has been freed and is invalid");
+    }
+
+    ByteBuffer buffer = getLogitsBufferNative(nativeHandle);
+    return buffer.asReadOnlyBuffer().order(ByteOrder.nativeOrder()).asFloatBuffer();
+  }
+
   /**
    * Retrieves the last token in the sequence for the specified sequence index.
    *
@@ -223,6 +287,9 @@ public final class Generator implements AutoCloseable, Iterable<Integer> {
 
   private native void appendTokens(long nativeHandle, int[] tokens) throws GenAIException;
 
+  private native void appendTokensDirect(
+      long nativeHandle, IntBuffer tokens, int offset, int tokenCount) throws GenAIException;
+
   private native void appendTokenSequences(long nativeHandle, long sequencesHandle)
       throws GenAIException;
 
@@ -233,6 +300,11 @@ public final class Generator implements AutoCloseable, Iterable<Integer> {
   private native int[] getSequenceNative(long nativeHandle, long sequenceIndex)
       throws GenAIException;
 
+  private native ByteBuffer getSequenceBufferNative(long nativeHandle, long sequenceIndex)
+      throws GenAIException;
+
+  private native ByteBuffer getLogitsBufferNative(long nativeHandle) throws GenAIException;
+
   private native int getSequenceLastToken(long nativeHandle, long sequenceIndex)
       throws GenAIException;
 
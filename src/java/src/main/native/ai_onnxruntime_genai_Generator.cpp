@@ -48,6 +48,21 @@ Java_ai_onnxruntime_genai_Generator_appendTokens(JNIEnv* env, jobject thiz, jlon
   env->ReleaseIntArrayElements(token_ids, tokens, JNI_ABORT);
 }
 
+JNIEXPORT void JNICALL
+Java_ai_onnxruntime_genai_Generator_appendTokensDirect(JNIEnv* env, jobject thiz, jlong native_handle,
+                                                       jobject token_buffer, jint offset, jint num_tokens) {
+  OgaGenerator* generator = reinterpret_cast<OgaGenerator*>(native_handle);
+
+  // the Java side checked the buffer is direct, so the tokens are read in place without pinning or copying
+  auto* tokens = static_cast<const int32_t*>(env->GetDirectBufferAddress(token_buffer));
+  if (tokens == nullptr) {
+    ThrowException(env, "Token buffer must be a direct buffer.");
+    return;
+  }
+
+  ThrowIfError(env, OgaGenerator_AppendTokens(generator, tokens + offset, static_cast<size_t>(num_tokens)));
+}
+
 JNIEXPORT jboolean JNICALL
 Java_ai_onnxruntime_genai_Generator_isDone(JNIEnv* env, jobject thiz, jlong native_handle) {
   return OgaGenerator_IsDone(reinterpret_cast<OgaGenerator*>(native_handle));
@@ -85,6 +100,35 @@ Java_ai_onnxruntime_genai_Generator_getSequenceNative(JNIEnv* env, jobject thiz,
   return java_int_array;
 }
 
+JNIEXPORT jobject JNICALL
+Java_ai_onnxruntime_genai_Generator_getSequenceBufferNative(JNIEnv* env, jobject thiz, jlong generator, jlong index) {
+  const OgaGenerator* oga_generator = reinterpret_cast<const OgaGenerator*>(generator);
+
+  size_t num_tokens = OgaGenerator_GetSequenceCount(oga_generator, index);
+  const int32_t* tokens = OgaGenerator_GetSequenceData(oga_generator, index);
+
+  if (num_tokens == 0) {
+    ThrowException(env, "OgaGenerator_GetSequenceCount returned 0 tokens.");
+    return nullptr;
+  }
+
+  // wraps the generator owned memory, the Java side makes the buffer read-only
+  return env->NewDirectByteBuffer(const_cast<int32_t*>(tokens), static_cast<jlong>(num_tokens * sizeof(int32_t)));
+}
+
+JNIEXPORT jobject JNICALL
+Java_ai_onnxruntime_genai_Generator_getLogitsBufferNative(JNIEnv* env, jobject thiz, jlong native_handle) {
+  const float* logits = nullptr;
+  size_t num_logits = 0;
+  if (ThrowIfError(env, OgaGenerator_GetLogitsData(reinterpret_cast<OgaGenerator*>(native_handle), &logits,
+                                                   &num_logits))) {
+    return nullptr;
+  }
+
+  // wraps the generator owned memory, the Java side makes the buffer read-only
+  return env->NewDirectByteBuffer(const_cast<float*>(logits), static_cast<jlong>(num_logits * sizeof(float)));
+}
+
 JNIEXPORT jint JNICALL
 Java_ai_onnxruntime_genai_Generator_getSequenceLastToken(JNIEnv* env, jobject thiz, jlong generator, jlong index) {
   const OgaGenerator* oga_generator = reinterpret_cast<const OgaGenerator*>(generator);
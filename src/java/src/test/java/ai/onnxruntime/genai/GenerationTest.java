@@ -7,6 +7,10 @@ package ai.onnxruntime.genai;
 import static org.junit.jupiter.api.Assertions.assertArrayEquals;
 import static org.junit.jupiter.api.Assertions.assertEquals;
 
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.FloatBuffer;
+import java.nio.IntBuffer;
 import java.util.function.Consumer;
 import java.util.logging.Logger;
 import org.junit.jupiter.api.Test;
@@ -151,4 +155,51 @@ public class GenerationTest {
       }
     }
   }
+
+  @Test
+  public void testWithDirectBuffers() throws GenAIException {
+    // same as testWithInputIds, but the tokens and logits go through direct buffers
+    try (Config config = new Config(TestUtils.tinyGpt2ModelPath());
+        Model model = new Model(config);
+        GeneratorParams params = new GeneratorParams(model); ) {
+      int batchSize = 2;
+      int maxLength = 10;
+      int[] inputIDs =
+          new int[] {
+            0, 0, 0, 52,
+            0, 0, 195, 731
+          };
+
+      params.setSearchOption("max_length", maxLength);
+      params.setSearchOption("batch_size", batchSize);
+
+      int[] expectedOutput =
+          new int[] {
+            0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+            0, 0, 195, 731, 731, 114, 114, 114, 114, 114
+          };
+
+      IntBuffer tokens =
+          ByteBuffer.allocateDirect(inputIDs.length * 4).order(ByteOrder.nativeOrder()).asIntBuffer();
+      tokens.put(inputIDs).flip();
+
+      try (Generator generator = new Generator(model, params); ) {
+        generator.appendTokens(tokens);
+        FloatBuffer logits = generator.getLogitsBuffer();
+        assertEquals(0, logits.remaining() % batchSize);
+
+        while (!generator.isDone()) {
+          generator.generateNextToken();
+        }
+
+        for (int i = 0; i < batchSize; i++) {
+          IntBuffer outputIds = generator.getSequenceBuffer(i);
+          assertEquals(maxLength, outputIds.remaining());
+          for (int j = 0; j < maxLength; j++) {
+            assertEquals(outputIds.get(j), expectedOutput[i * maxLength + j]);
+          }
+        }
+      }
+    }
+  }
 }
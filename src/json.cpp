@@ -3,6 +3,7 @@
 
 #include <cmath>
 #include <charconv>
+#include <forward_list>
 #include <sstream>
 
 namespace JSON {
@@ -19,7 +20,7 @@ struct JSON {
   void Parse_Value(Element& element, std::string_view name);
 
   double Parse_Number();
-  std::string Parse_String();
+  std::string_view Parse_String();
 
   bool Skip(char c);  // If *current_ is 'c' skip over it and return true
   template <size_t TCount>
@@ -29,6 +30,10 @@ struct JSON {
   const char* begin_;
   const char* current_{begin_};
   const char* end_;
+
+  // Strings with escapes can't be views of the document, so they're unescaped into here. The nodes never move, so the
+  // views stay valid until the parse is done.
+  std::forward_list<std::string> unescaped_strings_;
 };
 
 void Parse(Element& element, std::string_view document) {
@@ -221,8 +226,15 @@ double JSON::Parse_Number() {
   return value;
 }
 
-std::string JSON::Parse_String() {
-  std::string string;
+// Returns a view of the document, unless the string has escapes
+std::string_view JSON::Parse_String() {
+  const char* begin = current_;
+  while (current_ != end_ && *current_ != '"' && *current_ != '\\')
+    current_++;
+  if (current_ != end_ && *current_ == '"')
+    return {begin, static_cast<size_t>(current_++ - begin)};
+
+  auto& string = unescaped_strings_.emplace_front(begin, current_);
   while (char c = GetChar()) {
     if (c == '"') {
       break;
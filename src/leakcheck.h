@@ -8,13 +8,17 @@
 // On process exit, ValidateShutdown() will call LeakTypeList::Dump() and print out any types that have leaked.
 
 namespace Generators {
+struct BatchTokenizerStream;
+struct Engine;
 struct GeneratorParams;
 struct Generator;
 struct Model;
+struct Request;
 struct Search;
 struct Tensor;
 struct Tokenizer;
 struct TokenizerStream;
+struct WhisperStream;
 
 template <typename... Types>
 struct LeakTypeList {
@@ -23,7 +27,7 @@ struct LeakTypeList {
   static bool Dump();
 };
 
-using LeakTypes = LeakTypeList<GeneratorParams, Generator, Model, Search, Tensor, Tokenizer, TokenizerStream>;
+using LeakTypes = LeakTypeList<BatchTokenizerStream, Engine, GeneratorParams, Generator, Model, Request, Search, Tensor, Tokenizer, TokenizerStream, WhisperStream>;
 
 template <typename T>
 struct LeakChecked {
@@ -55,6 +55,11 @@ void SetLogString(std::string_view name, std::string_view value) {
       gp_stream = gp_logfile.get();
     else
       gp_stream = &std::cerr;
+  } else if (name == "trace_filename") {
+    if (value.empty())
+      Trace::Stop();
+    else
+      Trace::Start(std::string(value));
   } else
     throw JSON::unknown_value_error{};
 }
@@ -15,6 +15,9 @@
  *
  * Logging to a file is special: SetLogString("filename", "path") as "filename" is not a string in LogItems
  *
+ * Tracing is too: SetLogString("trace_filename", "path.json") records a Chrome trace of the generation (see trace.h),
+ * which is written to the file when trace_filename changes, is set to "" or at Shutdown.
+ *
  * COLOR: The functions use ANSI SGR terminal codes for color, the 'struct SGR' below makes it easy to add common
  *        options during log options. Just look in the code for examples of how to use it. Note that the colors
  *        may differ in intensity/saturation on different platforms.
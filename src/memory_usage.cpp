@@ -0,0 +1,21 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "memory_usage.h"
+#include <sstream>
+
+namespace Generators {
+
+std::string MemoryUsage::ToJson(std::initializer_list<std::pair<const char*, size_t>> extra) const {
+  std::ostringstream stream;
+  stream << '{';
+  for (size_t i = 0; i < CategoryCount; i++)
+    stream << '"' << category_names[i] << "_bytes\":" << Get(static_cast<Category>(i)) << ',';
+  stream << "\"total_bytes\":" << GetTotal() << ",\"peak_bytes\":" << GetPeak();
+  for (auto& [name, bytes] : extra)
+    stream << ",\"" << name << "_bytes\":" << bytes;
+  stream << '}';
+  return stream.str();
+}
+
+}  // namespace Generators
@@ -0,0 +1,79 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <utility>
+
+namespace Generators {
+
+// Live bytes of device and host memory held by a model or a generator, by category. A generator's usage has its model's
+// as parent, so the model's counters include every live generator.
+struct MemoryUsage : std::enable_shared_from_this<MemoryUsage> {
+  enum Category {
+    KeyValueCache,  // KeyValueCache tensors, for a paged cache the pool blocks the generator holds
+    Logits,         // Logits outputs and their fp32 and last token copies
+    Buffers,        // Everything allocated through DeviceInterface::Allocate inside a Memory::Scope
+    CategoryCount
+  };
+  static constexpr std::array<const char*, CategoryCount> category_names{"kv_cache", "logits", "buffers"};
+
+  MemoryUsage(std::shared_ptr<MemoryUsage> parent = {}) : parent_{std::move(parent)} {}
+  ~MemoryUsage() {
+    // What is left are the values last given to Set, the buffers are released before their usage
+    for (size_t i = 0; i < CategoryCount; i++)
+      Set(static_cast<Category>(i), 0);
+  }
+  MemoryUsage(const MemoryUsage&) = delete;
+  MemoryUsage& operator=(const MemoryUsage&) = delete;
+
+  void Add(Category category, int64_t bytes) {
+    bytes_[category] += bytes;
+    int64_t total = total_ += bytes;
+    int64_t peak = peak_;
+    while (total > peak && !peak_.compare_exchange_weak(peak, total)) {
+    }
+    if (parent_)
+      parent_->Add(category, bytes);
+  }
+  // For the categories that are measured instead of counted, like the KeyValueCache
+  void Set(Category category, size_t bytes) { Add(category, static_cast<int64_t>(bytes) - set_bytes_[category].exchange(static_cast<int64_t>(bytes))); }
+
+  size_t Get(Category category) const { return static_cast<size_t>(bytes_[category].load()); }
+  size_t GetTotal() const { return static_cast<size_t>(total_.load()); }
+  size_t GetPeak() const { return static_cast<size_t>(peak_.load()); }
+
+  // The categories, total and peak as a JSON object, followed by the 'extra' byte counts
+  std::string ToJson(std::initializer_list<std::pair<const char*, size_t>> extra = {}) const;
+
+ private:
+  std::shared_ptr<MemoryUsage> parent_;
+  std::array<std::atomic<int64_t>, CategoryCount> bytes_{};
+  std::array<std::atomic<int64_t>, CategoryCount> set_bytes_{};  // The value of the last Set, so the next one adds the difference
+  std::atomic<int64_t> total_{}, peak_{};
+};
+
+namespace Memory {
+// The usage the buffers allocated on this thread are charged to, only set during model creation and generator calls
+inline thread_local MemoryUsage* t_usage{};
+
+// Charges the allocations on this thread to 'usage' for its lifetime. Nested scopes of other generators (the draft
+// model of speculative decoding) charge their own usage.
+struct Scope {
+  Scope(MemoryUsage& usage) : previous_usage_{t_usage} { t_usage = &usage; }
+  ~Scope() { t_usage = previous_usage_; }
+
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+
+ private:
+  MemoryUsage* previous_usage_;
+};
+
+}  // namespace Memory
+}  // namespace Generators
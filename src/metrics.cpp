@@ -0,0 +1,50 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "metrics.h"
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+
+namespace Generators {
+
+namespace Metrics {
+namespace {
+std::shared_mutex sink_mutex;
+Sink sink;  // Protected by sink_mutex
+}  // namespace
+
+void SetSink(Sink new_sink) {
+  std::unique_lock lock{sink_mutex};
+  sink = std::move(new_sink);
+  g_has_sink = static_cast<bool>(sink);
+}
+
+void Emit(const char* name, MetricType type, double value) {
+  if (!HasSink())
+    return;
+  std::shared_lock lock{sink_mutex};
+  if (sink)
+    sink(name, type, value);
+}
+}  // namespace Metrics
+
+std::string GeneratorMetrics::ToJson() const {
+  std::ostringstream stream;
+  auto write_phase = [&](const char* name, const Phase& phase) {
+    stream << '"' << name << "\":{\"calls\":" << phase.calls << ",\"tokens\":" << phase.tokens
+           << ",\"total_seconds\":" << phase.total_seconds;
+    for (size_t i = 0; i < StageCount; i++)
+      stream << ",\"" << stage_names[i] << "_seconds\":" << phase.stage_seconds[i];
+    stream << '}';
+  };
+
+  stream << '{';
+  write_phase("prefill", prefill);
+  stream << ',';
+  write_phase("decode", decode);
+  stream << '}';
+  return stream.str();
+}
+
+}  // namespace Generators
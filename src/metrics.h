@@ -0,0 +1,165 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "trace.h"
+
+namespace Generators {
+
+// Where a generator's time goes, split into prefill (AppendTokens) and decode (GenerateNextToken, GetLogits).
+// The stages are exclusive: a copy made while gathering the logits counts as copy, not as logits.
+struct GeneratorMetrics {
+  enum Stage {
+    SessionRun,     // OrtSession::Run of the decoder
+    Logits,         // Logits::Get, gathering the last token and converting to fp32
+    Search,         // Logits processing and token selection
+    KeyValueCache,  // KeyValueCache::Update
+    Copy,           // DeviceSpan copies between host and device memory
+    VisionRun,      // OrtSession::Run of a multimodal model's vision model
+    EmbeddingRun,   // OrtSession::Run of a multimodal model's embedding model
+    StageCount
+  };
+  static constexpr std::array<const char*, StageCount> stage_names{"session_run", "logits", "search", "kv_cache_update", "copy",
+                                                                   "vision_run", "embedding_run"};
+
+  struct Phase {
+    double total_seconds{};                          // Wall time of the generator calls, including time outside of the stages
+    std::array<double, StageCount> stage_seconds{};  // Indexed by Stage
+    uint64_t calls{};                                // Generator calls in this phase
+    uint64_t tokens{};                               // Prefill: tokens appended, decode: tokens generated per sequence
+  };
+
+  Phase prefill, decode;
+
+  std::string ToJson() const;
+};
+
+enum class MetricType { Counter, Gauge, Histogram };  // Matches OgaMetricType
+
+namespace Metrics {
+// The process wide receiver of the runtime's metrics (see OgaSetMetricsSink): counter increments, gauge values and
+// histogram observations, by name. It's called on the threads doing the work, possibly with internal locks held.
+using Sink = std::function<void(const char* name, MetricType type, double value)>;
+void SetSink(Sink sink);  // An empty sink removes it
+
+inline std::atomic<bool> g_has_sink{};
+// Metrics that take work to measure check this first, Emit does nothing without a sink
+inline bool HasSink() { return g_has_sink.load(std::memory_order_relaxed); }
+void Emit(const char* name, MetricType type, double value);
+
+struct Timer;
+// The phase the timers on this thread add to, only set during a generator call so timers elsewhere cost a branch
+inline thread_local GeneratorMetrics::Phase* t_phase{};
+inline thread_local Timer* t_timer{};  // Innermost running timer on this thread
+
+using Clock = Trace::Clock;
+
+// Adds its lifetime minus the time of the timers nested in it to 'stage' of the current thread's phase. While tracing
+// it's also an event, named 'trace_name' (the stage name by default) with the given stream.
+struct Timer {
+  Timer(GeneratorMetrics::Stage stage, const char* trace_name = nullptr, const void* stream = nullptr)
+      : phase_{t_phase}, stage_{stage}, tracing_{Trace::IsRecording()}, trace_name_{trace_name}, stream_{stream} {
+    if (!phase_ && !tracing_)
+      return;
+    if (phase_) {
+      parent_ = t_timer;
+      t_timer = this;
+    }
+    start_ = Clock::now();
+  }
+
+  ~Timer() {
+    if (!phase_ && !tracing_)
+      return;
+    auto end = Clock::now();
+    if (tracing_)
+      Trace::AddEvent(trace_name_ ? trace_name_ : GeneratorMetrics::stage_names[stage_], "stage", start_, end, stream_);
+    if (!phase_)
+      return;
+    double elapsed = std::chrono::duration<double>(end - start_).count();
+    phase_->stage_seconds[stage_] += elapsed - nested_seconds_;
+    if (parent_)
+      parent_->nested_seconds_ += elapsed;
+    t_timer = parent_;
+  }
+
+  Timer(const Timer&) = delete;
+  Timer& operator=(const Timer&) = delete;
+
+ private:
+  GeneratorMetrics::Phase* phase_;
+  GeneratorMetrics::Stage stage_;
+  bool tracing_;
+  const char* trace_name_;
+  const void* stream_;
+  Timer* parent_{};
+  double nested_seconds_{};
+  Clock::time_point start_;
+};
+
+// Directs the timers on this thread to 'phase' of 'metrics' for the duration of a generator call. A generator call
+// made inside another call of the same generator keeps the outer phase, one of another generator (the draft model
+// of speculative decoding) records to its own metrics. The events of the call go to 'profile' too, if given.
+struct Scope {
+  Scope(GeneratorMetrics& metrics, GeneratorMetrics::Phase& phase, Trace::Profile* profile = nullptr)
+      : profile_scope_{profile}, trace_scope_{&phase == &metrics.prefill ? "prefill" : "decode", "generator"} {
+    if (t_phase == &metrics.prefill || t_phase == &metrics.decode)
+      return;
+    phase_ = &phase;
+    previous_phase_ = t_phase;
+    previous_timer_ = t_timer;
+    t_phase = phase_;
+    t_timer = nullptr;
+    phase_->calls++;
+    start_ = Clock::now();
+  }
+
+  ~Scope() {
+    if (!phase_)
+      return;
+    phase_->total_seconds += std::chrono::duration<double>(Clock::now() - start_).count();
+    t_phase = previous_phase_;
+    t_timer = previous_timer_;
+  }
+
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+
+ private:
+  GeneratorMetrics::Phase* phase_{};
+  GeneratorMetrics::Phase* previous_phase_{};
+  Timer* previous_timer_{};
+  Clock::time_point start_;
+  Trace::ProfileScope profile_scope_;  // Before trace_scope_, so the call is in the profile
+  Trace::Scope trace_scope_;
+};
+
+// Directs the timers of a worker thread doing part of a generator call to 'phase', a phase of its own that the call
+// adds to its phase after joining the worker, so the threads don't race on the stage times. Null records nothing.
+struct WorkerScope {
+  WorkerScope(GeneratorMetrics::Phase* phase) : previous_phase_{t_phase}, previous_timer_{t_timer} {
+    t_phase = phase;
+    t_timer = nullptr;
+  }
+  ~WorkerScope() {
+    t_phase = previous_phase_;
+    t_timer = previous_timer_;
+  }
+
+  WorkerScope(const WorkerScope&) = delete;
+  WorkerScope& operator=(const WorkerScope&) = delete;
+
+ private:
+  GeneratorMetrics::Phase* previous_phase_;
+  Timer* previous_timer_;
+};
+
+}  // namespace Metrics
+}  // namespace Generators
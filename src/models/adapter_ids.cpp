@@ -0,0 +1,45 @@
+#include "../generators.h"
+#include "model.h"
+#include "adapter_ids.h"
+
+namespace Generators {
+
+AdapterIds::AdapterIds(State& state)
+    : state_{state} {
+  const auto& name = model_.config_->model.decoder.inputs.adapter_ids;
+  const auto& params = *state_.params_;
+  if (!model_.session_info_->HasInput(name))
+    return;
+
+  if (model_.session_info_->GetInputDataType(name) != Ort::TypeToTensorType<int32_t>)
+    throw std::runtime_error(name + " must be int32");
+
+  // Every beam of a sequence uses the sequence's adapter, without SetBatchAdapters the whole batch uses the base model
+  const int num_beams = params.search.num_beams;
+  const std::array<int64_t, 1> shape{params.BatchBeamSize()};
+  adapter_ids_ = OrtValue::CreateTensor<int32_t>(model_.p_device_inputs_->GetAllocator(), shape);
+  auto adapter_ids = WrapTensor<int32_t>(*model_.p_device_inputs_, *adapter_ids_);
+  auto adapter_ids_cpu = adapter_ids.CpuSpan();
+  for (size_t i = 0; i < adapter_ids_cpu.size(); i++)
+    adapter_ids_cpu[i] = params.batch_adapter_ids.empty() ? 0 : params.batch_adapter_ids[i / num_beams];
+  adapter_ids.CopyCpuToDevice();
+}
+
+void AdapterIds::Add() {
+  if (!adapter_ids_)
+    return;
+
+  input_index_ = state_.inputs_.size();
+  state_.inputs_.push_back(adapter_ids_.get());
+  state_.input_names_.push_back(model_.config_->model.decoder.inputs.adapter_ids.c_str());
+}
+
+void AdapterIds::CompactBatch(std::span<const int32_t> rows) {
+  if (!adapter_ids_)
+    return;
+
+  adapter_ids_ = GatherRows(*adapter_ids_, rows, *model_.p_device_inputs_);
+  state_.inputs_[input_index_] = adapter_ids_.get();
+}
+
+}  // namespace Generators
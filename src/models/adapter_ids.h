@@ -0,0 +1,23 @@
+#pragma once
+
+namespace Generators {
+
+// Optional adapter_ids input of multi-LoRA models, which stack the LoRA weights of several adapters (see
+// model.decoder.adapter_names). Entry i of shape [batch_size * num_beams] is the adapter of sequence i, where 0 is the
+// base model and n is adapter_names[n - 1], so sequences for different adapters share a batch (see SetBatchAdapters).
+struct AdapterIds {
+  AdapterIds(State& state);
+
+  void Add();
+  // Keeps only the given rows of the batch (see State::CompactBatch)
+  void CompactBatch(std::span<const int32_t> rows);
+
+ private:
+  State& state_;
+  const Model& model_{state_.model_};
+
+  std::unique_ptr<OrtValue> adapter_ids_;
+  size_t input_index_{~0U};
+};
+
+}  // namespace Generators
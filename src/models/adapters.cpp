@@ -7,67 +7,171 @@
 namespace Generators {
 
 Adapter::Adapter(const char* adapter_file_path, Ort::Allocator* allocator)
-    : adapter_{OrtLoraAdapter::Create(fs::path(adapter_file_path).c_str(), *allocator)} {}
+    : path_{adapter_file_path}, allocator_{allocator} {
+  auto file = path_.open(std::ios::binary | std::ios::ate);
+  if (!file.is_open())
+    throw std::runtime_error("Adapter file not found: " + path_.string());
+  size_ = static_cast<size_t>(file.tellg());
+}
 
-const OrtLoraAdapter* Adapter::AcquireRef() {
-  ref_count_++;
+void Adapter::StartLoad() {
+  if (IsResident())
+    return;
 
-  return adapter_.get();
+  load_ = std::async(std::launch::async, [path = path_, allocator = allocator_]() {
+            return std::shared_ptr<OrtLoraAdapter>{OrtLoraAdapter::Create(path.c_str(), *allocator)};
+          }).share();
 }
 
-void Adapter::ReleaseRef() {
-  ref_count_--;
-  if (ref_count_ < 0) {
-    throw std::runtime_error("Adapter ref count went negative.");
-  }
+bool Adapter::IsLoading() const {
+  return IsResident() && load_.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
 }
 
-int32_t Adapter::RefCount() const {
-  return ref_count_;
+void Adapter::Evict() {
+  load_ = {};
 }
 
 Adapters::Adapters(const Model* model) : model_{model} {}
 
+Adapter& Adapters::GetAdapter(const std::string& adapter_name) {
+  auto adapter = adapters_.find(adapter_name);
+  if (adapter == adapters_.end()) {
+    throw std::runtime_error("Adapter not found: " + std::string{adapter_name});
+  }
+  return *adapter->second;
+}
+
+const Adapter& Adapters::GetAdapter(const std::string& adapter_name) const {
+  return const_cast<Adapters*>(this)->GetAdapter(adapter_name);
+}
+
 void Adapters::LoadAdapter(const char* adapter_file_path, const std::string& adapter_name) {
+  std::lock_guard lock{mutex_};
   if (adapters_.find(adapter_name) != adapters_.end()) {
     throw std::runtime_error("Adapter already loaded: " + std::string{adapter_name});
   }
 
-  adapters_.emplace(adapter_name, std::make_unique<Adapter>(adapter_file_path,
-                                                            model_->p_device_->GetType() == DeviceType::CUDA
-                                                                ? &model_->p_device_->GetAllocator()
-                                                                : nullptr));
+  auto& adapter = *adapters_.emplace(adapter_name, std::make_unique<Adapter>(adapter_file_path,
+                                                                             model_->p_device_->GetType() == DeviceType::CUDA
+                                                                                 ? &model_->p_device_->GetAllocator()
+                                                                                 : nullptr))
+                       .first->second;
+  adapter.last_used_ = ++clock_;
+  if (memory_limit_ == 0 || memory_usage_ + adapter.GetSize() <= memory_limit_)
+    MakeResident(adapter);
 }
 
 void Adapters::UnloadAdapter(const std::string& adapter_name) {
-  auto adapter = adapters_.find(adapter_name);
-  if (adapter == adapters_.end()) {
-    throw std::runtime_error("Adapter not found: " + std::string{adapter_name});
+  std::unique_ptr<Adapter> unloaded;  // Destroyed outside of the lock, as it waits for a pending load
+  {
+    std::lock_guard lock{mutex_};
+    auto adapter = adapters_.find(adapter_name);
+    if (adapter == adapters_.end()) {
+      throw std::runtime_error("Adapter not found: " + std::string{adapter_name});
+    }
+
+    if (adapter->second->ref_count_ > 0) {
+      throw std::runtime_error("Adapter still in use: " + std::string{adapter_name});
+    }
+
+    if (adapter->second->IsResident())
+      memory_usage_ -= adapter->second->GetSize();
+    unloaded = std::move(adapter->second);
+    adapters_.erase(adapter);
   }
+}
 
-  if (adapter->second->RefCount() > 0) {
-    throw std::runtime_error("Adapter still in use: " + std::string{adapter_name});
-  }
+void Adapters::PrefetchAdapter(const std::string& adapter_name) {
+  std::lock_guard lock{mutex_};
+  auto& adapter = GetAdapter(adapter_name);
+  adapter.last_used_ = ++clock_;
+  adapter.pinned_ = true;
+  MakeResident(adapter);
+}
 
-  adapters_.erase(adapter);
+bool Adapters::IsAdapterReady(const std::string& adapter_name) const {
+  std::lock_guard lock{mutex_};
+  auto& adapter = GetAdapter(adapter_name);
+  return adapter.IsResident() && !adapter.IsLoading();
 }
 
-const OrtLoraAdapter* Adapters::AcquireAdapter(const std::string& adapter_name) {
-  auto adapter = adapters_.find(adapter_name);
-  if (adapter == adapters_.end()) {
-    throw std::runtime_error("Adapter not found: " + std::string{adapter_name});
+void Adapters::SetMemoryLimit(size_t bytes) {
+  std::lock_guard lock{mutex_};
+  memory_limit_ = bytes;
+  EvictUnused(0);
+}
+
+size_t Adapters::GetMemoryUsage() const {
+  std::lock_guard lock{mutex_};
+  return memory_usage_;
+}
+
+void Adapters::MakeResident(Adapter& adapter) {
+  if (adapter.IsResident())
+    return;
+
+  EvictUnused(adapter.GetSize(), &adapter);
+  adapter.StartLoad();
+  memory_usage_ += adapter.GetSize();
+}
+
+// Evicts the least recently used adapters that nobody holds until 'needed_bytes' more fit in the memory limit.
+// Adapters that are still loading aren't evicted, dropping their load would wait for it.
+void Adapters::EvictUnused(size_t needed_bytes, const Adapter* keep) {
+  while (memory_limit_ != 0 && memory_usage_ + needed_bytes > memory_limit_) {
+    Adapter* oldest{};
+    for (auto& [name, adapter] : adapters_) {
+      if (adapter.get() == keep || adapter->ref_count_ > 0 || adapter->pinned_ || !adapter->IsResident() || adapter->IsLoading())
+        continue;
+      if (!oldest || adapter->last_used_ < oldest->last_used_)
+        oldest = adapter.get();
+    }
+    if (!oldest)
+      return;
+
+    oldest->Evict();
+    memory_usage_ -= oldest->GetSize();
   }
+}
 
-  return adapter->second->AcquireRef();
+const OrtLoraAdapter* Adapters::AcquireAdapter(const std::string& adapter_name) {
+  std::shared_future<std::shared_ptr<OrtLoraAdapter>> load;
+  Adapter* adapter;
+  bool resident;
+  {
+    std::lock_guard lock{mutex_};
+    adapter = &GetAdapter(adapter_name);
+    adapter->ref_count_++;  // Keeps both the adapter and its load from being unloaded or evicted
+    adapter->pinned_ = false;
+    adapter->last_used_ = ++clock_;
+    resident = adapter->IsResident();
+    MakeResident(*adapter);
+    load = adapter->GetLoad();
+  }
+  Metrics::Emit(resident ? "oga_adapter_cache_hits_total" : "oga_adapter_cache_misses_total", MetricType::Counter, 1);
+
+  // Wait outside of the lock, so other generators can use the adapters that are ready
+  try {
+    return load.get().get();
+  } catch (...) {
+    std::lock_guard lock{mutex_};
+    adapter->ref_count_--;
+    if (adapter->IsResident()) {  // Drop the failed load so the next use retries it
+      adapter->Evict();
+      memory_usage_ -= adapter->GetSize();
+    }
+    throw;
+  }
 }
 
 void Adapters::ReleaseAdapter(const std::string& adapter_name) {
-  auto adapter = adapters_.find(adapter_name);
-  if (adapter == adapters_.end()) {
-    throw std::runtime_error("Adapter not found: " + std::string{adapter_name});
+  std::lock_guard lock{mutex_};
+  auto& adapter = GetAdapter(adapter_name);
+  if (--adapter.ref_count_ < 0) {
+    throw std::runtime_error("Adapter ref count went negative.");
   }
 
-  adapter->second->ReleaseRef();
+  EvictUnused(0);
 }
 
 }  // namespace Generators
@@ -2,8 +2,13 @@
 // Licensed under the MIT License.
 #pragma once
 
+#include <future>
+#include <mutex>
+
 namespace Generators {
 
+// An adapter file that is only resident in (device) memory while it is loading, in use, or cached by Adapters.
+// The adapter is loaded on a background thread, ORT memory maps the file so only the weights are copied to the device.
 struct Adapter {
   Adapter() = delete;
   Adapter(const Adapter&) = delete;
@@ -11,17 +16,31 @@ struct Adapter {
 
   Adapter(const char* adapter_file_path, Ort::Allocator* allocator);
 
-  const OrtLoraAdapter* AcquireRef();
+  // Starts loading the adapter in the background if it isn't resident
+  void StartLoad();
+  // Releases the loaded adapter, it is loaded again on the next StartLoad
+  void Evict();
 
-  void ReleaseRef();
+  bool IsResident() const { return load_.valid(); }
+  bool IsLoading() const;
+  size_t GetSize() const { return size_; }  // The file size, used as an estimate of the adapter's memory usage
 
-  int32_t RefCount() const;
+  std::shared_future<std::shared_ptr<OrtLoraAdapter>> GetLoad() const { return load_; }
 
- private:
   int32_t ref_count_{};
-  std::unique_ptr<OrtLoraAdapter> adapter_;
+  bool pinned_{};         // Prefetched and not yet acquired, so it isn't evicted before the request that wants it runs
+  uint64_t last_used_{};  // Orders the adapters by last use, for eviction
+
+ private:
+  fs::path path_;
+  Ort::Allocator* allocator_;
+  size_t size_{};
+  std::shared_future<std::shared_ptr<OrtLoraAdapter>> load_;
 };
 
+// The adapters of a model. An adapter is loaded when it is first used (or prefetched) and stays resident after its
+// last user releases it, until the memory limit is reached: then the least recently used unreferenced adapters are
+// evicted, so many more adapters can be registered than fit in device memory.
 struct Adapters : std::enable_shared_from_this<Adapters> {
   Adapters() = delete;
   Adapters(const Adapters&) = delete;
@@ -29,10 +48,25 @@ struct Adapters : std::enable_shared_from_this<Adapters> {
 
   Adapters(const Model* model);
 
+  // Registers the adapter and, if it fits in the memory limit, starts loading it in the background
   void LoadAdapter(const char* adapter_file_path, const std::string& adapter_name);
 
   void UnloadAdapter(const std::string& adapter_name);
 
+  // Starts loading the adapter in the background, evicting unused adapters to make room for it. The adapter is pinned
+  // (not evicted) until it is next acquired, so a request can prefetch its adapter while it waits to be scheduled.
+  void PrefetchAdapter(const std::string& adapter_name);
+
+  // True if the adapter is resident and done loading, so acquiring it won't wait
+  bool IsAdapterReady(const std::string& adapter_name) const;
+
+  // Limits the memory of the resident adapters in bytes, 0 (the default) is unlimited. The limit is only exceeded
+  // while all the resident adapters are in use.
+  void SetMemoryLimit(size_t bytes);
+
+  size_t GetMemoryUsage() const;
+
+  // Waits for the adapter to be loaded, loading it if it isn't resident. The adapter can't be evicted until released.
   const OrtLoraAdapter* AcquireAdapter(const std::string& adapter_name);
 
   void ReleaseAdapter(const std::string& adapter_name);
@@ -40,8 +74,18 @@ struct Adapters : std::enable_shared_from_this<Adapters> {
   std::shared_ptr<Adapters> external_owner_;
 
  private:
+  Adapter& GetAdapter(const std::string& adapter_name);                  // Requires mutex_
+  const Adapter& GetAdapter(const std::string& adapter_name) const;      // Requires mutex_
+  void MakeResident(Adapter& adapter);                                     // Requires mutex_
+  void EvictUnused(size_t needed_bytes, const Adapter* keep = nullptr);  // Requires mutex_
+
   const Model* model_;
-  std::unordered_map<std::string, std::unique_ptr<Adapter>> adapters_;
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, std::unique_ptr<Adapter>> adapters_;  // Protected by mutex_
+  size_t memory_limit_{};                                                // Protected by mutex_
+  size_t memory_usage_{};                                                // Of the resident adapters, protected by mutex_
+  uint64_t clock_{};                                                     // Protected by mutex_
 };
 
 }  // namespace Generators
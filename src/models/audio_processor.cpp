@@ -6,48 +6,19 @@
 
 namespace Generators {
 
-namespace {
-
-std::unique_ptr<OrtValue> ProcessMel(ort_extensions::OrtxObjectPtr<OrtxTensor>& mel,
-                                     ONNXTensorElementDataType expected_type, Ort::Allocator& allocator) {
-  if (!(expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT || expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16)) {
-    throw std::runtime_error("Expected input_features to be of type float or float16. Actual: " + std::to_string(expected_type));
-  }
-
-  const float* mel_data{};
-  const int64_t* shape{};
-  size_t num_dims;
-  CheckResult(OrtxGetTensorData(mel.get(), reinterpret_cast<const void**>(&mel_data), &shape, &num_dims));
-  std::span<const int64_t> shape_span(shape, num_dims);
-  auto input_features_value = expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT
-                                  ? OrtValue::CreateTensor<float>(allocator, shape_span)
-                                  : OrtValue::CreateTensor<Ort::Float16_t>(allocator, shape_span);
-  if (expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT) {
-    std::copy(mel_data, mel_data + input_features_value->GetTensorTypeAndShapeInfo()->GetElementCount(),
-              input_features_value->GetTensorMutableData<float>());
-  } else {
-    auto input_features_fp32 = OrtValue::CreateTensor<float>(
-        allocator.GetInfo(),
-        std::span<float>(const_cast<float*>(mel_data), input_features_value->GetTensorTypeAndShapeInfo()->GetElementCount()),
-        shape_span);
-    Cast(*input_features_fp32, input_features_value, *GetDeviceInterface(DeviceType::CPU), Ort::TypeToTensorType<Ort::Float16_t>);
-  }
-
-  return input_features_value;
-}
-
-}  // namespace
-
 std::unique_ptr<Audios> LoadAudios(const std::span<const char* const>& audio_paths) {
   for (const char* audio_path : audio_paths) {
     if (!fs::path(audio_path).exists()) {
       throw std::runtime_error("Audio path does not exist: " + std::string(audio_path));
     }
   }
-  ort_extensions::OrtxObjectPtr<OrtxRawAudios> audios;
-  CheckResult(OrtxLoadAudios(audios.ToBeAssigned(), audio_paths.data(), audio_paths.size()));
 
-  return std::make_unique<Audios>(std::move(audios), audio_paths.size());
+  std::vector<ort_extensions::OrtxObjectPtr<OrtxRawAudios>> audios(audio_paths.size());
+  GetThreadPool().ParallelFor(audio_paths.size(), [&](size_t i) {
+    CheckResult(OrtxLoadAudios(audios[i].ToBeAssigned(), &audio_paths[i], 1));
+  });
+
+  return std::make_unique<Audios>(std::move(audios));
 }
 
 AudioProcessor::AudioProcessor(Config& config, const SessionInfo& session_info)
@@ -60,22 +31,53 @@ AudioProcessor::AudioProcessor(Config& config, const SessionInfo& session_info)
 }
 
 std::unique_ptr<NamedTensors> AudioProcessor::Process(const Audios* audios) const {
-  if (!audios || !audios->audios_) {
+  if (!audios || audios->audios_.empty()) {
     throw std::runtime_error("No audios provided to process.");
   }
+  if (!(input_features_type_ == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT || input_features_type_ == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16)) {
+    throw std::runtime_error("Expected input_features to be of type float or float16. Actual: " + std::to_string(input_features_type_));
+  }
 
-  Ort::Allocator& allocator{Ort::Allocator::GetWithDefaultOptions()};
-  auto named_tensors = std::make_unique<NamedTensors>();
-
-  ort_extensions::OrtxObjectPtr<OrtxTensorResult> result;
-  CheckResult(OrtxSpeechLogMel(processor_.get(), audios->audios_.get(), result.ToBeAssigned()));
-
-  ort_extensions::OrtxObjectPtr<OrtxTensor> mel;
-  CheckResult(OrtxTensorResultGetAt(result.get(), 0, mel.ToBeAssigned()));
+  // Decoding, resampling and the log-mel spectrogram of every audio are independent
+  const size_t audio_count = audios->audios_.size();
+  std::vector<ort_extensions::OrtxObjectPtr<OrtxTensorResult>> results(audio_count);
+  std::vector<ort_extensions::OrtxObjectPtr<OrtxTensor>> mels(audio_count);
+  std::vector<const float*> mel_data(audio_count);
+  std::vector<std::vector<int64_t>> mel_shapes(audio_count);
+  GetThreadPool().ParallelFor(audio_count, [&](size_t i) {
+    CheckResult(OrtxSpeechLogMel(processor_.get(), audios->audios_[i].get(), results[i].ToBeAssigned()));
+    CheckResult(OrtxTensorResultGetAt(results[i].get(), 0, mels[i].ToBeAssigned()));
+
+    const int64_t* shape{};
+    size_t num_dims;
+    CheckResult(OrtxGetTensorData(mels[i].get(), reinterpret_cast<const void**>(&mel_data[i]), &shape, &num_dims));
+    mel_shapes[i].assign(shape, shape + num_dims);
+  });
+
+  // Each audio's features are [1, number_of_mels, number_of_frames], the batch stacks them
+  const auto& shape = mel_shapes[0];
+  if (shape.size() != 3 || shape[0] != 1)
+    throw std::runtime_error("Expected the log-mel features of an audio to have shape [1, number_of_mels, number_of_frames]");
+  for (auto& mel_shape : mel_shapes) {
+    if (mel_shape != shape)
+      throw std::runtime_error("The log-mel features of all audios must have the same shape");
+  }
 
-  named_tensors->emplace(std::string(Config::Defaults::InputFeaturesName),
-                         std::make_shared<Tensor>(ProcessMel(mel, input_features_type_, allocator)));
+  const auto batch_shape = std::array<int64_t, 3>{static_cast<int64_t>(audio_count), shape[1], shape[2]};
+  auto input_features = OrtValue::CreateTensor(Ort::Allocator::GetWithDefaultOptions(), batch_shape, input_features_type_);
+  const size_t audio_element_count = static_cast<size_t>(shape[1] * shape[2]);
+  GetThreadPool().ParallelFor(audio_count, [&](size_t i) {
+    const float* source = mel_data[i];
+    if (input_features_type_ == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT) {
+      std::copy(source, source + audio_element_count, input_features->GetTensorMutableData<float>() + i * audio_element_count);
+    } else {
+      auto* fp16 = input_features->GetTensorMutableData<uint16_t>() + i * audio_element_count;
+      ConvertFloat32ToFloat16({source, audio_element_count}, {fp16, audio_element_count});
+    }
+  });
 
+  auto named_tensors = std::make_unique<NamedTensors>();
+  named_tensors->emplace(std::string(Config::Defaults::InputFeaturesName), std::make_shared<Tensor>(std::move(input_features)));
   return named_tensors;
 }
 
@@ -7,15 +7,16 @@
 
 namespace Generators {
 
+// Every audio is a separate OrtxRawAudios so that they can be decoded and processed in parallel
 struct Audios {
-  Audios(ort_extensions::OrtxObjectPtr<OrtxRawAudios> audios, size_t num_audios)
-      : audios_(std::move(audios)), num_audios_{num_audios} {}
+  Audios(std::vector<ort_extensions::OrtxObjectPtr<OrtxRawAudios>> audios)
+      : audios_(std::move(audios)), num_audios_{audios_.size()} {}
 
   Audios() = delete;
   Audios(const Audios&) = delete;
   Audios& operator=(const Audios&) = delete;
 
-  ort_extensions::OrtxObjectPtr<OrtxRawAudios> audios_;
+  std::vector<ort_extensions::OrtxObjectPtr<OrtxRawAudios>> audios_;
   size_t num_audios_{};
 };
 
@@ -28,6 +29,7 @@ struct AudioProcessor {
   AudioProcessor(const AudioProcessor&) = delete;
   AudioProcessor& operator=(const AudioProcessor&) = delete;
 
+  // Computes the log-mel features of each audio on the thread pool, written straight into one batch tensor
   std::unique_ptr<NamedTensors> Process(const Audios* audios) const;
 
  private:
@@ -0,0 +1,102 @@
+#include "../generators.h"
+#include "model.h"
+#include "cache_indirection.h"
+
+namespace Generators {
+
+CacheIndirection::CacheIndirection(State& state)
+    : state_{state},
+      shape_{state_.params_->search.batch_size, state_.params_->search.num_beams, state_.params_->search.max_length} {
+  const auto& inputs = model_.config_->model.decoder.inputs;
+  if (!model_.session_info_->HasInput(inputs.cache_indirection))
+    return;
+
+  if (model_.session_info_->GetInputDataType(inputs.cache_indirection) != Ort::TypeToTensorType<int32_t>)
+    throw std::runtime_error(inputs.cache_indirection + " must be int32");
+  if (!state_.params_->search.past_present_share_buffer)
+    throw std::runtime_error(inputs.cache_indirection + " requires the past_present_share_buffer search option");
+
+  if (auto* captured_graph_info = state_.GetCapturedGraphInfo(); captured_graph_info && captured_graph_info->sb_cache_indirection_) {
+    cache_indirection_ = captured_graph_info->sb_cache_indirection_->CreateTensorOnStaticBuffer(shape_, Ort::TypeToTensorType<int32_t>);
+    fixed_address_ = true;
+  } else {
+    cache_indirection_ = OrtValue::CreateTensor<int32_t>(model_.p_device_kvcache_->GetAllocator(), shape_);
+  }
+  cache_indirection_next_ = OrtValue::CreateTensor<int32_t>(model_.p_device_kvcache_->GetAllocator(), shape_);
+  // The prompt is the same for every beam, so all of its positions come from beam 0
+  ByteWrapTensor(*model_.p_device_kvcache_, *cache_indirection_).Zero();
+
+  // current_sequence_length and past_sequence_length together are handled by DefaultInputIDs
+  if (model_.session_info_->HasInput(inputs.past_sequence_length) && !model_.session_info_->HasInput(inputs.current_sequence_length)) {
+    if (model_.session_info_->GetInputDataType(inputs.past_sequence_length) != Ort::TypeToTensorType<int32_t>)
+      throw std::runtime_error(inputs.past_sequence_length + " must be int32");
+    past_sequence_length_ = OrtValue::CreateTensor<int32_t>(model_.allocator_cpu_, std::array<int64_t, 1>{1});
+  }
+}
+
+void CacheIndirection::Add() {
+  if (!cache_indirection_)
+    return;
+
+  input_index_ = state_.inputs_.size();
+  state_.inputs_.push_back(cache_indirection_.get());
+  state_.input_names_.push_back(model_.config_->model.decoder.inputs.cache_indirection.c_str());
+
+  if (past_sequence_length_) {
+    state_.inputs_.push_back(past_sequence_length_.get());
+    state_.input_names_.push_back(model_.config_->model.decoder.inputs.past_sequence_length.c_str());
+  }
+}
+
+void CacheIndirection::Update(DeviceSpan<int32_t> beam_indices, int total_length, int new_length) {
+  if (!cache_indirection_)
+    return;
+
+  if (past_sequence_length_)
+    *past_sequence_length_->GetTensorMutableData<int32_t>() = total_length - new_length;
+
+  // The first run processes the prompt, there are no beams to follow yet
+  if (is_first_update_ || beam_indices.empty()) {
+    is_first_update_ = false;
+    return;
+  }
+
+  const int batch_size = static_cast<int>(shape_[0]);
+  const int num_beams = static_cast<int>(shape_[1]);
+  const int max_length = static_cast<int>(shape_[2]);
+
+  auto& device = *model_.p_device_kvcache_;
+  if (device.GetType() == DeviceType::CUDA) {
+    device.UpdateCacheIndirectionKernelLauncher(cache_indirection_next_->GetTensorMutableData<int32_t>(),
+                                                cache_indirection_->GetTensorData<int32_t>(),
+                                                beam_indices.Span().data(),
+                                                batch_size, num_beams, 0, max_length, total_length);
+  } else {
+    // Same as the CUDA UpdateCacheIndirectionKernel: the new token of every beam is in its own cache slot, the earlier
+    // positions come from wherever the beam it continues read them
+    auto source = WrapTensor<int32_t>(device, *cache_indirection_).CopyDeviceToCpu();
+    auto target_device = WrapTensor<int32_t>(device, *cache_indirection_next_);
+    auto target = target_device.CpuSpan();
+    auto beam_indices_cpu = beam_indices.CopyDeviceToCpu();
+    for (int b = 0; b < batch_size; b++) {
+      for (int beam = 0; beam < num_beams; beam++) {
+        const int source_beam = beam_indices_cpu[b * num_beams + beam] % num_beams;
+        auto target_row = target.subspan((static_cast<size_t>(b) * num_beams + beam) * max_length, total_length);
+        auto source_row = source.subspan((static_cast<size_t>(b) * num_beams + source_beam) * max_length, total_length);
+        std::copy(source_row.begin(), source_row.end() - 1, target_row.begin());
+        target_row.back() = beam;
+      }
+    }
+    target_device.CopyCpuToDevice();
+  }
+
+  if (fixed_address_) {
+    ByteWrapTensor(device, *cache_indirection_).CopyFrom(ByteWrapTensor(device, *cache_indirection_next_));
+    return;
+  }
+
+  std::swap(cache_indirection_, cache_indirection_next_);
+  state_.inputs_[input_index_] = cache_indirection_.get();
+}
+
+}  // namespace Generators
@@ -0,0 +1,32 @@
+#pragma once
+
+namespace Generators {
+
+// Optional cache_indirection input of decoder-only models whose attention op reads the key-value cache through a
+// per beam table of shape [batch_size, num_beams, max_length]. Entry t of a beam is the beam whose cache slot holds
+// position t, so beam search only updates this table instead of reordering every layer's cache (see PickPastState).
+// The op also needs the past length, which is provided as the past_sequence_length input of shape [1].
+// With a captured graph the input lives in the graph's static buffer, so the update is copied back into it instead of
+// swapping the double buffers, and the graph keeps reading the same address.
+struct CacheIndirection {
+  CacheIndirection(State& state);
+
+  bool IsEnabled() const { return cache_indirection_ != nullptr; }
+
+  void Add();
+  void Update(DeviceSpan<int32_t> beam_indices, int total_length, int new_length);
+
+ private:
+  State& state_;
+  const Model& model_{state_.model_};
+
+  std::array<int64_t, 3> shape_;  // {batch_size, num_beams, max_length}
+  std::unique_ptr<OrtValue> cache_indirection_;
+  std::unique_ptr<OrtValue> cache_indirection_next_;  // Double buffered, the update reads the current table
+  std::unique_ptr<OrtValue> past_sequence_length_;
+  size_t input_index_{~0U};
+  bool is_first_update_{true};
+  bool fixed_address_{};  // cache_indirection_ is on the captured graph's static buffer
+};
+
+}  // namespace Generators
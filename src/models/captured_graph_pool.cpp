@@ -19,15 +19,28 @@ void CapturedGraphInfoRecycler::operator()(CapturedGraphInfo* captured_graph_inf
 }
 
 CapturedGraphInfoPtr CapturedGraphPool::ReserveCapturedGraph(const Model& model, const GeneratorParams& params) const {
-  if (!params.use_cuda_graph || (model.p_device_->GetType() != DeviceType::CUDA)) {
+  if (!params.use_cuda_graph || (model.p_device_->GetType() != DeviceType::CUDA && model.p_device_->GetType() != DeviceType::DML)) {
     return nullptr;
   }
 
   // Multiple generators can reserve graphs in parallel, so we need to make it thread saf
   std::unique_lock lock(captured_graph_mutex_);
 
-  auto key = std::make_unique<CapturedGraphKey>(params.max_batch_size, params.search.max_length, params.search.num_beams, params.extra_inputs);
+  // A graph info holds the graphs of every batch size up to its max_batch_size. With graph_capture_batch_buckets, the
+  // generators of a power of two bucket of max_batch_size share graph infos, and the decoder-only models run their batch
+  // padded to the bucket's size (see DecoderOnly_State::ReserveCapturedGraph). So a pool of a few buckets, with one
+  // captured graph each, serves any batch size.
+  int max_batch_size = params.max_batch_size;
+  if (params.search.graph_capture_batch_buckets) {
+    int bucket = 1;
+    while (bucket < max_batch_size)
+      bucket *= 2;
+    max_batch_size = bucket;
+  }
+
+  auto key = std::make_unique<CapturedGraphKey>(max_batch_size, params.search.max_length, params.search.num_beams, params.extra_inputs);
   auto& captured_graphs = captured_graphs_map_[*key];
+  Metrics::Emit(captured_graphs.empty() ? "oga_captured_graph_misses_total" : "oga_captured_graph_hits_total", MetricType::Counter, 1);
 
   // If no graphs are available, create a graph with a new ID
   if (captured_graphs.empty()) {
@@ -39,13 +52,14 @@ CapturedGraphInfoPtr CapturedGraphPool::ReserveCapturedGraph(const Model& model,
     // We can unlock the mutex here since we don't access state that is subject to changes after this point
     lock.unlock();
 
-    new_captured_graph->max_batch_size_ = params.max_batch_size;
+    new_captured_graph->max_batch_size_ = max_batch_size;
     new_captured_graph->max_length_ = params.search.max_length;
     new_captured_graph->num_beams_ = params.search.num_beams;
     new_captured_graph->pool_ = shared_from_this();
+    new_captured_graph->allocator_device_ = allocator_device_;
 
     // Create the static buffer for the input ids
-    size_t max_beam_batch_size = static_cast<size_t>(params.search.num_beams) * params.max_batch_size;
+    size_t max_beam_batch_size = static_cast<size_t>(params.search.num_beams) * max_batch_size;
     new_captured_graph->sb_input_ids_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
 
     // Create the static buffers for the cache
@@ -58,12 +72,12 @@ CapturedGraphInfoPtr CapturedGraphPool::ReserveCapturedGraph(const Model& model,
 
     // Create the static buffer for the position ids, if needed
     if (session_info_->HasInput(config_->model.decoder.inputs.position_ids)) {
-      new_captured_graph->sb_position_ids_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
+      new_captured_graph->sb_position_ids_ = std::make_unique<StaticBuffer>(allocator_inputs_, max_beam_batch_size);
     }
 
     // Create the static buffer for the attention mask, if needed
     if (session_info_->HasInput(config_->model.decoder.inputs.attention_mask)) {
-      new_captured_graph->sb_attention_mask_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
+      new_captured_graph->sb_attention_mask_ = std::make_unique<StaticBuffer>(allocator_inputs_, max_beam_batch_size);
     }
 
     auto output_type = session_info_->GetOutputDataType(config_->model.decoder.outputs.logits);
@@ -72,7 +86,7 @@ CapturedGraphInfoPtr CapturedGraphPool::ReserveCapturedGraph(const Model& model,
       new_captured_graph->sb_logits32_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
     }
 
-    if (output_type == Ort::TypeToTensorType<Ort::Float16_t>) {
+    if (output_type == Ort::TypeToTensorType<Ort::Float16_t> || output_type == Ort::TypeToTensorType<Ort::BFloat16_t>) {
       new_captured_graph->sb_logits16_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
     }
 
@@ -87,6 +101,12 @@ CapturedGraphInfoPtr CapturedGraphPool::ReserveCapturedGraph(const Model& model,
       new_captured_graph->sb_embeddings_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
     }
 
+    // Create the static buffer for the cache indirection of a beam search, its first dimension is the batch size
+    if (params.search.num_beams > 1 && session_info_->HasInput(config_->model.decoder.inputs.cache_indirection)) {
+      new_captured_graph->sb_cache_indirection_ = std::make_unique<StaticBuffer>(allocator_device_, max_batch_size);
+    }
+
+    new_captured_graph->max_beam_batch_size_ = max_beam_batch_size;
     new_captured_graph->key_ = std::move(key);
 
     return new_captured_graph;
@@ -102,4 +122,36 @@ void CapturedGraphPool::AddCapturedGraph(CapturedGraphInfoPtr&& captured_graph)
   std::unique_lock lock(captured_graph_mutex_);
   captured_graphs_map_[*captured_graph->key_].push_back(std::move(captured_graph));
 }
+
+size_t CapturedGraphPool::GetMemoryUsage() const {
+  std::unique_lock lock(captured_graph_mutex_);
+  size_t bytes = 0;
+  for (auto& [key, captured_graphs] : captured_graphs_map_) {
+    for (auto& captured_graph : captured_graphs)
+      bytes += captured_graph->GetMemoryUsage();
+  }
+  return bytes;
+}
+
+size_t CapturedGraphInfo::GetMemoryUsage() const {
+  size_t bytes = 0;
+  auto add = [&bytes](const std::unique_ptr<Generators::StaticBuffer>& buffer) {
+    if (buffer)
+      bytes += buffer->GetBytes();
+  };
+  add(sb_input_ids_);
+  for (auto& buffer : sb_kv_caches_)
+    add(buffer);
+  add(sb_logits16_);
+  add(sb_logits32_);
+  add(sb_position_ids_);
+  add(sb_attention_mask_);
+  for (auto& [name, buffer] : sb_extra_inputs_)
+    add(buffer);
+  add(sb_embeddings_);
+  add(sb_cache_indirection_);
+  for (auto& [name, buffer] : sb_staged_values_)
+    add(buffer);
+  return bytes;
+}
 }  // namespace Generators
@@ -109,14 +109,18 @@ using CapturedGraphInfoPtr = std::unique_ptr<CapturedGraphInfo, CapturedGraphInf
 
 class CapturedGraphPool : public std::enable_shared_from_this<CapturedGraphPool> {
  public:
-  CapturedGraphPool(const Config* config, const SessionInfo* session_info, Ort::Allocator* allocator_device)
+  CapturedGraphPool(const Config* config, const SessionInfo* session_info, Ort::Allocator* allocator_device,
+                    Ort::Allocator* allocator_inputs)
       : config_(config),
         session_info_(session_info),
-        allocator_device_(allocator_device){};
+        allocator_device_(allocator_device),
+        allocator_inputs_(allocator_inputs){};
 
   void AddCapturedGraph(CapturedGraphInfoPtr&& captured_graph) const;
   CapturedGraphInfoPtr ReserveCapturedGraph(const Model& model, const GeneratorParams& params) const;
 
+  size_t GetMemoryUsage() const;  // Bytes of the static buffers of the graphs in the pool, the reserved ones aren't counted
+
  private:
   // Map from batch_size/max_length to a list of captured graphs
   mutable std::unordered_map<CapturedGraphKey, std::list<CapturedGraphInfoPtr>> captured_graphs_map_;
@@ -127,6 +131,7 @@ class CapturedGraphPool : public std::enable_shared_from_this<CapturedGraphPool>
   const Config* config_;
   const SessionInfo* session_info_;
   Ort::Allocator* allocator_device_;
+  Ort::Allocator* allocator_inputs_;  // Of the position inputs, the CPU allocator on DML
 };
 
 struct CapturedGraphInfo {
@@ -142,9 +147,27 @@ struct CapturedGraphInfo {
   std::unique_ptr<Generators::StaticBuffer> sb_position_ids_;
   std::unique_ptr<Generators::StaticBuffer> sb_attention_mask_;
   std::unordered_map<std::string, std::unique_ptr<Generators::StaticBuffer>> sb_extra_inputs_;
+  // The shared input (see Model::GetSharedInput) each of sb_extra_inputs_ holds a copy of, so the next generator given
+  // the same tensor doesn't copy it again
+  mutable std::unordered_map<std::string, std::weak_ptr<OrtValue>> sb_extra_input_sources_;
   std::unique_ptr<Generators::StaticBuffer> sb_embeddings_;
+  std::unique_ptr<Generators::StaticBuffer> sb_cache_indirection_;  // Of beam searches, see CacheIndirection
   std::unique_ptr<CapturedGraphKey> key_;
 
+  // The device copies of the inputs and outputs that DML keeps on the CPU, see State::RunStaged
+  Ort::Allocator* allocator_device_{};
+  size_t max_beam_batch_size_{};
+  mutable std::unordered_map<std::string, std::unique_ptr<Generators::StaticBuffer>> sb_staged_values_;
+
+  size_t GetMemoryUsage() const;  // Bytes of all the static buffers
+
+  Generators::StaticBuffer& GetStagingBuffer(const std::string& name) const {
+    auto& buffer = sb_staged_values_[name];
+    if (!buffer)
+      buffer = std::make_unique<Generators::StaticBuffer>(allocator_device_, max_beam_batch_size_);
+    return *buffer;
+  }
+
   // Generates a unique annotation ID across different captured graph objects. This is necessary because different
   // generators could be alive at the same time and run the same batch size but with different static buffers, so
   // they need to have different annotation IDs.
@@ -4,7 +4,7 @@
 namespace Generators {
 DecoderOnly_Model::DecoderOnly_Model(std::unique_ptr<Config> config, OrtEnv& ort_env)
     : Model{std::move(config)} {
-  session_decoder_ = OrtSession::Create(ort_env, (config_->config_path / fs::path(config_->model.decoder.filename)).c_str(), session_options_.get());
+  session_decoder_ = CreateSharedSession(ort_env, config_->model.decoder.filename, config_->model.decoder.session_options, *session_options_);
 
   InitDeviceAllocator(*session_decoder_);
 }
@@ -13,37 +13,453 @@ std::unique_ptr<State> DecoderOnly_Model::CreateState(DeviceSpan<int32_t> sequen
   return std::make_unique<DecoderOnly_State>(*this, sequence_lengths_unk, params);
 }
 
+std::unique_ptr<OrtValue> DecoderOnly_Model::RunWithoutCache(std::span<const std::vector<int32_t>> sequences, const std::string& output_name,
+                                                              const char* caller) const {
+  if (sequences.empty())
+    throw std::runtime_error(std::string{caller} + " requires at least one sequence");
+
+  const auto& decoder = config_->model.decoder;
+  const auto batch_size = static_cast<int64_t>(sequences.size());
+  int64_t sequence_length = 0;
+  for (auto& sequence : sequences) {
+    if (sequence.empty())
+      throw std::runtime_error(std::string{caller} + " sequences can't be empty");
+    sequence_length = std::max(sequence_length, static_cast<int64_t>(sequence.size()));
+  }
+  if (sequence_length > config_->model.context_length)
+    throw std::runtime_error(std::string{caller} + " sequence length (" + std::to_string(sequence_length) + ") exceeds the model context_length (" +
+                             std::to_string(config_->model.context_length) + ")");
+
+  // The sequences are padded on the right to the longest one. The inputs are created on the CPU, ORT copies them to the
+  // device of the nodes that read them.
+  std::vector<std::string> input_names;
+  std::vector<std::unique_ptr<OrtValue>> inputs;
+  auto add_batch_input = [&](const std::string& name, const auto& get_value) {
+    const std::array<int64_t, 2> shape{batch_size, sequence_length};
+    auto type = session_info_->GetInputDataType(name);
+    auto input = OrtValue::CreateTensor(allocator_cpu_, shape, type);
+    for (int64_t i = 0; i < batch_size; i++) {
+      for (int64_t j = 0; j < sequence_length; j++) {
+        const int32_t value = get_value(sequences[i], static_cast<size_t>(j));
+        if (type == Ort::TypeToTensorType<int32_t>)
+          input->GetTensorMutableData<int32_t>()[i * sequence_length + j] = value;
+        else
+          input->GetTensorMutableData<int64_t>()[i * sequence_length + j] = value;
+      }
+    }
+    input_names.push_back(name);
+    inputs.push_back(std::move(input));
+  };
+
+  add_batch_input(decoder.inputs.input_ids, [this](const std::vector<int32_t>& sequence, size_t j) {
+    return j < sequence.size() ? sequence[j] : config_->model.pad_token_id;
+  });
+  if (session_info_->HasInput(decoder.inputs.attention_mask))
+    add_batch_input(decoder.inputs.attention_mask, [](const std::vector<int32_t>& sequence, size_t j) {
+      return static_cast<int32_t>(j < sequence.size());
+    });
+  if (session_info_->HasInput(decoder.inputs.position_ids))
+    add_batch_input(decoder.inputs.position_ids, [](const std::vector<int32_t>& sequence, size_t j) {
+      return j < sequence.size() ? static_cast<int32_t>(j) : 0;
+    });
+  if (session_info_->HasInput(decoder.inputs.seqlens_k)) {
+    auto seqlens_k = OrtValue::CreateTensor<int32_t>(allocator_cpu_, std::array<int64_t, 1>{batch_size});
+    for (int64_t i = 0; i < batch_size; i++)
+      seqlens_k->GetTensorMutableData<int32_t>()[i] = static_cast<int32_t>(sequences[i].size()) - 1;
+    input_names.push_back(decoder.inputs.seqlens_k);
+    inputs.push_back(std::move(seqlens_k));
+  }
+  if (session_info_->HasInput(decoder.inputs.total_sequence_length)) {
+    auto total_sequence_length = OrtValue::CreateTensor<int32_t>(allocator_cpu_, std::array<int64_t, 1>{1});
+    *total_sequence_length->GetTensorMutableData<int32_t>() = static_cast<int32_t>(sequence_length);
+    input_names.push_back(decoder.inputs.total_sequence_length);
+    inputs.push_back(std::move(total_sequence_length));
+  }
+  // Empty pasts, the presents the model computes are not fetched
+  for (int i = 0; i < decoder.num_hidden_layers; i++) {
+    for (auto* names : {&decoder.inputs.past_key_names, &decoder.inputs.past_value_names}) {
+      auto name = ComposeKeyValueName(*names, i);
+      if (!session_info_->HasInput(name))
+        continue;
+      const std::array<int64_t, 4> shape{batch_size, decoder.num_key_value_heads, 0, decoder.head_size};
+      inputs.push_back(OrtValue::CreateTensor(allocator_cpu_, shape, session_info_->GetInputDataType(name)));
+      input_names.push_back(std::move(name));
+    }
+  }
+
+  for (auto& name : session_info_->GetInputNames()) {
+    if (std::find(input_names.begin(), input_names.end(), name) == input_names.end())
+      throw std::runtime_error(std::string{caller} + " does not support the model input " + name);
+  }
+
+  std::vector<const char*> input_name_pointers;
+  std::vector<const OrtValue*> input_pointers;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    input_name_pointers.push_back(input_names[i].c_str());
+    input_pointers.push_back(inputs[i].get());
+  }
+  const char* output_name_pointer = output_name.c_str();
+  OrtValue* output_pointer{};
+  session_decoder_->Run(nullptr, input_name_pointers.data(), input_pointers.data(), inputs.size(), &output_name_pointer, &output_pointer, 1);
+  std::unique_ptr<OrtValue> output{output_pointer};
+
+  // Unbound outputs are returned on the CPU, only the type can differ
+  if (output->GetTensorTypeAndShapeInfo()->GetElementType() != Ort::TypeToTensorType<float>) {
+    std::unique_ptr<OrtValue> output_fp32;
+    Cast(*output, output_fp32, *GetDeviceInterface(DeviceType::CPU), Ort::TypeToTensorType<float>);
+    output = std::move(output_fp32);
+  }
+  return output;
+}
+
+std::unique_ptr<OrtValue> DecoderOnly_Model::Embed(std::span<const std::vector<int32_t>> sequences, std::string_view pooling) const {
+  const bool mean_pooling = pooling == "mean";
+  if (!mean_pooling && pooling != "last_token")
+    throw std::runtime_error("Unknown embedding pooling '" + std::string{pooling} + "', expected 'last_token' or 'mean'");
+  const auto& decoder = config_->model.decoder;
+  if (!session_info_->HasOutput(decoder.outputs.hidden_states))
+    throw std::runtime_error("Embed requires the model output " + decoder.outputs.hidden_states +
+                             ", see the model builder's include_hidden_states and exclude_lm_head options");
+
+  auto hidden_states = RunWithoutCache(sequences, decoder.outputs.hidden_states, "Embed");
+  const auto batch_size = static_cast<int64_t>(sequences.size());
+  const auto sequence_length = hidden_states->GetTensorTypeAndShapeInfo()->GetShape()[1];
+  const auto hidden_size = hidden_states->GetTensorTypeAndShapeInfo()->GetShape()[2];
+  const float* hidden = hidden_states->GetTensorData<float>();
+
+  auto embeddings = OrtValue::CreateTensor<float>(allocator_cpu_, std::array<int64_t, 2>{batch_size, hidden_size});
+  auto* embedding = embeddings->GetTensorMutableData<float>();
+  for (int64_t i = 0; i < batch_size; i++, embedding += hidden_size) {
+    const auto length = static_cast<int64_t>(sequences[i].size());
+    const float* row = hidden + i * sequence_length * hidden_size;
+    if (!mean_pooling) {
+      std::copy_n(row + (length - 1) * hidden_size, hidden_size, embedding);
+      continue;
+    }
+    std::fill_n(embedding, hidden_size, 0.0f);
+    for (int64_t j = 0; j < length; j++)
+      for (int64_t k = 0; k < hidden_size; k++)
+        embedding[k] += row[j * hidden_size + k];
+    for (int64_t k = 0; k < hidden_size; k++)
+      embedding[k] /= static_cast<float>(length);
+  }
+  return embeddings;
+}
+
+std::unique_ptr<OrtValue> DecoderOnly_Model::ScoreSequences(std::span<const std::vector<int32_t>> prompts,
+                                                            std::span<const std::vector<int32_t>> continuations) const {
+  if (prompts.size() != continuations.size())
+    throw std::runtime_error("ScoreSequences requires one continuation per prompt, got " + std::to_string(prompts.size()) +
+                             " prompts and " + std::to_string(continuations.size()) + " continuations");
+  if (config_->model.decoder.logits_top_k)
+    throw std::runtime_error("ScoreSequences requires the full vocabulary logits, the model has a logits_top_k head");
+
+  const auto vocab_size = static_cast<int64_t>(config_->model.vocab_size);
+  int64_t continuation_length = 0;
+  std::vector<std::vector<int32_t>> sequences(prompts.size());
+  for (size_t i = 0; i < prompts.size(); i++) {
+    // The first continuation token is scored by the logits of the last prompt token
+    if (prompts[i].empty() || continuations[i].empty())
+      throw std::runtime_error("ScoreSequences prompts and continuations can't be empty");
+    for (auto token : continuations[i]) {
+      if (token < 0 || token >= vocab_size)
+        throw std::runtime_error("ScoreSequences continuation token " + std::to_string(token) + " is outside the vocabulary");
+    }
+    sequences[i] = prompts[i];
+    sequences[i].insert(sequences[i].end(), continuations[i].begin(), continuations[i].end());
+    continuation_length = std::max(continuation_length, static_cast<int64_t>(continuations[i].size()));
+  }
+
+  auto logits = RunWithoutCache(sequences, config_->model.decoder.outputs.logits, "ScoreSequences");
+  const auto logits_shape = logits->GetTensorTypeAndShapeInfo()->GetShape();
+  const auto sequence_length = logits_shape[1];
+  if (logits_shape[2] != vocab_size)
+    throw std::runtime_error("ScoreSequences expects logits of the vocabulary size " + std::to_string(vocab_size) +
+                             ", the model returned " + std::to_string(logits_shape[2]));
+  const float* logits_data = logits->GetTensorData<float>();
+
+  const auto batch_size = static_cast<int64_t>(sequences.size());
+  auto log_probs = OrtValue::CreateTensor<float>(allocator_cpu_, std::array<int64_t, 2>{batch_size, continuation_length});
+  auto* log_prob = log_probs->GetTensorMutableData<float>();
+  std::fill_n(log_prob, batch_size * continuation_length, 0.0f);
+  for (int64_t i = 0; i < batch_size; i++, log_prob += continuation_length) {
+    const auto& continuation = continuations[i];
+    const auto prompt_length = static_cast<int64_t>(prompts[i].size());
+    for (size_t j = 0; j < continuation.size(); j++) {
+      std::span<const float> row{logits_data + (i * sequence_length + prompt_length - 1 + static_cast<int64_t>(j)) * vocab_size,
+                                 static_cast<size_t>(vocab_size)};
+      // log_softmax(row)[token], with the maximum subtracted so exp can't overflow
+      const float max = *std::max_element(row.begin(), row.end());
+      double sum = 0.0;
+      for (float value : row)
+        sum += std::exp(static_cast<double>(value - max));
+      log_prob[j] = row[continuation[j]] - max - static_cast<float>(std::log(sum));
+    }
+  }
+  return log_probs;
+}
+
 DecoderOnly_State::DecoderOnly_State(const DecoderOnly_Model& model, DeviceSpan<int32_t> sequence_lengths_unk, const GeneratorParams& params)
     : State{params, model},
       model_{model},
-      captured_graph_info_(model.GetCapturedGraphPool()->ReserveCapturedGraph(model, params)),
+      captured_graph_info_(ReserveCapturedGraph(params)),
       position_inputs_{model, *this, sequence_lengths_unk} {
   input_ids_.Add();
   position_inputs_.Add();
   logits_.Add();
-  kv_cache_.Add();
+  if (kv_cache_)
+    kv_cache_->Add();
+  cache_indirection_.Add();
+  adapter_ids_.Add();
   extra_inputs_.Add();
 }
 
+// With graph_capture_batch_buckets the model runs the batch padded to the max_batch_size of its bucket, so the generators
+// of a bucket replay the one graph captured for that size whatever their batch size. Sets batch_size_, so it's called
+// before the inputs and outputs are created.
+CapturedGraphInfoPtr DecoderOnly_State::ReserveCapturedGraph(const GeneratorParams& params) {
+  auto captured_graph_info = model_.GetCapturedGraphPool()->ReserveCapturedGraph(model_, params);
+  // Beam indices, extra inputs, adapter ids and top k candidates aren't padded
+  if (captured_graph_info && params.search.graph_capture_batch_buckets && params.search.num_beams == 1 &&
+      params.extra_inputs.empty() && params.batch_adapter_ids.empty() && !model_.config_->model.decoder.logits_top_k)
+    batch_size_ = captured_graph_info->max_batch_size_;
+  return captured_graph_info;
+}
+
+// Returns the tokens of the model's rows, the padding rows repeat the first row so they're valid input to every kernel.
+// Their results are dropped.
+DeviceSpan<int32_t> DecoderOnly_State::PadBatch(DeviceSpan<int32_t> tokens) {
+  const size_t rows = static_cast<size_t>(params_->BatchBeamSize());
+  const size_t row_length = tokens.size() / rows;
+  const size_t padded_size = static_cast<size_t>(BatchBeamSize()) * row_length;
+  if (padded_tokens_.size() != padded_size)
+    padded_tokens_ = params_->p_device->Allocate<int32_t>(padded_size);
+
+  // The prompt is also read on the CPU (see Logits::Update), the next tokens stay on the device
+  if (first_run_) {
+    auto source = tokens.CpuSpan();
+    auto target = padded_tokens_.CpuSpan();
+    std::copy(source.begin(), source.end(), target.begin());
+    for (size_t offset = source.size(); offset < target.size(); offset += row_length)
+      std::copy_n(source.begin(), row_length, target.begin() + offset);
+    padded_tokens_.CopyCpuToDevice();
+  } else {
+    padded_tokens_.subspan(0, tokens.size()).CopyFrom(tokens);
+    for (size_t offset = tokens.size(); offset < padded_size; offset += row_length)
+      padded_tokens_.subspan(offset, row_length).CopyFrom(tokens.subspan(0, row_length));
+  }
+  return padded_tokens_;
+}
+
 DeviceSpan<float> DecoderOnly_State::Run(int total_length, DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> next_indices) {
-  UpdateInputsOutputs(next_tokens, next_indices, total_length);
+  const bool padded = BatchBeamSize() != params_->BatchBeamSize();
+  auto model_tokens = padded ? PadBatch(next_tokens) : next_tokens;
+  UpdateInputsOutputs(model_tokens, next_indices, total_length);
 
   int batch_size = static_cast<int>(input_ids_.GetShape()[0]);
-  State::Run(*model_.session_decoder_, batch_size);
+  if (!first_run_ || !params_->search.ragged_prefill || !RunRaggedPrefill(next_tokens))
+    State::Run(*model_.session_decoder_, batch_size);
+  if (kv_cache_)
+    kv_cache_->PublishPrefix();
+
+  auto logits = logits_.Get();
+  if (!padded)
+    return logits;
+  // The search only gets the rows of the batch
+  const size_t rows = static_cast<size_t>(params_->BatchBeamSize());
+  if (raw_logits_) {
+    raw_logits_rows_ = SliceRows(*raw_logits_, 0, rows);
+    raw_logits_ = raw_logits_rows_.get();
+  }
+  return logits.empty() ? logits : logits.subspan(0, logits.size() / static_cast<size_t>(BatchBeamSize()) * rows);
+}
+
+OrtValue* DecoderOnly_State::GetOutput(const char* name) {
+  auto* output = State::GetOutput(name);
+  if (!output || BatchBeamSize() == params_->BatchBeamSize() ||
+      output->GetTensorTypeAndShapeInfo()->GetShape()[0] != BatchBeamSize())
+    return output;
+  auto& rows = output_rows_[name];
+  rows = SliceRows(*output, 0, static_cast<size_t>(params_->BatchBeamSize()));
+  return rows.get();
+}
+
+bool DecoderOnly_State::RunRaggedPrefill(DeviceSpan<int32_t>& next_tokens) {
+  auto* default_cache = dynamic_cast<DefaultKeyValueCache*>(kv_cache_.get());
+  const auto batch_size = static_cast<size_t>(input_ids_.GetShape()[0]);
+  // The rows are run as plain batch size 1 states, so everything that is batch specific or read back after the run stays
+  // on the regular path
+  if (!default_cache || batch_size < 2 || params_->search.num_beams != 1 || captured_graph_info_ ||
+      model_.config_->model.decoder.logits_top_k || !params_->extra_inputs.empty() || !params_->batch_adapter_ids.empty() ||
+      model_.session_decoder_->GetOutputNames().size() != output_names_.size())
+    return false;
+
+  const auto sequence_length = static_cast<size_t>(input_ids_.GetShape()[1]);
+  auto tokens = next_tokens.CopyDeviceToCpu();
+  const int32_t pad_token_id = model_.config_->model.pad_token_id;
+  std::vector<size_t> lengths(batch_size);
+  for (size_t r = 0; r < batch_size; r++) {
+    auto row = tokens.subspan(r * sequence_length, sequence_length);
+    lengths[r] = sequence_length - static_cast<size_t>(std::find_if(row.begin(), row.end(), [pad_token_id](int32_t token) { return token != pad_token_id; }) - row.begin());
+    if (lengths[r] == 0)
+      return false;  // An all padding row has nothing to compute, the regular run handles it
+  }
+  if (std::all_of(lengths.begin(), lengths.end(), [sequence_length](size_t length) { return length == sequence_length; }))
+    return false;  // Nothing is padded
+
+  auto row_params = std::make_shared<GeneratorParams>(model_);
+  row_params->search = params_->search;
+  row_params->search.batch_size = 1;
+  row_params->search.max_length = static_cast<int>(sequence_length);
+  row_params->search.past_present_share_buffer = false;
+  row_params->search.ragged_prefill = false;
+  row_params->use_cuda_graph = false;
+
+  const char* logits_name = model_.config_->model.decoder.outputs.logits.c_str();
+  auto logits = ByteWrapTensor(*model_.p_device_inputs_, *GetOutput(logits_name));
+  const size_t logits_row_bytes = logits.size() / batch_size;
+  for (size_t r = 0; r < batch_size; r++) {
+    const size_t length = lengths[r];
+    auto row_state = std::make_unique<DecoderOnly_State>(model_, params_->p_device->Allocate<int32_t>(1), *row_params);
+    auto row_tokens = params_->p_device->Allocate<int32_t>(length);
+    auto row = tokens.subspan(r * sequence_length + sequence_length - length, length);
+    std::copy(row.begin(), row.end(), row_tokens.CpuSpan().begin());
+    row_tokens.CopyCpuToDevice();
+    row_state->Run(static_cast<int>(length), row_tokens, {});
 
-  return logits_.Get();
+    // Both logits outputs are [rows, tokens, vocab_size] (or hold only the last token), the last token's logits are copied
+    auto& row_logits_output = *row_state->GetOutput(logits_name);
+    auto row_logits = ByteWrapTensor(*model_.p_device_inputs_, row_logits_output);
+    const size_t token_bytes = row_logits.size() / static_cast<size_t>(row_logits_output.GetTensorTypeAndShapeInfo()->GetShape()[1]);
+    logits.subspan(r * logits_row_bytes + logits_row_bytes - token_bytes, token_bytes).CopyFrom(row_logits.subspan(row_logits.size() - token_bytes, token_bytes));
+    default_cache->CopyRowFrom(static_cast<DefaultKeyValueCache&>(*row_state->kv_cache_), 0, 0, length, r, sequence_length - length);
+  }
+  first_run_ = false;
+  return true;
 }
 
 void DecoderOnly_State::RewindTo(size_t index) {
   position_inputs_.RewindTo(index);
-  kv_cache_.RewindTo(index);
+  if (kv_cache_)
+    kv_cache_->RewindTo(index);
+}
+
+size_t DecoderOnly_State::ReusePrefix(std::span<const int32_t> tokens) {
+  // Captured graphs expect the position inputs to be created by a full prompt run
+  if (!kv_cache_ || captured_graph_info_)
+    return 0;
+
+  size_t length = kv_cache_->ReusePrefix(tokens);
+  if (length)
+    position_inputs_.SetPastLength(static_cast<int>(length));
+  return length;
+}
+
+bool DecoderOnly_State::ForkFrom(State& source_state, size_t length) {
+  auto* source = dynamic_cast<DecoderOnly_State*>(&source_state);
+  // Captured graphs expect the position inputs to be created by a full prompt run
+  if (!source || !kv_cache_ || !source->kv_cache_ || captured_graph_info_)
+    return false;
+
+  if (!kv_cache_->ForkFrom(*source->kv_cache_, length))
+    return false;
+  position_inputs_.SetPastLength(static_cast<int>(length));
+  return true;
+}
+
+bool DecoderOnly_State::MergeRows(DeviceSpan<int32_t>& tokens, int length, std::span<const StateRow> rows) {
+  auto* cache = dynamic_cast<DefaultKeyValueCache*>(kv_cache_.get());
+  // Like RunRaggedPrefill, everything that is batch specific or set up by the first Run stays on the regular path
+  if (!first_run_ || !cache || params_->search.num_beams != 1 || captured_graph_info_ || !params_->extra_inputs.empty() ||
+      !params_->batch_adapter_ids.empty() || model_.session_decoder_->GetOutputNames().size() != output_names_.size())
+    return false;
+
+  std::vector<DefaultKeyValueCache*> sources;
+  for (const auto& row : rows) {
+    auto* source = dynamic_cast<DecoderOnly_State*>(row.state);
+    auto* source_cache = source ? dynamic_cast<DefaultKeyValueCache*>(source->kv_cache_.get()) : nullptr;
+    if (!source_cache)
+      return false;
+    sources.push_back(source_cache);
+  }
+
+  // The position inputs are derived from the pad tokens, as for a padded prompt
+  input_ids_.Update(tokens);
+  position_inputs_.Update(tokens, length, length);
+  cache->Update({}, length);
+  for (size_t r = 0; r < rows.size(); r++)
+    cache->CopyRowFrom(*sources[r], rows[r].row, rows[r].begin, rows[r].length, r, static_cast<size_t>(length) - rows[r].length);
+  first_run_ = false;
+  return true;
+}
+
+bool DecoderOnly_State::SaveKeyValueCache(StateWriter& writer, size_t length) {
+  return kv_cache_ && kv_cache_->Save(writer, length);
+}
+
+bool DecoderOnly_State::LoadKeyValueCache(StateReader& reader, size_t length) {
+  // Captured graphs expect the position inputs to be created by a full prompt run
+  if (!kv_cache_ || captured_graph_info_ || !kv_cache_->Load(reader, length))
+    return false;
+  position_inputs_.SetPastLength(static_cast<int>(length));
+  return true;
+}
+
+bool DecoderOnly_State::AppendKeyValueCache(StateReader& reader, size_t length, size_t position) {
+  if (!kv_cache_ || captured_graph_info_ || !kv_cache_->Append(reader, length, position))
+    return false;
+  position_inputs_.SetPastLength(static_cast<int>(position + length));
+  return true;
+}
+
+bool DecoderOnly_State::EvictKeyValueCache(size_t length, size_t begin, size_t count) {
+  if (!kv_cache_ || captured_graph_info_ || !kv_cache_->Evict(length, begin, count))
+    return false;
+  position_inputs_.SetPastLength(static_cast<int>(length - count));
+  return true;
+}
+
+bool DecoderOnly_State::SwitchRotaryFactors(size_t length, std::span<const size_t> padding, bool long_factors) {
+  // The keys are re-encoded in place, so a captured graph keeps its buffers
+  return kv_cache_ && kv_cache_->SwitchRotaryFactors(length, padding, long_factors);
+}
+
+bool DecoderOnly_State::OffloadKeyValueCache(const fs::path& path) {
+  return kv_cache_ && kv_cache_->Offload(path);
+}
+
+void DecoderOnly_State::RestoreKeyValueCache() {
+  if (kv_cache_)
+    kv_cache_->Restore();
+}
+
+void DecoderOnly_State::UpdateMemoryUsage(MemoryUsage& usage) const {
+  usage.Set(MemoryUsage::KeyValueCache, kv_cache_ ? kv_cache_->GetMemoryUsage() : 0);
+  usage.Set(MemoryUsage::Logits, logits_.GetMemoryUsage());
+}
+
+bool DecoderOnly_State::CompactBatch(std::span<const int32_t> rows) {
+  // Captured graphs and the cache indirection table are sized for the full batch
+  if (!kv_cache_ || captured_graph_info_ || cache_indirection_.IsEnabled() || model_.config_->model.decoder.paged_kv_cache)
+    return false;
+
+  input_ids_.CompactBatch(rows.size());
+  position_inputs_.CompactBatch(rows);
+  kv_cache_->CompactBatch(rows);
+  adapter_ids_.CompactBatch(rows);
+  logits_.CompactBatch(rows.size());
+  return true;
 }
 
 void DecoderOnly_State::UpdateInputsOutputs(DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> beam_indices, int total_length) {
   input_ids_.Update(next_tokens);
   size_t new_length = static_cast<size_t>(input_ids_.GetShape()[1]);
   position_inputs_.Update(next_tokens, total_length, static_cast<int>(new_length));
-  kv_cache_.Update(beam_indices, total_length);
+  if (kv_cache_) {
+    Metrics::Timer timer{GeneratorMetrics::KeyValueCache};
+    kv_cache_->Update(beam_indices, total_length);
+  }
+  cache_indirection_.Update(beam_indices, total_length, static_cast<int>(new_length));
   logits_.Update(next_tokens, new_length);
 }
 
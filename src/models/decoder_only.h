@@ -5,6 +5,8 @@
 #include "kv_cache.h"
 #include "position_inputs.h"
 #include "extra_inputs.h"
+#include "cache_indirection.h"
+#include "adapter_ids.h"
 
 namespace Generators {
 
@@ -12,28 +14,61 @@ struct DecoderOnly_Model : Model {
   DecoderOnly_Model(std::unique_ptr<Config> config, OrtEnv& ort_env);
 
   std::unique_ptr<State> CreateState(DeviceSpan<int32_t> sequence_lengths_unk, const GeneratorParams& params) const override;
+  std::unique_ptr<OrtValue> Embed(std::span<const std::vector<int32_t>> sequences, std::string_view pooling) const override;
+  std::unique_ptr<OrtValue> ScoreSequences(std::span<const std::vector<int32_t>> prompts,
+                                           std::span<const std::vector<int32_t>> continuations) const override;
 
-  std::unique_ptr<OrtSession> session_decoder_;
+  std::shared_ptr<OrtSession> session_decoder_;  // Shared with the other models of the process that load the same file
+
+ private:
+  // Runs the sequences once as a right padded batch with empty pasts and returns 'output_name' as a float tensor
+  // [sequence count, longest sequence, ...] on the CPU. 'caller' prefixes the error messages.
+  std::unique_ptr<OrtValue> RunWithoutCache(std::span<const std::vector<int32_t>> sequences, const std::string& output_name,
+                                            const char* caller) const;
 };
 
 struct DecoderOnly_State : State {
   DecoderOnly_State(const DecoderOnly_Model& model, DeviceSpan<int32_t> sequence_lengths_unk, const GeneratorParams& params);
   DeviceSpan<float> Run(int total_length, DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> next_indices) override;
   const CapturedGraphInfo* GetCapturedGraphInfo() const override { return captured_graph_info_.get(); };
+  OrtValue* GetOutput(const char* name) override;
 
   void RewindTo(size_t index) override;
+  size_t ReusePrefix(std::span<const int32_t> tokens) override;
+  bool ForkFrom(State& source, size_t length) override;
+  bool MergeRows(DeviceSpan<int32_t>& tokens, int length, std::span<const StateRow> rows) override;
+  bool SaveKeyValueCache(StateWriter& writer, size_t length) override;
+  bool LoadKeyValueCache(StateReader& reader, size_t length) override;
+  bool AppendKeyValueCache(StateReader& reader, size_t length, size_t position) override;
+  bool EvictKeyValueCache(size_t length, size_t begin, size_t count) override;
+  bool SwitchRotaryFactors(size_t length, std::span<const size_t> padding, bool long_factors) override;
+  bool OffloadKeyValueCache(const fs::path& path) override;
+  void RestoreKeyValueCache() override;
+  bool CompactBatch(std::span<const int32_t> rows) override;
+  void UpdateMemoryUsage(MemoryUsage& usage) const override;
 
  private:
+  CapturedGraphInfoPtr ReserveCapturedGraph(const GeneratorParams& params);
+  DeviceSpan<int32_t> PadBatch(DeviceSpan<int32_t> tokens);
   void UpdateInputsOutputs(DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> beam_indices, int total_length);
+  // See Config::Search::ragged_prefill. Returns false when the prompt run can't be split into rows.
+  bool RunRaggedPrefill(DeviceSpan<int32_t>& next_tokens);
 
   const DecoderOnly_Model& model_;
   CapturedGraphInfoPtr captured_graph_info_;
 
   DefaultInputIDs input_ids_{*this};
   Logits logits_{*this};
-  DefaultKeyValueCache kv_cache_{*this};
+  std::unique_ptr<KeyValueCache> kv_cache_{CreateKeyValueCache(*this)};
   DefaultPositionInputs position_inputs_;
+  CacheIndirection cache_indirection_{*this};
+  AdapterIds adapter_ids_{*this};
   ExtraInputs extra_inputs_{*this};
+
+  // Of a padded batch (see ReserveCapturedGraph): the tokens of the model's rows, and the outputs without the padding rows
+  DeviceSpan<int32_t> padded_tokens_;
+  std::unique_ptr<OrtValue> raw_logits_rows_;
+  std::unordered_map<std::string, std::unique_ptr<OrtValue>> output_rows_;
 };
 
 }  // namespace Generators
@@ -8,36 +8,85 @@
 
 namespace Generators {
 
+namespace {
+
+bool HasProviderOptions(const Config::Model::Decoder::PipelineModel& model) {
+  if (!model.session_options.has_value())
+    return false;
+  const auto& provider_options = (*model.session_options).provider_options;
+  return std::any_of(provider_options.begin(), provider_options.end(),
+                     [](const auto& elem) { return !elem.name.empty(); });
+}
+
+}  // namespace
+
 DecoderOnlyPipelineModel::DecoderOnlyPipelineModel(std::unique_ptr<Config> config, OrtEnv& ort_env)
-    : Model{std::move(config)} {
-  for (const auto& model : config_->model.decoder.pipeline) {
-    sessions_.emplace_back(OrtSession::Create(ort_env, (config_->config_path / fs::path(model.filename)).c_str(),
-                                              GetSessionOptions(model.model_id)));
-
-    if (!p_device_inputs_ && model.session_options.has_value()) {
-      const auto& provider_options = (*model.session_options).provider_options;
-      if (std::any_of(provider_options.begin(), provider_options.end(),
-                      [](const auto& elem) { return !elem.name.empty(); })) {
-        InitDeviceAllocator(*sessions_.back());
-      }
-    }
+    : Model{std::move(config)},
+      ort_env_{ort_env} {
+  const auto& pipeline = config_->model.decoder.pipeline;
+  if (pipeline.empty())
+    throw std::runtime_error("decoder-pipeline models need at least one pipeline model");
+  sessions_.resize(pipeline.size());
+
+  // Only the session that creates the device allocator is loaded here, the others wait for the first CreateState.
+  // If no pipeline model sets a provider, all sessions are configured to run on CPU and the device allocator is
+  // guaranteed to be the cpu allocator, so any session works.
+  auto device_session = std::find_if(pipeline.begin(), pipeline.end(), HasProviderOptions);
+  const size_t device_session_index = device_session != pipeline.end() ? device_session - pipeline.begin() : 0;
+  for (size_t i = 0; i < pipeline.size(); i++) {
+    if (i != device_session_index && SharesEpContexts(i))
+      last_shared_ep_context_session_ = i;
   }
+  if (!last_shared_ep_context_session_ && SharesEpContexts(device_session_index))
+    last_shared_ep_context_session_ = device_session_index;
 
-  if (!p_device_inputs_) {
-    // If the device allocator has not been created, it implies all
-    // sessions are configured to run on CPU.
-    // Pick any session to create the device allocator.
-    // Device allocator is guaranteed to be the cpu allocator.
-    InitDeviceAllocator(*sessions_.front());
-  }
+  sessions_[device_session_index] = LoadSession(device_session_index);
+  InitDeviceAllocator(*sessions_[device_session_index]);
+}
 
-  for (auto& session : sessions_) {
-    session_info_->Add(*session);
-  }
+// Models that share a pipeline model (like the embedding or the language model head) also share its session and weights
+std::shared_ptr<OrtSession> DecoderOnlyPipelineModel::LoadSession(size_t index) const {
+  const auto& model = config_->model.decoder.pipeline[index];
+  const auto& config_session_options = model.session_options ? *model.session_options : config_->model.decoder.session_options;
+  if (index != last_shared_ep_context_session_)
+    return CreateSharedSession(ort_env_, model.filename, config_session_options, *GetSessionOptions(model.model_id));
+
+  // Clears the EP contexts shared so far once the session is created, so a model loaded later doesn't pick up our graphs
+  auto session_options = GetSessionOptions(model.model_id)->Clone();
+  session_options->AddConfigEntry("ep.stop_share_ep_contexts", "1");
+  return CreateSharedSession(ort_env_, model.filename, config_session_options, *session_options);
+}
+
+// QNN sessions share their EP contexts: the graphs of a weight-shared context binary (one binary holding both the
+// prompt and the token generation graphs) that the first session didn't use are kept for the sessions loaded after it,
+// so every graph of the binary runs on the one weight allocation.
+bool DecoderOnlyPipelineModel::SharesEpContexts(size_t index) const {
+  const auto& model = config_->model.decoder.pipeline[index];
+  const auto& provider_options = (model.session_options ? *model.session_options : config_->model.decoder.session_options).provider_options;
+  return std::any_of(provider_options.begin(), provider_options.end(),
+                     [](const auto& elem) { return elem.name == "qnn"; });
+}
+
+void DecoderOnlyPipelineModel::LoadSessions() const {
+  std::call_once(sessions_loaded_, [this] {
+    // The sessions that share EP contexts are loaded one after another, sessions loaded in parallel wouldn't find the
+    // graphs the others are still loading and would each load the context binary's weights again
+    GetThreadPool().ParallelFor(sessions_.size(), [this](size_t i) {
+      if (!sessions_[i] && !SharesEpContexts(i))
+        sessions_[i] = LoadSession(i);
+    });
+    for (size_t i = 0; i < sessions_.size(); i++) {
+      if (!sessions_[i])
+        sessions_[i] = LoadSession(i);
+    }
+    for (auto& session : sessions_)
+      session_info_->Add(*session);
+  });
 }
 
 std::unique_ptr<State> DecoderOnlyPipelineModel::CreateState(DeviceSpan<int32_t> sequence_lengths,
                                                              const GeneratorParams& params) const {
+  LoadSessions();
   return std::make_unique<DecoderOnlyPipelineState>(*this, sequence_lengths, params);
 }
 
@@ -45,7 +94,31 @@ IntermediatePipelineState::IntermediatePipelineState(const DecoderOnlyPipelineMo
                                                      size_t pipeline_state_index)
     : State{params, model},
       id_{pipeline_state_index},
-      model_{model} {}
+      model_{model} {
+  auto& session = model_.GetSession(id_);
+  for (size_t i = 0; i < session.GetOutputCount(); i++) {
+    auto type_info = session.GetOutputTypeInfo(i);
+    auto& type_and_shape = type_info->GetTensorTypeAndShapeInfo();
+    auto shape = type_and_shape.GetShape();
+    if (std::all_of(shape.begin(), shape.end(), [](int64_t dim) { return dim > 0; }))
+      static_shape_outputs_.emplace(session.GetOutputName(i), std::make_pair(std::move(shape), type_and_shape.GetElementType()));
+  }
+}
+
+bool IntermediatePipelineState::HasStaticShape(const std::string& output_name) const {
+  return static_shape_outputs_.count(output_name) != 0;
+}
+
+std::unique_ptr<OrtValue> IntermediatePipelineState::CreateStaticShapeOutput(const std::string& output_name, Ort::Allocator& allocator) const {
+  const auto& [shape, type] = static_shape_outputs_.at(output_name);
+  return OrtValue::CreateTensor(allocator, shape, type);
+}
+
+bool IntermediatePipelineState::MatchesStaticShape(const std::string& output_name, OrtValue& value) const {
+  const auto& [shape, type] = static_shape_outputs_.at(output_name);
+  auto type_and_shape = value.GetTensorTypeAndShapeInfo();
+  return type_and_shape->GetElementType() == type && type_and_shape->GetShape() == shape;
+}
 
 bool IntermediatePipelineState::HasInput(std::string_view name) const {
   return std::any_of(model_.config_->model.decoder.pipeline[id_].inputs.begin(),
@@ -83,7 +156,7 @@ bool IntermediatePipelineState::SupportsPrimaryDevice() const {
 
 DeviceSpan<float> IntermediatePipelineState::Run(int total_length, DeviceSpan<int32_t>& next_tokens,
                                                  DeviceSpan<int32_t> next_indices) {
-  State::Run(*model_.sessions_[id_], params_->BatchBeamSize());
+  State::Run(model_.GetSession(id_), params_->BatchBeamSize());
   return {};
 }
 
@@ -111,6 +184,17 @@ static std::vector<size_t> DetectLayerIndicesFromPastKeyNameInputs(
   return detected_layer_indices;
 }
 
+// The name an output of the pipeline model is stored as for the following pipeline models
+static std::string GetStoredName(const Config::Model::Decoder::PipelineModel& pipeline_model, const std::string& output_name) {
+  auto forwarded_output = pipeline_model.output_names_forwarder.find(output_name);
+  return forwarded_output != pipeline_model.output_names_forwarder.end() ? forwarded_output->second : output_name;
+}
+
+static bool WritesValue(const Config::Model::Decoder::PipelineModel& pipeline_model, std::string_view name) {
+  return std::any_of(pipeline_model.outputs.begin(), pipeline_model.outputs.end(),
+                     [&](const std::string& output_name) { return GetStoredName(pipeline_model, output_name) == name; });
+}
+
 DecoderOnlyPipelineState::DecoderOnlyPipelineState(const DecoderOnlyPipelineModel& model,
                                                    DeviceSpan<int32_t> sequence_lengths,
                                                    const GeneratorParams& params)
@@ -142,13 +226,15 @@ DecoderOnlyPipelineState::DecoderOnlyPipelineState(const DecoderOnlyPipelineMode
     auto overlapped_kv_cache_update_record = [&]() -> std::optional<OverlappedKeyValueCacheUpdateRecord> {
       if (do_key_value_cache_partial_token_generation_update_) {
         const bool token_gen_only = !pipeline_model.run_on_prompt && pipeline_model.run_on_token_gen;
-        if (token_gen_only) {
+        const bool prompt_only = pipeline_model.run_on_prompt && !pipeline_model.run_on_token_gen;
+        if (token_gen_only || (prompt_only && model_.config_->model.decoder.sliding_window.has_value())) {
           auto layer_indices = DetectLayerIndicesFromPastKeyNameInputs(*past_key_name_to_layer_idx,
                                                                        pipeline_model.inputs);
           if (!layer_indices.empty()) {
-            // token generation model with KV cache tensors - we should overlap KV cache update
+            // token generation (or prompt window) model with KV cache tensors - we should overlap KV cache update
             auto record = OverlappedKeyValueCacheUpdateRecord{};
             record.layer_indices = std::move(layer_indices);
+            record.prompt = prompt_only;
             return record;
           }
         }
@@ -160,174 +246,400 @@ DecoderOnlyPipelineState::DecoderOnlyPipelineState(const DecoderOnlyPipelineMode
     pipeline_overlapped_kv_cache_update_records_.emplace_back(std::move(overlapped_kv_cache_update_record));
   }
 
+  // The prompt models only slide their layers between the windows, so every layer has to belong to one of them
+  std::vector<bool> prompt_layers(model_.config_->model.decoder.num_hidden_layers);
+  for (auto& record : pipeline_overlapped_kv_cache_update_records_) {
+    if (record.has_value() && record->prompt) {
+      for (size_t layer_idx : record->layer_indices)
+        prompt_layers[layer_idx] = true;
+    }
+  }
+  if (std::find(prompt_layers.begin(), prompt_layers.end(), false) != prompt_layers.end()) {
+    for (auto& record : pipeline_overlapped_kv_cache_update_records_) {
+      if (record.has_value() && record->prompt)
+        record.reset();
+    }
+  }
+
   if (std::any_of(pipeline_overlapped_kv_cache_update_records_.begin(),
                   pipeline_overlapped_kv_cache_update_records_.end(),
                   [](const auto& record) { return record.has_value(); })) {
     key_value_cache_update_worker_thread_.emplace();
   }
+
+  const size_t batch_size = params.BatchBeamSize();
+  const size_t micro_batch_count = std::min(static_cast<size_t>(std::max(model_.config_->model.decoder.pipeline_micro_batches, 1)),
+                                            batch_size);
+  if (micro_batch_count > 1) {
+    if (key_value_cache_update_worker_thread_ || model_.config_->model.decoder.sliding_window.has_value())
+      throw std::runtime_error("pipeline_micro_batches can't be used with sliding window or overlapped key-value cache updates");
+
+    micro_batches_.resize(micro_batch_count);
+    for (size_t m = 0; m < micro_batch_count; m++) {
+      auto& micro_batch = micro_batches_[m];
+      micro_batch.begin = m * batch_size / micro_batch_count;
+      micro_batch.count = (m + 1) * batch_size / micro_batch_count - micro_batch.begin;
+      for (size_t i = 0; i < pipeline_states_.size(); i++)
+        micro_batch.states.emplace_back(std::make_unique<IntermediatePipelineState>(model_, params, i));
+    }
+  }
+
+  if (model_.config_->model.decoder.early_exit) {
+    const auto& pipeline = model_.config_->model.decoder.pipeline;
+    const auto& exit_logits = model_.config_->model.decoder.outputs.exit_logits;
+    auto exit_model = std::find_if(pipeline.begin(), pipeline.end(), [&](const auto& pipeline_model) { return WritesValue(pipeline_model, exit_logits); });
+    if (exit_model == pipeline.end())
+      throw std::runtime_error("early_exit requires one of the pipeline models to output " + exit_logits);
+    if (!micro_batches_.empty())
+      throw std::runtime_error("early_exit can't be used with pipeline_micro_batches");
+    exit_stage_ = static_cast<size_t>(exit_model - pipeline.begin());
+  }
 }
 
-void DecoderOnlyPipelineState::RunPipeline(int total_length, DeviceSpan<int32_t>& next_tokens,
-                                           DeviceSpan<int32_t> next_indices) {
-  for (auto& pipeline_state : pipeline_states_) {
-    if (first_run_ && !model_.config_->model.decoder.pipeline[pipeline_state->id_].run_on_prompt) {
-      continue;
-    } else if (!first_run_ && !model_.config_->model.decoder.pipeline[pipeline_state->id_].run_on_token_gen) {
-      continue;
+// Two pipeline models depend on each other if one reads a value the other writes, or if both write the same value
+static bool DependsOn(const Config::Model::Decoder::PipelineModel& a, const Config::Model::Decoder::PipelineModel& b) {
+  auto reads_from = [](const Config::Model::Decoder::PipelineModel& reader, const Config::Model::Decoder::PipelineModel& writer) {
+    return std::any_of(reader.inputs.begin(), reader.inputs.end(), [&](const std::string& name) { return WritesValue(writer, name); });
+  };
+  return reads_from(a, b) || reads_from(b, a) ||
+         std::any_of(a.outputs.begin(), a.outputs.end(), [&](const std::string& name) { return WritesValue(b, GetStoredName(a, name)); });
+}
+
+void DecoderOnlyPipelineState::PrepareStage(IntermediatePipelineState& pipeline_state, ValueStore& store, const ValueStore* managed_views) {
+  // With micro batches, the pipeline model gets views of its rows of the managed inputs and outputs that have a batch dimension
+  auto managed_value = [managed_views](const std::string& name, OrtValue* value) {
+    if (managed_views) {
+      if (auto iter = managed_views->find(name); iter != managed_views->end())
+        return iter->second.get();
     }
+    return value;
+  };
 
-    // Clear the intermediate pipeline state outputs from the previous runs.
-    // These outputs will be replaced by the outputs from the current run.
-    for (const auto& output_name : pipeline_state->output_names_) {
-      if (auto iter = ortvalue_store_.find(output_name); iter != ortvalue_store_.end()) {
-        ortvalue_store_.erase(iter);
-      }
+  // Clear the intermediate pipeline state outputs from the previous runs.
+  // These outputs will be replaced by the outputs from the current run, except for the ones with a static shape.
+  for (const auto& output_name : pipeline_state.output_names_) {
+    if (pipeline_state.HasStaticShape(output_name))
+      continue;
+    if (auto iter = store.find(output_name); iter != store.end()) {
+      store.erase(iter);
     }
-    pipeline_state->ClearIO();
-
-    // Managed inputs and outputs are those inputs and outputs that the
-    // Model knows how to create and update from one run to the next.
-
-    // Add all the managed inputs to the intermediate pipeline state
-    for (const auto& input_name : input_names_) {
-      if (pipeline_state->HasInput(input_name)) {
-        if (!pipeline_state->SupportsPrimaryDevice()) {
-          throw std::runtime_error(
-              MakeString("Managed input ", input_name, " resides on the primary device type (",
-                         static_cast<int>(model_.p_device_->GetType()), "). But the pipeline model ",
-                         model_.config_->model.decoder.pipeline[pipeline_state->id_].model_id,
-                         " is expecting it to reside elsewhere."));
-        }
-        pipeline_state->input_names_.push_back(input_name);
-        pipeline_state->inputs_.push_back(State::GetInput(input_name));
+  }
+  pipeline_state.ClearIO();
+
+  // Managed inputs and outputs are those inputs and outputs that the
+  // Model knows how to create and update from one run to the next.
+
+  // Add all the managed inputs to the intermediate pipeline state
+  for (const auto& input_name : input_names_) {
+    if (pipeline_state.HasInput(input_name)) {
+      if (!pipeline_state.SupportsPrimaryDevice()) {
+        throw std::runtime_error(
+            MakeString("Managed input ", input_name, " resides on the primary device type (",
+                       static_cast<int>(model_.p_device_->GetType()), "). But the pipeline model ",
+                       model_.config_->model.decoder.pipeline[pipeline_state.id_].model_id,
+                       " is expecting it to reside elsewhere."));
       }
+      pipeline_state.input_names_.push_back(input_name);
+      pipeline_state.inputs_.push_back(managed_value(input_name, State::GetInput(input_name)));
     }
+  }
 
-    // Add outputs from the previous pipeline states to the current pipeline state
-    for (auto& [name, ortvalue] : ortvalue_store_) {
-      if (pipeline_state->HasInput(name)) {
-        pipeline_state->input_names_.push_back(name.c_str());
-        pipeline_state->inputs_.push_back(ortvalue.get());
-      }
+  // Add outputs from the previous pipeline states to the current pipeline state
+  for (auto& [name, ortvalue] : store) {
+    if (pipeline_state.HasInput(name)) {
+      pipeline_state.input_names_.push_back(name.c_str());
+      pipeline_state.inputs_.push_back(ortvalue.get());
     }
+  }
 
-    // Add all the managed outputs to the intermediate pipeline state
-    for (const auto& output_name : output_names_) {
-      if (pipeline_state->HasOutput(output_name)) {
-        if (!pipeline_state->SupportsPrimaryDevice()) {
-          throw std::runtime_error(
-              MakeString("Managed output ", output_name, " resides on the primary device type (",
-                         static_cast<int>(model_.p_device_->GetType()), "). But the pipeline model ",
-                         model_.config_->model.decoder.pipeline[pipeline_state->id_].model_id,
-                         " is expecting it to reside elsewhere."));
-        }
-        pipeline_state->output_names_.push_back(output_name);
-        pipeline_state->outputs_.push_back(State::GetOutput(output_name));
+  // Add all the managed outputs to the intermediate pipeline state
+  for (const auto& output_name : output_names_) {
+    if (pipeline_state.HasOutput(output_name)) {
+      if (!pipeline_state.SupportsPrimaryDevice()) {
+        throw std::runtime_error(
+            MakeString("Managed output ", output_name, " resides on the primary device type (",
+                       static_cast<int>(model_.p_device_->GetType()), "). But the pipeline model ",
+                       model_.config_->model.decoder.pipeline[pipeline_state.id_].model_id,
+                       " is expecting it to reside elsewhere."));
       }
+      pipeline_state.output_names_.push_back(output_name);
+      pipeline_state.outputs_.push_back(managed_value(output_name, State::GetOutput(output_name)));
     }
+  }
 
-    // Output of pipeline models could also be managed inputs.
-    // For example, the output of a pipeline model could be the key-value cache.
-    // In such cases, use the managed output buffers and register them with the pipeline model as outputs.
-    for (const auto& input_name : input_names_) {
-      if (pipeline_state->HasOutput(input_name)) {
-        if (!pipeline_state->SupportsPrimaryDevice()) {
-          throw std::runtime_error(
-              MakeString("Managed input ", input_name, " resides on the primary device type (",
-                         static_cast<int>(model_.p_device_->GetType()), "). But the pipeline model ",
-                         model_.config_->model.decoder.pipeline[pipeline_state->id_].model_id,
-                         " is expecting it to reside elsewhere."));
-        }
-        pipeline_state->output_names_.push_back(input_name);
-        pipeline_state->outputs_.push_back(State::GetInput(input_name));
+  // Output of pipeline models could also be managed inputs.
+  // For example, the output of a pipeline model could be the key-value cache.
+  // In such cases, use the managed output buffers and register them with the pipeline model as outputs.
+  for (const auto& input_name : input_names_) {
+    if (pipeline_state.HasOutput(input_name)) {
+      if (!pipeline_state.SupportsPrimaryDevice()) {
+        throw std::runtime_error(
+            MakeString("Managed input ", input_name, " resides on the primary device type (",
+                       static_cast<int>(model_.p_device_->GetType()), "). But the pipeline model ",
+                       model_.config_->model.decoder.pipeline[pipeline_state.id_].model_id,
+                       " is expecting it to reside elsewhere."));
       }
+      pipeline_state.output_names_.push_back(input_name);
+      pipeline_state.outputs_.push_back(managed_value(input_name, State::GetInput(input_name)));
     }
+  }
 
-    // Add all the remaining outputs for the intermediate pipeline state
-    for (const auto& output_name : model_.config_->model.decoder.pipeline[pipeline_state->id_].outputs) {
-      if (std::none_of(pipeline_state->output_names_.begin(), pipeline_state->output_names_.end(),
-                       [&](const std::string& elem) { return elem == output_name; })) {
-        pipeline_state->output_names_.push_back(output_name.c_str());
-        pipeline_state->outputs_.push_back(nullptr);
+  // Add all the remaining outputs for the intermediate pipeline state. The model writes the outputs with a static shape
+  // into their values of the previous run, which are still bound as inputs of the following pipeline models, so those
+  // don't need an allocation per run.
+  const auto& pipeline_model = model_.config_->model.decoder.pipeline[pipeline_state.id_];
+  for (const auto& output_name : pipeline_model.outputs) {
+    if (std::none_of(pipeline_state.output_names_.begin(), pipeline_state.output_names_.end(),
+                     [&](const std::string& elem) { return elem == output_name; })) {
+      OrtValue* output{};
+      if (pipeline_state.HasStaticShape(output_name)) {
+        // Another pipeline model can write the same value with a different static shape, like a QNN context model with
+        // the prompt's rows and an iterator model with one row. That value isn't reused, CollectStageOutputs replaces it.
+        auto iter = store.find(GetStoredName(pipeline_model, output_name));
+        if (iter != store.end() && pipeline_state.MatchesStaticShape(output_name, *iter->second))
+          output = iter->second.get();
+        else if (model_.p_device_->GetType() == DeviceType::QNN)
+          // Allocated from the HTP shared memory so the next pipeline model reads it without the EP copying it.
+          // CollectStageOutputs takes ownership, as it does for the outputs onnxruntime allocates.
+          output = pipeline_state.CreateStaticShapeOutput(output_name, model_.GetAllocator(*model_.p_device_)).release();
       }
+      pipeline_state.output_names_.push_back(output_name.c_str());
+      pipeline_state.outputs_.push_back(output);
     }
+  }
+}
 
-    auto& overlapped_kv_update_record = pipeline_overlapped_kv_cache_update_records_[pipeline_state->id_];
-    if (overlapped_kv_update_record.has_value()) {
-      // wait for any outstanding KV cache update to finish
-      if (overlapped_kv_update_record->outstanding_update.valid()) {
-        overlapped_kv_update_record->outstanding_update.get();
-      }
+void DecoderOnlyPipelineState::RunStage(IntermediatePipelineState& pipeline_state, int total_length,
+                                        DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> next_indices) {
+  auto& overlapped_kv_update_record = pipeline_overlapped_kv_cache_update_records_[pipeline_state.id_];
+  if (overlapped_kv_update_record.has_value()) {
+    // wait for any outstanding KV cache update to finish
+    if (overlapped_kv_update_record->outstanding_update.valid()) {
+      Trace::Scope trace_scope{"wait_for_kv_cache_update", "pipeline"};
+      overlapped_kv_update_record->outstanding_update.get();
     }
+  }
 
-    // Run the intermediate pipeline state
-    pipeline_state->Run(total_length, next_tokens, next_indices);
+  // Run the intermediate pipeline state
+  {
+    Trace::Scope trace_scope{model_.config_->model.decoder.pipeline[pipeline_state.id_].model_id.c_str(), "pipeline"};
+    pipeline_state.Run(total_length, next_tokens, next_indices);
+  }
 
-    if (overlapped_kv_update_record.has_value()) {
-      assert(key_value_cache_update_worker_thread_.has_value());
-      // enqueue the next KV cache update
-      auto update_fn = [&key_value_cache = *key_value_cache_.get(),
-                        layer_indices = overlapped_kv_update_record->layer_indices,
-                        next_indices, total_length]() {
-        key_value_cache.PartialTokenGenerationUpdate(next_indices, total_length, layer_indices);
+  if (overlapped_kv_update_record.has_value() && overlapped_kv_update_record->prompt) {
+    // Slide this model's layers for the next prompt window while the following pipeline models run
+    if (partial_prompt_update_) {
+      auto update_fn = [&key_value_cache = *key_value_cache_.get(), layer_indices = overlapped_kv_update_record->layer_indices]() {
+        Trace::Scope trace_scope{"kv_cache_update", "worker"};
+        key_value_cache.PartialPromptUpdate(layer_indices);
       };
       overlapped_kv_update_record->outstanding_update = key_value_cache_update_worker_thread_->Enqueue(update_fn);
     }
+  } else if (overlapped_kv_update_record.has_value()) {
+    assert(key_value_cache_update_worker_thread_.has_value());
+    // enqueue the next KV cache update
+    auto update_fn = [&key_value_cache = *key_value_cache_.get(),
+                      layer_indices = overlapped_kv_update_record->layer_indices,
+                      next_indices, total_length]() {
+      Trace::Scope trace_scope{"kv_cache_update", "worker"};
+      key_value_cache.PartialTokenGenerationUpdate(next_indices, total_length, layer_indices);
+    };
+    overlapped_kv_update_record->outstanding_update = key_value_cache_update_worker_thread_->Enqueue(update_fn);
+  }
+}
 
-    // Transfer ownership of all the non-managed outputs from the current pipeline state to the ortvalue store.
-    // All non managed outputs are assumed to be on CPU
-    for (size_t i = 0; i < pipeline_state->output_names_.size(); ++i) {
-      if (std::none_of(output_names_.begin(), output_names_.end(),
-                       [&](const std::string& elem) { return elem == pipeline_state->output_names_[i]; }) &&
-          std::none_of(input_names_.begin(), input_names_.end(),
-                       [&](const std::string& elem) { return elem == pipeline_state->output_names_[i]; })) {
-        auto forwarded_output = model_.config_->model.decoder.pipeline[pipeline_state->id_].output_names_forwarder.find(pipeline_state->output_names_[i]);
-        if (forwarded_output != model_.config_->model.decoder.pipeline[pipeline_state->id_].output_names_forwarder.end()) {
-          ortvalue_store_[forwarded_output->second] = std::unique_ptr<OrtValue>(pipeline_state->outputs_[i]);
-        } else {
-          ortvalue_store_[pipeline_state->output_names_[i]] = std::unique_ptr<OrtValue>(pipeline_state->outputs_[i]);
-        }
+void DecoderOnlyPipelineState::CollectStageOutputs(IntermediatePipelineState& pipeline_state, ValueStore& store) {
+  // Transfer ownership of all the non-managed outputs from the current pipeline state to the ortvalue store.
+  // All non managed outputs are assumed to be on CPU
+  for (size_t i = 0; i < pipeline_state.output_names_.size(); ++i) {
+    if (std::none_of(output_names_.begin(), output_names_.end(),
+                     [&](const std::string& elem) { return elem == pipeline_state.output_names_[i]; }) &&
+        std::none_of(input_names_.begin(), input_names_.end(),
+                     [&](const std::string& elem) { return elem == pipeline_state.output_names_[i]; })) {
+      auto& stored_output = store[GetStoredName(model_.config_->model.decoder.pipeline[pipeline_state.id_],
+                                                pipeline_state.output_names_[i])];
+      if (stored_output.get() != pipeline_state.outputs_[i]) {  // Reused outputs are already in the store
+        stored_output = std::unique_ptr<OrtValue>(pipeline_state.outputs_[i]);
       }
     }
   }
 }
 
+bool DecoderOnlyPipelineState::DependsOnAny(const IntermediatePipelineState& pipeline_state,
+                                            std::span<IntermediatePipelineState* const> stages) const {
+  const auto& pipeline = model_.config_->model.decoder.pipeline;
+  return std::any_of(stages.begin(), stages.end(), [&](const IntermediatePipelineState* stage) {
+    return DependsOn(pipeline[pipeline_state.id_], pipeline[stage->id_]);
+  });
+}
+
+bool DecoderOnlyPipelineState::ShouldRun(const IntermediatePipelineState& pipeline_state) const {
+  const auto& pipeline_model = model_.config_->model.decoder.pipeline[pipeline_state.id_];
+  return first_run_ ? pipeline_model.run_on_prompt : pipeline_model.run_on_token_gen;
+}
+
+// Splits the batch into micro batches and moves them through the pipeline models GPipe style: in step t, micro batch m
+// runs the pipeline model t - m. So every pipeline model works on a different micro batch at the same time, and a
+// micro batch only moves on to the next pipeline model after the previous one finished.
+void DecoderOnlyPipelineState::RunMicroBatches(int total_length, DeviceSpan<int32_t>& next_tokens,
+                                               DeviceSpan<int32_t> next_indices) {
+  // The managed inputs and outputs can be reallocated by every update, so the views of their rows are made for every run
+  const auto batch_size = static_cast<int64_t>(params_->BatchBeamSize());
+  for (auto& micro_batch : micro_batches_) {
+    micro_batch.managed_views.clear();
+    auto add_view = [&](const char* name, OrtValue* value) {
+      if (!value)
+        return;
+      auto shape = value->GetTensorTypeAndShapeInfo()->GetShape();
+      if (!shape.empty() && shape.front() == batch_size)
+        micro_batch.managed_views[name] = SliceRows(*value, micro_batch.begin, micro_batch.count);
+    };
+    for (size_t i = 0; i < input_names_.size(); i++)
+      add_view(input_names_[i], inputs_[i]);
+    for (size_t i = 0; i < output_names_.size(); i++)
+      add_view(output_names_[i], outputs_[i]);
+  }
+
+  std::vector<size_t> stages;  // The pipeline models to run, in order
+  for (auto& pipeline_state : pipeline_states_) {
+    if (ShouldRun(*pipeline_state))
+      stages.push_back(pipeline_state->id_);
+  }
+
+  const size_t micro_batch_count = micro_batches_.size();
+  for (size_t step = 0; step + 1 < stages.size() + micro_batch_count; step++) {
+    std::vector<std::pair<MicroBatch*, IntermediatePipelineState*>> work;
+    for (size_t m = 0; m < micro_batch_count && m <= step; m++) {
+      if (step - m < stages.size())
+        work.emplace_back(&micro_batches_[m], micro_batches_[m].states[stages[step - m]].get());
+    }
+
+    for (auto& [micro_batch, pipeline_state] : work)
+      PrepareStage(*pipeline_state, micro_batch->ortvalue_store, &micro_batch->managed_views);
+    GetThreadPool().ParallelFor(work.size(), [&](size_t i) { RunStage(*work[i].second, total_length, next_tokens, next_indices); });
+    for (auto& [micro_batch, pipeline_state] : work)
+      CollectStageOutputs(*pipeline_state, micro_batch->ortvalue_store);
+  }
+}
+
+void DecoderOnlyPipelineState::RunPipeline(int total_length, DeviceSpan<int32_t>& next_tokens,
+                                           DeviceSpan<int32_t> next_indices) {
+  if (!micro_batches_.empty()) {
+    RunMicroBatches(total_length, next_tokens, next_indices);
+    return;
+  }
+
+  // With run_pipeline_concurrently, consecutive pipeline models that don't depend on each other form a group that runs at
+  // the same time on the thread pool, otherwise every group is a single pipeline model
+  std::vector<IntermediatePipelineState*> group;
+  auto run_group = [&]() {
+    for (auto* pipeline_state : group)
+      PrepareStage(*pipeline_state, ortvalue_store_, nullptr);
+
+    if (group.size() == 1)
+      RunStage(*group.front(), total_length, next_tokens, next_indices);
+    else
+      GetThreadPool().ParallelFor(group.size(), [&](size_t i) { RunStage(*group[i], total_length, next_tokens, next_indices); });
+
+    for (auto* pipeline_state : group)
+      CollectStageOutputs(*pipeline_state, ortvalue_store_);
+    group.clear();
+  };
+
+  for (auto& pipeline_state : pipeline_states_) {
+    if (early_exit_ && pipeline_state->id_ > exit_stage_)
+      break;
+    if (!ShouldRun(*pipeline_state))
+      continue;
+
+    if (!group.empty() && (!model_.config_->model.decoder.run_pipeline_concurrently || DependsOnAny(*pipeline_state, group)))
+      run_group();
+    group.push_back(pipeline_state.get());
+  }
+
+  if (!group.empty())
+    run_group();
+}
+
 DeviceSpan<float> DecoderOnlyPipelineState::Run(int total_length, DeviceSpan<int32_t>& next_tokens,
                                                 DeviceSpan<int32_t> next_indices) {
+  // Once the prompt has been processed, a sliding window model only takes one token at a time. Tokens appended
+  // after that (e.g. the next turn of a conversation) are run one by one on top of the existing cache.
+  if (!first_run_ && model_.config_->model.decoder.sliding_window.has_value() && next_tokens.size() > 1) {
+    const int past_length = total_length - static_cast<int>(next_tokens.size());
+    for (size_t i = 0; i < next_tokens.size(); ++i) {
+      auto next_token = next_tokens.subspan(i, 1);
+      Run(past_length + static_cast<int>(i) + 1, next_token, next_indices);
+    }
+    return logits_.Get();
+  }
+
   UpdateInputsOutputs(next_tokens, next_indices, total_length);
 
-  size_t num_chunks{1};
-  if (first_run_ && model_.config_->model.decoder.sliding_window.has_value()) {
-    int window_size = model_.config_->model.decoder.sliding_window->window_size;
-    num_chunks = (next_tokens.size() + window_size - 1) / window_size;
+  std::vector<int> window_sizes{static_cast<int>(next_tokens.size())};
+  if (first_run_ && model_.config_->model.decoder.sliding_window.has_value())
+    window_sizes = GetPromptWindowSizes(*model_.config_->model.decoder.sliding_window, next_tokens.size());
+
+  const bool overlap_prompt_update = std::any_of(pipeline_overlapped_kv_cache_update_records_.begin(),
+                                                 pipeline_overlapped_kv_cache_update_records_.end(),
+                                                 [](const auto& record) { return record.has_value() && record->prompt; });
+  const size_t num_chunks = window_sizes.size();
+
+  // Only the last pipeline model of the last window lets the HTP drop to the idle performance mode after its run
+  IntermediatePipelineState* last_pipeline_state{};
+  if (model_.config_->model.decoder.session_options.idle_performance_mode) {
+    for (auto& pipeline_state : pipeline_states_) {
+      pipeline_state->ends_step_ = false;
+      if (ShouldRun(*pipeline_state))
+        last_pipeline_state = pipeline_state.get();
+    }
   }
 
+  size_t window_offset{};
   for (size_t i = 0; i < num_chunks; ++i) {
+    if (last_pipeline_state)
+      last_pipeline_state->ends_step_ = i == num_chunks - 1;
+    // The prompt models slide their layers of the KV cache as they finish, the next window's run of a model waits for them
+    partial_prompt_update_ = overlap_prompt_update && i < num_chunks - 1 && key_value_cache_->BeginPartialPromptUpdate(total_length);
     RunPipeline(total_length, next_tokens, next_indices);
 
     if (model_.config_->model.decoder.sliding_window.has_value() && i < num_chunks - 1) {
       // Sliding the window over the input_ids, key_cache, and value_cache, position_ids, and attention_mask
       input_ids_->Update(next_tokens);
-      if (key_value_cache_) key_value_cache_->Update(next_indices, total_length);
+      if (key_value_cache_ && !partial_prompt_update_) key_value_cache_->Update(next_indices, total_length);
       position_inputs_->Update(next_tokens, total_length, static_cast<int>(input_ids_->GetShape()[1]));
+
+      window_offset += window_sizes[i];
+      if (window_sizes[i + 1] != window_sizes[i]) {
+        // The logits of a smaller window have another shape
+        auto window_tokens = next_tokens.subspan(window_offset, window_sizes[i + 1]);
+        logits_.Update(window_tokens, window_sizes[i + 1]);
+      }
     }
   }
 
   // Clear the outputs of the pipeline models that are only run on prompt since this cannot happen earlier.
   if (!first_run_) {
-    for (auto& pipeline_state : pipeline_states_) {
-      if (!model_.config_->model.decoder.pipeline[pipeline_state->id_].run_on_token_gen) {
-        for (const auto& output_name : pipeline_state->output_names_) {
-          if (auto iter = ortvalue_store_.find(output_name); iter != ortvalue_store_.end()) {
-            ortvalue_store_.erase(iter);
+    auto clear_outputs = [&](const std::vector<std::unique_ptr<IntermediatePipelineState>>& states, ValueStore& store) {
+      for (auto& pipeline_state : states) {
+        if (!model_.config_->model.decoder.pipeline[pipeline_state->id_].run_on_token_gen) {
+          for (const auto& output_name : pipeline_state->output_names_) {
+            if (auto iter = store.find(output_name); iter != store.end()) {
+              store.erase(iter);
+            }
           }
         }
       }
-    }
+    };
+    clear_outputs(pipeline_states_, ortvalue_store_);
+    for (auto& micro_batch : micro_batches_)
+      clear_outputs(micro_batch.states, micro_batch.ortvalue_store);
   }
 
   first_run_ = false;
 
+  if (early_exit_)
+    return {};
   return logits_.Get();
 }
 
@@ -349,6 +661,7 @@ void DecoderOnlyPipelineState::UpdateInputsOutputs(DeviceSpan<int32_t>& next_tok
     if (outstanding_key_value_cache_partial_token_generation_update) {
       // If there is any outstanding partial KV cache update, don't update the KV cache here.
     } else {
+      Metrics::Timer timer{GeneratorMetrics::KeyValueCache};
       key_value_cache_->Update(beam_indices, total_length);
     }
   }
@@ -356,6 +669,43 @@ void DecoderOnlyPipelineState::UpdateInputsOutputs(DeviceSpan<int32_t>& next_tok
   logits_.Update(next_tokens, new_length);
 }
 
+void DecoderOnlyPipelineState::UpdateMemoryUsage(MemoryUsage& usage) const {
+  usage.Set(MemoryUsage::Logits, logits_.GetMemoryUsage());
+
+  // An overlapped KV cache update may still be changing the cache tensors, then the last measurement stays
+  const bool outstanding_update = std::any_of(pipeline_overlapped_kv_cache_update_records_.begin(),
+                                              pipeline_overlapped_kv_cache_update_records_.end(),
+                                              [](const std::optional<OverlappedKeyValueCacheUpdateRecord>& record) {
+                                                return record.has_value() && record->outstanding_update.valid();
+                                              });
+  if (!outstanding_update)
+    usage.Set(MemoryUsage::KeyValueCache, key_value_cache_ ? key_value_cache_->GetMemoryUsage() : 0);
+}
+
+void DecoderOnlyPipelineState::CheckRewindTo(size_t index) const {
+  if (key_value_cache_)
+    key_value_cache_->CheckRewindTo(index);
+}
+
+void DecoderOnlyPipelineState::RewindTo(size_t index) {
+  // Let any overlapped KV cache update finish before the cache is rewound
+  for (auto& record : pipeline_overlapped_kv_cache_update_records_) {
+    if (record.has_value() && record->outstanding_update.valid()) {
+      record->outstanding_update.get();
+    }
+  }
+
+  input_ids_->RewindTo(index);
+  position_inputs_->RewindTo(index);
+  if (key_value_cache_) {
+    key_value_cache_->RewindTo(index);
+  }
+
+  if (index == 0) {
+    first_run_ = true;  // The next tokens are a new prompt
+  }
+}
+
 OrtValue* DecoderOnlyPipelineState::GetOutput(const char* name) {
   // Check the ortvalue store to search if name is one of the non-managed output.
   auto it = ortvalue_store_.find(name);
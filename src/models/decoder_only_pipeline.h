@@ -4,7 +4,9 @@
 #pragma once
 
 #include <future>
+#include <mutex>
 #include <optional>
+#include <unordered_map>
 
 #include "../worker_thread.h"
 #include "model.h"
@@ -26,7 +28,22 @@ struct DecoderOnlyPipelineModel : Model {
   std::unique_ptr<State> CreateState(DeviceSpan<int32_t> sequence_lengths,
                                      const GeneratorParams& params) const override;
 
-  std::vector<std::unique_ptr<OrtSession>> sessions_;
+  void LoadSessions() const override;
+
+  // Only valid after the first CreateState, which loads the sessions that weren't needed to create the model
+  OrtSession& GetSession(size_t index) const { return *sessions_[index]; }
+
+ private:
+  std::shared_ptr<OrtSession> LoadSession(size_t index) const;
+  bool SharesEpContexts(size_t index) const;
+
+  // The last session with shared EP contexts to be loaded, it stops the sharing
+  std::optional<size_t> last_shared_ep_context_session_;
+
+  OrtEnv& ort_env_;
+  // Shared with every other model that loads the same file with the same session options
+  mutable std::vector<std::shared_ptr<OrtSession>> sessions_;
+  mutable std::once_flag sessions_loaded_;
 };
 
 struct IntermediatePipelineState : State {
@@ -45,10 +62,15 @@ struct IntermediatePipelineState : State {
 
   bool SupportsPrimaryDevice() const;
 
+  bool HasStaticShape(const std::string& output_name) const;  // True if the session declares no symbolic dimensions for the output
+  std::unique_ptr<OrtValue> CreateStaticShapeOutput(const std::string& output_name, Ort::Allocator& allocator) const;
+  bool MatchesStaticShape(const std::string& output_name, OrtValue& value) const;  // True if 'value' has the output's static shape and type
+
   size_t id_;
 
  private:
   const DecoderOnlyPipelineModel& model_;
+  std::unordered_map<std::string, std::pair<std::vector<int64_t>, ONNXTensorElementDataType>> static_shape_outputs_;  // Shape and type
 };
 
 struct DecoderOnlyPipelineState : State {
@@ -63,6 +85,10 @@ struct DecoderOnlyPipelineState : State {
 
   OrtValue* GetOutput(const char* name) override;
 
+  void RewindTo(size_t index) override;
+  void CheckRewindTo(size_t index) const override;
+  void UpdateMemoryUsage(MemoryUsage& usage) const override;
+
   void RunPipeline(int total_length, DeviceSpan<int32_t>& next_tokens,
                    DeviceSpan<int32_t> next_indices);
 
@@ -70,24 +96,49 @@ struct DecoderOnlyPipelineState : State {
   void UpdateInputsOutputs(DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> next_indices,
                            int total_length);
 
+  using ValueStore = std::unordered_map<std::string, std::unique_ptr<OrtValue>>;
+
+  // RunPipeline steps for a single pipeline model. Prepare and collect touch the value store, so only running them can
+  // happen concurrently.
+  void PrepareStage(IntermediatePipelineState& pipeline_state, ValueStore& store, const ValueStore* managed_views);
+  void RunStage(IntermediatePipelineState& pipeline_state, int total_length, DeviceSpan<int32_t>& next_tokens,
+                DeviceSpan<int32_t> next_indices);
+  void CollectStageOutputs(IntermediatePipelineState& pipeline_state, ValueStore& store);
+  bool ShouldRun(const IntermediatePipelineState& pipeline_state) const;  // Checks run_on_prompt/run_on_token_gen
+  void RunMicroBatches(int total_length, DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> next_indices);
+  bool DependsOnAny(const IntermediatePipelineState& pipeline_state, std::span<IntermediatePipelineState* const> stages) const;
+
   const DecoderOnlyPipelineModel& model_;
   std::vector<std::unique_ptr<IntermediatePipelineState>> pipeline_states_;
 
   struct OverlappedKeyValueCacheUpdateRecord {
     std::vector<size_t> layer_indices{};     // indicates which layers of the KV cache are to be updated
     std::future<void> outstanding_update{};  // future for an outstanding update task
+    bool prompt{};                           // Of a prompt model, updated between the prompt windows (see KeyValueCache::PartialPromptUpdate)
   };
 
   std::vector<std::optional<OverlappedKeyValueCacheUpdateRecord>> pipeline_overlapped_kv_cache_update_records_;
 
   // Stores all the outputs from the previous pipeline state(s)
-  std::unordered_map<std::string, std::unique_ptr<OrtValue>> ortvalue_store_;
+  ValueStore ortvalue_store_;
+
+  // pipeline_micro_batches: each micro batch has its own states of the pipeline models and its own intermediate values
+  struct MicroBatch {
+    size_t begin{}, count{};  // Rows of the batch
+    std::vector<std::unique_ptr<IntermediatePipelineState>> states;
+    ValueStore managed_views;  // Views of the micro batch's rows of the managed inputs and outputs
+    ValueStore ortvalue_store;
+  };
+  std::vector<MicroBatch> micro_batches_;
+
+  size_t exit_stage_{};  // With early_exit, the pipeline model that outputs the exit logits. The ones after it are skipped while early_exit_ is set.
 
   std::unique_ptr<InputIDs> input_ids_;
   Logits logits_{*this};
 
   std::unique_ptr<KeyValueCache> key_value_cache_;
   const bool do_key_value_cache_partial_token_generation_update_;
+  bool partial_prompt_update_{};  // Set while the current prompt window's KV cache update is split over the prompt models
   std::optional<WorkerThread> key_value_cache_update_worker_thread_{};
 
   std::unique_ptr<PositionInputs> position_inputs_;
@@ -0,0 +1,88 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "device_arena.h"
+
+namespace Generators {
+
+DeviceArena::DeviceArena(Ort::Allocator& allocator) : OrtAllocator{}, allocator_{allocator} {
+  version = ORT_API_VERSION;
+  OrtAllocator::Alloc = [](OrtAllocator* this_, size_t size) { return static_cast<DeviceArena*>(this_)->AllocBlock(size); };
+  OrtAllocator::Free = [](OrtAllocator* this_, void* p) { static_cast<DeviceArena*>(this_)->FreeBlock(p); };
+  OrtAllocator::Info = [](const OrtAllocator* this_) -> const OrtMemoryInfo* {
+    return &static_cast<const DeviceArena*>(this_)->allocator_.GetInfo();
+  };
+}
+
+DeviceArena::~DeviceArena() {
+  ReleaseFreeBlocks();
+  // Blocks still handed out are the caller's leak, but they were allocated from the device allocator so return them too
+  for (auto& [p, size] : block_sizes_)
+    allocator_.Free(p);
+}
+
+size_t DeviceArena::GetSizeClass(size_t size) {
+  constexpr size_t min_size = 256;
+  constexpr size_t large_size = 1024 * 1024;
+
+  size_t power_of_two = min_size;
+  while (power_of_two < size)
+    power_of_two *= 2;
+  if (power_of_two <= large_size)
+    return power_of_two;
+
+  const size_t step = power_of_two / 8;
+  return (size + step - 1) / step * step;
+}
+
+void* DeviceArena::AllocBlock(size_t size) {
+  const size_t size_class = GetSizeClass(size);
+  {
+    std::scoped_lock lock{mutex_};
+    auto it = free_blocks_.find(size_class);
+    if (it != free_blocks_.end() && !it->second.empty()) {
+      void* p = it->second.back();
+      it->second.pop_back();
+      block_sizes_.emplace(p, size_class);
+      return p;
+    }
+  }
+
+  // Allocate outside of the lock, device allocations can be slow
+  void* p = allocator_.Alloc(size_class);
+  std::scoped_lock lock{mutex_};
+  block_sizes_.emplace(p, size_class);
+  return p;
+}
+
+void DeviceArena::FreeBlock(void* p) {
+  if (!p)
+    return;
+
+  std::scoped_lock lock{mutex_};
+  auto it = block_sizes_.find(p);
+  assert(it != block_sizes_.end());  // Called from tensor destructors, so this can't throw
+  if (it == block_sizes_.end())
+    return;
+  free_blocks_[it->second].push_back(p);
+  block_sizes_.erase(it);
+}
+
+size_t DeviceArena::GetCachedBytes() const {
+  std::scoped_lock lock{mutex_};
+  size_t bytes = 0;
+  for (auto& [size_class, blocks] : free_blocks_)
+    bytes += size_class * blocks.size();
+  return bytes;
+}
+
+void DeviceArena::ReleaseFreeBlocks() {
+  std::scoped_lock lock{mutex_};
+  for (auto& [size_class, blocks] : free_blocks_) {
+    for (void* p : blocks)
+      allocator_.Free(p);
+  }
+  free_blocks_.clear();
+}
+
+}  // namespace Generators
@@ -0,0 +1,40 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+#include "onnxruntime_api.h"
+
+namespace Generators {
+
+// Caching allocator in front of a device allocator, shared by every generator of a model (see Config::Model::device_arena).
+// Sizes are rounded up to a size class and freed blocks go to the free list of their class instead of back to the device,
+// so the buffers of a destroyed generator are handed to the next one instead of fragmenting device memory.
+struct DeviceArena : OrtAllocator {
+  DeviceArena(Ort::Allocator& allocator);
+  DeviceArena(const DeviceArena&) = delete;
+  DeviceArena& operator=(const DeviceArena&) = delete;
+  ~DeviceArena();
+
+  // The arena as an Ort::Allocator, to pass wherever the device allocator would be used
+  Ort::Allocator& GetAllocator() { return *static_cast<Ort::Allocator*>(static_cast<OrtAllocator*>(this)); }
+
+  void* AllocBlock(size_t size);
+  void FreeBlock(void* p);
+  void ReleaseFreeBlocks();  // Returns every cached block to the device allocator
+
+  size_t GetCachedBytes() const;  // Bytes of the blocks in the free lists
+
+  // Powers of two up to 1MB, above that steps of 1/8th of the power of two, so at most 12.5% of a large block is unused
+  static size_t GetSizeClass(size_t size);
+
+ private:
+  Ort::Allocator& allocator_;
+
+  mutable std::mutex mutex_;
+  std::unordered_map<void*, size_t> block_sizes_;               // Size class of every block handed out, protected by mutex_
+  std::unordered_map<size_t, std::vector<void*>> free_blocks_;  // By size class, protected by mutex_
+};
+
+}  // namespace Generators
@@ -15,7 +15,8 @@ Embeddings::Embeddings(State& state, Embeddings::Mode mode, const std::string& n
                 ? model_.session_info_->GetInputDataType(name)
                 : model_.session_info_->GetOutputDataType(name)},
       mode_{mode},
-      name_{name} {
+      name_{name},
+      embeddings_buffer_{model_.p_device_->GetAllocator(), static_cast<size_t>(shape_[0] * shape_[2]) * SizeOf(type_), false} {
   // Embeddings are only transient inputs and outputs.
   // They are never the user provided/requested model inputs/outputs
   // So only create the transient input and reuse that ortvalue for previous
@@ -25,7 +26,7 @@ Embeddings::Embeddings(State& state, Embeddings::Mode mode, const std::string& n
       sb_embeddings_ = state_.GetCapturedGraphInfo()->sb_embeddings_.get();
     }
 
-    embeddings_ = OrtValue::CreateTensor(model_.p_device_->GetAllocator(), shape_, type_);
+    embeddings_ = embeddings_buffer_.CreateTensor(shape_, type_);
   }
 }
 
@@ -54,7 +55,7 @@ void Embeddings::UpdateSequenceLength(size_t new_length) {
 
     if (mode_ == Embeddings::Mode::Input) {
       if (!sb_embeddings_) {
-        embeddings_ = OrtValue::CreateTensor(model_.p_device_->GetAllocator(), shape_, type_);
+        embeddings_ = embeddings_buffer_.CreateTensor(shape_, type_);
       } else {
         embeddings_ = sb_embeddings_->CreateTensorOnStaticBuffer(shape_, type_);
       }
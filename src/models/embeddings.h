@@ -3,6 +3,8 @@
 
 #pragma once
 
+#include "static_buffer.h"
+
 namespace Generators {
 
 struct Embeddings {
@@ -32,6 +34,7 @@ struct Embeddings {
   ONNXTensorElementDataType type_;
   const Mode mode_{};
   const std::string name_;
+  TensorBuffer embeddings_buffer_;  // Sized once to the prompt, the generated tokens' embeddings are views into it
   std::unique_ptr<OrtValue> embeddings_;
   size_t index_{};
   StaticBuffer* sb_embeddings_{};
@@ -44,9 +44,34 @@ void PresetExtraInputs::Add() {
   }
 }
 
+std::shared_ptr<OrtValue> Model::GetSharedInput(const std::shared_ptr<Tensor>& tensor) const {
+  auto& source = *tensor->ort_tensor_;
+  if (p_device_inputs_->GetType() == DeviceType::CPU || source.GetTensorMemoryInfo().GetDeviceType() != OrtMemoryInfoDeviceType_CPU)
+    return {};
+
+  std::lock_guard lock{shared_inputs_mutex_};
+  auto& shared = shared_inputs_[tensor.get()];
+  if (auto value = shared.value.lock(); value && shared.tensor.lock() == tensor)
+    return value;
+
+  auto type_and_shape_info = source.GetTensorTypeAndShapeInfo();
+  std::shared_ptr<OrtValue> value = OrtValue::CreateTensor(GetAllocator(*p_device_inputs_), type_and_shape_info->GetShape(),
+                                                           type_and_shape_info->GetElementType());
+  auto device_tensor = ByteWrapTensor(*p_device_inputs_, *value);
+  copy(std::span{source.GetTensorData<uint8_t>(), device_tensor.size()}, device_tensor.CpuSpan());
+  device_tensor.CopyCpuToDevice();
+  shared = {tensor, value};
+
+  // Drop the entries of the tensors no generator uses anymore
+  std::erase_if(shared_inputs_, [](const auto& entry) { return entry.second.value.expired(); });
+  return value;
+}
+
 ExtraInputs::ExtraInputs(State& state)
     : state_{state} {
   extra_inputs_.reserve(state_.params_->extra_inputs.size());
+  for (auto& extra_input : state_.params_->extra_inputs)
+    shared_extra_inputs_.push_back(model_.GetSharedInput(extra_input.tensor));
 
   if (state_.GetCapturedGraphInfo()) {
     owned_extra_inputs_.reserve(state_.params_->extra_inputs.size());
@@ -60,9 +85,10 @@ ExtraInputs::ExtraInputs(State& state)
       extra_inputs_.push_back(owned_extra_inputs_.back().get());
     }
   } else {
-    // We don't use graph capture, so simply use the existing pointers
-    for (auto& extra_input : state_.params_->extra_inputs) {
-      extra_inputs_.push_back(extra_input.tensor->ort_tensor_.get());
+    // We don't use graph capture, so simply use the existing pointers (or the shared uploads of them)
+    for (size_t i = 0; i < state_.params_->extra_inputs.size(); ++i) {
+      auto& shared = shared_extra_inputs_[i];
+      extra_inputs_.push_back(shared ? shared.get() : state_.params_->extra_inputs[i].tensor->ort_tensor_.get());
     }
   }
 }
@@ -74,10 +100,26 @@ void ExtraInputs::Add() {
     state_.inputs_.push_back(extra_inputs_[i]);
   }
 
-  // Copy the data from the CPU-backed ORT value to the static buffers
+  // Copy the data from the user's ORT value to the static buffers, a device tensor (or the shared upload of a CPU
+  // tensor) is copied on the device. A static buffer that already holds the shared upload is left as it is.
   for (int i = 0; i < sb_extra_inputs_.size(); ++i) {
     auto tensor = ByteWrapTensor(*model_.p_device_, *extra_inputs_[i]);
-    auto source = std::span{state_.params_->extra_inputs[i].tensor->ort_tensor_->GetTensorData<uint8_t>(), tensor.size()};
+    const auto& name = state_.params_->extra_inputs[i].name;
+    auto& sb_sources = state_.GetCapturedGraphInfo()->sb_extra_input_sources_;
+    if (auto& shared = shared_extra_inputs_[i]) {
+      if (sb_sources[name].lock() != shared) {
+        tensor.CopyFrom(ByteWrapTensor(*model_.p_device_, *shared));
+        sb_sources[name] = shared;
+      }
+      continue;
+    }
+    sb_sources.erase(name);
+    auto& source_value = *state_.params_->extra_inputs[i].tensor->ort_tensor_;
+    if (source_value.GetTensorMemoryInfo().GetDeviceType() != OrtMemoryInfoDeviceType_CPU) {
+      tensor.CopyFrom(ByteWrapTensor(*model_.p_device_, source_value));
+      continue;
+    }
+    auto source = std::span{source_value.GetTensorData<uint8_t>(), tensor.size()};
     copy(source, tensor.CpuSpan());
     tensor.CopyCpuToDevice();
   }
@@ -25,6 +25,7 @@ struct ExtraInputs {
   const Model& model_{state_.model_};
   std::vector<OrtValue*> extra_inputs_;
   std::vector<std::unique_ptr<OrtValue>> owned_extra_inputs_;
+  std::vector<std::shared_ptr<OrtValue>> shared_extra_inputs_;  // See Model::GetSharedInput, null for tensors used as they are
   std::unordered_map<std::string, StaticBuffer*> sb_extra_inputs_;
   PresetExtraInputs registrar_{state_};
 };
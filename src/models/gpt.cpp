@@ -5,7 +5,7 @@ namespace Generators {
 
 Gpt_Model::Gpt_Model(std::unique_ptr<Config> config, OrtEnv& ort_env)
     : Model{std::move(config)} {
-  session_decoder_ = OrtSession::Create(ort_env, (config_->config_path / fs::path(config_->model.decoder.filename)).c_str(), session_options_.get());
+  session_decoder_ = CreateSession(ort_env, config_->model.decoder.filename, config_->model.decoder.session_options, *session_options_);
   InitDeviceAllocator(*session_decoder_);
 }
 
@@ -38,11 +38,68 @@ void Gpt_State::RewindTo(size_t index) {
   kv_cache_.RewindTo(index);
 }
 
+bool Gpt_State::ForkFrom(State& source_state, size_t length) {
+  auto* source = dynamic_cast<Gpt_State*>(&source_state);
+  if (!source || !kv_cache_.ForkFrom(source->kv_cache_, length))
+    return false;
+  position_inputs_.SetPastLength(static_cast<int>(length));
+  return true;
+}
+
+bool Gpt_State::MergeRows(DeviceSpan<int32_t>& tokens, int length, std::span<const StateRow> rows) {
+  // The extra outputs are only set up by the first Run
+  if (!first_run_ || params_->search.num_beams != 1 || !params_->extra_inputs.empty() ||
+      model_.session_decoder_->GetOutputNames().size() != output_names_.size())
+    return false;
+
+  std::vector<Gpt_State*> sources;
+  for (const auto& row : rows) {
+    auto* source = dynamic_cast<Gpt_State*>(row.state);
+    if (!source)
+      return false;
+    sources.push_back(source);
+  }
+
+  // The position inputs are derived from the pad tokens, as for a padded prompt
+  input_ids_.Update(tokens);
+  position_inputs_.Update(tokens, length, length);
+  kv_cache_.Update({}, length);
+  for (size_t r = 0; r < rows.size(); r++)
+    kv_cache_.CopyRowFrom(sources[r]->kv_cache_, rows[r].row, rows[r].begin, rows[r].length, r, static_cast<size_t>(length) - rows[r].length);
+  first_run_ = false;
+  return true;
+}
+
+bool Gpt_State::LoadKeyValueCache(StateReader& reader, size_t length) {
+  if (!kv_cache_.Load(reader, length))
+    return false;
+  position_inputs_.SetPastLength(static_cast<int>(length));
+  return true;
+}
+
+bool Gpt_State::EvictKeyValueCache(size_t length, size_t begin, size_t count) {
+  if (!kv_cache_.Evict(length, begin, count))
+    return false;
+  position_inputs_.SetPastLength(static_cast<int>(length - count));
+  return true;
+}
+
+bool Gpt_State::CompactBatch(std::span<const int32_t> rows) {
+  input_ids_.CompactBatch(rows.size());
+  position_inputs_.CompactBatch(rows);
+  kv_cache_.CompactBatch(rows);
+  logits_.CompactBatch(rows.size());
+  return true;
+}
+
 void Gpt_State::UpdateInputsOutputs(DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> beam_indices, int total_length) {
   input_ids_.Update(next_tokens);
   size_t new_length = static_cast<size_t>(input_ids_.GetShape()[1]);
   position_inputs_.Update(next_tokens, total_length, static_cast<int>(new_length));
-  kv_cache_.Update(beam_indices, total_length);
+  {
+    Metrics::Timer timer{GeneratorMetrics::KeyValueCache};
+    kv_cache_.Update(beam_indices, total_length);
+  }
   logits_.Update(next_tokens, new_length);
 }
 
@@ -21,6 +21,18 @@ struct Gpt_State : State {
   DeviceSpan<float> Run(int current_length, DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> next_indices) override;
 
   void RewindTo(size_t index) override;
+  bool ForkFrom(State& source, size_t length) override;
+  bool MergeRows(DeviceSpan<int32_t>& tokens, int length, std::span<const StateRow> rows) override;
+  bool SaveKeyValueCache(StateWriter& writer, size_t length) override { return kv_cache_.Save(writer, length); }
+  bool LoadKeyValueCache(StateReader& reader, size_t length) override;
+  bool EvictKeyValueCache(size_t length, size_t begin, size_t count) override;
+  bool OffloadKeyValueCache(const fs::path& path) override { return kv_cache_.Offload(path); }
+  void RestoreKeyValueCache() override { kv_cache_.Restore(); }
+  bool CompactBatch(std::span<const int32_t> rows) override;
+  void UpdateMemoryUsage(MemoryUsage& usage) const override {
+    usage.Set(MemoryUsage::KeyValueCache, kv_cache_.GetMemoryUsage());
+    usage.Set(MemoryUsage::Logits, logits_.GetMemoryUsage());
+  }
 
  private:
   void UpdateInputsOutputs(DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> beam_indices, int current_length);
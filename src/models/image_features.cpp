@@ -61,7 +61,9 @@ void ImageFeatures::ReuseImageFeaturesBuffer(ImageFeatures& other) {
   }
 
   // Share the output ImageFeatures OrtValue* from other with the input ImageFeatures for this.
+  // The shape goes along, so the next Update(false) replaces them with empty image features.
   image_features_ = std::move(other.image_features_);
+  shape_ = other.shape_;
   state_.inputs_[index_] = other.state_.outputs_[other.index_];
 }
 
@@ -7,7 +7,7 @@ namespace Generators {
 DefaultInputIDs::DefaultInputIDs(State& state)
     : state_{state} {
   name_ = model_.config_->model.decoder.inputs.input_ids.c_str();
-  shape_ = {state_.params_->BatchBeamSize(), 0};
+  shape_ = {state_.BatchBeamSize(), 0};
   type_ = model_.session_info_->GetInputDataType(name_);
 
   if (model_.session_info_->HasInput(model_.config_->model.decoder.inputs.current_sequence_length) &&
@@ -45,8 +45,6 @@ void DefaultInputIDs::Add() {
 }
 
 void DefaultInputIDs::Update(DeviceSpan<int32_t> new_tokens) {
-  auto new_tokens_cpu = new_tokens.CopyDeviceToCpu();
-
   const auto get_unpadded_sequence_length = [](std::span<const int32_t> input_ids, int32_t pad_token_id) {
     for (int32_t i = 0; i < input_ids.size(); i++) {
       if (input_ids[i] == pad_token_id)
@@ -59,13 +57,14 @@ void DefaultInputIDs::Update(DeviceSpan<int32_t> new_tokens) {
     if (state_.params_->BatchBeamSize() != 1) {
       throw std::runtime_error("Batch size must be 1 for current_sequence_length and past_sequence_length inputs");
     }
-    auto new_sequence_length = get_unpadded_sequence_length(new_tokens_cpu, model_.config_->model.pad_token_id);
+    // Only these scalar inputs need the tokens on the CPU, input_ids itself is copied device to device
+    auto new_sequence_length = get_unpadded_sequence_length(new_tokens.CopyDeviceToCpu(), model_.config_->model.pad_token_id);
     *current_sequence_length_->GetTensorMutableData<int32_t>() += new_sequence_length;
     *past_sequence_length_->GetTensorMutableData<int32_t>() += new_sequence_length;
   }
 
   // For beam search, resize input_ids shape based on new_tokens
-  size_t sequence_length = static_cast<size_t>(new_tokens.size()) / state_.params_->BatchBeamSize();
+  size_t sequence_length = static_cast<size_t>(new_tokens.size()) / shape_[0];
   if (is_prompt_ && state_.params_->search.num_beams > 1)
     sequence_length = static_cast<size_t>(new_tokens.size()) / state_.params_->search.batch_size;
 
@@ -98,6 +97,11 @@ void DefaultInputIDs::Update(DeviceSpan<int32_t> new_tokens) {
   is_prompt_ = false;
 }
 
+void DefaultInputIDs::CompactBatch(size_t batch_size) {
+  shape_[0] = static_cast<int64_t>(batch_size);
+  shape_[1] = 0;  // Reallocated by the next Update
+}
+
 WindowedInputIDs::WindowedInputIDs(State& state) : state_{state} {
   name_ = model_.config_->model.decoder.inputs.input_ids.c_str();
 
@@ -127,20 +131,27 @@ void WindowedInputIDs::Add() {
 
 void WindowedInputIDs::Update(DeviceSpan<int32_t> new_tokens) {
   if (window_index_ == 0) {
-    num_windows_ = (new_tokens.size() + window_size_ - 1) / window_size_;
+    window_sizes_ = GetPromptWindowSizes(*model_.config_->model.decoder.sliding_window, new_tokens.size());
+    window_offset_ = 0;
 
+    shape_[1] = window_sizes_[0];
     value_ = OrtValue::CreateTensor(model_.allocator_cpu_, shape_, type_);
 
-    // new_tokens will always be padded so that it's size is a multiple of window_size_
+    // new_tokens will always be padded so that it's size is the sum of the window sizes
     // new_tokens -> [0, a, b, c, d, e]
     // window_size = 3, num_windows = 2, pad_token = 0
     // window_index = 0, value_ -> [0, a, b]
-    std::copy_n(new_tokens.Span().begin(), window_size_, value_->GetTensorMutableData<int32_t>());
-  } else if (window_index_ < num_windows_) {
+    std::copy_n(new_tokens.Span().begin(), shape_[1], value_->GetTensorMutableData<int32_t>());
+  } else if (window_index_ < window_sizes_.size()) {
     // new_tokens -> [a, b, c, d, e]
     // window_size = 3, num_windows = 2
     // window_index = 1, value_ -> [c, d, e]
-    std::copy_n(new_tokens.Span().begin() + window_index_ * window_size_, window_size_, value_->GetTensorMutableData<int32_t>());
+    window_offset_ += shape_[1];
+    if (shape_[1] != window_sizes_[window_index_]) {
+      shape_[1] = window_sizes_[window_index_];
+      value_ = OrtValue::CreateTensor(model_.allocator_cpu_, shape_, type_);
+    }
+    std::copy_n(new_tokens.Span().begin() + window_offset_, shape_[1], value_->GetTensorMutableData<int32_t>());
   } else {
     // All prompt token chunks have been processed. Now we process the tokens generated by the model.
     // new_tokens -> [f]
@@ -157,6 +168,14 @@ void WindowedInputIDs::Update(DeviceSpan<int32_t> new_tokens) {
   window_index_++;
 }
 
+void WindowedInputIDs::RewindTo(size_t index) {
+  // Later tokens are processed one at a time, so there's nothing to rewind unless the prompt is processed again
+  if (index == 0) {
+    window_index_ = 0;
+    shape_[1] = window_size_;
+  }
+}
+
 std::unique_ptr<InputIDs> CreateInputIDs(State& state) {
   if (state.model_.config_->model.decoder.sliding_window.has_value()) {
     return std::make_unique<WindowedInputIDs>(state);
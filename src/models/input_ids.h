@@ -9,6 +9,7 @@ struct InputIDs {
   virtual void Add() = 0;
   virtual std::array<int64_t, 2> GetShape() const = 0;
   virtual void Update(DeviceSpan<int32_t> next_tokens) = 0;
+  virtual void RewindTo(size_t index) {}
 };
 
 struct DefaultInputIDs : InputIDs {
@@ -22,6 +23,8 @@ struct DefaultInputIDs : InputIDs {
   // Resize input_ids based on size of next_tokens.
   // Update value with next_tokens.
   void Update(DeviceSpan<int32_t> next_tokens) override;
+  // The following Updates only receive the tokens of 'batch_size' sequences (see State::CompactBatch)
+  void CompactBatch(size_t batch_size);
 
   std::array<int64_t, 2> GetShape() const override { return shape_; }
   const char* name_;
@@ -47,6 +50,7 @@ struct DefaultInputIDs : InputIDs {
 // Certain models can only process a fixed number of tokens at a time.
 // For example, given a prompt with 120 tokens, and a model that can only process 20 tokens at a time,
 // this class will split the prompt into 6 windows of 20 tokens each.
+// If the model also takes smaller windows, the end of the prompt may be split into those (see GetPromptWindowSizes).
 // At each update step, the next window of tokens is processed.
 // This is done until all windows have been processed before switching to the model-generated tokens
 // which are processed one token at a time.
@@ -58,6 +62,7 @@ struct WindowedInputIDs : public InputIDs {
 
   void Add() override;
   void Update(DeviceSpan<int32_t> next_tokens) override;
+  void RewindTo(size_t index) override;  // Rewinding to 0 restarts prompt processing
   std::array<int64_t, 2> GetShape() const override { return shape_; }
 
  private:
@@ -65,8 +70,9 @@ struct WindowedInputIDs : public InputIDs {
   const Model& model_{state_.model_};
   size_t input_index_{~0U};
   size_t window_size_{};
-  size_t num_windows_{};
+  std::vector<int> window_sizes_;  // Of the prompt windows
   size_t window_index_{};
+  size_t window_offset_{};  // Of the current prompt window in the prompt
   const char* name_;
   std::array<int64_t, 2> shape_{};
   ONNXTensorElementDataType type_;
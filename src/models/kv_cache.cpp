@@ -5,13 +5,347 @@
 #include "model.h"
 #include "kv_cache.h"
 #include "windowed_kv_cache.h"
+#include "paged_kv_cache.h"
+#include "../state_blob.h"
 
 namespace Generators {
 
+namespace {
+
+// The number of entries the shared past/present buffers grow by (see DefaultKeyValueCache::ReserveSharedBuffers)
+constexpr int64_t shared_buffer_growth = 512;
+
+// CPU cache tensors at least this large are copied with streaming stores (see StreamingCopy)
+constexpr size_t streaming_copy_bytes = 4 * 1024 * 1024;
+
+// Runs fn(i) for every cache tensor index in [0, count). On the CPU the per-layer copies are plain memory copies, so
+// they're spread over the shared thread pool. Other devices queue their copies on one stream, so they stay in order here.
+// The pool's threads have none of the caller's thread_local scopes (Memory::Scope, StreamScope), so fn only copies, the
+// tensors it copies to are created by the caller beforehand.
+template <typename Fn>
+void ForEachCacheTensor(DeviceInterface& device, int count, Fn&& fn) {
+  if (device.GetType() == DeviceType::CPU && count > 1)
+    GetThreadPool().ParallelFor(static_cast<size_t>(count), [&](size_t i) { fn(static_cast<int>(i)); });
+  else
+    for (int i = 0; i < count; i++)
+      fn(i);
+}
+
+// Copies between two cache tensor spans, with streaming stores for the copies of large CPU tensors
+void CopyCacheBytes(DeviceInterface& device, DeviceSpan<uint8_t> dest, DeviceSpan<uint8_t> source, bool streaming) {
+  if (streaming && device.GetType() == DeviceType::CPU)
+    StreamingCopy(dest.CpuSpan().data(), source.CpuSpan().data(), source.size());
+  else
+    dest.CopyFrom(source);
+}
+
+// Float conversions of the key-value cache entries that are quantized for a snapshot
+void ConvertToFloat32(std::span<const uint8_t> data, ONNXTensorElementDataType type, std::span<float> values) {
+  if (type == Ort::TypeToTensorType<float>)
+    std::memcpy(values.data(), data.data(), values.size_bytes());
+  else if (type == Ort::TypeToTensorType<Ort::Float16_t>)
+    ConvertFloat16ToFloat32({reinterpret_cast<const uint16_t*>(data.data()), values.size()}, values);
+  else if (type == Ort::TypeToTensorType<Ort::BFloat16_t>)
+    ConvertBFloat16ToFloat32({reinterpret_cast<const uint16_t*>(data.data()), values.size()}, values);
+  else
+    throw std::runtime_error("Only float, float16 and bfloat16 key-value caches can be quantized");
+}
+
+void ConvertFromFloat32(std::span<const float> values, ONNXTensorElementDataType type, std::span<uint8_t> data) {
+  if (type == Ort::TypeToTensorType<float>)
+    std::memcpy(data.data(), values.data(), values.size_bytes());
+  else if (type == Ort::TypeToTensorType<Ort::Float16_t>)
+    ConvertFloat32ToFloat16(values, {reinterpret_cast<uint16_t*>(data.data()), values.size()});
+  else if (type == Ort::TypeToTensorType<Ort::BFloat16_t>)
+    ConvertFloat32ToBFloat16(values, {reinterpret_cast<uint16_t*>(data.data()), values.size()});
+  else
+    throw std::runtime_error("Only float, float16 and bfloat16 key-value caches can be quantized");
+}
+
+// Writes the entries of 'data' (of 'entry_size' values each) as a float scale followed by the int8 values
+void WriteQuantized(StateWriter& writer, std::span<const uint8_t> data, ONNXTensorElementDataType type, size_t entry_size) {
+  std::vector<float> values(data.size() / SizeOf(type));
+  ConvertToFloat32(data, type, values);
+  std::vector<int8_t> quantized(entry_size);
+  for (size_t begin = 0; begin < values.size(); begin += entry_size) {
+    float max = 0.0f;
+    for (size_t i = 0; i < entry_size; i++)
+      max = std::max(max, std::abs(values[begin + i]));
+    const float scale = max / 127.0f;
+    for (size_t i = 0; i < entry_size; i++)
+      quantized[i] = scale ? static_cast<int8_t>(std::lround(values[begin + i] / scale)) : 0;
+    writer.Write<float>(scale);
+    writer.WriteBytes({reinterpret_cast<const uint8_t*>(quantized.data()), quantized.size()});
+  }
+}
+
+void ReadQuantized(StateReader& reader, std::span<uint8_t> data, ONNXTensorElementDataType type, size_t entry_size) {
+  std::vector<float> values(data.size() / SizeOf(type));
+  for (size_t begin = 0; begin < values.size(); begin += entry_size) {
+    const float scale = reader.Read<float>();
+    auto quantized = reader.ReadBytes(entry_size);
+    for (size_t i = 0; i < entry_size; i++)
+      values[begin + i] = static_cast<int8_t>(quantized[i]) * scale;
+  }
+  ConvertFromFloat32(values, type, data);
+}
+
+// Moves the rotary position embedding of cached keys 'delta' positions on (or back when negative). The rotations of a
+// frequency compose, so the key cached for position p becomes the one for position p + delta without knowing p.
+struct KeyRotation {
+  KeyRotation(const Config::Model::Decoder::RotaryEmbedding& config, size_t head_size, double delta)
+      : dim_{config.dim ? static_cast<size_t>(config.dim) : head_size}, interleaved_{config.interleaved} {
+    if (dim_ % 2 || dim_ > head_size)
+      throw std::runtime_error("rotary_embedding dim (" + std::to_string(dim_) + ") must be even and at most head_size (" +
+                               std::to_string(head_size) + ")");
+    for (size_t i = 0; i < dim_ / 2; i++) {
+      const double angle = delta * config.position_scale *
+                           std::pow(static_cast<double>(config.theta), -2.0 * static_cast<double>(i) / static_cast<double>(dim_));
+      cos_.push_back(static_cast<float>(std::cos(angle)));
+      sin_.push_back(static_cast<float>(std::sin(angle)));
+    }
+  }
+
+  // Rotates the keys in 'data', entries of 'head_size' values
+  void Apply(std::span<uint8_t> data, ONNXTensorElementDataType type, size_t head_size) const {
+    std::vector<float> values(data.size() / SizeOf(type));
+    ConvertToFloat32(data, type, values);
+    const size_t half = dim_ / 2;
+    for (size_t begin = 0; begin < values.size(); begin += head_size) {
+      float* entry = values.data() + begin;
+      for (size_t i = 0; i < half; i++) {
+        float& x1 = entry[interleaved_ ? 2 * i : i];
+        float& x2 = entry[interleaved_ ? 2 * i + 1 : i + half];
+        const float a = x1, b = x2;
+        x1 = a * cos_[i] - b * sin_[i];
+        x2 = b * cos_[i] + a * sin_[i];
+      }
+    }
+    ConvertFromFloat32(values, type, data);
+  }
+
+ private:
+  size_t dim_;
+  bool interleaved_;
+  std::vector<float> cos_, sin_;  // Of the rotation by 'delta' positions, per pair
+};
+
+// Re-encodes cached keys from the short LongRoPE factors to the long ones (or back). Unlike a KeyRotation the angle
+// depends on the position: the rotated dimensions of the key for position p are rotated by
+// p * (frequency_to - frequency_from) and rescaled by mscale_to / mscale_from.
+struct RotaryFactorSwitch {
+  RotaryFactorSwitch(const Config::Model::Decoder::RotaryEmbedding& config, size_t head_size, bool to_long)
+      : dim_{config.dim ? static_cast<size_t>(config.dim) : head_size}, interleaved_{config.interleaved} {
+    if (dim_ % 2 || dim_ > head_size || config.short_factor.size() != dim_ / 2 || config.long_factor.size() != dim_ / 2)
+      throw std::runtime_error("rotary_embedding short_factor and long_factor must have dim / 2 (" + std::to_string(dim_ / 2) +
+                               ") values");
+    const auto& from = to_long ? config.short_factor : config.long_factor;
+    const auto& to = to_long ? config.long_factor : config.short_factor;
+    for (size_t i = 0; i < dim_ / 2; i++) {
+      const double frequency = config.position_scale *
+                               std::pow(static_cast<double>(config.theta), -2.0 * static_cast<double>(i) / static_cast<double>(dim_));
+      delta_.push_back(frequency / to[i] - frequency / from[i]);
+    }
+    scale_ = to_long ? config.long_mscale / config.short_mscale : config.short_mscale / config.long_mscale;
+  }
+
+  // Re-encodes the keys in 'data', entries of 'head_size' values for the consecutive positions from 0 on
+  void Apply(std::span<uint8_t> data, ONNXTensorElementDataType type, size_t head_size) const {
+    std::vector<float> values(data.size() / SizeOf(type));
+    ConvertToFloat32(data, type, values);
+    const size_t half = dim_ / 2;
+    for (size_t position = 0; position * head_size < values.size(); position++) {
+      float* entry = values.data() + position * head_size;
+      for (size_t i = 0; i < half; i++) {
+        const double angle = static_cast<double>(position) * delta_[i];
+        const float cos = static_cast<float>(std::cos(angle)) * scale_, sin = static_cast<float>(std::sin(angle)) * scale_;
+        float& x1 = entry[interleaved_ ? 2 * i : i];
+        float& x2 = entry[interleaved_ ? 2 * i + 1 : i + half];
+        const float a = x1, b = x2;
+        x1 = a * cos - b * sin;
+        x2 = b * cos + a * sin;
+      }
+    }
+    ConvertFromFloat32(values, type, data);
+  }
+
+ private:
+  size_t dim_;
+  bool interleaved_;
+  std::vector<double> delta_;  // Per pair, of the angle per position
+  float scale_;
+};
+
+// Writes the first 'length' entries along 'sequence_axis' of every tensor, which are all of 'shape'
+void SaveTensors(StateWriter& writer, DeviceInterface& device, std::span<const std::unique_ptr<OrtValue>> tensors,
+                 std::span<const int64_t> shape, size_t sequence_axis, size_t length, ONNXTensorElementDataType type) {
+  // A quantized cache is marked by an int8 type ahead of its own, the caches themselves are never int8
+  const bool quantize = writer.quantize_key_value_cache_;
+  if (quantize)
+    writer.Write<int32_t>(ONNX_TENSOR_ELEMENT_DATA_TYPE_INT8);
+  writer.Write<int32_t>(type);
+  writer.Write<uint64_t>(tensors.size());
+  writer.Write<uint64_t>(shape.size());
+  for (size_t i = 0; i < shape.size(); i++)
+    writer.Write<int64_t>(i == sequence_axis ? static_cast<int64_t>(length) : shape[i]);
+
+  // Every index of the axes before the sequence axis is a row, of which the first 'length' entries are kept
+  const auto rows = std::accumulate(shape.begin(), shape.begin() + sequence_axis, int64_t{1}, std::multiplies<int64_t>());
+  const auto entry_bytes = std::accumulate(shape.begin() + sequence_axis + 1, shape.end(), static_cast<int64_t>(SizeOf(type)),
+                                           std::multiplies<int64_t>());
+  const auto row_bytes = shape[sequence_axis] * entry_bytes;
+  const auto saved_row_bytes = static_cast<int64_t>(length) * entry_bytes;
+  const auto entry_size = static_cast<size_t>(entry_bytes) / SizeOf(type);
+  for (auto& tensor : tensors) {
+    auto data = ByteWrapTensor(device, *tensor).CopyDeviceToCpu();
+    for (int64_t row = 0; row < rows; row++) {
+      if (quantize)
+        WriteQuantized(writer, data.subspan(row * row_bytes, saved_row_bytes), type, entry_size);
+      else
+        writer.WriteBytes(data.subspan(row * row_bytes, saved_row_bytes));
+    }
+  }
+}
+
+// Reads what SaveTensors wrote into the 'length' entries from 'offset' on of the tensors, the entries past them are
+// undefined. With a 'rotation', the tensors alternate keys and values and the keys are rotated.
+void LoadTensors(StateReader& reader, DeviceInterface& device, std::span<const std::unique_ptr<OrtValue>> tensors,
+                 std::span<const int64_t> shape, size_t sequence_axis, size_t length, ONNXTensorElementDataType type,
+                 size_t offset = 0, const KeyRotation* rotation = nullptr) {
+  auto saved_type = reader.Read<int32_t>();
+  const bool quantized = saved_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_INT8;
+  if (quantized)
+    saved_type = reader.Read<int32_t>();
+  bool matches = saved_type == type && reader.Read<uint64_t>() == tensors.size() && reader.Read<uint64_t>() == shape.size();
+  for (size_t i = 0; matches && i < shape.size(); i++)
+    matches = reader.Read<int64_t>() == (i == sequence_axis ? static_cast<int64_t>(length) : shape[i]);
+  if (!matches)
+    throw std::runtime_error("The saved key-value cache doesn't match the key-value cache of the model");
+
+  const auto rows = std::accumulate(shape.begin(), shape.begin() + sequence_axis, int64_t{1}, std::multiplies<int64_t>());
+  const auto entry_bytes = std::accumulate(shape.begin() + sequence_axis + 1, shape.end(), static_cast<int64_t>(SizeOf(type)),
+                                           std::multiplies<int64_t>());
+  const auto row_bytes = shape[sequence_axis] * entry_bytes;
+  const auto saved_row_bytes = static_cast<int64_t>(length) * entry_bytes;
+  const auto entry_size = static_cast<size_t>(entry_bytes) / SizeOf(type);
+  const auto offset_bytes = static_cast<int64_t>(offset) * entry_bytes;
+  for (size_t i = 0; i < tensors.size(); i++) {
+    auto data = ByteWrapTensor(device, *tensors[i]);
+    // The entries before 'offset' are kept, so they're copied to the host with the rest
+    auto cpu = offset ? data.CopyDeviceToCpu() : data.CpuSpan();
+    for (int64_t row = 0; row < rows; row++) {
+      auto entries = cpu.subspan(row * row_bytes + offset_bytes, saved_row_bytes);
+      if (quantized)
+        ReadQuantized(reader, entries, type, entry_size);
+      else
+        copy(reader.ReadBytes(saved_row_bytes), entries);
+      if (rotation && i % 2 == 0)
+        rotation->Apply(entries, type, entry_size);
+    }
+    data.CopyCpuToDevice();
+  }
+}
+
+// Drops the 'count' entries from 'begin' on of the first 'length' along 'sequence_axis' of 'source', which is of 'shape',
+// and moves the entries after them down. The result goes to 'target', rows of 'target_length' entries, which can be
+// 'source' itself. With a 'rotation', the moved entries are keys and are rotated.
+void EvictEntries(DeviceInterface& device, OrtValue& source, OrtValue& target, std::span<const int64_t> shape,
+                  size_t sequence_axis, size_t target_length, size_t length, size_t begin, size_t count,
+                  ONNXTensorElementDataType type, const KeyRotation* rotation) {
+  const auto rows = std::accumulate(shape.begin(), shape.begin() + sequence_axis, int64_t{1}, std::multiplies<int64_t>());
+  const auto entry_bytes = static_cast<size_t>(std::accumulate(shape.begin() + sequence_axis + 1, shape.end(),
+                                                               static_cast<int64_t>(SizeOf(type)), std::multiplies<int64_t>()));
+  const auto row_bytes = static_cast<size_t>(shape[sequence_axis]) * entry_bytes;
+  const auto target_row_bytes = target_length * entry_bytes;
+  const auto moved_bytes = (length - begin - count) * entry_bytes;
+  auto source_data = ByteWrapTensor(device, source);
+  auto target_data = &target == &source ? source_data : ByteWrapTensor(device, target);
+  auto source_cpu = source_data.CopyDeviceToCpu();
+  auto target_cpu = target_data.CpuSpan();
+  for (int64_t row = 0; row < rows; row++) {
+    const auto* source_row = source_cpu.data() + row * row_bytes;
+    auto* target_row = target_cpu.data() + row * target_row_bytes;
+    if (&target != &source)
+      std::memcpy(target_row, source_row, begin * entry_bytes);
+    std::memmove(target_row + begin * entry_bytes, source_row + (begin + count) * entry_bytes, moved_bytes);
+    if (rotation)
+      rotation->Apply({target_row + begin * entry_bytes, moved_bytes}, type, entry_bytes / SizeOf(type));
+  }
+  target_data.CopyCpuToDevice();
+}
+
+}  // namespace
+
+bool OffloadedTensors::Offload(DeviceInterface& device, std::span<std::unique_ptr<OrtValue>* const> tensors, const fs::path& path) {
+  if (is_offloaded_)
+    throw std::runtime_error("The key-value cache is already offloaded.");
+
+  // CPU tensors already live in host memory, there is nothing to gain from a host copy
+  const bool to_file = !path.string().empty();
+  if (!to_file && device.GetType() == DeviceType::CPU)
+    return false;
+
+  std::ofstream file;
+  if (to_file) {
+    file = path.open_for_write(std::ios::binary);
+    if (!file.is_open())
+      throw std::runtime_error("Error opening " + path.string() + " to offload the key-value cache");
+  }
+
+  for (auto* tensor : tensors) {
+    auto& entry = entries_.emplace_back(Entry{tensor, (*tensor)->GetTensorTypeAndShapeInfo()->GetShape(), ByteWrapTensor(device, **tensor)});
+    auto data = entry.host.CopyDeviceToCpu();
+    if (to_file) {
+      file.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+      entry.host = {};  // Frees the host copy
+    } else if (data.data() == entry.host.Span().data()) {
+      // The device memory is CPU accessible (e.g. WebGPU), so it needs a copy that outlives the tensor
+      auto host = GetDeviceInterface(DeviceType::CPU)->Allocate<uint8_t>(data.size());
+      copy(std::span<const uint8_t>{data}, host.CpuSpan());
+      entry.host = host;
+    }
+    *tensor = nullptr;
+  }
+
+  if (to_file && !file)
+    throw std::runtime_error("Error writing the key-value cache to " + path.string());
+
+  path_ = path;
+  is_offloaded_ = true;
+  return true;
+}
+
+void OffloadedTensors::Restore(DeviceInterface& device, Ort::Allocator& allocator, ONNXTensorElementDataType type) {
+  std::ifstream file;
+  const bool from_file = !path_.string().empty();
+  if (from_file) {
+    file = path_.open(std::ios::binary);
+    if (!file.is_open())
+      throw std::runtime_error("Error opening " + path_.string() + " to restore the key-value cache");
+  }
+
+  for (auto& entry : entries_) {
+    *entry.tensor = OrtValue::CreateTensor(allocator, entry.shape, type);
+    auto data = ByteWrapTensor(device, **entry.tensor);
+    if (from_file)
+      file.read(reinterpret_cast<char*>(data.CpuSpan().data()), static_cast<std::streamsize>(data.size()));
+    else
+      copy(std::span<const uint8_t>{entry.host.CpuSpan()}, data.CpuSpan());
+    data.CopyCpuToDevice();
+  }
+
+  if (from_file && !file)
+    throw std::runtime_error("Error reading the key-value cache from " + path_.string());
+
+  entries_.clear();
+  path_ = {};
+  is_offloaded_ = false;
+}
+
 CombinedKeyValueCache::CombinedKeyValueCache(State& state)
     : state_{state},
       layer_count_{model_.config_->model.decoder.num_hidden_layers},
-      shape_{2, state_.params_->BatchBeamSize(), model_.config_->model.decoder.num_key_value_heads, 0, model_.config_->model.decoder.head_size} {
+      shape_{2, state_.BatchBeamSize(), model_.config_->model.decoder.num_key_value_heads, 0, model_.config_->model.decoder.head_size} {
   pasts_.resize(layer_count_);
   presents_.reserve(layer_count_);
 
@@ -77,15 +411,75 @@ void CombinedKeyValueCache::RewindTo(size_t index) {
       pasts_[i] = nullptr;
       state_.inputs_[input_index_ + i] = empty_past_.get();
     }
-  } else if (type_ == Ort::TypeToTensorType<float>) {
-    RewindPastTensorsTo<float>(index);
   } else {
-    RewindPastTensorsTo<Ort::Float16_t>(index);
+    RewindPastTensorsTo(index, presents_);
+  }
+}
+
+bool CombinedKeyValueCache::ForkFrom(KeyValueCache& source_cache, size_t length) {
+  auto* source = dynamic_cast<CombinedKeyValueCache*>(&source_cache);
+  if (!source || length == 0 || source->shape_[1] != shape_[1] || source->shape_[3] < static_cast<int64_t>(length))
+    return false;
+
+  shape_ = source->shape_;
+  RewindPastTensorsTo(length, source->CurrentCaches());
+  is_first_update_ = true;
+  return true;
+}
+
+bool CombinedKeyValueCache::Save(StateWriter& writer, size_t length) {
+  if (length == 0 || shape_[3] < static_cast<int64_t>(length))
+    return false;
+  SaveTensors(writer, Device(), CurrentCaches(), shape_, 3, length, type_);
+  return true;
+}
+
+bool CombinedKeyValueCache::Evict(size_t length, size_t begin, size_t count) {
+  // The keys and values share a tensor, rotary embeddings of the keys aren't re-encoded
+  if (model_.config_->model.decoder.rotary_embedding || shape_[3] != static_cast<int64_t>(length))
+    return false;
+
+  const auto& caches = CurrentCaches();
+  auto new_shape = shape_;
+  new_shape[3] = static_cast<int64_t>(length - count);
+  std::vector<std::unique_ptr<OrtValue>> pasts(layer_count_);
+  for (int i = 0; i < layer_count_; i++) {
+    pasts[i] = OrtValue::CreateTensor(Allocator(), new_shape, type_);
+    EvictEntries(Device(), *caches[i], *pasts[i], shape_, 3, length - count, length, begin, count, type_, nullptr);
+  }
+  shape_ = new_shape;
+  pasts_ = std::move(pasts);
+  for (int i = 0; i < layer_count_; i++)
+    state_.inputs_[input_index_ + i] = pasts_[i].get();
+  is_first_update_ = true;
+  return true;
+}
+
+bool CombinedKeyValueCache::Load(StateReader& reader, size_t length) {
+  if (length == 0)
+    return false;
+  shape_[3] = static_cast<int64_t>(length);
+  for (int i = 0; i < layer_count_; i++)
+    pasts_[i] = OrtValue::CreateTensor(Allocator(), shape_, type_);
+  LoadTensors(reader, Device(), pasts_, shape_, 3, length, type_);
+  for (int i = 0; i < layer_count_; i++)
+    state_.inputs_[input_index_ + i] = pasts_[i].get();
+  is_first_update_ = true;
+  return true;
+}
+
+void CombinedKeyValueCache::RewindPastTensorsTo(size_t index, std::span<const std::unique_ptr<OrtValue>> caches) {
+  if (type_ == Ort::TypeToTensorType<float>) {
+    RewindPastTensorsTo<float>(index, caches);
+  } else if (type_ == Ort::TypeToTensorType<Ort::BFloat16_t>) {
+    RewindPastTensorsTo<Ort::BFloat16_t>(index, caches);
+  } else {
+    RewindPastTensorsTo<Ort::Float16_t>(index, caches);
   }
 }
 
 template <typename T>
-void CombinedKeyValueCache::RewindPastTensorsTo(size_t index) {
+void CombinedKeyValueCache::RewindPastTensorsTo(size_t index, std::span<const std::unique_ptr<OrtValue>> caches) {
   assert(index > 0 && shape_[3] >= static_cast<int64_t>(index));
   std::array<int64_t, 5> new_shape = shape_;
   new_shape[3] = static_cast<int>(index);
@@ -95,7 +489,7 @@ void CombinedKeyValueCache::RewindPastTensorsTo(size_t index) {
   shape_[3] = new_shape[3];
 
   for (int i = 0; i < layer_count_; i++) {
-    OrtValue& present = *presents_[i];
+    OrtValue& present = *caches[i];
     std::unique_ptr<OrtValue> past = OrtValue::CreateTensor(Allocator(), shape_, type_);
     auto present_span = WrapTensor<T>(Device(), present);
     auto past_span = WrapTensor<T>(Device(), *past);
@@ -140,16 +534,100 @@ void CombinedKeyValueCache::PickPastState(DeviceSpan<int32_t> beam_indices_devic
 void CombinedKeyValueCache::PickPastState(DeviceSpan<int32_t> beam_indices, int index) {
   if (type_ == Ort::TypeToTensorType<float>) {
     PickPastState<float>(beam_indices, index);
+  } else if (type_ == Ort::TypeToTensorType<Ort::BFloat16_t>) {
+    PickPastState<Ort::BFloat16_t>(beam_indices, index);
   } else {
     PickPastState<Ort::Float16_t>(beam_indices, index);
   }
 }
 
+bool CombinedKeyValueCache::Offload(const fs::path& path) {
+  // See DefaultKeyValueCache::Offload
+  if (!(is_first_update_ && pasts_[0])) {
+    for (auto& past : pasts_)
+      past = nullptr;
+  }
+
+  std::vector<std::unique_ptr<OrtValue>*> tensors;
+  for (int i = 0; i < layer_count_; i++) {
+    tensors.push_back(&presents_[i]);
+    if (pasts_[i])
+      tensors.push_back(&pasts_[i]);
+  }
+  return offloaded_.Offload(Device(), tensors, path);
+}
+
+size_t CombinedKeyValueCache::GetMemoryUsage() const {
+  return GetTensorsSizeInBytes(pasts_) + GetTensorsSizeInBytes(presents_);
+}
+
+void CombinedKeyValueCache::CompactBatch(std::span<const int32_t> rows) {
+  // Between Runs the presents hold the cache, the next Update moves them to the pasts. The batch is the second
+  // dimension, so the rows are gathered from the key half and the value half.
+  const size_t row_size_bytes = static_cast<size_t>(shape_[2] * shape_[3] * shape_[4]) * SizeOf(type_);
+  const size_t batch_size = static_cast<size_t>(shape_[1]);
+  shape_[1] = static_cast<int64_t>(rows.size());
+
+  for (int i = 0; i < layer_count_; i++) {
+    auto present = OrtValue::CreateTensor(Allocator(), shape_, type_);
+    auto source = ByteWrapTensor(Device(), *presents_[i]);
+    auto target = ByteWrapTensor(Device(), *present);
+    for (size_t half = 0; half < 2; half++) {
+      for (size_t j = 0; j < rows.size(); j++)
+        target.subspan((half * rows.size() + j) * row_size_bytes, row_size_bytes).CopyFrom(source.subspan((half * batch_size + rows[j]) * row_size_bytes, row_size_bytes));
+    }
+    presents_[i] = std::move(present);
+    state_.outputs_[output_index_ + i] = presents_[i].get();
+  }
+}
+
+void CombinedKeyValueCache::CopyRowFrom(CombinedKeyValueCache& source, size_t source_row, size_t begin, size_t length, size_t row, size_t offset) {
+  assert(source.type_ == type_ && source_row < static_cast<size_t>(source.shape_[1]));
+  const size_t source_length = static_cast<size_t>(source.shape_[3]);
+  if (begin + length > source_length || offset + length > static_cast<size_t>(shape_[3]))
+    throw std::runtime_error("CombinedKeyValueCache::CopyRowFrom - the row doesn't fit the key-value cache");
+
+  // The batch is the second dimension, so the row is copied in the key half and in the value half
+  const size_t batch_size = static_cast<size_t>(shape_[1]), source_batch_size = static_cast<size_t>(source.shape_[1]);
+  const size_t heads = static_cast<size_t>(shape_[2]);
+  const size_t entry_bytes = static_cast<size_t>(shape_[4]) * SizeOf(type_);
+  const size_t head_bytes = static_cast<size_t>(shape_[3]) * entry_bytes;
+  const size_t source_head_bytes = source_length * entry_bytes;
+  const auto& source_caches = source.CurrentCaches();
+  for (int i = 0; i < layer_count_; i++) {
+    auto present = ByteWrapTensor(Device(), *presents_[i]);
+    auto source_present = ByteWrapTensor(Device(), *source_caches[i]);
+    for (size_t half = 0; half < 2; half++) {
+      for (size_t head = 0; head < heads; head++) {
+        // See DefaultKeyValueCache::CopyRowFrom
+        auto row_head = present.subspan(((half * batch_size + row) * heads + head) * head_bytes, head_bytes);
+        if (offset)
+          row_head.subspan(0, offset * entry_bytes).Zero();
+        auto source_head = source_present.subspan(((half * source_batch_size + source_row) * heads + head) * source_head_bytes, source_head_bytes);
+        row_head.subspan(offset * entry_bytes, length * entry_bytes).CopyFrom(source_head.subspan(begin * entry_bytes, length * entry_bytes));
+      }
+    }
+  }
+}
+
+void CombinedKeyValueCache::Restore() {
+  if (!offloaded_.IsOffloaded())
+    return;
+  offloaded_.Restore(Device(), Allocator(), type_);
+
+  for (int i = 0; i < layer_count_; i++) {
+    state_.outputs_[output_index_ + i] = presents_[i].get();
+    state_.inputs_[input_index_ + i] = pasts_[i] ? pasts_[i].get() : empty_past_.get();
+  }
+}
+
 DefaultKeyValueCache::DefaultKeyValueCache(State& state)
     : state_{state},
       layer_count_{model_.config_->model.decoder.num_hidden_layers},
-      past_present_share_buffer_{state_.params_->search.past_present_share_buffer && (state_.params_->search.num_beams == 1 || model_.config_->model.type == "whisper")},
-      shape_{state_.params_->BatchBeamSize(), model_.config_->model.decoder.num_key_value_heads, 0, model_.config_->model.decoder.head_size} {
+      past_present_share_buffer_{state_.params_->search.past_present_share_buffer &&
+                                 (state_.params_->search.num_beams == 1 || model_.config_->model.type == "whisper" ||
+                                  model_.session_info_->HasInput(model_.config_->model.decoder.inputs.cache_indirection))},
+      shape_{state_.BatchBeamSize(), model_.config_->model.decoder.num_key_value_heads, 0, model_.config_->model.decoder.head_size} {
   if (g_log.enabled && g_log.warning && past_present_share_buffer_ != state_.params_->search.past_present_share_buffer)
     Log("warning", "past_present_share_buffer search option set to true, but has been disabled due to the current configuration. See https://aka.ms/generate_config for details");
 
@@ -166,6 +644,7 @@ DefaultKeyValueCache::DefaultKeyValueCache(State& state)
 
   // Derive the KV data type from the KV input 0
   type_ = model_.session_info_->GetInputDataType(input_name_strings_[0]);
+  CheckKeyValueCacheType(model_, type_);
 
   empty_past_ = OrtValue::CreateTensor(Allocator(), shape_, type_);
 
@@ -178,6 +657,12 @@ DefaultKeyValueCache::DefaultKeyValueCache(State& state)
       for (int i = 0; i < layer_count_ * 2; ++i) {
         sb_kv_caches_.push_back(state_.GetCapturedGraphInfo()->sb_kv_caches_[i].get());
       }
+    } else if (model_.config_->model.type != "whisper" &&
+               !model_.session_info_->HasInput(model_.config_->model.decoder.inputs.cache_indirection)) {
+      // Captured graphs are bound to max_length buffers and a cache indirection is max_length long, otherwise the
+      // buffers grow with the sequence so a generous max_length doesn't reserve memory that's never used
+      grow_shared_buffers_ = true;
+      shape_[2] = std::min<int64_t>(shape_[2], shared_buffer_growth);
     }
   }
 
@@ -187,7 +672,7 @@ DefaultKeyValueCache::DefaultKeyValueCache(State& state)
           sb_kv_caches_.empty() ? OrtValue::CreateTensor(Allocator(), shape_, type_)
                                 : sb_kv_caches_[i]->CreateTensorOnStaticBuffer(shape_, type_));
       // Zero the memory so we don't leak any data from the previous run
-      // WebGPU device has no Zero() implementation yet. Since this zeroing is optional we disable it for WebGPU for now
+      // WebGPU zeroes through a CPU staging copy of the whole buffer. Since this zeroing is optional we skip it for WebGPU
       if (Device().GetType() != DeviceType::WEBGPU) {
         ByteWrapTensor(Device(), *presents_.back()).Zero();
       }
@@ -232,19 +717,24 @@ void DefaultKeyValueCache::Add() {
 }
 
 void DefaultKeyValueCache::Update(DeviceSpan<int32_t> beam_indices, int total_length) {
-  // If we're sharing past & present buffers there is nothing to do here, so early exit
-  if (past_present_share_buffer_)
+  // If we're sharing past & present buffers there is nothing to do here besides making room, so early exit
+  if (past_present_share_buffer_) {
+    ReserveSharedBuffers(static_cast<size_t>(total_length));
     return;
+  }
 
   if (!is_first_update_) {
-    for (int i = 0; i < layer_count_ * 2; i++) {
-      if (beam_indices.empty()) {
+    if (beam_indices.empty()) {
+      for (int i = 0; i < layer_count_ * 2; i++)
         pasts_[i] = std::move(presents_[i]);
-      } else {
-        PickPastState(beam_indices, i);
-      }
-      state_.inputs_[input_index_ + i] = pasts_[i].get();
+    } else {
+      std::span<const int32_t> cpu_beam_indices = beam_indices.CopyDeviceToCpu();  // Once for all of the layers
+      for (int i = 0; i < layer_count_ * 2; i++)
+        pasts_[i] = OrtValue::CreateTensor(Allocator(), shape_, type_);
+      ForEachCacheTensor(Device(), layer_count_ * 2, [&](int i) { PickPastState(cpu_beam_indices, i); });
     }
+    for (int i = 0; i < layer_count_ * 2; i++)
+      state_.inputs_[input_index_ + i] = pasts_[i].get();
   }
 
   shape_[2] = total_length;
@@ -269,74 +759,325 @@ void DefaultKeyValueCache::RewindTo(size_t index) {
       pasts_[i] = nullptr;
       state_.inputs_[input_index_ + i] = empty_past_.get();
     }
-  } else if (type_ == Ort::TypeToTensorType<float>) {
-    RewindPastTensorsTo<float>(index);
   } else {
-    RewindPastTensorsTo<Ort::Float16_t>(index);
+    RewindPastTensorsTo(index, presents_);
   }
 }
 
-template <typename T>
-void DefaultKeyValueCache::RewindPastTensorsTo(size_t index) {
+bool DefaultKeyValueCache::ForkFrom(KeyValueCache& source_cache, size_t length) {
+  auto* source = dynamic_cast<DefaultKeyValueCache*>(&source_cache);
+  if (!source || length == 0 || source->past_present_share_buffer_ != past_present_share_buffer_ ||
+      source->shape_[0] != shape_[0] || source->shape_[2] < static_cast<int64_t>(length))
+    return false;
+
+  if (past_present_share_buffer_) {
+    // Both buffers are equally long, the entries past 'length' are overwritten before they're read
+    ReserveSharedBuffers(static_cast<size_t>(source->shape_[2]));
+    if (source->shape_ != shape_)
+      return false;
+    for (int i = 0; i < layer_count_ * 2; i++)
+      ByteWrapTensor(Device(), *presents_[i]).CopyFrom(ByteWrapTensor(Device(), *source->presents_[i]));
+    return true;
+  }
+
+  shape_ = source->shape_;
+  RewindPastTensorsTo(length, source->CurrentCaches());
+  is_first_update_ = true;
+  return true;
+}
+
+bool DefaultKeyValueCache::Save(StateWriter& writer, size_t length) {
+  if (length == 0 || shape_[2] < static_cast<int64_t>(length))
+    return false;
+  // The shared buffers are max_length long, only the entries the tokens filled are saved
+  SaveTensors(writer, Device(), past_present_share_buffer_ ? presents_ : CurrentCaches(), shape_, 2, length, type_);
+  return true;
+}
+
+bool DefaultKeyValueCache::Load(StateReader& reader, size_t length) {
+  if (past_present_share_buffer_)
+    ReserveSharedBuffers(length);
+  if (length == 0 || (past_present_share_buffer_ && shape_[2] < static_cast<int64_t>(length)))
+    return false;
+  if (past_present_share_buffer_) {
+    LoadTensors(reader, Device(), presents_, shape_, 2, length, type_);
+    return true;
+  }
+
+  shape_[2] = static_cast<int64_t>(length);
+  for (int i = 0; i < layer_count_ * 2; i++)
+    pasts_[i] = OrtValue::CreateTensor(Allocator(), shape_, type_);
+  LoadTensors(reader, Device(), pasts_, shape_, 2, length, type_);
+  for (int i = 0; i < layer_count_ * 2; i++)
+    state_.inputs_[input_index_ + i] = pasts_[i].get();
+  is_first_update_ = true;
+  return true;
+}
+
+bool DefaultKeyValueCache::Append(StateReader& reader, size_t length, size_t position) {
+  // Only the rotary embedding of the keys depends on the position, the 8-bit caches can't be rotated without their scales.
+  // The LongRoPE frequencies depend on the sequence length, so its keys aren't moved.
+  const auto& rotary_embedding = model_.config_->model.decoder.rotary_embedding;
+  if (length == 0 || !rotary_embedding || !rotary_embedding->long_factor.empty() || model_.config_->model.decoder.kv_cache_quantization)
+    return false;
+  const KeyRotation rotation{*rotary_embedding, static_cast<size_t>(shape_[3]), static_cast<double>(position)};
+
+  if (past_present_share_buffer_) {
+    ReserveSharedBuffers(position + length);
+    if (shape_[2] < static_cast<int64_t>(position + length))
+      return false;
+    LoadTensors(reader, Device(), presents_, shape_, 2, length, type_, position, &rotation);
+    return true;
+  }
+  if (shape_[2] != static_cast<int64_t>(position))
+    return false;
+
+  // The new pasts hold the current entries followed by the loaded ones
+  const auto& caches = CurrentCaches();
+  std::array<int64_t, 4> new_shape = shape_;
+  new_shape[2] = static_cast<int64_t>(position + length);
+  const auto element_size = static_cast<int64_t>(SizeOf(type_));
+  const auto head_bytes = shape_[2] * shape_[3] * element_size;
+  const auto new_head_bytes = new_shape[2] * shape_[3] * element_size;
+  std::vector<std::unique_ptr<OrtValue>> pasts(layer_count_ * 2);
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    pasts[i] = OrtValue::CreateTensor(Allocator(), new_shape, type_);
+    auto past = ByteWrapTensor(Device(), *pasts[i]);
+    auto current = ByteWrapTensor(Device(), *caches[i]);
+    for (int64_t j = 0; j < shape_[0] * shape_[1]; j++)
+      past.subspan(j * new_head_bytes, head_bytes).CopyFrom(current.subspan(j * head_bytes, head_bytes));
+  }
+  shape_ = new_shape;
+  LoadTensors(reader, Device(), pasts, shape_, 2, length, type_, position, &rotation);
+  pasts_ = std::move(pasts);
+  for (int i = 0; i < layer_count_ * 2; i++)
+    state_.inputs_[input_index_ + i] = pasts_[i].get();
+  is_first_update_ = true;
+  return true;
+}
+
+bool DefaultKeyValueCache::Evict(size_t length, size_t begin, size_t count) {
+  // The moved keys are rotated back by 'count' positions, the 8-bit caches can't be rotated without their scales, nor
+  // LongRoPE keys whose frequencies depend on the sequence length
+  const auto& rotary_embedding = model_.config_->model.decoder.rotary_embedding;
+  if (rotary_embedding && (model_.config_->model.decoder.kv_cache_quantization || !rotary_embedding->long_factor.empty()))
+    return false;
+  std::optional<KeyRotation> rotation;
+  if (rotary_embedding)
+    rotation.emplace(*rotary_embedding, static_cast<size_t>(shape_[3]), -static_cast<double>(count));
+
+  if (past_present_share_buffer_) {
+    for (int i = 0; i < layer_count_ * 2; i++)
+      EvictEntries(Device(), *presents_[i], *presents_[i], shape_, 2, static_cast<size_t>(shape_[2]), length, begin, count,
+                   type_, i % 2 == 0 && rotation ? &*rotation : nullptr);
+    return true;
+  }
+  if (shape_[2] != static_cast<int64_t>(length))
+    return false;
+
+  const auto& caches = CurrentCaches();
+  std::array<int64_t, 4> new_shape = shape_;
+  new_shape[2] = static_cast<int64_t>(length - count);
+  std::vector<std::unique_ptr<OrtValue>> pasts(layer_count_ * 2);
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    pasts[i] = OrtValue::CreateTensor(Allocator(), new_shape, type_);
+    EvictEntries(Device(), *caches[i], *pasts[i], shape_, 2, length - count, length, begin, count, type_,
+                 i % 2 == 0 && rotation ? &*rotation : nullptr);
+  }
+  shape_ = new_shape;
+  pasts_ = std::move(pasts);
+  for (int i = 0; i < layer_count_ * 2; i++)
+    state_.inputs_[input_index_ + i] = pasts_[i].get();
+  is_first_update_ = true;
+  return true;
+}
+
+bool DefaultKeyValueCache::SwitchRotaryFactors(size_t length, std::span<const size_t> padding, bool long_factors) {
+  const auto& rotary_embedding = model_.config_->model.decoder.rotary_embedding;
+  if (!rotary_embedding || rotary_embedding->long_factor.empty() || model_.config_->model.decoder.kv_cache_quantization ||
+      padding.size() != static_cast<size_t>(shape_[0]))
+    return false;
+  if (past_present_share_buffer_ ? shape_[2] < static_cast<int64_t>(length) : shape_[2] != static_cast<int64_t>(length))
+    return false;
+  const RotaryFactorSwitch rotation{*rotary_embedding, static_cast<size_t>(shape_[3]), long_factors};
+
+  // The keys are re-encoded in place, the padding entries of a row are left as they are
+  const auto& caches = past_present_share_buffer_ ? presents_ : CurrentCaches();
+  const size_t entry_bytes = static_cast<size_t>(shape_[3]) * SizeOf(type_);
+  const size_t head_bytes = static_cast<size_t>(shape_[2]) * entry_bytes;
+  for (int i = 0; i < layer_count_ * 2; i += 2) {
+    auto data = ByteWrapTensor(Device(), *caches[i]);
+    auto cpu = data.CopyDeviceToCpu();
+    for (int64_t row = 0; row < shape_[0]; row++) {
+      const size_t begin = std::min(padding[row], length);
+      for (int64_t head = 0; head < shape_[1]; head++)
+        rotation.Apply(cpu.subspan((row * shape_[1] + head) * head_bytes + begin * entry_bytes, (length - begin) * entry_bytes),
+                       type_, static_cast<size_t>(shape_[3]));
+    }
+    data.CopyCpuToDevice();
+  }
+  return true;
+}
+
+void DefaultKeyValueCache::CopyRowFrom(DefaultKeyValueCache& source, size_t source_row, size_t begin, size_t length, size_t row, size_t offset) {
+  assert(source.type_ == type_ && source_row < static_cast<size_t>(source.shape_[0]));
+  const size_t source_length = static_cast<size_t>(source.shape_[2]);
+  if (begin + length > source_length || offset + length > static_cast<size_t>(shape_[2]))
+    throw std::runtime_error("DefaultKeyValueCache::CopyRowFrom - the row doesn't fit the key-value cache");
+
+  const size_t entry_bytes = static_cast<size_t>(shape_[3]) * SizeOf(type_);
+  const size_t head_bytes = static_cast<size_t>(shape_[2]) * entry_bytes;
+  const size_t source_head_bytes = source_length * entry_bytes;
+  const auto& source_caches = source.CurrentCaches();
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    auto present = ByteWrapTensor(Device(), *presents_[i]);
+    auto source_present = ByteWrapTensor(Device(), *source_caches[i]);
+    for (int64_t head = 0; head < shape_[1]; head++) {
+      // The padding positions are masked, but uninitialized memory could hold NaNs that the masking doesn't remove
+      auto row_head = present.subspan((row * shape_[1] + head) * head_bytes, head_bytes);
+      if (offset)
+        row_head.subspan(0, offset * entry_bytes).Zero();
+      auto source_head = source_present.subspan((source_row * shape_[1] + head) * source_head_bytes, source_head_bytes);
+      row_head.subspan(offset * entry_bytes, length * entry_bytes).CopyFrom(source_head.subspan(begin * entry_bytes, length * entry_bytes));
+    }
+  }
+}
+
+void DefaultKeyValueCache::ReserveSharedBuffers(size_t length) {
+  if (!grow_shared_buffers_ || shape_[2] >= static_cast<int64_t>(length))
+    return;
+
+  // Grows in shared_buffer_growth steps, so a generation reallocates every few hundred tokens rather than every token
+  auto new_shape = shape_;
+  new_shape[2] = std::min<int64_t>(state_.params_->search.max_length,
+                                   (static_cast<int64_t>(length) + shared_buffer_growth - 1) / shared_buffer_growth * shared_buffer_growth);
+  const auto element_size = static_cast<int64_t>(SizeOf(type_));
+  const auto head_bytes = shape_[2] * shape_[3] * element_size;
+  const auto new_head_bytes = new_shape[2] * shape_[3] * element_size;
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    auto present = OrtValue::CreateTensor(Allocator(), new_shape, type_);
+    auto present_span = ByteWrapTensor(Device(), *present);
+    if (Device().GetType() != DeviceType::WEBGPU)
+      present_span.Zero();  // See the constructor
+    auto old_span = ByteWrapTensor(Device(), *presents_[i]);
+    for (int64_t j = 0; j < shape_[0] * shape_[1]; j++)
+      present_span.subspan(j * new_head_bytes, head_bytes).CopyFrom(old_span.subspan(j * head_bytes, head_bytes));
+    presents_[i] = std::move(present);
+    state_.inputs_[input_index_ + i] = presents_[i].get();
+    state_.outputs_[output_index_ + i] = presents_[i].get();
+  }
+  shape_ = new_shape;
+}
+
+void DefaultKeyValueCache::RewindPastTensorsTo(size_t index, std::span<const std::unique_ptr<OrtValue>> caches) {
   assert(index > 0 && shape_[2] >= static_cast<int64_t>(index) && !past_present_share_buffer_);
   std::array<int64_t, 4> new_shape = shape_;
   new_shape[2] = static_cast<int>(index);
+  const auto element_size = static_cast<int64_t>(SizeOf(type_));
   auto batch_x_num_heads = new_shape[0] * new_shape[1];
-  auto new_length_x_head_size = new_shape[2] * new_shape[3];
-  auto old_length_x_head_size = shape_[2] * new_shape[3];
+  auto new_length_x_head_size = new_shape[2] * new_shape[3] * element_size;
+  auto old_length_x_head_size = shape_[2] * new_shape[3] * element_size;
   shape_[2] = new_shape[2];
+  const bool streaming = static_cast<size_t>(batch_x_num_heads * new_length_x_head_size) >= streaming_copy_bytes;
 
-  for (int i = 0; i < layer_count_ * 2; i++) {
-    OrtValue& present = *presents_[i];
-    std::unique_ptr<OrtValue> past = OrtValue::CreateTensor(Allocator(), shape_, type_);
+  // 'caches' can be pasts_ (see CurrentCaches), so they're only replaced once everything is copied
+  std::vector<std::unique_ptr<OrtValue>> pasts(layer_count_ * 2);
+  for (auto& past : pasts)
+    past = OrtValue::CreateTensor(Allocator(), shape_, type_);
 
-    auto past_span = WrapTensor<T>(Device(), *past);
-    auto present_span = WrapTensor<T>(Device(), present);
+  ForEachCacheTensor(Device(), layer_count_ * 2, [&](int i) {
+    OrtValue& present = *caches[i];
+    auto past_span = ByteWrapTensor(Device(), *pasts[i]);
+    auto present_span = ByteWrapTensor(Device(), present);
 
     for (int j = 0; j < batch_x_num_heads; j++) {
       auto present_data = present_span.subspan(j * old_length_x_head_size, new_length_x_head_size);
       auto past_data = past_span.subspan(j * new_length_x_head_size, new_length_x_head_size);
-      past_data.CopyFrom(present_data);
+      CopyCacheBytes(Device(), past_data, present_data, streaming);
     }
-    pasts_[i] = std::move(past);
+  });
+
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    pasts_[i] = std::move(pasts[i]);
     state_.inputs_[input_index_ + i] = pasts_[i].get();
   }
 }
 
 // Copy present state to past state reordered by the beam_indices
-template <typename ScoreType>
-void DefaultKeyValueCache::PickPastState(DeviceSpan<int32_t> beam_indices_device, int index) {
-  std::span<int32_t> beam_indices = beam_indices_device.CopyDeviceToCpu();
-  auto block_size_per_beam = shape_[1] * shape_[2] * shape_[3];
-
-  OrtValue& present_value = *presents_[index];
-  std::unique_ptr<OrtValue> past_value = OrtValue::CreateTensor<ScoreType>(Allocator(), shape_);
+void DefaultKeyValueCache::PickPastState(std::span<const int32_t> beam_indices, int index) {
+  auto block_size_per_beam = shape_[1] * shape_[2] * shape_[3] * static_cast<int64_t>(SizeOf(type_));
 
-  auto past_span = WrapTensor<ScoreType>(Device(), *past_value);
-  auto present_span = WrapTensor<ScoreType>(Device(), present_value);
+  auto past_span = ByteWrapTensor(Device(), *pasts_[index]);
+  auto present_span = ByteWrapTensor(Device(), *presents_[index]);
+  const bool streaming = past_span.size() >= streaming_copy_bytes;
 
   for (size_t j = 0; j < beam_indices.size(); j++) {
     int32_t beam_index = beam_indices[j];
     auto present = present_span.subspan(beam_index * block_size_per_beam, block_size_per_beam);
     auto past = past_span.subspan(j * block_size_per_beam, block_size_per_beam);
-    past.CopyFrom(present);
+    CopyCacheBytes(Device(), past, present, streaming);
   }
+}
 
-  pasts_[index] = std::move(past_value);
+void DefaultKeyValueCache::CompactBatch(std::span<const int32_t> rows) {
+  if (!sb_kv_caches_.empty())
+    throw std::runtime_error("The key-value cache batch cannot be compacted when graph capture is enabled.");
+
+  // Between Runs the presents hold the cache, the next Update moves them to the pasts (or keeps sharing them)
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    presents_[i] = GatherRows(*presents_[i], rows, Device());
+    state_.outputs_[output_index_ + i] = presents_[i].get();
+    if (past_present_share_buffer_)
+      state_.inputs_[input_index_ + i] = presents_[i].get();
+  }
+  shape_[0] = static_cast<int64_t>(rows.size());
 }
 
-void DefaultKeyValueCache::PickPastState(DeviceSpan<int32_t> beam_indices, int index) {
-  if (type_ == Ort::TypeToTensorType<float>) {
-    PickPastState<float>(beam_indices, index);
-  } else {
-    PickPastState<Ort::Float16_t>(beam_indices, index);
+bool DefaultKeyValueCache::Offload(const fs::path& path) {
+  if (!sb_kv_caches_.empty())
+    throw std::runtime_error("The key-value cache cannot be offloaded when graph capture is enabled.");
+
+  // After a Run the presents hold the cache and the pasts are replaced by the next Update. Only after a RewindTo
+  // (is_first_update_ with the pasts set) do the pasts hold the entries the next Run reads.
+  if (!past_present_share_buffer_ && !(is_first_update_ && pasts_[0])) {
+    for (auto& past : pasts_)
+      past = nullptr;
+  }
+
+  std::vector<std::unique_ptr<OrtValue>*> tensors;
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    tensors.push_back(&presents_[i]);
+    if (pasts_[i])
+      tensors.push_back(&pasts_[i]);
+  }
+  return offloaded_.Offload(Device(), tensors, path);
+}
+
+size_t DefaultKeyValueCache::GetMemoryUsage() const {
+  // With past_present_share_buffer the pasts are null and the presents are both inputs and outputs
+  return GetTensorsSizeInBytes(pasts_) + GetTensorsSizeInBytes(presents_);
+}
+
+void DefaultKeyValueCache::Restore() {
+  if (!offloaded_.IsOffloaded())
+    return;
+  offloaded_.Restore(Device(), Allocator(), type_);
+
+  // The state still references the released tensors
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    state_.outputs_[output_index_ + i] = presents_[i].get();
+    if (past_present_share_buffer_)
+      state_.inputs_[input_index_ + i] = presents_[i].get();
+    else
+      state_.inputs_[input_index_ + i] = pasts_[i] ? pasts_[i].get() : empty_past_.get();
   }
 }
 
 CrossCache::CrossCache(State& state)
     : state_{state},
       layer_count_{model_.config_->model.decoder.num_hidden_layers},
-      shape_{state_.params_->BatchBeamSize(), model_.config_->model.decoder.num_key_value_heads, 1500, model_.config_->model.decoder.head_size} {
+      shape_{model_.config_->model.decoder.cross_cache_per_batch_entry ? state_.params_->search.batch_size : state_.params_->BatchBeamSize(),
+             model_.config_->model.decoder.num_key_value_heads, 1500, model_.config_->model.decoder.head_size} {
   values_.reserve(layer_count_ * 2);
 
   for (int i = 0; i < layer_count_; ++i) {
@@ -364,12 +1105,28 @@ void CrossCache::AddOutputs() {
 }
 
 void CrossCache::AddInputs() {
+  input_index_ = state_.inputs_.size();
   for (int i = 0; i < layer_count_ * 2; ++i) {
     state_.inputs_.push_back(values_[i].get());
     state_.input_names_.push_back(input_name_strings_[i].c_str());
   }
 }
 
+void CrossCache::CompactBatch(std::span<const int32_t> rows) {
+  for (int i = 0; i < layer_count_ * 2; ++i) {
+    values_[i] = GatherRows(*values_[i], rows, Device());
+    state_.inputs_[input_index_ + i] = values_[i].get();
+  }
+  shape_[0] = static_cast<int64_t>(rows.size());
+}
+
+size_t GetTensorsSizeInBytes(std::span<const std::unique_ptr<OrtValue>> tensors) {
+  size_t bytes = 0;
+  for (auto& tensor : tensors)
+    bytes += GetTensorSizeInBytes(tensor.get());
+  return bytes;
+}
+
 std::string ComposeKeyValueName(const std::string& template_string, int index) {
   constexpr int32_t KeyValueNameLength = 64;
   char key_value_name[KeyValueNameLength];
@@ -381,6 +1138,18 @@ std::string ComposeKeyValueName(const std::string& template_string, int index) {
   return std::string(key_value_name);
 }
 
+void CheckKeyValueCacheType(const Model& model, ONNXTensorElementDataType type) {
+  const auto& quantization = model.config_->model.decoder.kv_cache_quantization;
+  if (!quantization)
+    return;
+
+  // The model does the quantization (with its per-head scales), we only store and move the 8-bit values
+  const auto expected_type = quantization->type == "int8" ? Ort::TypeToTensorType<int8_t> : ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT8E4M3FN;
+  if (type != expected_type)
+    throw std::runtime_error("kv_cache_quantization type is " + quantization->type +
+                             " but the model's key-value cache inputs are of a different type. Re-export the model with the matching kv_cache_quant_type.");
+}
+
 namespace {
 
 bool IsCacheNeeded(const Model& model) {
@@ -394,7 +1163,9 @@ std::unique_ptr<KeyValueCache> CreateKeyValueCache(State& state) {
     return nullptr;
   }
 
-  if (state.model_.config_->model.decoder.sliding_window) {
+  if (state.model_.config_->model.decoder.paged_kv_cache) {
+    return std::make_unique<PagedKeyValueCache>(state);
+  } else if (state.model_.config_->model.decoder.sliding_window) {
     return std::make_unique<WindowedKeyValueCache>(state);
   } else {
     return std::make_unique<DefaultKeyValueCache>(state);
@@ -5,6 +5,28 @@
 
 namespace Generators {
 
+// Key-value tensors released from the device by KeyValueCache::Offload. The contents are kept in host memory (pinned where the
+// device supports it) or in a file, and Restore recreates every tensor in place with its original shape and contents.
+struct OffloadedTensors {
+  // Copies the tensors to host memory (or the file at 'path' when it isn't empty) and resets them. Returns false when there
+  // was nothing to gain (CPU tensors without a file), then the tensors are kept.
+  bool Offload(DeviceInterface& device, std::span<std::unique_ptr<OrtValue>* const> tensors, const fs::path& path);
+  void Restore(DeviceInterface& device, Ort::Allocator& allocator, ONNXTensorElementDataType type);
+
+  bool IsOffloaded() const { return is_offloaded_; }
+
+ private:
+  struct Entry {
+    std::unique_ptr<OrtValue>* tensor;  // Where the tensor is restored to
+    std::vector<int64_t> shape;
+    DeviceSpan<uint8_t> host;  // Only the CPU side is used, empty when offloaded to a file
+  };
+
+  std::vector<Entry> entries_;
+  fs::path path_;
+  bool is_offloaded_{};
+};
+
 struct KeyValueCache {
   virtual ~KeyValueCache() = default;
 
@@ -15,6 +37,44 @@ struct KeyValueCache {
   virtual void Update(DeviceSpan<int32_t> beam_indices, int total_length) = 0;
 
   virtual void RewindTo(size_t index) = 0;
+  virtual void CheckRewindTo(size_t index) const {}  // Throws if RewindTo(index) can't be done
+
+  // Prefix caching (see PagedKeyValueCache). ReusePrefix is called before the first Run with the prompt and returns how many
+  // of its leading tokens already have key-value entries, PublishPrefix is called after every Run.
+  virtual size_t ReusePrefix(std::span<const int32_t> tokens) { return 0; }
+  virtual void PublishPrefix() {}
+
+  // Called on the cache of a new generator before its first Run (see Generator::Fork). Makes the first 'length' entries of
+  // 'source', a cache of another generator of the same model, the contents of this one. Returns false if that isn't
+  // supported, then nothing is changed.
+  virtual bool ForkFrom(KeyValueCache& source, size_t length) { return false; }
+
+  // Snapshots of the first 'length' entries (see State::SaveKeyValueCache), both return false if they aren't supported
+  virtual bool Save(StateWriter& writer, size_t length) { return false; }
+  virtual bool Load(StateReader& reader, size_t length) { return false; }
+  // Called between Runs with the entries of the first 'position' tokens in the cache. Reads the entries Save wrote for
+  // 'length' tokens at positions [0, length) after them, re-encoded for their new positions (see
+  // State::AppendKeyValueCache). Returns false if that isn't supported, then nothing is changed.
+  virtual bool Append(StateReader& reader, size_t length, size_t position) { return false; }
+
+  // Called between Runs with the entries of the first 'length' tokens in the cache. Drops the 'count' entries from 'begin'
+  // on and moves the later ones down, re-encoded for their new positions (see State::EvictKeyValueCache). Returns false
+  // if that isn't supported, then nothing is changed.
+  virtual bool Evict(size_t length, size_t begin, size_t count) { return false; }
+
+  // Called between Runs with the entries of the first 'length' tokens in the cache, re-encodes their keys for the other
+  // LongRoPE factors (see State::SwitchRotaryFactors). Returns false if that isn't supported, then nothing is changed.
+  virtual bool SwitchRotaryFactors(size_t length, std::span<const size_t> padding, bool long_factors) { return false; }
+
+  // Copies the cache contents to host memory (or to the file at 'path' when it isn't empty) and releases the device memory,
+  // Restore allocates the device memory again and copies the contents back. Only called between Runs. Returns false if the
+  // cache stayed where it was (see OffloadedTensors::Offload), Restore then does nothing.
+  virtual bool Offload(const fs::path& path) {
+    throw std::runtime_error("Offloading is not supported by this key-value cache type.");
+  }
+  virtual void Restore() {
+    throw std::runtime_error("Offloading is not supported by this key-value cache type.");
+  }
 
   // Note: PartialTokenGenerationUpdate() is mainly for supporting DecoderOnlyPipelineState usage where we update
   // part of the KV cache after running part of the pipeline.
@@ -22,10 +82,27 @@ struct KeyValueCache {
 
   virtual bool IsPartialTokenGenerationUpdateSupported() const { return false; }
 
+  // Bytes of device memory the cache holds right now, 0 while offloaded (see Generator::GetMemoryUsage)
+  virtual size_t GetMemoryUsage() const { return 0; }
+
+  // Keeps only the given rows of the batch, called between Runs (see State::CompactBatch)
+  virtual void CompactBatch(std::span<const int32_t> rows) {
+    throw std::runtime_error("Compacting the batch is not supported by this key-value cache type.");
+  }
+
   virtual void PartialTokenGenerationUpdate(DeviceSpan<int32_t> beam_indices, int total_length,
                                             std::span<const size_t> layer_indices_to_update) {
     throw std::runtime_error("PartialTokenGenerationUpdate is not supported.");
   }
+
+  // The same for the updates between the prompt windows of a sliding window model. Called before a window runs,
+  // BeginPartialPromptUpdate does the bookkeeping of the Update after it and returns true if that update only slides
+  // the layers, then PartialPromptUpdate slides them a few layers at a time as the window's pipeline models finish and
+  // Update isn't called. Returns false if the update has to be done by Update, e.g. as the next window has another size.
+  virtual bool BeginPartialPromptUpdate(int total_length) { return false; }
+  virtual void PartialPromptUpdate(std::span<const size_t> layer_indices_to_update) {
+    throw std::runtime_error("PartialPromptUpdate is not supported.");
+  }
 };
 
 struct CombinedKeyValueCache : KeyValueCache {
@@ -37,17 +114,35 @@ struct CombinedKeyValueCache : KeyValueCache {
   };
   void Update(DeviceSpan<int32_t> beam_indices, int total_length) override;
   void RewindTo(size_t index) override;
+  bool ForkFrom(KeyValueCache& source, size_t length) override;
+  bool Save(StateWriter& writer, size_t length) override;
+  bool Load(StateReader& reader, size_t length) override;
+  bool Evict(size_t length, size_t begin, size_t count) override;
+
+  bool Offload(const fs::path& path) override;
+  void Restore() override;
+
+  size_t GetMemoryUsage() const override;
+
+  void CompactBatch(std::span<const int32_t> rows) override;
+
+  // See DefaultKeyValueCache::CopyRowFrom
+  void CopyRowFrom(CombinedKeyValueCache& source, size_t source_row, size_t begin, size_t length, size_t row, size_t offset);
 
  private:
   template <typename ScoreType>
   void PickPastState(DeviceSpan<int32_t> beam_indices, int index);
   void PickPastState(DeviceSpan<int32_t> beam_indices, int index);
 
+  // Sets the pasts to the first 'index' entries of 'caches', which are of shape_
   template <typename T>
-  void RewindPastTensorsTo(size_t index);
+  void RewindPastTensorsTo(size_t index, std::span<const std::unique_ptr<OrtValue>> caches);
+  void RewindPastTensorsTo(size_t index, std::span<const std::unique_ptr<OrtValue>> caches);
+  // The tensors holding the entries the next Run reads, see DefaultKeyValueCache::Offload
+  const std::vector<std::unique_ptr<OrtValue>>& CurrentCaches() const { return is_first_update_ && pasts_[0] ? pasts_ : presents_; }
 
   DeviceInterface& Device() { return *model_.p_device_kvcache_; }
-  Ort::Allocator& Allocator() { return model_.p_device_kvcache_->GetAllocator(); }
+  Ort::Allocator& Allocator() { return model_.GetAllocator(*model_.p_device_kvcache_); }
 
   State& state_;
   const Model& model_{state_.model_};
@@ -62,6 +157,7 @@ struct CombinedKeyValueCache : KeyValueCache {
   std::unique_ptr<OrtValue> empty_past_;
   std::vector<std::unique_ptr<OrtValue>> pasts_, presents_;
   std::vector<std::string> input_name_strings_, output_name_strings_;
+  OffloadedTensors offloaded_;
 };
 
 struct DefaultKeyValueCache : KeyValueCache {
@@ -74,23 +170,46 @@ struct DefaultKeyValueCache : KeyValueCache {
   // Move present to past. Prepare present output for next generation iteration.
   void Update(DeviceSpan<int32_t> beam_indices, int total_length) override;
   void RewindTo(size_t index) override;
+  bool ForkFrom(KeyValueCache& source, size_t length) override;
+  bool Save(StateWriter& writer, size_t length) override;
+  bool Load(StateReader& reader, size_t length) override;
+  bool Append(StateReader& reader, size_t length, size_t position) override;
+  bool Evict(size_t length, size_t begin, size_t count) override;
+  bool SwitchRotaryFactors(size_t length, std::span<const size_t> padding, bool long_factors) override;
 
- private:
-  template <typename ScoreType>
-  void PickPastState(DeviceSpan<int32_t> beam_indices, int index);
-  void PickPastState(DeviceSpan<int32_t> beam_indices, int index);
+  bool Offload(const fs::path& path) override;
+  void Restore() override;
 
-  template <typename T>
-  void RewindPastTensorsTo(size_t index);
+  void CompactBatch(std::span<const int32_t> rows) override;
+
+  size_t GetMemoryUsage() const override;
+
+  // Called after Update, before the Run it prepares would be skipped (see DecoderOnly_State::RunRaggedPrefill and
+  // MergeRows). Copies the 'length' entries from position 'begin' on of row 'source_row' of the cache of 'source', a
+  // state of the same model between Runs, into row 'row' of the presents from position 'offset' on. The positions
+  // before 'offset' are zeroed.
+  void CopyRowFrom(DefaultKeyValueCache& source, size_t source_row, size_t begin, size_t length, size_t row, size_t offset);
+
+ private:
+  // Both copy raw bytes, so they work for any KV type including the 8-bit kv_cache_quantization types
+  // Copies presents_[index] reordered by beam_indices, which are on the CPU, into pasts_[index] created by the caller
+  void PickPastState(std::span<const int32_t> beam_indices, int index);
+  // Sets the pasts to the first 'index' entries of 'caches', which are of shape_
+  void RewindPastTensorsTo(size_t index, std::span<const std::unique_ptr<OrtValue>> caches);
+  // The tensors holding the entries the next Run reads, see Offload
+  const std::vector<std::unique_ptr<OrtValue>>& CurrentCaches() const { return is_first_update_ && pasts_[0] ? pasts_ : presents_; }
+  // Grows the shared buffers (if grow_shared_buffers_) to hold at least 'length' entries, copying the current entries
+  void ReserveSharedBuffers(size_t length);
 
   DeviceInterface& Device() { return *model_.p_device_kvcache_; }
-  Ort::Allocator& Allocator() { return model_.p_device_kvcache_->GetAllocator(); }
+  Ort::Allocator& Allocator() { return model_.GetAllocator(*model_.p_device_kvcache_); }
 
   State& state_;
   const Model& model_{state_.model_};
   int layer_count_;
   size_t input_index_{~0U}, output_index_{~0U};
   bool past_present_share_buffer_;  // True if model.decoder.past_present_share_buffer is set to true, and we're using cuda, and not beam search
+  bool grow_shared_buffers_{};      // The shared buffers start short of max_length, see ReserveSharedBuffers
 
   bool is_first_update_{true};
 
@@ -101,6 +220,7 @@ struct DefaultKeyValueCache : KeyValueCache {
   std::vector<std::unique_ptr<OrtValue>> pasts_, presents_;
   std::vector<std::string> input_name_strings_, output_name_strings_;
   std::vector<StaticBuffer*> sb_kv_caches_;
+  OffloadedTensors offloaded_;
 };
 
 // Very similar to the DefaultKeyValueCache, but is only created once at the encoder step, then used without modification for every decoder step
@@ -110,9 +230,12 @@ struct CrossCache {
   void AddOutputs();
   void AddInputs();
 
+  // Keeps only the given rows of the batch, called between decoder Runs (see State::CompactBatch)
+  void CompactBatch(std::span<const int32_t> rows);
+
  private:
   DeviceInterface& Device() { return *model_.p_device_kvcache_; }
-  Ort::Allocator& Allocator() { return model_.p_device_kvcache_->GetAllocator(); }
+  Ort::Allocator& Allocator() { return model_.GetAllocator(*model_.p_device_kvcache_); }
 
   State& state_;
   const Model& model_{state_.model_};
@@ -123,10 +246,17 @@ struct CrossCache {
 
   std::vector<std::unique_ptr<OrtValue>> values_;
   std::vector<std::string> input_name_strings_, output_name_strings_;
+  size_t input_index_{~0U};
 };
 
 std::string ComposeKeyValueName(const std::string& template_string, int index);
 
+// Sum of the bytes of the tensors, skipping null ones
+size_t GetTensorsSizeInBytes(std::span<const std::unique_ptr<OrtValue>> tensors);
+
+// Throws if the model's key-value cache type doesn't match model.decoder.kv_cache_quantization (when set)
+void CheckKeyValueCacheType(const Model& model, ONNXTensorElementDataType type);
+
 std::unique_ptr<KeyValueCache> CreateKeyValueCache(State& state);
 
 }  // namespace Generators
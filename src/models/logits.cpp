@@ -6,11 +6,35 @@
 
 namespace Generators {
 
+void ExpandTopKLogits(std::span<const float> values, std::span<const int32_t> tokens, std::span<float> logits, size_t rows) {
+  const size_t count = values.size() / rows;
+  const size_t vocab_size = logits.size() / rows;
+  std::fill(logits.begin(), logits.end(), std::numeric_limits<float>::lowest());
+  for (size_t row = 0; row < rows; row++) {
+    for (size_t i = row * count; i < (row + 1) * count; i++)
+      logits[row * vocab_size + tokens[i]] = values[i];
+  }
+}
+
 Logits::Logits(State& state)
     : state_{state},
-      shape_{static_cast<int64_t>(state_.params_->BatchBeamSize()), 0, model_.config_->model.vocab_size},
-      type_{model_.session_info_->GetOutputDataType(model_.config_->model.decoder.outputs.logits)} {
-  output_raw_ = OrtValue::CreateTensor(model_.p_device_inputs_->GetAllocator(), shape_, type_);
+      shape_{static_cast<int64_t>(state_.BatchBeamSize()), 0, top_k_ ? static_cast<int64_t>(top_k_) : model_.config_->model.vocab_size},
+      type_{model_.session_info_->GetOutputDataType(top_k_ ? model_.config_->model.decoder.outputs.logits_top_k_values : model_.config_->model.decoder.outputs.logits)},
+      output_raw_buffer_{model_.GetAllocator(*model_.p_device_inputs_), shape_[0] * shape_[2] * SizeOf(type_)},
+      output_last_tokens_buffer_{model_.GetAllocator(*model_.p_device_inputs_), shape_[0] * shape_[2] * SizeOf(type_)},
+      indices_raw_buffer_{model_.GetAllocator(*model_.p_device_inputs_), top_k_ ? shape_[0] * shape_[2] * sizeof(int64_t) : 0},
+      indices_last_tokens_buffer_{model_.GetAllocator(*model_.p_device_inputs_), top_k_ ? shape_[0] * shape_[2] * sizeof(int64_t) : 0} {
+  if (model_.session_info_->HasInput(model_.config_->model.decoder.inputs.last_token_indices)) {
+    std::array<int64_t, 1> indices_shape{shape_[0]};
+    last_token_indices_ = OrtValue::CreateTensor<int64_t>(model_.GetAllocator(*model_.p_device_inputs_), indices_shape);
+    shape_[1] = 1;
+  }
+  output_raw_ = output_raw_buffer_.CreateTensor(shape_, type_);
+  if (top_k_) {
+    if (model_.session_info_->GetOutputDataType(model_.config_->model.decoder.outputs.logits_top_k_indices) != Ort::TypeToTensorType<int64_t>)
+      throw std::runtime_error("logits_top_k_indices must be int64");
+    indices_raw_ = indices_raw_buffer_.CreateTensor(shape_, Ort::TypeToTensorType<int64_t>);
+  }
 
   if (model_.p_device_inputs_->GetType() == DeviceType::CUDA && !model_.config_->model.eos_token_ids.empty()) {
     auto& cpu_ids = model_.config_->model.eos_token_ids;
@@ -19,50 +43,63 @@ Logits::Logits(State& state)
     cuda_eos_token_ids_.CopyCpuToDevice();
   }
 
-  input_sequence_lengths.resize(state_.params_->search.batch_size);
+  input_sequence_lengths.resize(state_.batch_size_);
 }
 
-DeviceSpan<float> Logits::Get() {
-  size_t element_count = shape_[0] * shape_[1] * shape_[2];
+OrtValue* Logits::GatherLastTokens(OrtValue& raw, TensorBuffer& buffer, std::unique_ptr<OrtValue>& last_tokens, ONNXTensorElementDataType type) {
+  const size_t seq_length = shape_[1];
+  const size_t vocab_size = shape_[2];
+  const size_t num_beams = state_.params_->search.num_beams;
 
-  // The model's output logits are {batch_size*num_beams, input_seq_len, vocab_size}
-  OrtValue* logits_of_last_token = output_raw_.get();
+  // create new OrtValue for the last tokens and use last_tokens to hold it
   std::array<int64_t, 3> shape_last{shape_[0], 1, shape_[2]};
-  if (shape_[1] != 1) {
-    const size_t seq_length = shape_[1];
-    const size_t vocab_size = shape_[2];
-    const size_t num_beams = state_.params_->search.num_beams;
+  last_tokens = buffer.CreateTensor(shape_last, type);
 
-    // create new OrtValue for logits_of_last_token and use output_last_tokens_ to hold it
-    output_last_tokens_ = OrtValue::CreateTensor(model_.p_device_inputs_->GetAllocator(), shape_last, type_);
+  size_t element_size = SizeOf(type);
+  size_t vocab_index = 0;  // Simpler math to have this index go up by vocab_size for every logit chunk we process
 
-    if (type_ == Ort::TypeToTensorType<Ort::Float16_t>)
-      logits_of_last_token_fp32_ = OrtValue::CreateTensor<float>(model_.p_device_inputs_->GetAllocator(), shape_);
+  auto logits_raw = ByteWrapTensor(*model_.p_device_inputs_, raw);
+  auto logits_last_tokens = ByteWrapTensor(*model_.p_device_inputs_, *last_tokens);
 
-    logits_of_last_token = output_last_tokens_.get();
+  for (size_t batch_index = 0; batch_index < input_sequence_lengths.size(); batch_index++) {
+    // Find the first non pad token from the end
+    size_t token_index = input_sequence_lengths[batch_index] - 1;
+    for (int beam_index = 0; beam_index < num_beams; beam_index++) {
+      auto target = logits_last_tokens.subspan(vocab_index * element_size, vocab_size * element_size);
+      auto source = logits_raw.subspan((vocab_index * seq_length + token_index * vocab_size) * element_size, vocab_size * element_size);
+      target.CopyFrom(source);
+      vocab_index += vocab_size;
+    }
+  }
+  return last_tokens.get();
+}
 
-    size_t element_size = SizeOf(type_);
-    size_t vocab_index = 0;  // Simpler math to have this index go up by vocab_size for every logit chunk we process
+DeviceSpan<float> Logits::Get() {
+  Metrics::Timer timer{GeneratorMetrics::Logits};
+  state_.raw_logits_ = nullptr;
+  state_.top_k_values_ = {};
+  state_.top_k_tokens_ = {};
 
-    auto logits_raw = ByteWrapTensor(*model_.p_device_inputs_, *output_raw_);
-    auto logits_last_tokens = ByteWrapTensor(*model_.p_device_inputs_, *logits_of_last_token);
+  // The model's output logits are {batch_size*num_beams, input_seq_len, vocab_size}
+  OrtValue* logits_of_last_token = output_raw_.get();
+  OrtValue* indices_of_last_token = indices_raw_.get();
+  if (shape_[1] != 1) {
+    logits_of_last_token = GatherLastTokens(*output_raw_, output_last_tokens_buffer_, output_last_tokens_, type_);
+    if (top_k_)
+      indices_of_last_token = GatherLastTokens(*indices_raw_, indices_last_tokens_buffer_, indices_last_tokens_, Ort::TypeToTensorType<int64_t>);
+  }
 
-    for (int batch_index = 0; batch_index < state_.params_->search.batch_size; batch_index++) {
-      // Find the first non pad token from the end
-      size_t token_index = input_sequence_lengths[batch_index] - 1;
-      for (int beam_index = 0; beam_index < num_beams; beam_index++) {
-        auto target = logits_last_tokens.subspan(vocab_index * element_size, vocab_size * element_size);
-        auto source = logits_raw.subspan((vocab_index * seq_length + token_index * vocab_size) * element_size, vocab_size * element_size);
-        target.CopyFrom(source);
-        vocab_index += vocab_size;
-      }
-    }
+  if (top_k_)
+    return GetTopK(*logits_of_last_token, *indices_of_last_token);
 
-    element_count = shape_[0] * shape_[2];  // shape_[1] is now 1, so the element count must be updated
+  // The search reads the fp16 logits directly, see GreedySearch_Cuda::SelectTopFp16 and GreedySearch_Cpu::SelectTopFp16
+  if (state_.defer_logits_ && type_ == Ort::TypeToTensorType<Ort::Float16_t>) {
+    state_.raw_logits_ = logits_of_last_token;
+    return {};
   }
 
-  // Convert from float16 to float32 if necessary
-  if (type_ == Ort::TypeToTensorType<Ort::Float16_t>) {
+  // Convert from float16 or bfloat16 to float32 if necessary
+  if (type_ == Ort::TypeToTensorType<Ort::Float16_t> || type_ == Ort::TypeToTensorType<Ort::BFloat16_t>) {
     Cast(*logits_of_last_token, logits_of_last_token_fp32_, *model_.p_device_inputs_, Ort::TypeToTensorType<float>);
     logits_of_last_token = logits_of_last_token_fp32_.get();
   }
@@ -85,13 +122,49 @@ DeviceSpan<float> Logits::Get() {
   return logits_;
 }
 
+// The candidates are only batch_beam_size * top_k_ values, so the EOS handling and the selection work on them on the CPU
+DeviceSpan<float> Logits::GetTopK(OrtValue& values_of_last_token, OrtValue& indices_of_last_token) {
+  OrtValue* values_fp32 = &values_of_last_token;
+  if (type_ != Ort::TypeToTensorType<float>) {
+    Cast(values_of_last_token, logits_of_last_token_fp32_, *model_.p_device_inputs_, Ort::TypeToTensorType<float>);
+    values_fp32 = logits_of_last_token_fp32_.get();
+  }
+
+  auto values = WrapTensor<float>(*model_.p_device_inputs_, *values_fp32);
+  auto values_cpu = values.CopyDeviceToCpu();
+  top_k_values_.assign(values_cpu.begin(), values_cpu.end());
+
+  auto indices = WrapTensor<int64_t>(*model_.p_device_inputs_, indices_of_last_token);
+  auto indices_cpu = indices.CopyDeviceToCpu();
+  top_k_tokens_.resize(indices_cpu.size());
+  std::transform(indices_cpu.begin(), indices_cpu.end(), top_k_tokens_.begin(), [](int64_t index) { return static_cast<int32_t>(index); });
+
+  HandleEOSCandidates();
+
+  // The search selects the tokens from the candidates, see GreedySearch_Cpu::SelectFromCandidates
+  if (state_.defer_logits_) {
+    state_.top_k_values_ = top_k_values_;
+    state_.top_k_tokens_ = top_k_tokens_;
+    return {};
+  }
+
+  const size_t rows = static_cast<size_t>(shape_[0]);
+  const size_t vocab_size = static_cast<size_t>(model_.config_->model.vocab_size);
+  if (top_k_logits_.size() != rows * vocab_size)
+    top_k_logits_ = model_.p_device_inputs_->Allocate<float>(rows * vocab_size);
+  ExpandTopKLogits(top_k_values_, top_k_tokens_, top_k_logits_.CpuSpan(), rows);
+  top_k_logits_.CopyCpuToDevice();
+  return top_k_logits_;
+}
+
 void Logits::Update(const DeviceSpan<int32_t>& next_tokens, size_t new_kv_length) {
-  if (static_cast<size_t>(output_raw_.get()->GetTensorTypeAndShapeInfo()->GetShape()[1]) == new_kv_length && new_kv_length == 1) {
+  if (input_length_ == new_kv_length && new_kv_length == 1) {
     return;
   }
+  input_length_ = new_kv_length;
 
   // Store length of input sequence for each batch for the get step
-  for (int b = 0; b < state_.params_->search.batch_size; b++) {
+  for (size_t b = 0; b < input_sequence_lengths.size(); b++) {
     // Find the first non pad token from the end
     size_t token_index = new_kv_length;
     while (token_index-- > 0) {
@@ -102,13 +175,55 @@ void Logits::Update(const DeviceSpan<int32_t>& next_tokens, size_t new_kv_length
     input_sequence_lengths[b] = static_cast<int>(token_index + 1);
   }
 
+  if (last_token_indices_) {
+    auto indices = WrapTensor<int64_t>(*model_.p_device_inputs_, *last_token_indices_);
+    auto indices_cpu = indices.CpuSpan();
+    const size_t num_beams = state_.params_->search.num_beams;
+    for (size_t i = 0; i < indices_cpu.size(); i++)
+      indices_cpu[i] = input_sequence_lengths[i / num_beams] - 1;
+    indices.CopyCpuToDevice();
+    return;
+  }
+
   if (static_cast<size_t>(output_raw_.get()->GetTensorTypeAndShapeInfo()->GetShape()[1]) == new_kv_length) {
     return;
   }
 
   shape_[1] = new_kv_length;
-  output_raw_ = OrtValue::CreateTensor(model_.p_device_inputs_->GetAllocator(), shape_, type_);
+  output_raw_ = output_raw_buffer_.CreateTensor(shape_, type_);
   state_.outputs_[output_index_] = output_raw_.get();
+  if (top_k_) {
+    indices_raw_ = indices_raw_buffer_.CreateTensor(shape_, Ort::TypeToTensorType<int64_t>);
+    state_.outputs_[indices_index_] = indices_raw_.get();
+  }
+}
+
+void Logits::CompactBatch(size_t batch_size) {
+  shape_[0] = static_cast<int64_t>(batch_size);
+  input_sequence_lengths.resize(batch_size / state_.params_->search.num_beams);
+
+  output_raw_ = output_raw_buffer_.CreateTensor(shape_, type_);
+  state_.outputs_[output_index_] = output_raw_.get();
+  if (top_k_) {
+    indices_raw_ = indices_raw_buffer_.CreateTensor(shape_, Ort::TypeToTensorType<int64_t>);
+    state_.outputs_[indices_index_] = indices_raw_.get();
+  }
+  // The fp32 copy may get the address of the old one, so the wrapper is rebuilt by the next Get
+  logits_of_last_token_fp32_ = nullptr;
+  logits_ = {};
+
+  if (last_token_indices_) {
+    // Only called while decoding single tokens, where every sequence's last token is at index 0
+    last_token_indices_ = OrtValue::CreateTensor<int64_t>(model_.GetAllocator(*model_.p_device_inputs_), std::array<int64_t, 1>{shape_[0]});
+    ByteWrapTensor(*model_.p_device_inputs_, *last_token_indices_).Zero();
+    state_.inputs_[last_token_indices_index_] = last_token_indices_.get();
+  }
+}
+
+size_t Logits::GetMemoryUsage() const {
+  return GetTensorSizeInBytes(output_raw_.get()) + GetTensorSizeInBytes(output_last_tokens_.get()) +
+         GetTensorSizeInBytes(logits_of_last_token_fp32_.get()) + GetTensorSizeInBytes(indices_raw_.get()) +
+         GetTensorSizeInBytes(indices_last_tokens_.get()) + top_k_logits_.size() * sizeof(float);
 }
 
 void Logits::HandleEOSArray(std::span<float> batched_logits) {
@@ -131,11 +246,53 @@ void Logits::HandleEOSArray(std::span<float> batched_logits) {
   }
 }
 
+// The same as HandleEOSArray, on the candidates. When any of them is an EOS token, the first one (or the primary EOS
+// token itself) becomes the primary EOS token with the highest score of them.
+void Logits::HandleEOSCandidates() {
+  const auto& eos_token_ids = model_.config_->model.eos_token_ids;
+  if (eos_token_ids.empty())
+    return;
+
+  const int32_t eos_token_id = model_.config_->model.eos_token_id;
+  for (size_t row = 0; row < static_cast<size_t>(shape_[0]); row++) {
+    auto values = std::span<float>{top_k_values_}.subspan(row * top_k_, top_k_);
+    auto tokens = std::span<int32_t>{top_k_tokens_}.subspan(row * top_k_, top_k_);
+    float max = std::numeric_limits<float>::lowest();
+    size_t primary = top_k_;
+    for (size_t i = 0; i < top_k_; i++) {
+      if (std::find(eos_token_ids.begin(), eos_token_ids.end(), tokens[i]) == eos_token_ids.end())
+        continue;
+      max = std::max(max, values[i]);
+      values[i] = std::numeric_limits<float>::lowest();
+      if (primary == top_k_ || tokens[i] == eos_token_id)
+        primary = i;
+    }
+    if (primary != top_k_) {
+      tokens[primary] = eos_token_id;
+      values[primary] = max;
+    }
+  }
+}
+
 void Logits::Add() {
   output_index_ = state_.outputs_.size();
 
-  state_.output_names_.push_back(model_.config_->model.decoder.outputs.logits.c_str());
-  state_.outputs_.push_back(output_raw_.get());
+  if (top_k_) {
+    state_.output_names_.push_back(model_.config_->model.decoder.outputs.logits_top_k_values.c_str());
+    state_.outputs_.push_back(output_raw_.get());
+    indices_index_ = state_.outputs_.size();
+    state_.output_names_.push_back(model_.config_->model.decoder.outputs.logits_top_k_indices.c_str());
+    state_.outputs_.push_back(indices_raw_.get());
+  } else {
+    state_.output_names_.push_back(model_.config_->model.decoder.outputs.logits.c_str());
+    state_.outputs_.push_back(output_raw_.get());
+  }
+
+  if (last_token_indices_) {
+    last_token_indices_index_ = state_.inputs_.size();
+    state_.input_names_.push_back(model_.config_->model.decoder.inputs.last_token_indices.c_str());
+    state_.inputs_.push_back(last_token_indices_.get());
+  }
 }
 
 }  // namespace Generators
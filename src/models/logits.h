@@ -6,6 +6,10 @@
 
 namespace Generators {
 
+// Scatters the candidates 'values' and 'tokens' [rows, count] into the full vocabulary 'logits' [rows, vocab_size], the
+// scores of the other tokens are set to the lowest float
+void ExpandTopKLogits(std::span<const float> values, std::span<const int32_t> tokens, std::span<float> logits, size_t rows);
+
 struct Logits {
   Logits(State& state);
 
@@ -17,16 +21,34 @@ struct Logits {
   // Resize logits to [bz, token_count, vocab_size] if necessary.
   void Update(const DeviceSpan<int32_t>& next_tokens, size_t new_kv_length);
 
+  // The following Runs only compute 'batch_size' sequences (see State::CompactBatch)
+  void CompactBatch(size_t batch_size);
+
+  size_t GetMemoryUsage() const;  // Bytes of the raw, last token and fp32 logits tensors
+
  private:
   void HandleEOSArray(std::span<float> logits);
+  void HandleEOSCandidates();
+
+  // Returns a [batch_beam_size, 1, row_size] tensor in 'buffer' with the rows of 'raw' at each sequence's last token
+  OrtValue* GatherLastTokens(OrtValue& raw, TensorBuffer& buffer, std::unique_ptr<OrtValue>& last_tokens, ONNXTensorElementDataType type);
+  DeviceSpan<float> GetTopK(OrtValue& values_of_last_token, OrtValue& indices_of_last_token);
 
   State& state_;
   const Model& model_{state_.model_};
+  const size_t top_k_{static_cast<size_t>(model_.config_->model.decoder.logits_top_k)};  // See Config::Model::Decoder::logits_top_k
   size_t output_index_{~0U};
+  size_t indices_index_{~0U};  // The logits_top_k_indices output
+  size_t last_token_indices_index_{~0U};
+  size_t input_length_{};  // new_kv_length of the last Update
 
-  std::array<int64_t, 3> shape_{};
+  std::array<int64_t, 3> shape_{};  // The last dimension is top_k_ for a logits_top_k head
   ONNXTensorElementDataType type_;
 
+  // The memory of output_raw_ and output_last_tokens_, both reserved for [batch_beam_size, 1, vocab_size]
+  TensorBuffer output_raw_buffer_;
+  TensorBuffer output_last_tokens_buffer_;
+
   // Tensor to keep the logits of the last tokens. It is used in the 2 cases below. Otherwhise, it is not used.
   // 1. prompt: store the last tokens logits from output_raw_
   // 2. token gen: store the converted fp32 logits if output_raw_ is fp16.
@@ -35,6 +57,20 @@ struct Logits {
 
   std::unique_ptr<OrtValue> output_raw_;  // Raw logits output from model
 
+  // For models with a logits_top_k head output_raw_ holds the candidate scores, these their token ids. The candidates are
+  // copied to the CPU, where the search takes them (see State::top_k_values_) or they are expanded to logits_.
+  TensorBuffer indices_raw_buffer_;
+  TensorBuffer indices_last_tokens_buffer_;
+  std::unique_ptr<OrtValue> indices_raw_;
+  std::unique_ptr<OrtValue> indices_last_tokens_;
+  std::vector<float> top_k_values_;
+  std::vector<int32_t> top_k_tokens_;
+  DeviceSpan<float> top_k_logits_;  // shape [batch_beam_size, vocab_size]
+
+  // For models with a last_token_indices input: the index of each sequence's last token in the input. The model only
+  // produces logits for those tokens, so output_raw_ is always [batch_beam_size, 1, vocab_size] and nothing is gathered here.
+  std::unique_ptr<OrtValue> last_token_indices_;
+
   std::vector<int> input_sequence_lengths;
   // OrtValue wrapped in a DeviceMemory object to make it universal
   DeviceSpan<float> logits_;
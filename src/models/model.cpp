@@ -3,18 +3,35 @@
 //
 // Modifications Copyright(C) 2024 Advanced Micro Devices, Inc. All rights reserved
 #include <algorithm>
+#include <cstdio>
+#include <fstream>
 #include <set>
+#include <sstream>
 #include <string>
 #include <thread>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include "../generators.h"
 #include "../search.h"
+#include "../constrained_decoding.h"
 #include "model.h"
 #include "gpt.h"
 #include "decoder_only.h"
 #include "whisper.h"
 #include "multi_modal_vision_model.h"
 #include "decoder_only_pipeline.h"
+#include "paged_kv_cache.h"
+#include "device_arena.h"
 #include "../dml/interface.h"
 
 namespace Generators {
@@ -22,11 +39,34 @@ namespace Generators {
 State::State(const GeneratorParams& params, const Model& model)
     : model_{model},
       params_{params.shared_from_this()},
+      batch_size_{params.search.batch_size},
       run_options_{OrtRunOptions::Create()},
-      extra_outputs_{*this} {}
+      extra_outputs_{*this} {
+  // With pipelined_decode the outputs are only read by work queued on the same stream, so Run returns without waiting for them
+  if (params.search.pipelined_decode && params.p_device->GetType() == DeviceType::CUDA)
+    run_options_->AddConfigEntry("disable_synchronize_execution_providers", "1");
+
+  // Every run switches the HTP to the active mode, the EPs other than QNN ignore the entry
+  const auto& session_options = model.config_->model.decoder.session_options;
+  if (session_options.active_performance_mode)
+    run_options_->AddConfigEntry("qnn.htp_perf_mode", session_options.active_performance_mode->c_str());
+}
+
+// The HTP drops to the idle mode after a run unless other states of the model are running too, so one generator
+// finishing its step doesn't slow down the others. Only changes the entry when the mode changes.
+void State::SetPostRunPerformanceMode(bool others_running) {
+  const auto& session_options = model_.config_->model.decoder.session_options;
+  const bool idle_after_run = session_options.idle_performance_mode && ends_step_ && !others_running;
+  if (idle_after_run_ == idle_after_run)
+    return;
+  idle_after_run_ = idle_after_run;
+  const auto& mode = idle_after_run ? *session_options.idle_performance_mode : *session_options.active_performance_mode;
+  run_options_->AddConfigEntry("qnn.htp_perf_mode_post_run", mode.c_str());
+}
 
 void State::Run(OrtSession& session, int new_batch_size) {
   auto captured_graph_info = GetCapturedGraphInfo();
+  const bool replays_graph = captured_graph_info && !first_run_;  // The first run (the prompt) isn't captured
 
   if (first_run_) {
     if (captured_graph_info) {
@@ -55,8 +95,26 @@ void State::Run(OrtSession& session, int new_batch_size) {
     DumpTensors(model_, stream, outputs_.data(), output_names_.data(), output_names_.size(), false);
   }
 
-  session.Run(run_options_.get(), input_names_.data(), inputs_.data(), input_names_.size(),
-              output_names_.data(), outputs_.data(), output_names_.size());
+  {
+    const void* stream = Trace::IsEnabled() && model_.p_device_->GetType() == DeviceType::CUDA ? model_.p_device_->GetCudaStream() : nullptr;
+    Metrics::Timer timer{run_stage_, nullptr, stream};
+    StreamScope stream_scope{*model_.p_device_, nullptr};  // The session runs on the model's stream
+    struct RunningScope {
+      RunningScope(const Model& model) : model_{model} { others_running_ = model_.running_states_++ > 0; }
+      ~RunningScope() { model_.running_states_--; }
+      const Model& model_;
+      bool others_running_;
+    } running_scope{model_};
+    if (model_.config_->model.decoder.session_options.active_performance_mode)
+      SetPostRunPerformanceMode(running_scope.others_running_);
+    model_.p_device_->SubmitRecordedWork();  // The input updates of this step go to the device in one submission
+    if (replays_graph && model_.p_device_inputs_ != model_.p_device_) {
+      RunStaged(session, *captured_graph_info);
+    } else {
+      session.Run(run_options_.get(), input_names_.data(), inputs_.data(), input_names_.size(),
+                  output_names_.data(), outputs_.data(), output_names_.size());
+    }
+  }
 
   extra_outputs_.RegisterOutputs();
 
@@ -67,6 +125,49 @@ void State::Run(OrtSession& session, int new_batch_size) {
   }
 }
 
+// DML keeps the input ids, position inputs and logits on the CPU, but a captured graph reads and writes fixed device
+// addresses. So these run through device copies in the captured graph's staging buffers.
+void State::RunStaged(OrtSession& session, const CapturedGraphInfo& captured_graph_info) {
+  const auto& inputs = model_.config_->model.decoder.inputs;
+  const auto& outputs = model_.config_->model.decoder.outputs;
+  auto is_staged = [](const std::string& name, std::initializer_list<const std::string*> staged_names, OrtValue* value) {
+    return value && value->GetTensorMemoryInfo().GetDeviceType() == OrtMemoryInfoDeviceType_CPU &&
+           std::any_of(staged_names.begin(), staged_names.end(), [&](const std::string* staged_name) { return *staged_name == name; });
+  };
+  auto stage = [&](const char* name, OrtValue* value) {
+    auto type_and_shape = value->GetTensorTypeAndShapeInfo();
+    return captured_graph_info.GetStagingBuffer(name).CreateTensorOnStaticBuffer(type_and_shape->GetShape(),
+                                                                                  type_and_shape->GetElementType());
+  };
+
+  std::vector<std::unique_ptr<OrtValue>> staged_values;
+  std::vector<OrtValue*> run_inputs{inputs_};
+  for (size_t i = 0; i < run_inputs.size(); i++) {
+    if (!is_staged(input_names_[i], {&inputs.input_ids, &inputs.embeddings, &inputs.position_ids, &inputs.attention_mask}, run_inputs[i]))
+      continue;
+    auto& staged = staged_values.emplace_back(stage(input_names_[i], run_inputs[i]));
+    ByteWrapTensor(*model_.p_device_, *staged).CopyFrom(ByteWrapTensor(*model_.p_device_inputs_, *run_inputs[i]));
+    run_inputs[i] = staged.get();
+  }
+
+  std::vector<std::pair<OrtValue*, OrtValue*>> staged_outputs;  // {output, its device copy}
+  std::vector<OrtValue*> run_outputs{outputs_};
+  for (size_t i = 0; i < run_outputs.size(); i++) {
+    if (!is_staged(output_names_[i], {&outputs.logits}, run_outputs[i]))
+      continue;
+    auto& staged = staged_values.emplace_back(stage(output_names_[i], run_outputs[i]));
+    staged_outputs.emplace_back(run_outputs[i], staged.get());
+    run_outputs[i] = staged.get();
+  }
+
+  model_.p_device_->SubmitRecordedWork();
+  session.Run(run_options_.get(), input_names_.data(), run_inputs.data(), input_names_.size(),
+              output_names_.data(), run_outputs.data(), output_names_.size());
+
+  for (auto& [output, staged] : staged_outputs)
+    ByteWrapTensor(*model_.p_device_inputs_, *output).CopyFrom(ByteWrapTensor(*model_.p_device_, *staged));
+}
+
 void State::SetTerminate() {
   session_terminated_ = true;
   run_options_->SetTerminate();
@@ -159,18 +260,58 @@ void CheckResult(extError_t error) {
 }
 
 TokenizerStream::TokenizerStream(const Tokenizer& tokenizer)
-    : tokenizer_{tokenizer.shared_from_this()} {
+    : tokenizer_{tokenizer.shared_from_this()},
+      vocabulary_{tokenizer.GetTokenVocabulary()} {
   CheckResult(OrtxCreate(kOrtxKindDetokenizerCache, cache_.Address()));
 }
 
 const std::string& TokenizerStream::Decode(int32_t token) {
+  const auto& tokens = vocabulary_->tokens_;
+  const bool in_vocabulary = token >= 0 && static_cast<size_t>(token) < tokens.size() && !tokens[token].empty();
+  if (in_vocabulary && !detokenize_next_) {
+    chunk_ = tokens[token];
+    return chunk_;
+  }
+
+  // The detokenizer only sees the tokens that can't be looked up. The token after one of them is decoded by it too, as
+  // is every token until it returns text again (it holds the bytes of an incomplete character until then).
   const char* string;
   CheckResult(OrtxDetokenizeCached(tokenizer_->tokenizer_, cache_, token, &string));
   chunk_ = string;
+  detokenize_next_ = !in_vocabulary || chunk_.empty();
   return chunk_;
 }
 
-Tokenizer::Tokenizer(Config& config) : pad_token_id_{config.model.pad_token_id} {
+BatchTokenizerStream::BatchTokenizerStream(const Tokenizer& tokenizer, size_t count)
+    : streams_(count),
+      chunk_offsets_(count),
+      chunks_(count) {
+  for (auto& stream : streams_)
+    stream = std::make_unique<TokenizerStream>(tokenizer);
+}
+
+std::span<const char* const> BatchTokenizerStream::Decode(std::span<const int32_t> tokens) {
+  if (tokens.size() != streams_.size())
+    throw std::runtime_error("BatchTokenizerStream expects one token for each of its " + std::to_string(streams_.size()) +
+                             " sequences, got " + std::to_string(tokens.size()));
+
+  arena_.clear();
+  for (size_t i = 0; i < tokens.size(); i++) {
+    chunk_offsets_[i] = arena_.size();
+    arena_.append(streams_[i]->Decode(tokens[i]));
+    arena_.push_back('\0');
+  }
+
+  // The arena only stops growing once every chunk is in it
+  for (size_t i = 0; i < chunks_.size(); i++)
+    chunks_[i] = arena_.data() + chunk_offsets_[i];
+  return chunks_;
+}
+
+Tokenizer::Tokenizer(Config& config)
+    : pad_token_id_{config.model.pad_token_id},
+      vocab_size_{static_cast<size_t>(std::max(config.model.vocab_size, 0))},
+      cache_size_{static_cast<size_t>(std::max(config.model.tokenizer_cache_size, 0))} {
   CheckResult(OrtxCreateTokenizer(tokenizer_.Address(), config.config_path.string().c_str()));
 }
 
@@ -179,6 +320,47 @@ std::unique_ptr<TokenizerStream> Tokenizer::CreateStream() const {
 }
 
 std::vector<int32_t> Tokenizer::Encode(const char* text) const {
+  if (cache_size_ == 0)
+    return EncodeUncached(text);
+
+  {
+    std::scoped_lock lock{cache_mutex_};
+    if (auto it = cache_index_.find(text); it != cache_index_.end()) {
+      cache_.splice(cache_.begin(), cache_, it->second);
+      Metrics::Emit("oga_tokenizer_cache_hits_total", MetricType::Counter, 1);
+      return it->second->second;
+    }
+  }
+  Metrics::Emit("oga_tokenizer_cache_misses_total", MetricType::Counter, 1);
+
+  // Tokenize outside of the lock, another thread may have added the same text in the meantime
+  auto tokens = EncodeUncached(text);
+  std::scoped_lock lock{cache_mutex_};
+  if (cache_index_.find(text) == cache_index_.end()) {
+    cache_.emplace_front(text, tokens);
+    cache_index_.emplace(cache_.front().first, cache_.begin());
+    while (cache_.size() > cache_size_) {
+      cache_index_.erase(cache_.back().first);
+      cache_.pop_back();
+    }
+  }
+  return tokens;
+}
+
+std::vector<int32_t> Tokenizer::EncodeSegments(std::span<const std::string> segments) const {
+  const auto added_prefix = Encode("");  // What the tokenizer adds to every text
+  std::vector<int32_t> tokens;
+  for (size_t i = 0; i < segments.size(); i++) {
+    auto segment = Encode(segments[i].c_str());
+    auto begin = segment.begin();
+    if (i > 0 && segment.size() >= added_prefix.size() && std::equal(added_prefix.begin(), added_prefix.end(), segment.begin()))
+      begin += added_prefix.size();
+    tokens.insert(tokens.end(), begin, segment.end());
+  }
+  return tokens;
+}
+
+std::vector<int32_t> Tokenizer::EncodeUncached(const char* text) const {
   OrtxPtr<OrtxTokenId2DArray> ids;
   CheckResult(OrtxTokenize(tokenizer_, &text, 1, ids.Address()));
 
@@ -197,24 +379,42 @@ std::string Tokenizer::Decode(std::span<const int32_t> tokens) const {
   return string;
 }
 
+// The strings are tokenized on the thread pool, and the tokens are copied from the tokenizer's results straight into
+// the padded batch (padded on the right, like PadInputs)
 std::vector<int32_t> Tokenizer::EncodeBatch(std::span<const std::string> strings) const {
-  std::vector<std::vector<int32_t>> sequences;
-  std::vector<std::span<const int32_t>> span_sequences;
-  for (size_t i = 0; i < strings.size(); i++) {
-    sequences.emplace_back(Encode(strings[i].c_str()));
-    span_sequences.emplace_back(sequences.back());
-  }
+  std::vector<OrtxPtr<OrtxTokenId2DArray>> ids(strings.size());
+  std::vector<std::span<const extTokenId_t>> sequences(strings.size());
+  GetThreadPool().ParallelFor(strings.size(), [&](size_t i) {
+    const char* text = strings[i].c_str();
+    CheckResult(OrtxTokenize(tokenizer_, &text, 1, ids[i].Address()));
+
+    const extTokenId_t* tokens;
+    size_t count;
+    CheckResult(OrtxTokenId2DArrayGetItem(ids[i], 0, &tokens, &count));
+    sequences[i] = {tokens, count};
+  });
 
-  return PadInputs(span_sequences, pad_token_id_);
+  size_t max_length = 0;
+  for (auto& sequence : sequences)
+    max_length = std::max(max_length, sequence.size());
+
+  std::vector<int32_t> result(max_length * sequences.size());
+  GetThreadPool().ParallelFor(sequences.size(), [&](size_t i) {
+    auto output = std::span<int32_t>{result}.subspan(i * max_length, max_length);
+    std::copy(sequences[i].begin(), sequences[i].end(), output.begin());
+    std::fill(output.begin() + sequences[i].size(), output.end(), pad_token_id_);
+  });
+  return result;
 }
 
 std::vector<std::string> Tokenizer::DecodeBatch(std::span<const int32_t> sequences, size_t count) const {
   if (sequences.size() % count != 0)
     throw std::runtime_error("DecodeBatch: sequences must be evenly divisible by the count");
   size_t sequence_length = sequences.size() / count;
-  std::vector<std::string> strings;
-  for (size_t i = 0; i < count; i++)
-    strings.emplace_back(Decode(sequences.subspan(sequence_length * i, sequence_length)));
+  std::vector<std::string> strings(count);
+  GetThreadPool().ParallelFor(count, [&](size_t i) {
+    strings[i] = Decode(sequences.subspan(sequence_length * i, sequence_length));
+  });
   return strings;
 }
 
@@ -228,12 +428,14 @@ int32_t Tokenizer::TokenToTokenId(const char* token) const {
 // the allocator used is not destroyed until last. This keeps the allocator around until exit, after all other memory
 // has been destroyed. Without this, we will crash in the Onnxruntime BFCArena code when deleting tensors due to the
 // arena already being destroyed.
-void EnsureDeviceOrtInit(OrtSession& session, DeviceType type) {
+void EnsureDeviceOrtInit(OrtSession& session, DeviceInterface& device_interface) {
   // CPU Allocator is a special case, it's not in the owned 'allocator_device_' table below so we handle it separately
+  const auto type = device_interface.GetType();
   if (type == DeviceType::CPU)
     return;
 
-  auto& device = GetOrtGlobals()->allocator_device_[static_cast<int>(type)];
+  // Keyed by the interface, as there can be several devices of a type (DML adapters, see the 'adapter_selection' option)
+  auto& device = GetOrtGlobals()->allocator_device_[&device_interface];
   if (device)
     return;
 
@@ -245,7 +447,7 @@ void EnsureDeviceOrtInit(OrtSession& session, DeviceType type) {
   device = Ort::Allocator::Create(session, *memory_info);
   if (!device)
     throw std::runtime_error("Unexpected failure to create device memory allocator for " + std::string(name));
-  GetDeviceInterface(type)->InitOrt(*Ort::api, *device);  // Necessary for any shared library providers so they can access Ort::api
+  device_interface.InitOrt(*Ort::api, *device);  // Necessary for any shared library providers so they can access Ort::api
 }
 
 SessionInfo::SessionInfo(OrtSession& session) {
@@ -301,17 +503,109 @@ std::vector<std::string> SessionInfo::GetInputNames() const {
   return names;
 }
 
-Model::Model(std::unique_ptr<Config> config) : config_{std::move(config)} {
+namespace {
+thread_local const ModelLoadProgress* t_load_progress{};  // The progress of the CreateModel running on this thread
+}  // namespace
+
+Model::Model(std::unique_ptr<Config> config) : config_{std::move(config)}, load_progress_{t_load_progress} {
+  if (config_->model.decoder.tensor_parallel.has_value())
+    InitTensorParallel();
   CreateSessionOptions();
+  ReportLoadProgress("Created session options");
+}
+
+void Model::InitTensorParallel() {
+  // The rank comes from the launcher that started the processes, the same one NCCL in the model is set up by
+  auto get_first_set = [](std::initializer_list<const char*> names) {
+    for (auto name : names) {
+      if (auto value = GetEnvironmentVariable(name); !value.empty())
+        return value;
+    }
+    return std::string{};
+  };
+
+  auto& decoder = config_->model.decoder;
+  const int world_size = decoder.tensor_parallel->world_size;
+  if (world_size < 1)
+    throw std::runtime_error("tensor_parallel world_size must be at least 1, got " + std::to_string(world_size));
+
+  if (auto launched_size = get_first_set({"OMPI_COMM_WORLD_SIZE", "PMI_SIZE", "WORLD_SIZE"});
+      !launched_size.empty() && std::stoi(launched_size) != world_size)
+    throw std::runtime_error("tensor_parallel world_size is " + std::to_string(world_size) + " but " + launched_size + " processes were launched");
+
+  const auto rank = get_first_set({"OMPI_COMM_WORLD_RANK", "PMI_RANK", "RANK"});
+  if (rank.empty() && world_size > 1)
+    throw std::runtime_error("tensor_parallel models run one process per rank, but no rank was set by the launcher (e.g. mpirun)");
+  tensor_parallel_rank_ = rank.empty() ? 0 : std::stoi(rank);
+  if (tensor_parallel_rank_ < 0 || tensor_parallel_rank_ >= world_size)
+    throw std::runtime_error("tensor_parallel rank " + rank + " is out of range for world_size " + std::to_string(world_size));
+
+  const auto local_rank = get_first_set({"OMPI_COMM_WORLD_LOCAL_RANK", "MPI_LOCALRANKID", "LOCAL_RANK"});
+  tensor_parallel_device_id_ = local_rank.empty() ? tensor_parallel_rank_ : std::stoi(local_rank);
+
+  if (decoder.num_key_value_heads % world_size != 0 || decoder.num_attention_heads % world_size != 0)
+    throw std::runtime_error("tensor_parallel world_size " + std::to_string(world_size) +
+                             " must divide num_key_value_heads and num_attention_heads");
+  decoder.num_key_value_heads /= world_size;
+  decoder.num_attention_heads /= world_size;
+}
+
+std::string Model::GetRankFilename(const std::string& filename) const {
+  constexpr std::string_view c_rank = "{rank}";
+  auto rank_filename = filename;
+  if (config_->model.decoder.tensor_parallel.has_value()) {
+    for (auto pos = rank_filename.find(c_rank); pos != std::string::npos; pos = rank_filename.find(c_rank, pos))
+      rank_filename.replace(pos, c_rank.size(), std::to_string(tensor_parallel_rank_));
+  }
+  return rank_filename;
 }
 
 Model::~Model() = default;
 
+std::string Model::GetMemoryUsage() const {
+  size_t device_arena_bytes = 0;
+  for (auto& [device, arena] : device_arenas_)
+    device_arena_bytes += arena->GetCachedBytes();
+  size_t device_pool_bytes = 0;
+  for (auto* device : GetDevices())
+    device_pool_bytes += device->GetCachedBytes();
+
+  return memory_usage_->ToJson({{"paged_kv_cache_pool", paged_kv_cache_pool_ ? paged_kv_cache_pool_->GetMemoryUsage() : 0},
+                                {"captured_graph_pool", captured_graph_pool_ ? captured_graph_pool_->GetMemoryUsage() : 0},
+                                {"device_arena_cached", device_arena_bytes},
+                                {"device_pool_cached", device_pool_bytes}});
+}
+
+void Model::ReleaseCachedMemory() const {
+  for (auto& [device, arena] : device_arenas_)
+    arena->ReleaseFreeBlocks();
+  for (auto* device : GetDevices())
+    device->ReleaseCachedMemory();
+}
+
+// The distinct devices the model runs on, the device pools are shared by every model on the same device
+std::vector<DeviceInterface*> Model::GetDevices() const {
+  std::vector<DeviceInterface*> devices;
+  for (auto* device : {p_device_, p_device_inputs_, p_device_kvcache_}) {
+    if (device && std::find(devices.begin(), devices.end(), device) == devices.end())
+      devices.push_back(device);
+  }
+  return devices;
+}
+
+Ort::Allocator& Model::GetAllocator(DeviceInterface& device) const {
+  auto it = device_arenas_.find(&device);
+  if (it != device_arenas_.end())
+    return it->second->GetAllocator();
+  return device.GetAllocator();
+}
+
 void Model::InitDeviceAllocator(OrtSession& session) {
-  EnsureDeviceOrtInit(session, p_device_->GetType());
+  EnsureDeviceOrtInit(session, *p_device_);
 
-  // Only CUDA does every input on the device
-  if (p_device_->GetType() == DeviceType::CUDA)
+  // Only CUDA does every input on the device. QNN's HTP shared memory is CPU accessible, so its inputs and logits
+  // live there too and the EP reads them without a copy.
+  if (p_device_->GetType() == DeviceType::CUDA || p_device_->GetType() == DeviceType::QNN)
     p_device_inputs_ = p_device_;
   else
     p_device_inputs_ = GetDeviceInterface(DeviceType::CPU);
@@ -319,14 +613,96 @@ void Model::InitDeviceAllocator(OrtSession& session) {
   // The kvcache is always allocated in device memory
   p_device_kvcache_ = p_device_;
 
+  // Before the arenas, which allocate from the pool then
+  if (auto& pool = config_->model.device_memory_pool) {
+    const auto release_threshold = pool->release_threshold < 0 ? std::numeric_limits<uint64_t>::max() : static_cast<uint64_t>(pool->release_threshold);
+    for (auto* device : {p_device_, p_device_inputs_, p_device_kvcache_})
+      device->EnableMemoryPool(release_threshold);
+  }
+
+  if (config_->model.device_arena) {
+    for (auto* device : {p_device_, p_device_inputs_, p_device_kvcache_}) {
+      if (!device_arenas_.contains(device))
+        device_arenas_.emplace(device, std::make_unique<DeviceArena>(device->GetAllocator()));
+    }
+  }
+
   session_info_ = std::make_unique<SessionInfo>(session);
-  captured_graph_pool_ = std::make_shared<CapturedGraphPool>(config_.get(), session_info_.get(), &p_device_->GetAllocator());
+  captured_graph_pool_ = std::make_shared<CapturedGraphPool>(config_.get(), session_info_.get(), &GetAllocator(*p_device_),
+                                                             &GetAllocator(*p_device_inputs_));
+
+  if (config_->model.decoder.paged_kv_cache)
+    paged_kv_cache_pool_ = std::make_shared<PagedKeyValueCachePool>(*this);
+}
+
+namespace {
+
+// The CPUs of a NUMA node, from its cpulist in sysfs (like "0-15,32-47")
+std::vector<int> GetNumaNodeCpus(int node) {
+#ifdef __linux__
+  std::ifstream file{"/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"};
+  std::string list;
+  if (node < 0 || !std::getline(file, list))
+    throw std::runtime_error("NUMA node " + std::to_string(node) + " does not exist");
+
+  std::vector<int> cpus;
+  std::istringstream ranges{list};
+  for (std::string range; std::getline(ranges, range, ',');) {
+    if (range.empty())
+      continue;
+    const auto dash = range.find('-');
+    const int first = std::stoi(range.substr(0, dash));
+    const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+  }
+  if (cpus.empty())
+    throw std::runtime_error("NUMA node " + std::to_string(node) + " has no CPUs");
+  return cpus;
+#else
+  (void)node;
+  throw std::runtime_error("numa_node is only supported on Linux");
+#endif
 }
 
+#ifdef __linux__
+// Runs the calling thread on the given CPUs until destroyed. Memory is allocated on the node of the thread that touches
+// it first, so the weights a session copies while it's created end up on the node of its CPUs.
+struct ScopedThreadAffinity {
+  ScopedThreadAffinity(const std::vector<int>& cpus) {
+    restore_ = pthread_getaffinity_np(pthread_self(), sizeof(previous_), &previous_) == 0;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+      CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+  ~ScopedThreadAffinity() {
+    if (restore_)
+      pthread_setaffinity_np(pthread_self(), sizeof(previous_), &previous_);
+  }
+
+ private:
+  ScopedThreadAffinity(const ScopedThreadAffinity&) = delete;
+  void operator=(const ScopedThreadAffinity&) = delete;
+
+  cpu_set_t previous_;
+  bool restore_{};
+};
+#endif
+
+}  // namespace
+
 void Model::CreateSessionOptionsFromConfig(const Config::SessionOptions& config_session_options,
                                            OrtSessionOptions& session_options,
                                            bool is_primary_session_options,
                                            bool disable_graph_capture) {
+  // Share the env's thread pools unless the config asks for this session's own
+  if (GetOrtGlobals()->global_thread_pools_ && !config_session_options.intra_op_num_threads.has_value() &&
+      !config_session_options.inter_op_num_threads.has_value() && !config_session_options.numa_node.has_value()) {
+    session_options.DisablePerSessionThreads();
+  }
+
   // Default to a limit of 16 threads to optimize performance
   constexpr int min_thread_nums = 1;
   constexpr int max_thread_nums = 16;
@@ -341,6 +717,22 @@ void Model::CreateSessionOptionsFromConfig(const Config::SessionOptions& config_
     session_options.SetInterOpNumThreads(config_session_options.inter_op_num_threads.value());
   }
 
+  // With numa_node, the session has intra op threads of its own (one per core of the node unless intra_op_num_threads
+  // says otherwise), and every one but the calling thread runs on the node's CPUs. ORT numbers the CPUs from 1.
+  if (config_session_options.numa_node.has_value()) {
+    const auto cpus = GetNumaNodeCpus(*config_session_options.numa_node);
+    const int threads = config_session_options.intra_op_num_threads.value_or(std::max(1, static_cast<int>(cpus.size() / 2)));
+    std::string cpu_list;
+    for (int cpu : cpus)
+      cpu_list += (cpu_list.empty() ? "" : ",") + std::to_string(cpu + 1);
+    std::string affinities;
+    for (int i = 1; i < threads; i++)
+      affinities += (affinities.empty() ? "" : ";") + cpu_list;
+    session_options.SetIntraOpNumThreads(threads);
+    if (!affinities.empty())
+      session_options.AddConfigEntry("session.intra_op_thread_affinities", affinities.c_str());
+  }
+
   if (config_session_options.enable_cpu_mem_arena.has_value()) {
     if (config_session_options.enable_cpu_mem_arena.value())
       session_options.EnableCpuMemArena();
@@ -402,7 +794,9 @@ void Model::CreateSessionOptionsFromConfig(const Config::SessionOptions& config_
     session_options.SetEpContextFilePath(config_session_options.ep_context_file_path.value().c_str());
   }
 
-  if (config_session_options.provider_options.empty() && config_session_options.use_env_allocators) {
+  // A session bound to a NUMA node keeps its own allocator rather than sharing the env's with the other nodes
+  if (config_session_options.provider_options.empty() && config_session_options.use_env_allocators &&
+      !config_session_options.numa_node.has_value()) {
     // Share env allocators across sessions that only use the CPU provider
     session_options.AddConfigEntry("session.use_env_allocators", "1");
   }
@@ -419,6 +813,16 @@ void Model::CreateSessionOptionsFromConfig(const Config::SessionOptions& config_
         keys.emplace_back(option.first.c_str());
         values.emplace_back(option.second.c_str());
       }
+
+      // Each tensor parallel rank runs on its own GPU, unless the config picks one
+      const auto device_id = std::to_string(tensor_parallel_device_id_);
+      if (config_->model.decoder.tensor_parallel.has_value() &&
+          std::none_of(keys.begin(), keys.end(), [](const char* key) { return std::string_view{key} == "device_id"; })) {
+        keys.emplace_back("device_id");
+        values.emplace_back(device_id.c_str());
+        // The stream below and the generator buffers are created on the current device
+        Ort::SetCurrentGpuDeviceId(tensor_parallel_device_id_);
+      }
       ort_provider_options->Update(keys.data(), values.data(), keys.size());
 
       // Device type determines the scoring device.
@@ -442,29 +846,44 @@ void Model::CreateSessionOptionsFromConfig(const Config::SessionOptions& config_
       }
 
       Ort::ThrowOnError(Ort::api->UpdateROCMProviderOptions(&ort_provider_options, keys.data(), values.data(), keys.size()));
+
+#if USE_ROCM_KERNELS
+      // The HIP build of the CUDA kernels is the CUDA device interface, so the search runs on the GPU and shares the
+      // ROCm EP's stream. Without it the search runs on the CPU.
+      if (is_primary_session_options) {
+        p_device_ = GetDeviceInterface(DeviceType::CUDA);
+        ort_provider_options.has_user_compute_stream = 1;
+        ort_provider_options.user_compute_stream = p_device_->GetCudaStream();
+      }
+#endif
+
       session_options.AppendExecutionProvider_ROCM(ort_provider_options);
 #if USE_DML
     } else if (provider_options.name == "dml") {
-      if (!GetDmlInterface()) {
-        LUID device_luid{};
-        LUID* p_device_luid{};
-        for (const auto& [name, value] : provider_options.options) {
-          if (name == "luid") {
-            if (auto separator_position = value.find(":"); separator_position != std::string::npos) {
-              device_luid.HighPart = std::stol(value.substr(0, separator_position));
-              device_luid.LowPart = std::stol(value.substr(separator_position + 1));
-              p_device_luid = &device_luid;
-            }
+      // Models on different adapters each get their own DML device, models without 'luid' or 'adapter_selection' share
+      // the first one created
+      LUID device_luid{};
+      LUID* p_device_luid{};
+      for (const auto& [name, value] : provider_options.options) {
+        if (name == "luid") {
+          if (auto separator_position = value.find(":"); separator_position != std::string::npos) {
+            device_luid.HighPart = std::stol(value.substr(0, separator_position));
+            device_luid.LowPart = std::stol(value.substr(separator_position + 1));
+            p_device_luid = &device_luid;
           }
+        } else if (name == "adapter_selection" && !p_device_luid) {
+          device_luid = SelectDmlAdapter(value);
+          p_device_luid = &device_luid;
         }
-
-        InitDmlInterface(p_device_luid);
       }
 
-      SetDmlProvider(session_options);
+      auto* dml_device = InitDmlInterface(p_device_luid);
+      SetDmlProvider(session_options, *dml_device);
+      if (!disable_graph_capture && IsCudaGraphEnabled(config_session_options))
+        session_options.AddConfigEntry("ep.dml.enable_graph_capture", "1");
 
       if (is_primary_session_options)
-        p_device_ = GetDeviceInterface(DeviceType::DML);  // We use a DML allocator for input/output caches, but other tensors will use CPU tensors
+        p_device_ = dml_device;  // We use a DML allocator for input/output caches, but other tensors will use CPU tensors
 #endif
     } else if (provider_options.name == "qnn") {
       session_options.AddConfigEntry("ep.share_ep_contexts", "1");
@@ -521,12 +940,474 @@ OrtSessionOptions* Model::GetSessionOptions(const std::string& model_id) const {
   return session_options_.get();
 }
 
+std::string MakeSessionKey(const Config::SessionOptions& options) {
+  std::ostringstream key;
+  auto add = [&key](const char* name, const auto& value) {
+    if (value.has_value())
+      key << name << '=' << *value << '\n';
+  };
+  add("intra_op_num_threads", options.intra_op_num_threads);
+  add("inter_op_num_threads", options.inter_op_num_threads);
+  add("enable_cpu_mem_arena", options.enable_cpu_mem_arena);
+  add("enable_mem_pattern", options.enable_mem_pattern);
+  add("disable_cpu_ep_fallback", options.disable_cpu_ep_fallback);
+  add("disable_quant_qdq", options.disable_quant_qdq);
+  add("enable_quant_qdq_cleanup", options.enable_quant_qdq_cleanup);
+  add("ep_context_enable", options.ep_context_enable);
+  add("ep_context_embed_mode", options.ep_context_embed_mode);
+  add("ep_context_file_path", options.ep_context_file_path);
+  add("log_id", options.log_id);
+  add("log_severity_level", options.log_severity_level);
+  add("enable_profiling", options.enable_profiling);
+  add("numa_node", options.numa_node);
+  if (options.graph_optimization_level.has_value())
+    key << "graph_optimization_level=" << static_cast<int>(*options.graph_optimization_level) << '\n';
+  key << "use_env_allocators=" << options.use_env_allocators << '\n';
+  key << "mmap_external_data=" << options.mmap_external_data << '\n';
+  key << "save_prepacked_weights=" << options.save_prepacked_weights << '\n';
+  key << "share_weights=" << options.share_weights << '\n';
+  for (const auto& provider_options : options.provider_options) {
+    key << "provider=" << provider_options.name << '\n';
+    for (const auto& [name, value] : provider_options.options)
+      key << name << '=' << value << '\n';
+  }
+  return key.str();
+}
+
+MappedFile::MappedFile(const fs::path& path) {
+#ifdef _WIN32
+  file_ = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  LARGE_INTEGER size{};
+  if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &size))
+    throw std::runtime_error("Failed to open " + path.string() + " for mapping");
+  mapping_ = CreateFileMappingW(file_, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+  void* data = mapping_ ? MapViewOfFile(mapping_, FILE_MAP_COPY, 0, 0, 0) : nullptr;
+  if (!data)
+    throw std::runtime_error("Failed to map " + path.string());
+  data_ = {static_cast<char*>(data), static_cast<size_t>(size.QuadPart)};
+#else
+  int file = open(path.c_str(), O_RDONLY);
+  struct stat info;
+  if (file == -1 || fstat(file, &info) != 0) {
+    if (file != -1)
+      close(file);
+    throw std::runtime_error("Failed to open " + path.string() + " for mapping");
+  }
+  void* data = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+  close(file);  // The mapping keeps its own reference to the file
+  if (data == MAP_FAILED)
+    throw std::runtime_error("Failed to map " + path.string());
+  data_ = {static_cast<char*>(data), static_cast<size_t>(info.st_size)};
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+  if (!data_.empty())
+    UnmapViewOfFile(data_.data());
+  if (mapping_)
+    CloseHandle(mapping_);
+  if (file_ != INVALID_HANDLE_VALUE)
+    CloseHandle(file_);
+#else
+  if (!data_.empty())
+    munmap(data_.data(), data_.size());
+#endif
+}
+
+void MappedFile::Prefault() {
+  constexpr size_t page_size = 4096;             // The smallest page size, touching more often than needed is harmless
+  constexpr size_t chunk_size = 64 * 1024 * 1024;  // Per task
+  const size_t chunk_count = (data_.size() + chunk_size - 1) / chunk_size;
+  GetThreadPool().ParallelFor(chunk_count, [this](size_t chunk) {
+    const size_t end = std::min(data_.size(), (chunk + 1) * chunk_size);
+    char sum{};
+    for (size_t offset = chunk * chunk_size; offset < end; offset += page_size)
+      sum ^= static_cast<const volatile char*>(data_.data())[offset];
+    (void)sum;
+  });
+}
+
+namespace {
+
+// The initializers of an ONNX model that are stored in its external data file
+struct ExternalInitializer {
+  std::string name;
+  ONNXTensorElementDataType type;  // TensorProto.DataType has the same values
+  std::vector<int64_t> shape;
+  std::string location;  // Relative to the model file
+  size_t offset{}, length{};
+};
+
+// Reads the ModelProto's graph.initializer entries with data_location EXTERNAL straight from the protobuf wire format,
+// the rest of the model is skipped
+struct OnnxInitializerReader {
+  explicit OnnxInitializerReader(std::span<const char> data) : data_{data} {}
+
+  std::vector<ExternalInitializer> Read() {
+    std::vector<ExternalInitializer> initializers;
+    ForEachField(data_, [&](const Field& model_field) {
+      if (model_field.number == 7)  // ModelProto.graph
+        ForEachField(model_field.bytes, [&](const Field& graph_field) {
+          if (graph_field.number == 5)  // GraphProto.initializer
+            ReadTensor(graph_field.bytes, initializers);
+        });
+    });
+    return initializers;
+  }
+
+ private:
+  struct Field {
+    uint32_t number;
+    bool is_varint;
+    uint64_t varint;              // If is_varint
+    std::span<const char> bytes;  // Else the length delimited bytes (a string, message or packed array), empty for fixed size fields
+  };
+
+  static uint64_t ReadVarint(std::span<const char>& data) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (data.empty())
+        throw std::runtime_error("share_weights: the model file is truncated");
+      const auto byte = static_cast<uint8_t>(data[0]);
+      data = data.subspan(1);
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        return value;
+    }
+    throw std::runtime_error("share_weights: the model file has an invalid varint");
+  }
+
+  template <typename Fn>
+  static void ForEachField(std::span<const char> data, Fn&& fn) {
+    while (!data.empty()) {
+      const uint64_t tag = ReadVarint(data);
+      Field field{static_cast<uint32_t>(tag >> 3), false, 0, {}};
+      switch (tag & 7) {
+        case 0:
+          field.is_varint = true;
+          field.varint = ReadVarint(data);
+          fn(field);
+          break;
+        case 1:
+        case 5: {
+          const size_t size = (tag & 7) == 1 ? 8 : 4;
+          if (data.size() < size)
+            throw std::runtime_error("share_weights: the model file is truncated");
+          data = data.subspan(size);
+          break;
+        }
+        case 2: {
+          const uint64_t size = ReadVarint(data);
+          if (size > data.size())
+            throw std::runtime_error("share_weights: the model file is truncated");
+          field.bytes = data.first(static_cast<size_t>(size));
+          data = data.subspan(static_cast<size_t>(size));
+          fn(field);
+          break;
+        }
+        default:
+          throw std::runtime_error("share_weights: the model file uses an unsupported protobuf wire type");
+      }
+    }
+  }
+
+  static void ReadTensor(std::span<const char> tensor, std::vector<ExternalInitializer>& initializers) {
+    ExternalInitializer initializer{};
+    bool external = false, has_length = false;
+    ForEachField(tensor, [&](const Field& field) {
+      switch (field.number) {
+        case 1:  // dims, packed or not
+          if (field.is_varint) {
+            initializer.shape.push_back(static_cast<int64_t>(field.varint));
+          } else {
+            for (auto dims = field.bytes; !dims.empty();)
+              initializer.shape.push_back(static_cast<int64_t>(ReadVarint(dims)));
+          }
+          break;
+        case 2:  // data_type
+          initializer.type = static_cast<ONNXTensorElementDataType>(field.varint);
+          break;
+        case 8:  // name
+          initializer.name.assign(field.bytes.data(), field.bytes.size());
+          break;
+        case 13: {  // external_data, StringStringEntryProto
+          std::string key, entry;
+          ForEachField(field.bytes, [&](const Field& entry_field) {
+            if (entry_field.number == 1)
+              key.assign(entry_field.bytes.data(), entry_field.bytes.size());
+            else if (entry_field.number == 2)
+              entry.assign(entry_field.bytes.data(), entry_field.bytes.size());
+          });
+          if (key == "location") {
+            initializer.location = entry;
+          } else if (key == "offset") {
+            initializer.offset = std::stoull(entry);
+          } else if (key == "length") {
+            initializer.length = std::stoull(entry);
+            has_length = true;
+          }
+          break;
+        }
+        case 14:  // data_location
+          external = field.varint == 1;
+          break;
+      }
+    });
+    if (!external)
+      return;
+    if (!has_length)
+      throw std::runtime_error("share_weights: the external initializer " + initializer.name + " has no length");
+    initializers.push_back(std::move(initializer));
+  }
+
+  std::span<const char> data_;
+};
+
+// The external initializers of a model file, mapped once per process and added to every session that loads the file
+// with share_weights. The sessions also share one prepacked weights container, which ORT only uses for initializers added
+// through AddInitializer, so the weights that kernels repack are shared too.
+struct SharedWeights {
+  std::vector<std::shared_ptr<MappedFile>> files_;
+  std::vector<std::string> names_;
+  std::vector<std::unique_ptr<OrtValue>> values_;
+  std::unique_ptr<OrtPrepackedWeightsContainer> prepacked_weights_{OrtPrepackedWeightsContainer::Create()};
+};
+
+std::shared_ptr<SharedWeights> GetSharedWeights(const fs::path& model_path) {
+  static std::mutex mutex;
+  static std::unordered_map<std::string, std::weak_ptr<SharedWeights>> cache;
+
+  struct stat info {};
+  stat(model_path.string().c_str(), &info);
+  const auto key = MakeString(model_path.string(), '\n', info.st_size, '\n', static_cast<int64_t>(info.st_mtime));
+
+  std::scoped_lock lock{mutex};
+  auto& cached = cache[key];
+  if (auto weights = cached.lock())
+    return weights;
+
+  std::vector<ExternalInitializer> initializers;
+  {
+    MappedFile model_file{model_path};
+    initializers = OnnxInitializerReader{model_file.data_}.Read();
+  }
+  if (initializers.empty())
+    throw std::runtime_error("share_weights requires a model with external data, " + model_path.string() + " has none");
+
+  auto weights = std::make_shared<SharedWeights>();
+  static auto memory_info = OrtMemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeDefault);
+  const auto model_dir = model_path.parent_path();
+  std::unordered_map<std::string, MappedFile*> files;
+  for (auto& initializer : initializers) {
+    auto& file = files[initializer.location];
+    if (!file) {
+      weights->files_.push_back(std::make_shared<MappedFile>(model_dir / fs::path(initializer.location)));
+      file = weights->files_.back().get();
+      file->Prefault();
+    }
+    if (initializer.offset + initializer.length > file->data_.size())
+      throw std::runtime_error("share_weights: the external initializer " + initializer.name + " is outside of " + initializer.location);
+    weights->values_.push_back(OrtValue::CreateTensor(*memory_info, file->data_.data() + initializer.offset, initializer.length,
+                                                      initializer.shape, initializer.type));
+    weights->names_.push_back(std::move(initializer.name));
+  }
+  cached = weights;
+  return weights;
+}
+
+}  // namespace
+
+// Name of the cached optimized model of the model file 'path'. It hashes everything the optimized model depends on, so
+// a changed model file, session config, provider or onnxruntime build gets a cache entry of its own.
+static std::string GetOptimizedModelCacheName(const fs::path& path, const Config::SessionOptions& options, DeviceType device_type) {
+  struct stat info {};
+  stat(path.string().c_str(), &info);
+  const auto key = MakeString(path.string(), '\n', info.st_size, '\n', static_cast<int64_t>(info.st_mtime), '\n',
+                              MakeSessionKey(options), static_cast<int>(device_type), '\n', Ort::api->GetBuildInfoString());
+
+  uint64_t hash = 14695981039346656037ULL;  // 64 bit FNV-1a, unlike std::hash it's the same for every build
+  for (char c : key)
+    hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+
+  auto file_name = path.string().substr(path.string().find_last_of("/\\") + 1);
+  std::ostringstream name;
+  name << file_name.substr(0, file_name.rfind('.')) << '.' << std::hex << hash;
+  return name.str();
+}
+
+std::unique_ptr<OrtSession> Model::CreateSession(OrtEnv& ort_env, const std::string& filename,
+                                                 const Config::SessionOptions& config_session_options,
+                                                 const OrtSessionOptions& session_options,
+                                                 std::shared_ptr<MappedFile>* external_data) const {
+  auto path = config_->config_path / fs::path(GetRankFilename(filename));
+
+  // The options are shared by the sessions of the model, so the changes for this session go to a copy of them
+  auto options = session_options.Clone();
+
+  // With optimized_model_cache_dir, the first load writes the optimized model (or the EP context model with
+  // ep_context_enable) under a name of its own, and renames it to the cache entry once it is complete. So processes that
+  // start at the same time never load a partial cache entry.
+  std::optional<std::pair<fs::path, fs::path>> cache_entry;  // Written to .first, renamed to .second
+  if (config_session_options.optimized_model_cache_dir.has_value()) {
+    const fs::path cache_dir{*config_session_options.optimized_model_cache_dir};
+    if (!cache_dir.is_directory())
+      throw std::runtime_error("optimized_model_cache_dir is not a directory: " + cache_dir.string());
+
+    const auto cache_name = GetOptimizedModelCacheName(path, config_session_options, p_device_->GetType());
+    auto cache_path = cache_dir / (cache_name + ".onnx");
+    if (cache_path.exists()) {
+      path = cache_path;
+      options->SetGraphOptimizationLevel(ORT_DISABLE_ALL);  // The cached model is optimized already
+      options->AddConfigEntry("ep.context_enable", "0");
+    } else {
+#ifdef _WIN32
+      const auto writer_name = cache_name + "." + std::to_string(GetCurrentProcessId());
+#else
+      const auto writer_name = cache_name + "." + std::to_string(getpid());
+#endif
+      auto written_path = cache_dir / (writer_name + ".onnx");
+      if (config_session_options.ep_context_enable.value_or(false)) {
+        options->SetEpContextFilePath(written_path.string().c_str());
+      } else {
+        options->SetOptimizedModelFilePath(written_path.c_str());
+        options->AddConfigEntry("session.optimized_model_external_initializers_file_name", (writer_name + ".onnx.data").c_str());
+        options->AddConfigEntry("session.optimized_model_external_initializers_min_size_in_bytes", "1024");
+        // The prepacked weights are written to the external data file too, a session that loads the cache entry uses them
+        // as they are instead of packing the weights again. Older onnxruntime versions ignore the entry.
+        if (config_session_options.save_prepacked_weights)
+          options->AddConfigEntry("session.save_external_prepacked_constant_initializers", "1");
+      }
+      cache_entry.emplace(std::move(written_path), std::move(cache_path));
+    }
+  }
+
+  // With share_weights, the sessions of every model that loads the file use the same external initializers. The session
+  // keeps them alive through an aliasing pointer to their first file, which takes the place of the mapped external data.
+  std::shared_ptr<SharedWeights> shared_weights;
+  if (config_session_options.share_weights) {
+    shared_weights = GetSharedWeights(path);
+    for (size_t i = 0; i < shared_weights->names_.size(); i++)
+      options->AddInitializer(shared_weights->names_[i].c_str(), *shared_weights->values_[i]);
+  }
+
+  // With mmap_external_data, the mapped file replaces the external data file that the model refers to by its name
+  // relative to the model
+  std::shared_ptr<MappedFile> mapped_file;
+  const auto data_path = fs::path(path.string() + ".data");
+  if (shared_weights) {
+    mapped_file = std::shared_ptr<MappedFile>{shared_weights, shared_weights->files_.front().get()};
+  } else if (config_session_options.mmap_external_data && data_path.exists()) {
+    mapped_file = std::make_shared<MappedFile>(data_path);
+    mapped_file->Prefault();
+    const auto data_name = data_path.string().substr(data_path.string().find_last_of("/\\") + 1);
+    options->AddExternalInitializersFromFilesInMemory({fs::path(data_name).c_str()}, {mapped_file->data_.data()},
+                                                      {mapped_file->data_.size()});
+  }
+
+#ifdef __linux__
+  std::optional<ScopedThreadAffinity> numa_affinity;
+  if (config_session_options.numa_node.has_value())
+    numa_affinity.emplace(GetNumaNodeCpus(*config_session_options.numa_node));
+#endif
+  auto session = shared_weights ? OrtSession::Create(ort_env, path.c_str(), options.get(), *shared_weights->prepacked_weights_)
+                                : OrtSession::Create(ort_env, path.c_str(), options.get());
+  if (Trace::IsEnabled() && config_session_options.enable_profiling.has_value())
+    Trace::AddOrtProfile(*config_session_options.enable_profiling, session->GetProfilingStartTimeNs());
+
+  if (cache_entry && cache_entry->first.exists()) {
+#ifdef _WIN32
+    MoveFileExW(cache_entry->first.c_str(), cache_entry->second.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    std::rename(cache_entry->first.c_str(), cache_entry->second.c_str());
+#endif
+  }
+
+  if (mapped_file) {
+    if (external_data) {
+      *external_data = std::move(mapped_file);
+    } else {
+      std::scoped_lock lock{external_data_mutex_};
+      external_data_.push_back(std::move(mapped_file));
+    }
+  }
+  ReportLoadProgress("Created session " + filename);
+  return session;
+}
+
+void Model::ReportLoadProgress(std::string_view step) const {
+  if (load_progress_)
+    (*load_progress_)(step);
+}
+
+namespace {
+
+// Process wide cache of the sessions of CreateSharedSession. Sessions are owned by the models that use them.
+// A session is created outside of the lock, so sessions of different files are created in parallel, and a second
+// request for a session that is still being created waits for it in 'loading_'.
+struct SessionCache {
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::weak_ptr<OrtSession>> sessions_;
+  std::unordered_map<std::string, std::shared_future<std::shared_ptr<OrtSession>>> loading_;
+};
+
+SessionCache& GetSessionCache() {
+  static SessionCache cache;
+  return cache;
+}
+
+}  // namespace
+
+std::shared_ptr<OrtSession> Model::CreateSharedSession(OrtEnv& ort_env, const std::string& filename,
+                                                       const Config::SessionOptions& config_session_options,
+                                                       const OrtSessionOptions& session_options) const {
+  auto create = [&]() -> std::shared_ptr<OrtSession> {
+    std::shared_ptr<MappedFile> external_data;
+    auto created = CreateSession(ort_env, filename, config_session_options, session_options, &external_data);
+    return {created.release(), [external_data](OrtSession* p) { delete p; }};
+  };
+  if (IsCudaGraphEnabled(config_session_options))
+    return create();
+
+  const auto path = config_->config_path / fs::path(GetRankFilename(filename));
+  const auto key = path.string() + '\n' + MakeSessionKey(config_session_options);
+
+  auto& cache = GetSessionCache();
+  std::promise<std::shared_ptr<OrtSession>> created;
+  {
+    std::unique_lock lock{cache.mutex_};
+    if (auto session = cache.sessions_[key].lock())
+      return session;
+    if (auto it = cache.loading_.find(key); it != cache.loading_.end()) {
+      auto loading = it->second;
+      lock.unlock();
+      return loading.get();
+    }
+    cache.loading_.emplace(key, created.get_future().share());
+  }
+
+  std::shared_ptr<OrtSession> session;
+  try {
+    session = create();
+  } catch (...) {
+    std::scoped_lock lock{cache.mutex_};
+    cache.loading_.erase(key);
+    created.set_exception(std::current_exception());
+    throw;
+  }
+  std::scoped_lock lock{cache.mutex_};
+  cache.sessions_[key] = session;
+  cache.loading_.erase(key);
+  created.set_value(session);
+  return session;
+}
+
 std::shared_ptr<Tokenizer> Model::CreateTokenizer() const {
   return std::make_shared<Tokenizer>(*config_);
 }
 
 std::shared_ptr<MultiModalProcessor> Model::CreateMultiModalProcessor() const {
-  return std::make_shared<MultiModalProcessor>(*config_, *session_info_);
+  return std::make_shared<MultiModalProcessor>(*config_, *session_info_, *p_device_);
 }
 
 std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, const char* config_path, const RuntimeSettings* settings /*= nullptr*/) {
@@ -534,11 +1415,44 @@ std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, const char* config_path, con
   if (settings) {
     config_overlay = settings->GenerateConfigOverlay();
   }
-  auto config = std::make_unique<Config>(fs::path(config_path), config_overlay);
-  return CreateModel(ort_env, std::move(config));
+  return CreateModel(ort_env, LoadConfig(fs::path(config_path), config_overlay));
 }
 
-std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, std::unique_ptr<Config> config) {
+// Runs the dummy generations of the warmup config. The first runs of a session pay for kernel tuning, allocator growth
+// and graph capture, this moves that cost to the model creation.
+static void RunWarmup(const Model& model) {
+  const auto& config = *model.config_;
+  const auto& warmup = *config.model.warmup;
+  if (config.model.type == "whisper" || config.model.type == "phi3v")
+    throw std::runtime_error("warmup is not supported for model type " + config.model.type);
+
+  // Any token that isn't the padding token, which would be masked out
+  const int32_t token = config.model.bos_token_id != config.model.pad_token_id
+                            ? config.model.bos_token_id
+                            : (config.model.pad_token_id + 1) % std::max(config.model.vocab_size, 2);
+  for (int batch_size : warmup.batch_sizes) {
+    for (int prompt_length : warmup.prompt_lengths) {
+      if (batch_size < 1 || prompt_length < 1)
+        throw std::runtime_error("warmup batch_sizes and prompt_lengths must be 1 or greater");
+
+      auto params = CreateGeneratorParams(model);
+      params->search.batch_size = batch_size;
+      params->search.max_length = prompt_length + warmup.decode_steps;
+      if (config.model.context_length > 0)
+        params->search.max_length = std::min(params->search.max_length, config.model.context_length);
+      params->search.min_length = params->search.max_length;  // So the dummy tokens can't end the generation early
+      params->TryGraphCapture(batch_size);
+
+      auto generator = CreateGenerator(model, *params);
+      std::vector<int32_t> tokens(static_cast<size_t>(batch_size) * prompt_length, token);
+      generator->AppendTokens(cpu_span<const int32_t>{tokens.data(), tokens.size()});
+      for (int step = 0; step < warmup.decode_steps && !generator->IsDone(); step++)
+        generator->GenerateNextToken();
+    }
+  }
+}
+
+static std::shared_ptr<Model> CreateModelWithoutWarmup(OrtEnv& ort_env, std::unique_ptr<Config> config) {
   std::set<std::string> llm_types = {"chatglm", "decoder", "gemma", "gemma2", "granite", "llama", "mistral", "nemotron", "olmo", "phi", "phimoe", "phi3", "phi3small", "qwen2"};
   if (config->model.type == "gpt2")
     return std::make_shared<Gpt_Model>(std::move(config), ort_env);
@@ -554,6 +1468,31 @@ std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, std::unique_ptr<Config> conf
   throw std::runtime_error("Unsupported model_type in config.json: " + config->model.type);
 }
 
+std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, std::unique_ptr<Config> config, const ModelLoadProgress* progress) {
+  const bool warmup = config->model.warmup.has_value();
+  t_load_progress = progress;  // Picked up by the Model constructor
+  std::shared_ptr<Model> model;
+  try {
+    model = CreateModelWithoutWarmup(ort_env, std::move(config));
+  } catch (...) {
+    t_load_progress = nullptr;
+    throw;
+  }
+  t_load_progress = nullptr;
+
+  struct ResetProgress {
+    ~ResetProgress() { model_.load_progress_ = nullptr; }
+    Model& model_;
+  } reset_progress{*model};
+  if (progress)
+    model->LoadSessions();
+  if (warmup) {
+    RunWarmup(*model);
+    model->ReportLoadProgress("Ran warmup");
+  }
+  return model;
+}
+
 std::shared_ptr<GeneratorParams> CreateGeneratorParams(const Model& model) {
   return std::make_shared<GeneratorParams>(model);
 }
@@ -576,6 +1515,33 @@ void Cast(OrtValue& input, std::unique_ptr<OrtValue>& output, DeviceInterface& d
     GetDeviceInterface(DeviceType::CPU)->Cast(input, *output);
 }
 
+std::unique_ptr<OrtValue> GatherRows(OrtValue& input, std::span<const int32_t> rows, DeviceInterface& device) {
+  auto input_info = input.GetTensorTypeAndShapeInfo();
+  auto shape = input_info->GetShape();
+  auto type = input_info->GetElementType();
+  const size_t row_size_bytes = input_info->GetElementCount() * SizeOf(type) / shape[0];
+
+  shape[0] = static_cast<int64_t>(rows.size());
+  auto output = OrtValue::CreateTensor(device.GetAllocator(), shape, type);
+
+  auto input_span = ByteWrapTensor(device, input);
+  auto output_span = ByteWrapTensor(device, *output);
+  for (size_t i = 0; i < rows.size(); i++)
+    output_span.subspan(i * row_size_bytes, row_size_bytes).CopyFrom(input_span.subspan(rows[i] * row_size_bytes, row_size_bytes));
+  return output;
+}
+
+std::unique_ptr<OrtValue> SliceRows(OrtValue& input, size_t begin, size_t count) {
+  auto input_info = input.GetTensorTypeAndShapeInfo();
+  auto shape = input_info->GetShape();
+  auto type = input_info->GetElementType();
+  const size_t row_size_bytes = input_info->GetElementCount() * SizeOf(type) / shape[0];
+
+  shape[0] = static_cast<int64_t>(count);
+  auto* data = static_cast<uint8_t*>(input.GetTensorMutableRawData()) + begin * row_size_bytes;
+  return OrtValue::CreateTensor(input.GetTensorMemoryInfo(), data, count * row_size_bytes, shape, type);
+}
+
 std::unique_ptr<OrtValue> Model::ExpandInputs(std::unique_ptr<OrtValue>& input, int num_beams) const {
   // Input shape (batch_size, sequence_length). The input is required with data type T.
   // Output shape (batch_size * num_beams, sequence_length)
@@ -605,10 +1571,10 @@ std::unique_ptr<OrtValue> Model::ExpandInputs(std::unique_ptr<OrtValue>& input,
   return expanded;
 }
 
-MultiModalProcessor::MultiModalProcessor(Config& config, const SessionInfo& session_info)
+MultiModalProcessor::MultiModalProcessor(Config& config, const SessionInfo& session_info, DeviceInterface& device)
     : tokenizer_{std::make_shared<Tokenizer>(config)} {
   if (config.model.type == "phi3v") {
-    image_processor_ = std::make_shared<ImageProcessor>(config, session_info);
+    image_processor_ = std::make_shared<ImageProcessor>(config, session_info, device);
   } else if (config.model.type == "whisper") {
     audio_processor_ = std::make_shared<AudioProcessor>(config, session_info);
   } else {
@@ -1,6 +1,9 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 #pragma once
+#include <list>
+#include <mutex>
+
 #include "ortx_tokenizer.h"
 #include "captured_graph_pool.h"
 #include "utils.h"
@@ -12,10 +15,31 @@
 namespace Generators {
 
 struct Tokenizer;
+struct PagedKeyValueCachePool;
+struct TokenVocabulary;
+struct DeviceArena;
+struct StateWriter;
+struct StateReader;
 
 void Cast(OrtValue& input, std::unique_ptr<OrtValue>& output, DeviceInterface& device, ONNXTensorElementDataType type);
+// Returns a tensor on 'device' holding the given rows of the first dimension of 'input' (also on 'device'), in that order
+std::unique_ptr<OrtValue> GatherRows(OrtValue& input, std::span<const int32_t> rows, DeviceInterface& device);
+// Returns a tensor of rows [begin, begin + count) of the first dimension of 'input' that shares the memory of 'input'
+std::unique_ptr<OrtValue> SliceRows(OrtValue& input, size_t begin, size_t count);
 void CheckResult(extError_t error);
 
+struct State;
+
+// A row of a state's batch whose KV cache entries are copied into another state (see State::MergeRows)
+struct StateRow {
+  State* state;
+  size_t row;     // Index into the batch of 'state'
+  size_t begin;   // The row's first KV cache entry, the entries before it are padding
+  size_t length;  // The row's KV cache entries from 'begin' on
+};
+
+// The per-generator model state. A State is not thread-safe and must only be used by one thread at a time, while the
+// States of different generators (of the same or different models) can run concurrently on separate threads.
 struct State {
   State(const GeneratorParams& params, const Model& model_);
   virtual ~State();
@@ -30,6 +54,59 @@ struct State {
   OrtValue* GetInput(const char* name);
 
   virtual void RewindTo(size_t index) { (void)index; };
+  // Throws if RewindTo(index) can't be done, called before anything of the generator is rewound
+  virtual void CheckRewindTo(size_t index) const { (void)index; }
+
+  // Called before the first Run with the prompt. Returns the number of leading prompt tokens that are already in the
+  // KV cache (shared from an earlier generator), those tokens are skipped and only the rest is passed to Run.
+  virtual size_t ReusePrefix(std::span<const int32_t> tokens) { return 0; }
+
+  // Called before the first Run of a new state (see Generator::Fork). Copies or shares the KV cache entries of the first
+  // 'length' tokens of 'source', a state of the same model, so the next Run continues after them. Returns false if the
+  // state can't do that, then nothing is changed.
+  virtual bool ForkFrom(State& source, size_t length) { return false; }
+
+  // Called instead of the first Run of a new state (see Generator::Merge). 'tokens' are the first 'length' tokens of
+  // every row of the batch, left padded with the pad token. Row n of the batch continues rows[n], whose entries take the
+  // last rows[n].length of the 'length' positions. Sets up the inputs as if the tokens were run and copies the KV cache
+  // entries of the rows, so the next Run continues after them. Returns false if the state can't do that, then nothing
+  // is changed.
+  virtual bool MergeRows(DeviceSpan<int32_t>& tokens, int length, std::span<const StateRow> rows) { return false; }
+
+  // Snapshots (see Generator::SaveState). SaveKeyValueCache writes the KV cache entries of the first 'length' tokens and
+  // LoadKeyValueCache reads them into a new state before its first Run, throwing if they don't fit the model. Both return
+  // false if the state doesn't support that, then nothing is written or changed.
+  virtual bool SaveKeyValueCache(StateWriter& writer, size_t length) { return false; }
+  virtual bool LoadKeyValueCache(StateReader& reader, size_t length) { return false; }
+  // Cached documents (see Generator::AppendState). Called between Runs with the KV cache holding the entries of the first
+  // 'position' tokens, reads the entries saved for 'length' tokens at positions [0, length) after them, re-encoded for
+  // their new positions, so the next Run continues after them. Returns false if the state can't do that, then nothing is
+  // changed.
+  virtual bool AppendKeyValueCache(StateReader& reader, size_t length, size_t position) { return false; }
+  // Attention sinks (see search.attention_sinks). Called between Runs with the KV cache holding the entries of the first
+  // 'length' tokens, drops the entries of the 'count' tokens from 'begin' on so the next Run continues after the
+  // 'length - count' left. Returns false if the state can't do that, then nothing is changed.
+  virtual bool EvictKeyValueCache(size_t length, size_t begin, size_t count) { return false; }
+  // LongRoPE (see Config::Model::Decoder::RotaryEmbedding). Called between Runs with the KV cache holding the entries of
+  // the first 'length' tokens, re-encodes their keys for the long factors (or back for the short ones when false). Row n
+  // of the batch starts with padding[n] pad tokens. Returns false if the state can't do that, then nothing is changed.
+  virtual bool SwitchRotaryFactors(size_t length, std::span<const size_t> padding, bool long_factors) { return false; }
+
+  // Moves the KV cache off the device between Runs (see Generator::OffloadKeyValueCache), returns false if it stayed
+  virtual bool OffloadKeyValueCache(const fs::path& path) {
+    throw std::runtime_error("Offloading the key-value cache is not supported for this model type.");
+  }
+  virtual void RestoreKeyValueCache() {
+    throw std::runtime_error("Offloading the key-value cache is not supported for this model type.");
+  }
+
+  // Drops the finished sequences from the model's batch between Runs, keeping the given rows (ascending indices into the
+  // current batch). The next_tokens passed to the next Runs and the logits they return only cover these rows.
+  // Returns false if the state can't change its batch size, then nothing is changed.
+  virtual bool CompactBatch(std::span<const int32_t> rows) { return false; }
+
+  // Sets the KeyValueCache and Logits categories of 'usage' to the memory the state holds now
+  virtual void UpdateMemoryUsage(MemoryUsage& usage) const {}
 
   virtual OrtValue* GetOutput(const char* name);
 
@@ -40,23 +117,52 @@ struct State {
   const Model& model_;
 
   std::shared_ptr<const GeneratorParams> params_;
+  // The batch size the model's inputs and outputs are sized for. params_->search.batch_size, unless a captured graph
+  // shared by a bucket of batch sizes pads the batch (see DecoderOnly_State::ReserveCapturedGraph).
+  int batch_size_;
+  int BatchBeamSize() const { return batch_size_ * params_->search.num_beams; }
 
   std::vector<const char*> input_names_, output_names_;
   std::vector<std::string> adapter_names_;
   std::vector<OrtValue*> inputs_, outputs_;
 
+  // Set by the generator when the next Run's logits only feed a greedy or top k selection. If the logits are fp16,
+  // Logits::Get then skips the fp32 conversion and EOS handling, sets raw_logits_ and returns an empty span.
+  bool defer_logits_{};
+  OrtValue* raw_logits_{};  // The last tokens' fp16 logits [batch_size, 1, vocab_size] of the last deferred Run, else null
+  // Models with a logits_top_k head: the last tokens' candidates of the last deferred Run, with the EOS handling applied,
+  // shape [batch_size, logits_top_k]. Else empty.
+  std::span<const float> top_k_values_;
+  std::span<const int32_t> top_k_tokens_;
+
+  // Set by the generator while it drafts tokens from a pipeline model's early exit head. The pipeline models after the
+  // one with the head are skipped and Run returns an empty span, the exit logits are read with GetOutput.
+  bool early_exit_{};
+
+  // Cleared by the pipeline on the states that don't run last in a step, the HTP then stays in the active performance
+  // mode after their runs
+  bool ends_step_{true};
+
  protected:
   void Run(OrtSession& session, int new_batch_size);  // Uses the inputs below to run
+  void RunStaged(OrtSession& session, const CapturedGraphInfo& captured_graph_info);
   bool first_run_{true};
+  GeneratorMetrics::Stage run_stage_{GeneratorMetrics::SessionRun};  // The stage Run's session time goes to
 
   std::unique_ptr<OrtRunOptions> run_options_;
 
  private:
+  void SetPostRunPerformanceMode(bool others_running);
+
   int current_batch_size_{0};
+  std::optional<bool> idle_after_run_;  // The last post run performance mode set, the idle one if true
   std::shared_ptr<Adapters> adapters_;
   ExtraOutputs extra_outputs_;
 };
 
+// Most tokens decode to the same text wherever they are, those are looked up in the tokenizer's TokenVocabulary. The
+// detokenizer still decodes the first token, special tokens, the pieces of multibyte characters and the token after
+// any of those, which depend on the tokens around them.
 struct TokenizerStream : LeakChecked<TokenizerStream> {
   TokenizerStream(const Tokenizer& tokenizer);
 
@@ -64,8 +170,24 @@ struct TokenizerStream : LeakChecked<TokenizerStream> {
 
  private:
   std::shared_ptr<const Tokenizer> tokenizer_;
+  std::shared_ptr<const TokenVocabulary> vocabulary_;
   OrtxPtr<OrtxObject> cache_;
   std::string chunk_;
+  bool detokenize_next_{true};  // The next token has to go through the detokenizer
+};
+
+// TokenizerStream for 'count' independent sequences that are decoded together, one token per sequence and call
+struct BatchTokenizerStream : LeakChecked<BatchTokenizerStream> {
+  BatchTokenizerStream(const Tokenizer& tokenizer, size_t count);
+
+  // Returns the text each sequence's token completed (empty if none), valid until the next Decode
+  std::span<const char* const> Decode(std::span<const int32_t> tokens);
+
+ private:
+  std::vector<std::unique_ptr<TokenizerStream>> streams_;
+  std::string arena_;                  // Every chunk of the last Decode, each followed by '\0'
+  std::vector<size_t> chunk_offsets_;  // Offset of each sequence's chunk in arena_
+  std::vector<const char*> chunks_;    // Pointers into arena_
 };
 
 // Turn an array of ragged token sequences into a 2D input suitable for batching. Handles padding for the model
@@ -80,20 +202,40 @@ struct Tokenizer : std::enable_shared_from_this<Tokenizer>, LeakChecked<Tokenize
   std::vector<int32_t> Encode(const char* text) const;
   std::string Decode(std::span<const int32_t> tokens) const;
 
+  // Encodes the segments separately and concatenates their tokens, the tokens the tokenizer adds to the start of every
+  // text (such as BOS) are only kept for the first segment. With tokenizer_cache_size set, segments that repeat between
+  // calls (a system prompt, the role markers of a chat template) are only tokenized once. Segments should be split at
+  // boundaries the tokenizer doesn't merge across, like special tokens.
+  std::vector<int32_t> EncodeSegments(std::span<const std::string> segments) const;
+
   std::vector<int32_t> EncodeBatch(std::span<const std::string> strings) const;
   std::vector<std::string> DecodeBatch(std::span<const int32_t> sequences, size_t count) const;
 
   int32_t TokenToTokenId(const char* token) const;
 
+  // The text of every token, built on first use (by the first TokenizerStream), as it decodes the whole vocabulary
+  std::shared_ptr<const TokenVocabulary> GetTokenVocabulary() const;
+
   OrtxPtr<OrtxTokenizer> tokenizer_;
   std::shared_ptr<Tokenizer> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
 
  private:
+  std::vector<int32_t> EncodeUncached(const char* text) const;
+
   int32_t pad_token_id_;
+  size_t vocab_size_;
+
+  mutable std::mutex token_vocabulary_mutex_;
+  mutable std::shared_ptr<const TokenVocabulary> token_vocabulary_;  // Protected by token_vocabulary_mutex_
+
+  size_t cache_size_;
+  mutable std::mutex cache_mutex_;
+  mutable std::list<std::pair<std::string, std::vector<int32_t>>> cache_;  // Most recently used first, protected by cache_mutex_
+  mutable std::unordered_map<std::string_view, decltype(cache_)::iterator> cache_index_;  // Keyed by the strings in cache_
 };
 
 struct MultiModalProcessor : std::enable_shared_from_this<MultiModalProcessor> {
-  MultiModalProcessor(Config& config, const SessionInfo& session_info);
+  MultiModalProcessor(Config& config, const SessionInfo& session_info, DeviceInterface& device);
 
   std::shared_ptr<Tokenizer> tokenizer_;
   std::shared_ptr<ImageProcessor> image_processor_;
@@ -119,6 +261,29 @@ struct SessionInfo {
   std::unordered_map<std::string, ONNXTensorElementDataType> inputs_, outputs_;
 };
 
+// Identifies the session options that Model::CreateSessionOptionsFromConfig creates from 'options'
+std::string MakeSessionKey(const Config::SessionOptions& options);
+
+// Copy on write memory mapping of a whole file. Pages that are never written stay shared with the page cache, so
+// processes that map the same file share its memory.
+struct MappedFile {
+  MappedFile(const fs::path& path);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  void Prefault();  // Reads every page on the thread pool, so the session creation doesn't take the page faults one by one
+
+  std::span<char> data_;
+
+ private:
+#ifdef _WIN32
+  HANDLE file_{INVALID_HANDLE_VALUE};
+  HANDLE mapping_{};
+#endif
+};
+
 struct Model : std::enable_shared_from_this<Model>, LeakChecked<Model> {
   Model(std::unique_ptr<Config> config);
   virtual ~Model();
@@ -129,12 +294,68 @@ struct Model : std::enable_shared_from_this<Model>, LeakChecked<Model> {
 
   virtual std::unique_ptr<State> CreateState(DeviceSpan<int32_t> sequence_lengths, const GeneratorParams& params) const = 0;
 
+  // Loads the sessions that the model only loads on first use
+  virtual void LoadSessions() const {}
+
+  // Passes 'step' to the progress callback of the CreateModel that creates this model, if any
+  void ReportLoadProgress(std::string_view step) const;
+
+  // Runs the decoder once on the sequences, without a generator or KV cache, and returns their pooled final hidden states
+  // (outputs.hidden_states) as a float tensor [sequence count, hidden_size] on the CPU. 'pooling' is "last_token" or "mean".
+  virtual std::unique_ptr<OrtValue> Embed(std::span<const std::vector<int32_t>> sequences, std::string_view pooling) const {
+    throw std::runtime_error("Embeddings are not supported for this model type.");
+  }
+
+  // Runs the decoder once on each prompt followed by its continuation and returns the log-probability of every
+  // continuation token given the tokens before it, as a float tensor [prompt count, longest continuation] on the CPU.
+  // The entries past the end of a shorter continuation are 0.
+  virtual std::unique_ptr<OrtValue> ScoreSequences(std::span<const std::vector<int32_t>> prompts,
+                                                   std::span<const std::vector<int32_t>> continuations) const {
+    throw std::runtime_error("Sequence scoring is not supported for this model type.");
+  }
+
   std::unique_ptr<OrtValue> ExpandInputs(std::unique_ptr<OrtValue>& input, int num_beams) const;
 
   CapturedGraphPool* GetCapturedGraphPool() const { return captured_graph_pool_.get(); }
 
+  // The allocator for generator buffers on 'device', which is the model's DeviceArena for it with device_arena
+  Ort::Allocator& GetAllocator(DeviceInterface& device) const;
+
+  // memory_usage_ as JSON, followed by the memory the model holds for its generators: the paged key-value cache pool,
+  // the static buffers of the idle captured graphs, the free blocks of the device arenas and the buffers pooled by the
+  // devices (see MemoryUsage::ToJson)
+  std::string GetMemoryUsage() const;
+  // Frees the memory kept for reuse: the free blocks of the device arenas and the buffers pooled by the devices
+  void ReleaseCachedMemory() const;
+
   OrtSessionOptions* GetSessionOptions(const std::string& model_id) const;
 
+  // The bytes of every token, for guidance. Built on first use, as it decodes the whole vocabulary.
+  std::shared_ptr<const TokenVocabulary> GetTokenVocabulary() const;
+
+  // A copy of the CPU tensor 'tensor' on p_device_inputs_, shared by every generator that is given the same tensor
+  // through GeneratorParams::SetInputs (see ExtraInputs), so it is uploaded once rather than on every run. Freed with
+  // the last generator that uses it. Null if the tensor can be used as it is. The tensor's data must not change while
+  // generators use it.
+  std::shared_ptr<OrtValue> GetSharedInput(const std::shared_ptr<Tensor>& tensor) const;
+
+  // 'filename' with {rank} replaced by the tensor parallel rank, see Config::Model::Decoder::TensorParallel
+  std::string GetRankFilename(const std::string& filename) const;
+
+  // Creates the session of the model file 'filename' in the config directory. With mmap_external_data, its external
+  // data file is mapped into memory and kept alive by 'external_data' if given, otherwise by this model.
+  std::unique_ptr<OrtSession> CreateSession(OrtEnv& ort_env, const std::string& filename,
+                                            const Config::SessionOptions& config_session_options,
+                                            const OrtSessionOptions& session_options,
+                                            std::shared_ptr<MappedFile>* external_data = nullptr) const;
+
+  // Like CreateSession, but every model in the process that loads the same file with the same session options gets the
+  // same session, so they share its weights and the copies of them prepacked by the EP. The session keeps its mapped
+  // external data alive itself. Sessions with graph capture aren't shared, their captured graphs belong to one model.
+  std::shared_ptr<OrtSession> CreateSharedSession(OrtEnv& ort_env, const std::string& filename,
+                                                  const Config::SessionOptions& config_session_options,
+                                                  const OrtSessionOptions& session_options) const;
+
   std::unique_ptr<Config> config_;
   std::unique_ptr<OrtSessionOptions> session_options_;
 
@@ -142,14 +363,25 @@ struct Model : std::enable_shared_from_this<Model>, LeakChecked<Model> {
   mutable DeviceInterface* p_device_inputs_{};   // For some model inputs, the device might be the CPU device (all but KV cache currently for WebGPU and DML)
   mutable DeviceInterface* p_device_kvcache_{};  // The kvcache is always allocated in device memory  (TODO: Remove in favor of just p_device_?)
 
+  int tensor_parallel_rank_{};       // With decoder.tensor_parallel, the rank of this process
+  int tensor_parallel_device_id_{};  // and the GPU it runs on, its rank on this machine
+
   Ort::Allocator& allocator_cpu_{GetDeviceInterface(DeviceType::CPU)->GetAllocator()};
 
   std::unique_ptr<SessionInfo> session_info_;
 
+  std::shared_ptr<PagedKeyValueCachePool> paged_kv_cache_pool_;  // Only set if the model uses a paged key-value cache
+
+  std::shared_ptr<MemoryUsage> memory_usage_{std::make_shared<MemoryUsage>()};  // The sum of its live generators' usage
+  mutable std::atomic<int> running_states_{};  // The states in State::Run, see active_performance_mode
+
   std::shared_ptr<Model> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
+  const ModelLoadProgress* load_progress_{};  // Only set while CreateModel runs
 
  protected:
   void InitDeviceAllocator(OrtSession& session);
+  std::vector<DeviceInterface*> GetDevices() const;
+  void InitTensorParallel();  // Finds the rank of this process and shards the key-value heads
   void CreateSessionOptions();
 
   void CreateSessionOptionsFromConfig(const Config::SessionOptions& config_session_options,
@@ -157,8 +389,21 @@ struct Model : std::enable_shared_from_this<Model>, LeakChecked<Model> {
                                       bool is_primary_session_options,
                                       bool disable_graph_capture);
 
+  std::unordered_map<DeviceInterface*, std::unique_ptr<DeviceArena>> device_arenas_;  // Declared before everything that allocates from them
   std::shared_ptr<CapturedGraphPool> captured_graph_pool_;
   std::map<std::string, std::unique_ptr<OrtSessionOptions>> pipeline_session_options_;
+  mutable std::mutex external_data_mutex_;  // Sessions are created in parallel
+  mutable std::vector<std::shared_ptr<MappedFile>> external_data_;  // See CreateSession, only changes while sessions are created
+
+  mutable std::mutex token_vocabulary_mutex_;
+  mutable std::shared_ptr<const TokenVocabulary> token_vocabulary_;  // Protected by token_vocabulary_mutex_
+
+  struct SharedInput {
+    std::weak_ptr<Tensor> tensor;  // Expired once the tensor is gone, so a new tensor at the same address isn't matched
+    std::weak_ptr<OrtValue> value;
+  };
+  mutable std::mutex shared_inputs_mutex_;
+  mutable std::unordered_map<const Tensor*, SharedInput> shared_inputs_;  // See GetSharedInput, protected by shared_inputs_mutex_
 };
 
 }  // namespace Generators
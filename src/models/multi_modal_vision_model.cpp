@@ -48,6 +48,36 @@ int64_t GetNumImageTokens(const std::vector<GeneratorParams::Input>& extra_input
   return num_image_tokens;
 }
 
+// Hash of every vision model input, so equal images (and image sizes) give equal keys. Only CPU inputs can be hashed.
+std::optional<uint64_t> HashVisionInputs(const std::vector<GeneratorParams::Input>& extra_inputs) {
+  uint64_t hash = 14695981039346656037ULL;  // 64 bit FNV-1a, over 8 byte words for the multi-megabyte pixel values
+  auto add = [&hash](uint64_t word) { hash = (hash ^ word) * 1099511628211ULL; };
+
+  for (auto& input : extra_inputs) {
+    auto& tensor = *input.tensor->ort_tensor_;
+    if (tensor.GetTensorMemoryInfo().GetDeviceType() != OrtMemoryInfoDeviceType_CPU)
+      return std::nullopt;
+
+    for (char c : input.name)
+      add(static_cast<unsigned char>(c));
+    auto info = tensor.GetTensorTypeAndShapeInfo();
+    add(static_cast<uint64_t>(info->GetElementType()));
+    for (auto dim : info->GetShape())
+      add(static_cast<uint64_t>(dim));
+
+    auto bytes = std::span{tensor.GetTensorData<uint8_t>(), info->GetElementCount() * SizeOf(info->GetElementType())};
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= bytes.size(); i += sizeof(uint64_t)) {
+      uint64_t word;
+      std::memcpy(&word, bytes.data() + i, sizeof(word));
+      add(word);
+    }
+    for (; i < bytes.size(); i++)
+      add(bytes[i]);
+  }
+  return hash;
+}
+
 }  // namespace
 
 MultiModalVisionModel::MultiModalVisionModel(std::unique_ptr<Config> config, OrtEnv& ort_env)
@@ -59,18 +89,34 @@ MultiModalVisionModel::MultiModalVisionModel(std::unique_ptr<Config> config, Ort
   auto embedding_session_options = OrtSessionOptions::Create();
   CreateSessionOptionsFromConfig(config_->model.decoder.session_options, *embedding_session_options, true, true);
 
-  embedding_session_ = OrtSession::Create(
-      ort_env, (config_->config_path / fs::path(config_->model.embedding.filename)).c_str(), embedding_session_options.get());
-  vision_session_ = OrtSession::Create(
-      ort_env, (config_->config_path / fs::path(config_->model.vision.filename)).c_str(), vision_session_options.get());
-  decoder_session_ = OrtSession::Create(
-      ort_env, (config_->config_path / fs::path(config_->model.decoder.filename)).c_str(), session_options_.get());
+  // The sessions are independent, so they're created in parallel
+  const std::array<std::function<void()>, 3> create_sessions{
+      [&] { embedding_session_ = CreateSession(ort_env, config_->model.embedding.filename, config_->model.decoder.session_options, *embedding_session_options); },
+      [&] { vision_session_ = CreateSession(ort_env, config_->model.vision.filename, config_->model.decoder.session_options, *vision_session_options); },
+      [&] { decoder_session_ = CreateSession(ort_env, config_->model.decoder.filename, config_->model.decoder.session_options, *session_options_); }};
+  GetThreadPool().ParallelFor(create_sessions.size(), [&](size_t i) { create_sessions[i](); });
 
   InitDeviceAllocator(*decoder_session_);
   session_info_->Add(*embedding_session_);
   session_info_->Add(*vision_session_);
 }
 
+std::shared_ptr<OrtValue> MultiModalVisionModel::FindImageFeatures(uint64_t key) const {
+  std::scoped_lock lock{image_feature_cache_mutex_};
+  auto it = std::find_if(image_feature_cache_.begin(), image_feature_cache_.end(), [key](auto& entry) { return entry.first == key; });
+  if (it == image_feature_cache_.end())
+    return {};
+  image_feature_cache_.splice(image_feature_cache_.begin(), image_feature_cache_, it);
+  return it->second;
+}
+
+void MultiModalVisionModel::AddImageFeatures(uint64_t key, std::shared_ptr<OrtValue> image_features) const {
+  std::scoped_lock lock{image_feature_cache_mutex_};
+  image_feature_cache_.emplace_front(key, std::move(image_features));
+  if (image_feature_cache_.size() > static_cast<size_t>(config_->model.vision.feature_cache_size))
+    image_feature_cache_.pop_back();
+}
+
 std::unique_ptr<State> MultiModalVisionModel::CreateState(DeviceSpan<int32_t> sequence_lengths, const GeneratorParams& params) const {
   return std::make_unique<MultiModalPipelineState>(*this, sequence_lengths, params);
 }
@@ -79,6 +125,7 @@ EmbeddingState::EmbeddingState(const MultiModalVisionModel& model, const Generat
     : State{params, model},
       model_{model},
       num_image_tokens_{num_image_tokens} {
+  run_stage_ = GeneratorMetrics::EmbeddingRun;
   input_ids_.Add();
   image_features_.Add();
   inputs_embeds_.Add();
@@ -100,6 +147,7 @@ VisionState::VisionState(const MultiModalVisionModel& model, const GeneratorPara
     : State{params, model},
       model_{model},
       num_image_tokens_{num_image_tokens} {
+  run_stage_ = GeneratorMetrics::VisionRun;
   extra_inputs_.Add();
   image_features_.Add();
 }
@@ -132,7 +180,10 @@ void DecoderState::UpdateInputsOutputs(DeviceSpan<int32_t>& next_tokens, int tot
   int batch_size = static_cast<int>(inputs_embeds_.GetShape()[0]);
   size_t new_length = next_tokens.size() / batch_size;
   position_inputs_.Update(next_tokens, total_length, static_cast<int>(new_length));
-  kv_cache_.Update(beam_indices, total_length);
+  {
+    Metrics::Timer timer{GeneratorMetrics::KeyValueCache};
+    kv_cache_.Update(beam_indices, total_length);
+  }
   logits_.Update(next_tokens, new_length);
   inputs_embeds_.UpdateSequenceLength(new_length);
 }
@@ -160,13 +211,18 @@ DeviceSpan<float> MultiModalPipelineState::Run(int current_length, DeviceSpan<in
   //   - input_ids, image_features -> |embeddings_model| -> inputs_embeds
   //   - inputs_embeds -> |decoder_model| -> logits
 
+  if (is_prompt_ && num_image_tokens_ > 0) {
+    const size_t text_prefix_length = GetTextPrefixLength(next_tokens);
+    if (text_prefix_length > 0)
+      return RunPromptOverlapped(current_length, next_tokens, next_indices, text_prefix_length);
+  }
+
   embedding_state_->UpdateInputsOutputs(next_tokens, is_prompt_);
   decoder_state_->UpdateInputsOutputs(next_tokens, current_length, next_indices);
 
   if (is_prompt_) {
-    if (num_image_tokens_ > 0) {
-      vision_state_->Run(current_length, next_tokens, next_indices);
-    }
+    if (num_image_tokens_ > 0)
+      RunVision(current_length, next_tokens, next_indices);
     embedding_state_->image_features_.ReuseImageFeaturesBuffer(vision_state_->image_features_);
     embedding_state_->inputs_embeds_.ReuseEmbeddingsBuffer(decoder_state_->inputs_embeds_);
     embedding_state_->Run(current_length, next_tokens, next_indices);
@@ -184,4 +240,84 @@ DeviceSpan<float> MultiModalPipelineState::Run(int current_length, DeviceSpan<in
   return decoder_state_->Run(current_length, next_tokens, next_indices);
 }
 
+size_t MultiModalPipelineState::GetTextPrefixLength(DeviceSpan<int32_t>& next_tokens) const {
+  // The prompt is run in two parts, which needs the continuous decoding paths of the decoder inputs (batch size 1 only)
+  // and doesn't work with the fixed shapes of a captured graph
+  if (params_->BatchBeamSize() != 1 || captured_graph_info_)
+    return 0;
+
+  // Image placeholders are the negated image ids
+  auto tokens = next_tokens.CpuSpan();
+  auto first_image_token = std::find_if(tokens.begin(), tokens.end(), [](int32_t token) { return token < 0; });
+  return first_image_token == tokens.end() ? 0 : static_cast<size_t>(first_image_token - tokens.begin());
+}
+
+DeviceSpan<float> MultiModalPipelineState::RunPromptOverlapped(int current_length, DeviceSpan<int32_t>& next_tokens,
+                                                               DeviceSpan<int32_t> next_indices, size_t text_prefix_length) {
+  // The tokens before the first image don't attend to it, so they are embedded and prefilled while the vision model runs
+  WorkerThread vision_thread;
+  GeneratorMetrics::Phase* phase = Metrics::t_phase;
+  GeneratorMetrics::Phase vision_phase;
+  auto vision = vision_thread.Enqueue([&]() {
+    Metrics::WorkerScope metrics_scope{phase ? &vision_phase : nullptr};
+    RunVision(current_length, next_tokens, next_indices);
+  });
+
+  const int prefix_length = static_cast<int>(text_prefix_length);
+  auto prefix_tokens = next_tokens.subspan(0, text_prefix_length);
+  embedding_state_->UpdateInputsOutputs(prefix_tokens, false);  // Takes empty image features
+  decoder_state_->UpdateInputsOutputs(prefix_tokens, prefix_length, next_indices);
+  embedding_state_->inputs_embeds_.ReuseEmbeddingsBuffer(decoder_state_->inputs_embeds_);
+  embedding_state_->Run(prefix_length, prefix_tokens, next_indices);
+  decoder_state_->Run(prefix_length, prefix_tokens, next_indices);
+
+  vision.get();
+  if (phase) {
+    for (size_t i = 0; i < GeneratorMetrics::StageCount; i++)
+      phase->stage_seconds[i] += vision_phase.stage_seconds[i];
+  }
+
+  // The rest of the prompt continues from the prefix's KV cache, with the image features spliced in by the embedding model
+  auto rest_tokens = next_tokens.subspan(text_prefix_length, next_tokens.size() - text_prefix_length);
+  embedding_state_->UpdateInputsOutputs(rest_tokens, true);
+  decoder_state_->UpdateInputsOutputs(rest_tokens, current_length, next_indices);
+  embedding_state_->image_features_.ReuseImageFeaturesBuffer(vision_state_->image_features_);
+  embedding_state_->inputs_embeds_.ReuseEmbeddingsBuffer(decoder_state_->inputs_embeds_);
+  embedding_state_->Run(current_length, rest_tokens, next_indices);
+  auto logits = decoder_state_->Run(current_length, rest_tokens, next_indices);
+
+  is_prompt_ = false;
+  vision_state_.reset();  // The vision state is no longer needed in generation stage
+
+  return logits;
+}
+
+void MultiModalPipelineState::RunVision(int current_length, DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> next_indices) {
+  std::optional<uint64_t> key;
+  if (model_.config_->model.vision.feature_cache_size > 0)
+    key = HashVisionInputs(params_->extra_inputs);
+
+  auto& image_features = *vision_state_->image_features_.Get();
+  auto image_features_bytes = ByteWrapTensor(*model_.p_device_, image_features);
+  if (key) {
+    // A follow-up question about the same image reuses its features instead of running the vision model again
+    if (auto cached = model_.FindImageFeatures(*key)) {
+      auto cached_bytes = ByteWrapTensor(*model_.p_device_, *cached);
+      if (cached_bytes.size() == image_features_bytes.size()) {
+        image_features_bytes.CopyFrom(cached_bytes);
+        return;
+      }
+    }
+  }
+
+  vision_state_->Run(current_length, next_tokens, next_indices);
+
+  if (key) {
+    auto info = image_features.GetTensorTypeAndShapeInfo();
+    std::shared_ptr<OrtValue> cached = OrtValue::CreateTensor(model_.p_device_->GetAllocator(), info->GetShape(), info->GetElementType());
+    ByteWrapTensor(*model_.p_device_, *cached).CopyFrom(image_features_bytes);
+    model_.AddImageFeatures(*key, std::move(cached));
+  }
+}
+
 }  // namespace Generators
@@ -2,6 +2,8 @@
 // Licensed under the MIT License.
 
 #pragma once
+#include <list>
+#include <mutex>
 #include "model.h"
 #include "input_ids.h"
 #include "image_features.h"
@@ -21,9 +23,17 @@ struct MultiModalVisionModel : Model {
   std::unique_ptr<State> CreateState(DeviceSpan<int32_t> sequence_lengths,
                                      const GeneratorParams& params) const override;
 
+  // Cache of the image features of recent vision inputs by a hash of them (see vision.feature_cache_size)
+  std::shared_ptr<OrtValue> FindImageFeatures(uint64_t key) const;
+  void AddImageFeatures(uint64_t key, std::shared_ptr<OrtValue> image_features) const;
+
   std::unique_ptr<OrtSession> vision_session_;     // pixel_values, image_sizes -> image_features
   std::unique_ptr<OrtSession> embedding_session_;  // input_ids, image_features -> inputs_embeds
   std::unique_ptr<OrtSession> decoder_session_;    // inputs_embeds, attention_mask, kv_cache -> logits
+
+ private:
+  mutable std::mutex image_feature_cache_mutex_;
+  mutable std::list<std::pair<uint64_t, std::shared_ptr<OrtValue>>> image_feature_cache_;  // Most recently used first
 };
 
 struct EmbeddingState : State {
@@ -79,6 +89,10 @@ struct DecoderState : State {
                         DeviceSpan<int32_t> next_indices) override;
 
   const CapturedGraphInfo* GetCapturedGraphInfo() const override { return captured_graph_info_; };
+  void UpdateMemoryUsage(MemoryUsage& usage) const override {
+    usage.Set(MemoryUsage::KeyValueCache, kv_cache_.GetMemoryUsage());
+    usage.Set(MemoryUsage::Logits, logits_.GetMemoryUsage());
+  }
 
  private:
   friend struct MultiModalPipelineState;
@@ -102,10 +116,17 @@ struct MultiModalPipelineState : State {
 
   DeviceSpan<float> Run(int current_length, DeviceSpan<int32_t>& next_tokens,
                         DeviceSpan<int32_t> next_indices) override;
+  void UpdateMemoryUsage(MemoryUsage& usage) const override { decoder_state_->UpdateMemoryUsage(usage); }
 
  private:
   void UpdateInputsOutputs(const DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> next_indices,
                            int current_length);
+  // Runs the vision model, or copies the cached image features of the same inputs
+  void RunVision(int current_length, DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> next_indices);
+  // The number of prompt tokens before the first image placeholder that can be prefilled during RunVision, 0 if none can
+  size_t GetTextPrefixLength(DeviceSpan<int32_t>& next_tokens) const;
+  DeviceSpan<float> RunPromptOverlapped(int current_length, DeviceSpan<int32_t>& next_tokens,
+                                        DeviceSpan<int32_t> next_indices, size_t text_prefix_length);
 
   const MultiModalVisionModel& model_;
   int64_t num_image_tokens_{};
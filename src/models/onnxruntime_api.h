@@ -584,6 +584,8 @@ struct OrtSessionOptions {
   OrtSessionOptions& AddConfigEntry(const char* config_key, const char* config_value);                                                          ///< Wraps OrtApi::AddSessionConfigEntry
   OrtSessionOptions& AddInitializer(const char* name, const OrtValue& ort_val);                                                                 ///< Wraps OrtApi::AddInitializer
   OrtSessionOptions& AddExternalInitializers(const std::vector<std::string>& names, const std::vector<std::unique_ptr<OrtValue>>& ort_values);  ///< Wraps OrtApi::AddExternalInitializers
+  OrtSessionOptions& AddExternalInitializersFromFilesInMemory(const std::vector<std::basic_string<ORTCHAR_T>>& file_names,
+                                                              const std::vector<char*>& buffers, const std::vector<size_t>& lengths);  ///< Wraps OrtApi::AddExternalInitializersFromFilesInMemory
 
   OrtSessionOptions& AppendExecutionProvider_CUDA(const OrtCUDAProviderOptions& provider_options);               ///< Wraps OrtApi::SessionOptionsAppendExecutionProvider_CUDA
   OrtSessionOptions& AppendExecutionProvider_CUDA_V2(const OrtCUDAProviderOptionsV2& provider_options);          ///< Wraps OrtApi::SessionOptionsAppendExecutionProvider_CUDA_V2
@@ -1233,6 +1235,16 @@ struct OrtArenaCfg {
   Ort::Abstract make_abstract;
 };
 
+/** \brief Holds the weights that sessions prepacked for their kernels, so sessions created with the same container reuse
+ * the prepacked copies of the initializers they share through OrtSessionOptions::AddInitializer
+ */
+struct OrtPrepackedWeightsContainer {
+  static std::unique_ptr<OrtPrepackedWeightsContainer> Create();  ///< Wraps OrtApi::CreatePrepackedWeightsContainer
+
+  static void operator delete(void* p) { Ort::api->ReleasePrepackedWeightsContainer(reinterpret_cast<OrtPrepackedWeightsContainer*>(p)); }
+  Ort::Abstract make_abstract;
+};
+
 //
 // Custom OPs (only needed to implement custom OPs)
 //
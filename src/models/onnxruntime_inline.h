@@ -329,6 +329,12 @@ inline OrtEnv& OrtEnv::DisableTelemetryEvents() {
   return *this;
 }
 
+inline std::unique_ptr<OrtPrepackedWeightsContainer> OrtPrepackedWeightsContainer::Create() {
+  OrtPrepackedWeightsContainer* p;
+  Ort::ThrowOnError(Ort::api->CreatePrepackedWeightsContainer(&p));
+  return std::unique_ptr<OrtPrepackedWeightsContainer>{p};
+}
+
 inline OrtEnv& OrtEnv::CreateAndRegisterAllocator(const OrtMemoryInfo& mem_info, const OrtArenaCfg& arena_cfg) {
   Ort::ThrowOnError(Ort::api->CreateAndRegisterAllocator(this, &mem_info, &arena_cfg));
   return *this;
@@ -607,6 +613,21 @@ inline OrtSessionOptions& OrtSessionOptions::AddExternalInitializers(const std::
   return *this;
 }
 
+inline OrtSessionOptions& OrtSessionOptions::AddExternalInitializersFromFilesInMemory(const std::vector<std::basic_string<ORTCHAR_T>>& file_names,
+                                                                                      const std::vector<char*>& buffers,
+                                                                                      const std::vector<size_t>& lengths) {
+  const size_t files_num = file_names.size();
+  if (files_num != buffers.size() || files_num != lengths.size()) {
+    Ort::ThrowOnError(OrtStatus::Create(ORT_INVALID_ARGUMENT, "Expecting file_names, buffers and lengths to have the same length").get());
+  }
+  std::vector<const ORTCHAR_T*> file_names_ptr;
+  file_names_ptr.reserve(files_num);
+  for (const auto& file_name : file_names)
+    file_names_ptr.push_back(file_name.c_str());
+  Ort::ThrowOnError(Ort::api->AddExternalInitializersFromFilesInMemory(this, file_names_ptr.data(), buffers.data(), lengths.data(), files_num));
+  return *this;
+}
+
 inline OrtSessionOptions& OrtSessionOptions::AppendExecutionProvider_CUDA(const OrtCUDAProviderOptions& provider_options) {
   Ort::ThrowOnError(Ort::api->SessionOptionsAppendExecutionProvider_CUDA(this, &provider_options));
   return *this;
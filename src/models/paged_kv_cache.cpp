@@ -0,0 +1,356 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "../generators.h"
+#include "model.h"
+#include "paged_kv_cache.h"
+
+namespace Generators {
+
+PagedKeyValueCachePool::PagedKeyValueCachePool(const Model& model)
+    : model_{model},
+      layer_count_{model_.config_->model.decoder.num_hidden_layers},
+      block_size_{model_.config_->model.decoder.paged_kv_cache->block_size},
+      num_blocks_{model_.config_->model.decoder.paged_kv_cache->num_blocks},
+      prefix_cache_enabled_{model_.config_->model.decoder.paged_kv_cache->enable_prefix_cache} {
+  if (block_size_ < 1)
+    throw std::runtime_error("paged_kv_cache block_size must be 1 or greater, is " + std::to_string(block_size_));
+  if (num_blocks_ == 0)
+    num_blocks_ = (model_.config_->model.context_length + block_size_ - 1) / block_size_ + 1;  // Enough for one full length sequence
+  if (num_blocks_ < 2)
+    throw std::runtime_error("paged_kv_cache num_blocks must be 2 or greater, is " + std::to_string(num_blocks_));
+
+  shape_ = {num_blocks_, model_.config_->model.decoder.num_key_value_heads, block_size_, model_.config_->model.decoder.head_size};
+
+  // Derive the KV data type from the KV input 0
+  type_ = model_.session_info_->GetInputDataType(ComposeKeyValueName(model_.config_->model.decoder.inputs.past_key_names, 0));
+  CheckKeyValueCacheType(model_, type_);
+
+  auto& device = *model_.p_device_kvcache_;
+  try {
+    for (int i = 0; i < layer_count_ * 2; ++i) {
+      blocks_.push_back(OrtValue::CreateTensor(device.GetAllocator(), shape_, type_));
+      ByteWrapTensor(device, *blocks_.back()).Zero();
+    }
+  } catch (const Ort::Exception&) {
+    std::ostringstream oss;
+    oss << "Could not allocate the paged key-value cache pool of shape: ["
+        << "num_blocks (" << shape_[0] << "), num_key_value_heads ("
+        << shape_[1] << "), block_size (" << shape_[2] << "), head_size ("
+        << shape_[3] << ")] for " << layer_count_ << " layers. "
+        << "Try reducing the paged_kv_cache num_blocks.";
+    throw std::runtime_error(oss.str());
+  }
+
+  // Hand out the lowest block ids first, block 0 is kept out of the free list
+  free_blocks_.resize(num_blocks_ - 1);
+  std::iota(free_blocks_.rbegin(), free_blocks_.rend(), 1);
+  reference_counts_.resize(num_blocks_);
+}
+
+std::vector<int32_t> PagedKeyValueCachePool::AllocateBlocks(size_t count) {
+  std::scoped_lock lock{mutex_};
+  return AllocateBlocksLocked(count);
+}
+
+std::vector<int32_t> PagedKeyValueCachePool::AllocateBlocksLocked(size_t count) {
+  while (count > free_blocks_.size() && EvictPrefix()) {
+  }
+  if (count > free_blocks_.size())
+    throw std::runtime_error("Paged key-value cache is out of blocks: requested " + std::to_string(count) + ", available " +
+                             std::to_string(free_blocks_.size()) + " of " + std::to_string(num_blocks_) +
+                             ". Try increasing the paged_kv_cache num_blocks or reducing the number of concurrent generators.");
+
+  std::vector<int32_t> blocks(free_blocks_.end() - count, free_blocks_.end());
+  free_blocks_.resize(free_blocks_.size() - count);
+  for (auto block : blocks)
+    reference_counts_[block] = 1;
+  return blocks;
+}
+
+void PagedKeyValueCachePool::FreeBlocks(std::span<const int32_t> blocks) {
+  std::scoped_lock lock{mutex_};
+  for (auto block : blocks)
+    ReleaseBlock(block);
+}
+
+void PagedKeyValueCachePool::ReleaseBlock(int32_t block) {
+  assert(reference_counts_[block] > 0);
+  if (--reference_counts_[block] == 0)
+    free_blocks_.push_back(block);
+}
+
+void PagedKeyValueCachePool::ShareBlocks(std::span<const int32_t> blocks) {
+  std::scoped_lock lock{mutex_};
+  for (auto block : blocks) {
+    assert(reference_counts_[block] > 0);
+    reference_counts_[block]++;
+  }
+}
+
+int32_t PagedKeyValueCachePool::MakeWritable(int32_t block) {
+  // The check, the copy and the release are one step under the lock. Otherwise two holders of a shared block could both
+  // copy it, or one could copy it while the last other holder frees it and it's handed out again.
+  std::scoped_lock lock{mutex_};
+  if (reference_counts_[block] == 1)
+    return block;
+
+  // Other sequences (or the prefix cache) still read the shared block, so the caller gets its own copy to write to
+  const int32_t copy = AllocateBlocksLocked(1)[0];
+  auto& device = *model_.p_device_kvcache_;
+  const size_t block_bytes = static_cast<size_t>(shape_[1] * shape_[2] * shape_[3]) * SizeOf(type_);
+  for (auto& blocks : blocks_) {
+    auto bytes = ByteWrapTensor(device, *blocks);
+    bytes.subspan(copy * block_bytes, block_bytes).CopyFrom(bytes.subspan(block * block_bytes, block_bytes));
+  }
+  ReleaseBlock(block);
+  return copy;
+}
+
+std::vector<int32_t> PagedKeyValueCachePool::MatchPrefix(std::span<const int32_t> tokens) {
+  std::vector<int32_t> blocks;
+  if (!prefix_cache_enabled_)
+    return blocks;
+
+  std::scoped_lock lock{mutex_};
+  ++prefix_clock_;
+  auto* node = &prefix_root_;
+  std::vector<int32_t> key;
+  for (size_t begin = 0; begin + block_size_ <= tokens.size(); begin += block_size_) {
+    key.assign(tokens.begin() + begin, tokens.begin() + begin + block_size_);
+    auto child = node->children_.find(key);
+    if (child == node->children_.end())
+      break;
+    node = child->second.get();
+    node->last_used_ = prefix_clock_;
+    reference_counts_[node->block_]++;
+    blocks.push_back(node->block_);
+  }
+  return blocks;
+}
+
+void PagedKeyValueCachePool::InsertPrefix(std::span<const int32_t> tokens, std::span<const int32_t> blocks) {
+  if (!prefix_cache_enabled_)
+    return;
+
+  std::scoped_lock lock{mutex_};
+  ++prefix_clock_;
+  auto* node = &prefix_root_;
+  std::vector<int32_t> key;
+  for (size_t i = 0; i < blocks.size() && (i + 1) * block_size_ <= tokens.size(); i++) {
+    key.assign(tokens.begin() + i * block_size_, tokens.begin() + (i + 1) * block_size_);
+    auto& child = node->children_[key];
+    // If another sequence already published this block, keep its copy, the contents are identical
+    if (!child) {
+      child = std::make_unique<PrefixNode>();
+      child->parent_ = node;
+      child->block_ = blocks[i];
+      reference_counts_[blocks[i]]++;
+    }
+    child->last_used_ = prefix_clock_;
+    node = child.get();
+  }
+}
+
+bool PagedKeyValueCachePool::EvictPrefix() {
+  // Only leaves can go, inner nodes are needed to reach their children. A block still used by a sequence frees nothing.
+  PrefixNode* victim{};
+  std::vector<PrefixNode*> pending{&prefix_root_};
+  while (!pending.empty()) {
+    auto* node = pending.back();
+    pending.pop_back();
+    for (auto& [tokens, child] : node->children_) {
+      if (!child->children_.empty())
+        pending.push_back(child.get());
+      else if (reference_counts_[child->block_] == 1 && (!victim || child->last_used_ < victim->last_used_))
+        victim = child.get();
+    }
+  }
+  if (!victim)
+    return false;
+
+  ReleaseBlock(victim->block_);
+  std::erase_if(victim->parent_->children_, [victim](const auto& entry) { return entry.second.get() == victim; });
+  return true;
+}
+
+size_t PagedKeyValueCachePool::GetFreeBlockCount() const {
+  std::scoped_lock lock{mutex_};
+  return free_blocks_.size();
+}
+
+size_t PagedKeyValueCachePool::GetBlockSizeInBytes() const {
+  return GetTensorsSizeInBytes(blocks_) / num_blocks_;
+}
+
+PagedKeyValueCache::PagedKeyValueCache(State& state)
+    : state_{state},
+      pool_{model_.paged_kv_cache_pool_},
+      layer_count_{model_.config_->model.decoder.num_hidden_layers},
+      block_size_{pool_->GetBlockSize()},
+      sequence_blocks_(state_.params_->BatchBeamSize()),
+      block_table_shape_{state_.params_->BatchBeamSize(), (state_.params_->search.max_length + block_size_ - 1) / block_size_} {
+  for (int i = 0; i < layer_count_; ++i) {
+    input_name_strings_.emplace_back(ComposeKeyValueName(model_.config_->model.decoder.inputs.past_key_names, i));
+    input_name_strings_.emplace_back(ComposeKeyValueName(model_.config_->model.decoder.inputs.past_value_names, i));
+
+    output_name_strings_.emplace_back(ComposeKeyValueName(model_.config_->model.decoder.outputs.present_key_names, i));
+    output_name_strings_.emplace_back(ComposeKeyValueName(model_.config_->model.decoder.outputs.present_value_names, i));
+  }
+
+  block_table_ = OrtValue::CreateTensor<int32_t>(model_.p_device_inputs_->GetAllocator(), block_table_shape_);
+  UpdateBlockTable();
+}
+
+PagedKeyValueCache::~PagedKeyValueCache() {
+  for (auto& blocks : sequence_blocks_)
+    pool_->FreeBlocks(blocks);
+}
+
+void PagedKeyValueCache::Add() {
+  input_index_ = state_.inputs_.size();
+  output_index_ = state_.outputs_.size();
+
+  // The pool is both the past and the present, the model writes the new tokens into the blocks listed in the block table
+  for (int i = 0; i < layer_count_ * 2; ++i) {
+    state_.inputs_.push_back(pool_->GetBlocks(i));
+    state_.input_names_.push_back(input_name_strings_[i].c_str());
+    state_.outputs_.push_back(pool_->GetBlocks(i));
+    state_.output_names_.push_back(output_name_strings_[i].c_str());
+  }
+
+  state_.inputs_.push_back(block_table_.get());
+  state_.input_names_.push_back(model_.config_->model.decoder.inputs.block_table.c_str());
+}
+
+void PagedKeyValueCache::Update(DeviceSpan<int32_t> beam_indices, int total_length) {
+  const size_t num_beams = static_cast<size_t>(state_.params_->search.num_beams);
+  if (num_beams > 1 && sequence_length_ == 0) {
+    // The prompt is the same for every beam of a batch entry, so they all share the blocks of the first one. The model
+    // writes identical entries into them for every beam.
+    const size_t block_count = (static_cast<size_t>(total_length) + block_size_ - 1) / block_size_;
+    for (size_t i = 0; i < sequence_blocks_.size(); i += num_beams) {
+      sequence_blocks_[i] = pool_->AllocateBlocks(block_count);
+      for (size_t beam = 1; beam < num_beams; beam++) {
+        sequence_blocks_[i + beam] = sequence_blocks_[i];
+        pool_->ShareBlocks(sequence_blocks_[i + beam]);
+      }
+    }
+    UpdateBlockTable();
+  } else if (num_beams > 1 && !beam_indices.empty()) {
+    // Every beam continues the blocks of the beam it was picked from, they stay shared until the partially filled last
+    // block is written to (see ResizeSequences)
+    auto indices = beam_indices.CopyDeviceToCpu();
+    std::vector<std::vector<int32_t>> sequence_blocks(sequence_blocks_.size());
+    for (size_t i = 0; i < sequence_blocks.size(); i++) {
+      sequence_blocks[i] = sequence_blocks_[indices[i]];
+      pool_->ShareBlocks(sequence_blocks[i]);
+    }
+    for (auto& blocks : sequence_blocks_)
+      pool_->FreeBlocks(blocks);
+    sequence_blocks_ = std::move(sequence_blocks);
+    UpdateBlockTable();
+  }
+  ResizeSequences(static_cast<size_t>(total_length));
+}
+
+void PagedKeyValueCache::RewindTo(size_t index) {
+  pending_prefix_.clear();
+  ResizeSequences(index);
+}
+
+size_t PagedKeyValueCache::ReusePrefix(std::span<const int32_t> tokens) {
+  if (!pool_->IsPrefixCacheEnabled() || sequence_blocks_.size() != 1 || !sequence_blocks_[0].empty())
+    return 0;
+
+  pending_prefix_.assign(tokens.begin(), tokens.end());
+  // The last token is always run through the model, as its logits are needed
+  sequence_blocks_[0] = pool_->MatchPrefix(tokens.first(tokens.size() - 1));
+  if (sequence_blocks_[0].empty())
+    return 0;
+
+  UpdateBlockTable();
+  return sequence_blocks_[0].size() * block_size_;
+}
+
+void PagedKeyValueCache::PublishPrefix() {
+  if (pending_prefix_.empty())
+    return;
+  // A chunked prefill processes the prompt over several Runs, the remaining blocks are published by the later ones
+  const size_t length = std::min(pending_prefix_.size(), sequence_length_);
+  pool_->InsertPrefix(std::span<const int32_t>{pending_prefix_}.first(length), sequence_blocks_[0]);
+  if (length == pending_prefix_.size())
+    pending_prefix_.clear();
+}
+
+bool PagedKeyValueCache::ForkFrom(KeyValueCache& source_cache, size_t length) {
+  auto* source = dynamic_cast<PagedKeyValueCache*>(&source_cache);
+  if (!source || length == 0 || source->pool_ != pool_ || source->sequence_blocks_.size() != 1 ||
+      sequence_blocks_.size() != 1 || !sequence_blocks_[0].empty() || source->sequence_length_ < length)
+    return false;
+
+  const size_t block_count = (length + block_size_ - 1) / block_size_;
+  auto& blocks = sequence_blocks_[0];
+  blocks.assign(source->sequence_blocks_[0].begin(), source->sequence_blocks_[0].begin() + block_count);
+  pool_->ShareBlocks(blocks);
+  sequence_length_ = length;
+  UpdateBlockTable();
+  return true;
+}
+
+size_t PagedKeyValueCache::GetMemoryUsage() const {
+  // The beams of a beam search share most of their blocks, each one is only counted once
+  std::vector<int32_t> blocks;
+  for (auto& sequence_blocks : sequence_blocks_)
+    blocks.insert(blocks.end(), sequence_blocks.begin(), sequence_blocks.end());
+  std::sort(blocks.begin(), blocks.end());
+  return static_cast<size_t>(std::unique(blocks.begin(), blocks.end()) - blocks.begin()) * pool_->GetBlockSizeInBytes();
+}
+
+void PagedKeyValueCache::ResizeSequences(size_t length) {
+  const size_t block_count = (length + block_size_ - 1) / block_size_;
+  if (block_count > static_cast<size_t>(block_table_shape_[1]))
+    throw std::runtime_error("Requested length " + std::to_string(length) + " exceeds the paged key-value cache capacity of the generator.");
+
+  bool changed = false;
+  for (auto& blocks : sequence_blocks_) {
+    if (blocks.size() < block_count) {
+      auto new_blocks = pool_->AllocateBlocks(block_count - blocks.size());
+      blocks.insert(blocks.end(), new_blocks.begin(), new_blocks.end());
+      changed = true;
+    } else if (blocks.size() > block_count) {
+      pool_->FreeBlocks(std::span<const int32_t>{blocks}.subspan(block_count));
+      blocks.resize(block_count);
+      changed = true;
+    }
+
+    // New tokens get written into the partially filled block the sequence ends in, so it can't stay shared with the prefix
+    // cache or a forked generator
+    if (length > sequence_length_ && sequence_length_ % block_size_ != 0) {
+      auto& block = blocks[sequence_length_ / block_size_];
+      auto writable = pool_->MakeWritable(block);
+      changed |= writable != block;
+      block = writable;
+    }
+  }
+
+  sequence_length_ = length;
+  if (changed)
+    UpdateBlockTable();
+}
+
+void PagedKeyValueCache::UpdateBlockTable() {
+  auto block_table = WrapTensor<int32_t>(*model_.p_device_inputs_, *block_table_);
+  auto block_table_cpu = block_table.CpuSpan();
+  const size_t max_blocks = static_cast<size_t>(block_table_shape_[1]);
+  for (size_t i = 0; i < sequence_blocks_.size(); i++) {
+    auto row = block_table_cpu.subspan(i * max_blocks, max_blocks);
+    auto end = std::copy(sequence_blocks_[i].begin(), sequence_blocks_[i].end(), row.begin());
+    // Unused entries point at block 0, which no sequence owns. The model only reads up to the sequence length, and models
+    // that write every entry of the table back to the pool (see the builder's kv_layout=paged) only write garbage to it.
+    std::fill(end, row.end(), 0);
+  }
+  block_table.CopyCpuToDevice();
+}
+
+}  // namespace Generators
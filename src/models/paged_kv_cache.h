@@ -0,0 +1,126 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <map>
+#include <mutex>
+
+#include "kv_cache.h"
+
+namespace Generators {
+
+// Pool of fixed-size key-value cache blocks shared by every generator of a model.
+// Each layer's key and value cache is a single tensor of shape [num_blocks, num_key_value_heads, block_size, head_size]
+// and a sequence owns a list of block ids into it, so memory is only used for the tokens that actually exist.
+// Blocks are reference counted so that sequences with a common prompt prefix can share them (see enable_prefix_cache).
+// Block 0 is never handed out, the unused entries of the block tables point at it (see PagedKeyValueCache::UpdateBlockTable).
+struct PagedKeyValueCachePool {
+  PagedKeyValueCachePool(const Model& model);
+
+  // Returns 'count' free block ids, throws if the pool cannot satisfy the request
+  std::vector<int32_t> AllocateBlocks(size_t count);
+  // Drops one reference to each block, blocks without references return to the free list
+  void FreeBlocks(std::span<const int32_t> blocks);
+  // Adds one reference to each block, for a sequence that reads them too (see PagedKeyValueCache::ForkFrom)
+  void ShareBlocks(std::span<const int32_t> blocks);
+  // Returns a block the caller can write to: 'block' itself if the caller holds its only reference, otherwise a private copy
+  int32_t MakeWritable(int32_t block);
+
+  // Prefix cache, only active when enable_prefix_cache is set. The cache holds a reference to every block it contains,
+  // and unreferenced cache entries are evicted (least recently used first) when the free list runs out.
+  bool IsPrefixCacheEnabled() const { return prefix_cache_enabled_; }
+  // Returns the blocks of the longest cached run of full blocks that prefixes 'tokens', with a reference added for the caller
+  std::vector<int32_t> MatchPrefix(std::span<const int32_t> tokens);
+  // Adds the full blocks of 'tokens', whose key-value entries are stored in 'blocks', to the prefix cache
+  void InsertPrefix(std::span<const int32_t> tokens, std::span<const int32_t> blocks);
+
+  size_t GetFreeBlockCount() const;
+  size_t GetBlockSizeInBytes() const;  // Of one block in every layer's key and value cache
+  size_t GetMemoryUsage() const { return GetBlockSizeInBytes() * num_blocks_; }
+  int GetBlockSize() const { return block_size_; }
+  int GetBlockCount() const { return num_blocks_; }
+
+  OrtValue* GetBlocks(size_t index) { return blocks_[index].get(); }  // index is 2 * layer (+ 1 for the value cache)
+
+ private:
+  // One full block of tokens, its children continue the prefix with the next block
+  struct PrefixNode {
+    PrefixNode* parent_{};
+    int32_t block_{-1};
+    uint64_t last_used_{};
+    std::map<std::vector<int32_t>, std::unique_ptr<PrefixNode>> children_;  // Keyed by the block_size tokens of the child block
+  };
+
+  std::vector<int32_t> AllocateBlocksLocked(size_t count);  // Requires mutex_
+  void ReleaseBlock(int32_t block);                        // Requires mutex_
+  bool EvictPrefix();                                      // Requires mutex_, returns false if no cache entry can be evicted
+
+  const Model& model_;
+  int layer_count_;
+  int block_size_;
+  int num_blocks_;
+
+  std::array<int64_t, 4> shape_;  // {num_blocks, num_key_value_heads, block_size, head_size}
+  ONNXTensorElementDataType type_;
+  std::vector<std::unique_ptr<OrtValue>> blocks_;
+
+  bool prefix_cache_enabled_;
+
+  mutable std::mutex mutex_;
+  std::vector<int32_t> free_blocks_;       // Protected by mutex_
+  std::vector<int32_t> reference_counts_;  // Per block, protected by mutex_
+  PrefixNode prefix_root_;                 // Protected by mutex_
+  uint64_t prefix_clock_{};                // Protected by mutex_, orders cache entries by last use
+};
+
+// KeyValueCache that reads and writes the shared block pool in place. The model receives the pool tensors as both
+// its past and present key-value inputs/outputs and a block table input of shape [batch_beam_size, max_blocks_per_sequence]
+// that maps every sequence's logical blocks to block ids in the pool.
+struct PagedKeyValueCache : KeyValueCache {
+  PagedKeyValueCache(State& state);
+  ~PagedKeyValueCache() override;
+
+  void Add() override;
+  void AddEncoder() override {
+    throw std::runtime_error("PagedKeyValueCache does not support AddEncoder.");
+  };
+
+  // Grows every sequence's block list to hold total_length tokens. With a beam search, the beams share the prompt's blocks
+  // and every beam takes over the blocks of the beam it continues, so only a diverging beam's last block is copied.
+  void Update(DeviceSpan<int32_t> beam_indices, int total_length) override;
+  // Returns the blocks past index to the pool
+  void RewindTo(size_t index) override;
+
+  // Attaches the cached blocks of the longest shared prefix of 'tokens' and returns the number of tokens they hold.
+  // 'tokens' is remembered so its full blocks can be added to the prefix cache once the model has processed them.
+  size_t ReusePrefix(std::span<const int32_t> tokens) override;
+  void PublishPrefix() override;
+
+  // Shares the source's blocks holding the first 'length' tokens, a partially used last block is copied once written to
+  bool ForkFrom(KeyValueCache& source, size_t length) override;
+
+  // The blocks the sequences hold, including the ones shared with other generators through the prefix cache
+  size_t GetMemoryUsage() const override;
+
+ private:
+  void ResizeSequences(size_t length);
+  void UpdateBlockTable();
+
+  State& state_;
+  const Model& model_{state_.model_};
+  std::shared_ptr<PagedKeyValueCachePool> pool_;
+  int layer_count_;
+  int block_size_;
+  size_t input_index_{~0U}, output_index_{~0U};
+
+  std::vector<std::vector<int32_t>> sequence_blocks_;  // Block ids owned by each batch_beam entry, in logical order
+  std::vector<int32_t> pending_prefix_;                // Prompt tokens to add to the prefix cache after the next Run
+  size_t sequence_length_{};                           // Tokens the sequences' blocks hold, as of the last Update or RewindTo
+
+  std::array<int64_t, 2> block_table_shape_;  // {batch_beam_size, max_blocks_per_sequence}
+  std::unique_ptr<OrtValue> block_table_;
+  std::vector<std::string> input_name_strings_, output_name_strings_;
+};
+
+}  // namespace Generators
@@ -9,6 +9,20 @@ DefaultPositionInputs::DefaultPositionInputs(const Model& model, State& state, D
       state_{state} {
   has_mask_input_ = model_.session_info_->HasInput(model_.config_->model.decoder.inputs.attention_mask);
   has_posid_input_ = model_.session_info_->HasInput(model_.config_->model.decoder.inputs.position_ids);
+  has_seqlens_k_input_ = model_.session_info_->HasInput(model_.config_->model.decoder.inputs.seqlens_k) &&
+                         model_.session_info_->HasInput(model_.config_->model.decoder.inputs.total_sequence_length);
+  batch_beam_size_ = state_.BatchBeamSize();
+
+  if (has_seqlens_k_input_) {
+    if (model_.session_info_->GetInputDataType(model_.config_->model.decoder.inputs.seqlens_k) != Ort::TypeToTensorType<int32_t> ||
+        model_.session_info_->GetInputDataType(model_.config_->model.decoder.inputs.total_sequence_length) != Ort::TypeToTensorType<int32_t>)
+      throw std::runtime_error("seqlens_k and total_sequence_length must be int32");
+    // The captured graphs are shared between generators, which would each need seqlens_k at the same address
+    if (state_.GetCapturedGraphInfo())
+      throw std::runtime_error("seqlens_k and total_sequence_length inputs are not supported with graph capture");
+    total_sequence_length_ = OrtValue::CreateTensor<int32_t>(model_.allocator_cpu_, std::array<int64_t, 1>{1});
+    *total_sequence_length_->GetTensorMutableData<int32_t>() = 0;
+  }
 
   type_ = Ort::TypeToTensorType<int32_t>;
   if (has_mask_input_) {
@@ -34,10 +48,20 @@ DefaultPositionInputs::DefaultPositionInputs(const Model& model, State& state, D
   else
     InitializeSequenceLengths<int64_t>(shape, sequence_lengths);
   sequence_lengths_unk.CopyCpuToDevice();
+  shape[0] = state_.batch_size_;  // The search's sequence lengths don't cover the padding rows of the model's batch
 
   position_ids_shape_ = shape;
   attention_mask_shape_ = shape;
 
+  auto& allocator = model_.GetAllocator(*model_.p_device_inputs_);
+  const size_t reserved_bytes = static_cast<size_t>(state_.BatchBeamSize()) * state_.params_->search.max_length * SizeOf(type_);
+  if (has_posid_input_)
+    position_ids_buffer_ = std::make_unique<TensorBuffer>(allocator, reserved_bytes);
+  if (has_mask_input_) {
+    for (auto& buffer : attention_mask_buffers_)
+      buffer = std::make_unique<TensorBuffer>(allocator, reserved_bytes);
+  }
+
   if (state_.GetCapturedGraphInfo()) {
     if (has_posid_input_) {
       sb_position_ids_ = state_.GetCapturedGraphInfo()->sb_position_ids_.get();
@@ -55,9 +79,18 @@ void DefaultPositionInputs::Add() {
   if (has_mask_input_) {
     AddAttentionMask();
   }
+  if (has_seqlens_k_input_) {
+    AddSeqlensK();
+  }
 }
 
 void DefaultPositionInputs::Update(DeviceSpan<int32_t> next_tokens, int total_length, int new_length) {
+  // A compacted batch of one sequence increments its position ids on the CPU, see UpdatePositionIDs
+  if (!is_first_update_ && model_.p_device_inputs_->GetType() == DeviceType::CUDA && !(is_compacted_ && batch_beam_size_ == 1)) {
+    UpdateOnDevice(total_length, new_length);
+    return;
+  }
+
   if (has_posid_input_) {
     // Initialize on first update
     if (is_first_update_) {
@@ -82,6 +115,14 @@ void DefaultPositionInputs::Update(DeviceSpan<int32_t> next_tokens, int total_le
       UpdateAttentionMask(total_length, new_length);
     }
   }
+  if (has_seqlens_k_input_) {
+    if (is_first_update_)
+      CreateAndInitializeSeqlensK(next_tokens, {state_.batch_size_, new_length});
+    else
+      UpdateSeqlensK(total_length, new_length);
+  }
+  if (is_first_update_)
+    batch_beam_size_ = state_.BatchBeamSize();
   is_first_update_ = false;
 }
 
@@ -91,14 +132,70 @@ void DefaultPositionInputs::RewindTo(size_t index) {
     is_first_update_ = true;
     is_first_mask_update_ = true;
     // Rewind the mask input to a previous state
-  } else if (has_mask_input_) {
-    if (attention_mask_shape_[0] == 1) {
-      RewindMask(index);
-    } else
-      throw std::runtime_error("DefaultPositionInputs::RewindTo - Unsupported batch size");
+  } else {
+    if (has_mask_input_) {
+      if (attention_mask_shape_[0] == 1) {
+        RewindMask(index);
+      } else
+        throw std::runtime_error("DefaultPositionInputs::RewindTo - Unsupported batch size");
+    }
+    if (has_seqlens_k_input_) {
+      if (batch_beam_size_ != 1)
+        throw std::runtime_error("DefaultPositionInputs::RewindTo - Unsupported batch size");
+      SetSeqlensK(static_cast<int>(index));
+    }
   }
 }
 
+void DefaultPositionInputs::SetPastLength(int past_length) {
+  if (state_.params_->BatchBeamSize() != 1)
+    throw std::runtime_error("DefaultPositionInputs::SetPastLength - batch_size must be 1.");
+
+  // Position ids are fully recomputed from the total length on the next update, only the mask carries over
+  if (has_mask_input_) {
+    attention_mask_shape_[1] = past_length;
+    attention_mask_ = OrtValue::CreateTensor(model_.allocator_cpu_, attention_mask_shape_, type_);
+    if (type_ == Ort::TypeToTensorType<int32_t>)
+      std::fill_n(attention_mask_->GetTensorMutableData<int32_t>(), past_length, 1);
+    else
+      std::fill_n(attention_mask_->GetTensorMutableData<int64_t>(), past_length, 1);
+    attention_mask_ = model_.ExpandInputs(attention_mask_, 1);  // Moves the mask to the device
+    state_.inputs_[mask_input_index_] = attention_mask_.get();
+  }
+  if (has_seqlens_k_input_) {
+    seqlens_k_ = OrtValue::CreateTensor<int32_t>(model_.allocator_cpu_, std::array<int64_t, 1>{1});
+    seqlens_k_ = model_.ExpandInputs(seqlens_k_, 1);  // Moves seqlens_k to the device
+    state_.inputs_[seqlens_k_input_index_] = seqlens_k_.get();
+    SetSeqlensK(past_length);
+  }
+  batch_beam_size_ = 1;
+  is_first_update_ = false;
+}
+
+void DefaultPositionInputs::CompactBatch(std::span<const int32_t> rows) {
+  if (sb_position_ids_ || sb_attention_mask_)
+    throw std::runtime_error("DefaultPositionInputs::CompactBatch - Static buffers are not supported.");
+
+  if (has_posid_input_) {
+    position_ids_ = GatherRows(*position_ids_, rows, *model_.p_device_inputs_);
+    if (position_ids_next_)
+      position_ids_next_ = GatherRows(*position_ids_next_, rows, *model_.p_device_inputs_);
+    position_ids_shape_[0] = static_cast<int64_t>(rows.size());
+    state_.inputs_[posid_input_index_] = position_ids_.get();
+  }
+  if (has_mask_input_) {
+    attention_mask_ = GatherRows(*attention_mask_, rows, *model_.p_device_inputs_);
+    attention_mask_shape_[0] = static_cast<int64_t>(rows.size());
+    state_.inputs_[mask_input_index_] = attention_mask_.get();
+  }
+  if (has_seqlens_k_input_) {
+    seqlens_k_ = GatherRows(*seqlens_k_, rows, *model_.p_device_inputs_);
+    state_.inputs_[seqlens_k_input_index_] = seqlens_k_.get();
+  }
+  batch_beam_size_ = static_cast<int>(rows.size());
+  is_compacted_ = true;
+}
+
 void DefaultPositionInputs::AddAttentionMask() {
   mask_input_index_ = state_.inputs_.size();
 
@@ -113,13 +210,22 @@ void DefaultPositionInputs::AddPositionIDs() {
   state_.input_names_.push_back(model_.config_->model.decoder.inputs.position_ids.c_str());
 }
 
+void DefaultPositionInputs::AddSeqlensK() {
+  seqlens_k_input_index_ = state_.inputs_.size();
+
+  state_.inputs_.push_back(seqlens_k_.get());
+  state_.input_names_.push_back(model_.config_->model.decoder.inputs.seqlens_k.c_str());
+  state_.inputs_.push_back(total_sequence_length_.get());
+  state_.input_names_.push_back(model_.config_->model.decoder.inputs.total_sequence_length.c_str());
+}
+
 void DefaultPositionInputs::CreateNextPositionIDsTensor() {
   if (!sb_position_ids_) {
     if (position_ids_shape_[1] == 1 && position_ids_next_) {
       position_ids_ = std::move(position_ids_next_);
       position_ids_next_ = nullptr;
     } else {
-      position_ids_ = OrtValue::CreateTensor(model_.p_device_inputs_->GetAllocator(), position_ids_shape_, type_);
+      position_ids_ = position_ids_buffer_->CreateTensor(position_ids_shape_, type_);
     }
   } else {
     position_ids_ = sb_position_ids_->CreateTensorOnStaticBuffer(position_ids_shape_, type_);
@@ -135,14 +241,13 @@ void DefaultPositionInputs::UpdatePositionIDs(int total_length, int new_kv_lengt
   if (position_ids_shape_[0] != 1 && !(total_length == 0 || new_kv_length == 1))
     throw std::runtime_error("DefaultPositionInputs::UpdatePositionIDs - batch_size must be 1 for continuous decoding.");
 
-  // Reallocate position_ids when new_kv_length changes
-  if (position_ids_shape_[1] != new_kv_length) {
-    position_ids_shape_[1] = new_kv_length;
-    CreateNextPositionIDsTensor();
-    state_.inputs_[posid_input_index_] = position_ids_.get();
-  }
+  ResizePositionIDs(new_kv_length);
 
-  if (model_.p_device_inputs_->GetType() == DeviceType::CUDA)
+  if (is_compacted_ && position_ids_shape_[0] == 1) {
+    // The batch size 1 paths compute the positions from total_length, which ignores the sequence's padding
+    type_ == Ort::TypeToTensorType<int32_t> ? IncrementPositionID<int32_t>()
+                                            : IncrementPositionID<int64_t>();
+  } else if (model_.p_device_inputs_->GetType() == DeviceType::CUDA)
     model_.p_device_inputs_->UpdatePositionIds(position_ids_->GetTensorMutableRawData(), static_cast<int>(position_ids_shape_[0]), total_length, new_kv_length, type_);
   else {
     type_ == Ort::TypeToTensorType<int32_t> ? UpdatePositionIDsImpl<int32_t>(total_length, new_kv_length)
@@ -150,10 +255,30 @@ void DefaultPositionInputs::UpdatePositionIDs(int total_length, int new_kv_lengt
   }
 }
 
+// Reallocate position_ids when new_kv_length changes
+void DefaultPositionInputs::ResizePositionIDs(int new_kv_length) {
+  if (position_ids_shape_[1] != new_kv_length) {
+    position_ids_shape_[1] = new_kv_length;
+    CreateNextPositionIDsTensor();
+    state_.inputs_[posid_input_index_] = position_ids_.get();
+  }
+}
+
+bool DefaultPositionInputs::IsMaskExtendedInPlace() const {
+  return attention_mask_shape_[0] == 1 && !is_compacted_ && model_.p_device_inputs_->GetType() != DeviceType::CUDA;
+}
+
 void DefaultPositionInputs::CreateNextAttentionMaskTensor(int total_length) {
   if (!sb_attention_mask_) {
     attention_mask_shape_[1] = total_length;
-    attention_mask_next_ = OrtValue::CreateTensor(model_.p_device_inputs_->GetAllocator(), attention_mask_shape_, type_);
+    // A single sequence's mask on the CPU only grows at its end, so it stays in the current mask's buffer and each step
+    // only writes the new entries (see UpdateAttentionMaskImpl). The device kernels read the old mask while writing the new one.
+    if (IsMaskExtendedInPlace()) {
+      attention_mask_next_ = attention_mask_buffers_[attention_mask_buffer_index_ ^ 1]->CreateTensor(attention_mask_shape_, type_);
+      return;
+    }
+    attention_mask_next_ = attention_mask_buffers_[attention_mask_buffer_index_]->CreateTensor(attention_mask_shape_, type_);
+    attention_mask_buffer_index_ ^= 1;
   } else {
     attention_mask_shape_[1] = state_.params_->search.max_length;
     attention_mask_next_ = sb_attention_mask_->CreateTensorOnStaticBuffer(attention_mask_shape_, type_);
@@ -167,6 +292,7 @@ void DefaultPositionInputs::UpdateAttentionMask(int total_length, int new_kv_len
   if (position_ids_shape_[0] != 1 && !(total_length == 0 || new_kv_length == 1))
     throw std::runtime_error("DefaultPositionInputs::UpdatePositionIDs - batch_size must be 1 for continuous decoding.");
 
+  const int old_length = static_cast<int>(attention_mask_shape_[1]);
   CreateNextAttentionMaskTensor(total_length);
   state_.inputs_[mask_input_index_] = attention_mask_.get();
 
@@ -182,8 +308,8 @@ void DefaultPositionInputs::UpdateAttentionMask(int total_length, int new_kv_len
                                                  update_only,
                                                  type_);
   } else {
-    type_ == Ort::TypeToTensorType<int32_t> ? UpdateAttentionMaskImpl<int32_t>(total_length)
-                                            : UpdateAttentionMaskImpl<int64_t>(total_length);
+    type_ == Ort::TypeToTensorType<int32_t> ? UpdateAttentionMaskImpl<int32_t>(old_length, total_length)
+                                            : UpdateAttentionMaskImpl<int64_t>(old_length, total_length);
   }
 
   attention_mask_ = std::move(attention_mask_next_);
@@ -191,6 +317,83 @@ void DefaultPositionInputs::UpdateAttentionMask(int total_length, int new_kv_len
   is_first_mask_update_ = false;
 }
 
+// A decoding step launches a single kernel for the position ids, the attention mask and seqlens_k, instead of one per input
+void DefaultPositionInputs::UpdateOnDevice(int total_length, int new_kv_length) {
+  if (batch_beam_size_ != 1 && !(total_length == 0 || new_kv_length == 1))
+    throw std::runtime_error("DefaultPositionInputs::UpdateOnDevice - batch_size must be 1 for continuous decoding.");
+
+  void* position_ids{};
+  if (has_posid_input_) {
+    ResizePositionIDs(new_kv_length);
+    position_ids = position_ids_->GetTensorMutableRawData();
+  }
+
+  void* mask_data{};
+  const void* old_mask_data{};
+  int max_length = total_length;
+  bool update_only = false;
+  if (has_mask_input_) {
+    CreateNextAttentionMaskTensor(total_length);
+    mask_data = attention_mask_next_->GetTensorMutableRawData();
+    old_mask_data = attention_mask_->GetTensorRawData();
+    max_length = sb_attention_mask_ ? state_.params_->search.max_length : total_length;
+    update_only = sb_attention_mask_ && !is_first_mask_update_;
+  }
+
+  int32_t* seqlens_k{};
+  if (has_seqlens_k_input_) {
+    seqlens_k = seqlens_k_->GetTensorMutableData<int32_t>();
+    *total_sequence_length_->GetTensorMutableData<int32_t>() = total_length;
+  }
+
+  model_.p_device_inputs_->UpdatePositionInputs(position_ids, mask_data, old_mask_data, seqlens_k, batch_beam_size_,
+                                                new_kv_length, total_length, max_length, update_only, type_);
+
+  if (has_mask_input_) {
+    attention_mask_ = std::move(attention_mask_next_);
+    state_.inputs_[mask_input_index_] = attention_mask_.get();
+    is_first_mask_update_ = false;
+  }
+}
+
+void DefaultPositionInputs::CreateAndInitializeSeqlensK(DeviceSpan<int32_t> next_tokens, std::array<int64_t, 2> shape) {
+  // GroupQueryAttention computes seqlens_k from the attention mask as the number of non pad tokens minus one
+  seqlens_k_ = OrtValue::CreateTensor<int32_t>(model_.allocator_cpu_, std::array<int64_t, 1>{shape[0]});
+  auto* seqlens_k = seqlens_k_->GetTensorMutableData<int32_t>();
+  const auto* word_id = const_cast<DeviceSpan<int32_t>&>(next_tokens).CpuSpan().data();
+  for (int i = 0; i < shape[0]; i++) {
+    int32_t length = 0;
+    for (int j = 0; j < shape[1]; j++, word_id++)
+      length += *word_id != model_.config_->model.pad_token_id;
+    seqlens_k[i] = length - 1;
+  }
+  *total_sequence_length_->GetTensorMutableData<int32_t>() = static_cast<int32_t>(shape[1]);
+
+  // Move the tensor to the device and expand by num_beams
+  seqlens_k_ = model_.ExpandInputs(seqlens_k_, state_.params_->search.num_beams);
+  state_.inputs_[seqlens_k_input_index_] = seqlens_k_.get();
+}
+
+void DefaultPositionInputs::UpdateSeqlensK(int total_length, int new_kv_length) {
+  if (batch_beam_size_ == 1 && !is_compacted_) {
+    SetSeqlensK(total_length);
+    return;
+  }
+
+  *total_sequence_length_->GetTensorMutableData<int32_t>() = total_length;
+  auto seqlens_k = WrapTensor<int32_t>(*model_.p_device_inputs_, *seqlens_k_);
+  for (auto& length : seqlens_k.CopyDeviceToCpu())
+    length += new_kv_length;
+  seqlens_k.CopyCpuToDevice();
+}
+
+void DefaultPositionInputs::SetSeqlensK(int total_length) {
+  *total_sequence_length_->GetTensorMutableData<int32_t>() = total_length;
+  auto seqlens_k = WrapTensor<int32_t>(*model_.p_device_inputs_, *seqlens_k_);
+  seqlens_k.CpuSpan()[0] = total_length - 1;
+  seqlens_k.CopyCpuToDevice();
+}
+
 template <typename T>
 void DefaultPositionInputs::CreateAndInitializePositionIDs(DeviceSpan<int32_t> next_tokens, std::array<int64_t, 2> shape) {
   // Set attention mask to be 0 for pad tokens, and 1 for all other tokens.
@@ -267,39 +470,51 @@ void DefaultPositionInputs::UpdatePositionIDsImpl(int total_length, int new_kv_l
 }
 
 template <typename T>
-void DefaultPositionInputs::UpdateAttentionMaskImpl(int total_length) {
+void DefaultPositionInputs::UpdateAttentionMaskImpl(int old_length, int total_length) {
   auto* data = attention_mask_next_->GetTensorMutableData<T>();
   auto* old_data = attention_mask_->GetTensorData<T>();
-  if (attention_mask_shape_[0] == 1) {
-    // For batch size == 1 we assume no padding. We make this explicit for continuous decoding.
-    for (int i = 0; i < total_length; i++)
+  // A static buffer (graph capture on DML) holds max_length entries per row and is updated in place
+  const int stride = static_cast<int>(attention_mask_shape_[1]);
+  const int old_stride = sb_attention_mask_ && !is_first_mask_update_ ? stride : total_length - 1;
+  if (attention_mask_shape_[0] == 1 && !is_compacted_) {
+    // For batch size == 1 we assume no padding. We make this explicit for continuous decoding. A mask extended in place
+    // already has its first old_length entries set.
+    for (int i = data == old_data && !sb_attention_mask_ ? std::min(old_length, total_length) : 0; i < total_length; i++)
       data[i] = 1;
   } else {
     // For batch size > 1 we increment attention mask by 1... continuous decoding is not supported
     for (int i = 0; i < attention_mask_shape_[0]; i++) {
-      for (int j = 0; j < total_length - 1; j++) {
-        data[i * total_length + j] = old_data[i * (total_length - 1) + j];
+      if (data != old_data) {
+        for (int j = 0; j < total_length - 1; j++) {
+          data[i * stride + j] = old_data[i * old_stride + j];
+        }
       }
-      data[i * total_length + total_length - 1] = 1;
+      data[i * stride + total_length - 1] = 1;
     }
   }
 }
 
+template <typename T>
+void DefaultPositionInputs::IncrementPositionID() {
+  auto position_ids = WrapTensor<T>(*model_.p_device_inputs_, *position_ids_);
+  position_ids.CopyDeviceToCpu()[0]++;
+  position_ids.CopyCpuToDevice();
+}
+
+template <typename T>
+void DefaultPositionInputs::RewindMaskImpl(size_t index) {
+  // The static buffer is updated in place, so the entries past the rewound length have to be cleared
+  auto mask = WrapTensor<T>(*model_.p_device_inputs_, *attention_mask_);
+  auto mask_cpu = mask.CpuSpan();
+  std::fill(mask_cpu.begin(), mask_cpu.begin() + index, T{1});
+  std::fill(mask_cpu.begin() + index, mask_cpu.end(), T{0});
+  mask.CopyCpuToDevice();
+}
+
 void DefaultPositionInputs::RewindMask(size_t index) {
   if (sb_attention_mask_ && !is_first_mask_update_) {
-    throw std::runtime_error("PositionInputs::RewindMask - Static buffer is not supported for continuous decoding.");
-#if 0  // TODO: Fix implementation, cudaMemsetAsync of 1 is setting bytes of 1 vs int32's of 1
-    int past_length = static_cast<int>(index);
-    int max_length = static_cast<int>(state_.params_->search.max_length);
-    cudaMemsetAsync(attention_mask_->GetTensorMutableRawData(),
-                    0,
-                    (type_ == Ort::TypeToTensorType<int32_t> ? sizeof(int32_t) : sizeof(int64_t)) * max_length,
-                    model_.cuda_stream_);
-    cudaMemsetAsync(attention_mask_->GetTensorMutableRawData(),
-                    1,
-                    (type_ == Ort::TypeToTensorType<int32_t> ? sizeof(int32_t) : sizeof(int64_t)) * past_length,
-                    model_.cuda_stream_);
-#endif
+    type_ == Ort::TypeToTensorType<int32_t> ? RewindMaskImpl<int32_t>(index)
+                                            : RewindMaskImpl<int64_t>(index);
   }
 }
 
@@ -348,11 +563,15 @@ void WindowedPositionInputs::Add() {
 
 void WindowedPositionInputs::Update(DeviceSpan<int32_t> next_tokens, int total_length, int new_length) {
   if (window_index_ == 0) {
-    num_windows_ = (next_tokens.size() + window_size_ - 1) / window_size_;
+    window_sizes_ = GetPromptWindowSizes(*model_.config_->model.decoder.sliding_window, next_tokens.size());
+    window_size_ = window_sizes_[0];
+    auto tokens = next_tokens.CpuSpan();
+    prompt_padding_length_ = std::find_if(tokens.begin(), tokens.end(), [this](int32_t token) { return token != model_.config_->model.pad_token_id; }) - tokens.begin();
     if (has_posid_input_) {
+      position_ids_shape_[1] = window_size_;
       position_ids_ = OrtValue::CreateTensor(model_.allocator_cpu_, position_ids_shape_, position_ids_type_);
 
-      // next_tokens will always be padded so that it's size is a multiple of window_size_
+      // next_tokens will always be padded so that it's size is the sum of the window sizes
       // next_tokens -> [0, a, b, c, d, e]
       // window_size = 3, num_windows = 2, pad_token = 0
       // window_index = 0, position_ids_ -> [0, 0, 1]
@@ -369,7 +588,7 @@ void WindowedPositionInputs::Update(DeviceSpan<int32_t> next_tokens, int total_l
     if (has_mask_input_) {
       attention_mask_ = OrtValue::CreateTensor(model_.allocator_cpu_, attention_mask_shape_, attention_mask_type_);
 
-      // next_tokens will always be padded so that it's size is a multiple of window_size_
+      // next_tokens will always be padded so that it's size is the sum of the window sizes
       // next_tokens -> [0, a, b, c, d, e]
       // window_size = 3, num_windows = 2, pad_token = 0
       // window_index = 0, attention_mask_ -> ([0] * context_length - window_size_) + [0, 1, 1]
@@ -385,20 +604,25 @@ void WindowedPositionInputs::Update(DeviceSpan<int32_t> next_tokens, int total_l
         }
       }
     }
-  } else if (window_index_ < num_windows_) {
+  } else if (window_index_ < window_sizes_.size()) {
+    window_size_ = window_sizes_[window_index_];
     if (has_posid_input_) {
-      // next_tokens will always be padded so that it's size is a multiple of window_size_
+      // next_tokens will always be padded so that it's size is the sum of the window sizes
       // next_tokens -> [0, a, b, c, d, e]
       // window_size = 3, num_windows = 2, pad_token = 0
       // window_index = 1, position_ids_ -> [2, 3, 4]
 
+      const auto last_position = position_ids_->GetTensorData<int32_t>()[position_ids_shape_[1] - 1];
+      if (position_ids_shape_[1] != static_cast<int64_t>(window_size_)) {
+        position_ids_shape_[1] = window_size_;
+        position_ids_ = OrtValue::CreateTensor(model_.allocator_cpu_, position_ids_shape_, position_ids_type_);
+      }
       auto* position_ids_data = position_ids_->GetTensorMutableData<int32_t>();
-      const auto last_position = position_ids_data[window_size_ - 1];
       std::iota(position_ids_data, position_ids_data + window_size_, last_position + 1);
     }
 
     if (has_mask_input_) {
-      // next_tokens will always be padded so that it's size is a multiple of window_size_
+      // next_tokens will always be padded so that it's size is the sum of the window sizes
       // next_tokens -> [0, a, b, c, d, e]
       // window_size = 3, num_windows = 2, pad_token = 0
       // window_index = 1, attention_mask_ -> ([0] * context_length - (2 * window_size_)) + [0, 1, 1, 1, 1, 1]
@@ -440,6 +664,32 @@ void WindowedPositionInputs::Update(DeviceSpan<int32_t> next_tokens, int total_l
   window_index_++;
 }
 
+void WindowedPositionInputs::RewindTo(size_t index) {
+  if (index == 0) {
+    window_index_ = 0;  // The first update sizes the position ids for the new prompt's first window
+    return;
+  }
+
+  if (window_index_ < window_sizes_.size())
+    throw std::runtime_error("WindowedPositionInputs::RewindTo - The prompt must be processed before rewinding.");
+
+  // Padding only precedes the prompt, every token after it has a position and is attended to
+  const size_t length = index > prompt_padding_length_ ? index - prompt_padding_length_ : 0;
+
+  if (has_posid_input_) {
+    // The next token continues from the position of the last kept token
+    position_ids_->GetTensorMutableData<int32_t>()[position_ids_shape_[1] - 1] = static_cast<int32_t>(length) - 1;
+  }
+
+  if (has_mask_input_) {
+    // attention_mask_ -> ([0] * context_length - length) + [1] * length
+    auto* attention_mask_data = attention_mask_->GetTensorMutableData<int32_t>();
+    std::fill_n(attention_mask_data, attention_mask_shape_[1] - length, 0);
+    std::fill_n(attention_mask_data + attention_mask_shape_[1] - length, length, 1);
+    attention_mask_backward_offset_ = attention_mask_shape_[1] - length - 1;
+  }
+}
+
 std::unique_ptr<PositionInputs> CreatePositionInputs(State& state, DeviceSpan<int32_t> sequence_lengths) {
   if (state.model_.config_->model.decoder.sliding_window.has_value()) {
     return std::make_unique<WindowedPositionInputs>(state);
@@ -18,15 +18,30 @@ struct DefaultPositionInputs : PositionInputs {
 
   void RewindTo(size_t index) override;
 
+  // Continue from 'past_length' tokens that were never passed to Update (their KV cache entries came from elsewhere).
+  // The next Update then takes the continuous decoding path. Only batch size 1 without padding is supported.
+  void SetPastLength(int past_length);
+
+  // Keeps only the given rows of the batch (see State::CompactBatch)
+  void CompactBatch(std::span<const int32_t> rows);
+
  private:
   void AddAttentionMask();
   void AddPositionIDs();
+  void AddSeqlensK();
 
   void CreateNextPositionIDsTensor();
   void CreateNextAttentionMaskTensor(int total_length);
+  bool IsMaskExtendedInPlace() const;
+  void ResizePositionIDs(int new_kv_length);
 
   void UpdatePositionIDs(int total_length, int new_length);
   void UpdateAttentionMask(int total_length, int new_length);
+  void UpdateOnDevice(int total_length, int new_kv_length);  // All inputs in one launch, see DeviceInterface::UpdatePositionInputs
+
+  void CreateAndInitializeSeqlensK(DeviceSpan<int32_t> next_tokens, std::array<int64_t, 2> shape);
+  void UpdateSeqlensK(int total_length, int new_kv_length);
+  void SetSeqlensK(int total_length);  // Batch size 1 only
 
   template <typename T>
   void InitializeSequenceLengths(std::array<int64_t, 2> shape, cpu_span<int32_t> sequence_lengths_unk);
@@ -38,7 +53,11 @@ struct DefaultPositionInputs : PositionInputs {
   template <typename T>
   void UpdatePositionIDsImpl(int total_length, int new_kv_length);
   template <typename T>
-  void UpdateAttentionMaskImpl(int total_length);
+  void UpdateAttentionMaskImpl(int old_length, int total_length);
+  template <typename T>
+  void IncrementPositionID();
+  template <typename T>
+  void RewindMaskImpl(size_t index);
 
   void RewindMask(size_t index);
 
@@ -47,11 +66,21 @@ struct DefaultPositionInputs : PositionInputs {
 
   size_t mask_input_index_{~0U};
   size_t posid_input_index_{~0U};
+  size_t seqlens_k_input_index_{~0U};
 
   ONNXTensorElementDataType type_;  // Common type for position_ids and attention_mask
 
   bool has_mask_input_{};
   bool has_posid_input_{};
+  bool has_seqlens_k_input_{};  // GroupQueryAttention models that take seqlens_k and total_sequence_length instead of the attention mask
+
+  int batch_beam_size_{};
+
+  // The memory of the tensors created after the first update, reserved for [batch_beam_size, max_length]. Every update
+  // reads the previous attention mask, so the masks alternate between two buffers.
+  std::unique_ptr<TensorBuffer> position_ids_buffer_;
+  std::array<std::unique_ptr<TensorBuffer>, 2> attention_mask_buffers_;
+  size_t attention_mask_buffer_index_{};
 
   std::array<int64_t, 2> position_ids_shape_{};  // {params.batch_size*params.beam_size, params.sequence_length}
   std::unique_ptr<OrtValue> position_ids_;
@@ -61,17 +90,22 @@ struct DefaultPositionInputs : PositionInputs {
   std::unique_ptr<OrtValue> position_ids_next_;    // Replaces position_ids_ after the first Run() call
   std::unique_ptr<OrtValue> attention_mask_next_;  // Replaces attention_mask_ after the first Run() call
 
+  std::unique_ptr<OrtValue> seqlens_k_;              // [batch_beam_size] on the device, the sequence lengths minus one
+  std::unique_ptr<OrtValue> total_sequence_length_;  // [1] on the CPU
+
   // Used for decoding runs with cuda graphs.
   StaticBuffer* sb_position_ids_{};
   StaticBuffer* sb_attention_mask_{};
 
   bool is_first_mask_update_{true};
   bool is_first_update_{true};
+  bool is_compacted_{};  // A batch compacted to one sequence may be padded, so it can't take the batch size 1 paths
 };
 
 // Certain models can only process a fixed number of tokens at a time.
 // For example, given a prompt with 120 tokens, and a model that can only process 20 tokens at a time,
-// this class will split the position ids into 6 windows of 20 tokens each.
+// this class will split the position ids into 6 windows of 20 tokens each (or into smaller windows at the end of the
+// prompt, see GetPromptWindowSizes).
 // At each update step, the next window of position ids is prepared.
 // This is done until all windows have been processed before switching to the model-generation phase
 // where position ids are prepared one id at a time.
@@ -85,9 +119,8 @@ struct WindowedPositionInputs : PositionInputs {
 
   void Add() override;
   void Update(DeviceSpan<int32_t> next_tokens, int total_length, int new_length) override;
-  void RewindTo(size_t index) override {
-    throw std::runtime_error("WindowedPositionInputs does not support RewindTo.");
-  };
+  // Supported once the prompt has been processed, rewinding to 0 restarts prompt processing
+  void RewindTo(size_t index) override;
 
  private:
   State& state_;
@@ -103,12 +136,13 @@ struct WindowedPositionInputs : PositionInputs {
   ONNXTensorElementDataType attention_mask_type_{};
   std::unique_ptr<OrtValue> attention_mask_;
   size_t attention_mask_backward_offset_{~0U};
+  size_t prompt_padding_length_{};  // Number of pad tokens in front of the prompt
 
   size_t attention_mask_index_{~0U};
   size_t position_ids_index_{~0U};
 
-  size_t window_size_{};
-  size_t num_windows_{};
+  size_t window_size_{};  // Of the current prompt window
+  std::vector<int> window_sizes_;
   size_t window_index_{};
 };
 
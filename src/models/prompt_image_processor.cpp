@@ -4,6 +4,7 @@
 #include "../generators.h"
 #include "model.h"
 
+#include <fstream>
 #include <regex>
 
 namespace Generators {
@@ -15,12 +16,19 @@ std::unique_ptr<OrtValue> ProcessImagePrompt(const Generators::Tokenizer& tokeni
   const size_t num_images = num_img_tokens ? num_img_tokens->NumberOfElement() : 0U;
   auto* num_img_tokens_data = num_img_tokens ? num_img_tokens->Data() : nullptr;
 
-  // Split the prompt string based on the occurrences of the pattern "<|image_<number>|>"
-  // Here the <number> represents the image id.
-  const std::regex pattern("<\\|image_\\d+\\|>");
-  const std::vector<std::string> prompt_chunks(
-      std::sregex_token_iterator(prompt.begin(), prompt.end(), pattern, -1),
-      std::sregex_token_iterator());
+  // Split the prompt string based on the occurrences of the pattern "<|image_<number>|>", in a single pass that also
+  // extracts the image ids. Here the <number> represents the image id. Compiling the pattern is slow, so it's done once.
+  static const std::regex pattern("<\\|image_(\\d+)\\|>");
+  std::vector<std::string> prompt_chunks;
+  std::vector<int32_t> image_ids;
+  auto chunk_begin = prompt.begin();
+  for (auto it = std::sregex_iterator(prompt.begin(), prompt.end(), pattern); it != std::sregex_iterator(); ++it) {
+    prompt_chunks.emplace_back(chunk_begin, (*it)[0].first);
+    image_ids.push_back(std::stoi((*it)[1].str()));
+    chunk_begin = (*it)[0].second;
+  }
+  if (chunk_begin != prompt.end())  // Like std::sregex_token_iterator, an empty remainder isn't a chunk
+    prompt_chunks.emplace_back(chunk_begin, prompt.end());
 
   // Each chunk of the prompt string obtained after splitting is then tokenized using the tokenizer.
   std::vector<std::vector<int32_t>> input_ids_chunks(prompt_chunks.size());
@@ -28,21 +36,6 @@ std::unique_ptr<OrtValue> ProcessImagePrompt(const Generators::Tokenizer& tokeni
     input_ids_chunks[i] = tokenizer.Encode(prompt_chunks[i].c_str());
   }
 
-  // Extract the image tags from the prompt string.
-  // Here the image tags are of the form "<|image_<number>|>"
-  const std::vector<std::string> image_tags(
-      std::sregex_token_iterator(prompt.begin(), prompt.end(), pattern),
-      std::sregex_token_iterator());
-
-  // Extract the image ids from the image tags.
-  std::vector<int32_t> image_ids(image_tags.size());
-  constexpr size_t image_id_position_begin = 8;  // <|image_ : Character at idx 8 is the beginning of the image_id
-  for (size_t i = 0; i < image_tags.size(); ++i) {
-    const size_t image_id_position_end = image_tags[i].size() - 2;  // |> : Character at idx size() - 2 is '|' which marks the end of the image_id
-    image_ids[i] = std::stoi(image_tags[i].substr(image_id_position_begin,
-                                                  image_id_position_end - image_id_position_begin));
-  }
-
   if (std::set<int32_t>(image_ids.begin(), image_ids.end()).size() != num_images) {
     throw std::runtime_error("Number of unique image tags does not match the number of images.");
   }
@@ -81,20 +74,44 @@ std::unique_ptr<OrtValue> ProcessPixelValues(ortc::Tensor<float>* pixel_values,
   auto pixel_values_value = expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT
                                 ? OrtValue::CreateTensor<float>(allocator, pixel_values->Shape())
                                 : OrtValue::CreateTensor<Ort::Float16_t>(allocator, pixel_values->Shape());
-  if (expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT) {
-    std::copy(pixel_values->Data(), pixel_values->Data() + pixel_values->NumberOfElement(),
-              pixel_values_value->GetTensorMutableData<float>());
-  } else {
-    auto pixel_values_fp32 = OrtValue::CreateTensor<float>(
-        allocator.GetInfo(),
-        std::span<float>(const_cast<float*>(pixel_values->Data()), pixel_values->NumberOfElement()),
-        pixel_values->Shape());
-    Cast(*pixel_values_fp32, pixel_values_value, *GetDeviceInterface(DeviceType::CPU), Ort::TypeToTensorType<Ort::Float16_t>);
-  }
+
+  // Tens of megabytes for documents with many images, so the copy (or conversion) into the tensor is split across threads
+  constexpr size_t chunk_size = 1024 * 1024;
+  const float* source = pixel_values->Data();
+  const size_t element_count = pixel_values->NumberOfElement();
+  GetThreadPool().ParallelFor((element_count + chunk_size - 1) / chunk_size, [&](size_t chunk) {
+    const size_t begin = chunk * chunk_size;
+    const size_t end = std::min(begin + chunk_size, element_count);
+    if (expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT) {
+      std::copy(source + begin, source + end, pixel_values_value->GetTensorMutableData<float>() + begin);
+    } else {
+      auto* fp16 = pixel_values_value->GetTensorMutableData<uint16_t>();
+      ConvertFloat32ToFloat16({source + begin, end - begin}, {fp16 + begin, end - begin});
+    }
+  });
 
   return pixel_values_value;
 }
 
+// Uploads the processor's float pixel values once and converts them on the device, so neither the CPU conversion nor
+// the vision model's own upload of the CPU tensor is paid per prompt
+std::unique_ptr<OrtValue> ProcessPixelValuesOnDevice(ortc::Tensor<float>* pixel_values, ONNXTensorElementDataType expected_type,
+                                                     DeviceInterface& device) {
+  if (!(expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT || expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16)) {
+    throw std::runtime_error("Expected pixel_values to be of type float or float16. Actual: " + std::to_string(expected_type));
+  }
+  auto fp32_value = OrtValue::CreateTensor<float>(device.GetAllocator(), pixel_values->Shape());
+  auto source = GetDeviceInterface(DeviceType::CPU)->WrapMemory(std::span<const float>{pixel_values->Data(), static_cast<size_t>(pixel_values->NumberOfElement())});
+  WrapTensor<float>(device, *fp32_value).CopyFrom(source);
+  if (expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT)
+    return fp32_value;
+
+  auto fp16_value = OrtValue::CreateTensor<Ort::Float16_t>(device.GetAllocator(), pixel_values->Shape());
+  if (!device.Cast(*fp32_value, *fp16_value))
+    throw std::runtime_error("vision.device_preprocessing is not supported on this device, pixel_values can't be converted to float16");
+  return fp16_value;
+}
+
 std::unique_ptr<OrtValue> ProcessImageSizes(ortc::Tensor<int64_t>* image_sizes, Ort::Allocator& allocator) {
   auto image_sizes_value = OrtValue::CreateTensor<int64_t>(allocator, image_sizes->Shape());
   std::copy(image_sizes->Data(), image_sizes->Data() + image_sizes->NumberOfElement(),
@@ -110,13 +127,26 @@ std::unique_ptr<Images> LoadImages(const std::span<const char* const>& image_pat
       throw std::runtime_error("Image path does not exist: " + std::string(image_path));
     }
   }
-  auto [images, num_images] = ort_extensions::LoadRawData<const char* const*, ort_extensions::ImageRawData>(
-      image_paths.data(), image_paths.data() + image_paths.size());
-  return std::make_unique<Images>(std::move(images), num_images);
+
+  // The files are read in parallel, a prompt with many images spends most of its loading time waiting on the reads
+  auto images = std::make_unique<ort_extensions::ImageRawData[]>(image_paths.size());
+  GetThreadPool().ParallelFor(image_paths.size(), [&](size_t i) {
+    std::ifstream file(image_paths[i], std::ios::binary | std::ios::ate);
+    if (!file)
+      throw std::runtime_error("Failed to open image file: " + std::string(image_paths[i]));
+    images[i].resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char*>(images[i].data()), images[i].size()))
+      throw std::runtime_error("Failed to read image file: " + std::string(image_paths[i]));
+  });
+  return std::make_unique<Images>(std::move(images), image_paths.size());
 }
 
-ImageProcessor::ImageProcessor(Config& config, const SessionInfo& session_info)
+ImageProcessor::ImageProcessor(Config& config, const SessionInfo& session_info, DeviceInterface& device)
     : pixel_values_type_{session_info.GetInputDataType(config.model.vision.inputs.pixel_values)} {
+  if (config.model.vision.device_preprocessing && device.GetType() != DeviceType::CPU)
+    pixel_values_device_ = &device;
+
   const std::string default_processor_file_name = "processor_config.json";
   auto processor_config = (config.config_path / fs::path(default_processor_file_name)).string();
   CheckResult(OrtxCreateProcessor(processor_.Address(), processor_config.c_str()));
@@ -137,6 +167,9 @@ std::unique_ptr<NamedTensors> ImageProcessor::Process(const Tokenizer& tokenizer
     return named_tensors;
   }
 
+  Trace::Scope trace_scope{"image_preprocessing", "processor"};
+  const auto start = Metrics::Clock::now();
+
   ort_extensions::ImageProcessor* processor = static_cast<ort_extensions::ImageProcessor*>(processor_.p_);
 
   ortc::Tensor<float>* pixel_values = nullptr;
@@ -151,12 +184,14 @@ std::unique_ptr<NamedTensors> ImageProcessor::Process(const Tokenizer& tokenizer
   named_tensors->emplace(std::string(Config::Defaults::InputIdsName),
                          std::make_shared<Tensor>(ProcessImagePrompt(tokenizer, prompt, num_img_tokens, allocator)));
   named_tensors->emplace(std::string(Config::Defaults::PixelValuesName),
-                         std::make_shared<Tensor>(ProcessPixelValues(pixel_values, pixel_values_type_, allocator)));
+                         std::make_shared<Tensor>(pixel_values_device_ ? ProcessPixelValuesOnDevice(pixel_values, pixel_values_type_, *pixel_values_device_)
+                                                                       : ProcessPixelValues(pixel_values, pixel_values_type_, allocator)));
   named_tensors->emplace(std::string(Config::Defaults::ImageSizesName),
                          std::make_shared<Tensor>(ProcessImageSizes(image_sizes, allocator)));
 
   processor->ClearOutputs(&result);
 
+  Metrics::Emit("oga_image_preprocessing_seconds", MetricType::Histogram, std::chrono::duration<double>(Metrics::Clock::now() - start).count());
   return named_tensors;
 }
 
@@ -18,7 +18,7 @@ struct Images {
 std::unique_ptr<Images> LoadImages(const std::span<const char* const>& image_paths);
 
 struct ImageProcessor {
-  ImageProcessor(Config& config, const SessionInfo& session_info);
+  ImageProcessor(Config& config, const SessionInfo& session_info, DeviceInterface& device);
 
   std::unique_ptr<NamedTensors> Process(const Tokenizer& tokenizer, const std::string& prompt, const Images* images) const;
 
@@ -28,6 +28,7 @@ struct ImageProcessor {
   std::string input_ids_name_;
   std::string pixel_values_name_;
   ONNXTensorElementDataType pixel_values_type_;
+  DeviceInterface* pixel_values_device_{};  // Set when pixel_values are prepared in device memory (vision.device_preprocessing)
   std::string image_sizes_name_;
 };
 
@@ -14,12 +14,12 @@ std::unique_ptr<OrtValue> StaticBuffer::CreateTensorOnStaticBuffer(std::span<con
   size_t new_bytes = SizeOf(type) * GetNumElements(shape);
   if (buffer_ == nullptr) {
     // Assuming the first dimension is the batch size
-    bytes_ = new_bytes * (max_beam_batch_size_ / shape[0]);
+    bytes_ = new_bytes / shape[0] * max_beam_batch_size_;  // Divide first, the first batch size doesn't have to divide max_beam_batch_size_
     buffer_ = allocator_->Alloc(bytes_);
     return OrtValue::CreateTensor(info_, buffer_, new_bytes, shape, type);
   }
   if (new_bytes > bytes_) {
-    std::runtime_error("StaticBuffer: new_bytes > bytes_");
+    throw std::runtime_error("StaticBuffer: new_bytes > bytes_");
   }
   return OrtValue::CreateTensor(info_, buffer_, new_bytes, shape, type);
 }
@@ -38,4 +38,28 @@ StaticBuffer::~StaticBuffer() {
   }
 }
 
+TensorBuffer::TensorBuffer(Ort::Allocator& allocator, size_t reserved_bytes, bool shrink)
+    : allocator_{allocator}, info_{allocator_.GetInfo()}, reserved_bytes_{reserved_bytes}, shrink_{shrink} {
+}
+
+std::unique_ptr<OrtValue> TensorBuffer::CreateTensor(std::span<const int64_t> shape, ONNXTensorElementDataType type) {
+  size_t new_bytes = SizeOf(type);
+  for (auto dim : shape)
+    new_bytes *= dim;
+
+  // Shrink a prompt sized buffer again once the decode shapes are small, but never below the reserved size
+  if (!buffer_ || new_bytes > bytes_ || (shrink_ && bytes_ > reserved_bytes_ && new_bytes < bytes_ / 4)) {
+    if (buffer_)
+      allocator_.Free(buffer_);
+    bytes_ = std::max(new_bytes, reserved_bytes_);
+    buffer_ = allocator_.Alloc(bytes_);
+  }
+  return OrtValue::CreateTensor(info_, buffer_, new_bytes, shape, type);
+}
+
+TensorBuffer::~TensorBuffer() {
+  if (buffer_)
+    allocator_.Free(buffer_);
+}
+
 }  // namespace Generators
\ No newline at end of file
@@ -22,6 +22,8 @@ struct StaticBuffer {
   std::unique_ptr<OrtValue> CreateTensorOnStaticBuffer(std::span<const int64_t> shape,
                                                        ONNXTensorElementDataType type);
 
+  size_t GetBytes() const { return bytes_; }  // 0 until the first tensor is created
+
  private:
   size_t GetNumElements(std::span<const int64_t> shape);
 
@@ -32,4 +34,25 @@ struct StaticBuffer {
   size_t max_beam_batch_size_{};
 };
 
+// Device memory that tensors of changing shapes are created as views into, so the steady state decode loop doesn't
+// allocate. The memory is only reallocated when a tensor doesn't fit, or (unless 'shrink' is false) uses less than a
+// quarter of memory grown past the reserved size. Reallocating invalidates the earlier views, so replace them before
+// using the new one.
+struct TensorBuffer {
+  TensorBuffer(Ort::Allocator& allocator, size_t reserved_bytes = 0, bool shrink = true);
+  TensorBuffer(const TensorBuffer&) = delete;
+  TensorBuffer& operator=(const TensorBuffer&) = delete;
+  ~TensorBuffer();
+
+  std::unique_ptr<OrtValue> CreateTensor(std::span<const int64_t> shape, ONNXTensorElementDataType type);
+
+ private:
+  Ort::Allocator& allocator_;
+  const OrtMemoryInfo& info_;
+  void* buffer_{};
+  size_t bytes_{};
+  size_t reserved_bytes_{};
+  bool shrink_{};
+};
+
 }  // namespace Generators
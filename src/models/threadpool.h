@@ -2,19 +2,17 @@
 // Licensed under the MIT License.
 
 #include <functional>
-#include <vector>
-#include <thread>
 
 namespace Generators {
 
+// Runs a function for 'num_tasks' indices in parallel on the shared thread pool (see GetThreadPool)
 struct ThreadPool {
-  ThreadPool(size_t num_threads);
+  ThreadPool(size_t num_tasks);
 
   void Compute(const std::function<void(size_t)>& func);
 
  private:
-  size_t num_threads_;
-  std::vector<std::thread> threads_;
+  size_t num_tasks_;
 };
 
 }  // namespace Generators
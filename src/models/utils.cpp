@@ -2,6 +2,22 @@
 // Licensed under the MIT License.
 #include "../generators.h"
 #include "utils.h"
+#include "threadpool.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define GENAI_TARGET_F16C
+#else
+#include <cpuid.h>
+#define GENAI_TARGET_F16C __attribute__((target("avx,f16c")))
+#endif
+#define GENAI_HAS_F16C_PATH 1
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define GENAI_HAS_NEON_PATH 1
+#endif
 
 namespace Generators {
 
@@ -10,6 +26,13 @@ DeviceSpan<uint8_t> ByteWrapTensor(DeviceInterface& device, OrtValue& value) {
   return device.WrapMemory(std::span<uint8_t>{value.GetTensorMutableData<uint8_t>(), info->GetElementCount() * SizeOf(info->GetElementType())});
 }
 
+size_t GetTensorSizeInBytes(OrtValue* value) {
+  if (!value)
+    return 0;
+  auto info = value->GetTensorTypeAndShapeInfo();
+  return info->GetElementCount() * SizeOf(info->GetElementType());
+}
+
 size_t SizeOf(ONNXTensorElementDataType type) {
   switch (type) {
     case Ort::TypeToTensorType<uint8_t>:
@@ -38,6 +61,8 @@ size_t SizeOf(ONNXTensorElementDataType type) {
       return sizeof(Ort::Float16_t);
     case Ort::TypeToTensorType<Ort::BFloat16_t>:
       return sizeof(Ort::BFloat16_t);
+    case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT8E4M3FN:
+      return 1;
     default:
       throw std::runtime_error("Unsupported ONNXTensorElementDataType in GetTypeSize");
   }
@@ -98,4 +123,153 @@ uint16_t FastFloat32ToFloat16(float v) {
   return static_cast<uint16_t>((b & 0x80000000) >> 16 | (e > 112) * ((((e - 112) << 10) & 0x7C00) | m >> 13) | ((e < 113) & (e > 101)) * ((((0x007FF000 + m) >> (125 - e)) + 1) >> 1) | (e > 143) * 0x7FFF);  // sign : normalized : denormalized : saturate
 }
 
+namespace {
+
+// Buffers larger than this are converted in chunks of this many elements on the shared thread pool
+constexpr size_t c_convert_chunk_size = 64 * 1024;
+
+template <typename TFn>
+void ConvertInChunks(size_t count, const TFn& convert) {
+  const size_t chunk_count = (count + c_convert_chunk_size - 1) / c_convert_chunk_size;
+  if (chunk_count <= 1) {
+    convert(size_t{0}, count);
+    return;
+  }
+
+  ThreadPool{chunk_count}.Compute([&](size_t chunk) {
+    const size_t begin = chunk * c_convert_chunk_size;
+    convert(begin, std::min(c_convert_chunk_size, count - begin));
+  });
+}
+
+#if GENAI_HAS_F16C_PATH
+bool HasF16C() {
+  // F16C uses the AVX register state, so the OS must also save the YMM registers (OSXSAVE + XCR0 bits 1 and 2)
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 1);
+  const unsigned ecx = static_cast<unsigned>(info[2]);
+  if ((ecx & (1u << 27)) == 0)
+    return false;
+  return (ecx & (1u << 28)) != 0 && (ecx & (1u << 29)) != 0 && (_xgetbv(0) & 6) == 6;
+#else
+  unsigned eax{}, ebx{}, ecx{}, edx{};
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  return __builtin_cpu_supports("avx") && (ecx & bit_F16C) != 0;
+#endif
+}
+
+const bool g_has_f16c = HasF16C();
+
+GENAI_TARGET_F16C void Float16ToFloat32_F16C(const uint16_t* fp16, float* fp32, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+    _mm256_storeu_ps(fp32 + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(fp16 + i))));
+  for (; i < count; i++)
+    fp32[i] = _cvtsh_ss(fp16[i]);
+}
+
+GENAI_TARGET_F16C void Float32ToFloat16_F16C(const float* fp32, uint16_t* fp16, size_t count) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(fp16 + i), _mm256_cvtps_ph(_mm256_loadu_ps(fp32 + i), _MM_FROUND_TO_NEAREST_INT));
+  for (; i < count; i++)
+    fp16[i] = _cvtss_sh(fp32[i], _MM_FROUND_TO_NEAREST_INT);
+}
+#endif
+
+void Float16ToFloat32Range(const uint16_t* fp16, float* fp32, size_t count) {
+  size_t i = 0;
+#if GENAI_HAS_F16C_PATH
+  if (g_has_f16c)
+    return Float16ToFloat32_F16C(fp16, fp32, count);
+#elif GENAI_HAS_NEON_PATH
+  for (; i + 4 <= count; i += 4)
+    vst1q_f32(fp32 + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(fp16 + i))));
+#endif
+  for (; i < count; i++)
+    fp32[i] = FastFloat16ToFloat32(fp16[i]);
+}
+
+void Float32ToFloat16Range(const float* fp32, uint16_t* fp16, size_t count) {
+  size_t i = 0;
+#if GENAI_HAS_F16C_PATH
+  if (g_has_f16c)
+    return Float32ToFloat16_F16C(fp32, fp16, count);
+#elif GENAI_HAS_NEON_PATH
+  for (; i + 4 <= count; i += 4)
+    vst1_u16(fp16 + i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(fp32 + i))));
+#endif
+  for (; i < count; i++)
+    fp16[i] = FastFloat32ToFloat16(fp32[i]);
+}
+
+// bf16 is the upper half of an fp32, so these plain loops are left to the compiler's auto-vectorizer
+void BFloat16ToFloat32Range(const uint16_t* bf16, float* fp32, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    fp32[i] = bit_cast<float>(static_cast<uint32_t>(bf16[i]) << 16);
+}
+
+void Float32ToBFloat16Range(const float* fp32, uint16_t* bf16, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    const uint32_t b = bit_cast<uint32_t>(fp32[i]);
+    const bool is_nan = (b & 0x7FFFFFFF) > 0x7F800000;
+    const uint32_t rounded = (b + 0x7FFF + ((b >> 16) & 1)) >> 16;  // round-to-nearest-even on the truncated 16 bits
+    bf16[i] = static_cast<uint16_t>(is_nan ? ((b >> 16) | 0x0040) : rounded);  // Keep NaNs quiet instead of rounding them to Inf
+  }
+}
+
+template <typename TFrom, typename TTo>
+void ConvertSpan(std::span<const TFrom> input, std::span<TTo> output, void (*convert)(const TFrom*, TTo*, size_t)) {
+  if (input.size() != output.size())
+    throw std::runtime_error("Conversion input and output sizes do not match");
+  ConvertInChunks(input.size(), [&](size_t begin, size_t count) { convert(input.data() + begin, output.data() + begin, count); });
+}
+
+}  // namespace
+
+void ConvertFloat16ToFloat32(std::span<const uint16_t> fp16, std::span<float> fp32) {
+  ConvertSpan(fp16, fp32, Float16ToFloat32Range);
+}
+
+void ConvertFloat32ToFloat16(std::span<const float> fp32, std::span<uint16_t> fp16) {
+  ConvertSpan(fp32, fp16, Float32ToFloat16Range);
+}
+
+void ConvertBFloat16ToFloat32(std::span<const uint16_t> bf16, std::span<float> fp32) {
+  ConvertSpan(bf16, fp32, BFloat16ToFloat32Range);
+}
+
+void ConvertFloat32ToBFloat16(std::span<const float> fp32, std::span<uint16_t> bf16) {
+  ConvertSpan(fp32, bf16, Float32ToBFloat16Range);
+}
+
+void StreamingCopy(void* dest, const void* source, size_t size) {
+#if defined(__x86_64__) || defined(_M_X64)
+  auto* d = static_cast<uint8_t*>(dest);
+  auto* s = static_cast<const uint8_t*>(source);
+  // Streaming stores need a 16 byte aligned destination, the unaligned head and the tail are copied normally
+  const size_t head = std::min(size, (16 - reinterpret_cast<uintptr_t>(d) % 16) % 16);
+  std::memcpy(d, s, head);
+  d += head;
+  s += head;
+  size -= head;
+
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    auto* src = reinterpret_cast<const __m128i*>(s + i);
+    auto* dst = reinterpret_cast<__m128i*>(d + i);
+    _mm_stream_si128(dst, _mm_loadu_si128(src));
+    _mm_stream_si128(dst + 1, _mm_loadu_si128(src + 1));
+    _mm_stream_si128(dst + 2, _mm_loadu_si128(src + 2));
+    _mm_stream_si128(dst + 3, _mm_loadu_si128(src + 3));
+  }
+  _mm_sfence();  // Streaming stores are weakly ordered, make them visible before the copy is handed to another thread
+  std::memcpy(d + i, s + i, size - i);
+#else
+  std::memcpy(dest, source, size);
+#endif
+}
+
 }  // namespace Generators
\ No newline at end of file
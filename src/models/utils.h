@@ -32,4 +32,15 @@ float Float16ToFloat32(uint16_t v);
 float FastFloat16ToFloat32(const uint16_t x);
 uint16_t FastFloat32ToFloat16(float v);
 
+// Bulk fp16/bf16<->fp32 conversions, vectorized with F16C (x64) or NEON (arm64) when available and split across the
+// shared thread pool for large buffers. The vectorized fp16 paths handle NaN and Inf, the scalar fallback is the Fast* one above.
+void ConvertFloat16ToFloat32(std::span<const uint16_t> fp16, std::span<float> fp32);
+void ConvertFloat32ToFloat16(std::span<const float> fp32, std::span<uint16_t> fp16);
+void ConvertBFloat16ToFloat32(std::span<const uint16_t> bf16, std::span<float> fp32);
+void ConvertFloat32ToBFloat16(std::span<const float> fp32, std::span<uint16_t> bf16);  // Rounds to nearest even
+
+// memcpy with streaming stores (SSE2 on x64, plain memcpy elsewhere) that bypass the cache, for copies much larger than
+// the cache that would otherwise evict the working set for data that doesn't stay cached anyway
+void StreamingCopy(void* dest, const void* source, size_t size);
+
 }  // namespace Generators
\ No newline at end of file
@@ -8,8 +8,11 @@ namespace Generators {
 
 Whisper_Model::Whisper_Model(std::unique_ptr<Config> config, OrtEnv& ort_env)
     : Model{std::move(config)} {
-  session_encoder_ = OrtSession::Create(ort_env, (config_->config_path / fs::path(config_->model.encoder_decoder_init.filename)).c_str(), session_options_.get());
-  session_decoder_ = OrtSession::Create(ort_env, (config_->config_path / fs::path(config_->model.decoder.filename)).c_str(), session_options_.get());
+  // The sessions are independent, so they're created in parallel
+  const std::array<std::function<void()>, 2> create_sessions{
+      [&] { session_encoder_ = CreateSession(ort_env, config_->model.encoder_decoder_init.filename, config_->model.decoder.session_options, *session_options_); },
+      [&] { session_decoder_ = CreateSession(ort_env, config_->model.decoder.filename, config_->model.decoder.session_options, *session_options_); }};
+  GetThreadPool().ParallelFor(create_sessions.size(), [&](size_t i) { create_sessions[i](); });
 
   InitDeviceAllocator(*session_decoder_);
   session_info_->Add(*session_encoder_);
@@ -24,20 +27,28 @@ Whisper_State::Whisper_State(const Whisper_Model& model, DeviceSpan<int32_t> seq
       model_{model} {
   auto& inputs = const_cast<GeneratorParams::Whisper&>(std::get<GeneratorParams::Whisper>(params.inputs));
 
+  // The beams of a batch entry share its audio, so with a per batch entry cross cache the features aren't expanded
+  const bool cross_cache_per_batch_entry = model_.config_->model.decoder.cross_cache_per_batch_entry;
+  const int encoder_num_beams = cross_cache_per_batch_entry ? 1 : params_->search.num_beams;
   for (const auto& [name, value] : params.extra_inputs) {
     if (name == "encoder_input_ids") {
-      encoder_input_ids_ = model_.ExpandInputs(value->ort_tensor_, params_->search.num_beams);
+      encoder_input_ids_ = model_.ExpandInputs(value->ort_tensor_, encoder_num_beams);
     }
   }
   if (encoder_input_ids_ == nullptr) {
-    encoder_input_ids_ = model_.ExpandInputs(inputs.input_features->ort_tensor_, params_->search.num_beams);
+    encoder_input_ids_ = model_.ExpandInputs(inputs.input_features->ort_tensor_, encoder_num_beams);
   }
 
   if (encoder_input_ids_ == nullptr) {
     throw std::runtime_error("encoder_input_ids must be provided in the extra inputs");
   }
 
-  if (inputs.alignment_heads != nullptr) {
+  if (inputs.alignment_heads != nullptr && inputs.sparse_cross_qk) {
+    if (params_->search.num_beams != 1)
+      throw std::runtime_error("sparse_cross_qk does not support beam search, num_beams is " + std::to_string(params_->search.num_beams));
+    sparse_cross_qk_ = true;
+    alignment_heads_ = std::move(inputs.alignment_heads->ort_tensor_);
+  } else if (inputs.alignment_heads != nullptr) {
 #if 0  // USE_CUDA
     auto alignment_heads_type_and_shape_info = inputs.alignment_heads->ort_tensor_->GetTensorTypeAndShapeInfo();
     auto alignment_heads_type = alignment_heads_type_and_shape_info->GetElementType();  // ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32
@@ -62,7 +73,8 @@ Whisper_State::Whisper_State(const Whisper_Model& model, DeviceSpan<int32_t> seq
   }
 
   auto hidden_states_type = model_.session_info_->GetOutputDataType("encoder_hidden_states");
-  auto encoder_hidden_states_shape = std::array<int64_t, 3>{decoder_input_ids_.GetShape()[0], 1500, static_cast<int64_t>(model_.config_->model.decoder.num_attention_heads) * model_.config_->model.decoder.head_size};
+  const int64_t encoder_batch_size = cross_cache_per_batch_entry ? params_->search.batch_size : decoder_input_ids_.GetShape()[0];
+  auto encoder_hidden_states_shape = std::array<int64_t, 3>{encoder_batch_size, 1500, static_cast<int64_t>(model_.config_->model.decoder.num_attention_heads) * model_.config_->model.decoder.head_size};
   encoder_hidden_states_ = OrtValue::CreateTensor(model_.p_device_->GetAllocator(), encoder_hidden_states_shape, hidden_states_type);
 
   auto sequence_lengths = sequence_lengths_unk.CpuSpan();
@@ -214,7 +226,8 @@ DeviceSpan<float> Whisper_State::Run(int current_length, DeviceSpan<int32_t>& ne
             }
             break;
 #endif
-          case DeviceType::CPU: {
+          case DeviceType::CPU:
+          case DeviceType::QNN: {  // HTP shared memory is CPU accessible
             memcpy(dest_data, src_data, copy_data_size_all);
             break;
           }
@@ -276,7 +289,8 @@ DeviceSpan<float> Whisper_State::Run(int current_length, DeviceSpan<int32_t>& ne
         ByteWrapTensor(*model_.p_device_, *cache_indirection_).Zero();
       }
 
-      if (model_.session_info_->HasOutput("output_cross_qk_0")) {
+      // Plain transcription doesn't pay for the cross QK outputs, they're only bound when timestamps are requested
+      if (alignment_heads_ && model_.session_info_->HasOutput("output_cross_qk_0")) {
         auto layer_count = model_.config_->model.decoder.num_hidden_layers;
         auto type = model_.session_info_->GetOutputDataType("output_cross_qk_0");
         std::array<int64_t, 4> shape{params_->BatchBeamSize(), model_.config_->model.decoder.num_attention_heads, 1, 1500};
@@ -304,12 +318,71 @@ DeviceSpan<float> Whisper_State::Run(int current_length, DeviceSpan<int32_t>& ne
   }
 
   State::Run(*model_.session_decoder_, batch_size);
+  if (sparse_cross_qk_ && !output_cross_qk_.empty())
+    RecordCrossQkFrames();
   return logits_.Get();
 }
 
+void Whisper_State::RecordCrossQkFrames() {
+  const auto heads_shape = alignment_heads_->GetTensorTypeAndShapeInfo()->GetShape();
+  const size_t alignment_head_count = static_cast<size_t>(heads_shape[0]);
+  auto heads = std::span<const int32_t>{alignment_heads_->GetTensorData<int32_t>(), alignment_head_count * 2};
+
+  const auto shape = output_cross_qk_[0]->GetTensorTypeAndShapeInfo()->GetShape();  // { batch_beam_size, num_heads, 1, frames }
+  const size_t batch_beam_size = static_cast<size_t>(shape[0]);
+  const size_t head_count = static_cast<size_t>(shape[1]);
+  const size_t frame_count = static_cast<size_t>(shape[3]);
+
+  const size_t step_begin = cross_qk_frames_.size();
+  cross_qk_frames_.resize(step_begin + batch_beam_size * alignment_head_count);
+
+  // Every layer's cross QK is copied to the CPU once, even when several alignment heads are in it
+  std::unordered_map<int32_t, std::vector<float>> layers;
+  for (size_t i = 0; i < alignment_head_count; i++) {
+    const int32_t layer = heads[i * 2];
+    const int32_t head = heads[i * 2 + 1];
+    if (layer < 0 || static_cast<size_t>(layer) >= output_cross_qk_.size() || head < 0 || static_cast<size_t>(head) >= head_count)
+      throw std::runtime_error("Alignment head (" + std::to_string(layer) + ", " + std::to_string(head) + ") is out of range");
+
+    auto [it, inserted] = layers.try_emplace(layer);
+    if (inserted) {
+      OrtValue* cross_qk = output_cross_qk_[layer].get();
+      std::unique_ptr<OrtValue> cross_qk_fp32;
+      if (cross_qk->GetTensorTypeAndShapeInfo()->GetElementType() != Ort::TypeToTensorType<float>) {
+        Cast(*cross_qk, cross_qk_fp32, *model_.p_device_, Ort::TypeToTensorType<float>);
+        cross_qk = cross_qk_fp32.get();
+      }
+      auto values = WrapTensor<float>(*model_.p_device_, *cross_qk).CopyDeviceToCpu();
+      it->second.assign(values.begin(), values.end());
+    }
+
+    for (size_t b = 0; b < batch_beam_size; b++) {
+      auto frames = std::span<const float>{it->second}.subspan((b * head_count + head) * frame_count, frame_count);
+      cross_qk_frames_[step_begin + b * alignment_head_count + i] = static_cast<int32_t>(std::max_element(frames.begin(), frames.end()) - frames.begin());
+    }
+  }
+  cross_qk_frames_output_.reset();
+}
+
+bool Whisper_State::CompactBatch(std::span<const int32_t> rows) {
+  // The first decoder run still copies the encoder's presents for the full batch, and the cache indirection and
+  // cross QK buffers are sized for the full batch
+  if (run_state_ != RunState::Decoder || cache_indirection_ || !output_cross_qk_.empty())
+    return false;
+
+  decoder_input_ids_.CompactBatch(rows.size());
+  kv_cache_.CompactBatch(rows);
+  cross_cache_.CompactBatch(rows);
+  logits_.CompactBatch(rows.size());
+  return true;
+}
+
 void Whisper_State::UpdateInputsOutputs(DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> beam_indices, int current_length, bool search_buffers) {
   decoder_input_ids_.Update(next_tokens);
-  kv_cache_.Update(beam_indices, current_length);
+  {
+    Metrics::Timer timer{GeneratorMetrics::KeyValueCache};
+    kv_cache_.Update(beam_indices, current_length);
+  }
   size_t new_length = decoder_input_ids_.GetShape()[1];
   logits_.Update(next_tokens, new_length);
 
@@ -385,7 +458,7 @@ void Whisper_State::Initialize(DeviceSpan<int32_t>& next_tokens, int total_lengt
 }
 
 void Whisper_State::Finalize() {
-  if (output_cross_qk_.size() && alignment_heads_) {
+  if (output_cross_qk_.size() && alignment_heads_ && !sparse_cross_qk_) {
 #if 0  // USE_CUDA
     int decoded_length = *(past_sequence_length_->GetTensorMutableData<int32_t>()) + 1;
     auto output_cross_qk_dims = output_cross_qk_[0]->GetTensorTypeAndShapeInfo()->GetShape();
@@ -418,7 +491,54 @@ OrtValue* Whisper_State::GetOutput(const char* name) {
   if (std::strcmp("cross_qk", name) == 0) {
     return cross_qk_final_.get();
   }
+  if (std::strcmp("cross_qk_frames", name) == 0) {
+    if (!sparse_cross_qk_)
+      return nullptr;
+    if (!cross_qk_frames_output_) {
+      const int64_t batch_beam_size = params_->BatchBeamSize();
+      const int64_t head_count = alignment_heads_->GetTensorTypeAndShapeInfo()->GetShape()[0];
+      const int64_t step_count = static_cast<int64_t>(cross_qk_frames_.size()) / (batch_beam_size * head_count);
+      cross_qk_frames_output_ = OrtValue::CreateTensor<int32_t>(model_.allocator_cpu_, std::array<int64_t, 3>{batch_beam_size, head_count, step_count});
+      auto frames = cross_qk_frames_output_->GetTensorMutableData<int32_t>();
+      for (int64_t step = 0; step < step_count; step++)
+        for (int64_t b = 0; b < batch_beam_size; b++)
+          for (int64_t h = 0; h < head_count; h++)
+            frames[(b * head_count + h) * step_count + step] = cross_qk_frames_[(step * batch_beam_size + b) * head_count + h];
+    }
+    return cross_qk_frames_output_.get();
+  }
   return State::GetOutput(name);
 };
 
+std::shared_ptr<Tensor> BatchInputFeatures(std::span<const std::shared_ptr<Tensor>> input_features) {
+  if (input_features.empty())
+    throw std::runtime_error("BatchInputFeatures requires at least one input features tensor");
+
+  auto first_info = input_features[0]->ort_tensor_->GetTensorTypeAndShapeInfo();
+  auto type = first_info->GetElementType();
+  auto shape = first_info->GetShape();
+  if (shape.size() != 3)
+    throw std::runtime_error("Expected input features of shape [batch_size, number_of_mels, number_of_frames]");
+
+  int64_t batch_size = 0;
+  for (auto& features : input_features) {
+    auto info = features->ort_tensor_->GetTensorTypeAndShapeInfo();
+    auto features_shape = info->GetShape();
+    if (info->GetElementType() != type || features_shape.size() != 3 || features_shape[1] != shape[1] || features_shape[2] != shape[2])
+      throw std::runtime_error("All input features must have the same type, number_of_mels and number_of_frames");
+    batch_size += features_shape[0];
+  }
+
+  shape[0] = batch_size;
+  auto batch = OrtValue::CreateTensor(Ort::Allocator::GetWithDefaultOptions(), shape, type);
+  auto destination = ByteWrapTensor(*GetDeviceInterface(DeviceType::CPU), *batch);
+  size_t offset = 0;
+  for (auto& features : input_features) {
+    auto source = ByteWrapTensor(*GetDeviceInterface(DeviceType::CPU), *features->ort_tensor_);
+    destination.subspan(offset, source.size()).CopyFrom(source);
+    offset += source.size();
+  }
+  return std::make_shared<Tensor>(std::move(batch));
+}
+
 }  // namespace Generators
@@ -21,11 +21,17 @@ struct Whisper_State : State {
   Whisper_State(const Whisper_Model& model, DeviceSpan<int32_t> sequence_lengths, const GeneratorParams& params);
   DeviceSpan<float> Run(int current_length, DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> next_indices) override;
   OrtValue* GetOutput(const char* name) override;
+  bool CompactBatch(std::span<const int32_t> rows) override;
+  void UpdateMemoryUsage(MemoryUsage& usage) const override {
+    usage.Set(MemoryUsage::KeyValueCache, kv_cache_.GetMemoryUsage());
+    usage.Set(MemoryUsage::Logits, logits_.GetMemoryUsage());
+  }
 
  private:
   void UpdateInputsOutputs(DeviceSpan<int32_t>& next_tokens, DeviceSpan<int32_t> next_indices, int current_length, bool search_buffers);
   void Initialize(DeviceSpan<int32_t>& next_tokens, int total_length, DeviceSpan<int32_t> beam_indices);
   void Finalize() override;
+  void RecordCrossQkFrames();
 
   const Whisper_Model& model_;
   enum struct RunState {
@@ -60,6 +66,15 @@ struct Whisper_State : State {
   std::unique_ptr<OrtValue> cross_qk_search_buffer_;  // { batch_beam_size, num_alignment_heads, max_length, 1500 }
   std::unique_ptr<OrtValue> cross_qk_final_;          // { batch_size, num_return_sequences, num_alignment_heads, decoded_length, 1500 }
 
+  // Sparse cross QK, the frame with the highest cross QK of every alignment head for each decoded token
+  bool sparse_cross_qk_{};
+  std::vector<int32_t> cross_qk_frames_;                // [decoded_length][batch_beam_size][num_alignment_heads]
+  std::unique_ptr<OrtValue> cross_qk_frames_output_;  // { batch_beam_size, num_alignment_heads, decoded_length }
+
   size_t cache_indirection_index_{~0U};
 };
+
+// Stacks the input features of several audios (each float or float16 [batch_size, number_of_mels, number_of_frames])
+// into one batch, so a single encoder run and one batch of decoders transcribe all of them
+std::shared_ptr<Tensor> BatchInputFeatures(std::span<const std::shared_ptr<Tensor>> input_features);
 }  // namespace Generators
@@ -17,16 +17,7 @@ namespace Generators {
 
 WindowedKeyValueCache::WindowedKeyValueCache(State& state)
     : state_{state},
-      layer_count_{model_.config_->model.decoder.num_hidden_layers},
-      window_size_{model_.config_->model.decoder.sliding_window->window_size},
-      key_cache_shape_in_{model_.config_->model.decoder.num_key_value_heads, 1,
-                          model_.config_->model.decoder.head_size, model_.config_->model.context_length - window_size_},
-      key_cache_shape_out_{model_.config_->model.decoder.num_key_value_heads, 1,
-                           model_.config_->model.decoder.head_size, window_size_},
-      value_cache_shape_in_{model_.config_->model.decoder.num_key_value_heads, 1,
-                            model_.config_->model.context_length - window_size_, model_.config_->model.decoder.head_size},
-      value_cache_shape_out_{model_.config_->model.decoder.num_key_value_heads, 1,
-                             window_size_, model_.config_->model.decoder.head_size} {
+      layer_count_{model_.config_->model.decoder.num_hidden_layers} {
   if (layer_count_ == 0) {
     throw std::runtime_error("Expected there to be at least 1 layer in the model. Actual: " +
                              std::to_string(layer_count_) + ". Please check the num_hidden_layers attribute in the model configuration.");
@@ -45,15 +36,57 @@ WindowedKeyValueCache::WindowedKeyValueCache(State& state)
                              std::to_string(type_));
   }
 
+  // The views into the buffers can't be registered as shared memory with an NPU, so only CPU caches slide in place
+  slide_in_place_ = Device().GetType() == DeviceType::CPU;
+
+  InitializeCaches(model_.config_->model.decoder.sliding_window->window_size);
+}
+
+size_t WindowedKeyValueCache::KeySlackBytes(size_t window_size) const {
+  return std::max(c_slide_slack_tokens, window_size);
+}
+
+size_t WindowedKeyValueCache::ValueSlackBytes(size_t window_size) const {
+  return std::max(c_slide_slack_tokens, window_size) * model_.config_->model.decoder.head_size;
+}
+
+std::unique_ptr<OrtValue> WindowedKeyValueCache::CreateInputCache(std::span<const int64_t> shape, size_t slack_bytes,
+                                                                  std::unique_ptr<OrtValue>& buffer) {
+  if (!slide_in_place_)
+    return OrtValue::CreateTensor(Allocator(), shape, type_);
+
+  const size_t cache_bytes = static_cast<size_t>(ElementCountFromShape(shape));
+  buffer = OrtValue::CreateTensor(Allocator(), std::array<int64_t, 1>{static_cast<int64_t>(cache_bytes + slack_bytes)}, type_);
+  return OrtValue::CreateTensor(Allocator().GetInfo(), buffer->GetTensorMutableData<uint8_t>(), cache_bytes, shape, type_);
+}
+
+void WindowedKeyValueCache::InitializeCaches(int window_size) {
+  window_size_ = window_size;
+  key_cache_shape_in_ = {model_.config_->model.decoder.num_key_value_heads, 1,
+                         model_.config_->model.decoder.head_size, model_.config_->model.context_length - window_size_};
+  key_cache_shape_out_ = {model_.config_->model.decoder.num_key_value_heads, 1,
+                          model_.config_->model.decoder.head_size, window_size_};
+  value_cache_shape_in_ = {model_.config_->model.decoder.num_key_value_heads, 1,
+                           model_.config_->model.context_length - window_size_, model_.config_->model.decoder.head_size};
+  value_cache_shape_out_ = {model_.config_->model.decoder.num_key_value_heads, 1,
+                            window_size_, model_.config_->model.decoder.head_size};
+
+  key_caches_in_.clear();
+  value_caches_in_.clear();
+  key_caches_out_.clear();
+  value_caches_out_.clear();
+  key_buffers_in_.assign(layer_count_, nullptr);
+  value_buffers_in_.assign(layer_count_, nullptr);
+  key_offsets_in_.assign(layer_count_, 0);
+  value_offsets_in_.assign(layer_count_, 0);
+
   for (int i = 0; i < layer_count_; ++i) {
-    key_caches_in_.push_back(
-        OrtValue::CreateTensor(Allocator(), key_cache_shape_in_, type_));
+    key_caches_in_.push_back(CreateInputCache(key_cache_shape_in_, KeySlackBytes(window_size_), key_buffers_in_[i]));
     std::fill_n(key_caches_in_[i]->GetTensorMutableData<uint8_t>(),
                 ElementCountFromShape(key_cache_shape_in_),
                 static_cast<uint8_t>(model_.config_->model.decoder.sliding_window->pad_value));
 
-    value_caches_in_.push_back(
-        OrtValue::CreateTensor(Allocator(), value_cache_shape_in_, type_));
+    value_caches_in_.push_back(CreateInputCache(value_cache_shape_in_, ValueSlackBytes(window_size_), value_buffers_in_[i]));
     std::fill_n(value_caches_in_[i]->GetTensorMutableData<uint8_t>(),
                 ElementCountFromShape(value_cache_shape_in_),
                 static_cast<uint8_t>(model_.config_->model.decoder.sliding_window->pad_value));
@@ -63,6 +96,13 @@ WindowedKeyValueCache::WindowedKeyValueCache(State& state)
     value_caches_out_.push_back(
         OrtValue::CreateTensor(Allocator(), value_cache_shape_out_, type_));
   }
+
+  window_sizes_.clear();
+  window_index_ = 0;
+  is_first_update_ = true;
+  processed_length_ = 0;
+  layer_lengths_.assign(layer_count_, 0);
+  skip_next_slide_ = false;
 }
 
 void WindowedKeyValueCache::Add() {
@@ -129,13 +169,68 @@ void WindowedKeyValueCache::SlideLayer(size_t layer_idx) {
       std::copy(value_cache_src.begin(), value_cache_src.end(), value_cache_dst.begin());
     }
   }
+
+  layer_lengths_[layer_idx] += window_size_;
+}
+
+void WindowedKeyValueCache::SlideLayerInPlace(size_t layer_idx) {
+  assert(layer_idx < layer_count_ && slide_in_place_);
+
+  // The input caches are rows of right aligned tokens: head_size rows per head for the keys and one row per head for
+  // the values. Moving a view forward by the window drops the oldest tokens of every row, and the end of each row
+  // becomes the start of the next row, which is exactly the tokens dropped from that row. So only the window's new
+  // tokens are written, and the cache is moved back to the start of its buffer once the slack after it is used up.
+  auto slide = [&](std::unique_ptr<OrtValue>& cache, OrtValue& buffer, size_t& offset, std::span<const int64_t> shape,
+                   size_t row_count, size_t window_bytes, const OrtValue& cache_out) {
+    const size_t cache_bytes = static_cast<size_t>(ElementCountFromShape(shape));
+    const size_t buffer_bytes = buffer.GetTensorTypeAndShapeInfo()->GetElementCount();
+    const size_t row_bytes = cache_bytes / row_count;
+    uint8_t* buffer_data = buffer.GetTensorMutableData<uint8_t>();
+    if (offset + window_bytes + cache_bytes > buffer_bytes) {
+      std::memmove(buffer_data, buffer_data + offset, cache_bytes);
+      offset = 0;
+    }
+    offset += window_bytes;
+
+    uint8_t* cache_data = buffer_data + offset;
+    const uint8_t* cache_out_data = cache_out.GetTensorData<uint8_t>();
+    for (size_t row = 0; row < row_count; ++row)
+      std::copy_n(cache_out_data + row * window_bytes, window_bytes, cache_data + row * row_bytes + row_bytes - window_bytes);
+    cache = OrtValue::CreateTensor(Allocator().GetInfo(), cache_data, cache_bytes, shape, type_);
+  };
+
+  slide(key_caches_in_[layer_idx], *key_buffers_in_[layer_idx], key_offsets_in_[layer_idx], key_cache_shape_in_,
+        static_cast<size_t>(key_cache_shape_in_[0] * key_cache_shape_in_[2]), static_cast<size_t>(window_size_),
+        *key_caches_out_[layer_idx]);
+  slide(value_caches_in_[layer_idx], *value_buffers_in_[layer_idx], value_offsets_in_[layer_idx], value_cache_shape_in_,
+        static_cast<size_t>(value_cache_shape_in_[0]), static_cast<size_t>(window_size_ * value_cache_shape_in_[3]),
+        *value_caches_out_[layer_idx]);
+
+  layer_lengths_[layer_idx] += window_size_;
+}
+
+void WindowedKeyValueCache::SetStateInputsOutputs() {
+  for (size_t layer_idx = 0; layer_idx < layer_count_; ++layer_idx)
+    SetLayerInputsOutputs(layer_idx);
+}
+
+void WindowedKeyValueCache::SetLayerInputsOutputs(size_t layer_idx) {
+  state_.inputs_[input_index_ + 2 * layer_idx] = key_caches_in_[layer_idx].get();
+  state_.inputs_[input_index_ + 2 * layer_idx + 1] = value_caches_in_[layer_idx].get();
+  state_.outputs_[output_index_ + 2 * layer_idx] = key_caches_out_[layer_idx].get();
+  state_.outputs_[output_index_ + 2 * layer_idx + 1] = value_caches_out_[layer_idx].get();
 }
 
 void WindowedKeyValueCache::SlideAllLayers() {
   ThreadPool thread_pool{static_cast<size_t>(layer_count_)};
   thread_pool.Compute([this](size_t layer_idx) {
-    SlideLayer(layer_idx);
+    if (slide_in_place_)
+      SlideLayerInPlace(layer_idx);
+    else
+      SlideLayer(layer_idx);
   });
+  if (slide_in_place_)
+    SetStateInputsOutputs();  // The input caches are new views
 }
 
 void WindowedKeyValueCache::SlideLayers(std::span<const size_t> layer_indices) {
@@ -147,18 +242,35 @@ void WindowedKeyValueCache::SlideLayers(std::span<const size_t> layer_indices) {
 }
 
 void WindowedKeyValueCache::Update(DeviceSpan<int32_t> /* beam_indices */, int current_length) {
+  processed_length_ = static_cast<size_t>(current_length);
   if (is_first_update_) {
-    num_windows_ = (current_length + window_size_ - 1) / window_size_;
+    auto window_sizes = GetPromptWindowSizes(*model_.config_->model.decoder.sliding_window, static_cast<size_t>(current_length));
+    if (window_sizes[0] != window_size_) {
+      // The prompt is shorter than a full window, so the caches are still all padding
+      InitializeCaches(window_sizes[0]);
+      SetStateInputsOutputs();
+    }
+    window_sizes_ = std::move(window_sizes);
     is_first_update_ = false;
     window_index_++;
     return;
-  } else if (window_size_ == 1 || window_index_ < num_windows_) {
-    SlideAllLayers();
+  } else if (skip_next_slide_) {
+    skip_next_slide_ = false;
     window_index_++;
     return;
   }
 
-  // Transition from prompt processing to token generation.
+  // After the prompt windows, tokens are processed one at a time
+  const int next_window_size = window_index_ < window_sizes_.size() ? window_sizes_[window_index_] : 1;
+  if (next_window_size == window_size_)
+    SlideAllLayers();
+  else
+    TransitionToWindowSize(next_window_size);
+  window_index_++;
+}
+
+void WindowedKeyValueCache::TransitionToWindowSize(int updated_window_size) {
+  // Transition to a window of another size, e.g. from prompt processing to token generation (updated_window_size = 1).
   // Concatenate the last window_size_ elements to the end of the cache
 
   // key_caches_in_ = Concat(key_caches_in_[:, :, :, 1:], key_caches_out_)
@@ -167,8 +279,8 @@ void WindowedKeyValueCache::Update(DeviceSpan<int32_t> /* beam_indices */, int c
   // value_cache = Concat(value_caches_in_[:, :, 1:, :], value_caches_out_)
   // [num_key_value_heads, 1, context_length - 1, head_size] = [num_key_value_heads, 1, context_length - window_size_ - 1, head_size] +
   //                                                           [num_key_value_heads, 1, window_size_, head_size]
+  // (the examples are for updated_window_size = 1, other sizes drop their updated_window_size oldest elements instead)
 
-  int updated_window_size = 1;
   auto updated_key_cache_shape_in = std::array<int64_t, 4>{model_.config_->model.decoder.num_key_value_heads, 1,
                                                            model_.config_->model.decoder.head_size,
                                                            model_.config_->model.context_length - updated_window_size};
@@ -185,9 +297,13 @@ void WindowedKeyValueCache::Update(DeviceSpan<int32_t> /* beam_indices */, int c
                                                               updated_window_size,
                                                               model_.config_->model.decoder.head_size};
 
+  const size_t key_slack_bytes = KeySlackBytes(updated_window_size);
+  const size_t value_slack_bytes = ValueSlackBytes(updated_window_size);
+
   ThreadPool thread_pool{static_cast<size_t>(layer_count_)};
   thread_pool.Compute([&](size_t layer_idx) {
-    std::unique_ptr<OrtValue> key_cache = OrtValue::CreateTensor(Allocator(), updated_key_cache_shape_in, type_);
+    std::unique_ptr<OrtValue> key_buffer;
+    std::unique_ptr<OrtValue> key_cache = CreateInputCache(updated_key_cache_shape_in, key_slack_bytes, key_buffer);
 
     uint8_t* key_cache_data = key_cache->GetTensorMutableData<uint8_t>();
     uint8_t* key_cache_in_data = key_caches_in_[layer_idx]->GetTensorMutableData<uint8_t>();
@@ -213,9 +329,12 @@ void WindowedKeyValueCache::Update(DeviceSpan<int32_t> /* beam_indices */, int c
     }
 
     key_caches_in_[layer_idx] = std::move(key_cache);
+    key_buffers_in_[layer_idx] = std::move(key_buffer);
+    key_offsets_in_[layer_idx] = 0;
     key_caches_out_[layer_idx] = OrtValue::CreateTensor(Allocator(), updated_key_cache_shape_out, type_);
 
-    std::unique_ptr<OrtValue> value_cache = OrtValue::CreateTensor(Allocator(), updated_value_cache_shape_in, type_);
+    std::unique_ptr<OrtValue> value_buffer;
+    std::unique_ptr<OrtValue> value_cache = CreateInputCache(updated_value_cache_shape_in, value_slack_bytes, value_buffer);
 
     uint8_t* value_cache_data = value_cache->GetTensorMutableData<uint8_t>();
     uint8_t* value_cache_in_data = value_caches_in_[layer_idx]->GetTensorMutableData<uint8_t>();
@@ -241,27 +360,120 @@ void WindowedKeyValueCache::Update(DeviceSpan<int32_t> /* beam_indices */, int c
     }
 
     value_caches_in_[layer_idx] = std::move(value_cache);
+    value_buffers_in_[layer_idx] = std::move(value_buffer);
+    value_offsets_in_[layer_idx] = 0;
     value_caches_out_[layer_idx] = OrtValue::CreateTensor(Allocator(), updated_value_cache_shape_out, type_);
+
+    layer_lengths_[layer_idx] += window_size_;
   });
 
-  window_size_ = 1;
+  window_size_ = updated_window_size;
   key_cache_shape_in_ = updated_key_cache_shape_in;
   value_cache_shape_in_ = updated_value_cache_shape_in;
   key_cache_shape_out_ = updated_key_cache_shape_out;
   value_cache_shape_out_ = updated_value_cache_shape_out;
 
-  for (size_t layer_idx = 0; layer_idx < layer_count_; ++layer_idx) {
-    state_.inputs_[input_index_ + 2 * layer_idx] = key_caches_in_[layer_idx].get();
-    state_.inputs_[input_index_ + 2 * layer_idx + 1] = value_caches_in_[layer_idx].get();
-    state_.outputs_[output_index_ + 2 * layer_idx] = key_caches_out_[layer_idx].get();
-    state_.outputs_[output_index_ + 2 * layer_idx + 1] = value_caches_out_[layer_idx].get();
+  SetStateInputsOutputs();
+}
+
+void WindowedKeyValueCache::ShiftLayerRight(size_t layer_idx, size_t count) {
+  // The input caches are right aligned (newest token last), so dropping tokens moves the older ones right
+  // and fills the freed space on the left with padding, the same state the cache was in before they were added.
+  const auto pad_value = static_cast<uint8_t>(model_.config_->model.decoder.sliding_window->pad_value);
+
+  const size_t key_length = static_cast<size_t>(key_cache_shape_in_[3]);
+  const size_t key_count = std::min(count, key_length);
+  uint8_t* key_cache_data = key_caches_in_[layer_idx]->GetTensorMutableData<uint8_t>();
+  for (int64_t j = 0; j < key_cache_shape_in_[0] * key_cache_shape_in_[2]; ++j) {
+    uint8_t* row = key_cache_data + j * key_length;
+    std::copy_backward(row, row + key_length - key_count, row + key_length);
+    std::fill_n(row, key_count, pad_value);
+  }
+
+  const size_t value_length = static_cast<size_t>(value_cache_shape_in_[2]);
+  const size_t value_count = std::min(count, value_length);
+  const size_t head_size = static_cast<size_t>(value_cache_shape_in_[3]);
+  uint8_t* value_cache_data = value_caches_in_[layer_idx]->GetTensorMutableData<uint8_t>();
+  for (int64_t j = 0; j < value_cache_shape_in_[0]; ++j) {
+    uint8_t* head = value_cache_data + j * value_length * head_size;
+    std::copy_backward(head, head + (value_length - value_count) * head_size, head + value_length * head_size);
+    std::fill_n(head, value_count * head_size, pad_value);
   }
 }
 
+bool IsRewindWithinWindow(size_t index, size_t processed_length, size_t capacity) {
+  return index == 0 || index >= processed_length || processed_length <= capacity;
+}
+
+void WindowedKeyValueCache::CheckRewindTo(size_t index) const {
+  // RewindTo moves the caches into the token generation layout, whose input caches hold context_length - 1 tokens
+  const size_t capacity = static_cast<size_t>(model_.config_->model.context_length - 1);
+  if (!IsRewindWithinWindow(index, processed_length_, capacity))
+    throw std::runtime_error("Cannot rewind the sliding window key-value cache to " + std::to_string(index) + " tokens: " +
+                             std::to_string(processed_length_ - capacity) + " of its " + std::to_string(processed_length_) +
+                             " tokens have slid out of the window. Only rewinding to 0 is supported once that happens.");
+}
+
+void WindowedKeyValueCache::RewindTo(size_t index) {
+  CheckRewindTo(index);
+  if (index == 0) {
+    InitializeCaches(model_.config_->model.decoder.sliding_window->window_size);
+    SetStateInputsOutputs();
+    return;
+  }
+
+  // Move the last window into the token generation layout so the input caches can hold every processed token
+  if (window_size_ != 1)
+    TransitionToWindowSize(1);
+
+  const size_t length = std::min(index, processed_length_);
+  ThreadPool thread_pool{static_cast<size_t>(layer_count_)};
+  thread_pool.Compute([&](size_t layer_idx) {
+    if (layer_lengths_[layer_idx] < processed_length_)
+      SlideLayer(layer_idx);  // The newest token is still in the output cache
+    ShiftLayerRight(layer_idx, layer_lengths_[layer_idx] - length);
+    layer_lengths_[layer_idx] = length;
+  });
+
+  processed_length_ = length;
+  skip_next_slide_ = true;
+}
+
+size_t WindowedKeyValueCache::GetMemoryUsage() const {
+  const size_t inputs_size = slide_in_place_ ? GetTensorsSizeInBytes(key_buffers_in_) + GetTensorsSizeInBytes(value_buffers_in_)
+                                             : GetTensorsSizeInBytes(key_caches_in_) + GetTensorsSizeInBytes(value_caches_in_);
+  return inputs_size + GetTensorsSizeInBytes(key_caches_out_) + GetTensorsSizeInBytes(value_caches_out_);
+}
+
 void WindowedKeyValueCache::PartialTokenGenerationUpdate(DeviceSpan<int32_t> /* beam_indices */, int /* total_length */,
                                                          std::span<const size_t> layer_indices_to_update) {
   assert(window_size_ == 1);
   SlideLayers(layer_indices_to_update);
 }
 
+bool WindowedKeyValueCache::BeginPartialPromptUpdate(int total_length) {
+  if (is_first_update_ || skip_next_slide_)
+    return false;
+  const int next_window_size = window_index_ < window_sizes_.size() ? window_sizes_[window_index_] : 1;
+  if (next_window_size != window_size_)
+    return false;
+
+  processed_length_ = static_cast<size_t>(total_length);
+  window_index_++;
+  return true;
+}
+
+// Only changes the state inputs of the given layers, the pipeline models that read the other layers may be preparing
+void WindowedKeyValueCache::PartialPromptUpdate(std::span<const size_t> layer_indices_to_update) {
+  if (!slide_in_place_) {
+    SlideLayers(layer_indices_to_update);
+    return;
+  }
+
+  ThreadPool thread_pool{layer_indices_to_update.size()};
+  thread_pool.Compute([&](size_t idx) { SlideLayerInPlace(layer_indices_to_update[idx]); });
+  for (size_t layer_idx : layer_indices_to_update)
+    SetLayerInputsOutputs(layer_idx);
+}
+
 }  // namespace Generators
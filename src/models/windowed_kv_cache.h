@@ -21,24 +21,43 @@ struct WindowedKeyValueCache : KeyValueCache {
 
   void PartialTokenGenerationUpdate(DeviceSpan<int32_t> beam_indices, int total_length,
                                     std::span<const size_t> layer_indices_to_update) override;
+  bool BeginPartialPromptUpdate(int total_length) override;
+  void PartialPromptUpdate(std::span<const size_t> layer_indices_to_update) override;
 
-  void RewindTo(size_t index) override {
-    throw std::runtime_error("WindowedKeyValueCache does not support RewindTo.");
-  }
+  // Keeps the first index tokens by shifting the newer ones back out of the window. Rewinding to 0 restarts prompt processing.
+  void RewindTo(size_t index) override;
+  // Throws once tokens have slid out of the window, as the kept tokens would need them back (see IsRewindWithinWindow)
+  void CheckRewindTo(size_t index) const override;
+
+  size_t GetMemoryUsage() const override;
 
  private:
+  void InitializeCaches(int window_size);  // Allocates the pad filled caches used for prompt processing
+  void SetStateInputsOutputs();
+  void SetLayerInputsOutputs(size_t layer_idx);
+
+  // Creates an input cache. When sliding in place it is a view at the start of 'buffer', with slack_bytes of room
+  // after it for the view to move forward into.
+  std::unique_ptr<OrtValue> CreateInputCache(std::span<const int64_t> shape, size_t slack_bytes, std::unique_ptr<OrtValue>& buffer);
+  size_t KeySlackBytes(size_t window_size) const;
+  size_t ValueSlackBytes(size_t window_size) const;
+
   void SlideLayer(size_t layer_idx);
+  void SlideLayerInPlace(size_t layer_idx);  // Moves the input cache views forward in their buffers, see SlideAllLayers
   void SlideAllLayers();
   void SlideLayers(std::span<const size_t> layer_indices);
+  // Moves the last window into caches laid out for the next window size, which is 1 for token generation
+  void TransitionToWindowSize(int updated_window_size);
+  void ShiftLayerRight(size_t layer_idx, size_t count);  // Drops the count newest tokens of the layer's input cache
 
   DeviceInterface& Device() { return *model_.p_device_kvcache_; }
-  Ort::Allocator& Allocator() { return model_.p_device_kvcache_->GetAllocator(); }
+  Ort::Allocator& Allocator() { return model_.GetAllocator(*model_.p_device_kvcache_); }
 
   State& state_;
   const Model& model_{state_.model_};
   int layer_count_{};
   int window_size_{};
-  size_t num_windows_{};
+  std::vector<int> window_sizes_;  // Of the prompt windows
   size_t window_index_{};
   size_t input_index_{~0U}, output_index_{~0U};
 
@@ -48,9 +67,24 @@ struct WindowedKeyValueCache : KeyValueCache {
 
   std::vector<std::unique_ptr<OrtValue>> key_caches_in_, value_caches_in_;
   std::vector<std::unique_ptr<OrtValue>> key_caches_out_, value_caches_out_;
+
+  // CPU caches slide in place: the input caches are views into larger buffers and sliding moves the views forward
+  bool slide_in_place_{};
+  std::vector<std::unique_ptr<OrtValue>> key_buffers_in_, value_buffers_in_;
+  std::vector<size_t> key_offsets_in_, value_offsets_in_;  // Of the views into the buffers, in bytes
+  static constexpr size_t c_slide_slack_tokens = 256;     // Tokens of slack after each view, at least one window
   std::vector<std::string> input_name_strings_, output_name_strings_;
 
   bool is_first_update_{true};
+
+  size_t processed_length_{};          // Number of tokens (including padding) that the model has produced key-values for
+  std::vector<size_t> layer_lengths_;  // Number of those tokens moved into each layer's input cache, the rest is in the output
+  bool skip_next_slide_{};             // Set by RewindTo, the output caches don't hold any new tokens
 };
 
+// True if the input caches, which hold the newest 'capacity' of the processed_length tokens, still hold every token that
+// a rewind to 'index' keeps. Once older tokens have slid out, dropping the newest ones would leave the window with
+// padding where the slid out tokens belong, so only rewinding to 0 (starting over) is possible.
+bool IsRewindWithinWindow(size_t index, size_t processed_length, size_t capacity);
+
 }  // namespace Generators
@@ -228,6 +228,17 @@ typedef NS_ENUM(NSInteger, OGAElementType) {
                   error:(NSError**)error;
 @end
 
+/**
+ * Called on the callback queue of an asynchronous generation with the tokens of the steps since the last call, in step
+ * order with one token per sequence for each step. 'text' is their decoded text when a tokenizer stream was given.
+ */
+typedef void (^OGAGeneratorTokensHandler)(NSArray<NSNumber*>* tokens, NSString* _Nullable text);
+
+/**
+ * Called on the callback queue once an asynchronous generation ended, with the error if it failed.
+ */
+typedef void (^OGAGeneratorCompletionHandler)(NSError* _Nullable error);
+
 /**
  * The main generator interface that can be used for generation loop.
  */
@@ -304,6 +315,34 @@ typedef NS_ENUM(NSInteger, OGAElementType) {
 - (size_t)sequenceCountAtIndex:(size_t)index
                          error:(NSError**)error;
 
+/**
+ * Runs the generation loop on a background queue until the generator is done, maxNewTokens steps have run or
+ * cancelGeneration is called. The tokens are handed to tokensHandler in chunks of chunkSize steps, so the callback
+ * queue (e.g. the main queue) is only dispatched to once per chunk instead of once per token.
+ * The generator must not be used otherwise until completionHandler is called.
+ *
+ * In Swift this can be awaited, and wrapped in an AsyncThrowingStream to iterate over the chunks.
+ *
+ * @param maxNewTokens The maximum number of steps to run.
+ * @param chunkSize The number of steps per call of tokensHandler, the last chunk may be shorter.
+ * @param tokenizerStream Optional, decodes the tokens into the text passed to tokensHandler, for a batch size of 1.
+ * @param callbackQueue The queue tokensHandler and completionHandler are called on, a serial queue keeps the chunks in order.
+ * @param tokensHandler Called with every chunk of tokens.
+ * @param completionHandler Called once the generation ended.
+ */
+- (void)generateWithMaxNewTokens:(size_t)maxNewTokens
+                       chunkSize:(size_t)chunkSize
+                 tokenizerStream:(nullable OGATokenizerStream*)tokenizerStream
+                   callbackQueue:(dispatch_queue_t)callbackQueue
+                   tokensHandler:(OGAGeneratorTokensHandler)tokensHandler
+               completionHandler:(OGAGeneratorCompletionHandler)completionHandler
+    NS_SWIFT_NAME(generate(maxNewTokens:chunkSize:tokenizerStream:callbackQueue:tokensHandler:completionHandler:));
+
+/**
+ * Stops an asynchronous generation after its current step. Its tokens so far are still delivered.
+ */
+- (void)cancelGeneration;
+
 /**
  * Clean up the resource before process exits.
  */
@@ -5,8 +5,13 @@
 #import "oga_internal.h"
 #import "ort_genai_objc.h"
 
+#include <algorithm>
+#include <atomic>
+#include <string>
+
 @implementation OGAGenerator {
   std::unique_ptr<OgaGenerator> _generator;
+  std::atomic<bool> _cancelled;
 }
 
 - (nullable instancetype)initWithModel:(OGAModel*)model
@@ -89,6 +94,67 @@
   OGA_OBJC_API_IMPL_CATCH(error, size_t(-1))
 }
 
+- (void)generateWithMaxNewTokens:(size_t)maxNewTokens
+                       chunkSize:(size_t)chunkSize
+                 tokenizerStream:(nullable OGATokenizerStream*)tokenizerStream
+                   callbackQueue:(dispatch_queue_t)callbackQueue
+                   tokensHandler:(OGAGeneratorTokensHandler)tokensHandler
+               completionHandler:(OGAGeneratorCompletionHandler)completionHandler {
+  _cancelled = false;
+  chunkSize = std::max<size_t>(chunkSize, 1);
+  dispatch_async(dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^{
+    NSError* error = nil;
+    NSMutableArray<NSNumber*>* tokens = [NSMutableArray array];
+    __block std::string text;
+    __block size_t chunkSteps = 0;
+
+    auto deliverChunk = ^{
+      if (tokens.count == 0) {
+        return;
+      }
+      NSArray<NSNumber*>* chunkTokens = [tokens copy];
+      NSString* chunkText = tokenizerStream ? [NSString stringWithUTF8String:text.c_str()] : nil;
+      dispatch_async(callbackQueue, ^{
+        tokensHandler(chunkTokens, chunkText);
+      });
+      [tokens removeAllObjects];
+      text.clear();
+      chunkSteps = 0;
+    };
+
+    try {
+      for (size_t step = 0; step < maxNewTokens && !_cancelled && !_generator->IsDone(); step++) {
+        _generator->GenerateNextToken();
+
+        const int32_t* nextTokens;
+        size_t count;
+        OgaCheckResult(OgaGenerator_GetNextTokens(_generator.get(), &nextTokens, &count));
+        for (size_t i = 0; i < count; i++) {
+          [tokens addObject:@(nextTokens[i])];
+          if (tokenizerStream) {
+            text += [tokenizerStream CXXAPIOgaTokenizerStream].Decode(nextTokens[i]);
+          }
+        }
+
+        if (++chunkSteps == chunkSize) {
+          deliverChunk();
+        }
+      }
+    } catch (const std::exception& e) {
+      OGASaveExceptionToError(e, &error);
+    }
+
+    deliverChunk();
+    dispatch_async(callbackQueue, ^{
+      completionHandler(error);
+    });
+  });
+}
+
+- (void)cancelGeneration {
+  _cancelled = true;
+}
+
 + (void)shutdown {
   OgaShutdown();
 }
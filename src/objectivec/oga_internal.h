@@ -19,6 +19,12 @@ NS_ASSUME_NONNULL_BEGIN
 
 @end
 
+@interface OGATokenizerStream ()
+
+- (OgaTokenizerStream&)CXXAPIOgaTokenizerStream;
+
+@end
+
 @interface OGASequences ()
 
 - (nullable instancetype)initWithError:(NSError**)error;
@@ -41,4 +41,8 @@
   OGA_OBJC_API_IMPL_CATCH_RETURNING_NULLABLE(error)
 }
 
+- (OgaTokenizerStream&)CXXAPIOgaTokenizerStream {
+  return *(_stream.get());
+}
+
 @end
\ No newline at end of file
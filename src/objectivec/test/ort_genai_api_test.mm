@@ -129,6 +129,49 @@ NS_ASSUME_NONNULL_BEGIN
     ORTAssertBoolResultSuccessful(ret, error);
 }
 
+- (void)testGenerateAsync {
+    NSArray<NSNumber*>* input_ids = @[@0, @0, @195, @731];
+    NSArray<NSNumber*>* expected_tokens = @[@731, @114, @114, @114, @114, @114];
+
+    NSError *error = nil;
+    OGAModel* model = [[OGAModel alloc] initWithPath:[ORTGenAIAPITest getModelPath] error:&error];
+    ORTAssertNullableResultSuccessful(model, error);
+
+    OGAGeneratorParams *params = [[OGAGeneratorParams alloc] initWithModel:model error:&error];
+    ORTAssertNullableResultSuccessful(params, error);
+    [params setSearchOption:@"max_length" doubleValue:10 error:&error];
+    XCTAssertNil(error);
+
+    OGAGenerator* generator = [[OGAGenerator alloc] initWithModel:model
+                                                           params:params
+                                                            error:&error];
+    ORTAssertNullableResultSuccessful(generator, error);
+    [generator appendTokens:input_ids error:&error];
+    XCTAssertNil(error);
+
+    // The 6 steps arrive in chunks of 4 and 2 tokens
+    NSMutableArray<NSNumber*>* tokens = [NSMutableArray array];
+    __block size_t chunks = 0;
+    XCTestExpectation* done = [self expectationWithDescription:@"generation completed"];
+    [generator generateWithMaxNewTokens:100
+                              chunkSize:4
+                        tokenizerStream:nil
+                          callbackQueue:dispatch_get_main_queue()
+                          tokensHandler:^(NSArray<NSNumber*>* chunk, NSString* _Nullable text) {
+                              XCTAssertNil(text);
+                              [tokens addObjectsFromArray:chunk];
+                              chunks++;
+                          }
+                      completionHandler:^(NSError* _Nullable generationError) {
+                          XCTAssertNil(generationError);
+                          [done fulfill];
+                      }];
+    [self waitForExpectationsWithTimeout:60 handler:nil];
+
+    XCTAssertEqualObjects(tokens, expected_tokens);
+    XCTAssertEqual(chunks, 2u);
+}
+
 @end
 
 NS_ASSUME_NONNULL_END
@@ -5,6 +5,7 @@
 
 #include <memory>
 #include <stdexcept>
+#include <utility>
 #include <vector>
 
 #if __cplusplus >= 202002L
@@ -100,9 +101,22 @@ struct OgaConfig : OgaAbstract {
     OgaCheckResult(OgaConfigSetProviderOption(this, provider, name, value));
   }
 
+  void Overlay(const char* json) {
+    OgaCheckResult(OgaConfigOverlay(this, json));
+  }
+
   static void operator delete(void* p) { OgaDestroyConfig(reinterpret_cast<OgaConfig*>(p)); }
 };
 
+struct OgaString {
+  OgaString(const char* p) : p_{p} {}
+  ~OgaString() { OgaDestroyString(p_); }
+
+  operator const char*() const { return p_; }
+
+  const char* p_;
+};
+
 struct OgaModel : OgaAbstract {
   static std::unique_ptr<OgaModel> Create(const char* config_path) {
     OgaModel* p;
@@ -120,16 +134,34 @@ struct OgaModel : OgaAbstract {
     return std::unique_ptr<OgaModel>(p);
   }
 
-  static void operator delete(void* p) { OgaDestroyModel(reinterpret_cast<OgaModel*>(p)); }
-};
+  OgaString GetMemoryUsage() const {
+    const char* p;
+    OgaCheckResult(OgaModel_GetMemoryUsage(this, &p));
+    return p;
+  }
 
-struct OgaString {
-  OgaString(const char* p) : p_{p} {}
-  ~OgaString() { OgaDestroyString(p_); }
+  void ReleaseCachedMemory() const {
+    OgaCheckResult(OgaModel_ReleaseCachedMemory(this));
+  }
 
-  operator const char*() const { return p_; }
+  std::unique_ptr<OgaTensor> Embed(const OgaSequences& sequences, const char* pooling = "last_token") const {
+    OgaTensor* out;
+    OgaCheckResult(OgaModel_Embed(this, &sequences, pooling, &out));
+    return std::unique_ptr<OgaTensor>(out);
+  }
 
-  const char* p_;
+  std::unique_ptr<OgaTensor> ScoreSequences(const OgaSequences& prompts, const OgaSequences& continuations) const {
+    OgaTensor* out;
+    OgaCheckResult(OgaModel_ScoreSequences(this, &prompts, &continuations, &out));
+    return std::unique_ptr<OgaTensor>(out);
+  }
+
+  void BatchGenerate(const char* const* prompts, size_t prompt_count, const OgaGeneratorParams& params,
+                     OgaBatchGenerateCallback callback, void* user_data = nullptr) const {
+    OgaCheckResult(OgaBatchGenerate(this, prompts, prompt_count, &params, callback, user_data));
+  }
+
+  static void operator delete(void* p) { OgaDestroyModel(reinterpret_cast<OgaModel*>(p)); }
 };
 
 struct OgaSequences : OgaAbstract {
@@ -185,6 +217,12 @@ struct OgaTokenizer : OgaAbstract {
     OgaCheckResult(OgaTokenizerEncode(this, str, &sequences));
   }
 
+  std::unique_ptr<OgaTensor> EncodeBatch(const char* const* strings, size_t count) const {
+    OgaTensor* out;
+    OgaCheckResult(OgaTokenizerEncodeBatch(this, strings, count, &out));
+    return std::unique_ptr<OgaTensor>(out);
+  }
+
   int32_t ToTokenId(const char* str) const {
     int32_t token_id;
     OgaCheckResult(OgaTokenizerToTokenId(this, str, &token_id));
@@ -205,6 +243,12 @@ struct OgaTokenizer : OgaAbstract {
   }
 #endif
 
+  std::unique_ptr<OgaStringArray> DecodeBatch(OgaTensor& tokens) const {
+    OgaStringArray* out;
+    OgaCheckResult(OgaTokenizerDecodeBatch(this, &tokens, &out));
+    return std::unique_ptr<OgaStringArray>(out);
+  }
+
   static void operator delete(void* p) { OgaDestroyTokenizer(reinterpret_cast<OgaTokenizer*>(p)); }
 };
 
@@ -235,6 +279,73 @@ struct OgaTokenizerStream : OgaAbstract {
   static void operator delete(void* p) { OgaDestroyTokenizerStream(reinterpret_cast<OgaTokenizerStream*>(p)); }
 };
 
+struct OgaBatchTokenizerStream : OgaAbstract {
+  static std::unique_ptr<OgaBatchTokenizerStream> Create(const OgaTokenizer& tokenizer, size_t count) {
+    OgaBatchTokenizerStream* p;
+    OgaCheckResult(OgaCreateBatchTokenizerStream(&tokenizer, count, &p));
+    return std::unique_ptr<OgaBatchTokenizerStream>(p);
+  }
+
+  /*
+   * Decode the next token of every sequence, returns the chunk each token completed (empty if none).
+   * The chunks are valid until the next call to Decode or when the OgaBatchTokenizerStream is destroyed
+   */
+  std::span<const char* const> Decode(std::span<const int32_t> tokens) {
+    const char* const* out;
+    OgaCheckResult(OgaBatchTokenizerStreamDecode(this, tokens.data(), tokens.size(), &out));
+    return {out, tokens.size()};
+  }
+
+  static void operator delete(void* p) { OgaDestroyBatchTokenizerStream(reinterpret_cast<OgaBatchTokenizerStream*>(p)); }
+};
+
+struct OgaWhisperStream : OgaAbstract {
+  static std::unique_ptr<OgaWhisperStream> Create(const OgaModel& model, OgaGeneratorParams& params, const int32_t* prompt_tokens,
+                                                  size_t prompt_token_count, int32_t start_of_previous_token_id = -1,
+                                                  size_t step_frames = 100, size_t window_frames = 3000) {
+    OgaWhisperStream* p;
+    OgaCheckResult(OgaCreateWhisperStream(&model, &params, prompt_tokens, prompt_token_count, start_of_previous_token_id,
+                                          step_frames, window_frames, &p));
+    return std::unique_ptr<OgaWhisperStream>(p);
+  }
+
+  // The 'feature_count' floats of 'features' have the layout [number_of_mels, frame_count]
+  void AddFeatures(const float* features, size_t feature_count, size_t frame_count) {
+    OgaCheckResult(OgaWhisperStreamAddFeatures(this, features, feature_count, frame_count));
+  }
+
+  void Flush() {
+    OgaCheckResult(OgaWhisperStreamFlush(this));
+  }
+
+  void GetNewTokens(OgaSequences& sequences) {
+    OgaCheckResult(OgaWhisperStreamGetNewTokens(this, &sequences));
+  }
+
+  void GetTranscript(OgaSequences& sequences) const {
+    OgaCheckResult(OgaWhisperStreamGetTranscript(this, &sequences));
+  }
+
+  void SetVoiceActivity(float silence_threshold = 1.0f, size_t min_silence_frames = 50, size_t padding_frames = 10) {
+    OgaCheckResult(OgaWhisperStreamSetVoiceActivity(this, silence_threshold, min_silence_frames, padding_frames));
+  }
+
+  size_t GetSegmentCount() const {
+    size_t out;
+    OgaCheckResult(OgaWhisperStreamGetSegmentCount(this, &out));
+    return out;
+  }
+
+  // Returns the frames [begin, end) of the segment and appends its tokens to 'tokens'
+  std::pair<size_t, size_t> GetSegment(size_t index, OgaSequences& tokens) const {
+    size_t begin_frame, end_frame;
+    OgaCheckResult(OgaWhisperStreamGetSegment(this, index, &begin_frame, &end_frame, &tokens));
+    return {begin_frame, end_frame};
+  }
+
+  static void operator delete(void* p) { OgaDestroyWhisperStream(reinterpret_cast<OgaWhisperStream*>(p)); }
+};
+
 struct OgaGeneratorParams : OgaAbstract {
   static std::unique_ptr<OgaGeneratorParams> Create(const OgaModel& model) {
     OgaGeneratorParams* p;
@@ -262,6 +373,44 @@ struct OgaGeneratorParams : OgaAbstract {
     OgaCheckResult(OgaGeneratorParamsTryGraphCaptureWithMaxBatchSize(this, max_batch_size));
   }
 
+  void SetDraftModel(const OgaModel& draft_model, int num_draft_tokens) {
+    OgaCheckResult(OgaGeneratorParamsSetDraftModel(this, &draft_model, num_draft_tokens));
+  }
+
+  void SetBatchSampling(const int32_t* top_k, const float* top_p, const float* temperature, size_t batch_size) {
+    OgaCheckResult(OgaGeneratorParamsSetBatchSampling(this, top_k, top_p, temperature, batch_size));
+  }
+
+#if __cplusplus >= 202002L
+  void SetBatchSampling(std::span<const int32_t> top_k, std::span<const float> top_p, std::span<const float> temperature) {
+    if (top_p.size() != top_k.size() || temperature.size() != top_k.size())
+      throw std::runtime_error("The top_k, top_p and temperature arrays must have the same size");
+    SetBatchSampling(top_k.data(), top_p.data(), temperature.data(), top_k.size());
+  }
+#endif
+
+  void SetBatchAdapters(const char* const* adapter_names, size_t batch_size) {
+    OgaCheckResult(OgaGeneratorParamsSetBatchAdapters(this, adapter_names, batch_size));
+  }
+
+  void SetGuidance(const char* type, const char* data) {
+    OgaCheckResult(OgaGeneratorParamsSetGuidance(this, type, data));
+  }
+
+  void AddStopTokenSequence(const int32_t* tokens, size_t count) {
+    OgaCheckResult(OgaGeneratorParamsAddStopTokenSequence(this, tokens, count));
+  }
+
+  void AddStopString(const char* text) {
+    OgaCheckResult(OgaGeneratorParamsAddStopString(this, text));
+  }
+
+#if __cplusplus >= 202002L
+  void SetBatchAdapters(std::span<const char* const> adapter_names) {
+    SetBatchAdapters(adapter_names.data(), adapter_names.size());
+  }
+#endif
+
   static void operator delete(void* p) { OgaDestroyGeneratorParams(reinterpret_cast<OgaGeneratorParams*>(p)); }
 };
 
@@ -276,6 +425,10 @@ struct OgaGenerator : OgaAbstract {
     return OgaGenerator_IsDone(this);
   }
 
+  bool IsDoneReady() const {
+    return OgaGenerator_IsDoneReady(this);
+  }
+
   void AppendTokenSequences(const OgaSequences& sequences) {
     OgaCheckResult(OgaGenerator_AppendTokenSequences(this, &sequences));
   }
@@ -292,10 +445,62 @@ struct OgaGenerator : OgaAbstract {
     OgaCheckResult(OgaGenerator_GenerateNextToken(this));
   }
 
+  // Returns the number of steps run, out_tokens holds max_new_tokens * batch_size tokens
+  size_t GenerateTokens(size_t max_new_tokens, int32_t* out_tokens, size_t callback_interval = 0,
+                        OgaGenerateTokensCallback callback = nullptr, void* user_data = nullptr) {
+    size_t count;
+    OgaCheckResult(OgaGenerator_GenerateTokens(this, max_new_tokens, out_tokens, &count, callback_interval, callback, user_data));
+    return count;
+  }
+
   void RewindTo(size_t new_length) {
     OgaCheckResult(OgaGenerator_RewindTo(this, new_length));
   }
 
+  void SetTokens(const int32_t* tokens, size_t token_count) {
+    OgaCheckResult(OgaGenerator_SetTokens(this, tokens, token_count));
+  }
+
+  std::unique_ptr<OgaGenerator> Fork() {
+    OgaGenerator* p;
+    OgaCheckResult(OgaGenerator_Fork(this, &p));
+    return std::unique_ptr<OgaGenerator>(p);
+  }
+
+  void SaveState(const char* path) {
+    OgaCheckResult(OgaGenerator_SaveState(this, path));
+  }
+
+  void LoadState(const char* path) {
+    OgaCheckResult(OgaGenerator_LoadState(this, path));
+  }
+
+  std::unique_ptr<OgaTensor> SaveStateToBuffer(bool quantize_kv_cache = false) {
+    OgaTensor* out;
+    OgaCheckResult(OgaGenerator_SaveStateToBuffer(this, quantize_kv_cache, &out));
+    return std::unique_ptr<OgaTensor>(out);
+  }
+
+  void LoadStateFromBuffer(const uint8_t* data, size_t size) {
+    OgaCheckResult(OgaGenerator_LoadStateFromBuffer(this, data, size));
+  }
+
+  void AppendState(const char* path) {
+    OgaCheckResult(OgaGenerator_AppendState(this, path));
+  }
+
+  void AppendStateFromBuffer(const uint8_t* data, size_t size) {
+    OgaCheckResult(OgaGenerator_AppendStateFromBuffer(this, data, size));
+  }
+
+  void OffloadKeyValueCache(const char* path = nullptr) {
+    OgaCheckResult(OgaGenerator_OffloadKeyValueCache(this, path));
+  }
+
+  void RestoreKeyValueCache() {
+    OgaCheckResult(OgaGenerator_RestoreKeyValueCache(this));
+  }
+
   void SetRuntimeOption(const char* key, const char* value) {
     OgaCheckResult(OgaGenerator_SetRuntimeOption(this, key, value));
   }
@@ -324,16 +529,63 @@ struct OgaGenerator : OgaAbstract {
     OgaCheckResult(OgaGenerator_SetLogits(this, &tensor));
   }
 
+  void SetLogitsBias(const int32_t* tokens, const float* biases, size_t count) {
+    OgaCheckResult(OgaGenerator_SetLogitsBias(this, tokens, biases, count));
+  }
+
+  void SetAllowedTokens(const int32_t* tokens, size_t count) {
+    OgaCheckResult(OgaGenerator_SetAllowedTokens(this, tokens, count));
+  }
+
 #if __cplusplus >= 202002L
   std::span<const int32_t> GetSequence(size_t index) const {
     return {GetSequenceData(index), GetSequenceCount(index)};
   }
+
+  std::span<const int32_t> GetNextTokens() {
+    const int32_t* tokens;
+    size_t count;
+    OgaCheckResult(OgaGenerator_GetNextTokens(this, &tokens, &count));
+    return {tokens, count};
+  }
+
+  // Both spans have the shape [batch_size * num_beams, top_logprobs]
+  std::pair<std::span<const int32_t>, std::span<const float>> GetTopLogProbs() {
+    const int32_t* tokens;
+    const float* logprobs;
+    size_t count;
+    OgaCheckResult(OgaGenerator_GetTopLogProbs(this, &tokens, &logprobs, &count));
+    return {{tokens, count}, {logprobs, count}};
+  }
+
+  std::span<const float> GetLogitsData() {
+    const float* logits;
+    size_t count;
+    OgaCheckResult(OgaGenerator_GetLogitsData(this, &logits, &count));
+    return {logits, count};
+  }
 #endif
 
   void SetActiveAdapter(OgaAdapters& adapters, const char* adapter_name) {
     OgaCheckResult(OgaSetActiveAdapter(this, &adapters, adapter_name));
   }
 
+  OgaString GetMetrics() const {
+    const char* p;
+    OgaCheckResult(OgaGenerator_GetMetrics(this, &p));
+    return p;
+  }
+
+  void ResetMetrics() {
+    OgaCheckResult(OgaGenerator_ResetMetrics(this));
+  }
+
+  OgaString GetMemoryUsage() const {
+    const char* p;
+    OgaCheckResult(OgaGenerator_GetMemoryUsage(this, &p));
+    return p;
+  }
+
   static void operator delete(void* p) { OgaDestroyGenerator(reinterpret_cast<OgaGenerator*>(p)); }
 };
 
@@ -350,6 +602,11 @@ struct OgaTensor : OgaAbstract {
     OgaCheckResult(OgaCreateTensorFromBuffer(data, shape_dims, shape_dims_count, element_type, &p));
     return std::unique_ptr<OgaTensor>(p);
   }
+  static std::unique_ptr<OgaTensor> Create(void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type, const char* device_type, int device_id = 0) {
+    OgaTensor* p;
+    OgaCheckResult(OgaCreateTensorFromDeviceBuffer(data, shape_dims, shape_dims_count, element_type, device_type, device_id, &p));
+    return std::unique_ptr<OgaTensor>(p);
+  }
 
   OgaElementType Type() {
     OgaElementType type;
@@ -374,6 +631,30 @@ struct OgaTensor : OgaAbstract {
   static void operator delete(void* p) { OgaDestroyTensor(reinterpret_cast<OgaTensor*>(p)); }
 };
 
+struct OgaStringArray : OgaAbstract {
+  static std::unique_ptr<OgaStringArray> Create() {
+    OgaStringArray* p;
+    OgaCheckResult(OgaCreateStringArray(&p));
+    return std::unique_ptr<OgaStringArray>(p);
+  }
+
+  void Add(const char* str) {
+    OgaCheckResult(OgaStringArrayAddString(this, str));
+  }
+
+  size_t Count() const {
+    return OgaStringArrayGetCount(this);
+  }
+
+  const char* Get(size_t index) const {
+    const char* out;
+    OgaCheckResult(OgaStringArrayGetString(this, index, &out));
+    return out;
+  }
+
+  static void operator delete(void* p) { OgaDestroyStringArray(reinterpret_cast<OgaStringArray*>(p)); }
+};
+
 struct OgaImages : OgaAbstract {
   static std::unique_ptr<OgaImages> Load(const std::vector<const char*>& image_paths) {
     OgaImages* p;
@@ -478,9 +759,107 @@ struct OgaAdapters : OgaAbstract {
     OgaCheckResult(OgaUnloadAdapter(this, adapter_name));
   }
 
+  void PrefetchAdapter(const char* adapter_name) {
+    OgaCheckResult(OgaPrefetchAdapter(this, adapter_name));
+  }
+
+  bool IsAdapterReady(const char* adapter_name) const {
+    bool out;
+    OgaCheckResult(OgaIsAdapterReady(this, adapter_name, &out));
+    return out;
+  }
+
+  void SetMemoryLimit(size_t bytes) {
+    OgaCheckResult(OgaSetAdaptersMemoryLimit(this, bytes));
+  }
+
+  size_t GetMemoryUsage() const {
+    size_t out;
+    OgaCheckResult(OgaAdaptersGetMemoryUsage(this, &out));
+    return out;
+  }
+
   static void operator delete(void* p) { OgaDestroyAdapters(reinterpret_cast<OgaAdapters*>(p)); }
 };
 
+struct OgaRequest : OgaAbstract {
+  static std::unique_ptr<OgaRequest> Create(const OgaGeneratorParams& params) {
+    OgaRequest* p;
+    OgaCheckResult(OgaCreateRequest(&params, &p));
+    return std::unique_ptr<OgaRequest>(p);
+  }
+
+  void SetPriority(OgaRequestPriority priority) {
+    OgaCheckResult(OgaRequest_SetPriority(this, priority));
+  }
+
+  void AddTokens(const int32_t* tokens, size_t token_count) {
+    OgaCheckResult(OgaRequest_AddTokens(this, tokens, token_count));
+  }
+
+  bool IsDone() const {
+    return OgaRequest_IsDone(this);
+  }
+
+  void Cancel() {
+    OgaCheckResult(OgaRequest_Cancel(this));
+  }
+
+  std::unique_ptr<OgaSequences> GetUnseenTokens() {
+    OgaSequences* p;
+    OgaCheckResult(OgaRequest_GetUnseenTokens(this, &p));
+    return std::unique_ptr<OgaSequences>(p);
+  }
+
+  static void operator delete(void* p) { OgaDestroyRequest(reinterpret_cast<OgaRequest*>(p)); }
+};
+
+struct OgaEngine : OgaAbstract {
+  static std::unique_ptr<OgaEngine> Create(const OgaModel& model, int max_active_requests) {
+    OgaEngine* p;
+    OgaCheckResult(OgaCreateEngine(&model, max_active_requests, &p));
+    return std::unique_ptr<OgaEngine>(p);
+  }
+
+  void AddRequest(OgaRequest& request) {
+    OgaCheckResult(OgaEngine_AddRequest(this, &request));
+  }
+
+  void Step() {
+    OgaCheckResult(OgaEngine_Step(this));
+  }
+
+  bool HasPendingRequests() const {
+    return OgaEngine_HasPendingRequests(this);
+  }
+
+  size_t GetActiveRequestCount() const {
+    return OgaEngine_GetActiveRequestCount(this);
+  }
+
+  size_t GetQueuedRequestCount() const {
+    return OgaEngine_GetQueuedRequestCount(this);
+  }
+
+  void SetTokenBudget(size_t tokens) {
+    OgaCheckResult(OgaEngine_SetTokenBudget(this, tokens));
+  }
+
+  void SetStepTokenBudget(size_t tokens) {
+    OgaCheckResult(OgaEngine_SetStepTokenBudget(this, tokens));
+  }
+
+  void SetKeyValueCacheBudget(size_t bytes) {
+    OgaCheckResult(OgaEngine_SetKeyValueCacheBudget(this, bytes));
+  }
+
+  void SetPreemptionMode(OgaPreemptionMode mode) {
+    OgaCheckResult(OgaEngine_SetPreemptionMode(this, mode));
+  }
+
+  static void operator delete(void* p) { OgaDestroyEngine(reinterpret_cast<OgaEngine*>(p)); }
+};
+
 struct OgaHandle {
   OgaHandle() = default;
   ~OgaHandle() noexcept {
@@ -499,6 +878,10 @@ inline void SetLogString(const char* name, const char* value) {
   OgaCheckResult(OgaSetLogString(name, value));
 }
 
+inline void SetMetricsSink(OgaMetricsSink sink, void* user_data) {
+  OgaCheckResult(OgaSetMetricsSink(sink, user_data));
+}
+
 inline void SetCurrentGpuDeviceId(int device_id) {
   OgaCheckResult(OgaSetCurrentGpuDeviceId(device_id));
 }
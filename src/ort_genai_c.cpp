@@ -8,9 +8,11 @@
 #include "ort_genai_c.h"
 #include "generators.h"
 #include "models/model.h"
+#include "engine.h"
 #include "runtime_settings.h"
 #include "search.h"
 #include "smartptrs.h"
+#include "whisper_stream.h"
 
 namespace Generators {
 
@@ -53,6 +55,20 @@ OgaResult* OGA_API_CALL OgaSetLogString(const char* name, const char* value) {
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaSetMetricsSink(OgaMetricsSink sink, void* user_data) {
+  OGA_TRY
+  static_assert(static_cast<int>(Generators::MetricType::Histogram) == OgaMetricType_Histogram);
+  if (!sink) {
+    Generators::Metrics::SetSink({});
+    return nullptr;
+  }
+  Generators::Metrics::SetSink([sink, user_data](const char* name, Generators::MetricType type, double value) {
+    sink(name, static_cast<OgaMetricType>(type), value, user_data);
+  });
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaCreateSequences(OgaSequences** out) {
   OGA_TRY
   *out = reinterpret_cast<OgaSequences*>(std::make_unique<Generators::TokenSequences>().release());
@@ -152,9 +168,45 @@ OgaResult* OGA_API_CALL OgaCreateModelWithRuntimeSettings(const char* config_pat
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaCreateModelAsync(const char* config_path, const OgaRuntimeSettings* settings,
+                                            OgaCreateModelProgressCallback progress,
+                                            OgaCreateModelCompletionCallback completion, void* user_data) {
+  OGA_TRY
+  if (!completion)
+    throw std::runtime_error("OgaCreateModelAsync requires a completion callback");
+  std::string config_overlay;
+  if (settings)
+    config_overlay = reinterpret_cast<const Generators::RuntimeSettings*>(settings)->GenerateConfigOverlay();
+  auto config = Generators::LoadConfig(fs::path(config_path), config_overlay);
+
+  std::thread{[config = std::move(config), progress, completion, user_data]() mutable {
+    std::mutex progress_mutex;
+    const Generators::ModelLoadProgress on_progress = [&](std::string_view step) {
+      if (!progress)
+        return;
+      const std::string step_string{step};
+      std::scoped_lock lock{progress_mutex};
+      progress(step_string.c_str(), user_data);
+    };
+
+    OgaResult* result{};
+    OgaModel* out{};
+    try {
+      auto model = Generators::CreateModel(Generators::GetOrtEnv(), std::move(config), &on_progress);
+      model->external_owner_ = model;
+      out = reinterpret_cast<OgaModel*>(model.get());
+    } catch (const std::exception& e) {
+      result = reinterpret_cast<OgaResult*>(std::make_unique<Generators::Result>(e.what()).release());
+    }
+    completion(result, out, user_data);
+  }}.detach();
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaCreateConfig(const char* config_path, OgaConfig** out) {
   OGA_TRY
-  *out = reinterpret_cast<OgaConfig*>(std::make_unique<Generators::Config>(fs::path(config_path), std::string_view{}).release());
+  *out = reinterpret_cast<OgaConfig*>(Generators::LoadConfig(fs::path(config_path), std::string_view{}).release());
   return nullptr;
   OGA_CATCH
 }
@@ -180,6 +232,13 @@ OgaResult* OGA_API_CALL OgaConfigSetProviderOption(OgaConfig* config, const char
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaConfigOverlay(OgaConfig* config, const char* json) {
+  OGA_TRY
+  Generators::OverlayConfig(*reinterpret_cast<Generators::Config*>(config), json);
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaCreateModelFromConfig(const OgaConfig* config, OgaModel** out) {
   OGA_TRY
   auto config_copy = std::make_unique<Generators::Config>(*reinterpret_cast<const Generators::Config*>(config));
@@ -194,6 +253,59 @@ OgaResult* OGA_API_CALL OgaCreateModel(const char* config_path, OgaModel** out)
   return OgaCreateModelWithRuntimeSettings(config_path, nullptr, out);
 }
 
+OgaResult* OGA_API_CALL OgaModel_GetMemoryUsage(const OgaModel* oga_model, const char** out) {
+  OGA_TRY
+  auto json = reinterpret_cast<const Generators::Model*>(oga_model)->GetMemoryUsage();
+  auto cstr_buffer = std::make_unique<char[]>(json.length() + 1);
+  memcpy(cstr_buffer.get(), json.c_str(), json.length() + 1);
+  *out = cstr_buffer.release();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModel_ReleaseCachedMemory(const OgaModel* oga_model) {
+  OGA_TRY
+  reinterpret_cast<const Generators::Model*>(oga_model)->ReleaseCachedMemory();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModel_Embed(const OgaModel* oga_model, const OgaSequences* sequences, const char* pooling, OgaTensor** out) {
+  OGA_TRY
+  auto& token_sequences = *reinterpret_cast<const Generators::TokenSequences*>(sequences);
+  auto tensor = std::make_shared<Generators::Tensor>(reinterpret_cast<const Generators::Model*>(oga_model)->Embed(token_sequences, pooling));
+  tensor->external_owner_ = tensor;
+  *out = reinterpret_cast<OgaTensor*>(tensor.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModel_ScoreSequences(const OgaModel* oga_model, const OgaSequences* prompts, const OgaSequences* continuations, OgaTensor** out) {
+  OGA_TRY
+  auto& prompt_sequences = *reinterpret_cast<const Generators::TokenSequences*>(prompts);
+  auto& continuation_sequences = *reinterpret_cast<const Generators::TokenSequences*>(continuations);
+  auto tensor = std::make_shared<Generators::Tensor>(reinterpret_cast<const Generators::Model*>(oga_model)->ScoreSequences(prompt_sequences, continuation_sequences));
+  tensor->external_owner_ = tensor;
+  *out = reinterpret_cast<OgaTensor*>(tensor.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaBatchGenerate(const OgaModel* oga_model, const char* const* prompts, size_t prompt_count,
+                                         const OgaGeneratorParams* params, OgaBatchGenerateCallback callback, void* user_data) {
+  OGA_TRY
+  auto& model = *reinterpret_cast<const Generators::Model*>(oga_model);
+  std::vector<std::string> prompt_strings(prompts, prompts + prompt_count);
+  auto tokenizer = model.CreateTokenizer();
+  Generators::BatchGenerate(model, prompt_strings, *reinterpret_cast<const Generators::GeneratorParams*>(params),
+                            [&](size_t index, std::span<const int32_t> tokens) {
+                              auto text = tokenizer->Decode(tokens);
+                              callback(index, tokens.data(), tokens.size(), text.c_str(), user_data);
+                            });
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaCreateGeneratorParams(const OgaModel* model, OgaGeneratorParams** out) {
   OGA_TRY
   auto params = std::make_shared<Generators::GeneratorParams>(*reinterpret_cast<const Generators::Model*>(model));
@@ -244,6 +356,58 @@ OgaResult* OGA_API_CALL OgaGeneratorParamsSetInputs(OgaGeneratorParams* oga_para
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetDraftModel(OgaGeneratorParams* oga_params, const OgaModel* draft_model, int32_t num_draft_tokens) {
+  OGA_TRY
+  auto& params = *reinterpret_cast<Generators::GeneratorParams*>(oga_params);
+  params.SetDraftModel(*reinterpret_cast<const Generators::Model*>(draft_model), num_draft_tokens);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetBatchSampling(OgaGeneratorParams* oga_params, const int32_t* top_k, const float* top_p, const float* temperature, size_t batch_size) {
+  OGA_TRY
+  auto& params = *reinterpret_cast<Generators::GeneratorParams*>(oga_params);
+  params.SetBatchSampling({top_k, batch_size}, {top_p, batch_size}, {temperature, batch_size});
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetBatchAdapters(OgaGeneratorParams* oga_params, const char* const* adapter_names, size_t batch_size) {
+  OGA_TRY
+  auto& params = *reinterpret_cast<Generators::GeneratorParams*>(oga_params);
+  std::vector<std::string> names;
+  for (size_t i = 0; i < batch_size; i++)
+    names.emplace_back(adapter_names[i] ? adapter_names[i] : "");
+  params.SetBatchAdapters(names);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetGuidance(OgaGeneratorParams* oga_params, const char* type, const char* data) {
+  OGA_TRY
+  reinterpret_cast<Generators::GeneratorParams*>(oga_params)->SetGuidance(type, data ? data : "");
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsAddStopTokenSequence(OgaGeneratorParams* oga_params, const int32_t* tokens, size_t count) {
+  OGA_TRY
+  if (count == 0)
+    throw std::runtime_error("A stop token sequence needs at least one token");
+  reinterpret_cast<Generators::GeneratorParams*>(oga_params)->search.stop_token_sequences.emplace_back(tokens, tokens + count);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsAddStopString(OgaGeneratorParams* oga_params, const char* text) {
+  OGA_TRY
+  if (!text || !*text)
+    throw std::runtime_error("A stop string cannot be empty");
+  reinterpret_cast<Generators::GeneratorParams*>(oga_params)->search.stop_strings.emplace_back(text);
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaGeneratorParamsSetModelInput(OgaGeneratorParams* oga_params, const char* name, OgaTensor* tensor) {
   OGA_TRY
   auto& params = *reinterpret_cast<Generators::GeneratorParams*>(oga_params);
@@ -272,6 +436,10 @@ bool OGA_API_CALL OgaGenerator_IsDone(const OgaGenerator* generator) {
   return reinterpret_cast<const Generators::Generator*>(generator)->IsDone();
 }
 
+bool OGA_API_CALL OgaGenerator_IsDoneReady(const OgaGenerator* generator) {
+  return reinterpret_cast<const Generators::Generator*>(generator)->IsDoneReady();
+}
+
 bool OGA_API_CALL OgaGenerator_IsSessionTerminated(const OgaGenerator* generator) {
   return reinterpret_cast<const Generators::Generator*>(generator)->IsSessionTerminated();
 }
@@ -312,6 +480,19 @@ OgaResult* OGA_API_CALL OgaGenerator_GenerateNextToken(OgaGenerator* generator)
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaGenerator_GenerateTokens(OgaGenerator* oga_generator, size_t max_new_tokens, int32_t* out_tokens, size_t* out_count,
+                                                    size_t callback_interval, OgaGenerateTokensCallback callback, void* user_data) {
+  OGA_TRY
+  auto& generator = *reinterpret_cast<Generators::Generator*>(oga_generator);
+  std::span<int32_t> tokens{out_tokens, max_new_tokens * generator.search_->params_->search.batch_size};
+  std::function<bool(std::span<const int32_t>)> on_tokens;
+  if (callback)
+    on_tokens = [&](std::span<const int32_t> new_tokens) { return callback(new_tokens.data(), new_tokens.size(), user_data); };
+  *out_count = generator.GenerateTokens(max_new_tokens, tokens, callback_interval, on_tokens);
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaGenerator_RewindTo(OgaGenerator* generator, size_t new_length) {
   OGA_TRY
   reinterpret_cast<Generators::Generator*>(generator)->RewindToLength(new_length);
@@ -319,6 +500,109 @@ OgaResult* OGA_API_CALL OgaGenerator_RewindTo(OgaGenerator* generator, size_t ne
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaGenerator_SetTokens(OgaGenerator* generator, const int32_t* tokens, size_t token_count) {
+  OGA_TRY
+  reinterpret_cast<Generators::Generator*>(generator)->SetTokens(Generators::cpu_span<const int32_t>(tokens, token_count));
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_Fork(OgaGenerator* generator, OgaGenerator** out) {
+  OGA_TRY
+  *out = reinterpret_cast<OgaGenerator*>(reinterpret_cast<Generators::Generator*>(generator)->Fork().release());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_SaveState(OgaGenerator* generator, const char* path) {
+  OGA_TRY
+  auto state = reinterpret_cast<Generators::Generator*>(generator)->SaveState();
+  auto file = fs::path(path).open_for_write(std::ios::binary);
+  if (!file.is_open())
+    throw std::runtime_error(std::string{"Error opening "} + path + " to save the generator state");
+  file.write(reinterpret_cast<const char*>(state.data()), static_cast<std::streamsize>(state.size()));
+  if (!file)
+    throw std::runtime_error(std::string{"Error writing the generator state to "} + path);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_LoadState(OgaGenerator* generator, const char* path) {
+  OGA_TRY
+  auto file = fs::path(path).open(std::ios::binary);
+  if (!file.is_open())
+    throw std::runtime_error(std::string{"Error opening "} + path + " to load the generator state");
+  std::vector<uint8_t> state{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+  reinterpret_cast<Generators::Generator*>(generator)->LoadState(state);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_SaveStateToBuffer(OgaGenerator* generator, bool quantize_kv_cache, OgaTensor** out) {
+  OGA_TRY
+  auto state = reinterpret_cast<Generators::Generator*>(generator)->SaveState(quantize_kv_cache);
+  auto value = OrtValue::CreateTensor<uint8_t>(Ort::Allocator::GetWithDefaultOptions(), std::array<int64_t, 1>{static_cast<int64_t>(state.size())});
+  std::copy(state.begin(), state.end(), value->GetTensorMutableData<uint8_t>());
+  auto tensor = std::make_shared<Generators::Tensor>(std::move(value));
+  tensor->external_owner_ = tensor;
+  *out = reinterpret_cast<OgaTensor*>(tensor.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_LoadStateFromBuffer(OgaGenerator* generator, const uint8_t* data, size_t size) {
+  OGA_TRY
+  reinterpret_cast<Generators::Generator*>(generator)->LoadState(std::span<const uint8_t>{data, size});
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_AppendState(OgaGenerator* generator, const char* path) {
+  OGA_TRY
+  Generators::MappedFile file{fs::path(path)};
+  reinterpret_cast<Generators::Generator*>(generator)->AppendState(std::span<const uint8_t>{reinterpret_cast<const uint8_t*>(file.data_.data()), file.data_.size()});
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_AppendStateFromBuffer(OgaGenerator* generator, const uint8_t* data, size_t size) {
+  OGA_TRY
+  reinterpret_cast<Generators::Generator*>(generator)->AppendState(std::span<const uint8_t>{data, size});
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_OffloadKeyValueCache(OgaGenerator* generator, const char* path) {
+  OGA_TRY
+  reinterpret_cast<Generators::Generator*>(generator)->OffloadKeyValueCache(path);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_RestoreKeyValueCache(OgaGenerator* generator) {
+  OGA_TRY
+  reinterpret_cast<Generators::Generator*>(generator)->RestoreKeyValueCache();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_SetLogitsBias(OgaGenerator* generator, const int32_t* tokens, const float* biases, size_t count) {
+  OGA_TRY
+  std::vector<std::pair<int32_t, float>> logit_bias(count);
+  for (size_t i = 0; i < count; i++)
+    logit_bias[i] = {tokens[i], biases[i]};
+  reinterpret_cast<Generators::Generator*>(generator)->SetLogitsBias(logit_bias);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_SetAllowedTokens(OgaGenerator* generator, const int32_t* tokens, size_t count) {
+  OGA_TRY
+  reinterpret_cast<Generators::Generator*>(generator)->SetAllowedTokens({tokens, count});
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaGenerator_SetRuntimeOption(OgaGenerator* generator, const char* key, const char* value) {
   OGA_TRY
   reinterpret_cast<Generators::Generator*>(generator)->SetRuntimeOption(key, value);
@@ -364,6 +648,15 @@ OgaResult* OGA_API_CALL OgaGenerator_GetLogits(OgaGenerator* oga_generator, OgaT
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaGenerator_GetLogitsData(OgaGenerator* oga_generator, const float** out, size_t* out_count) {
+  OGA_TRY
+  std::span<const float> logits = reinterpret_cast<Generators::Generator*>(oga_generator)->GetLogits().CopyDeviceToCpu();
+  *out = logits.data();
+  *out_count = logits.size();
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaGenerator_SetLogits(OgaGenerator* oga_generator, OgaTensor* tensor) {
   OGA_TRY
   auto generator = reinterpret_cast<Generators::Generator*>(oga_generator);
@@ -395,6 +688,54 @@ const int32_t* OGA_API_CALL OgaGenerator_GetSequenceData(const OgaGenerator* oga
   return generator.GetSequence(static_cast<int>(index)).CopyDeviceToCpu().data();
 }
 
+OgaResult* OGA_API_CALL OgaGenerator_GetNextTokens(OgaGenerator* oga_generator, const int32_t** out, size_t* out_count) {
+  OGA_TRY
+  auto tokens = reinterpret_cast<Generators::Generator*>(oga_generator)->GetNextTokens();
+  *out = tokens.data();
+  *out_count = tokens.size();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_GetTopLogProbs(OgaGenerator* oga_generator, const int32_t** tokens, const float** logprobs, size_t* out_count) {
+  OGA_TRY
+  auto generator = reinterpret_cast<Generators::Generator*>(oga_generator);
+  auto top_tokens = generator->GetTopLogProbTokens();
+  auto top_logprobs = generator->GetTopLogProbs();
+  *tokens = top_tokens.data();
+  *logprobs = top_logprobs.data();
+  *out_count = top_tokens.size();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_GetMetrics(const OgaGenerator* oga_generator, const char** out) {
+  OGA_TRY
+  auto json = reinterpret_cast<const Generators::Generator*>(oga_generator)->metrics_.ToJson();
+  auto cstr_buffer = std::make_unique<char[]>(json.length() + 1);
+  memcpy(cstr_buffer.get(), json.c_str(), json.length() + 1);
+  *out = cstr_buffer.release();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_GetMemoryUsage(const OgaGenerator* oga_generator, const char** out) {
+  OGA_TRY
+  auto json = reinterpret_cast<const Generators::Generator*>(oga_generator)->GetMemoryUsage();
+  auto cstr_buffer = std::make_unique<char[]>(json.length() + 1);
+  memcpy(cstr_buffer.get(), json.c_str(), json.length() + 1);
+  *out = cstr_buffer.release();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_ResetMetrics(OgaGenerator* oga_generator) {
+  OGA_TRY
+  reinterpret_cast<Generators::Generator*>(oga_generator)->metrics_ = {};
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaCreateTokenizer(const OgaModel* model, OgaTokenizer** out) {
   OGA_TRY
   auto tokenizer = reinterpret_cast<const Generators::Model*>(model)->CreateTokenizer();
@@ -413,6 +754,24 @@ OgaResult* OGA_API_CALL OgaTokenizerEncode(const OgaTokenizer* p, const char* st
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaTokenizerEncodeBatch(const OgaTokenizer* p, const char* const* strings, size_t count, OgaTensor** out) {
+  OGA_TRY
+  auto& tokenizer = *reinterpret_cast<const Generators::Tokenizer*>(p);
+  if (count == 0)
+    throw std::runtime_error("OgaTokenizerEncodeBatch: count must be greater than zero");
+
+  std::vector<std::string> batch(strings, strings + count);
+  auto tokens = tokenizer.EncodeBatch(batch);
+  const auto max_length = static_cast<int64_t>(tokens.size() / count);
+
+  auto tensor = std::make_shared<Generators::Tensor>(OrtValue::CreateTensor<int32_t>(Ort::Allocator::GetWithDefaultOptions(), std::array<int64_t, 2>{static_cast<int64_t>(count), max_length}));
+  std::copy(tokens.begin(), tokens.end(), tensor->ort_tensor_->GetTensorMutableData<int32_t>());
+  tensor->external_owner_ = tensor;
+  *out = reinterpret_cast<OgaTensor*>(tensor.get());
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaTokenizerToTokenId(const OgaTokenizer* p, const char* str, int32_t* token_id) {
   OGA_TRY
   auto& tokenizer = *reinterpret_cast<const Generators::Tokenizer*>(p);
@@ -434,6 +793,27 @@ OgaResult* OGA_API_CALL OgaTokenizerDecode(const OgaTokenizer* p, const int32_t*
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaTokenizerDecodeBatch(const OgaTokenizer* p, OgaTensor* tokens, OgaStringArray** out) {
+  OGA_TRY
+  auto& tokenizer = *reinterpret_cast<const Generators::Tokenizer*>(p);
+  auto& ort_tensor = *reinterpret_cast<Generators::Tensor*>(tokens)->ort_tensor_;
+
+  auto type_info = ort_tensor.GetTensorTypeAndShapeInfo();
+  if (type_info->GetElementType() != Ort::TypeToTensorType<int32_t>)
+    throw std::runtime_error("OgaTokenizerDecodeBatch: tokens must be an int32 tensor");
+  auto shape = type_info->GetShape();
+  if (shape.size() != 1 && shape.size() != 2)
+    throw std::runtime_error("OgaTokenizerDecodeBatch: tokens must be of shape [count, sequence_length] or [sequence_length]");
+  const size_t count = shape.size() == 2 ? static_cast<size_t>(shape[0]) : 1;
+
+  auto strings = std::make_unique<std::vector<std::string>>();
+  if (count != 0)
+    *strings = tokenizer.DecodeBatch({ort_tensor.GetTensorData<int32_t>(), type_info->GetElementCount()}, count);
+  *out = reinterpret_cast<OgaStringArray*>(strings.release());
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaProcessorDecode(const OgaMultiModalProcessor* p, const int32_t* tokens, size_t token_count, const char** out_string) {
   OGA_TRY
   auto& processor = *reinterpret_cast<const Generators::MultiModalProcessor*>(p);
@@ -472,6 +852,90 @@ OgaResult* OGA_API_CALL OgaTokenizerStreamDecode(OgaTokenizerStream* p, int32_t
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaCreateBatchTokenizerStream(const OgaTokenizer* p, size_t count, OgaBatchTokenizerStream** out) {
+  OGA_TRY
+  *out = reinterpret_cast<OgaBatchTokenizerStream*>(new Generators::BatchTokenizerStream(*reinterpret_cast<const Generators::Tokenizer*>(p), count));
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaBatchTokenizerStreamDecode(OgaBatchTokenizerStream* p, const int32_t* tokens, size_t token_count, const char* const** out) {
+  OGA_TRY
+  *out = reinterpret_cast<Generators::BatchTokenizerStream*>(p)->Decode({tokens, token_count}).data();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaCreateWhisperStream(const OgaModel* model, OgaGeneratorParams* params, const int32_t* prompt_tokens,
+                                               size_t prompt_token_count, int32_t start_of_previous_token_id, size_t step_frames,
+                                               size_t window_frames, OgaWhisperStream** out) {
+  OGA_TRY
+  auto stream = std::make_shared<Generators::WhisperStream>(*reinterpret_cast<const Generators::Model*>(model),
+                                                            reinterpret_cast<Generators::GeneratorParams*>(params)->shared_from_this(),
+                                                            std::span<const int32_t>{prompt_tokens, prompt_token_count},
+                                                            start_of_previous_token_id, step_frames, window_frames);
+  stream->external_owner_ = stream;
+  *out = reinterpret_cast<OgaWhisperStream*>(stream.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaWhisperStreamAddFeatures(OgaWhisperStream* p, const float* features, size_t feature_count, size_t frame_count) {
+  OGA_TRY
+  reinterpret_cast<Generators::WhisperStream*>(p)->AddFeatures({features, feature_count}, frame_count);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaWhisperStreamFlush(OgaWhisperStream* p) {
+  OGA_TRY
+  reinterpret_cast<Generators::WhisperStream*>(p)->Flush();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaWhisperStreamGetNewTokens(OgaWhisperStream* p, OgaSequences* sequences) {
+  OGA_TRY
+  reinterpret_cast<Generators::TokenSequences*>(sequences)->emplace_back(reinterpret_cast<Generators::WhisperStream*>(p)->GetNewTokens());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaWhisperStreamGetTranscript(const OgaWhisperStream* p, OgaSequences* sequences) {
+  OGA_TRY
+  reinterpret_cast<Generators::TokenSequences*>(sequences)->emplace_back(reinterpret_cast<const Generators::WhisperStream*>(p)->GetTranscript());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaWhisperStreamSetVoiceActivity(OgaWhisperStream* p, float silence_threshold, size_t min_silence_frames,
+                                                         size_t padding_frames) {
+  OGA_TRY
+  reinterpret_cast<Generators::WhisperStream*>(p)->SetVoiceActivity({silence_threshold, min_silence_frames, padding_frames});
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaWhisperStreamGetSegmentCount(const OgaWhisperStream* p, size_t* out) {
+  OGA_TRY
+  *out = reinterpret_cast<const Generators::WhisperStream*>(p)->GetSegments().size();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaWhisperStreamGetSegment(const OgaWhisperStream* p, size_t index, size_t* begin_frame, size_t* end_frame,
+                                                   OgaSequences* tokens) {
+  OGA_TRY
+  auto segments = reinterpret_cast<const Generators::WhisperStream*>(p)->GetSegments();
+  if (index >= segments.size())
+    throw std::runtime_error("Segment index " + std::to_string(index) + " is out of range, " + std::to_string(segments.size()) + " segments are completed");
+  *begin_frame = segments[index].begin_frame;
+  *end_frame = segments[index].end_frame;
+  reinterpret_cast<Generators::TokenSequences*>(tokens)->emplace_back(std::move(segments[index].tokens));
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaCreateTensorFromBuffer(void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type, OgaTensor** out) {
   OGA_TRY
   auto tensor = std::make_shared<Generators::Tensor>();
@@ -487,6 +951,31 @@ OgaResult* OGA_API_CALL OgaCreateTensorFromBuffer(void* data, const int64_t* sha
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaCreateTensorFromDeviceBuffer(void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type, const char* device_type, int device_id, OgaTensor** out) {
+  OGA_TRY
+  std::unique_ptr<OrtMemoryInfo> p_memory_info;
+  std::string_view device{device_type};
+  if (device == "cpu")
+    p_memory_info = OrtMemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
+  else if (device == "cuda")
+    p_memory_info = OrtMemoryInfo::Create("Cuda", OrtDeviceAllocator, device_id, OrtMemTypeDefault);
+  else if (device == "dml")
+    p_memory_info = OrtMemoryInfo::Create("DML", OrtDeviceAllocator, device_id, OrtMemTypeDefault);
+  else
+    throw std::runtime_error("Unsupported device type for a tensor: " + std::string{device});
+
+  auto tensor = std::make_shared<Generators::Tensor>();
+  auto ort_element_type = static_cast<ONNXTensorElementDataType>(element_type);
+  size_t byte_count = Generators::SizeOf(ort_element_type);
+  for (size_t i = 0; i < shape_dims_count; i++)
+    byte_count *= shape_dims[i];
+  tensor->ort_tensor_ = OrtValue::CreateTensor(*p_memory_info, data, byte_count, std::span<const int64_t>{shape_dims, shape_dims_count}, ort_element_type);
+  tensor->external_owner_ = tensor;
+  *out = reinterpret_cast<OgaTensor*>(tensor.get());
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaTensorGetType(OgaTensor* tensor, OgaElementType* out) {
   OGA_TRY
   *out = static_cast<OgaElementType>(reinterpret_cast<Generators::Tensor*>(tensor)->ort_tensor_->GetTensorTypeAndShapeInfo()->GetElementType());
@@ -597,6 +1086,13 @@ size_t OGA_API_CALL OgaStringArrayGetCount(const OgaStringArray* string_array) {
   return reinterpret_cast<const std::vector<std::string>*>(string_array)->size();
 }
 
+OgaResult* OGA_API_CALL OgaStringArrayGetString(const OgaStringArray* string_array, size_t index, const char** out) {
+  OGA_TRY
+  *out = reinterpret_cast<const std::vector<std::string>*>(string_array)->at(index).c_str();
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OgaCreateAdapters(const OgaModel* model, OgaAdapters** out) {
   OGA_TRY
   auto adapters = std::make_shared<Generators::Adapters>(reinterpret_cast<const Generators::Model*>(model));
@@ -621,6 +1117,34 @@ OgaResult* OgaUnloadAdapter(OgaAdapters* adapters, const char* adapter_name) {
   OGA_CATCH
 }
 
+OgaResult* OgaPrefetchAdapter(OgaAdapters* adapters, const char* adapter_name) {
+  OGA_TRY
+  reinterpret_cast<Generators::Adapters*>(adapters)->PrefetchAdapter(adapter_name);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OgaIsAdapterReady(const OgaAdapters* adapters, const char* adapter_name, bool* out) {
+  OGA_TRY
+  *out = reinterpret_cast<const Generators::Adapters*>(adapters)->IsAdapterReady(adapter_name);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OgaSetAdaptersMemoryLimit(OgaAdapters* adapters, size_t bytes) {
+  OGA_TRY
+  reinterpret_cast<Generators::Adapters*>(adapters)->SetMemoryLimit(bytes);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OgaAdaptersGetMemoryUsage(const OgaAdapters* adapters, size_t* out) {
+  OGA_TRY
+  *out = reinterpret_cast<const Generators::Adapters*>(adapters)->GetMemoryUsage();
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OgaSetActiveAdapter(OgaGenerator* generator, OgaAdapters* adapters,
                                const char* adapter_name) {
   OGA_TRY
@@ -630,6 +1154,115 @@ OgaResult* OgaSetActiveAdapter(OgaGenerator* generator, OgaAdapters* adapters,
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaCreateRequest(const OgaGeneratorParams* params, OgaRequest** out) {
+  OGA_TRY
+  auto& generator_params = const_cast<Generators::GeneratorParams&>(*reinterpret_cast<const Generators::GeneratorParams*>(params));
+  auto request = std::make_shared<Generators::Request>(generator_params.shared_from_this());
+  request->external_owner_ = request;
+  *out = reinterpret_cast<OgaRequest*>(request.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaRequest_SetPriority(OgaRequest* request, OgaRequestPriority priority) {
+  OGA_TRY
+  reinterpret_cast<Generators::Request*>(request)->SetPriority(priority == OgaRequestPriority_Batch ? Generators::Request::Priority::Batch
+                                                                                                  : Generators::Request::Priority::Interactive);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaRequest_AddTokens(OgaRequest* request, const int32_t* tokens, size_t token_count) {
+  OGA_TRY
+  reinterpret_cast<Generators::Request*>(request)->AddTokens({tokens, token_count});
+  return nullptr;
+  OGA_CATCH
+}
+
+bool OGA_API_CALL OgaRequest_IsDone(const OgaRequest* request) {
+  return reinterpret_cast<const Generators::Request*>(request)->IsDone();
+}
+
+OgaResult* OGA_API_CALL OgaRequest_Cancel(OgaRequest* request) {
+  OGA_TRY
+  reinterpret_cast<Generators::Request*>(request)->Cancel();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaRequest_GetUnseenTokens(OgaRequest* request, OgaSequences** out) {
+  OGA_TRY
+  auto sequences = std::make_unique<Generators::TokenSequences>();
+  sequences->emplace_back(reinterpret_cast<Generators::Request*>(request)->GetUnseenTokens());
+  *out = reinterpret_cast<OgaSequences*>(sequences.release());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaCreateEngine(const OgaModel* model, int max_active_requests, OgaEngine** out) {
+  OGA_TRY
+  auto engine = std::make_shared<Generators::Engine>(*reinterpret_cast<const Generators::Model*>(model), max_active_requests);
+  engine->external_owner_ = engine;
+  *out = reinterpret_cast<OgaEngine*>(engine.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaEngine_AddRequest(OgaEngine* engine, OgaRequest* request) {
+  OGA_TRY
+  reinterpret_cast<Generators::Engine*>(engine)->AddRequest(reinterpret_cast<Generators::Request*>(request)->shared_from_this());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaEngine_Step(OgaEngine* engine) {
+  OGA_TRY
+  reinterpret_cast<Generators::Engine*>(engine)->Step();
+  return nullptr;
+  OGA_CATCH
+}
+
+bool OGA_API_CALL OgaEngine_HasPendingRequests(const OgaEngine* engine) {
+  return reinterpret_cast<const Generators::Engine*>(engine)->HasPendingRequests();
+}
+
+size_t OGA_API_CALL OgaEngine_GetActiveRequestCount(const OgaEngine* engine) {
+  return reinterpret_cast<const Generators::Engine*>(engine)->GetActiveRequestCount();
+}
+
+size_t OGA_API_CALL OgaEngine_GetQueuedRequestCount(const OgaEngine* engine) {
+  return reinterpret_cast<const Generators::Engine*>(engine)->GetQueuedRequestCount();
+}
+
+OgaResult* OGA_API_CALL OgaEngine_SetTokenBudget(OgaEngine* engine, size_t tokens) {
+  OGA_TRY
+  reinterpret_cast<Generators::Engine*>(engine)->SetTokenBudget(tokens);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaEngine_SetStepTokenBudget(OgaEngine* engine, size_t tokens) {
+  OGA_TRY
+  reinterpret_cast<Generators::Engine*>(engine)->SetStepTokenBudget(tokens);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaEngine_SetKeyValueCacheBudget(OgaEngine* engine, size_t bytes) {
+  OGA_TRY
+  reinterpret_cast<Generators::Engine*>(engine)->SetKeyValueCacheBudget(bytes);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaEngine_SetPreemptionMode(OgaEngine* engine, OgaPreemptionMode mode) {
+  OGA_TRY
+  reinterpret_cast<Generators::Engine*>(engine)->SetPreemptionMode(mode == OgaPreemptionMode_Recompute ? Generators::PreemptionMode::Recompute
+                                                                                                       : Generators::PreemptionMode::Swap);
+  return nullptr;
+  OGA_CATCH
+}
+
 void OGA_API_CALL OgaDestroyStringArray(OgaStringArray* string_array) {
   delete reinterpret_cast<std::vector<std::string>*>(string_array);
 }
@@ -670,6 +1303,14 @@ void OGA_API_CALL OgaDestroyTokenizerStream(OgaTokenizerStream* p) {
   delete reinterpret_cast<Generators::TokenizerStream*>(p);
 }
 
+void OGA_API_CALL OgaDestroyBatchTokenizerStream(OgaBatchTokenizerStream* p) {
+  delete reinterpret_cast<Generators::BatchTokenizerStream*>(p);
+}
+
+void OGA_API_CALL OgaDestroyWhisperStream(OgaWhisperStream* p) {
+  reinterpret_cast<Generators::WhisperStream*>(p)->external_owner_ = nullptr;
+}
+
 void OGA_API_CALL OgaDestroyTensor(OgaTensor* p) {
   reinterpret_cast<Generators::Tensor*>(p)->external_owner_ = nullptr;
 }
@@ -690,6 +1331,14 @@ void OGA_API_CALL OgaDestroyNamedTensors(OgaNamedTensors* p) {
   delete reinterpret_cast<Generators::NamedTensors*>(p);
 }
 
+void OGA_API_CALL OgaDestroyRequest(OgaRequest* p) {
+  reinterpret_cast<Generators::Request*>(p)->external_owner_ = nullptr;
+}
+
+void OGA_API_CALL OgaDestroyEngine(OgaEngine* p) {
+  reinterpret_cast<Generators::Engine*>(p)->external_owner_ = nullptr;
+}
+
 void OGA_API_CALL OgaDestroyAdapters(OgaAdapters* p) {
   reinterpret_cast<Generators::Adapters*>(p)->external_owner_ = nullptr;
 }
@@ -61,6 +61,25 @@ typedef struct OgaModel OgaModel;
 typedef struct OgaSequences OgaSequences;
 typedef struct OgaTokenizer OgaTokenizer;
 typedef struct OgaTokenizerStream OgaTokenizerStream;
+typedef struct OgaBatchTokenizerStream OgaBatchTokenizerStream;
+typedef struct OgaWhisperStream OgaWhisperStream;
+
+/* Called by OgaGenerator_GenerateTokens with the tokens of the latest steps, return false to stop the generation */
+typedef bool(OGA_API_CALL* OgaGenerateTokensCallback)(const int32_t* tokens, size_t token_count, void* user_data);
+/* Called by OgaCreateModelAsync with a description of each completed step, 'step' is only valid during the call */
+typedef void(OGA_API_CALL* OgaCreateModelProgressCallback)(const char* step, void* user_data);
+/* Called by OgaCreateModelAsync once the model is created, with the model or the error (the callback owns either one) */
+typedef void(OGA_API_CALL* OgaCreateModelCompletionCallback)(OgaResult* result, OgaModel* model, void* user_data);
+/* How OgaMetricsSink values add up: a counter's are increments, a gauge's replace the last one, a histogram's are observations */
+typedef enum OgaMetricType {
+  OgaMetricType_Counter,
+  OgaMetricType_Gauge,
+  OgaMetricType_Histogram,
+} OgaMetricType;
+/* Called with each value of a runtime metric, see OgaSetMetricsSink. 'name' is a static string */
+typedef void(OGA_API_CALL* OgaMetricsSink)(const char* name, OgaMetricType type, double value, void* user_data);
+/* Called by OgaBatchGenerate with the generated tokens and text of the prompt at 'index', both are only valid during the call */
+typedef void(OGA_API_CALL* OgaBatchGenerateCallback)(size_t index, const int32_t* tokens, size_t token_count, const char* text, void* user_data);
 typedef struct OgaTensor OgaTensor;
 typedef struct OgaImages OgaImages;
 typedef struct OgaNamedTensors OgaNamedTensors;
@@ -68,6 +87,18 @@ typedef struct OgaMultiModalProcessor OgaMultiModalProcessor;
 typedef struct OgaAudios OgaAudios;
 typedef struct OgaStringArray OgaStringArray;
 typedef struct OgaAdapters OgaAdapters;
+typedef struct OgaEngine OgaEngine;
+typedef struct OgaRequest OgaRequest;
+/* Interactive requests are admitted before batch requests, and preempt them when the engine is full */
+typedef enum OgaRequestPriority {
+  OgaRequestPriority_Interactive,
+  OgaRequestPriority_Batch,
+} OgaRequestPriority;
+/* What happens to a preempted request: Swap moves its key-value cache to host memory, Recompute runs its sequence again */
+typedef enum OgaPreemptionMode {
+  OgaPreemptionMode_Swap,
+  OgaPreemptionMode_Recompute,
+} OgaPreemptionMode;
 
 //! @}
 
@@ -94,6 +125,26 @@ OGA_EXPORT const char* OGA_API_CALL OgaResultGetError(const OgaResult* result);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaSetLogBool(const char* name, bool value);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaSetLogString(const char* name, const char* value);
 
+/**
+ * \brief Sets the process wide receiver of the runtime's metrics, so they can be exported (e.g. as Prometheus counters
+ *        and histograms or through OTLP) without polling every generator. The metrics are:
+ *        - oga_prompt_tokens_total, oga_generated_tokens_total (counters): tokens appended and generated per sequence
+ *        - oga_time_to_first_token_seconds (histogram): from an OgaGenerator_AppendTokens to the next generated token
+ *        - oga_inter_token_latency_seconds (histogram): between consecutive OgaGenerator_GenerateNextToken calls
+ *        - oga_kv_cache_bytes (gauge): the key-value cache of the model's generators, after each generated token
+ *        - oga_engine_queued_requests, oga_engine_active_requests (gauges): with each OgaEngine step
+ *        - oga_captured_graph_hits_total, oga_captured_graph_misses_total (counters): generators reusing a captured graph
+ *        - oga_adapter_cache_hits_total, oga_adapter_cache_misses_total (counters): adapters resident when acquired
+ *        - oga_tokenizer_cache_hits_total, oga_tokenizer_cache_misses_total (counters): texts found in the tokenizer's
+ *          cache when encoded, with the tokenizer_cache_size model option
+ *        The sink is called on the threads doing the work, possibly with internal locks held, so it has to be fast and
+ *        must not call back into the library. Without a sink the metrics aren't measured.
+ * \param[in] sink The sink, null to remove it.
+ * \param[in] user_data Passed to the sink.
+ * \return OgaResult containing the error message if setting the sink failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaSetMetricsSink(OgaMetricsSink sink, void* user_data);
+
 /**
  * \param[in] result OgaResult to be destroyed.
  */
@@ -219,6 +270,15 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaConfigAppendProvider(OgaConfig* config, co
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaConfigSetProviderOption(OgaConfig* config, const char* provider, const char* key, const char* value);
 
+/**
+ * \brief Overlays the given JSON on top of the config, e.g. {"model": {"decoder": {"session_options": {"intra_op_num_threads": 4}}}}
+ * The JSON has the layout of genai_config.json, its values replace the config's and its provider options are merged.
+ * \param[in] config The config to overlay.
+ * \param[in] json The JSON to overlay.
+ * \return OgaResult containing the error message if the JSON is invalid.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaConfigOverlay(OgaConfig* config, const char* json);
+
 /**
  * \brief Creates a model from the given configuration directory.
  * \param[in] config_path The path to the model configuration directory. The path is expected to be encoded in UTF-8.
@@ -244,6 +304,22 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateModelFromConfig(const OgaConfig* con
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateModelWithRuntimeSettings(const char* config_path, const OgaRuntimeSettings* settings, OgaModel** out);
 
+/**
+ * \brief Creates a model on a background thread, like OgaCreateModelWithRuntimeSettings, and returns right away.
+ * The model's sessions are created in parallel, including the ones a model would otherwise load on first use, so the
+ * model is ready to run when 'completion' is called. The callbacks are called on the library's threads, one at a time.
+ * OgaShutdown must not be called before 'completion' was called.
+ * \param[in] config_path The path to the model configuration directory. The path is expected to be encoded in UTF-8.
+ * \param[in] settings Optional runtime settings to use for the model, only used during this call.
+ * \param[in] progress Optional, called after each step of the model creation.
+ * \param[in] completion Called once with the created model, or with the error if the model creation failed.
+ * \param[in] user_data Passed to the callbacks.
+ * \return OgaResult containing the error message if the model creation could not be started.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateModelAsync(const char* config_path, const OgaRuntimeSettings* settings,
+                                                       OgaCreateModelProgressCallback progress,
+                                                       OgaCreateModelCompletionCallback completion, void* user_data);
+
 /**
  * \brief Destroys the given config
  * \param[in] config The config to be destroyed.
@@ -256,6 +332,69 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyConfig(OgaConfig* config);
  */
 OGA_EXPORT void OGA_API_CALL OgaDestroyModel(OgaModel* model);
 
+/**
+ * \brief Returns the live memory of the model's generators as a JSON object of byte counts: kv_cache, logits, buffers
+ *        (everything else the generators allocated on the device and host), their total and peak, then what the model
+ *        holds for its generators: paged_kv_cache_pool, captured_graph_pool (idle captured graphs) and
+ *        device_arena_cached (freed blocks kept by the device arena) and device_pool_cached (freed buffers pooled by
+ *        the device, see OgaModel_ReleaseCachedMemory). The kv_cache and logits of a generator are
+ *        measured after each of its model runs.
+ * \param[in] model The model to get the memory usage of.
+ * \param[out] out The JSON string. Must be freed with OgaDestroyString.
+ * \return OgaResult containing the error message if getting the memory usage failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModel_GetMemoryUsage(const OgaModel* model, const char** out);
+
+/**
+ * \brief Frees the memory the model keeps for reuse by its generators: the freed blocks of the device arena and the
+ *        buffers pooled by the device (WebGPU pools its buffers, shared by every model on the device). Call it on
+ *        memory pressure, later allocations create new buffers again.
+ * \param[in] model The model to free the cached memory of.
+ * \return OgaResult containing the error message if freeing the memory failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModel_ReleaseCachedMemory(const OgaModel* model);
+
+/**
+ * \brief Computes sentence embeddings with a decoder model that outputs its final hidden states (see the model builder's
+ *        include_hidden_states and exclude_lm_head options). The sequences are run once as a batch padded to the longest
+ *        one, without a generator, search or key-value cache.
+ * \param[in] model The model to run.
+ * \param[in] sequences The token sequences to embed, none can be empty.
+ * \param[in] pooling "last_token" for the hidden state of each sequence's last token, "mean" for the average over its tokens.
+ * \param[out] out A float tensor of shape [sequence count, hidden_size] on the CPU. Must be freed with OgaDestroyTensor.
+ * \return OgaResult containing the error message if the computation failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModel_Embed(const OgaModel* model, const OgaSequences* sequences, const char* pooling, OgaTensor** out);
+
+/**
+ * \brief Scores continuations for reranking and evaluation. Each prompt followed by its continuation is run once as a
+ *        batch padded to the longest one, without a generator, search or key-value cache, and the log-probabilities of
+ *        the continuation tokens are gathered from the logits of all positions.
+ * \param[in] model The model to run.
+ * \param[in] prompts The prompt token sequences, none can be empty.
+ * \param[in] continuations One continuation per prompt, none can be empty.
+ * \param[out] out A float tensor of shape [prompt count, longest continuation] on the CPU. Entry [i, j] is the log-probability
+ *        of continuation token j of prompt i, the entries past the end of a continuation are 0. Must be freed with OgaDestroyTensor.
+ * \return OgaResult containing the error message if the computation failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModel_ScoreSequences(const OgaModel* model, const OgaSequences* prompts, const OgaSequences* continuations, OgaTensor** out);
+
+/**
+ * \brief Generates a completion for each of the prompts, for offline workloads where all of the prompts are known upfront.
+ *        The prompts are tokenized in parallel and sorted by length, so each batch holds prompts of similar length and
+ *        pads little. Finished sequences are dropped from greedy batches, so the remaining ones run at full speed.
+ * \param[in] model The model to use for generation.
+ * \param[in] prompts The prompts to complete.
+ * \param[in] prompt_count The number of prompts.
+ * \param[in] params The search options, batch_size is the number of prompts run together. Beam search is not supported.
+ * \param[in] callback Called once per prompt as its batch finishes, with the index of the prompt in 'prompts' and the
+ *        tokens generated up to the first end of sequence token. The calls are not in prompt order.
+ * \param[in] user_data Passed to the callback.
+ * \return OgaResult containing the error message if the generation failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaBatchGenerate(const OgaModel* model, const char* const* prompts, size_t prompt_count,
+                                                    const OgaGeneratorParams* params, OgaBatchGenerateCallback callback, void* user_data);
+
 /**
  * \brief Creates a OgaGeneratorParams from the given model.
  * \param[in] model The model to use for generation.
@@ -276,6 +415,68 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsTryGraphCaptureWithMaxBatch
 
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetInputs(OgaGeneratorParams* generator_params, const OgaNamedTensors* named_tensors);
 
+/**
+ * \brief Enables speculative decoding: the draft model proposes tokens that the model verifies in a single run.
+ * Only greedy search with a batch size of 1 and no beam search is sped up, the generated tokens are the same as without a draft model.
+ * \param[in] generator_params The generator params to set the draft model on
+ * \param[in] draft_model A smaller model with the same vocabulary
+ * \param[in] num_draft_tokens Number of tokens the draft model proposes per verification run
+ * \return OgaResult containing the error message if the draft model could not be set.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetDraftModel(OgaGeneratorParams* generator_params, const OgaModel* draft_model, int32_t num_draft_tokens);
+
+/**
+ * \brief Sets the sampling parameters of every batch entry, so sequences with different sampling settings can share a batch.
+ * They replace the top_k, top_p and temperature search options when do_sample is true. Entries with a top_k of 1 select the top token.
+ * \param[in] generator_params The generator params to set the sampling parameters on
+ * \param[in] top_k Array of batch_size top_k values, 0 to not limit the number of tokens
+ * \param[in] top_p Array of batch_size top_p values, 0 to not limit the probability mass
+ * \param[in] temperature Array of batch_size temperatures
+ * \param[in] batch_size The number of elements in each array, must match the batch_size search option
+ * \return OgaResult containing the error message if a sampling parameter is out of range.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetBatchSampling(OgaGeneratorParams* generator_params, const int32_t* top_k, const float* top_p, const float* temperature, size_t batch_size);
+
+/**
+ * \brief Sets the adapter of every batch entry of a multi-LoRA model, so sequences for different adapters can share a batch.
+ * The adapters are the ones the model was built with, listed in the adapter_names of its genai_config.json.
+ * \param[in] generator_params The generator params to set the adapters on
+ * \param[in] adapter_names Array of batch_size adapter names, an empty string (or null) selects the base model
+ * \param[in] batch_size The number of elements in the array, must match the batch_size search option
+ * \return OgaResult containing the error message if the model isn't a multi-LoRA model or an adapter isn't found.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetBatchAdapters(OgaGeneratorParams* generator_params, const char* const* adapter_names, size_t batch_size);
+
+/**
+ * \brief Constrains the generated text to a grammar, so the output is guaranteed to parse (structured outputs). Tokens
+ * the grammar doesn't allow are masked before the search selects the next token. Prompt tokens aren't constrained.
+ * \param[in] generator_params The generator params to set the guidance on
+ * \param[in] type "regex" for a regular expression the whole generated text must match, or "json_schema" for a JSON
+ * schema the generated JSON must be valid for. An empty string removes the guidance.
+ * \param[in] data The regular expression or JSON schema
+ * \return OgaResult containing the error message if the type is unknown or the grammar could not be compiled.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetGuidance(OgaGeneratorParams* generator_params, const char* type, const char* data);
+
+/**
+ * \brief Adds a stop sequence of tokens, a batch entry is done as soon as its generated tokens end with it. The stop
+ * sequence stays in the output. Adds to the stop_token_sequences search option, not supported with beam search.
+ * \param[in] generator_params The generator params to add the stop sequence to
+ * \param[in] tokens The token ids of the stop sequence
+ * \param[in] count The number of tokens, must be 1 or more
+ * \return OgaResult containing the error message if the stop sequence could not be added.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsAddStopTokenSequence(OgaGeneratorParams* generator_params, const int32_t* tokens, size_t count);
+
+/**
+ * \brief Adds a stop string, a batch entry is done as soon as its generated text ends with it, however the text was
+ * tokenized. The token that completes the stop string stays in the output. Adds to the stop_strings search option.
+ * \param[in] generator_params The generator params to add the stop string to
+ * \param[in] text The UTF-8 stop string, must not be empty
+ * \return OgaResult containing the error message if the stop string could not be added.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsAddStopString(OgaGeneratorParams* generator_params, const char* text);
+
 /**
  * \brief For additional model inputs that genai does not handle, this lets the user set their values. For example LoRA models handle
  * fine tuning through model inputs. This lets the user supply the fine tuning inputs, while genai handles the standard inputs.
@@ -308,6 +509,15 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyGenerator(OgaGenerator* generator);
  * \return True if the generator has finished generating all the sequences, false otherwise.
  */
 OGA_EXPORT bool OGA_API_CALL OgaGenerator_IsDone(const OgaGenerator* generator);
+
+/**
+ * \brief Returns true if OgaGenerator_IsDone can return without waiting for the device. On CUDA the done state is
+ *        computed on the GPU, so a loop can poll this to do host-side work (like streaming the last token) while
+ *        the GPU is still busy, instead of blocking in OgaGenerator_IsDone.
+ * \param[in] generator The generator to check.
+ * \return True if the done state is available, false if the device is still computing it.
+ */
+OGA_EXPORT bool OGA_API_CALL OgaGenerator_IsDoneReady(const OgaGenerator* generator);
 OGA_EXPORT bool OGA_API_CALL OgaGenerator_IsSessionTerminated(const OgaGenerator* generator);
 
 /**
@@ -334,6 +544,33 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_AppendTokens(OgaGenerator* oga_g
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GenerateNextToken(OgaGenerator* generator);
 
+/**
+ * \brief Runs the generation loop for up to max_new_tokens steps, or until the generator is done, in a single call.
+ *        Every step's tokens are written to out_tokens, one per sequence. Not supported with beam search.
+ * \param[in] generator The generator to generate the tokens with.
+ * \param[in] max_new_tokens The maximum number of steps to run.
+ * \param[out] out_tokens Buffer of max_new_tokens * batch_size tokens, filled in step order.
+ * \param[out] out_count The number of steps run.
+ * \param[in] callback_interval Call the callback every callback_interval steps, 0 to only call it at the end.
+ * \param[in] callback Optional, called with the tokens of the steps since the last call. Returning false stops the generation.
+ * \param[in] user_data Passed to the callback.
+ * \return OgaResult containing the error message if the generation failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GenerateTokens(OgaGenerator* generator, size_t max_new_tokens, int32_t* out_tokens, size_t* out_count,
+                                                               size_t callback_interval, OgaGenerateTokensCallback callback, void* user_data);
+
+/**
+ * \brief Sets a runtime option of the generator:
+ *        - terminate_session: "1" makes the session runs in progress and the next ones fail, "0" allows them again.
+ *        - enable_profiling: the file name prefix of a timeline of this generator's calls, written as
+ *          <prefix>_<generator id>.json in the Chrome trace event format once the option changes or the generator is
+ *          destroyed. Empty or "0" stops profiling. Unlike the enable_profiling session option it costs nothing for the
+ *          other generators, so a server can profile a sample of its requests.
+ * \param[in] generator The generator to set the option of.
+ * \param[in] key The option name.
+ * \param[in] value The option value.
+ * \return OgaResult containing the error message if the option or its value is unknown.
+ */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_SetRuntimeOption(OgaGenerator* generator, const char* key, const char* value);
 
 /**
@@ -345,6 +582,109 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_SetRuntimeOption(OgaGenerator* g
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_RewindTo(OgaGenerator* generator, size_t new_length);
 
+/**
+ * \brief Makes the given tokens the sequence of the generator, rewinding it to the prefix they share with the current
+ *        sequence and appending the rest. Useful to prefill a prompt while the user is still typing it: call it with the
+ *        partial prompt as it changes, then with the final prompt, which only runs the tokens that differ. Only batch
+ *        size 1 without beam search is supported.
+ * \param[in] generator The generator to set the sequence of.
+ * \param[in] tokens The new sequence.
+ * \param[in] token_count The number of tokens, at least 1.
+ * \return OgaResult containing the error message if setting the sequence failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_SetTokens(OgaGenerator* generator, const int32_t* tokens, size_t token_count);
+
+/**
+ * \brief Creates a generator that continues independently from the current sequence of the given one, to sample several
+ *        completions of one prompt without running the prompt again. The key-value cache is copied, or shared with a paged
+ *        key-value cache until either generator writes to a shared block. Only batch size 1 is supported.
+ * \param[in] generator The generator to fork, it must have a sequence.
+ * \param[out] out The created generator, destroy it with OgaDestroyGenerator.
+ * \return OgaResult containing the error message if the fork failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_Fork(OgaGenerator* generator, OgaGenerator** out);
+
+/**
+ * \brief Writes a versioned snapshot of the generator to a file: the sequence, the sampling random number generator state
+ *        and the key-value cache where the model supports saving it. The snapshot can be loaded in another process, for
+ *        example to move a conversation to another node without running its prompt again. Only batch size 1 is supported.
+ * \param[in] generator The generator to save.
+ * \param[in] path The file to write the snapshot to.
+ * \return OgaResult containing the error message if saving failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_SaveState(OgaGenerator* generator, const char* path);
+
+/**
+ * \brief Continues a generator saved with OgaGenerator_SaveState. The generator must be new and created with the same
+ *        model and generator params as the saved one. Without a saved key-value cache the whole sequence is run.
+ * \param[in] generator The new generator to load the snapshot into.
+ * \param[in] path The file written by OgaGenerator_SaveState.
+ * \return OgaResult containing the error message if loading failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_LoadState(OgaGenerator* generator, const char* path);
+
+/**
+ * \brief Same as OgaGenerator_SaveState, but returns the snapshot in memory for the caller to send over its own transport,
+ *        for example from a node that runs the prompts to one that decodes.
+ * \param[in] generator The generator to save.
+ * \param[in] quantize_kv_cache Writes the key-value cache as int8 with a scale per token and head, about half the size of a
+ *            float16 cache at a small loss of accuracy.
+ * \param[out] out A uint8 tensor [snapshot size] on the CPU, destroy it with OgaDestroyTensor.
+ * \return OgaResult containing the error message if saving failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_SaveStateToBuffer(OgaGenerator* generator, bool quantize_kv_cache, OgaTensor** out);
+
+/**
+ * \brief Same as OgaGenerator_LoadState, for a snapshot in memory from OgaGenerator_SaveStateToBuffer.
+ * \param[in] generator The new generator to load the snapshot into.
+ * \param[in] data The snapshot.
+ * \param[in] size The size of the snapshot in bytes.
+ * \return OgaResult containing the error message if loading failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_LoadStateFromBuffer(OgaGenerator* generator, const uint8_t* data, size_t size);
+
+/**
+ * \brief Appends a document saved with OgaGenerator_SaveState (without a BOS token), along with its key-value cache, to the
+ *        sequence of a generator created with the same model. The document is prefilled once and appended to any number of
+ *        prompts, several documents one after another, so a retrieval prompt only runs its own tokens and the last token of
+ *        each document. The key-value cache entries are re-encoded for their new positions when the decoder config has a
+ *        rotary_embedding, otherwise the document's tokens are run. A document's tokens only attend to each other.
+ *        The file is memory mapped, so generators of one process appending it share its pages.
+ * \param[in] generator The generator to append the document to.
+ * \param[in] path The file written by OgaGenerator_SaveState.
+ * \return OgaResult containing the error message if appending failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_AppendState(OgaGenerator* generator, const char* path);
+
+/**
+ * \brief Same as OgaGenerator_AppendState, for a snapshot in memory from OgaGenerator_SaveStateToBuffer.
+ * \param[in] generator The generator to append the document to.
+ * \param[in] data The snapshot.
+ * \param[in] size The size of the snapshot in bytes.
+ * \return OgaResult containing the error message if appending failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_AppendStateFromBuffer(OgaGenerator* generator, const uint8_t* data, size_t size);
+
+/**
+ * \brief Moves the generator's key-value cache off the device to free device memory while the generator is idle, for example
+ *        between the turns of a chat session. The cache is copied to pinned host memory, or written to a file when a path is given.
+ *        The next call that runs the model restores it, so generation resumes without processing the sequence again. On CPU
+ *        without a path the cache already lives in host memory and is left in place.
+ * \param[in] generator The generator to offload the key-value cache of.
+ * \param[in] path Optional file to write the key-value cache to, nullptr to keep it in host memory.
+ * \return OgaResult containing the error message if the offloading failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_OffloadKeyValueCache(OgaGenerator* generator, const char* path);
+
+/**
+ * \brief Restores the key-value cache moved off the device by OgaGenerator_OffloadKeyValueCache. This happens automatically
+ *        on the next call that runs the model, calling it ahead of time keeps the copy out of that call. Does nothing if the
+ *        key-value cache isn't offloaded.
+ * \param[in] generator The generator to restore the key-value cache of.
+ * \return OgaResult containing the error message if the restoring failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_RestoreKeyValueCache(OgaGenerator* generator);
+
 /**
  * \brief Returns a copy of the model output identified by the given name as an OgaTensor on CPU. The buffer is owned by returned OgaTensor
  *       and will be released when the OgaTensor is destroyed
@@ -374,6 +714,39 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GetLogits(OgaGenerator* generato
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_SetLogits(OgaGenerator* generator, OgaTensor* tensor);
 
+/**
+ * \brief Adds a bias to the logits of the given tokens from the next generated token on, replacing the search's logit_bias.
+ *        The biases are applied on the device before the selection, a large negative bias keeps a token from being selected.
+ * \param[in] generator The generator to bias the logits of.
+ * \param[in] tokens The token ids, the biases of a token given more than once are added.
+ * \param[in] biases The bias of each token.
+ * \param[in] count The number of tokens and biases, 0 removes the bias.
+ * \return OgaResult containing the error message if a token is outside of the vocabulary.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_SetLogitsBias(OgaGenerator* generator, const int32_t* tokens, const float* biases, size_t count);
+
+/**
+ * \brief Only lets the given tokens be selected from the next generated token on, for example the label tokens of a
+ *        classification prompt. The mask is applied to the logits on the device before the selection, which is much cheaper
+ *        than masking them through OgaGenerator_SetLogits. EOS is only allowed if it's one of the tokens.
+ * \param[in] generator The generator to restrict the tokens of.
+ * \param[in] tokens The allowed token ids.
+ * \param[in] count The number of tokens, 0 allows every token again.
+ * \return OgaResult containing the error message if a token is outside of the vocabulary.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_SetAllowedTokens(OgaGenerator* generator, const int32_t* tokens, size_t count);
+
+/**
+ * \brief Returns the last token logits without copying them into a new OgaTensor. The data has the shape
+ *        [batch_size * num_beams, vocab_size] and is on the CPU, device logits are copied into a buffer the generator
+ *        reuses, so on the CPU this reads the search's logits in place.
+ * \param[in] generator The generator to get the logits from.
+ * \param[out] out The pointer to the logits, owned by the generator and valid until its next call.
+ * \param[out] out_count The number of logits.
+ * \return OgaResult containing the error message if getting the logits failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GetLogitsData(OgaGenerator* generator, const float** out, size_t* out_count);
+
 /*
  * \brief Returns the number of tokens in the sequence at the given index.
  * \param[in] generator The generator to get the count of the tokens for the sequence at the given index.
@@ -393,6 +766,59 @@ OGA_EXPORT size_t OGA_API_CALL OgaGenerator_GetSequenceCount(const OgaGenerator*
  */
 OGA_EXPORT const int32_t* OGA_API_CALL OgaGenerator_GetSequenceData(const OgaGenerator* generator, size_t index);
 
+/**
+ * \brief Returns the tokens selected by the last OgaGenerator_GenerateNextToken call, one per sequence. With the
+ *        pipelined_decode search option the model is already running on these tokens, and unlike the sequence data
+ *        they are returned without waiting for it, so streaming them overlaps with the next step.
+ * \param[in] generator The generator to get the next tokens for.
+ * \param[out] out The pointer to the tokens, owned by the generator and valid until its next call.
+ * \param[out] out_count The number of tokens.
+ * \return OgaResult containing the error message if getting the next tokens failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GetNextTokens(OgaGenerator* generator, const int32_t** out, size_t* out_count);
+
+/**
+ * \brief Returns the top_logprobs search option's most likely tokens of the last OgaGenerator_GenerateNextToken call and
+ *        their log-probabilities. Both arrays have the shape [batch_size * num_beams, top_logprobs], in descending order,
+ *        and are computed on the device during the token selection, so only this compact buffer is copied.
+ * \param[in] generator The generator to get the top log-probabilities for.
+ * \param[out] tokens The pointer to the tokens, owned by the generator and valid until its next call.
+ * \param[out] logprobs The pointer to the log-probabilities, owned by the generator and valid until its next call.
+ * \param[out] out_count The number of entries in each array.
+ * \return OgaResult containing the error message if top_logprobs isn't set or no token was generated yet.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GetTopLogProbs(OgaGenerator* generator, const int32_t** tokens, const float** logprobs, size_t* out_count);
+
+/**
+ * \brief Returns where the generator's time went since it was created or its metrics were reset, as a JSON object with
+ *        a "prefill" (OgaGenerator_AppendTokens) and a "decode" (OgaGenerator_GenerateNextToken, OgaGenerator_GetLogits)
+ *        entry. Each entry has the number of calls and tokens, the wall time of the calls in total_seconds and the time
+ *        in session_run (the decoder), logits, search, kv_cache_update, copy (host/device), vision_run and
+ *        embedding_run (the vision and embedding models of a multimodal model) seconds. The stages are exclusive and
+ *        don't cover everything, so they can add up to less than the total. A multimodal prompt may run the vision
+ *        model on a worker thread while the text before the first image is prefilled, then the stages overlap.
+ * \param[in] generator The generator to get the metrics of.
+ * \param[out] out The JSON string. Must be freed with OgaDestroyString.
+ * \return OgaResult containing the error message if getting the metrics failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GetMetrics(const OgaGenerator* generator, const char** out);
+
+/**
+ * \brief Sets the generator's metrics back to zero.
+ * \param[in] generator The generator to reset the metrics of.
+ * \return OgaResult containing the error message if resetting the metrics failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_ResetMetrics(OgaGenerator* generator);
+
+/**
+ * \brief Returns the live memory of the generator as a JSON object of byte counts: kv_cache, logits, buffers, their
+ *        total and peak. A paged key-value cache counts the pool blocks the generator holds, see OgaModel_GetMemoryUsage.
+ * \param[in] generator The generator to get the memory usage of.
+ * \param[out] out The JSON string. Must be freed with OgaDestroyString.
+ * \return OgaResult containing the error message if getting the memory usage failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GetMemoryUsage(const OgaGenerator* generator, const char** out);
+
 OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateTokenizer(const OgaModel* model, OgaTokenizer** out);
 OGA_EXPORT void OGA_API_CALL OgaDestroyTokenizer(OgaTokenizer*);
 
@@ -406,6 +832,17 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyMultiModalProcessor(OgaMultiModalProcesso
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerEncode(const OgaTokenizer*, const char* str, OgaSequences* sequences);
 
+/**
+ * \brief Encodes a batch of strings on the thread pool.
+ * \param[in] tokenizer The tokenizer to use.
+ * \param[in] strings The strings to encode.
+ * \param[in] count The number of strings.
+ * \param[out] out An int32 tensor of shape [count, max_length] on the CPU. Shorter sequences are padded on the right with the
+ *                 pad token. Must be destroyed with OgaDestroyTensor.
+ * \return OgaResult containing the error message if the encoding failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerEncodeBatch(const OgaTokenizer* tokenizer, const char* const* strings, size_t count, OgaTensor** out);
+
 /**
  * \brief Converts the given string to a single token id.
  * \param[in] tokenizer The tokenizer to use to convert the string to a token id.
@@ -422,6 +859,15 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaProcessorProcessAudios(const OgaMultiModal
 /** Decode a single token sequence and returns a null terminated utf8 string. out_string must be freed with OgaDestroyString
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerDecode(const OgaTokenizer*, const int32_t* tokens, size_t token_count, const char** out_string);
+
+/**
+ * \brief Decodes a batch of token sequences on the thread pool.
+ * \param[in] tokenizer The tokenizer to use.
+ * \param[in] tokens An int32 tensor on the CPU of shape [count, sequence_length], or [sequence_length] for a single sequence.
+ * \param[out] out The decoded strings, one per sequence. Must be destroyed with OgaDestroyStringArray.
+ * \return OgaResult containing the error message if the decoding failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerDecodeBatch(const OgaTokenizer* tokenizer, OgaTensor* tokens, OgaStringArray** out);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaProcessorDecode(const OgaMultiModalProcessor*, const int32_t* tokens, size_t token_count, const char** out_string);
 
 /** OgaTokenizerStream is to decoded token strings incrementally, one token at a time.
@@ -437,6 +883,67 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyTokenizerStream(OgaTokenizerStream*);
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerStreamDecode(OgaTokenizerStream*, int32_t token, const char** out);
 
+/** OgaBatchTokenizerStream decodes 'count' sequences incrementally, one token of every sequence per call.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateBatchTokenizerStream(const OgaTokenizer*, size_t count, OgaBatchTokenizerStream** out);
+OGA_EXPORT void OGA_API_CALL OgaDestroyBatchTokenizerStream(OgaBatchTokenizerStream*);
+
+/**
+ * Decode the next token of every sequence, 'token_count' must match the stream's count. 'out' receives an array of
+ * 'token_count' null terminated strings, the chunk each sequence's token completed (empty if none).
+ * 'out' is valid until the next call to OgaBatchTokenizerStreamDecode or when the OgaBatchTokenizerStream is destroyed
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaBatchTokenizerStreamDecode(OgaBatchTokenizerStream*, const int32_t* tokens, size_t token_count, const char* const** out);
+
+/** OgaWhisperStream transcribes audio that arrives in chunks with a Whisper model. The log-mel frames of the current
+ * segment are re-encoded every 'step_frames' frames (the encoder always sees a full, padded window of 'window_frames')
+ * and decoded from scratch, tokens are committed once two consecutive decodes agree on them. 'prompt_tokens' are the
+ * decoder prompt of every window (e.g. <|startoftranscript|><|en|><|transcribe|><|notimestamps|>), the committed tokens
+ * of earlier segments are passed to the decoder after 'start_of_previous_token_id' (<|startofprev|>) unless it's negative.
+ * The stream sets the inputs of 'params' (batch_size 1) for every decode, so they can't be shared with other generators.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateWhisperStream(const OgaModel* model, OgaGeneratorParams* params, const int32_t* prompt_tokens,
+                                                          size_t prompt_token_count, int32_t start_of_previous_token_id, size_t step_frames,
+                                                          size_t window_frames, OgaWhisperStream** out);
+OGA_EXPORT void OGA_API_CALL OgaDestroyWhisperStream(OgaWhisperStream*);
+
+/**
+ * Appends 'frame_count' log-mel frames, the 'feature_count' floats of 'features' have the layout [number_of_mels, frame_count].
+ * Decodes on the calling thread whenever another step_frames frames are buffered.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaWhisperStreamAddFeatures(OgaWhisperStream*, const float* features, size_t feature_count, size_t frame_count);
+
+/** Decodes the buffered frames and commits the whole hypothesis, call once the audio has ended */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaWhisperStreamFlush(OgaWhisperStream*);
+
+/**
+ * Appends the tokens committed since the last call to 'sequences' as a new sequence. Can be called while another thread
+ * adds features.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaWhisperStreamGetNewTokens(OgaWhisperStream*, OgaSequences* sequences);
+
+/** Appends every token committed so far to 'sequences' as a new sequence */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaWhisperStreamGetTranscript(const OgaWhisperStream*, OgaSequences* sequences);
+
+/**
+ * Enables energy based voice activity detection for the frames added after this call. A frame is silent when its mean
+ * is more than 'silence_threshold' below the loudest frame seen so far (Whisper's features span 2.0, which is 80 dB).
+ * A run of more than 'min_silence_frames' silent frames ends the segment, and only 'padding_frames' silent frames are
+ * kept before and after speech, so long silences are never encoded.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaWhisperStreamSetVoiceActivity(OgaWhisperStream*, float silence_threshold, size_t min_silence_frames,
+                                                                    size_t padding_frames);
+
+/** Returns the number of segments completed so far, their tokens make up the transcript */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaWhisperStreamGetSegmentCount(const OgaWhisperStream*, size_t* out);
+
+/**
+ * Returns the frames [begin_frame, end_frame) of completed segment 'index', counted from the first frame added (Whisper's
+ * frames are 10ms), and appends its tokens to 'tokens' as a new sequence
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaWhisperStreamGetSegment(const OgaWhisperStream*, size_t index, size_t* begin_frame, size_t* end_frame,
+                                                              OgaSequences* tokens);
+
 /** Create an OgaTensor from a user owned buffer. The OgaTensor does not own the memory (as it has no way to free it) so
  * the 'data' parameter must be valid for the lifetime of the OgaTensor.
  *
@@ -447,6 +954,20 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerStreamDecode(OgaTokenizerStream*,
  * \param[out] out Writes the newly created OgaTensor into this, must be destroyed with OgaDestroyTensor
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateTensorFromBuffer(void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type, OgaTensor** out);
+
+/** Create an OgaTensor from a user owned buffer in device memory, for example the output of another CUDA or DML
+ * pipeline, so it can be passed to OgaGeneratorParamsSetInputs/OgaGenerator_SetModelInput without a copy through the
+ * CPU. As with OgaCreateTensorFromBuffer, the OgaTensor does not own the memory.
+ *
+ * \param[in] data User supplied memory pointer on the device, must remain valid for lifetime of the OgaTensor
+ * \param[in] shape_dims Pointer to array of int64_t values that define the tensor shape
+ * \param[in] shape_dims_count Count of elements in the shape_dims array
+ * \param[in] element_type The data type that 'data' points to.
+ * \param[in] device_type The device 'data' lives on: "cpu", "cuda" or "dml"
+ * \param[in] device_id The index of the device 'data' lives on, ignored for "cpu"
+ * \param[out] out Writes the newly created OgaTensor into this, must be destroyed with OgaDestroyTensor
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateTensorFromDeviceBuffer(void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type, const char* device_type, int device_id, OgaTensor** out);
 OGA_EXPORT void OGA_API_CALL OgaDestroyTensor(OgaTensor* tensor);
 
 /** Get the OgaElementType of the data stored in the OgaTensor
@@ -500,6 +1021,15 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaStringArrayAddString(OgaStringArray* strin
  */
 OGA_EXPORT size_t OGA_API_CALL OgaStringArrayGetCount(const OgaStringArray* string_array);
 
+/**
+ * \brief Gets the string at the given index of the string_array.
+ * \param[in] string_array The OgaStringArray object to get the string from.
+ * \param[in] index The index of the string.
+ * \param[out] out The null terminated string. Valid until the string_array is modified or destroyed.
+ * \return The result of the operation. If the operation is successful, a nullptr is returned.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaStringArrayGetString(const OgaStringArray* string_array, size_t index, const char** out);
+
 /**
  * \brief Creates the OgaAdapters object that manages the adapters.
           - The OgaAdapters object is used to load all the model adapters.
@@ -518,6 +1048,8 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyAdapters(OgaAdapters* adapters);
  * \param[in] adapter_file_path The file path of the adapter to load.
  * \param[in] adapter_name A unique identifier for the adapter chosed by the function invoker.
  *                         This name is used for querying the adapter.
+ *        The adapter is loaded in the background. If it doesn't fit in the memory limit, it is only loaded when it is
+ *        first used or prefetched.
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaLoadAdapter(OgaAdapters* adapters, const char* adapter_file_path,
                                                   const char* adapter_name);
@@ -530,6 +1062,39 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaLoadAdapter(OgaAdapters* adapters, const c
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaUnloadAdapter(OgaAdapters* adapters, const char* adapter_name);
 
+/**
+ * \brief Starts loading the adapter in the background if it isn't resident, so that a later OgaSetActiveAdapter
+ *        doesn't wait for it. Unused adapters are evicted to keep within the memory limit, the prefetched adapter
+ *        itself is pinned and isn't evicted until it is next set active. Call it when a request is queued, so the
+ *        adapter load overlaps with the wait instead of adding to the time to first token.
+ * \param[in] adapters The OgaAdapters object that manages the model adapters.
+ * \param[in] adapter_name The name of the adapter to prefetch.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaPrefetchAdapter(OgaAdapters* adapters, const char* adapter_name);
+
+/**
+ * \brief Checks if the adapter is loaded, so setting it active won't wait for it to load.
+ * \param[in] adapters The OgaAdapters object that manages the model adapters.
+ * \param[in] adapter_name The name of the adapter to check.
+ * \param[out] out True if the adapter is loaded.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaIsAdapterReady(const OgaAdapters* adapters, const char* adapter_name, bool* out);
+
+/**
+ * \brief Limits the memory used by the resident adapters. When the limit is reached, the least recently used adapters
+ *        that no generator has active are evicted, and loaded again the next time they are used.
+ * \param[in] adapters The OgaAdapters object that manages the model adapters.
+ * \param[in] bytes The memory limit in bytes, 0 (the default) is unlimited.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaSetAdaptersMemoryLimit(OgaAdapters* adapters, size_t bytes);
+
+/**
+ * \brief Returns the memory used by the resident adapters, as counted against the memory limit.
+ * \param[in] adapters The OgaAdapters object that manages the model adapters.
+ * \param[out] out The memory usage in bytes.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaAdaptersGetMemoryUsage(const OgaAdapters* adapters, size_t* out);
+
 /**
  * \brief Sets the adapter with the given adapter name as active for the given OgaGenerator object.
  * \param[in] generator The OgaGenerator object to set the active adapter.
@@ -538,6 +1103,95 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaUnloadAdapter(OgaAdapters* adapters, const
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaSetActiveAdapter(OgaGenerator* generator, OgaAdapters* adapters,
                                                        const char* adapter_name);
+
+/**
+ * \brief Creates a request, a single sequence generated by an OgaEngine. The params must have a batch_size of 1 and
+ *        num_beams of 1, the request keeps them alive.
+ * \param[in] params The search options of the request.
+ * \param[out] out The created request. Must be destroyed with OgaDestroyRequest, the engine keeps it alive while it runs.
+ * \return OgaResult containing the error message if the creation failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateRequest(const OgaGeneratorParams* params, OgaRequest** out);
+
+/**
+ * \brief Destroys the given request.
+ */
+OGA_EXPORT void OGA_API_CALL OgaDestroyRequest(OgaRequest* request);
+
+/**
+ * \brief Sets the priority of the request, the default is OgaRequestPriority_Interactive. Must be called before the
+ *        request is added to an engine.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaRequest_SetPriority(OgaRequest* request, OgaRequestPriority priority);
+
+/**
+ * \brief Adds prompt tokens to the request, must be called before the request is added to an engine.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaRequest_AddTokens(OgaRequest* request, const int32_t* tokens, size_t token_count);
+
+/**
+ * \brief Returns true once the request finished generating or was cancelled. Its last tokens may still be unseen.
+ */
+OGA_EXPORT bool OGA_API_CALL OgaRequest_IsDone(const OgaRequest* request);
+
+/**
+ * \brief Cancels the request, it leaves the engine on the next OgaEngine_Step.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaRequest_Cancel(OgaRequest* request);
+
+/**
+ * \brief Returns the tokens generated since the last call, as a single sequence. Safe to call while the engine is stepping
+ *        on another thread.
+ * \param[out] out The tokens. Must be destroyed with OgaDestroySequences.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaRequest_GetUnseenTokens(OgaRequest* request, OgaSequences** out);
+
+/**
+ * \brief Creates an engine that generates many independent requests against one model, with up to max_active_requests
+ *        of them in flight. Requests become active on the first step after they're added and leave as soon as they're
+ *        done. The decoding requests are stepped as one batch that requests join and leave between steps, requests
+ *        with options that can't be batched (e.g. guidance or stop sequences) run their own generators in parallel.
+ * \param[in] model The model the requests run on, the engine keeps it alive.
+ * \param[in] max_active_requests The number of requests that run at once, 1 or greater.
+ * \param[out] out The created engine. Must be destroyed with OgaDestroyEngine.
+ * \return OgaResult containing the error message if the creation failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateEngine(const OgaModel* model, int max_active_requests, OgaEngine** out);
+
+/**
+ * \brief Destroys the given engine.
+ */
+OGA_EXPORT void OGA_API_CALL OgaDestroyEngine(OgaEngine* engine);
+
+/**
+ * \brief Queues the request, it's admitted on the next OgaEngine_Step that has room for it. Can be called from any thread.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaEngine_AddRequest(OgaEngine* engine, OgaRequest* request);
+
+/**
+ * \brief Admits queued requests, then generates one token for every active request and retires the finished ones.
+ *        Must be called from one thread at a time.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaEngine_Step(OgaEngine* engine);
+
+/**
+ * \brief Returns true while the engine has queued or active requests. Can be called from any thread.
+ */
+OGA_EXPORT bool OGA_API_CALL OgaEngine_HasPendingRequests(const OgaEngine* engine);
+OGA_EXPORT size_t OGA_API_CALL OgaEngine_GetActiveRequestCount(const OgaEngine* engine);
+OGA_EXPORT size_t OGA_API_CALL OgaEngine_GetQueuedRequestCount(const OgaEngine* engine);  // Including the preempted requests
+
+/**
+ * \brief Scheduler limits, set them before the engine first steps. 0, the default, is no limit for each of them.
+ *        - Token budget: requests are only admitted while the tokens of the active requests stay within it.
+ *        - Step token budget: the tokens each step runs, long prompts are prefilled in chunks over several steps.
+ *        - Key-value cache budget: the bytes the key-value caches may take before requests are preempted.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaEngine_SetTokenBudget(OgaEngine* engine, size_t tokens);
+OGA_EXPORT OgaResult* OGA_API_CALL OgaEngine_SetStepTokenBudget(OgaEngine* engine, size_t tokens);
+OGA_EXPORT OgaResult* OGA_API_CALL OgaEngine_SetKeyValueCacheBudget(OgaEngine* engine, size_t bytes);
+OGA_EXPORT OgaResult* OGA_API_CALL OgaEngine_SetPreemptionMode(OgaEngine* engine, OgaPreemptionMode mode);
+
 #ifdef __cplusplus
 }
 #endif
@@ -15,9 +15,11 @@ import numpy as np
 import torch
 
 import argparse
+import fnmatch
 import gc
 import json
 import os
+import re
 import textwrap
 
 
@@ -37,10 +39,19 @@ class Model:
 
         self.model_name_or_path = config._name_or_path
         self.model_type = config.architectures[0]
-        self.io_dtype = io_dtype      # {'fp16', 'fp32'}
-        self.onnx_dtype = onnx_dtype  # {"int4", "fp16", "fp32"}
+        self.io_dtype = io_dtype      # {'fp16', 'bf16', 'fp32'}
+        self.onnx_dtype = onnx_dtype  # {"int4", "fp16", "bf16", "fp32"}
         self.quant_type = config.quantization_config["quant_method"] if hasattr(config, "quantization_config") else None
         self.adapter_path = extra_options.get("adapter_path", None)
+        # Comma separated adapter paths make a multi-LoRA model: the adapters' weights are stacked and every sequence of a
+        # batch selects its own adapter (or 0 for the base model) through the adapter_ids input
+        self.adapter_paths = self.adapter_path.split(",") if self.adapter_path is not None else []
+        self.adapter_names = [os.path.basename(os.path.normpath(path)) for path in self.adapter_paths]
+        self.multi_lora = len(self.adapter_paths) > 1
+        # A merged adapter is folded into the base weights (before they are quantized), so the model has no LoRA subgraphs
+        self.merge_adapter = extra_options.get("merge_adapter", False)
+        if self.merge_adapter and self.quant_type is not None:
+            raise NotImplementedError(f"An adapter can't be merged into the {self.quant_type} quantized weights of a pre-quantized model.")
 
         self.cache_dir = cache_dir
         self.filename = extra_options.get("filename", "model.onnx")
@@ -87,6 +98,7 @@ class Model:
             "past_key_values.value": ["batch_size", self.num_kv_heads, "past_sequence_length", self.head_size],  # For standard models (note that `past_key_values.value` is written this way to match Hugging Face format)
         }
         self.exclude_embeds = extra_options.get("exclude_embeds", False)
+        self.int32_inputs = extra_options.get("int32_inputs", True)  # Feed input_ids, attention_mask, and position_ids as int32 (the runtime's native type) instead of int64
         if self.exclude_embeds:
             self.input_names = [name.replace("input_ids", "inputs_embeds") for name in self.input_names]
 
@@ -104,13 +116,60 @@ class Model:
             "present.key": ["batch_size", self.num_kv_heads, "total_sequence_length", self.head_size],           # For standard models (note that `present.key` is written this way to match Hugging Face format)
             "present.value": ["batch_size", self.num_kv_heads, "total_sequence_length", self.head_size],         # For standard models (note that `present.value` is written this way to match Hugging Face format)
         }
+        # KV cache quantization (past/present are stored as 8-bit values and (de)quantized around the attention op with per-head scales)
+        self.kv_cache_quant_type = extra_options.get("kv_cache_quant_type", None)
+        if self.kv_cache_quant_type is not None:
+            if self.kv_cache_quant_type not in {"int8", "fp8"}:
+                raise ValueError(f"kv_cache_quant_type must be 'int8' or 'fp8', not '{self.kv_cache_quant_type}'")
+            kv_dtype = TensorProto.INT8 if self.kv_cache_quant_type == "int8" else TensorProto.FLOAT8E4M3FN
+            self.input_types["past_key_values.key"] = self.input_types["past_key_values.value"] = kv_dtype
+            self.output_types["present.key"] = self.output_types["present.value"] = kv_dtype
+            # int8 has no exponent, so the default scale maps [-8, 8] onto it. FP8 E4M3 covers [-448, 448] on its own.
+            self.kv_cache_scale = float(extra_options.get("kv_cache_scale", 1 / 16 if self.kv_cache_quant_type == "int8" else 1.0))
+
         self.exclude_lm_head = extra_options.get("exclude_lm_head", False)
         self.include_hidden_states = extra_options.get("include_hidden_states", False)
+        # Tied embeddings are saved once, transposed like the LM head's MatMul weight, and the embedding gathers its columns.
+        # The int4 LM head is quantized from its own copy, the embedding stays in io_dtype.
+        self.tie_embeddings = getattr(config, "tie_word_embeddings", False) and onnx_dtype in {"fp16", "bf16", "fp32"} and not self.exclude_embeds and not self.exclude_lm_head
+        self.embed_tokens_weight = None  # The embedding's weight when it is tied, see make_embedding
         if self.exclude_lm_head:
             self.output_names = [name.replace("logits", "hidden_states") for name in self.output_names]
         elif self.include_hidden_states:
             self.output_names = ["hidden_states"] + self.output_names
 
+        # Last token logits (the hidden state of each sequence's last token is gathered before the LM head, so the prompt only produces [batch_size, 1, vocab_size] logits)
+        self.last_token_logits = extra_options.get("last_token_logits", False)
+        if self.last_token_logits:
+            self.input_names.append("last_token_indices")
+            self.input_types["last_token_indices"] = TensorProto.INT64                                          # For models that only compute the logits of the last token
+            self.input_shapes["last_token_indices"] = ["batch_size"]                                             # For models that only compute the logits of the last token
+            self.output_shapes["logits"] = ["batch_size", 1, self.vocab_size]
+
+        # Top k logits (a TopK node after the LM head keeps the best scores of each token and their token ids, so the full vocabulary logits never leave the model)
+        self.logits_top_k = int(extra_options.get("logits_top_k", 0))
+        if self.logits_top_k > 0:
+            self.output_names = [name for name in self.output_names if name != "logits"] + ["logits_top_k_values", "logits_top_k_indices"]
+            self.output_types["logits_top_k_values"] = self.io_dtype                                             # For models with a top k logits head
+            self.output_types["logits_top_k_indices"] = TensorProto.INT64                                        # For models with a top k logits head
+            top_k_shape = self.output_shapes["logits"][:2] + [self.logits_top_k]
+            self.output_shapes["logits_top_k_values"] = self.output_shapes["logits_top_k_indices"] = top_k_shape
+
+        # Early exit head (the residual stream after layer exit_layer also goes through the final norm and the LM head, so the runtime can draft tokens from it)
+        self.exit_layer = int(extra_options.get("exit_layer", -1))
+        self.exit_attrs = {}
+        if self.exit_layer >= 0:
+            if self.exit_layer >= self.num_layers - 1:
+                raise ValueError(f"exit_layer must be less than the last layer ({self.num_layers - 1}), is {self.exit_layer}")
+            self.output_names.append("exit_logits")
+            self.output_types["exit_logits"] = self.io_dtype                                                     # For models with an early exit head
+            self.output_shapes["exit_logits"] = ["batch_size", "sequence_length", self.vocab_size]               # For models with an early exit head
+
+        if self.multi_lora:
+            self.input_names.append("adapter_ids")
+            self.input_types["adapter_ids"] = TensorProto.INT32                                                  # For multi-LoRA models
+            self.input_shapes["adapter_ids"] = ["batch_size"]                                                    # For multi-LoRA models
+
         # Store names of nodes already created
         self.node_names = set()
 
@@ -122,6 +181,10 @@ class Model:
             TensorProto.FLOAT16: np.float16,
             TensorProto.FLOAT: np.float32,
         }
+        if self.io_dtype == TensorProto.BFLOAT16:
+            # NumPy has no bfloat16, the ml_dtypes one (an onnx dependency) is used instead
+            import ml_dtypes
+            self.to_numpy_dtype[TensorProto.BFLOAT16] = ml_dtypes.bfloat16
 
         # Map TensorProto dtypes to string dtypes
         self.to_str_dtype = {
@@ -129,6 +192,7 @@ class Model:
             TensorProto.INT32: "TensorProto.INT32",
             TensorProto.INT64: "TensorProto.INT64",
             TensorProto.FLOAT16: "TensorProto.FLOAT16",
+            TensorProto.BFLOAT16: "TensorProto.BFLOAT16",
             TensorProto.FLOAT: "TensorProto.FLOAT",
         }
 
@@ -141,6 +205,7 @@ class Model:
             "block_row_indices": "",    # Row indices of CSR format of block mask (used as input to SparseAttention)
             "block_col_indices": "",    # Col indices of CSR format of block mask (used as input to SparseAttention)
             "key_total_seq_lens": "",   # Sum of each row in attention mask (used as input to SparseAttention)
+            "key_padding_mask": "",     # 2D attention mask as int32 (used as input to MultiHeadAttention with a cache indirection table)
         }
 
         # Embedding-specific variables
@@ -163,7 +228,7 @@ class Model:
         }
 
         # MatMul-specific variables
-        is_lora = hasattr(config, "peft_type") and config.peft_type == "LORA"
+        is_lora = hasattr(config, "peft_type") and config.peft_type == "LORA" and not self.merge_adapter
         self.matmul_attrs = {
             "use_lora": is_lora,        # Use LoRA/QLoRA format
         }
@@ -244,10 +309,12 @@ class Model:
         valid_gqa_configurations = [
             ("cpu", TensorProto.FLOAT),
             ("cuda", TensorProto.FLOAT16),
+            ("cuda", TensorProto.BFLOAT16),
             ("rocm", TensorProto.FLOAT16),
             ("dml", TensorProto.FLOAT16),
         ]
-        if (self.ep, self.io_dtype) in valid_gqa_configurations:
+        self.use_cache_indirection = extra_options.get("use_cache_indirection", False)
+        if (self.ep, self.io_dtype) in valid_gqa_configurations and not self.use_cache_indirection:
             # Change model settings for GroupQueryAttention
             self.attention_attrs["op_type"] = "GroupQueryAttention"
             print("GroupQueryAttention (GQA) is used in this model.")
@@ -262,6 +329,49 @@ class Model:
                 self.input_names.remove("position_ids")
 
         self.past_present_share_buffer = self.attention_attrs["op_type"] == "GroupQueryAttention"
+        if self.use_cache_indirection:
+            # MultiHeadAttention reads the past KV cache of each beam through a cache indirection table, so beam search
+            # never reorders the KV cache. This requires the past and present KV caches to share one buffer.
+            if self.num_attn_heads != self.num_kv_heads:
+                raise NotImplementedError("use_cache_indirection is not supported when the KV cache is repeated for MultiHeadAttention.")
+            self.past_present_share_buffer = True
+            self.input_names += ["past_sequence_length", "cache_indirection"]
+            self.input_types["past_sequence_length"] = TensorProto.INT32                                         # For models that read the KV cache through a cache indirection table
+            self.input_types["cache_indirection"] = TensorProto.INT32                                            # For models that read the KV cache through a cache indirection table
+            self.input_shapes["past_sequence_length"] = [1]                                                      # For models that read the KV cache through a cache indirection table
+            self.input_shapes["cache_indirection"] = ["num_sequences", "beam_width", "max_sequence_length"]      # For models that read the KV cache through a cache indirection table
+        if self.kv_cache_quant_type is not None and self.past_present_share_buffer:
+            # The attention op reads the dequantized past and writes an unquantized present, so they can't share a buffer
+            print(f"WARNING: kv_cache_quant_type={self.kv_cache_quant_type} disables past-present buffer sharing. The runtime keeps separate 8-bit past and present KV caches of the current length instead of one max_length buffer in {TensorProto.DataType.Name(self.io_dtype).lower()}.")
+            self.past_present_share_buffer = False
+        # GroupQueryAttention only reads the sequence lengths of the 2D attention mask, so the runtime can update those
+        # directly instead of rebuilding the mask on every step
+        seqlens_k_supported = self.attention_attrs["op_type"] == "GroupQueryAttention" and self.past_present_share_buffer and self.attention_attrs["block_sparse"]["sparse_block_size"] == 0
+        self.use_seqlens_k_inputs = extra_options.get("use_seqlens_k_inputs", False)
+        if self.use_seqlens_k_inputs:
+            if not seqlens_k_supported:
+                raise NotImplementedError("use_seqlens_k_inputs requires GroupQueryAttention with past_present_share_buffer and is not supported with sparse attention.")
+            self.input_names.remove("attention_mask")
+            self.input_names += ["seqlens_k", "total_sequence_length"]
+            self.input_types["seqlens_k"] = TensorProto.INT32                                                    # For GroupQueryAttention models that take the sequence lengths instead of the attention mask
+            self.input_types["total_sequence_length"] = TensorProto.INT32                                        # For GroupQueryAttention models that take the sequence lengths instead of the attention mask
+            self.input_shapes["seqlens_k"] = ["batch_size"]                                                      # For GroupQueryAttention models that take the sequence lengths instead of the attention mask
+            self.input_shapes["total_sequence_length"] = [1]                                                     # For GroupQueryAttention models that take the sequence lengths instead of the attention mask
+
+        # Paged KV cache (past and present are one pool of fixed-size blocks shared by all sequences, and a block table lists the blocks of each sequence)
+        self.kv_layout = extra_options.get("kv_layout", "contiguous")
+        if self.kv_layout not in {"contiguous", "paged"}:
+            raise ValueError(f"kv_layout must be 'contiguous' or 'paged', not '{self.kv_layout}'")
+        self.kv_block_size = int(extra_options.get("kv_block_size", 16))
+        if self.kv_layout == "paged":
+            if self.attention_attrs["op_type"] != "GroupQueryAttention" or self.attention_attrs["block_sparse"]["sparse_block_size"] != 0 or self.kv_cache_quant_type is not None:
+                raise NotImplementedError("kv_layout=paged requires GroupQueryAttention and is not supported with sparse attention or kv_cache_quant_type.")
+            self.input_names.append("block_table")
+            self.input_types["block_table"] = TensorProto.INT32                                                  # For models with a paged KV cache
+            self.input_shapes["block_table"] = ["batch_size", "max_blocks_per_sequence"]                         # For models with a paged KV cache
+            kv_pool_shape = ["num_blocks", self.num_kv_heads, self.kv_block_size, self.head_size]
+            self.input_shapes["past_key_values.key"] = self.input_shapes["past_key_values.value"] = kv_pool_shape
+            self.output_shapes["present.key"] = self.output_shapes["present.value"] = kv_pool_shape
 
         # MLP-specific variables
         self.mlp_attrs = {
@@ -299,6 +409,9 @@ class Model:
                 "block_size": int(extra_options.get("int4_block_size", 32)),
                 "is_symmetric": extra_options.get("int4_is_symmetric", True),
                 "op_types_to_quantize": extra_options.get("int4_op_types_to_quantize", ("MatMul", )),
+                "mixed_precision": extra_options.get("int4_mixed_precision", False),                            # Keep sensitive MatMuls at int8 and pick block sizes per MatMul
+                "mixed_precision_tolerance": float(extra_options.get("int4_mixed_precision_tolerance", 1.0)),
+                "overrides": {},                                                                                 # Bits and block size per MatMul name pattern
             },
             "use_qdq": extra_options.get("use_qdq", False),           # Use QDQ format
         }
@@ -307,6 +420,12 @@ class Model:
             self.quant_attrs["bits"] = config.quantization_config["bits"]
             self.quant_attrs["group_size"] = config.quantization_config["group_size"]
             self.quant_attrs["use_g_idx"] = config.quantization_config["desc_act"] if "desc_act" in config.quantization_config else False
+        if "int4_quant_overrides" in extra_options:
+            with open(extra_options["int4_quant_overrides"]) as f:
+                self.quant_attrs["int4"]["overrides"] = json.load(f)
+            for pattern, override in self.quant_attrs["int4"]["overrides"].items():
+                if override.get("bits", 4) not in {4, 8}:
+                    raise ValueError(f"The bits of '{pattern}' in int4_quant_overrides must be 4 or 8, not {override['bits']}")
 
     def make_genai_config(self, model_name_or_path, extra_kwargs, out_dir):
         try:
@@ -324,9 +443,6 @@ class Model:
             "present_key_names": "present.%d.key",
             "present_value_names": "present.%d.value",
         })
-        if "hidden_states" in outputs:
-            # Remove 'hidden_states' from 'outputs' entry in config since ORT GenAI doesn't use it
-            del outputs["hidden_states"]
 
         genai_config = {
             "model": {
@@ -359,6 +475,7 @@ class Model:
                 "max_length": self.context_length,
                 "min_length": 0,
                 "no_repeat_ngram_size": config.no_repeat_ngram_size if hasattr(config, "no_repeat_ngram_size") else 0,
+                "num_beam_groups": config.num_beam_groups if hasattr(config, "num_beam_groups") else 1,
                 "num_beams": config.num_beams if hasattr(config, "num_beams") else 1,
                 "num_return_sequences": config.num_return_sequences if hasattr(config, "num_return_sequences") else 1,
                 "past_present_share_buffer": False if "config_only" in self.extra_options else self.past_present_share_buffer,
@@ -373,6 +490,38 @@ class Model:
             ep_options = { self.ep : self.ep_attrs[self.ep] }
             genai_config["model"]["decoder"]["session_options"]["provider_options"].append(ep_options)
 
+        if self.kv_cache_quant_type is not None:
+            genai_config["model"]["decoder"]["kv_cache_quantization"] = { "type": self.kv_cache_quant_type }
+
+        if self.kv_layout == "paged":
+            genai_config["model"]["decoder"]["paged_kv_cache"] = { "block_size": self.kv_block_size }
+
+        if self.multi_lora:
+            genai_config["model"]["decoder"]["adapter_names"] = self.adapter_names
+
+        if self.logits_top_k > 0:
+            genai_config["model"]["decoder"]["logits_top_k"] = self.logits_top_k
+
+        # DML models always use the long LongRoPE caches (see make_rotary_embedding_multi_cache)
+        if "rescale_inv_freq" not in self.rotemb_attrs and ("multi_cache" not in self.rotemb_attrs or self.ep != "dml"):
+            # The rotary embedding of the cached keys, so cached entries can be re-encoded at other positions (position-linear RoPE only)
+            genai_config["model"]["decoder"]["rotary_embedding"] = {
+                "theta": self.rotemb_attrs["theta"],
+                "dim": int(self.rotemb_attrs["partial_rotary_factor"] * self.head_size),
+                "interleaved": bool(self.rotemb_attrs["interleaved"]),
+                "position_scale": self.rotemb_attrs["position_scale"] if self.context_length == self.original_context_length else 1,
+            }
+            if "multi_cache" in self.rotemb_attrs:
+                # The model switches from the short to the long factors past original_context_length, the runtime re-encodes the cached keys then
+                multi_cache = self.rotemb_attrs["multi_cache"]
+                genai_config["model"]["decoder"]["rotary_embedding"].update({
+                    "short_factor": [float(factor) for factor in multi_cache["short_factor"]],
+                    "long_factor": [float(factor) for factor in multi_cache["long_factor"]],
+                    "short_mscale": float(multi_cache["short_mscale"]),
+                    "long_mscale": float(multi_cache["long_mscale"]),
+                    "original_context_length": self.original_context_length,
+                })
+
         if self.extra_options.get("include_prompt_templates", False):
             prompt_templates = self._get_prompt_templates(model_name_or_path, extra_kwargs)
             if prompt_templates is not None:
@@ -415,9 +564,12 @@ class Model:
         print(f"Saving ONNX model in {out_dir}")
         gc.collect()
 
+        if self.int32_inputs:
+            self.make_int32_inputs()
+
         # Create ONNX model
         model = helper.make_model(
-            opset_imports=[self.clear_field(helper.make_operatorsetid('', 21 if self.quant_attrs["use_qdq"] else 14), 'domain'), helper.make_operatorsetid('com.microsoft', 1)],
+            opset_imports=[self.clear_field(helper.make_operatorsetid('', 21 if self.quant_attrs["use_qdq"] or self.kv_cache_quant_type == "fp8" or self.uses_int4_plan() else 14), 'domain'), helper.make_operatorsetid('com.microsoft', 1)],
             ir_version=7,
             producer_name="onnxruntime-genai",
             producer_version="0.0.0",
@@ -470,17 +622,106 @@ class Model:
         )
 
     def to_int4(self, model):
-        quant = MatMul4BitsQuantizer(
-            model=model,
-            block_size=self.quant_attrs["int4"]["block_size"],
-            is_symmetric=self.quant_attrs["int4"]["is_symmetric"],
-            accuracy_level=self.quant_attrs["int4"]["accuracy_level"],
-            nodes_to_exclude=[],
-            quant_format=QuantFormat.QDQ if self.quant_attrs["use_qdq"] else QuantFormat.QOperator,
-            op_types_to_quantize=self.quant_attrs["int4"]["op_types_to_quantize"],
-        )
-        quant.process()
-        return quant.model.model
+        plan = self.make_int4_plan(model) if self.uses_int4_plan() else {}
+        int8_names = [name for name, config in plan.items() if config["bits"] == 8]
+        if int8_names:
+            self.to_int8_matmuls(model, int8_names)
+
+        # One quantizer pass per block size, the MatMuls planned with the other block sizes (or int8) are excluded from it
+        default_block_size = self.quant_attrs["int4"]["block_size"]
+        block_sizes = {name: config["block_size"] for name, config in plan.items() if config["bits"] == 4}
+        for block_size in [default_block_size] + sorted(set(block_sizes.values()) - {default_block_size}):
+            quant = MatMul4BitsQuantizer(
+                model=model,
+                block_size=block_size,
+                is_symmetric=self.quant_attrs["int4"]["is_symmetric"],
+                accuracy_level=self.quant_attrs["int4"]["accuracy_level"],
+                nodes_to_exclude=int8_names + [name for name, size in block_sizes.items() if size != block_size],
+                quant_format=QuantFormat.QDQ if self.quant_attrs["use_qdq"] else QuantFormat.QOperator,
+                op_types_to_quantize=self.quant_attrs["int4"]["op_types_to_quantize"] if block_size == default_block_size else ("MatMul", ),
+            )
+            quant.process()
+            model = quant.model.model
+        return model
+
+    def uses_int4_plan(self):
+        return self.onnx_dtype == "int4" and (self.quant_attrs["int4"]["mixed_precision"] or len(self.quant_attrs["int4"]["overrides"]) > 0)
+
+    def make_int4_plan(self, model):
+        # Bits and block size of every MatMul with a constant weight
+        if "MatMul" not in self.quant_attrs["int4"]["op_types_to_quantize"]:
+            return {}
+        initializers = {tensor.name: tensor for tensor in model.graph.initializer}
+        matmuls = [node for node in model.graph.node if node.op_type == "MatMul" and node.input[1] in initializers]
+        default_block_size = self.quant_attrs["int4"]["block_size"]
+        plan = {node.name: {"bits": 4, "block_size": default_block_size} for node in matmuls}
+
+        if self.quant_attrs["int4"]["mixed_precision"]:
+            # The first and last layers and the attention output projections are the most sensitive to quantization, they stay at int8
+            errors = {}
+            for node in matmuls:
+                layer_match = re.match(r"/model/layers\.(\d+)/", node.name)
+                layer_id = int(layer_match.group(1)) if layer_match else None
+                if layer_id in {0, self.num_layers - 1} or "/attn/o_proj/" in node.name:
+                    plan[node.name]["bits"] = 8
+                else:
+                    weight = numpy_helper.to_array(initializers[node.input[1]])
+                    errors[node.name] = {size: self.get_int4_error(weight, size) for size in sorted({16, 32, 128, default_block_size})}
+
+            # Calibrate the block sizes on the weights: each MatMul gets the largest block size that is as accurate as the median
+            # MatMul at the default block size (times the tolerance), else the smallest block size
+            if errors:
+                target = np.median([error[default_block_size] for error in errors.values()]) * self.quant_attrs["int4"]["mixed_precision_tolerance"]
+                for name, error in errors.items():
+                    plan[name]["block_size"] = next((size for size in sorted(error, reverse=True) if error[size] <= target), min(error))
+
+        # int4_quant_overrides (e.g. from an activation-aware calibration pass) apply last
+        for pattern, override in self.quant_attrs["int4"]["overrides"].items():
+            for name in fnmatch.filter(plan.keys(), pattern):
+                plan[name].update(override)
+
+        print(f"Quantizing {sum(config['bits'] == 8 for config in plan.values())} of {len(plan)} MatMuls to int8, block sizes of the int4 MatMuls: {sorted({config['block_size'] for config in plan.values() if config['bits'] == 4})}")
+        return plan
+
+    def get_int4_error(self, weight, block_size):
+        # Relative RMS error of a symmetric int4 round trip with blocks along the input dimension, like MatMulNBits
+        weight = weight.astype(np.float32)
+        padded = np.pad(weight, ((0, -weight.shape[0] % block_size), (0, 0))).reshape(-1, block_size, weight.shape[1])
+        scale = np.abs(padded).max(axis=1, keepdims=True) / 7
+        scale[scale == 0] = 1
+        dequantized = np.clip(np.round(padded / scale), -8, 7) * scale
+        return np.sqrt(np.sum((dequantized - padded) ** 2) / max(np.sum(padded ** 2), np.finfo(np.float32).tiny))
+
+    def to_int8_matmuls(self, model, names):
+        # Weight-only int8 MatMuls with a symmetric scale per output channel (int8 weight --> DequantizeLinear --> MatMul)
+        initializers = {tensor.name: tensor for tensor in model.graph.initializer}
+        names = set(names)
+        nodes = []
+        for node in model.graph.node:
+            if node.name in names:
+                weight = numpy_helper.to_array(initializers[node.input[1]])
+                scale = np.abs(weight).max(axis=0) / 127
+                scale[scale == 0] = 1
+                qweight = np.clip(np.round(weight / scale), -127, 127).astype(np.int8)
+
+                basename = node.name[1:].replace("/", ".")
+                qweight_tensor = self.array_to_tensor(qweight, name=f"{basename}.qweight")
+                scale_tensor = self.array_to_tensor(scale.astype(weight.dtype), name=f"{basename}.scales")
+                model.graph.initializer.extend([qweight_tensor, scale_tensor])
+
+                dq_name = f"{node.name}/DequantizeLinear"
+                dq_output = f"{dq_name}/output_0"
+                nodes.append(helper.make_node("DequantizeLinear", inputs=[qweight_tensor.name, scale_tensor.name], outputs=[dq_output], name=dq_name, axis=1))
+                node.input[1] = dq_output
+            nodes.append(node)
+
+        # Drop the float weights that no node reads anymore
+        used = {name for node in nodes for name in node.input}
+        weights = [tensor for tensor in model.graph.initializer if tensor.name in used]
+        del model.graph.initializer[:]
+        model.graph.initializer.extend(weights)
+        del model.graph.node[:]
+        model.graph.node.extend(nodes)
 
     def clear_field(self, proto, field):
         proto.ClearField(field)
@@ -490,8 +731,21 @@ class Model:
         order = list(order)
         repeated_proto.sort(key=lambda x: order.index(getattr(x, key_name)))
 
+    def array_to_tensor(self, np_data, name=None):
+        # numpy_helper.from_array does not accept the ml_dtypes bfloat16 type in every onnx version, so its raw bits are stored directly
+        if np_data.dtype.name == "bfloat16":
+            return helper.make_tensor(name or "", TensorProto.BFLOAT16, np_data.shape, np_data.view(np.uint16).tobytes(), raw=True)
+        return numpy_helper.from_array(np_data, name=name)
+
+    def get_dtype_min(self, onnx_dtype):
+        np_dtype = self.to_numpy_dtype[onnx_dtype]
+        if onnx_dtype == TensorProto.BFLOAT16:
+            import ml_dtypes
+            return ml_dtypes.finfo(np_dtype).min
+        return np.finfo(np_dtype).min
+
     def make_external_tensor(self, np_data, name, unpack_int4=False, **kwargs):
-        tensor = numpy_helper.from_array(np_data)
+        tensor = self.array_to_tensor(np_data)
         tensor.name = name
 
         filename = f"{name}.bin"
@@ -580,7 +834,7 @@ class Model:
         path = name.split("/")
         onnx_dtype, dims, num = eval(path[-3]), path[-2], eval(path[-1])
         np_dtype = self.to_numpy_dtype[onnx_dtype]
-        value = numpy_helper.from_array(np.array(num if dims == "0D" else list(num) if type(num) == tuple else [num], dtype=np_dtype), name=name.replace("constants", "numpy_helper"))
+        value = self.array_to_tensor(np.array(num if dims == "0D" else list(num) if type(num) == tuple else [num], dtype=np_dtype), name=name.replace("constants", "numpy_helper"))
 
         node_name = name.replace("constants", "constant_nodes")
         self.make_node("Constant", inputs=[], outputs=[name], name=node_name, value=value)
@@ -672,6 +926,30 @@ class Model:
         self.make_node("ReduceMax", inputs=inputs, outputs=[output], name=name, keepdims=False)
         self.make_value_info(output, dtype, shape=shape)
 
+    def make_int32_inputs(self):
+        # Change the int64 input_ids, attention_mask, and position_ids inputs to int32
+        #
+        # Consumers that accept int32 (Gather indices and Shape) read the inputs directly, so the
+        # common case of input_ids going to the embedding needs no cast at all. Any other consumer
+        # reads an int64 Cast of the input, which is placed first so the nodes stay topologically sorted.
+        int32_input_index = {"Gather": 1, "Shape": 0}
+        for graph_input in self.inputs:
+            name = graph_input.name
+            if name not in {"input_ids", "attention_mask", "position_ids"} or graph_input.type.tensor_type.elem_type != TensorProto.INT64:
+                continue
+            graph_input.type.tensor_type.elem_type = TensorProto.INT32
+
+            uses = [(node, i) for node in self.nodes for i, input_name in enumerate(node.input) if input_name == name and int32_input_index.get(node.op_type) != i]
+            if len(uses) == 0:
+                continue
+
+            cast_name = f"/model/inputs/{name}/Cast"
+            shape = [dim.dim_param if dim.dim_param else dim.dim_value for dim in graph_input.type.tensor_type.shape.dim]
+            self.make_cast(cast_name, name, dtype=TensorProto.INT64, shape=shape)
+            self.nodes.insert(0, self.nodes.pop())
+            for node, i in uses:
+                node.input[i] = f"{cast_name}/output_0"
+
     def make_cast(self, name, root_input, dtype, shape):
         output = f"{name}/output_0"
         self.make_node("Cast", inputs=[root_input], outputs=[output], name=name, to=dtype)
@@ -731,7 +1009,7 @@ class Model:
             return self.make_matmul_op(matmul, basename, root_input, **kwargs)
     
     def make_matmul_op(self, matmul, basename, root_input, **kwargs):
-        if self.onnx_dtype in {"fp16", "fp32"}:
+        if self.onnx_dtype in {"fp16", "bf16", "fp32"}:
             return self.make_matmul_fp16_or_fp32(matmul, basename, root_input, **kwargs)
         elif self.onnx_dtype == "int4":
             if self.quant_attrs["use_qdq"]:
@@ -743,7 +1021,11 @@ class Model:
 
     def make_matmul_fp16_or_fp32(self, matmul, name, root_input, **kwargs):
         weight = name[1:].replace("/", ".") + ".weight"
-        self.make_external_tensor(matmul.weight.detach().numpy().transpose().astype(self.to_numpy_dtype[self.io_dtype]), weight)
+        if name == "/lm_head/MatMul" and self.is_tied_embedding(matmul.weight):
+            # The LM head uses the embedding's (transposed) weight
+            weight = "model.embed_tokens.weight"
+        else:
+            self.make_external_tensor(matmul.weight.detach().numpy().transpose().astype(self.to_numpy_dtype[self.io_dtype]), weight)
 
         last_dim = matmul.weight.shape[0]
         output = "logits" if kwargs.get("logits", False) else f"{name}/output_0"
@@ -752,6 +1034,13 @@ class Model:
 
         return name
 
+    def is_tied_embedding(self, weight):
+        # True if the weight is the embedding's own tensor, not just a copy of its values
+        if self.embed_tokens_weight is None:
+            return False
+        weight = weight.detach().numpy()
+        return weight.shape == self.embed_tokens_weight.shape and weight.ctypes.data == self.embed_tokens_weight.ctypes.data
+
     def make_matmul_int4(self, matmul, basename, root_input, **kwargs):
         if not hasattr(matmul, "qweight"):
             # TODO: quantize weights, then save new MatMul numpy weights for onnx model
@@ -841,6 +1130,9 @@ class Model:
         return matmul_name
 
     def make_matmul_lora(self, matmul, basename, root_input, **kwargs):
+        if self.multi_lora:
+            return self.make_matmul_multi_lora(matmul, basename, root_input, **kwargs)
+
         # Make nodes for the MatMul-LoRA subgraph
         #
         #            root_input
@@ -879,8 +1171,76 @@ class Model:
 
         return add_name
 
+    def make_matmul_multi_lora(self, matmul, basename, root_input, **kwargs):
+        # Make nodes for the MatMul-MultiLoRA subgraph
+        #
+        #                        root_input
+        #                            |
+        #                 +----------+----------+
+        #                 |                     |
+        #   Gather_LoRA_A(adapter_ids)          |
+        #                 |                     |
+        #          MatMul_LoRA_A              MatMul
+        #                 |                     |
+        #   Gather_LoRA_B(adapter_ids)          |
+        #                 |                     |
+        #          MatMul_LoRA_B                |
+        #                 |                     |
+        #                 +----------+----------+
+        #                            |
+        #                       Add_LoRA_Add
+        #
+        # The LoRA weights of all adapters are stacked as [num_adapters + 1, in_features, max_rank] and
+        # [num_adapters + 1, max_rank, out_features], where index 0 holds zeros for the base model and the ranks are
+        # zero padded. Each sequence gathers its own adapter, so the batched MatMuls read the base weights once.
+
+        basename_parts = basename.split("/")
+        in_features = matmul.base_layer.weight.shape[1]
+        out_features = matmul.base_layer.weight.shape[0]
+        max_rank = max(matmul.lora_A[name].weight.shape[0] for name in matmul.lora_A.keys())
+
+        np_dtype = self.to_numpy_dtype[self.io_dtype]
+        lora_A_weights = np.zeros((len(self.adapter_names) + 1, in_features, max_rank), dtype=np_dtype)
+        lora_B_weights = np.zeros((len(self.adapter_names) + 1, max_rank, out_features), dtype=np_dtype)
+        for index, adapter_name in enumerate(self.adapter_names, start=1):
+            if adapter_name not in matmul.lora_A.keys():
+                continue  # The adapter doesn't change this MatMul
+            rank = matmul.lora_A[adapter_name].weight.shape[0]
+            lora_A_weights[index, :, :rank] = matmul.lora_A[adapter_name].weight.detach().cpu().numpy().transpose()
+            lora_B_weights[index, :rank, :] = (matmul.lora_B[adapter_name].weight.detach().cpu().numpy() * matmul.scaling[adapter_name]).transpose()
+
+        # Make LoRA MatMul path
+        lora_paths = []
+        lora_input = root_input
+        for part, weights in [("lora_A", lora_A_weights), ("lora_B", lora_B_weights)]:
+            part_basename = "/".join(basename_parts[:-1] + [part] + basename_parts[-1:])
+            weight = part_basename[1:].replace("/", ".") + ".weight"
+            self.make_external_tensor(weights, weight)
+
+            gather_name = f"{part_basename}/Gather"
+            gather_output = f"{gather_name}/output_0"
+            self.make_node("Gather", inputs=[weight, "adapter_ids"], outputs=[gather_output], name=gather_name, axis=0)
+            self.make_value_info(gather_output, self.io_dtype, shape=["batch_size", weights.shape[1], weights.shape[2]])
+
+            matmul_output = f"{part_basename}/output_0"
+            self.make_node("MatMul", inputs=[lora_input, gather_output], outputs=[matmul_output], name=part_basename)
+            self.make_value_info(matmul_output, self.io_dtype, shape=["batch_size", "sequence_length", weights.shape[2]])
+            lora_input = matmul_output
+            lora_paths.append(matmul_output)
+
+        # Make regular MatMul path
+        matmul_name = self.make_matmul_op(matmul.base_layer, basename, root_input, **kwargs)
+
+        # Make LoRA Add node
+        add_name = "/".join(basename_parts[:-1] + ["lora", "Add"])
+        add_inputs = [f"{matmul_name}/output_0", lora_paths[-1]]
+        add_shape = ["batch_size", "sequence_length", out_features]
+        self.make_add(add_name, add_inputs, dtype=self.io_dtype, shape=add_shape)
+
+        return add_name
+
     def make_packed_matmul(self, q_matmul, k_matmul, v_matmul, basename, root_input, **kwargs):
-        if self.onnx_dtype in {"fp16", "fp32"}:
+        if self.onnx_dtype in {"fp16", "bf16", "fp32"}:
             return self.make_packed_matmul_fp16_or_fp32(q_matmul, k_matmul, v_matmul, basename, root_input, **kwargs)
         elif self.onnx_dtype == "int4":
             return self.make_packed_matmul_int4(q_matmul, k_matmul, v_matmul, basename, root_input, **kwargs)
@@ -976,13 +1336,22 @@ class Model:
 
     def make_embedding(self, embedding):
         weight = "model.embed_tokens.weight"
-        self.make_external_tensor(embedding.astype(self.to_numpy_dtype[self.io_dtype]), weight)
-
         basename = "/model/embed_tokens"
         gather_name = f"{basename}/Gather"
         gather_output = f"{gather_name}/output_0"
-        self.make_node('Gather', inputs=[weight, 'input_ids'], outputs=[gather_output], name=gather_name)
-        self.make_value_info(gather_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
+        if self.tie_embeddings:
+            # Gather the columns of the transposed weight that the LM head shares (Gather --> Transpose)
+            self.embed_tokens_weight = embedding
+            self.make_external_tensor(embedding.transpose().astype(self.to_numpy_dtype[self.io_dtype]), weight)
+            self.make_node('Gather', inputs=[weight, 'input_ids'], outputs=[gather_output], name=gather_name, axis=1)
+            self.make_value_info(gather_output, self.io_dtype, shape=[self.hidden_size, 'batch_size', 'sequence_length'])
+            transpose_name = f"{basename}/Transpose"
+            self.make_transpose(transpose_name, gather_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size], perm=[1, 2, 0])
+            gather_output = f"{transpose_name}/output_0"
+        else:
+            self.make_external_tensor(embedding.astype(self.to_numpy_dtype[self.io_dtype]), weight)
+            self.make_node('Gather', inputs=[weight, 'input_ids'], outputs=[gather_output], name=gather_name)
+            self.make_value_info(gather_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
 
         if self.embed_attrs["scale"] != 1:
             # Scale the embeddings
@@ -1194,8 +1563,8 @@ class Model:
                 initializer=[],
                 value_info=[],
                 nodes=[
-                    helper.make_node("Constant", inputs=[], outputs=[cos_cache_large_name], name="/large/cos_cache/Constant", value=numpy_helper.from_array(cos_cache_large)),
-                    helper.make_node("Constant", inputs=[], outputs=[sin_cache_large_name], name="/large/sin_cache/Constant", value=numpy_helper.from_array(sin_cache_large)),
+                    helper.make_node("Constant", inputs=[], outputs=[cos_cache_large_name], name="/large/cos_cache/Constant", value=self.array_to_tensor(cos_cache_large)),
+                    helper.make_node("Constant", inputs=[], outputs=[sin_cache_large_name], name="/large/sin_cache/Constant", value=self.array_to_tensor(sin_cache_large)),
                 ],
             ),
             else_branch=self.make_graph(
@@ -1208,8 +1577,8 @@ class Model:
                 initializer=[],
                 value_info=[],
                 nodes=[
-                    helper.make_node("Constant", inputs=[], outputs=[cos_cache_small_name], name="/small/cos_cache/Constant", value=numpy_helper.from_array(cos_cache_small)),
-                    helper.make_node("Constant", inputs=[], outputs=[sin_cache_small_name], name="/small/sin_cache/Constant", value=numpy_helper.from_array(sin_cache_small)),
+                    helper.make_node("Constant", inputs=[], outputs=[cos_cache_small_name], name="/small/cos_cache/Constant", value=self.array_to_tensor(cos_cache_small)),
+                    helper.make_node("Constant", inputs=[], outputs=[sin_cache_small_name], name="/small/sin_cache/Constant", value=self.array_to_tensor(sin_cache_small)),
                 ],
             ),
         )
@@ -1397,7 +1766,9 @@ class Model:
     def make_attention_op(self, name, **kwargs):
         op_type = self.attention_attrs["op_type"]
 
-        if op_type == "MultiHeadAttention":
+        if op_type == "MultiHeadAttention" and self.use_cache_indirection:
+            self.make_multi_head_attention(name, attn_mask=f"{self.mask_attrs['key_padding_mask']}/output_0", past_sequence_length="past_sequence_length", cache_indirection="cache_indirection", **kwargs)
+        elif op_type == "MultiHeadAttention":
             self.make_multi_head_attention(name, add_qk=f"{self.mask_attrs['mask_name']}/output_0", **kwargs)
         elif op_type == "GroupQueryAttention":
             self.make_group_query_attention(name, seqlens_k=f"{self.mask_attrs['seqlens_k']}/output_0", total_seq_len=f"{self.mask_attrs['total_seq_len']}/output_0", **kwargs)
@@ -1412,6 +1783,8 @@ class Model:
             kwargs.get("attn_mask", ""), kwargs.get("add_qk", ""),
             kwargs.get("past_k", ""), kwargs.get("past_v", ""),
         ]
+        if "cache_indirection" in kwargs:
+            inputs += [kwargs["past_sequence_length"], kwargs["cache_indirection"]]
         output = f"{name}/output_0"
         outputs = [output, kwargs.get("present_k", ""), kwargs.get("present_v", "")]
         self.make_node(
@@ -1452,6 +1825,77 @@ class Model:
             do_rotary=self.attention_attrs["use_rotemb_in_attn"], rotary_interleaved=self.rotemb_attrs["interleaved"],
         )
 
+    def make_kv_cache_quantization(self, layer_id, kv_name, past_kv, present_kv):
+        # Make nodes that dequantize the past KV cache before the attention op and quantize the present KV cache after it
+        #
+        #   past_kv (int8/fp8) --> DequantizeLinear --> attention op --> QuantizeLinear --> present_kv (int8/fp8)
+        #
+        # The scales are per KV head (axis 1 of [batch_size, num_kv_heads, sequence_length, head_size]) so they can be calibrated per head
+        basename = f"/model/layers.{layer_id}/attn/{kv_name}_cache"
+        kv_dtype = self.input_types[f"past_key_values.{kv_name}"]
+
+        scale = f"{basename}/scale"
+        self.make_external_tensor(np.full(self.num_kv_heads, self.kv_cache_scale, dtype=self.to_numpy_dtype[self.io_dtype]), scale)
+        zero_point = f"{basename}/zero_point"
+        self.initializers.append(helper.make_tensor(zero_point, kv_dtype, [self.num_kv_heads], [0] * self.num_kv_heads))
+
+        dequantize_name = f"{basename}/DequantizeLinear"
+        dequantize_output = f"{dequantize_name}/output_0"
+        self.make_node("DequantizeLinear", inputs=[past_kv, scale, zero_point], outputs=[dequantize_output], name=dequantize_name, axis=1)
+        self.make_value_info(dequantize_output, self.io_dtype, shape=self.input_shapes[f"past_key_values.{kv_name}"])
+
+        present_output = f"{basename}/present"
+        quantize_name = f"{basename}/QuantizeLinear"
+        self.make_node("QuantizeLinear", inputs=[present_output, scale, zero_point], outputs=[present_kv], name=quantize_name, axis=1)
+        self.make_value_info(present_output, self.io_dtype, shape=self.output_shapes[f"present.{kv_name}"])
+
+        return dequantize_output, present_output
+
+    def make_block_table_indices(self):
+        # ScatterND takes the block table as int64 indices with a trailing index dimension, shared by every layer
+        basename = "/model/block_table"
+        unsqueeze_name = f"{basename}/Unsqueeze"
+        if unsqueeze_name not in self.node_names:
+            cast_name = f"{basename}/Cast"
+            self.make_cast(cast_name, "block_table", dtype=TensorProto.INT64, shape=["batch_size", "max_blocks_per_sequence"])
+            self.make_unsqueeze(unsqueeze_name, [f"{cast_name}/output_0", "/model/constants/TensorProto.INT64/1D/-1"], dtype=TensorProto.INT64, shape=["batch_size", "max_blocks_per_sequence", 1])
+        return f"{unsqueeze_name}/output_0"
+
+    def make_paged_kv_cache(self, layer_id, kv_name, past_kv, present_kv):
+        # Make nodes that gather the blocks of each sequence into a contiguous past KV cache before the attention op and
+        # scatter the present KV cache back into the blocks after it
+        #
+        #   past_kv (pool) --> Gather --> Transpose --> Reshape --> attention op --> Reshape --> Transpose --> ScatterND --> present_kv (pool)
+        #
+        # The pool is [num_blocks, num_kv_heads, block_size, head_size]. The runtime binds the same pool to past_kv and present_kv,
+        # so ScatterND updates it in place. Unused block table entries all point at block 0, which the runtime never hands out.
+        basename = f"/model/layers.{layer_id}/attn/{kv_name}_cache"
+        blocks_shape = ["batch_size", "max_blocks_per_sequence", self.num_kv_heads, self.kv_block_size, self.head_size]
+        heads_shape = ["batch_size", self.num_kv_heads, "max_blocks_per_sequence", self.kv_block_size, self.head_size]
+        cache_shape = ["batch_size", self.num_kv_heads, "max_sequence_length", self.head_size]
+
+        gather_name = f"{basename}/Gather"
+        gather_output = f"{gather_name}/output_0"
+        self.make_node("Gather", inputs=[past_kv, "block_table"], outputs=[gather_output], name=gather_name, axis=0)
+        self.make_value_info(gather_output, self.io_dtype, shape=blocks_shape)
+        transpose_1_name = f"{basename}/Transpose_1"
+        self.make_transpose(transpose_1_name, gather_output, dtype=self.io_dtype, shape=heads_shape, perm=[0, 2, 1, 3, 4])
+        reshape_1_name = f"{basename}/Reshape_1"
+        reshape_1_inputs = [f"{transpose_1_name}/output_0", f"/model/constants/TensorProto.INT64/1D/0, {self.num_kv_heads}, -1, {self.head_size}"]
+        self.make_reshape(reshape_1_name, reshape_1_inputs, dtype=self.io_dtype, shape=cache_shape)
+
+        present_output = f"{basename}/present"
+        self.make_value_info(present_output, self.io_dtype, shape=cache_shape)
+        reshape_2_name = f"{basename}/Reshape_2"
+        reshape_2_inputs = [present_output, f"/model/constants/TensorProto.INT64/1D/0, {self.num_kv_heads}, -1, {self.kv_block_size}, {self.head_size}"]
+        self.make_reshape(reshape_2_name, reshape_2_inputs, dtype=self.io_dtype, shape=heads_shape)
+        transpose_2_name = f"{basename}/Transpose_2"
+        self.make_transpose(transpose_2_name, f"{reshape_2_name}/output_0", dtype=self.io_dtype, shape=blocks_shape, perm=[0, 2, 1, 3, 4])
+        scatter_name = f"{basename}/ScatterND"
+        self.make_node("ScatterND", inputs=[past_kv, self.make_block_table_indices(), f"{transpose_2_name}/output_0"], outputs=[present_kv], name=scatter_name)
+
+        return f"{reshape_1_name}/output_0", present_output
+
     def make_attention(self, layer_id, attention, root_input, **kwargs):
         # Make nodes for the Attention subgraph
         #
@@ -1554,6 +1998,18 @@ class Model:
             self.attention_attrs["v_path"] = self.make_repeat_kv(layer_id, root_input=self.attention_attrs["v_path"], past_kv=past_v, present_kv=present_v)
             past_k, past_v, present_k, present_v = "", "", "", ""
 
+        # Make DequantizeLinear/QuantizeLinear nodes for the KV cache if it is stored quantized
+        if self.kv_cache_quant_type is not None:
+            if past_k == "":
+                raise NotImplementedError("kv_cache_quant_type is not supported when the KV cache is repeated for MultiHeadAttention.")
+            past_k, present_k = self.make_kv_cache_quantization(layer_id, "key", past_k, present_k)
+            past_v, present_v = self.make_kv_cache_quantization(layer_id, "value", past_v, present_v)
+
+        # Make Gather/ScatterND nodes that read and write the blocks of a paged KV cache
+        if self.kv_layout == "paged":
+            past_k, present_k = self.make_paged_kv_cache(layer_id, "key", past_k, present_k)
+            past_v, present_v = self.make_paged_kv_cache(layer_id, "value", past_v, present_v)
+
         # Make attention node (e.g. MultiHeadAttention, GroupQueryAttention, etc.)
         attn_name = f"/model/layers.{layer_id}/attn/{self.attention_attrs['op_type']}"
         self.make_attention_op(
@@ -1613,37 +2069,37 @@ class Model:
         v_proj.weight = torch.nn.Parameter(qkv_linear.weight[q_size + kv_size :, :], requires_grad=False)
         v_proj.bias = None if qkv_linear.bias is None else torch.nn.Parameter(qkv_linear.bias[q_size + kv_size :], requires_grad=False)
 
-        # Create Q/K/V lora_B layers
-        lora_B = qkv_linear.lora_B.default
-
-        q_lora_B = torch.nn.Linear(in_features=q_size, out_features=q_size)
-        q_lora_B.weight = torch.nn.Parameter(lora_B.weight[: q_size, :], requires_grad=False)
-        q_lora_B.bias = None if lora_B.bias is None else torch.nn.Parameter(lora_B.bias[: q_size], requires_grad=False)
-
-        k_lora_B = torch.nn.Linear(in_features=q_size, out_features=kv_size)
-        k_lora_B.weight = torch.nn.Parameter(lora_B.weight[q_size : q_size + kv_size, :], requires_grad=False)
-        k_lora_B.bias = None if lora_B.bias is None else torch.nn.Parameter(lora_B.bias[q_size : q_size + kv_size], requires_grad=False)
-
-        v_lora_B = torch.nn.Linear(in_features=q_size, out_features=kv_size)
-        v_lora_B.weight = torch.nn.Parameter(lora_B.weight[q_size + kv_size :, :], requires_grad=False)
-        v_lora_B.bias = None if lora_B.bias is None else torch.nn.Parameter(lora_B.bias[q_size + kv_size :], requires_grad=False)
-
         # Create Q/K/V LoRA layers
         attention.q_proj = LoraLayer(q_proj)
         attention.q_proj.lora_A = qkv_linear.lora_A
-        attention.q_proj.lora_B.default = q_lora_B
         attention.q_proj.scaling = qkv_linear.scaling
 
         attention.k_proj = LoraLayer(k_proj)
         attention.k_proj.lora_A = qkv_linear.lora_A
-        attention.k_proj.lora_B.default = k_lora_B
         attention.k_proj.scaling = qkv_linear.scaling
 
         attention.v_proj = LoraLayer(v_proj)
         attention.v_proj.lora_A = qkv_linear.lora_A
-        attention.v_proj.lora_B.default = v_lora_B
         attention.v_proj.scaling = qkv_linear.scaling
 
+        # Create Q/K/V lora_B layers, one per adapter of a multi-LoRA model
+        for adapter_name, lora_B in qkv_linear.lora_B.items():
+            q_lora_B = torch.nn.Linear(in_features=q_size, out_features=q_size)
+            q_lora_B.weight = torch.nn.Parameter(lora_B.weight[: q_size, :], requires_grad=False)
+            q_lora_B.bias = None if lora_B.bias is None else torch.nn.Parameter(lora_B.bias[: q_size], requires_grad=False)
+
+            k_lora_B = torch.nn.Linear(in_features=q_size, out_features=kv_size)
+            k_lora_B.weight = torch.nn.Parameter(lora_B.weight[q_size : q_size + kv_size, :], requires_grad=False)
+            k_lora_B.bias = None if lora_B.bias is None else torch.nn.Parameter(lora_B.bias[q_size : q_size + kv_size], requires_grad=False)
+
+            v_lora_B = torch.nn.Linear(in_features=q_size, out_features=kv_size)
+            v_lora_B.weight = torch.nn.Parameter(lora_B.weight[q_size + kv_size :, :], requires_grad=False)
+            v_lora_B.bias = None if lora_B.bias is None else torch.nn.Parameter(lora_B.bias[q_size + kv_size :], requires_grad=False)
+
+            attention.q_proj.lora_B[adapter_name] = q_lora_B
+            attention.k_proj.lora_B[adapter_name] = k_lora_B
+            attention.v_proj.lora_B[adapter_name] = v_lora_B
+
     def make_attention_unpacked_regular(self, layer_id, attention, qkv_linear, root_input, **kwargs):
         q_size = self.num_attn_heads * self.head_size
         kv_size = self.num_kv_heads * self.head_size
@@ -1700,28 +2156,28 @@ class Model:
         up_proj.weight = torch.nn.Parameter(gate_up_linear.weight[self.intermediate_size :, :], requires_grad=False)
         up_proj.bias = None if gate_up_linear.bias is None else torch.nn.Parameter(gate_up_linear.bias[self.intermediate_size :], requires_grad=False)
 
-        # Create GateProj/UpProj lora_B layers
-        lora_B = gate_up_linear.lora_B.default
-
-        gate_proj_lora_B = torch.nn.Linear(in_features=self.hidden_size, out_features=self.intermediate_size)
-        gate_proj_lora_B.weight = torch.nn.Parameter(lora_B.weight[ : self.intermediate_size, :], requires_grad=False)
-        gate_proj_lora_B.bias = None if lora_B.bias is None else torch.nn.Parameter(lora_B.bias[: self.intermediate_size], requires_grad=False)
-
-        up_proj_lora_B = torch.nn.Linear(in_features=self.hidden_size, out_features=self.intermediate_size)
-        up_proj_lora_B.weight = torch.nn.Parameter(lora_B.weight[self.intermediate_size :, :], requires_grad=False)
-        up_proj_lora_B.bias = None if lora_B.bias is None else torch.nn.Parameter(lora_B.bias[self.intermediate_size :], requires_grad=False)
-
         # Create GateProj/UpProj LoRA layers
         mlp.gate_proj = LoraLayer(gate_proj)
         mlp.gate_proj.lora_A = gate_up_linear.lora_A
-        mlp.gate_proj.lora_B.default = gate_proj_lora_B
         mlp.gate_proj.scaling = gate_up_linear.scaling
 
         mlp.up_proj = LoraLayer(up_proj)
         mlp.up_proj.lora_A = gate_up_linear.lora_A
-        mlp.up_proj.lora_B.default = up_proj_lora_B
         mlp.up_proj.scaling = gate_up_linear.scaling
 
+        # Create GateProj/UpProj lora_B layers, one per adapter of a multi-LoRA model
+        for adapter_name, lora_B in gate_up_linear.lora_B.items():
+            gate_proj_lora_B = torch.nn.Linear(in_features=self.hidden_size, out_features=self.intermediate_size)
+            gate_proj_lora_B.weight = torch.nn.Parameter(lora_B.weight[ : self.intermediate_size, :], requires_grad=False)
+            gate_proj_lora_B.bias = None if lora_B.bias is None else torch.nn.Parameter(lora_B.bias[: self.intermediate_size], requires_grad=False)
+
+            up_proj_lora_B = torch.nn.Linear(in_features=self.hidden_size, out_features=self.intermediate_size)
+            up_proj_lora_B.weight = torch.nn.Parameter(lora_B.weight[self.intermediate_size :, :], requires_grad=False)
+            up_proj_lora_B.bias = None if lora_B.bias is None else torch.nn.Parameter(lora_B.bias[self.intermediate_size :], requires_grad=False)
+
+            mlp.gate_proj.lora_B[adapter_name] = gate_proj_lora_B
+            mlp.up_proj.lora_B[adapter_name] = up_proj_lora_B
+
     def make_mlp_unpacked_regular(self, layer_id, mlp, root_input):
         gate_up_linear = getattr(mlp, "gate_up_proj", None) or getattr(mlp, "dense_h_to_4h", None)
 
@@ -2027,6 +2483,29 @@ class Model:
             raise NotImplementedError(f"The {self.activation} activation function is not currently supported.")
         return output_name
 
+    def make_last_token_gather(self, root_input):
+        # Gather the hidden state at `last_token_indices` for each sequence so the LM head only runs on the last token
+        #
+        #              root_input     last_token_indices
+        #                  |                 |
+        #                  |             Unsqueeze
+        #                   \               /
+        #                 GatherND (batch_dims=1)
+        #                          |
+        #                      Unsqueeze
+        basename = "/lm_head/last_token"
+        indices_name = f"{basename}/indices/Unsqueeze"
+        self.make_unsqueeze(indices_name, ["last_token_indices", "/model/constants/TensorProto.INT64/1D/1"], dtype=TensorProto.INT64, shape=["batch_size", 1])
+
+        gather_name = f"{basename}/GatherND"
+        gather_output = f"{gather_name}/output_0"
+        self.make_node("GatherND", inputs=[root_input, f"{indices_name}/output_0"], outputs=[gather_output], name=gather_name, batch_dims=1)
+        self.make_value_info(gather_output, self.io_dtype, shape=["batch_size", self.hidden_size])
+
+        unsqueeze_name = f"{basename}/Unsqueeze"
+        self.make_unsqueeze(unsqueeze_name, [gather_output, "/model/constants/TensorProto.INT64/1D/1"], dtype=self.io_dtype, shape=["batch_size", 1, self.hidden_size])
+        return f"{unsqueeze_name}/output_0"
+
     def make_lm_head(self, lm_head):
         # Check if there are ops to insert after MatMul
         bias_exists = lm_head.bias is not None
@@ -2035,6 +2514,8 @@ class Model:
 
         matmul_basename = "/lm_head/MatMul"
         root_input = self.layernorm_attrs["output_0"]
+        if self.last_token_logits:
+            root_input = self.make_last_token_gather(root_input)
         matmul_name = self.make_matmul(lm_head, matmul_basename, root_input, logits=not(bias_exists or scale_exists or mask_exists))
         lm_name = matmul_name
 
@@ -2057,12 +2538,46 @@ class Model:
             self.make_external_tensor(self.lm_head_attrs["mask"].detach().numpy(), logits_mask_name)
 
             where_name = "/lm_head/Where"
-            where_inputs = [logits_mask_name, f"/model/constants/{self.to_str_dtype[self.io_dtype]}/0D/{np.finfo(self.to_numpy_dtype[self.io_dtype]).min}", f"{lm_name}/output_0"]
+            where_inputs = [logits_mask_name, f"/model/constants/{self.to_str_dtype[self.io_dtype]}/0D/{self.get_dtype_min(self.io_dtype)}", f"{lm_name}/output_0"]
             where_output = "logits"
             self.make_node('Where', inputs=where_inputs, outputs=[where_output], name=where_name)
             self.make_value_info(where_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.vocab_size])
             lm_name = where_name
 
+    def make_logits_top_k(self):
+        # Keep the best logits_top_k scores of every token and their token ids, best first (logits --> TopK --> values, indices)
+        topk_name = "/lm_head/TopK"
+        topk_inputs = ["logits", f"/model/constants/TensorProto.INT64/1D/{self.logits_top_k}"]
+        self.make_node("TopK", inputs=topk_inputs, outputs=["logits_top_k_values", "logits_top_k_indices"], name=topk_name, axis=-1, largest=1, sorted=1)
+
+    def make_exit_head(self, lm_head):
+        # Early exit head after layer exit_layer with the weights of the final norm and the LM head (SkipLayerNorm --> MatMul --> exit_logits)
+        # The LM head weights are saved again under the exit head's name, so this works for every precision
+        simple = self.layernorm_attrs["simple"]
+        weight = f"model.layers.{self.num_layers}.final_norm_layernorm.weight"
+        bias = f"model.layers.{self.num_layers}.final_norm_layernorm.bias"
+
+        norm_name = "/exit_head/SkipLayerNorm"
+        norm_inputs = [self.exit_attrs["root_input"], self.exit_attrs["skip_input"], weight] + ([] if simple else [bias])
+        norm_output = f"{norm_name}/output_0"
+        self.make_node(f"Skip{'Simplified' if simple else ''}LayerNormalization", inputs=norm_inputs, outputs=[norm_output], name=norm_name, domain="com.microsoft", epsilon=self.layernorm_attrs["epsilon"])
+        self.make_value_info(norm_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
+
+        exit_name = self.make_matmul(lm_head, "/exit_head/MatMul", norm_output)
+        if lm_head.bias is not None:
+            add_name = "/exit_head/Add"
+            self.make_add_bias(lm_head.bias.detach().numpy(), add_name, root_input=f"{exit_name}/output_0")
+            exit_name = add_name
+
+        if self.lm_head_attrs["scale"] != 1:
+            mul_name = "/exit_head/Mul"
+            mul_inputs = [f"{exit_name}/output_0", f"/model/constants/{self.to_str_dtype[self.io_dtype]}/0D/{self.lm_head_attrs['scale']}"]
+            self.make_node('Mul', inputs=mul_inputs, outputs=[f"{mul_name}/output_0"], name=mul_name)
+            self.make_value_info(f"{mul_name}/output_0", self.io_dtype, shape=['batch_size', 'sequence_length', self.vocab_size])
+            exit_name = mul_name
+
+        self.make_node("Identity", inputs=[f"{exit_name}/output_0"], outputs=["exit_logits"], name="/exit_head/Identity")
+
     def make_layer(self, layer_id, layer):
         # Each LLM decoder layer is typically defined as:
         # input_layernorm --> attention --> output_layernorm --> MLP
@@ -2108,7 +2623,14 @@ class Model:
 
         if "adapter_path" in self.extra_options:
             from peft import PeftModel
-            model = PeftModel.from_pretrained(model, self.extra_options["adapter_path"], cache_dir=self.cache_dir, token=self.hf_token)
+            if self.multi_lora:
+                model = PeftModel.from_pretrained(model, self.adapter_paths[0], adapter_name=self.adapter_names[0], cache_dir=self.cache_dir, token=self.hf_token)
+                for adapter_path, adapter_name in zip(self.adapter_paths[1:], self.adapter_names[1:]):
+                    model.load_adapter(adapter_path, adapter_name=adapter_name)
+            else:
+                model = PeftModel.from_pretrained(model, self.extra_options["adapter_path"], cache_dir=self.cache_dir, token=self.hf_token)
+                if self.merge_adapter:
+                    model = model.merge_and_unload()
 
         # Loop through model and map each module to ONNX/ORT ops
         self.layer_id = 0
@@ -2129,6 +2651,9 @@ class Model:
                 # Each decoder layer of model
                 print(f"Reading decoder layer {self.layer_id}")
                 self.make_layer(self.layer_id, module)
+                if self.layer_id == self.exit_layer:
+                    # Residual stream after the exit layer, the early exit head normalizes it like the final norm does
+                    self.exit_attrs = {"root_input": self.layernorm_attrs["root_input"], "skip_input": self.layernorm_attrs["skip_input"]}
                 self.layer_id += 1
 
             elif self.layer_id == self.num_layers and self.has_final_norm(module, model):
@@ -2142,7 +2667,12 @@ class Model:
                     # Language modeling head (SkipLayerNorm --> logits)
                     print("Reading LM head")
                     self.make_lm_head(module)
+                    if self.logits_top_k > 0:
+                        self.make_logits_top_k()
+                    if self.exit_layer >= 0:
+                        self.make_exit_head(module)
 
+        self.embed_tokens_weight = None
         del model
 
     def has_final_norm(self, module, model):
@@ -2170,6 +2700,11 @@ class Model:
 
         if self.attention_attrs["op_type"] == "GroupQueryAttention":
             self.make_attention_mask_reformatting_for_gqa()
+        elif self.attention_attrs["op_type"] == "MultiHeadAttention" and self.use_cache_indirection:
+            # MultiHeadAttention masks the shared past-present buffer with the 2D attention mask (B, T) as the key padding mask
+            cast_name = "/model/attn_mask_reformat/attn_mask_subgraph/Cast"
+            self.make_cast(cast_name, "attention_mask", dtype=TensorProto.INT32, shape=["batch_size", "total_sequence_length"])
+            self.mask_attrs["key_padding_mask"] = cast_name
         elif self.attention_attrs["op_type"] == "MultiHeadAttention":
             # Make attention mask reformatting nodes
             #
@@ -2311,7 +2846,7 @@ class Model:
         self.make_concat(concat_2_name, concat_inputs, dtype=TensorProto.INT64, shape=[2], axis=0)
         constant_shape_name = f"{basename}/ConstantOfShape_2"
         constant_shape_numpy_dtype = self.to_numpy_dtype[self.io_dtype]
-        constant_shape_value = numpy_helper.from_array(np.array([np.finfo(constant_shape_numpy_dtype).min], dtype=constant_shape_numpy_dtype))
+        constant_shape_value = self.array_to_tensor(np.array([self.get_dtype_min(self.io_dtype)], dtype=constant_shape_numpy_dtype))
         self.make_constant_of_shape(constant_shape_name, f"{concat_2_name}/output_0", value=constant_shape_value, dtype=self.io_dtype, shape=['unk', 'unk'])
 
         # Top path
@@ -2395,7 +2930,7 @@ class Model:
         cast_2_name = f"{basename}/Cast_2"
         self.make_cast(cast_2_name, f"{sub_name}/output_0", dtype=TensorProto.BOOL, shape=["unk", "unk", "unk", "unk"])
         where_2_name = f"{basename}/Where_2"
-        where_2_inputs = [f"{cast_2_name}/output_0", f"/model/constants/{self.to_str_dtype[self.io_dtype]}/0D/{np.finfo(self.to_numpy_dtype[self.io_dtype]).min}", f"{sub_name}/output_0"]
+        where_2_inputs = [f"{cast_2_name}/output_0", f"/model/constants/{self.to_str_dtype[self.io_dtype]}/0D/{self.get_dtype_min(self.io_dtype)}", f"{sub_name}/output_0"]
         self.make_where(where_2_name, where_2_inputs, dtype=self.io_dtype, shape=["unk", "unk", "unk", "unk"])
 
         return where_2_name
@@ -2483,6 +3018,17 @@ class Model:
         return expand_name
 
     def make_attention_mask_reformatting_for_gqa(self):
+        if self.use_seqlens_k_inputs:
+            # The runtime feeds seqlens_k and total_sequence_length directly, they only pass through
+            # Identity nodes to take the names that the GroupQueryAttention nodes read
+            basename = "/model/attn_mask_reformat/seqlens_k_inputs"
+            for input_name, attr_name in [("seqlens_k", "seqlens_k"), ("total_sequence_length", "total_seq_len")]:
+                identity_name = f"{basename}/{input_name}/Identity"
+                self.make_node("Identity", inputs=[input_name], outputs=[f"{identity_name}/output_0"], name=identity_name)
+                self.make_value_info(f"{identity_name}/output_0", TensorProto.INT32, shape=self.input_shapes[input_name])
+                self.mask_attrs[attr_name] = identity_name
+            return
+
         # Make nodes for the attention mask subgraph that calculates
         # attributes about the 2D attention mask to use in GroupQueryAttention
         #
@@ -2692,6 +3238,8 @@ class Gemma2Model(GemmaModel):
     def make_lm_head(self, lm_head):
         matmul_basename = "/lm_head/MatMul"
         root_input = self.layernorm_attrs["output_0"]
+        if self.last_token_logits:
+            root_input = self.make_last_token_gather(root_input)
         matmul_name = self.make_matmul(lm_head, matmul_basename, root_input, logits=False)
 
         # Add final logit softcapping (Div --> Tanh --> Mul)
@@ -3123,7 +3671,7 @@ def check_extra_options(kv_pairs):
     """
     Check key-value pairs and set values correctly
     """
-    bools = ["int4_is_symmetric", "exclude_embeds", "exclude_lm_head", "include_hidden_states", "enable_cuda_graph", "use_8bits_moe", "use_qdq", "include_prompt_templates"]
+    bools = ["int4_mixed_precision", "int4_is_symmetric", "exclude_embeds", "int32_inputs", "use_seqlens_k_inputs", "exclude_lm_head", "include_hidden_states", "enable_cuda_graph", "use_8bits_moe", "use_qdq", "include_prompt_templates", "last_token_logits", "use_cache_indirection", "merge_adapter"]
     for key in bools:
         if key in kv_pairs:
             if kv_pairs[key] in {"false", "False", "0"}:
@@ -3133,6 +3681,10 @@ def check_extra_options(kv_pairs):
             else:
                 raise ValueError(f"{key} must be false/False/0 or true/True/1.")
     
+    if kv_pairs.get("merge_adapter", False) and ("adapter_path" not in kv_pairs or "," in kv_pairs["adapter_path"]):
+        # Only a single adapter can be folded into the base weights, a multi-LoRA model selects its adapters at runtime
+        raise ValueError(f"'merge_adapter' requires a single 'adapter_path'.")
+
     if "int4_op_types_to_quantize" in kv_pairs:
         op_types_to_quantize = ()
         for op_type in kv_pairs["int4_op_types_to_quantize"].split("/"):
@@ -3144,6 +3696,22 @@ def check_extra_options(kv_pairs):
         # 'include_hidden_states' is for when 'hidden_states' are outputted and 'logits' are outputted
         raise ValueError(f"Both 'exclude_lm_head' and 'include_hidden_states' cannot be used together. Please use only one of them at once.")
 
+    if kv_pairs.get("last_token_logits", False) and kv_pairs.get("exclude_lm_head", False):
+        # 'last_token_logits' gathers the last token's hidden state in front of the language modeling head
+        raise ValueError(f"'last_token_logits' cannot be used with 'exclude_lm_head' since the model has no language modeling head.")
+
+    if int(kv_pairs.get("logits_top_k", 0)) > 0 and (kv_pairs.get("exclude_lm_head", False) or kv_pairs.get("include_hidden_states", False)):
+        # 'logits_top_k' replaces the 'logits' output of the language modeling head
+        raise ValueError(f"'logits_top_k' cannot be used with 'exclude_lm_head' or 'include_hidden_states'.")
+
+    if "exit_layer" in kv_pairs and (kv_pairs.get("exclude_lm_head", False) or kv_pairs.get("last_token_logits", False)):
+        # 'exit_layer' reuses the language modeling head for the early exit head, which produces logits for every input token
+        raise ValueError(f"'exit_layer' cannot be used with 'exclude_lm_head' or 'last_token_logits'.")
+
+    if kv_pairs.get("use_cache_indirection", False) and "kv_cache_quant_type" in kv_pairs:
+        # The quantized KV cache can't share its past and present buffers, which the cache indirection table relies on
+        raise ValueError(f"'use_cache_indirection' cannot be used with 'kv_cache_quant_type'.")
+
 
 def parse_extra_options(kv_items):
     """
@@ -3191,11 +3759,14 @@ def create_model(model_name, input_path, output_dir, precision, execution_provid
     config = AutoConfig.from_pretrained(hf_name, token=hf_token, trust_remote_code=True, **extra_kwargs)
     if "adapter_path" in extra_options:
         from peft import PeftConfig
-        peft_config = PeftConfig.from_pretrained(extra_options["adapter_path"], token=hf_token, trust_remote_code=True, **extra_kwargs)
+        # The adapters of a multi-LoRA model share the base model, the first one's config stands for all of them
+        peft_config = PeftConfig.from_pretrained(extra_options["adapter_path"].split(",")[0], token=hf_token, trust_remote_code=True, **extra_kwargs)
         config.update(peft_config.__dict__)
 
     # Set input/output precision of ONNX model
-    io_dtype = TensorProto.FLOAT if precision in {"int8", "fp32"} or (precision == "int4" and execution_provider == "cpu") else TensorProto.FLOAT16
+    if precision == "bf16" and execution_provider != "cuda":
+        raise NotImplementedError("The bf16 precision is only supported with the CUDA execution provider.")
+    io_dtype = TensorProto.FLOAT if precision in {"int8", "fp32"} or (precision == "int4" and execution_provider == "cpu") else TensorProto.BFLOAT16 if precision == "bf16" else TensorProto.FLOAT16
 
     if "config_only" not in extra_options:
         # List architecture options in alphabetical order
@@ -3291,7 +3862,7 @@ def get_args():
         "-p",
         "--precision",
         required=True,
-        choices=["int4", "fp16", "fp32"],
+        choices=["int4", "fp16", "bf16", "fp32"],
         help="Precision of model",
     )
 
@@ -3331,6 +3902,14 @@ def get_args():
                 int4_op_types_to_quantize = MatMul/Gather: Specify op types to target for int4 quantization.
                     Use this option when you want to quantize specific ops.
                     Separate the op types with a '/' when passing them here (e.g. int4_op_types_to_quantize=MatMul/Gather)
+                int4_mixed_precision = Quantize the MatMuls with mixed precision. Default is false.
+                    If true, the MatMuls of the first and last layers and the attention output projections are quantized to int8 (DequantizeLinear --> MatMul).
+                    Every other MatMul gets the largest block size of 16/32/128 whose weight quantization error is within the median error at int4_block_size.
+                int4_mixed_precision_tolerance = Factor on the median error that the block sizes of int4_mixed_precision must meet. Default is 1.0.
+                    Larger values pick larger (faster) block sizes.
+                int4_quant_overrides = Path to a JSON file with the bits (4 or 8) and block_size of MatMuls, e.g. from a calibration pass.
+                    The keys are patterns of MatMul names (e.g. {"/model/layers.1*/mlp/*": {"block_size": 16}, "/lm_head/MatMul": {"bits": 8}}).
+                    The overrides are applied after int4_mixed_precision.
                 num_hidden_layers = Manually specify the number of layers in your ONNX model (for unit testing purposes).
                 filename = Filename for ONNX model (default is 'model.onnx').
                     For models with multiple components, each component is exported to its own ONNX model.
@@ -3342,15 +3921,29 @@ def get_args():
                     If false, authentication with Hugging Face will be disabled.
                     If token, you can provide a custom authentication token that differs from the one stored in your environment.
                     If you have already authenticated via `huggingface-cli login`, you do not need to use this flag because Hugging Face has already stored your authentication token for you.
+                use_seqlens_k_inputs = Replace the attention_mask input of GroupQueryAttention models with seqlens_k and total_sequence_length inputs. Default is false.
+                    Recommended for the CPU, DirectML, and WebGPU EPs, where the runtime builds the attention mask on the CPU.
+                    The runtime then updates these sequence lengths in place instead of rebuilding the 2D attention mask on every step.
+                    Requires GroupQueryAttention with past_present_share_buffer and cannot be used with graph capture.
+                int32_inputs = Use int32 instead of int64 for the input_ids, attention_mask, and position_ids inputs. Default is true.
+                    The runtime produces these inputs in int32, so this avoids casting them on every step. Set it to false for int64 inputs.
                 exclude_embeds = Remove embedding layer from your ONNX model.
                     Use this option when you want to remove the embedding layer from within your ONNX model.
                     Instead of `input_ids`, you will have `inputs_embeds` as the input to your ONNX model.
                 exclude_lm_head = Remove language modeling head from your ONNX model.
                     Use this option when you want to remove the language modeling head from within your ONNX model.
                     Instead of `logits`, you will have `hidden_states` as the output to your ONNX model.
+                    Use this for embedding models, `Model.embed` reads `hidden_states` without computing a KV cache.
                 include_hidden_states = Include hidden states as output from your ONNX model.
                     Use this option when you want to have the hidden states as an output from your ONNX model.
                     In addition to `logits`, you will have `hidden_states` as an output to your ONNX model.
+                logits_top_k = Number of candidates a TopK node after the language modeling head keeps for every token. Default is 0 (disabled).
+                    Instead of `logits`, you will have `logits_top_k_values` and `logits_top_k_indices` as outputs to your ONNX model.
+                    Greedy search and top k sampling with top_k up to this number, without penalties or top p, then select from the candidates.
+                exit_layer = Index of the decoder layer after which an early exit head (the final norm and the language modeling head) is added. Default is disabled.
+                    In addition to `logits`, you will have `exit_logits` as an output to your ONNX model.
+                    To draft tokens from it at runtime, split the model into pipeline models with `exit_logits` output by an intermediate one and add
+                    "early_exit": {"threshold": 0.9, "num_draft_tokens": 4} to the decoder in `genai_config.json`.
                 enable_cuda_graph = Enable CUDA graph capture during inference. Default is false.
                     If enabled, all nodes being placed on the CUDA EP is the prerequisite for the CUDA graph to be used correctly.
                     It is not guaranteed that CUDA graph be enabled as it depends on the model and the graph structure.
@@ -3360,13 +3953,36 @@ def get_args():
                     Use this option when you want to use quantize-dequantize ops. For example, you will have a quantized MatMul op instead of the MatMulNBits op.
                 adapter_path = Path to folder on disk containing the adapter files (adapter_config.json and adapter model weights).
                     Use this option for LoRA models.
+                    Pass several comma separated paths to build a multi-LoRA model, where every sequence of a batch selects one of the adapters
+                    (named after their folders) or the base model. The adapters' weights are stacked in the model.
+                merge_adapter = Merge the adapter of adapter_path into the base weights. Default is false.
+                    Use this option for deployments that always run with the one adapter: the model runs at the base model's speed
+                    and the merged weights are quantized (e.g. to int4) like the base weights. Requires a single adapter_path.
                 include_prompt_templates = Include prompt templates in the GenAI config file. Default is false.
                     Use this option to include per-role prompt templates in the `genai_config.json` file.
+                kv_layout = contiguous/paged: How the KV cache is laid out. Default is contiguous.
+                    paged makes past and present KV caches one pool of [num_blocks, num_kv_heads, kv_block_size, head_size] blocks and adds a block_table input.
+                    The genai_config.json then enables the runtime's paged_kv_cache. Requires GroupQueryAttention.
+                kv_block_size = Number of tokens in each block of a paged KV cache. Default is 16.
+                kv_cache_quant_type = int8/fp8: Store the KV cache as 8-bit values. Default is to store it in the model's IO dtype.
+                    The past KV cache is dequantized before attention and the present KV cache is quantized after it using per-head scales.
+                    The KV cache kept between steps takes half the memory of fp16 (a quarter of fp32). Inside each run the attention op still reads a
+                    full precision copy of the past and writes a full precision present, so the peak memory of a run is not reduced.
+                    Past-present buffer sharing is disabled (a warning is printed for GroupQueryAttention models), so the runtime holds an 8-bit past and
+                    present of the current length instead of one max_length buffer. The saving over a shared buffer grows with max_length.
+                kv_cache_scale = Initial value of the per-head KV cache scales. Default is 1/16 for int8 and 1.0 for fp8.
+                    The scales are stored as initializers named '/model/layers.{i}/attn/{key,value}_cache/scale' and can be replaced by calibrated values.
+                use_cache_indirection = Read the KV cache through a cache indirection table for beam search. Default is false.
+                    The model uses MultiHeadAttention with `past_sequence_length` and `cache_indirection` inputs and shares its past and present KV caches,
+                    so beam search updates a [batch_size, num_beams, max_length] int32 table each step instead of reordering every layer's KV cache.
+                last_token_logits = Only compute the logits of the last token of each sequence. Default is false.
+                    Use this option to avoid computing [batch_size, sequence_length, vocab_size] logits for the whole prompt.
+                    The model gets a `last_token_indices` input of shape [batch_size] and its `logits` output has shape [batch_size, 1, vocab_size].
             """),
     )
 
     args = parser.parse_args()
-    print("Valid precision + execution provider combinations are: FP32 CPU, FP32 CUDA, FP16 CUDA, FP16 DML, INT4 CPU, INT4 CUDA, INT4 DML")
+    print("Valid precision + execution provider combinations are: FP32 CPU, FP32 CUDA, FP16 CUDA, BF16 CUDA, FP16 DML, INT4 CPU, INT4 CUDA, INT4 DML")
     return args
 
 if __name__ == '__main__':
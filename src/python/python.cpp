@@ -3,6 +3,7 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <pybind11/numpy.h>
+#include <deque>
 #include <iostream>
 #include "../generators.h"
 #include "../ort_genai.h"
@@ -11,6 +12,7 @@
 #include "../models/model.h"
 #include "../logging.h"
 #include "../smartptrs.h"
+#include "../whisper_stream.h"
 
 using namespace pybind11::literals;
 
@@ -190,6 +192,165 @@ struct PyDeviceMemorySpan {
   pybind11::array_t<T> py_cpu_array_;
 };
 
+// The parts of the DLPack ABI (https://github.com/dmlc/dlpack) needed to exchange tensors with other frameworks
+struct DLDevice {
+  int32_t device_type;
+  int32_t device_id;
+};
+
+struct DLDataType {
+  uint8_t code;
+  uint8_t bits;
+  uint16_t lanes;
+};
+
+struct DLTensor {
+  void* data;
+  DLDevice device;
+  int32_t ndim;
+  DLDataType dtype;
+  int64_t* shape;
+  int64_t* strides;  // nullptr for compact row-major tensors
+  uint64_t byte_offset;
+};
+
+struct DLManagedTensor {
+  DLTensor dl_tensor;
+  void* manager_ctx;
+  void (*deleter)(DLManagedTensor* self);
+};
+
+constexpr int32_t kDLCPU = 1;
+constexpr int32_t kDLCUDA = 2;
+constexpr int32_t kDLCUDAHost = 3;
+constexpr uint8_t kDLInt = 0;
+constexpr uint8_t kDLFloat = 2;
+
+DLDevice ToDLDevice(DeviceInterface& device) {
+  switch (device.GetType()) {
+    case DeviceType::CPU:
+      return {kDLCPU, 0};
+    case DeviceType::CUDA:
+      return {kDLCUDA, device.GetAllocator().GetInfo().GetDeviceId()};
+    default:
+      throw std::runtime_error("DLPack is not supported for the " + to_string(device.GetType()) + " device");
+  }
+}
+
+// A view of device memory owned by the generator that other frameworks can use in place through DLPack
+// (torch.from_dlpack, cupy.from_dlpack, numpy.from_dlpack) or __cuda_array_interface__. Work queued on a stream other
+// than the default stream must be synchronized before the generator uses the memory again.
+template <typename T>
+struct PyDeviceArray {
+  PyDeviceArray(DeviceSpan<T> span, DeviceInterface& device, std::vector<int64_t> shape)
+      : span_{std::move(span)}, device_{ToDLDevice(device)}, shape_{std::move(shape)} {}
+
+  pybind11::capsule ToDLPack() {
+    // Owns a reference to the memory until the consumer is done with it
+    struct Context {
+      DeviceSpan<T> span;
+      std::vector<int64_t> shape;
+      DLManagedTensor managed;
+    };
+    auto* context = new Context{span_, shape_, {}};
+    auto& tensor = context->managed.dl_tensor;
+    tensor.data = context->span.Span().data();
+    tensor.device = device_;
+    tensor.ndim = static_cast<int32_t>(context->shape.size());
+    tensor.dtype = {std::is_floating_point_v<T> ? kDLFloat : kDLInt, static_cast<uint8_t>(sizeof(T) * 8), 1};
+    tensor.shape = context->shape.data();
+    tensor.strides = nullptr;
+    tensor.byte_offset = 0;
+    context->managed.manager_ctx = context;
+    context->managed.deleter = [](DLManagedTensor* self) { delete static_cast<Context*>(self->manager_ctx); };
+
+    // A consumer renames the capsule to "used_dltensor" and calls the deleter itself, otherwise it's released here
+    return pybind11::capsule(&context->managed, "dltensor", +[](PyObject* capsule) {
+      if (PyCapsule_IsValid(capsule, "dltensor")) {
+        auto* managed = static_cast<DLManagedTensor*>(PyCapsule_GetPointer(capsule, "dltensor"));
+        managed->deleter(managed);
+      }
+    });
+  }
+
+  pybind11::tuple GetDLPackDevice() const { return pybind11::make_tuple(device_.device_type, device_.device_id); }
+
+  pybind11::dict GetCudaArrayInterface() {
+    if (device_.device_type != kDLCUDA)
+      throw pybind11::attribute_error("__cuda_array_interface__ is only available for CUDA memory");
+    pybind11::dict interface;
+    interface["shape"] = pybind11::tuple(pybind11::cast(shape_));
+    interface["typestr"] = std::is_floating_point_v<T> ? "<f" + std::to_string(sizeof(T)) : "<i" + std::to_string(sizeof(T));
+    interface["data"] = pybind11::make_tuple(reinterpret_cast<uintptr_t>(span_.Span().data()), false);
+    interface["version"] = 3;
+    interface["strides"] = pybind11::none();
+    interface["stream"] = 1;  // The legacy default stream
+    return interface;
+  }
+
+  pybind11::array_t<T> GetNumpy() {
+    auto v = span_.CopyDeviceToCpu();
+    return pybind11::array_t<T>(shape_, v.data());
+  }
+
+  const std::vector<int64_t>& GetShape() const { return shape_; }
+
+ private:
+  DeviceSpan<T> span_;
+  DLDevice device_;
+  std::vector<int64_t> shape_;
+};
+
+// Copies a tensor that implements __dlpack__ into 'destination', which must have as many elements. Memory that is
+// already 'destination' (a view from PyDeviceArray that was changed in place) isn't copied.
+void CopyFromDLPack(pybind11::object value, DeviceSpan<float> destination, DeviceInterface& device) {
+  auto capsule = value.attr("__dlpack__")();
+  auto* managed = static_cast<DLManagedTensor*>(PyCapsule_GetPointer(capsule.ptr(), "dltensor"));
+  if (!managed)
+    throw pybind11::error_already_set();
+  PyCapsule_SetName(capsule.ptr(), "used_dltensor");  // This is the consumer now, so the deleter is called here
+  struct Release {
+    ~Release() {
+      if (managed_->deleter)
+        managed_->deleter(managed_);
+    }
+    DLManagedTensor* managed_;
+  } release{managed};
+
+  const auto& tensor = managed->dl_tensor;
+  if (tensor.dtype.code != kDLFloat || tensor.dtype.bits != 32 || tensor.dtype.lanes != 1)
+    throw std::runtime_error("Logits must be float32");
+
+  size_t element_count = 1;
+  for (int32_t i = 0; i < tensor.ndim; i++)
+    element_count *= static_cast<size_t>(tensor.shape[i]);
+  if (element_count != destination.size())
+    throw std::runtime_error("Generator::SetLogits passed a tensor of size " + std::to_string(element_count) + " but should be size " + std::to_string(destination.size()));
+
+  if (tensor.strides) {
+    int64_t expected_stride = 1;
+    for (int32_t i = tensor.ndim; i-- > 0;) {
+      if (tensor.shape[i] != 1 && tensor.strides[i] != expected_stride)
+        throw std::runtime_error("Logits must be contiguous");
+      expected_stride *= tensor.shape[i];
+    }
+  }
+
+  const auto expected_device = ToDLDevice(device);
+  const bool is_cpu_memory = tensor.device.device_type == kDLCPU || tensor.device.device_type == kDLCUDAHost;
+  if (expected_device.device_type == kDLCPU ? !is_cpu_memory
+                                            : tensor.device.device_type != expected_device.device_type || tensor.device.device_id != expected_device.device_id)
+    throw std::runtime_error("Logits must be on the generator's device");
+
+  auto* data = reinterpret_cast<float*>(static_cast<uint8_t*>(tensor.data) + tensor.byte_offset);
+  if (data == destination.Span().data())
+    return;
+
+  auto source = OrtValue::CreateTensor<float>(device.GetAllocator().GetInfo(), std::span<float>{data, element_count},
+                                              std::array<int64_t, 1>{static_cast<int64_t>(element_count)});
+  destination.CopyFrom(WrapTensor<float>(device, *source));
+}
+
 struct PyNamedTensors {
   PyNamedTensors(std::unique_ptr<NamedTensors> named_tensors) : named_tensors_{std::move(named_tensors)} {
   }
@@ -211,6 +372,7 @@ struct PyGeneratorParams {
       whisper.input_features = std::make_shared<Tensor>(ToOrtValue(py_whisper_input_features_));
       if (py_alignment_heads_.size() != 0) {
         whisper.alignment_heads = std::make_shared<Tensor>(ToOrtValue(py_alignment_heads_));
+        whisper.sparse_cross_qk = py_sparse_cross_qk_;
       }
     }
   }
@@ -252,21 +414,170 @@ struct PyGeneratorParams {
     params_->TryGraphCapture(max_batch_size.cast<int>());
   }
 
+  void SetDraftModel(const Model& draft_model, int num_draft_tokens) {
+    params_->SetDraftModel(draft_model, num_draft_tokens);
+  }
+
+  void SetBatchSampling(const std::vector<int32_t>& top_k, const std::vector<float>& top_p, const std::vector<float>& temperature) {
+    params_->SetBatchSampling(top_k, top_p, temperature);
+  }
+
+  void SetBatchAdapters(const std::vector<std::string>& adapter_names) {
+    params_->SetBatchAdapters(adapter_names);
+  }
+
+  void SetGuidance(const std::string& type, const std::string& data) {
+    params_->SetGuidance(type, data);
+  }
+
+  void AddStopTokenSequence(const std::vector<int32_t>& tokens) {
+    if (tokens.empty())
+      throw std::runtime_error("A stop token sequence needs at least one token");
+    params_->search.stop_token_sequences.push_back(tokens);
+  }
+
+  void AddStopString(const std::string& text) {
+    if (text.empty())
+      throw std::runtime_error("A stop string cannot be empty");
+    params_->search.stop_strings.push_back(text);
+  }
+
   pybind11::array py_whisper_input_features_;
   pybind11::array py_alignment_heads_;
+  bool py_sparse_cross_qk_{};
 
   std::vector<pybind11::object> refs_;             // References to data we want to ensure doesn't get garbage collected
   std::shared_ptr<PyNamedTensors> named_tensors_;  // Ensure the model inputs don't get garbage collected
 };
 
+// Runs a generator's decode loop on a native worker thread and hands each step's next tokens to an asyncio event loop,
+// so `async for tokens in generator.stream()` never blocks the loop. The generator must not be used otherwise while
+// the stream runs.
+struct PyTokenStream {
+  PyTokenStream(Generator& generator) : generator_{generator} {
+    worker_.Enqueue([this]() { Run(); });
+  }
+
+  ~PyTokenStream() {
+    cancelled_ = true;
+    pybind11::gil_scoped_release release;  // The worker may be waiting for the GIL to resolve a future
+    worker_.Stop();
+  }
+
+  // __anext__, returns an asyncio future of the next step's tokens
+  pybind11::object Next() {
+    auto loop = pybind11::module_::import("asyncio").attr("get_running_loop")();
+    auto future = loop.attr("create_future")();
+
+    std::unique_lock lock{mutex_};
+    if (tokens_.empty() && !done_) {
+      waiter_loop_ = loop;
+      waiter_future_ = future;
+      return future;
+    }
+    auto outcome = TakeOutcome();
+    lock.unlock();
+    Resolve(future, outcome);
+    return future;
+  }
+
+ private:
+  struct Outcome {
+    std::optional<std::vector<int32_t>> tokens;  // Not set when the stream ended
+    std::string error;
+  };
+
+  void Run() {
+    try {
+      while (!cancelled_ && !generator_.IsDone()) {
+        generator_.GenerateNextToken();
+        auto tokens = generator_.GetNextTokens();
+        Post([&] { tokens_.emplace_back(tokens.begin(), tokens.end()); });
+      }
+      Post([&] { done_ = true; });
+    } catch (const std::exception& e) {
+      Post([&] {
+        done_ = true;
+        error_ = e.what();
+      });
+    }
+  }
+
+  // Requires mutex_, with tokens_ not empty or done_ set
+  Outcome TakeOutcome() {
+    if (!tokens_.empty()) {
+      Outcome outcome{std::move(tokens_.front()), {}};
+      tokens_.pop_front();
+      return outcome;
+    }
+    return {std::nullopt, std::exchange(error_, {})};  // The error is raised once, then the stream just ends
+  }
+
+  // Updates the state under mutex_ and resolves the pending future, if any, on its event loop
+  template <typename Fn>
+  void Post(Fn&& update) {
+    Outcome outcome;
+    {
+      std::scoped_lock lock{mutex_};
+      update();
+      if (!waiter_future_)
+        return;
+      outcome = TakeOutcome();
+    }
+
+    // The GIL is only taken without holding mutex_, Next takes them the other way around
+    pybind11::gil_scoped_acquire acquire;
+    pybind11::object loop, future;
+    {
+      std::scoped_lock lock{mutex_};
+      loop = std::move(waiter_loop_);
+      future = std::move(waiter_future_);
+    }
+    loop.attr("call_soon_threadsafe")(pybind11::cpp_function([future, outcome = std::move(outcome)]() { Resolve(future, outcome); }));
+  }
+
+  static void Resolve(pybind11::object future, const Outcome& outcome) {
+    if (future.attr("done")().cast<bool>())  // Cancelled by the awaiting task
+      return;
+    if (outcome.tokens)
+      future.attr("set_result")(pybind11::array_t<int32_t>(outcome.tokens->size(), outcome.tokens->data()));
+    else if (!outcome.error.empty())
+      future.attr("set_exception")(pybind11::module_::import("builtins").attr("RuntimeError")(outcome.error));
+    else
+      future.attr("set_exception")(pybind11::module_::import("builtins").attr("StopAsyncIteration")());
+  }
+
+  Generator& generator_;
+  std::atomic<bool> cancelled_{};
+
+  std::mutex mutex_;
+  std::deque<std::vector<int32_t>> tokens_;  // Steps not yet handed out, protected by mutex_
+  bool done_{};                              // Protected by mutex_
+  std::string error_;                        // Protected by mutex_
+  pybind11::object waiter_loop_;             // Loop and future of a pending Next, protected by mutex_
+  pybind11::object waiter_future_;
+
+  WorkerThread worker_;  // Last, so it stops before the members it uses are destroyed
+};
+
 struct PyGenerator {
   PyGenerator(Model& model, PyGeneratorParams& params) {
     generator_ = CreateGenerator(model, *params.params_);
   }
+  PyGenerator(std::unique_ptr<Generator> generator) : generator_{std::move(generator)} {}
 
   pybind11::array_t<int32_t> GetNextTokens() {
-    py_tokens_ = generator_->search_->GetNextTokens();
-    return py_tokens_.GetNumpy();
+    auto tokens = generator_->GetNextTokens();
+    return pybind11::array_t<int32_t>(tokens.size(), tokens.data());
+  }
+
+  // (tokens, logprobs), both of shape (batch_size * num_beams, top_logprobs)
+  pybind11::tuple GetTopLogProbs() {
+    auto tokens = generator_->GetTopLogProbTokens();
+    auto logprobs = generator_->GetTopLogProbs();
+    const auto count = static_cast<size_t>(generator_->search_->params_->search.top_logprobs);
+    const std::array<size_t, 2> shape{tokens.size() / count, count};
+    return pybind11::make_tuple(pybind11::array_t<int32_t>(shape, tokens.data()), pybind11::array_t<float>(shape, logprobs.data()));
   }
 
   pybind11::array_t<int32_t> GetSequence(int index) {
@@ -279,15 +590,35 @@ struct PyGenerator {
   }
 
   void AppendTokens(pybind11::array_t<int32_t> tokens) {
-    generator_->AppendTokens(ToSpan(tokens));
+    auto span = ToSpan(tokens);  // Converting the array touches Python objects, so it's done while holding the GIL
+
+    pybind11::gil_scoped_release release;
+    generator_->AppendTokens(span);
   }
 
   pybind11::array_t<float> GetLogits() {
-    py_logits_ = generator_->GetLogits();
+    {
+      pybind11::gil_scoped_release release;
+      py_logits_ = generator_->GetLogits();
+    }
     return py_logits_.GetNumpy();
   }
 
-  void SetLogits(pybind11::array_t<float> new_logits) {
+  // Zero-copy view of the logits, changes made through it are used by the next generate_next_token
+  PyDeviceArray<float> GetLogitsView() {
+    auto logits = generator_->GetLogits();
+    const auto vocab_size = static_cast<int64_t>(generator_->model_->config_->model.vocab_size);
+    return {logits, *generator_->state_->params_->p_device, {static_cast<int64_t>(logits.size()) / vocab_size, vocab_size}};
+  }
+
+  void SetLogits(pybind11::object value) {
+    if (!pybind11::isinstance<pybind11::array>(value) && pybind11::hasattr(value, "__dlpack__")) {
+      CopyFromDLPack(value, generator_->search_->GetLogits(), *generator_->state_->params_->p_device);
+      generator_->computed_logits_ = true;
+      return;
+    }
+
+    auto new_logits = value.cast<pybind11::array_t<float>>();
     auto logits = generator_->search_->GetLogits();
     if (static_cast<size_t>(new_logits.size()) != logits.size())
       throw std::runtime_error("Generator::SetLogits passed an array of size " + std::to_string(new_logits.size()) + " but should be size " + std::to_string(logits.size()));
@@ -297,25 +628,121 @@ struct PyGenerator {
     generator_->computed_logits_ = true;
   }
 
+  void SetLogitsBias(const std::map<int32_t, float>& logit_bias) {
+    std::vector<std::pair<int32_t, float>> biases(logit_bias.begin(), logit_bias.end());
+    generator_->SetLogitsBias(biases);
+  }
+
+  void SetAllowedTokens(pybind11::array_t<int32_t> tokens) {
+    generator_->SetAllowedTokens(ToSpan(tokens));
+  }
+
   void GenerateNextToken() {
     generator_->GenerateNextToken();
   }
 
+  pybind11::array_t<int32_t> GenerateTokens(size_t max_new_tokens, const std::optional<pybind11::function>& callback, size_t callback_interval) {
+    const size_t batch_size = generator_->search_->params_->search.batch_size;
+    std::vector<int32_t> tokens(max_new_tokens * batch_size);
+    std::function<bool(std::span<const int32_t>)> on_tokens;
+    if (callback) {
+      on_tokens = [&](std::span<const int32_t> new_tokens) {
+        pybind11::gil_scoped_acquire acquire;
+        auto result = (*callback)(pybind11::array_t<int32_t>({new_tokens.size() / batch_size, batch_size}, new_tokens.data()));
+        return result.is_none() || result.cast<bool>();
+      };
+    }
+    size_t count;
+    {
+      pybind11::gil_scoped_release release;
+      count = generator_->GenerateTokens(max_new_tokens, tokens, callback ? callback_interval : 0, on_tokens);
+    }
+    return pybind11::array_t<int32_t>({count, batch_size}, tokens.data());
+  }
+
   void RewindToLength(size_t new_length) {
     generator_->RewindToLength(new_length);
   }
 
+  void SetTokens(pybind11::array_t<int32_t> tokens) {
+    auto span = ToSpan(tokens);  // See AppendTokens
+
+    pybind11::gil_scoped_release release;
+    generator_->SetTokens(span);
+  }
+
+  std::unique_ptr<PyGenerator> Fork() {
+    return std::make_unique<PyGenerator>(generator_->Fork());
+  }
+
+  pybind11::bytes SaveState(bool quantize_kv_cache) {
+    auto state = generator_->SaveState(quantize_kv_cache);
+    return pybind11::bytes(reinterpret_cast<const char*>(state.data()), state.size());
+  }
+
+  void LoadState(const pybind11::bytes& state) {
+    std::string_view data{state};
+    generator_->LoadState(std::span<const uint8_t>{reinterpret_cast<const uint8_t*>(data.data()), data.size()});
+  }
+
+  void AppendState(const pybind11::bytes& state) {
+    std::string_view data{state};
+    generator_->AppendState(std::span<const uint8_t>{reinterpret_cast<const uint8_t*>(data.data()), data.size()});
+  }
+
+  void OffloadKeyValueCache(const std::optional<std::string>& path) {
+    generator_->OffloadKeyValueCache(path ? path->c_str() : nullptr);
+  }
+
+  void RestoreKeyValueCache() {
+    generator_->RestoreKeyValueCache();
+  }
+
   bool IsDone() const {
     return generator_->IsDone();
   }
 
+  std::unique_ptr<PyTokenStream> Stream() {
+    return std::make_unique<PyTokenStream>(*generator_);
+  }
+
+  bool IsDoneReady() const {
+    return generator_->IsDoneReady();
+  }
+
   void SetActiveAdapter(Adapters* adapters, const std::string& adapter_name) {
     generator_->state_->SetActiveAdapter(adapters, adapter_name);
   }
 
+  // {"prefill": {...}, "decode": {...}}, see OgaGenerator_GetMetrics
+  pybind11::dict GetMetrics() const {
+    auto to_dict = [](const GeneratorMetrics::Phase& phase) {
+      pybind11::dict dict;
+      dict["calls"] = phase.calls;
+      dict["tokens"] = phase.tokens;
+      dict["total_seconds"] = phase.total_seconds;
+      for (size_t i = 0; i < GeneratorMetrics::StageCount; i++)
+        dict[pybind11::str(std::string(GeneratorMetrics::stage_names[i]) + "_seconds")] = phase.stage_seconds[i];
+      return dict;
+    };
+
+    pybind11::dict metrics;
+    metrics["prefill"] = to_dict(generator_->metrics_.prefill);
+    metrics["decode"] = to_dict(generator_->metrics_.decode);
+    return metrics;
+  }
+
+  void ResetMetrics() {
+    generator_->metrics_ = {};
+  }
+
+  // Byte counts by category, see OgaGenerator_GetMemoryUsage
+  pybind11::object GetMemoryUsage() const {
+    return pybind11::module_::import("json").attr("loads")(generator_->GetMemoryUsage());
+  }
+
  private:
   std::unique_ptr<Generator> generator_;
-  PyDeviceMemorySpan<int32_t> py_tokens_;
   PyDeviceMemorySpan<int32_t> py_sequence_;
   PyDeviceMemorySpan<float> py_logits_;
 };
@@ -368,6 +795,7 @@ PYBIND11_MODULE(onnxruntime_genai, m) {
       // TODO(baijumeswani): Rename/redesign the whisper_input_features to be more generic
       .def_readwrite("whisper_input_features", &PyGeneratorParams::py_whisper_input_features_)
       .def_readwrite("alignment_heads", &PyGeneratorParams::py_alignment_heads_)
+      .def_readwrite("sparse_cross_qk", &PyGeneratorParams::py_sparse_cross_qk_)
       .def("set_inputs", [](PyGeneratorParams& generator_params, std::shared_ptr<PyNamedTensors> named_tensors) {
         if (!named_tensors || !named_tensors->named_tensors_)
           throw std::runtime_error("No inputs provided.");
@@ -377,29 +805,81 @@ PYBIND11_MODULE(onnxruntime_genai, m) {
       .def("set_model_input", &PyGeneratorParams::SetModelInput)
       .def("set_search_options", &PyGeneratorParams::SetSearchOptions)                                     // See config.h 'struct Search' for the options
       .def("try_use_cuda_graph_with_max_batch_size", &PyGeneratorParams::TryUseCudaGraphWithMaxBatchSize)  // will be deprecated
-      .def("try_graph_capture_with_max_batch_size", &PyGeneratorParams::TryGraphCaptureWithMaxBatchSize);
+      .def("try_graph_capture_with_max_batch_size", &PyGeneratorParams::TryGraphCaptureWithMaxBatchSize)
+      .def("set_draft_model", &PyGeneratorParams::SetDraftModel, pybind11::arg("draft_model"), pybind11::arg("num_draft_tokens") = 4)
+      .def("set_batch_sampling", &PyGeneratorParams::SetBatchSampling, pybind11::arg("top_k"), pybind11::arg("top_p"), pybind11::arg("temperature"))
+      .def("set_batch_adapters", &PyGeneratorParams::SetBatchAdapters, pybind11::arg("adapter_names"))
+      .def("set_guidance", &PyGeneratorParams::SetGuidance, pybind11::arg("type"), pybind11::arg("data"))
+      .def("add_stop_token_sequence", &PyGeneratorParams::AddStopTokenSequence, pybind11::arg("tokens"))
+      .def("add_stop_string", &PyGeneratorParams::AddStopString, pybind11::arg("text"));
+
+  // Transcribes audio that arrives in chunks, the features of add_features are [number_of_mels, frame_count] log-mel frames
+  pybind11::class_<WhisperStream, std::shared_ptr<WhisperStream>>(m, "WhisperStream")
+      .def(pybind11::init([](const Model& model, PyGeneratorParams& params, pybind11::array_t<int32_t> prompt_tokens,
+                             int32_t start_of_previous_token_id, size_t step_frames, size_t window_frames) {
+             return std::make_shared<WhisperStream>(model, params.params_, ToSpan(prompt_tokens), start_of_previous_token_id,
+                                                    step_frames, window_frames);
+           }),
+           pybind11::arg("model"), pybind11::arg("params"), pybind11::arg("prompt_tokens"), pybind11::arg("start_of_previous_token_id") = -1,
+           pybind11::arg("step_frames") = 100, pybind11::arg("window_frames") = 3000)
+      .def("add_features", [](WhisperStream& stream, pybind11::array_t<float> features) {
+        if (features.ndim() != 2)
+          throw std::runtime_error("features must be 2 dimensional, [number_of_mels, frame_count]");
+        const auto frame_count = static_cast<size_t>(features.shape(1));
+        auto span = ToSpan(features);
+
+        pybind11::gil_scoped_release release;
+        stream.AddFeatures(span, frame_count);
+      })
+      .def("flush", &WhisperStream::Flush, pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("get_new_tokens", [](WhisperStream& stream) {
+        auto tokens = stream.GetNewTokens();
+        return pybind11::array_t<int32_t>(tokens.size(), tokens.data());
+      })
+      .def("get_transcript", [](const WhisperStream& stream) {
+        auto tokens = stream.GetTranscript();
+        return pybind11::array_t<int32_t>(tokens.size(), tokens.data());
+      })
+      .def(
+          "set_voice_activity", [](WhisperStream& stream, float silence_threshold, size_t min_silence_frames, size_t padding_frames) {
+            stream.SetVoiceActivity({silence_threshold, min_silence_frames, padding_frames});
+          },
+          pybind11::arg("silence_threshold") = 1.0f, pybind11::arg("min_silence_frames") = 50, pybind11::arg("padding_frames") = 10)
+      // The completed segments as (begin_frame, end_frame, tokens)
+      .def("get_segments", [](const WhisperStream& stream) {
+        pybind11::list segments;
+        for (auto& segment : stream.GetSegments())
+          segments.append(pybind11::make_tuple(segment.begin_frame, segment.end_frame,
+                                               pybind11::array_t<int32_t>(segment.tokens.size(), segment.tokens.data())));
+        return segments;
+      });
 
   pybind11::class_<TokenizerStream>(m, "TokenizerStream")
       .def("decode", [](TokenizerStream& t, int32_t token) { return t.Decode(token); });
 
   pybind11::class_<Tokenizer, std::shared_ptr<Tokenizer>>(m, "Tokenizer")
       .def(pybind11::init([](Model& model) { return model.CreateTokenizer(); }))
-      .def("encode", &Tokenizer::Encode)
+      .def("encode", &Tokenizer::Encode, pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("encode_segments", [](const Tokenizer& t, std::vector<std::string> segments) { return t.EncodeSegments(segments); },
+           pybind11::call_guard<pybind11::gil_scoped_release>())
       .def("to_token_id", &Tokenizer::TokenToTokenId)
       .def("decode", [](const Tokenizer& t, pybind11::array_t<int32_t> tokens) { return t.Decode(ToSpan(tokens)); })
       .def("encode_batch", [](const Tokenizer& t, std::vector<std::string> strings) {
-        auto result = t.EncodeBatch(strings);
+        std::vector<int32_t> result;
+        {
+          pybind11::gil_scoped_release release;
+          result = t.EncodeBatch(strings);
+        }
         return pybind11::array_t<int32_t>({strings.size(), result.size() / strings.size()}, result.data());
       })
       .def("decode_batch", [](const Tokenizer& t, pybind11::array_t<int32_t> tokens) {
-        if (tokens.ndim() == 1) {  // Just a 1D array
-          return t.DecodeBatch(ToSpan(tokens), 1);
-        } else {
-          if (tokens.ndim() != 2)
-            throw std::runtime_error("token shape can only be 1 or 2 dimensional");
+        if (tokens.ndim() != 1 && tokens.ndim() != 2)
+          throw std::runtime_error("token shape can only be 1 or 2 dimensional");
+        const size_t count = tokens.ndim() == 1 ? 1 : tokens.shape(0);  // A 1D array is a single sequence
+        auto span = ToSpan(tokens);
 
-          return t.DecodeBatch(ToSpan(tokens), tokens.shape(0));
-        }
+        pybind11::gil_scoped_release release;
+        return t.DecodeBatch(span, count);
       })
       .def("create_stream", [](const Tokenizer& t) { return t.CreateStream(); });
 
@@ -408,32 +888,88 @@ PYBIND11_MODULE(onnxruntime_genai, m) {
       .def(pybind11::init([](const std::string& config_path) { return OgaConfig::Create(config_path.c_str()); }))
       .def("append_provider", &OgaConfig::AppendProvider)
       .def("set_provider_option", &OgaConfig::SetProviderOption)
+      .def("overlay", &OgaConfig::Overlay)
       .def("clear_providers", &OgaConfig::ClearProviders);
 
   pybind11::class_<Model, std::shared_ptr<Model>>(m, "Model")
       .def(pybind11::init([](const OgaConfig& config) {
-        auto config_copy = std::make_unique<Config>(*reinterpret_cast<const Config*>(&config));
-        return CreateModel(GetOrtEnv(), std::move(config_copy));
-      }))
+             auto config_copy = std::make_unique<Config>(*reinterpret_cast<const Config*>(&config));
+             return CreateModel(GetOrtEnv(), std::move(config_copy));
+           }),
+           pybind11::call_guard<pybind11::gil_scoped_release>())
       .def(pybind11::init([](const std::string& config_path) {
-        return CreateModel(GetOrtEnv(), config_path.c_str());
-      }))
+             return CreateModel(GetOrtEnv(), config_path.c_str());
+           }),
+           pybind11::call_guard<pybind11::gil_scoped_release>())
       .def_property_readonly("type", [](const Model& model) { return model.config_->model.type; })
       .def_property_readonly(
           "device_type", [](const Model& model) { return to_string(model.p_device_->GetType()); }, "The device type the model is running on")
-      .def("create_multimodal_processor", [](const Model& model) { return model.CreateMultiModalProcessor(); });
+      .def("create_multimodal_processor", [](const Model& model) { return model.CreateMultiModalProcessor(); })
+      .def("get_memory_usage", [](const Model& model) { return pybind11::module_::import("json").attr("loads")(model.GetMemoryUsage()); })
+      .def("release_cached_memory", &Model::ReleaseCachedMemory)
+      .def(
+          "embed", [](const Model& model, const std::vector<std::vector<int32_t>>& sequences, const std::string& pooling) {
+            std::unique_ptr<OrtValue> embeddings;
+            {
+              pybind11::gil_scoped_release release;
+              embeddings = model.Embed(sequences, pooling);
+            }
+            return ToNumpy(embeddings.get(), model);
+          },
+          pybind11::arg("sequences"), pybind11::arg("pooling") = "last_token")
+      .def(
+          "score_sequences", [](const Model& model, const std::vector<std::vector<int32_t>>& prompts, const std::vector<std::vector<int32_t>>& continuations) {
+            std::unique_ptr<OrtValue> log_probs;
+            {
+              pybind11::gil_scoped_release release;
+              log_probs = model.ScoreSequences(prompts, continuations);
+            }
+            return ToNumpy(log_probs.get(), model);
+          },
+          pybind11::arg("prompts"), pybind11::arg("continuations"));
+
+  pybind11::class_<PyDeviceArray<float>>(m, "DeviceArray")
+      .def("__dlpack__", [](PyDeviceArray<float>& a, pybind11::object /*stream*/) { return a.ToDLPack(); }, pybind11::arg("stream") = pybind11::none())
+      .def("__dlpack_device__", &PyDeviceArray<float>::GetDLPackDevice)
+      .def_property_readonly("__cuda_array_interface__", &PyDeviceArray<float>::GetCudaArrayInterface)
+      .def_property_readonly("shape", &PyDeviceArray<float>::GetShape)
+      .def("numpy", &PyDeviceArray<float>::GetNumpy);
+
+  // The native calls that can take long release the GIL, so generators on different Python threads run concurrently.
+  // A single generator (its State) must still only be used by one thread at a time.
+  pybind11::class_<PyTokenStream>(m, "TokenStream")
+      .def("__aiter__", [](pybind11::object self) { return self; })
+      .def("__anext__", &PyTokenStream::Next);
 
   pybind11::class_<PyGenerator>(m, "Generator")
-      .def(pybind11::init<Model&, PyGeneratorParams&>())
+      .def(pybind11::init<Model&, PyGeneratorParams&>(), pybind11::call_guard<pybind11::gil_scoped_release>())
       .def("is_done", &PyGenerator::IsDone)
+      .def("is_done_ready", &PyGenerator::IsDoneReady)
       .def("get_output", &PyGenerator::GetOutput)
       .def("append_tokens", &PyGenerator::AppendTokens)
       .def("get_logits", &PyGenerator::GetLogits)
+      .def("get_logits_view", &PyGenerator::GetLogitsView)
       .def("set_logits", &PyGenerator::SetLogits)
-      .def("generate_next_token", &PyGenerator::GenerateNextToken)
+      .def("set_logits_bias", &PyGenerator::SetLogitsBias)
+      .def("set_allowed_tokens", &PyGenerator::SetAllowedTokens)
+      .def("generate_next_token", &PyGenerator::GenerateNextToken, pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("generate_tokens", &PyGenerator::GenerateTokens, pybind11::arg("max_new_tokens"), pybind11::arg("callback") = std::nullopt,
+           pybind11::arg("callback_interval") = 1)
       .def("rewind_to", &PyGenerator::RewindToLength)
+      .def("set_tokens", &PyGenerator::SetTokens)
+      .def("fork", &PyGenerator::Fork, pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("save_state", &PyGenerator::SaveState, pybind11::arg("quantize_kv_cache") = false)
+      .def("load_state", &PyGenerator::LoadState)
+      .def("append_state", &PyGenerator::AppendState)
+      .def("offload_kv_cache", &PyGenerator::OffloadKeyValueCache, pybind11::arg("path") = std::nullopt)
+      .def("restore_kv_cache", &PyGenerator::RestoreKeyValueCache)
       .def("get_next_tokens", &PyGenerator::GetNextTokens)
+      .def("get_top_logprobs", &PyGenerator::GetTopLogProbs)
       .def("get_sequence", &PyGenerator::GetSequence)
+      .def("stream", &PyGenerator::Stream, pybind11::keep_alive<0, 1>())
+      .def("get_metrics", &PyGenerator::GetMetrics)
+      .def("reset_metrics", &PyGenerator::ResetMetrics)
+      .def("get_memory_usage", &PyGenerator::GetMemoryUsage)
       .def("set_active_adapter", [](PyGenerator& generator, Adapters* adapters, const std::string& adapter_name) {
         generator.SetActiveAdapter(adapters, adapter_name);
       });
@@ -522,7 +1058,12 @@ PYBIND11_MODULE(onnxruntime_genai, m) {
       .def(pybind11::init([](Model& model) {
         return std::make_shared<Adapters>(&model);
       }))
-      .def("load", &Adapters::LoadAdapter);
+      .def("load", &Adapters::LoadAdapter)
+      .def("unload", &Adapters::UnloadAdapter)
+      .def("prefetch", &Adapters::PrefetchAdapter)
+      .def("is_ready", &Adapters::IsAdapterReady)
+      .def("set_memory_limit", &Adapters::SetMemoryLimit)
+      .def("get_memory_usage", &Adapters::GetMemoryUsage);
 
   m.def("set_log_options", &SetLogOptions);
 
@@ -3,6 +3,7 @@
 
 #include "../generators.h"
 #include "../search.h"
+#include "../cpu/interface.h"
 #include "interface.h"
 
 namespace Generators {
@@ -32,7 +33,11 @@ struct QnnMemory final : DeviceBuffer {
   void CopyDeviceToCpu() override {}  // Nothing to do, device memory is CPU accessible
   void CopyCpuToDevice() override {}  // Nothing to do, device memory is CPU accessible
   void CopyFrom(size_t begin_dest, DeviceBuffer& source, size_t begin_source, size_t size_in_bytes) override {
-    CopyThroughCpu(*this, begin_dest, source, begin_source, size_in_bytes);
+    // The shared memory and CPU memory are both directly addressable, so only other devices need a CPU round trip
+    if (source.GetType() == device_label || source.GetType() == label_cpu)
+      memcpy(p_device_ + begin_dest, source.p_device_ + begin_source, size_in_bytes);
+    else
+      CopyThroughCpu(*this, begin_dest, source, begin_source, size_in_bytes);
   }
 
   void Zero() override {
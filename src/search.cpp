@@ -3,30 +3,123 @@
 #include "search.h"
 #include "beam_search_scorer.h"
 #include "cpu/interface.h"
-#include <queue>
+#include "models/utils.h"
 #include <algorithm>
 
 namespace Generators {
 
+namespace {
+
+// Runs fn(index) for every index in [0, count), spread over the shared thread pool when there is more than one
+template <typename Fn>
+void ParallelFor(size_t count, Fn&& fn) {
+  if (count == 1)
+    fn(0);
+  else
+    GetThreadPool().ParallelFor(count, std::forward<Fn>(fn));
+}
+
+// Moves the indices of the 'count' highest scores to the front of 'indices', in descending score order. The first
+// 'sorted_count' indices must already be the highest scores in order, so a caller can extend the sorted range as needed.
+void SortTopIndices(std::span<int32_t> indices, std::span<const float> scores, size_t sorted_count, size_t count) {
+  auto compare = [scores = scores.data()](int32_t i, int32_t j) { return scores[i] > scores[j]; };
+  auto begin = indices.begin() + sorted_count;
+  auto middle = indices.begin() + count;
+  std::nth_element(begin, middle, indices.end(), compare);
+  std::sort(begin, middle, compare);
+}
+
+// Sorts the indices of the highest scores to the front of 'indices' until the sum of their 'weights' reaches 'threshold'
+// and returns how many were needed. Most of the weight is usually in a few tokens, so only that many are sorted,
+// growing the sorted set if needed.
+size_t SortTopIndicesUntil(std::span<int32_t> indices, std::span<const float> scores, std::span<const float> weights, float threshold) {
+  constexpr size_t initial_candidate_count = 64;
+
+  size_t sorted_count = 0;
+  for (size_t candidate_count = std::min(initial_candidate_count, indices.size()); sorted_count < indices.size();
+       candidate_count = std::min(candidate_count * 4, indices.size())) {
+    SortTopIndices(indices, scores, sorted_count, candidate_count);
+    for (; sorted_count < candidate_count; sorted_count++) {
+      threshold -= weights[indices[sorted_count]];
+      if (threshold <= 0)
+        return sorted_count + 1;
+    }
+  }
+  return indices.size();
+}
+
+}  // namespace
+
+void TokenCounts::Add(int32_t token) {
+  if (static_cast<size_t>(token) >= counts_.size()) {
+    counts_.resize(token + 1);
+    positions_.resize(token + 1);
+  }
+  if (counts_[token]++ == 0) {
+    positions_[token] = static_cast<int32_t>(tokens_.size());
+    tokens_.push_back(token);
+  }
+}
+
+void TokenCounts::Remove(int32_t token) {
+  assert(GetCount(token) > 0);
+  if (--counts_[token] == 0) {
+    // Move the last token into the removed token's place
+    const int32_t last_token = tokens_.back();
+    tokens_[positions_[token]] = last_token;
+    positions_[last_token] = positions_[token];
+    tokens_.pop_back();
+  }
+}
+
+void TokenCounts::Clear() {
+  for (int32_t token : tokens_)
+    counts_[token] = 0;
+  tokens_.clear();
+}
+
+// The CPU processors other than the token mask only touch the tokens they change, so they stay separate passes
+void Search::ApplyLogitsProcessors(const LogitsProcessors& processors) {
+  ApplyMinLength(processors.min_length);
+  ApplyRepetitionPenalty(processors.repetition_penalty);
+  ApplyFrequencyPenalty(processors.frequency_penalty, processors.presence_penalty);
+  ApplyNoRepeatNGram(processors.no_repeat_ngram_size);
+  ApplyLogitBias(processors.logit_bias);
+  if (!processors.token_mask.empty())
+    ApplyTokenMask(processors.token_mask);
+}
+
 Search_Cpu::Search_Cpu(const GeneratorParams& params)
     : Search{params},
       cpu_device_{*GetCpuInterface()} {
   auto batch_beam_size = params.BatchBeamSize();
 
   sequence_lengths_ = cpu_device_.Allocate<int32_t>(batch_beam_size);
+  token_counts_.resize(batch_beam_size);
 }
 
 GreedySearch_Cpu::GreedySearch_Cpu(const GeneratorParams& params)
     : Search_Cpu(params) {
-  if (params_->search.random_seed != -1)
-    gen_.seed(params_->search.random_seed);
-  else {
+  gens_.resize(params.search.batch_size);
+  if (params_->search.random_seed != -1) {
+    // The first batch entry uses random_seed itself, so single sequence results are the same as with a single stream
+    gens_[0].seed(params_->search.random_seed);
+    for (size_t i = 1; i < gens_.size(); i++) {
+      std::seed_seq seq{params_->search.random_seed, static_cast<int>(i)};
+      gens_[i].seed(seq);
+    }
+  } else {
     std::random_device rd;
-    std::array<uint32_t, decltype(gen_)::state_size> data;
-    std::generate(std::begin(data), std::end(data), std::ref(rd));
-    std::seed_seq seq(data.begin(), data.end());
-    gen_.seed(seq);
+    for (auto& gen : gens_) {
+      std::array<uint32_t, std::mt19937::state_size> data;
+      std::generate(std::begin(data), std::end(data), std::ref(rd));
+      std::seed_seq seq(data.begin(), data.end());
+      gen.seed(seq);
+    }
   }
+  sample_indices_.resize(params.search.batch_size);
+  track_token_counts_ = params.search.repetition_penalty != 1.0f || params.search.frequency_penalty != 0.0f ||
+                        params.search.presence_penalty != 0.0f;
 
   next_tokens_ptr_ = cpu_device_.Allocate<int32_t>(params.search.batch_size);
   next_tokens_ptr_.Zero();
@@ -40,9 +133,23 @@ BeamSearch_Cpu::BeamSearch_Cpu(const GeneratorParams& params)
     : Search_Cpu(params) {
   assert(params_->search.num_beams > 1);  // If 1, use GreedySearch
   beam_scorer_ = std::make_unique<BeamSearchScorer>(*params_);
+  sequences_.UseTokenTree();
 
   next_tokens_buffer_ = AllocateArray<int32_t>(params.BatchBeamSize(), &next_tokens_);
   memset(next_tokens_buffer_.get(), 0, next_tokens_.size_bytes());
+
+  const size_t top_k = 2 * static_cast<size_t>(params.search.num_beams);
+  top_candidates_.resize(params.search.batch_size);
+  for (auto& candidates : top_candidates_)
+    candidates.reserve(top_k);
+  top_scores_.resize(top_k * params.search.batch_size);
+  top_indices_.resize(top_k * params.search.batch_size);
+  top_tokens_.resize(top_k * params.search.batch_size);
+  if (params.search.num_beam_groups > 1) {
+    group_tokens_.resize(params.search.batch_size);
+    for (auto& tokens : group_tokens_)
+      tokens.reserve(params.search.num_beams);
+  }
 }
 
 BeamSearch_Cpu::~BeamSearch_Cpu() = default;
@@ -69,64 +176,79 @@ DeviceSpan<int32_t> BeamSearch_Cpu::GetNextIndices() {
 
 void BeamSearch_Cpu::SelectTop() {
   auto next_token_scores = next_token_scores_.Span();
+  auto beam_scores = beam_scorer_->GetNextScores().Span();
 
-  // Normalize next token scores
-  for (size_t i = 0; i < params_->BatchBeamSize(); i++) {
-    std::span<float> const scores = next_token_scores.subspan(i * static_cast<size_t>(params_->config.model.vocab_size), params_->config.model.vocab_size);
-    LogSoftMax(scores, 1.0);
-  }
+  const size_t vocab_size = params_->config.model.vocab_size;
+  const size_t num_beam_groups = params_->search.num_beam_groups;
+  const size_t group_size = params_->search.num_beams / num_beam_groups;
+  const size_t top_k = 2 * group_size;
+  const float diversity_penalty = params_->search.diversity_penalty;
 
-  auto beam_scores = beam_scorer_->GetNextScores().Span();
+  auto next_scores = std::span<float>(top_scores_);
+  auto next_indices = std::span<int32_t>(top_indices_);
+  auto next_tokens = std::span<int32_t>(top_tokens_);
 
-  // Add beam score to next token scores. Corresponding python code is like:
+  // Normalize the next token scores, then keep the best top_k candidates of each beam group in a min-heap, so most scores
+  // are rejected with one compare. The beam score is added in the same pass. Corresponding python code is like:
   //    next_token_scores = next_token_scores + beam_scores[:, None].expand_as(next_token_scores)
-  // TODO(aciddelgado): use thread pool to parallel
-  int offset = 0;
-  int batch_beam_index = 0;
-  for (int i = 0; i < params_->search.batch_size; i++) {
-    for (int j = 0; j < params_->search.num_beams; j++, batch_beam_index++) {
-      for (int k = 0; k < params_->config.model.vocab_size; k++, offset++) {
-        next_token_scores[offset] += beam_scores[batch_beam_index];
+  // The groups of a batch entry are searched one after the other, as the Hamming diversity penalty of a group depends
+  // on the tokens the earlier groups picked in this step.
+  auto greater = [](const ScoreIndex& a, const ScoreIndex& b) { return a.score > b.score; };
+  ParallelFor(params_->search.batch_size, [&](size_t batch_index) {
+    auto& top_candidates = top_candidates_[batch_index];
+    if (num_beam_groups > 1)
+      group_tokens_[batch_index].clear();
+
+    for (size_t group = 0; group < num_beam_groups; group++) {
+      const size_t group_index = batch_index * num_beam_groups + group;
+      top_candidates.clear();
+      for (size_t beam_index = 0; beam_index < group_size; beam_index++) {
+        const size_t batch_beam_index = group_index * group_size + beam_index;
+        auto token_scores = next_token_scores.subspan(batch_beam_index * vocab_size, vocab_size);
+        LogSoftMax(token_scores, 1.0);
+        if (num_beam_groups > 1) {
+          for (int32_t token : group_tokens_[batch_index]) {
+            if (static_cast<size_t>(token) < vocab_size)  // The pad token of a done group can be -1
+              token_scores[token] -= diversity_penalty;
+          }
+        }
+        const float beam_score = beam_scores[batch_beam_index];
+        const auto index_offset = static_cast<int32_t>(beam_index * vocab_size);
+
+        for (size_t token = 0; token < vocab_size; token++) {
+          const float score = token_scores[token] += beam_score;
+          if (top_candidates.size() < top_k) {
+            top_candidates.push_back({score, index_offset + static_cast<int32_t>(token)});
+            std::push_heap(top_candidates.begin(), top_candidates.end(), greater);
+          } else if (score > top_candidates.front().score) {
+            std::pop_heap(top_candidates.begin(), top_candidates.end(), greater);
+            top_candidates.back() = {score, index_offset + static_cast<int32_t>(token)};
+            std::push_heap(top_candidates.begin(), top_candidates.end(), greater);
+          }
+        }
       }
-    }
-  }
-
-  const size_t top_k = 2 * params_->search.num_beams;
 
-  struct ScoreIndex {
-    float score;
-    int32_t index;
-
-    bool operator<(const ScoreIndex& s) const { return score < s.score; }
-  };
-
-  auto scores = std::make_unique<float[]>(top_k * params_->search.batch_size);     // Score of top_k tokens
-  auto indices = std::make_unique<int32_t[]>(top_k * params_->search.batch_size);  // beam index of top_k tokens
-  auto tokens = std::make_unique<int32_t[]>(top_k * params_->search.batch_size);   // token id of top_k tokens
-
-  auto next_scores = std::span<float>(scores.get(), top_k * params_->search.batch_size);
-  auto next_indices = std::span<int32_t>(indices.get(), top_k * params_->search.batch_size);
-  auto next_tokens = std::span<int32_t>(tokens.get(), top_k * params_->search.batch_size);
-
-  // TODO(aciddelgado): Optimize this top k with partial sort
-  for (size_t batch_index = 0; batch_index < static_cast<size_t>(params_->search.batch_size); batch_index++) {
-    std::priority_queue<ScoreIndex, std::vector<ScoreIndex>> queue;
-    auto token_scores_sub = next_token_scores.subspan(batch_index * params_->search.num_beams * params_->config.model.vocab_size, static_cast<size_t>(params_->search.num_beams) * params_->config.model.vocab_size);
-    for (int i = 0; i < token_scores_sub.size(); i++) {
-      queue.push({token_scores_sub[i], i});
-    }
+      // Best first, ties in index order
+      std::sort(top_candidates.begin(), top_candidates.end(),
+                [](const ScoreIndex& a, const ScoreIndex& b) { return a.score > b.score || (a.score == b.score && a.index < b.index); });
+
+      auto next_indices_sub = next_indices.subspan(top_k * group_index, top_k);
+      auto next_tokens_sub = next_tokens.subspan(top_k * group_index, top_k);
+      auto next_scores_sub = next_scores.subspan(top_k * group_index, top_k);
+      for (size_t i = 0; i < top_k; i++) {
+        const auto& v = top_candidates[i];
+        next_indices_sub[i] = v.index / static_cast<int32_t>(vocab_size);
+        next_tokens_sub[i] = v.index % static_cast<int32_t>(vocab_size);
+        next_scores_sub[i] = v.score;
+      }
 
-    auto next_indices_sub = next_indices.subspan(top_k * batch_index, top_k);
-    auto next_tokens_sub = next_tokens.subspan(top_k * batch_index, top_k);
-    auto next_scores_sub = next_scores.subspan(top_k * batch_index, top_k);
-    for (unsigned i = 0; i < top_k; i++) {
-      auto v = queue.top();
-      next_indices_sub[i] = v.index / params_->config.model.vocab_size;
-      next_tokens_sub[i] = v.index % params_->config.model.vocab_size;
-      next_scores_sub[i] = v.score;
-      queue.pop();
+      beam_scorer_->ProcessGroup(sequences_, group_index, next_scores, next_tokens, next_indices);
+      if (num_beam_groups > 1) {
+        auto group_next_tokens = beam_scorer_->GetNextTokens().Span().subspan(group_index * group_size, group_size);
+        group_tokens_[batch_index].insert(group_tokens_[batch_index].end(), group_next_tokens.begin(), group_next_tokens.end());
+      }
     }
-  }
+  });
 
 #if 0  // TODO(ryanhill): Use logging option
   DumpSpan(std::cout, next_tokens);
@@ -134,103 +256,350 @@ void BeamSearch_Cpu::SelectTop() {
   DumpSpan(std::cout, next_scores_);
 #endif
 
-  beam_scorer_->Process(sequences_, next_scores, next_tokens, next_indices);
   next_tokens_ = cpu_span<int32_t>(beam_scorer_->GetNextTokens().Span());
 
   AppendNextTokensToSequences();
 }
 
 void GreedySearch_Cpu::SelectTop() {
-  // next_tokens = torch.argmax(scores, dim=-1)
-  for (size_t batch_id = 0; batch_id < params_->search.batch_size; batch_id++) {
+  ParallelFor(params_->search.batch_size, [&](size_t batch_id) {
     if (PadIfAlreadyEOS(batch_id)) {
-      continue;
+      return;
     }
+    next_tokens_[batch_id] = SelectTopToken(batch_id);
+  });
 
-    std::span<float> const scores = next_token_scores_.Span().subspan(batch_id * params_->config.model.vocab_size, params_->config.model.vocab_size);
-    auto const token = static_cast<int32_t>(std::distance(scores.begin(), std::max_element(scores.begin(), scores.end())));
-    SetNextToken(batch_id, token);
-  }
-
+  SetNextTokens();
   AppendNextTokensToSequences();
 }
 
-void GreedySearch_Cpu::SampleTopK(int k, float temperature) {
-  for (size_t batch_id = 0; batch_id < params_->search.batch_size; batch_id++) {
-    std::span<float> const scores = next_token_scores_.Span().subspan(batch_id * params_->config.model.vocab_size, params_->config.model.vocab_size);
-    SoftMax(scores, temperature);
-    // Find the top K scores
-    std::vector<int> indices(scores.size());
+void GreedySearch_Cpu::SelectFromCandidates(std::span<const float> scores, std::span<const int32_t> tokens) {
+  const auto& search = params_->search;
+  const size_t count = scores.size() / search.batch_size;
+  const bool sample = search.do_sample && search.top_k > 1;
+  ParallelFor(search.batch_size, [&](size_t batch_id) {
+    if (PadIfAlreadyEOS(batch_id)) {
+      return;
+    }
+    auto batch_scores = scores.subspan(batch_id * count, count);
+    auto batch_tokens = tokens.subspan(batch_id * count, count);
+    if (!sample) {
+      next_tokens_[batch_id] = batch_tokens[std::distance(batch_scores.begin(), std::max_element(batch_scores.begin(), batch_scores.end()))];
+      return;
+    }
+
+    // The candidates are the best scores of the vocabulary, so their top k are the vocabulary's top k. As in
+    // SampleTopKToken, the top k are weighted by their softmax probabilities.
+    auto& indices = sample_indices_[batch_id];
+    indices.resize(count);
     std::iota(indices.begin(), indices.end(), 0);
-    std::partial_sort(indices.begin(), indices.begin() + k, indices.end(), [scores = scores.data()](int i, int j) { return scores[i] > scores[j]; });
-    std::vector<float> top_k_scores(k);
-    for (int i = 0; i < k; i++)
-      top_k_scores[i] = scores[indices[i]];
-    // Sample a token from the top K
-    std::discrete_distribution<> dis(top_k_scores.begin(), top_k_scores.end());
-    SetNextToken(batch_id, indices[dis(gen_)]);
-  }
+    const size_t top_k = std::min(static_cast<size_t>(search.top_k), count);
+    SortTopIndices(indices, batch_scores, 0, top_k);
+    const float max_score = batch_scores[indices[0]];
+    float top_k_sum = 0.0f;
+    for (size_t i = 0; i < top_k; i++)
+      top_k_sum += std::exp((batch_scores[indices[i]] - max_score) / search.temperature);
+    float threshold = std::uniform_real_distribution<float>(0, top_k_sum)(gens_[batch_id]);
+    size_t i = 0;
+    for (; i < top_k - 1; i++) {
+      threshold -= std::exp((batch_scores[indices[i]] - max_score) / search.temperature);
+      if (threshold <= 0)
+        break;
+    }
+    next_tokens_[batch_id] = batch_tokens[indices[i]];
+  });
+
+  SetNextTokens();
   AppendNextTokensToSequences();
 }
 
-void GreedySearch_Cpu::SampleTopP(float p, float temperature) {
-  std::uniform_real_distribution<float> dis(0, p);
-  for (size_t batch_id = 0; batch_id < params_->search.batch_size; batch_id++) {
+// The fp16 scores are converted a block at a time into a buffer that stays in the L1 cache, instead of the whole
+// vocabulary to fp32 in memory. Each block gets the EOS handling of Logits::HandleEOSArray and then the repetition penalty
+// of ApplyRepetitionPenalty, in the same order, so the tokens are the same as from the fp32 logits.
+void GreedySearch_Cpu::SelectTopFp16(DeviceSpan<Ort::Float16_t> logits, float repetition_penalty) {
+  const auto& search = params_->search;
+  const auto& eos_token_ids = params_->config.model.eos_token_ids;
+  const size_t eos_token_id = static_cast<size_t>(params_->config.model.eos_token_id);
+  const size_t vocab_size = static_cast<size_t>(params_->config.model.vocab_size);
+  const bool sample = search.do_sample && search.top_k > 1;
+  const size_t top_k = std::min(static_cast<size_t>(search.top_k), vocab_size);
+  constexpr size_t block_size = 1024;
+  if (sample)
+    fp16_candidates_.resize(search.batch_size);
+
+  auto logits_cpu = logits.CopyDeviceToCpu();
+  ParallelFor(search.batch_size, [&](size_t batch_id) {
     if (PadIfAlreadyEOS(batch_id)) {
-      continue;
+      return;
     }
-    std::span<float> const scores = next_token_scores_.Span().subspan(batch_id * params_->config.model.vocab_size, params_->config.model.vocab_size);
-    SoftMax(scores, temperature);
-    // Sort an array of indices into the scores
-    std::vector<int32_t> indices(scores.size());
-    std::iota(indices.begin(), indices.end(), 0);
-    std::sort(indices.begin(), indices.end(), [scores = scores.data()](int32_t i, int32_t j) { return scores[i] > scores[j]; });
-    // Sample a probability threshold
-    float threshold = dis(gen_);
-    int32_t token = 0;
-    // Find the first token where the cumulative probability exceeds the threshold
-    for (int i = 0; i < scores.size(); i++) {
-      threshold -= scores[indices[i]];
-      if (threshold > 0) {
+    std::span<const uint16_t> scores{reinterpret_cast<const uint16_t*>(logits_cpu.data()) + batch_id * vocab_size, vocab_size};
+
+    float eos_score = std::numeric_limits<float>::lowest();
+    for (auto id : eos_token_ids)
+      eos_score = std::max(eos_score, FastFloat16ToFloat32(scores[id]));
+
+    // The penalized tokens in order, so each block takes the next few of them
+    auto& penalized = sample_indices_[batch_id];
+    penalized.clear();
+    if (repetition_penalty != 1.0f) {
+      UpdateTokenCounts(batch_id);
+      auto tokens = token_counts_[batch_id].GetTokens();
+      penalized.assign(tokens.begin(), tokens.end());
+      std::sort(penalized.begin(), penalized.end());
+    }
+    auto next_penalized = penalized.begin();
+
+    // Top k sampling keeps the scores above the k-th best so far, trimmed back to the top k when they reach 3 * k
+    auto compare = [](const std::pair<float, int32_t>& a, const std::pair<float, int32_t>& b) { return a.first > b.first; };
+    std::vector<std::pair<float, int32_t>>* candidates{};
+    if (sample) {
+      candidates = &fp16_candidates_[batch_id];
+      candidates->clear();
+    }
+    float threshold = std::numeric_limits<float>::lowest();
+    int32_t best_token = 0;
+
+    std::array<float, block_size> buffer;
+    for (size_t begin = 0; begin < vocab_size; begin += block_size) {
+      const size_t count = std::min(block_size, vocab_size - begin);
+      auto block = std::span<float>{buffer}.first(count);
+      ConvertFloat16ToFloat32(scores.subspan(begin, count), block);
+
+      for (auto id : eos_token_ids) {
+        if (static_cast<size_t>(id) - begin < count)
+          block[id - begin] = std::numeric_limits<float>::lowest();
+      }
+      if (eos_token_id - begin < count)
+        block[eos_token_id - begin] = eos_score;
+      for (; next_penalized != penalized.end() && static_cast<size_t>(*next_penalized) < begin + count; ++next_penalized) {
+        float& score = block[*next_penalized - begin];
+        score = score < 0 ? score * repetition_penalty : score / repetition_penalty;
+      }
+
+      if (!sample) {
+        auto best = std::max_element(block.begin(), block.end());
+        if (*best > threshold || begin == 0) {
+          threshold = *best;
+          best_token = static_cast<int32_t>(begin + std::distance(block.begin(), best));
+        }
         continue;
       }
-      token = indices[i];
-      break;
+
+      for (size_t i = 0; i < count; i++) {
+        if (block[i] > threshold)
+          candidates->emplace_back(block[i], static_cast<int32_t>(begin + i));
+      }
+      if (candidates->size() >= 3 * top_k) {
+        std::nth_element(candidates->begin(), candidates->begin() + (top_k - 1), candidates->end(), compare);
+        candidates->resize(top_k);
+        threshold = (*candidates)[top_k - 1].first;
+      }
+    }
+
+    if (!sample) {
+      next_tokens_[batch_id] = best_token;
+      return;
+    }
+
+    // As in SelectFromCandidates, the top k are weighted by their softmax probabilities
+    const size_t candidate_count = std::min(top_k, candidates->size());
+    std::partial_sort(candidates->begin(), candidates->begin() + candidate_count, candidates->end(), compare);
+    const float max_score = (*candidates)[0].first;
+    float top_k_sum = 0.0f;
+    for (size_t i = 0; i < candidate_count; i++)
+      top_k_sum += std::exp(((*candidates)[i].first - max_score) / search.temperature);
+    float threshold_sum = std::uniform_real_distribution<float>(0, top_k_sum)(gens_[batch_id]);
+    size_t i = 0;
+    for (; i < candidate_count - 1; i++) {
+      threshold_sum -= std::exp(((*candidates)[i].first - max_score) / search.temperature);
+      if (threshold_sum <= 0)
+        break;
+    }
+    next_tokens_[batch_id] = (*candidates)[i].second;
+  });
+
+  SetNextTokens();
+  AppendNextTokensToSequences();
+}
+
+std::span<int32_t> GreedySearch_Cpu::ResetSampleIndices(size_t batch_id) {
+  auto& indices = sample_indices_[batch_id];
+  indices.resize(params_->config.model.vocab_size);
+  std::iota(indices.begin(), indices.end(), 0);
+  return indices;
+}
+
+std::span<float> GreedySearch_Cpu::GetBatchScores(size_t batch_id) {
+  return next_token_scores_.Span().subspan(batch_id * params_->config.model.vocab_size, params_->config.model.vocab_size);
+}
+
+int32_t GreedySearch_Cpu::SelectTopToken(size_t batch_id) {
+  // next_tokens = torch.argmax(scores, dim=-1)
+  std::span<float> const scores = GetBatchScores(batch_id);
+  return static_cast<int32_t>(std::distance(scores.begin(), std::max_element(scores.begin(), scores.end())));
+}
+
+int32_t GreedySearch_Cpu::SampleTopKToken(size_t batch_id, int k, float temperature) {
+  std::span<float> const scores = GetBatchScores(batch_id);
+  SoftMax(scores, temperature);
+  // Find the top K scores
+  auto indices = ResetSampleIndices(batch_id);
+  const size_t top_k = std::min(static_cast<size_t>(k), indices.size());
+  SortTopIndices(indices, scores, 0, top_k);
+  float top_k_sum = 0.0f;
+  for (size_t i = 0; i < top_k; i++)
+    top_k_sum += scores[indices[i]];
+  // Sample a token from the top K, weighted by their scores
+  float threshold = std::uniform_real_distribution<float>(0, top_k_sum)(gens_[batch_id]);
+  for (size_t i = 0; i < top_k; i++) {
+    threshold -= scores[indices[i]];
+    if (threshold > 0) {
+      continue;
+    }
+    return indices[i];
+  }
+  return indices[top_k - 1];
+}
+
+int32_t GreedySearch_Cpu::SampleTopPToken(size_t batch_id, float p, float temperature) {
+  std::span<float> const scores = GetBatchScores(batch_id);
+  SoftMax(scores, temperature);
+  auto indices = ResetSampleIndices(batch_id);
+  // Sample a probability threshold
+  float threshold = std::uniform_real_distribution<float>(0, p)(gens_[batch_id]);
+  // Find the first token where the cumulative probability exceeds the threshold
+  return indices[SortTopIndicesUntil(indices, scores, scores, threshold) - 1];
+}
+
+int32_t GreedySearch_Cpu::SampleTopKTopPToken(size_t batch_id, int k, float p, float temperature) {
+  std::span<float> const scores = GetBatchScores(batch_id);
+  SoftMax(scores, temperature);
+  // Find the top K scores
+  auto indices = ResetSampleIndices(batch_id);
+  const size_t top_k = std::min(static_cast<size_t>(k), indices.size());
+  SortTopIndices(indices, scores, 0, top_k);
+  // Sample a probability threshold
+  float threshold = std::uniform_real_distribution<float>(0, p)(gens_[batch_id]);
+  // Find the first token where the cumulative probability exceeds the threshold
+  for (size_t i = 0; i < top_k; i++) {
+    threshold -= scores[indices[i]];
+    if (threshold > 0) {
+      continue;
     }
-    SetNextToken(batch_id, token);
+    return indices[i];
   }
+  return indices[top_k - 1];
+}
+
+void GreedySearch_Cpu::SampleTopK(int k, float temperature) {
+  ParallelFor(params_->search.batch_size, [&](size_t batch_id) {
+    if (PadIfAlreadyEOS(batch_id)) {
+      return;
+    }
+    next_tokens_[batch_id] = SampleTopKToken(batch_id, k, temperature);
+  });
+  SetNextTokens();
+  AppendNextTokensToSequences();
+}
+
+void GreedySearch_Cpu::SampleTopP(float p, float temperature) {
+  ParallelFor(params_->search.batch_size, [&](size_t batch_id) {
+    if (PadIfAlreadyEOS(batch_id)) {
+      return;
+    }
+    next_tokens_[batch_id] = SampleTopPToken(batch_id, p, temperature);
+  });
+  SetNextTokens();
   AppendNextTokensToSequences();
 }
 
 void GreedySearch_Cpu::SampleTopKTopP(int k, float p, float temperature) {
-  std::uniform_real_distribution<float> dis(0, p);
-  for (size_t batch_id = 0; batch_id < params_->search.batch_size; batch_id++) {
+  ParallelFor(params_->search.batch_size, [&](size_t batch_id) {
     if (PadIfAlreadyEOS(batch_id)) {
-      continue;
+      return;
     }
-    std::span<float> const scores = next_token_scores_.Span().subspan(batch_id * params_->config.model.vocab_size, params_->config.model.vocab_size);
-    SoftMax(scores, temperature);
-    // Find the top K scores
-    std::vector<int> indices(scores.size());
-    std::iota(indices.begin(), indices.end(), 0);
-    std::partial_sort(indices.begin(), indices.begin() + k, indices.end(), [scores = scores.data()](int i, int j) { return scores[i] > scores[j]; });
-    // Sample a probability threshold
-    float threshold = dis(gen_);
-    int32_t token = indices[k - 1];
-    // Find the first token where the cumulative probability exceeds the threshold
-    for (int i = 0; i < k; i++) {
-      threshold -= scores[indices[i]];
-      if (threshold > 0) {
-        continue;
-      }
-      token = indices[i];
-      break;
+    next_tokens_[batch_id] = SampleTopKTopPToken(batch_id, k, p, temperature);
+  });
+  SetNextTokens();
+  AppendNextTokensToSequences();
+}
+
+void GreedySearch_Cpu::SampleTopKTopP(std::span<const int32_t> k, std::span<const float> p, std::span<const float> temperature) {
+  ParallelFor(params_->search.batch_size, [&](size_t batch_id) {
+    if (PadIfAlreadyEOS(batch_id)) {
+      return;
     }
-    SetNextToken(batch_id, token);
-  }
+    // Same choice of method as Generator::GenerateNextToken makes for the whole batch
+    const int top_k = k[batch_id];
+    const float top_p = p[batch_id];
+    int32_t token;
+    if (top_k == 1)
+      token = SelectTopToken(batch_id);
+    else if (top_p > 0.0f && top_p < 1.0f && top_k > 1)
+      token = SampleTopKTopPToken(batch_id, top_k, top_p, temperature[batch_id]);
+    else if (top_k > 1)
+      token = SampleTopKToken(batch_id, top_k, temperature[batch_id]);
+    else
+      token = SampleTopPToken(batch_id, top_p, temperature[batch_id]);
+    next_tokens_[batch_id] = token;
+  });
+  SetNextTokens();
   AppendNextTokensToSequences();
 }
 
+void GreedySearch_Cpu::ApplyMinP(float min_p, float temperature) {
+  if (min_p <= 0.0f)
+    return;
+
+  // A token's probability is at least min_p times the top token's when its logit is within temperature * log(min_p) of the top logit
+  const float log_min_p = std::log(min_p);
+  ParallelFor(params_->search.batch_size, [&](size_t batch_id) {
+    std::span<float> const scores = GetScores(static_cast<int>(batch_id));
+    const float threshold = MaxScore(scores) + temperature * log_min_p;
+    for (float& score : scores) {
+      if (score < threshold)
+        score = std::numeric_limits<float>::lowest();
+    }
+  });
+}
+
+void GreedySearch_Cpu::ApplyTypicalP(float typical_p, float temperature) {
+  if (typical_p <= 0.0f || typical_p >= 1.0f)
+    return;
+
+  const size_t vocab_size = params_->config.model.vocab_size;
+  typical_log_probs_.resize(params_->search.batch_size);
+  typical_shifts_.resize(params_->search.batch_size);
+  ParallelFor(params_->search.batch_size, [&](size_t batch_id) {
+    std::span<float> const scores = GetScores(static_cast<int>(batch_id));
+    auto& log_probs = typical_log_probs_[batch_id];
+    auto& shifts = typical_shifts_[batch_id];
+    log_probs.assign(scores.begin(), scores.end());
+    shifts.resize(vocab_size);
+    LogSoftMax(log_probs, temperature);
+
+    float entropy = 0.0f;
+    for (float log_prob : log_probs) {
+      const float prob = std::exp(log_prob);
+      if (prob > 0.0f)
+        entropy -= prob * log_prob;
+    }
+
+    // Keep the tokens whose information content is closest to the entropy, until they add up to typical_p. The shifts are
+    // negated so the closest tokens have the highest scores, and log_probs is reused for the probabilities.
+    for (size_t i = 0; i < vocab_size; i++) {
+      shifts[i] = -std::abs(-log_probs[i] - entropy);
+      log_probs[i] = std::exp(log_probs[i]);
+    }
+    auto indices = ResetSampleIndices(batch_id);
+    const float cutoff = shifts[indices[SortTopIndicesUntil(indices, shifts, log_probs, typical_p) - 1]];
+    for (size_t i = 0; i < vocab_size; i++) {
+      if (shifts[i] < cutoff)
+        scores[i] = std::numeric_limits<float>::lowest();
+    }
+  });
+}
+
 bool GreedySearch_Cpu::PadIfAlreadyEOS(size_t batch_id) {
   // If this batch entry has already seen the EOS token, append the pad token
   if (!eos_seen_[batch_id]) {
@@ -253,6 +622,43 @@ void GreedySearch_Cpu::SetNextToken(size_t batch_id, int32_t token) {
   }
 }
 
+void GreedySearch_Cpu::FinishSequence(size_t batch_id) {
+  if (eos_seen_[batch_id])
+    return;
+  eos_seen_[batch_id] = true;
+  if (--not_done_count_ == 0)
+    done_ = true;
+}
+
+std::string GreedySearch_Cpu::GetRandomState() const {
+  std::ostringstream stream;
+  for (auto& gen : gens_)
+    stream << gen << ' ';
+  return stream.str();
+}
+
+void GreedySearch_Cpu::SetRandomState(const std::string& state) {
+  if (state.empty())
+    return;
+  std::istringstream stream{state};
+  for (auto& gen : gens_)
+    stream >> gen;
+  if (!stream)
+    throw std::runtime_error("The saved random number generator state doesn't match the search");
+}
+
+void GreedySearch_Cpu::UpdateTokenCounts(size_t batch_beam_index) {
+  if (!track_token_counts_)
+    Search_Cpu::UpdateTokenCounts(batch_beam_index);
+}
+
+void GreedySearch_Cpu::SetNextTokens() {
+  for (size_t batch_id = 0; batch_id < params_->search.batch_size; batch_id++) {
+    if (!eos_seen_[batch_id])
+      SetNextToken(batch_id, next_tokens_[batch_id]);
+  }
+}
+
 void GreedySearch_Cpu::AppendNextTokensToSequences() {
   // Append next token to each sequence.
   auto sequences_span = sequences_.GetSequences().Span();
@@ -261,6 +667,8 @@ void GreedySearch_Cpu::AppendNextTokensToSequences() {
   auto batch_beam_size = params_->BatchBeamSize();
   for (int i = 0; i < batch_beam_size; i++) {
     sequences_span[i * sequences_.max_length_ + current_length] = next_tokens[i];
+    if (track_token_counts_)
+      token_counts_[i].Add(next_tokens[i]);
   }
 
   sequences_.AfterAppendNextTokens(next_tokens_ptr_, batch_beam_size);
@@ -300,25 +708,35 @@ void GreedySearch_Cpu::RewindTo(size_t index) {
     }
   } else
     memset(next_tokens_.data(), 0, next_tokens_.size_bytes());
+  if (track_token_counts_) {
+    for (int i = 0; i < params_->BatchBeamSize(); i++) {
+      for (int32_t token : sequences_.GetSequence(i).Span().subspan(index))
+        token_counts_[i].Remove(token);
+    }
+  }
   sequences_.RewindTo(index);
 }
 
+void GreedySearch_Cpu::EvictTokens(size_t begin, size_t count) {
+  if (track_token_counts_) {
+    for (int i = 0; i < params_->BatchBeamSize(); i++) {
+      for (int32_t token : sequences_.GetSequence(i).Span().subspan(begin, count))
+        token_counts_[i].Remove(token);
+    }
+  }
+  sequences_.Evict(begin, count);
+}
+
 void BeamSearch_Cpu::AppendTokens(DeviceSpan<int32_t>& next_tokens) {
   // Set user-defined next tokens
   auto next_tokens_cpu = next_tokens.Span();
-  auto batch_beam_size = params_->BatchBeamSize();
   auto tokens_count_per_batch = next_tokens_cpu.size() / params_->search.batch_size;
   if (tokens_count_per_batch > sequences_.max_length_) {
     throw std::runtime_error("User-defined tokens exceed max_length.");
   }
 
-  auto next_sequences_span = sequences_.GetNextSequences().Span();
-  // Copy the user-defined tokens to the sequences
-  for (ptrdiff_t i = 0; i < batch_beam_size; i++) {
-    std::span<int32_t> target = next_sequences_span.subspan(i * sequences_.max_length_, tokens_count_per_batch);
-    std::span<const int32_t> source = next_tokens_cpu.subspan((i / params_->search.num_beams) * tokens_count_per_batch, tokens_count_per_batch);
-    copy(source, target);
-  }
+  // Every beam of a batch entry gets its user-defined tokens
+  sequences_.AppendBatchTokens(next_tokens_cpu, params_->search.num_beams);
   sequences_.AfterAppendNextTokens(next_tokens, params_->search.batch_size);  // next_tokens is not expanded
 }
 
@@ -332,23 +750,8 @@ bool BeamSearch_Cpu::IsDone() const {
 }
 
 void BeamSearch_Cpu::AppendNextTokensToSequences() {
-  auto sequences_span = sequences_.GetSequences().Span();
-  auto sequences_next_span = sequences_.GetNextSequences().Span();
-  auto max_length = sequences_.max_length_;
-  auto current_length = sequences_.GetSequenceLength();
-  auto batch_beam_next_tokens = beam_scorer_->GetNextTokens().Span();
-  auto batch_beam_indices = beam_scorer_->GetNextIndices().Span();
-  auto batch_beam_size = params_->BatchBeamSize();
-
-  for (ptrdiff_t i = 0; i < batch_beam_size; i++) {
-    int batch_beam_index = batch_beam_indices[i];
-    std::span<const int32_t> source = sequences_span.subspan(static_cast<size_t>(batch_beam_index) * max_length, current_length);
-    std::span<int32_t> target = sequences_next_span.subspan(i * max_length, current_length);
-    copy(source, target);
-
-    // Append next token to each beam.
-    sequences_next_span[i * max_length + current_length] = batch_beam_next_tokens[i];
-  }
+  // Each beam continues the beam it was picked from, the token tree doesn't copy its history
+  sequences_.AppendBeamTokens(beam_scorer_->GetNextTokens().Span(), beam_scorer_->GetNextIndices().Span());
   auto next_tokens_device = beam_scorer_->GetNextTokens();
   sequences_.AfterAppendNextTokens(next_tokens_device, params_->BatchBeamSize());
 
@@ -383,6 +786,13 @@ std::span<float> Search_Cpu::GetScores(int batch_beam_index) {
   return next_token_scores_.Span().subspan(static_cast<size_t>(batch_beam_index) * params_->config.model.vocab_size, params_->config.model.vocab_size);
 }
 
+void Search_Cpu::UpdateTokenCounts(size_t batch_beam_index) {
+  auto& token_counts = token_counts_[batch_beam_index];
+  token_counts.Clear();
+  for (int32_t token : sequences_.GetSequence(batch_beam_index).CopyDeviceToCpu())
+    token_counts.Add(token);
+}
+
 void Search_Cpu::ApplyMinLength(int min_length) {
   if (sequences_.GetSequenceLength() >= min_length) {
     return;
@@ -399,25 +809,118 @@ void Search_Cpu::ApplyRepetitionPenalty(float penalty) {
   if (penalty == 1.0f)
     return;
 
-  const int batch_beam_size = params_->BatchBeamSize();
-  for (int i = 0; i < batch_beam_size; i++) {
-    std::span<float> const beam_token_scores = GetScores(i);
-    std::span<const int32_t> const sequence = sequences_.GetSequence(i).CopyDeviceToCpu();
-
-    // Find unique word IDs in sequence.
-    std::unordered_set<int32_t> unique_word_ids;
-    for (const auto& word_id : sequence) {
-      unique_word_ids.insert(word_id);
-    }
+  ParallelFor(params_->BatchBeamSize(), [&](size_t i) {
+    std::span<float> const beam_token_scores = GetScores(static_cast<int>(i));
 
-    for (const int32_t word_id : unique_word_ids) {
+    UpdateTokenCounts(i);
+    for (const int32_t word_id : token_counts_[i].GetTokens()) {
       float const score = beam_token_scores[word_id];
 
       // If score < 0, then repetition penalty > 1.0 has to multiplied to reduce the previous token probability,
       // This assumes that scores are either positive (like ctrl) or negative (like GPT-2), but not a mixture.
       beam_token_scores[word_id] = (score < 0 ? score * penalty : score / penalty);
     }
+  });
+}
+
+void Search_Cpu::ApplyFrequencyPenalty(float frequency_penalty, float presence_penalty) {
+  if (frequency_penalty == 0.0f && presence_penalty == 0.0f)
+    return;
+
+  ParallelFor(params_->BatchBeamSize(), [&](size_t i) {
+    std::span<float> const beam_token_scores = GetScores(static_cast<int>(i));
+
+    UpdateTokenCounts(i);
+    auto& token_counts = token_counts_[i];
+    for (const int32_t word_id : token_counts.GetTokens()) {
+      beam_token_scores[word_id] -= frequency_penalty * static_cast<float>(token_counts.GetCount(word_id)) + presence_penalty;
+    }
+  });
+}
+
+void Search_Cpu::ApplyLogitBias(std::span<const std::pair<int32_t, float>> logit_bias) {
+  if (logit_bias.empty())
+    return;
+
+  const int batch_beam_size = params_->BatchBeamSize();
+  for (int i = 0; i < batch_beam_size; i++) {
+    std::span<float> const beam_token_scores = GetScores(i);
+    for (auto& [token, bias] : logit_bias)
+      beam_token_scores[token] += bias;
+  }
+}
+
+void Search_Cpu::ApplyTokenMask(std::span<const uint32_t> mask) {
+  const size_t vocab_size = params_->config.model.vocab_size;
+  const size_t word_count = (vocab_size + 31) / 32;
+  ParallelFor(params_->BatchBeamSize(), [&](size_t i) {
+    std::span<float> const beam_token_scores = GetScores(static_cast<int>(i));
+    auto const row = mask.subspan(i * word_count, word_count);
+    for (size_t word = 0; word < word_count; word++) {
+      if (row[word] == ~0U)  // Most words of a grammar's mask are all allowed or all banned
+        continue;
+      const size_t begin = word * 32, end = std::min(begin + 32, vocab_size);
+      if (row[word] == 0) {
+        std::fill(beam_token_scores.begin() + begin, beam_token_scores.begin() + end, std::numeric_limits<float>::lowest());
+        continue;
+      }
+      for (size_t token = begin; token < end; token++) {
+        if (!(row[word] & (1U << (token - begin))))
+          beam_token_scores[token] = std::numeric_limits<float>::lowest();
+      }
+    }
+  });
+}
+
+void Search_Cpu::ComputeTopLogProbs(int n) {
+  const size_t batch_beam_size = params_->BatchBeamSize();
+  const size_t count = static_cast<size_t>(n);
+  if (top_logprobs_.size() != batch_beam_size * count) {
+    top_logprob_tokens_ = cpu_device_.Allocate<int32_t>(batch_beam_size * count);
+    top_logprobs_ = cpu_device_.Allocate<float>(batch_beam_size * count);
+    top_logprob_indices_.resize(batch_beam_size);
   }
+  auto tokens = top_logprob_tokens_.CpuSpan();
+  auto log_probs = top_logprobs_.CpuSpan();
+
+  ParallelFor(batch_beam_size, [&](size_t i) {
+    std::span<const float> const scores = GetScores(static_cast<int>(i));
+    // The scores are still selected from, so the log-softmax is only evaluated for the top tokens
+    float const max_score = MaxScore(scores);
+    float exp_sum = 0.0f;
+    for (float score : scores)
+      exp_sum += std::exp(score - max_score);
+    float const log_exp_sum = max_score + std::log(exp_sum);
+
+    auto& indices = top_logprob_indices_[i];
+    indices.resize(scores.size());
+    std::iota(indices.begin(), indices.end(), 0);
+    SortTopIndices(indices, scores, 0, count);
+    for (size_t j = 0; j < count; j++) {
+      tokens[i * count + j] = indices[j];
+      log_probs[i * count + j] = scores[indices[j]] - log_exp_sum;
+    }
+  });
+}
+
+void Search_Cpu::ApplyNoRepeatNGram(int ngram_size) {
+  if (ngram_size <= 0)
+    return;
+
+  const size_t n = static_cast<size_t>(ngram_size);
+  ParallelFor(params_->BatchBeamSize(), [&](size_t i) {
+    std::span<float> const beam_token_scores = GetScores(static_cast<int>(i));
+    std::span<const int32_t> const sequence = sequences_.GetSequence(i).CopyDeviceToCpu();
+    if (sequence.size() + 1 < n)
+      return;
+
+    // The next token completes an n-gram with the last n - 1 tokens, so ban every token that followed them before
+    auto const prefix = sequence.last(n - 1);
+    for (size_t start = 0; start + n <= sequence.size(); start++) {
+      if (std::equal(prefix.begin(), prefix.end(), sequence.begin() + start))
+        beam_token_scores[sequence[start + n - 1]] = std::numeric_limits<float>::lowest();
+    }
+  });
 }
 
-}  // namespace Generators
\ No newline at end of file
+}  // namespace Generators
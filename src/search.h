@@ -5,6 +5,17 @@
 
 namespace Generators {
 
+// The logits processors of one step. A processor with its neutral value (a penalty of 1 or 0, an empty span) is disabled.
+struct LogitsProcessors {
+  int min_length{};
+  float repetition_penalty{1.0f};
+  float frequency_penalty{};
+  float presence_penalty{};
+  int no_repeat_ngram_size{};
+  std::span<const std::pair<int32_t, float>> logit_bias;
+  std::span<const uint32_t> token_mask;  // See ApplyTokenMask
+};
+
 struct Search : LeakChecked<Search> {
   Search(const GeneratorParams& params) : params_{params.shared_from_this()}, sequences_{*params_} {}
   virtual ~Search() = default;
@@ -19,23 +30,77 @@ struct Search : LeakChecked<Search> {
   virtual DeviceSpan<float> GetLogits() const = 0;
   virtual void SetLogits(DeviceSpan<float> logits) = 0;
   virtual bool IsDone() const = 0;
+  virtual bool IsDoneReady() const { return true; }  // False while the device is still computing what IsDone returns, so IsDone would block
 
   virtual void SelectTop() = 0;
+  // Selects the top tokens straight from the model's fp16 logits, which haven't had the EOS handling of Logits::Get or
+  // any penalties applied yet. The EOS handling and the repetition penalty are fused into the selection. Greedy search
+  // takes the top token, top k sampling (CPU only) samples the top_k of them.
+  virtual void SelectTopFp16(DeviceSpan<Ort::Float16_t> /*logits*/, float /*repetition_penalty*/) { assert(false); }
+  // Selects the tokens from the best scores of a model with a logits_top_k head, 'scores' and 'tokens' have shape
+  // (batch_size, logits_top_k). Greedy search takes the top candidate, sampling samples the top_k of them.
+  virtual void SelectFromCandidates(std::span<const float> /*scores*/, std::span<const int32_t> /*tokens*/) { assert(false); }
   virtual void SampleTopP(float /*p*/, float /*temperature*/) { assert(false); }
   virtual void SampleTopK(int /*k*/, float /*temperature*/) { assert(false); }
   virtual void SampleTopKTopP(int /*k*/, float /*p*/, float /*temperature*/) { assert(false); }
+  // Samples every batch entry with its own top_k, top_p and temperature (see GeneratorParams::SetBatchSampling)
+  virtual void SampleTopKTopP(std::span<const int32_t> /*k*/, std::span<const float> /*p*/, std::span<const float> /*temperature*/) { assert(false); }
 
   // Scoring features
   virtual void ApplyMinLength(int min_length) = 0;
   virtual void ApplyRepetitionPenalty(float penalty) = 0;
+  virtual void ApplyFrequencyPenalty(float frequency_penalty, float presence_penalty) = 0;
+  virtual void ApplyNoRepeatNGram(int ngram_size) = 0;
+  virtual void ApplyLogitBias(std::span<const std::pair<int32_t, float>> logit_bias) = 0;
+  // Sets the scores of the tokens whose bit is clear to the lowest float. 'mask' has shape
+  // (batch_beam_size, (vocab_size + 31) / 32), bit t % 32 of word t / 32 of a row is token t.
+  virtual void ApplyTokenMask(std::span<const uint32_t> mask) = 0;
+  // Applies all of the enabled processors. By default they are applied one after the other in the order of the
+  // LogitsProcessors members, a search can instead fuse them into one pass over the scores.
+  virtual void ApplyLogitsProcessors(const LogitsProcessors& processors);
+
+  // Sampling filters, these set the logits of the tokens they remove to the lowest float before sampling
+  virtual void ApplyMinP(float /*min_p*/, float /*temperature*/) { assert(false); }
+  virtual void ApplyTypicalP(float /*typical_p*/, float /*temperature*/) { assert(false); }
+
+  // Fills top_logprob_tokens_ and top_logprobs_ with the 'n' highest scores of every batch beam entry, as log-softmax
+  // values in descending order. Called on the processed scores, before the sampling filters and the temperature.
+  virtual void ComputeTopLogProbs(int n) = 0;
 
   // Set user input tokens
   virtual void AppendTokens(DeviceSpan<int32_t>& next_tokens) { assert(false); };
   // To be used for rewind
   virtual void RewindTo(size_t index) { assert(false); };
+  // Attention sinks (see search.attention_sinks): drops the 'count' tokens from 'begin' on, the later tokens move down
+  virtual void EvictTokens(size_t begin, size_t count) { sequences_.Evict(begin, count); }
+  // Greedy search: the batch entry is done as if its last token was EOS, it only gets pad tokens from now on
+  virtual void FinishSequence(size_t /*batch_id*/) { assert(false); }
+
+  // The sampling random number generator state (see Generator::SaveState), empty if the search can't save it
+  virtual std::string GetRandomState() const { return {}; }
+  virtual void SetRandomState(const std::string& /*state*/) {}
 
   std::shared_ptr<const GeneratorParams> params_;
   Sequences sequences_;
+
+  DeviceSpan<int32_t> top_logprob_tokens_;  // shape (batch_beam_size, search.top_logprobs), empty until ComputeTopLogProbs
+  DeviceSpan<float> top_logprobs_;          // shape (batch_beam_size, search.top_logprobs)
+};
+
+// How often each token occurs in a sequence, updated as tokens are appended and rewound so the penalties don't have to
+// scan the whole sequence on every step
+struct TokenCounts {
+  void Add(int32_t token);
+  void Remove(int32_t token);
+  void Clear();
+
+  int32_t GetCount(int32_t token) const { return static_cast<size_t>(token) < counts_.size() ? counts_[token] : 0; }
+  std::span<const int32_t> GetTokens() const { return tokens_; }  // The tokens with a count > 0, in no particular order
+
+ private:
+  std::vector<int32_t> counts_;     // Indexed by token, grown as needed
+  std::vector<int32_t> positions_;  // Indexed by token, the token's index in tokens_
+  std::vector<int32_t> tokens_;
 };
 
 struct Search_Cpu : Search {
@@ -49,9 +114,18 @@ struct Search_Cpu : Search {
 
   void ApplyMinLength(int min_length) override;
   void ApplyRepetitionPenalty(float penalty) override;
+  void ApplyFrequencyPenalty(float frequency_penalty, float presence_penalty) override;
+  void ApplyNoRepeatNGram(int ngram_size) override;
+  void ApplyLogitBias(std::span<const std::pair<int32_t, float>> logit_bias) override;
+  void ApplyTokenMask(std::span<const uint32_t> mask) override;
+
+  void ComputeTopLogProbs(int n) override;
 
   std::span<float> GetScores(int batch_beam_index);
 
+  // Brings token_counts_[batch_beam_index] up to date with the sequence, by default by recounting it
+  virtual void UpdateTokenCounts(size_t batch_beam_index);
+
   DeviceInterface& cpu_device_;
 
   DeviceSpan<int32_t> sequence_lengths_;  // shape (beam_size*batch_size)
@@ -60,6 +134,10 @@ struct Search_Cpu : Search {
 
   DeviceSpan<float> next_token_scores_;  // shape (beam_size*batch_size, vocab_size)
 
+  std::vector<TokenCounts> token_counts_;  // shape (beam_size*batch_size), used by the penalties
+
+  std::vector<std::vector<int32_t>> top_logprob_indices_;  // ComputeTopLogProbs scratch, shape (beam_size*batch_size, vocab_size)
+
   bool done_{};
 };
 
@@ -70,13 +148,23 @@ struct GreedySearch_Cpu : Search_Cpu {
   DeviceSpan<int32_t> GetNextIndices() override { return {}; }
 
   void SelectTop() override;
+  void SelectFromCandidates(std::span<const float> scores, std::span<const int32_t> tokens) override;
+  void SelectTopFp16(DeviceSpan<Ort::Float16_t> logits, float repetition_penalty) override;
   void SampleTopK(int k, float temperature) override;
   void SampleTopP(float p, float temperature) override;
   void SampleTopKTopP(int /*k*/, float /*p*/, float /*temperature*/) override;
+  void SampleTopKTopP(std::span<const int32_t> k, std::span<const float> p, std::span<const float> temperature) override;
+  void ApplyMinP(float min_p, float temperature) override;
+  void ApplyTypicalP(float typical_p, float temperature) override;
 
   // Used by continuous decoding search.
   void AppendTokens(DeviceSpan<int32_t>& next_tokens) override;
   void RewindTo(size_t index) override;
+  void EvictTokens(size_t begin, size_t count) override;
+  void FinishSequence(size_t batch_id) override;
+
+  std::string GetRandomState() const override;
+  void SetRandomState(const std::string& state) override;
 
  protected:
   void SetNextToken(size_t batch_id, int32_t token);
@@ -84,14 +172,31 @@ struct GreedySearch_Cpu : Search_Cpu {
 
   bool PadIfAlreadyEOS(size_t batch_id);
 
+  // Select a single batch entry's token, the shared part of the batch wide SelectTop / Sample* methods
+  std::span<float> GetBatchScores(size_t batch_id);
+  int32_t SelectTopToken(size_t batch_id);
+  int32_t SampleTopKToken(size_t batch_id, int k, float temperature);
+  int32_t SampleTopPToken(size_t batch_id, float p, float temperature);
+  int32_t SampleTopKTopPToken(size_t batch_id, int k, float p, float temperature);
+
+  // Sampling scratch, the indices of a batch entry's scores to be ordered by SortTopIndices
+  std::span<int32_t> ResetSampleIndices(size_t batch_id);
+  // Calls SetNextToken for the tokens the parallel per batch entry work wrote to next_tokens_
+  void SetNextTokens();
+
+  void UpdateTokenCounts(size_t batch_beam_index) override;  // Kept up to date incrementally if track_token_counts_
+
   DeviceSpan<int32_t> next_tokens_ptr_;
-  std::unique_ptr<int32_t[]> temp_topk_buffer_;
+  std::vector<std::vector<int32_t>> sample_indices_;  // shape (batch_size, vocab_size), allocated on the first sampled token
+  std::vector<std::vector<std::pair<float, int32_t>>> fp16_candidates_;  // shape (batch_size, <3 * top_k), SelectTopFp16's sampling scratch
+  std::vector<std::vector<float>> typical_log_probs_, typical_shifts_;  // shape (batch_size, vocab_size), allocated by ApplyTypicalP
 
   std::span<bool> eos_seen_;  // shape (batch_size)
   std::unique_ptr<bool[]> eos_seen_buffer_;
   int not_done_count_{params_->search.batch_size};  // When zero, every batch entry is done (starts at batch_size_)
 
-  std::mt19937 gen_;
+  bool track_token_counts_{};       // Set if a penalty needs token_counts_
+  std::vector<std::mt19937> gens_;  // shape (batch_size), one stream per batch entry so results don't depend on the threading
 };
 
 struct BeamSearch_Cpu : Search_Cpu {
@@ -119,6 +224,16 @@ struct BeamSearch_Cpu : Search_Cpu {
   std::unique_ptr<int32_t[]> next_tokens_buffer_;  // prevents freeing of next_tokens buffer for setting user tokens
 
   std::unique_ptr<BeamSearchScorer> beam_scorer_;
+
+  // SelectTop scratch, the 2 * group size best candidates of every beam group (a batch entry without num_beam_groups)
+  struct ScoreIndex {
+    float score;
+    int32_t index;  // beam_index * vocab_size + token
+  };
+  std::vector<std::vector<ScoreIndex>> top_candidates_;  // shape (batch_size, 2 * num_beams), min-heaps while scanning
+  std::vector<float> top_scores_;                        // shape (batch_size * 2 * num_beams)
+  std::vector<int32_t> top_indices_, top_tokens_;        // shape (batch_size * 2 * num_beams)
+  std::vector<std::vector<int32_t>> group_tokens_;       // shape (batch_size, num_beams), the tokens the earlier beam groups picked this step
 };
 
 }  // namespace Generators
\ No newline at end of file
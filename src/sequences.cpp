@@ -21,8 +21,72 @@ void Sequences::AfterAppendNextTokens(DeviceSpan<int32_t>& next_tokens, size_t b
 }
 
 void Sequences::RewindTo(size_t index) {
+  assert(index <= static_cast<size_t>(current_length_));
+  for (auto& leaf : leaves_) {
+    for (size_t length = current_length_; length > index; length--)
+      leaf = nodes_[leaf].parent;
+  }
   current_length_ = static_cast<int>(index);
-  assert(current_length_ >= 0);
+}
+
+DeviceSpan<int32_t> Sequences::GetSequences() {
+  for (size_t i = 0; i < leaves_.size(); i++)
+    Materialize(i);
+  return sequences_;
+}
+
+void Sequences::UseTokenTree() {
+  assert(current_length_ == 0);
+  const size_t batch_beam_size = sequences_.size() / max_length_;
+  sequences_next_ = {};
+  nodes_.reserve(batch_beam_size * max_length_);
+  leaves_.assign(batch_beam_size, -1);
+  row_nodes_.assign(batch_beam_size * max_length_, -1);
+}
+
+void Sequences::AppendBeamTokens(std::span<const int32_t> tokens, std::span<const int32_t> beam_indices) {
+  assert(tokens.size() == leaves_.size() && beam_indices.size() == leaves_.size());
+  std::vector<int32_t> leaves(leaves_.size());
+  for (size_t i = 0; i < leaves.size(); i++) {
+    leaves[i] = static_cast<int32_t>(nodes_.size());
+    nodes_.push_back({tokens[i], leaves_[beam_indices[i]]});
+  }
+  leaves_.swap(leaves);
+}
+
+void Sequences::AppendBatchTokens(std::span<const int32_t> tokens, size_t num_beams) {
+  const size_t batch_size = leaves_.size() / num_beams;
+  const size_t count = tokens.size() / batch_size;
+  for (size_t i = 0; i < leaves_.size(); i++) {
+    for (int32_t token : tokens.subspan((i / num_beams) * count, count)) {
+      nodes_.push_back({token, leaves_[i]});
+      leaves_[i] = static_cast<int32_t>(nodes_.size() - 1);
+    }
+  }
+}
+
+void Sequences::Materialize(size_t batch_beam_index) {
+  auto sequence = sequences_.Span().subspan(batch_beam_index * max_length_, current_length_);
+  auto* row_nodes = row_nodes_.data() + batch_beam_index * max_length_;
+  // A position holding the same node also holds the same ancestors before it
+  int32_t node = leaves_[batch_beam_index];
+  for (int position = current_length_ - 1; position >= 0 && row_nodes[position] != node; position--) {
+    sequence[position] = nodes_[node].token;
+    row_nodes[position] = node;
+    node = nodes_[node].parent;
+  }
+}
+
+void Sequences::Evict(size_t begin, size_t count) {
+  assert(sequences_next_.empty() && begin + count <= static_cast<size_t>(current_length_));
+  auto sequences = sequences_.CopyDeviceToCpu();
+  const size_t rows = sequences.size() / max_length_;
+  for (size_t row = 0; row < rows; row++) {
+    auto* sequence = sequences.data() + row * max_length_;
+    std::copy(sequence + begin + count, sequence + current_length_, sequence + begin);
+  }
+  sequences_.CopyCpuToDevice();
+  current_length_ -= static_cast<int>(count);
 }
 
 }  // namespace Generators
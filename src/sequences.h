@@ -14,12 +14,22 @@ struct Sequences {
 
   // Returns a sequence of word IDs for a given beam index ( beam_index < batch_beam_size).
   DeviceSpan<int32_t> GetSequence(size_t batch_beam_index) {
+    if (!leaves_.empty())
+      Materialize(batch_beam_index);
     return sequences_.subspan(batch_beam_index * max_length_, current_length_);
   }
 
-  DeviceSpan<int32_t> GetSequences() { return sequences_; }
+  DeviceSpan<int32_t> GetSequences();
   DeviceSpan<int32_t> GetNextSequences() { return sequences_next_; }
 
+  // Keeps the beams as a tree of tokens with parent pointers instead of reordering every row into sequences_next_ each
+  // step (CPU beam search). Appending is then O(1) per beam, and a row is only written when GetSequence reads it.
+  void UseTokenTree();
+  // Appends tokens[i] to the sequence of beam beam_indices[i] as the new sequence i (token tree only)
+  void AppendBeamTokens(std::span<const int32_t> tokens, std::span<const int32_t> beam_indices);
+  // Appends row b of 'tokens' (shape (batch_size, count)) to every beam of batch entry b (token tree only)
+  void AppendBatchTokens(std::span<const int32_t> tokens, size_t num_beams);
+
   // Returns current sequence length.
   int GetSequenceLength() const { return current_length_; }
 
@@ -30,6 +40,8 @@ struct Sequences {
 
   // Rewind sequences to ith token
   void RewindTo(size_t index);
+  // Drops the 'count' tokens from 'begin' on from every sequence, the later tokens move down (greedy search only)
+  void Evict(size_t begin, size_t count);
 
  private:
   // Two buffers of shape (batch_size, num_beams, max_seq_length) to store sequences.
@@ -38,6 +50,17 @@ struct Sequences {
   DeviceSpan<int32_t> sequences_;
   DeviceSpan<int32_t> sequences_next_;  // This only exists for beam search, to allow for the easy reordering of sequences
 
+  // Writes the tokens of a beam into its row of sequences_, up to the first position that already holds them
+  void Materialize(size_t batch_beam_index);
+
+  struct TokenNode {
+    int32_t token;
+    int32_t parent;  // -1 for the first token of a sequence
+  };
+  std::vector<TokenNode> nodes_;      // The token tree, nodes are never removed
+  std::vector<int32_t> leaves_;       // shape (batch_beam_size), the node of the last token of every beam
+  std::vector<int32_t> row_nodes_;    // shape (batch_beam_size, max_length), the node each position of sequences_ holds
+
   int current_length_;
 };
 
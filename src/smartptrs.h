@@ -2,8 +2,11 @@
 // Licensed under the MIT License.
 #pragma once
 #include <assert.h>
+#include <algorithm>
 #include <memory>
 #include "span.h"
+#include "memory_usage.h"
+#include "metrics.h"
 
 namespace Ort {
 struct Allocator;
@@ -14,22 +17,55 @@ struct Search;
 struct Sequences;
 struct GeneratorParams;
 
+// Completion of work queued on a device, see DeviceBuffer::CopyDeviceToCpuAsync
+struct DeviceEvent {
+  virtual ~DeviceEvent() = default;
+  virtual void Wait() = 0;  // Blocks until the work is done
+};
+
 // A DeviceBuffer is an abstract interface to a block of device memory (can be cuda/dml/cpu memory)
 // Note: For a CPU DeviceBuffer, there's only one block of memory on CPU, the copy methods are no-ops
 // Do not use DeviceBuffer directly, use a DeviceSpan (the Allocate/WrapMemory methods return DeviceSpans)
 struct DeviceBuffer : std::enable_shared_from_this<DeviceBuffer> {
-  virtual ~DeviceBuffer() {}
+  virtual ~DeviceBuffer() {
+    if (memory_usage_)
+      memory_usage_->Add(MemoryUsage::Buffers, -static_cast<int64_t>(size_in_bytes_));
+  }
   virtual const char* GetType() const = 0;  // Returns "cuda" "cuda_cpu" "directml" etc
 
   virtual void AllocateCpu() = 0;      // Allocates p_cpu_ if necessary (using appropriate memory type for interop)
   virtual void CopyDeviceToCpu() = 0;  // Allocates p_cpu_ if necessary and copies p_device_ memory into it
+  // Like CopyDeviceToCpu, but only queues the copy. p_cpu_ holds it once the returned event is waited on, devices that
+  // copy right away return null.
+  virtual std::shared_ptr<DeviceEvent> CopyDeviceToCpuAsync() {
+    CopyDeviceToCpu();
+    return nullptr;
+  }
   virtual void CopyCpuToDevice() = 0;
   virtual void CopyFrom(size_t begin_dest, DeviceBuffer& source, size_t begin_source, size_t size_in_bytes) = 0;
   virtual void Zero() = 0;  // Zero out the device memory
 
+  // Copy part of the device memory to or from CPU memory outside of the buffer. These go through p_cpu_ unless a device
+  // can transfer just the range, the write downloads the rest of the buffer first when only part of it is written.
+  virtual void ReadToCpu(size_t begin, std::span<uint8_t> destination) {
+    CopyDeviceToCpu();
+    std::copy_n(p_cpu_ + begin, destination.size(), destination.begin());
+  }
+  virtual void WriteFromCpu(size_t begin, std::span<const uint8_t> source) {
+    if (begin == 0 && source.size() == size_in_bytes_)
+      AllocateCpu();
+    else
+      CopyDeviceToCpu();
+    std::copy(source.begin(), source.end(), p_cpu_ + begin);
+    CopyCpuToDevice();
+  }
+
+  bool IsCpuAccessible() const { return p_cpu_ && p_cpu_ == p_device_; }  // CPU memory, or device memory the CPU addresses directly
+
   uint8_t* p_device_{};
   uint8_t* p_cpu_{};
   size_t size_in_bytes_{};
+  std::shared_ptr<MemoryUsage> memory_usage_;  // Set by DeviceInterface::Allocate inside a Memory::Scope, charged with size_in_bytes_
 };
 
 // A DeviceSpan is how a DeviceBuffer is used. It can be thought of as a std::span for device memory with
@@ -58,18 +94,26 @@ struct DeviceSpan {
 
   // Copy device memory to CPU memory and return the CPU accessible memory
   std::span<T> CopyDeviceToCpu() {
+    Metrics::Timer timer{GeneratorMetrics::Copy, "copy_device_to_cpu"};  // Waits for the device
     p_device_memory_->CopyDeviceToCpu();
     return std::span<T>{reinterpret_cast<T*>(p_device_memory_->p_cpu_) + begin_, length_};
   }
 
+  // Queue the copy of device memory to CPU memory, CpuSpan holds it once the returned event (if any) is waited on
+  std::shared_ptr<DeviceEvent> CopyDeviceToCpuAsync() { return p_device_memory_->CopyDeviceToCpuAsync(); }
+
   // Copy CPU memory to device memory, typically used after calling CpuSpan or CopyDeviceToCpu to update the device memory with the modifications made
-  void CopyCpuToDevice() { p_device_memory_->CopyCpuToDevice(); }
+  void CopyCpuToDevice() {
+    Metrics::Timer timer{GeneratorMetrics::Copy, "copy_cpu_to_device"};
+    p_device_memory_->CopyCpuToDevice();
+  }
 
   // Zero out the device memory
   void Zero() { p_device_memory_->Zero(); }
 
   void CopyFrom(const DeviceSpan<const T>& source) {
     assert(source.size() == size());  // Spans must be the same size to copy
+    Metrics::Timer timer{GeneratorMetrics::Copy, "copy_device_to_device"};
     p_device_memory_->CopyFrom(begin_ * sizeof(T), *source.p_device_memory_, source.begin_ * sizeof(T), length_ * sizeof(T));
   }
 
@@ -98,9 +142,31 @@ struct DeviceInterface {
   virtual DeviceType GetType() const = 0;
   virtual void InitOrt(const OrtApi& api, Ort::Allocator& allocator) = 0;
   virtual Ort::Allocator& GetAllocator() = 0;
+  // Makes GetAllocator and AllocateBase use a stream ordered memory pool that keeps up to 'release_threshold' bytes of
+  // freed memory (see Config::Model::device_memory_pool). Devices without one ignore it.
+  virtual void EnableMemoryPool(uint64_t release_threshold) {}
+  // Devices that pool their buffers (WebGPU) keep the freed ones for the next AllocateBase. These return the bytes kept
+  // and free them, e.g. on memory pressure.
+  virtual size_t GetCachedBytes() const { return 0; }
+  virtual void ReleaseCachedMemory() {}
+
+  // Streams of generators with search.stream_priority, null being the model's stream (see StreamScope). GetPriorityStream
+  // returns the stream shared by the generators of 'priority', SetCurrentStream directs the device work of this thread
+  // to 'stream' and returns the previous one, WaitForStream makes the work queued on 'waiting' from now on wait for the
+  // work queued on 'stream' so far.
+  virtual void* GetPriorityStream(int priority) { throw std::runtime_error("stream_priority is only supported on CUDA"); }
+  virtual void* SetCurrentStream(void* stream) { return nullptr; }
+  virtual void WaitForStream(void* waiting, void* stream) {}
 
   template <typename T>
-  DeviceSpan<T> Allocate(size_t count) { return DeviceSpan<T>(AllocateBase(sizeof(T) * count)); }
+  DeviceSpan<T> Allocate(size_t count) {
+    auto memory = AllocateBase(sizeof(T) * count);
+    if (Memory::t_usage) {
+      memory->memory_usage_ = Memory::t_usage->shared_from_this();
+      memory->memory_usage_->Add(MemoryUsage::Buffers, static_cast<int64_t>(memory->size_in_bytes_));
+    }
+    return DeviceSpan<T>(std::move(memory));
+  }
   virtual std::shared_ptr<DeviceBuffer> AllocateBase(size_t size) = 0;
 
   // Wraps an existing memory block, useful for tensors. Use WrapTensor for OrtValue vs calling this directly
@@ -112,11 +178,16 @@ struct DeviceInterface {
   virtual std::unique_ptr<Search> CreateBeam(const GeneratorParams& params) = 0;
 
   virtual void Synchronize() = 0;  // Synchronize the device, typically used for timing or debugging
+  // Submits the device work recorded since the last submission without waiting for it (DML records its copies into a
+  // command list), called before a session run that reads it
+  virtual void SubmitRecordedWork() {}
 
   virtual bool Cast(OrtValue& /*input*/, OrtValue& /*output*/) { return false; }
 
   virtual void UpdatePositionIds(void* /*position_ids*/, int /*batch_beam_size*/, int /*total_length*/, int /*new_kv_length*/, ONNXTensorElementDataType /*type*/) { assert(false); }
   virtual void UpdateAttentionMask(void* /*mask_data*/, const void* /*old_data*/, int /*batch_beam_size*/, int /*new_kv_length*/, int /*total_length*/, int /*max_length*/, bool /*update_only*/, ONNXTensorElementDataType /*type*/) { assert(false); }
+  // UpdatePositionIds, UpdateAttentionMask and the seqlens_k update in one launch, any of position_ids, mask_data and seqlens_k may be null
+  virtual void UpdatePositionInputs(void* /*position_ids*/, void* /*mask_data*/, const void* /*old_mask_data*/, int32_t* /*seqlens_k*/, int /*batch_beam_size*/, int /*new_kv_length*/, int /*total_length*/, int /*max_length*/, bool /*update_only*/, ONNXTensorElementDataType /*type*/) { assert(false); }
 
   virtual void LaunchHandleEOSArray(float* /*batch_logits*/, int /*batch_beam_size*/, int /*vocab_size*/, const int32_t* /*eos_token_ids*/, int /*eos_token_ids_count*/) { assert(false); }
   virtual void UpdateCacheIndirectionKernelLauncher(int32_t* /*tgt_indir_cache*/, const int32_t* /*src_indir_cache*/, const int32_t* /*beam_ids*/, int /*batch_size*/, int /*beam_width*/, int /*input_seq_length*/, int /*max_seq_length*/, int /*current_length*/) { assert(false); }
@@ -130,6 +201,28 @@ struct DeviceInterface {
   }  // Temporary until we fully factor out providers
 };
 
+// Directs the device work of this thread to 'stream' for its lifetime. The stream waits for the work queued on the
+// previous one, which waits for this one at the end, so the work on both stays in order.
+struct StreamScope {
+  StreamScope(DeviceInterface& device, void* stream) : device_{device}, stream_{stream}, previous_{device.SetCurrentStream(stream)} {
+    if (previous_ != stream_)
+      device_.WaitForStream(stream_, previous_);
+  }
+  ~StreamScope() {
+    if (previous_ != stream_)
+      device_.WaitForStream(previous_, stream_);
+    device_.SetCurrentStream(previous_);
+  }
+
+  StreamScope(const StreamScope&) = delete;
+  StreamScope& operator=(const StreamScope&) = delete;
+
+ private:
+  DeviceInterface& device_;
+  void* stream_;
+  void* previous_;
+};
+
 namespace Location {
 struct CPU {};
 struct GPU {};
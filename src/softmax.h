@@ -2,30 +2,43 @@
 
 namespace Generators {
 
-void SoftMax(std::span<float> scores, float temperature) {
-  float const max_score = *std::max_element(scores.begin(), scores.end());
+// These run over the full vocabulary for every beam on every step, so each is a few tight passes with no allocation
+inline float MaxScore(std::span<const float> scores) {
+  float max_score = std::numeric_limits<float>::lowest();
+  for (float score : scores)
+    max_score = std::max(max_score, score);
+  return max_score;
+}
 
-  // Subtract max score and scale by temperature
-  std::transform(scores.begin(), scores.end(), scores.begin(), [max_score, temperature](float score) { return std::exp((score - max_score) / temperature); });
+inline void SoftMax(std::span<float> scores, float temperature) {
+  float const max_score = MaxScore(scores);
 
-  // Compute sum of exponentials
-  float const exp_sum = std::accumulate(scores.begin(), scores.end(), 0.0f);
+  // Subtract max score, scale by temperature and sum the exponentials in the same pass
+  float exp_sum = 0.0f;
+  for (float& score : scores) {
+    score = std::exp((score - max_score) / temperature);
+    exp_sum += score;
+  }
 
   // Divide each score by the sum of exponentials
-  std::transform(scores.begin(), scores.end(), scores.begin(), [exp_sum](float score) { return score / exp_sum; });
+  for (float& score : scores)
+    score /= exp_sum;
 }
 
-void LogSoftMax(std::span<float> scores, float temperature) {
-  float const max_score = *std::max_element(scores.begin(), scores.end());
-
-  // Subtract max score and scale by temperature
-  std::transform(scores.begin(), scores.end(), scores.begin(), [max_score, temperature](float score) { return (score - max_score) / temperature; });
+inline void LogSoftMax(std::span<float> scores, float temperature) {
+  float const max_score = MaxScore(scores);
 
-  // Compute sum of exponentials
-  float const exp_sum = std::accumulate(scores.begin(), scores.end(), 0.0f, [](float a, float b) { return a + std::exp(b); });
+  // Subtract max score, scale by temperature and sum the exponentials in the same pass
+  float exp_sum = 0.0f;
+  for (float& score : scores) {
+    score = (score - max_score) / temperature;
+    exp_sum += std::exp(score);
+  }
 
   // Subtract log of sum of exponentials from each score
-  std::transform(scores.begin(), scores.end(), scores.begin(), [exp_sum](float score) { return score - std::log(exp_sum); });
+  float const log_exp_sum = std::log(exp_sum);
+  for (float& score : scores)
+    score -= log_exp_sum;
 }
 
 }  // namespace Generators
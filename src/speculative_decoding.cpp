@@ -0,0 +1,278 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "models/model.h"
+#include "search.h"
+
+namespace Generators {
+
+namespace {
+
+// Copies 'count' elements starting at 'offset' of the last run's 'name' output to the CPU as fp32
+std::vector<float> CopyOutputToCpu(State& state, const Model& model, const std::string& name,
+                                   size_t offset = 0, size_t count = std::numeric_limits<size_t>::max()) {
+  OrtValue* output = state.GetOutput(name.c_str());
+  if (!output)
+    throw std::runtime_error("Model output '" + name + "' was not found");
+
+  std::unique_ptr<OrtValue> output_fp32;
+  if (output->GetTensorTypeAndShapeInfo()->GetElementType() != Ort::TypeToTensorType<float>) {
+    Cast(*output, output_fp32, *model.p_device_inputs_, Ort::TypeToTensorType<float>);
+    output = output_fp32.get();
+  }
+
+  auto output_span = WrapTensor<float>(*model.p_device_inputs_, *output);
+  auto output_cpu = output_span.subspan(offset, std::min(count, output_span.size() - offset)).CopyDeviceToCpu();
+  return {output_cpu.begin(), output_cpu.end()};
+}
+
+}  // namespace
+
+void GeneratorParams::SetDraftModel(const Model& model, int draft_token_count) {
+  if (draft_token_count < 1)
+    throw std::runtime_error("num_draft_tokens must be 1 or greater, is " + std::to_string(draft_token_count));
+  if (model.config_->model.vocab_size != config.model.vocab_size)
+    throw std::runtime_error("The draft model's vocab_size (" + std::to_string(model.config_->model.vocab_size) +
+                             ") must match the model's vocab_size (" + std::to_string(config.model.vocab_size) + ")");
+
+  draft_model = model.shared_from_this();
+  num_draft_tokens = draft_token_count;
+}
+
+bool Generator::IsSpeculating() const {
+  return !verified_logits_.empty();
+}
+
+void Generator::GenerateNextTokenSpeculative() {
+  if (!IsSpeculating())
+    StartSpeculativeRound();
+  SelectVerifiedToken();
+}
+
+void Generator::StartSpeculativeRound() {
+  round_start_length_ = search_->GetSequenceLength();
+
+  // The draft tokens are written to the KV cache along with the pending token, so they must fit in max_length
+  const auto& params = *state_->params_;
+  const size_t remaining_length = static_cast<size_t>(params.search.max_length) - round_start_length_;
+  draft_tokens_.clear();
+  if (draft_)
+    ProposeDraftModelTokens(std::min(static_cast<size_t>(params.num_draft_tokens), remaining_length));
+  else if (params.search.prompt_lookup_num_tokens > 0)
+    ProposePromptLookupTokens(std::min(static_cast<size_t>(params.search.prompt_lookup_num_tokens), remaining_length));
+  else if (early_exit_)
+    ProposeEarlyExitTokens(std::min(static_cast<size_t>(model_->config_->model.decoder.early_exit->num_draft_tokens), remaining_length));
+  else
+    ProposeMedusaTokens(remaining_length);
+
+  std::vector<int32_t> tokens{search_->GetNextTokens().CopyDeviceToCpu()[0]};
+  tokens.insert(tokens.end(), draft_tokens_.begin(), draft_tokens_.end());
+  auto tokens_device = AllocateInputIdsOnDevice(cpu_span<const int32_t>{tokens});
+
+  RestoreKeyValueCache();
+  state_->Run(static_cast<int>(round_start_length_ + draft_tokens_.size()), tokens_device, search_->GetNextIndices());
+  state_->UpdateMemoryUsage(*memory_usage_);
+
+  // The state only hands out the last token's logits, the verification needs the raw output for every token
+  const size_t vocab_size = model_->config_->model.vocab_size;
+  verified_logits_ = CopyOutputToCpu(*state_, *model_, model_->config_->model.decoder.outputs.logits);
+  if (verified_logits_.size() != tokens.size() * vocab_size)
+    throw std::runtime_error("Speculative decoding expects logits for all " + std::to_string(tokens.size()) + " input tokens");
+  verified_index_ = 0;
+
+  // Same as Logits::Get, the primary EOS token gets the highest score of all EOS tokens
+  auto& eos_token_ids = model_->config_->model.eos_token_ids;
+  if (!eos_token_ids.empty()) {
+    for (size_t i = 0; i < tokens.size(); i++) {
+      auto row = std::span<float>{verified_logits_}.subspan(i * vocab_size, vocab_size);
+      float max = std::numeric_limits<float>::lowest();
+      for (auto id : eos_token_ids) {
+        max = std::max(max, row[id]);
+        row[id] = std::numeric_limits<float>::lowest();
+      }
+      row[model_->config_->model.eos_token_id] = max;
+    }
+  }
+
+  if (verified_logits_device_.empty())
+    verified_logits_device_ = state_->params_->p_device->Allocate<float>(vocab_size);
+}
+
+void Generator::SelectVerifiedToken() {
+  const size_t vocab_size = model_->config_->model.vocab_size;
+  copy(std::span<const float>{verified_logits_}.subspan(verified_index_ * vocab_size, vocab_size), verified_logits_device_.CpuSpan());
+  verified_logits_device_.CopyCpuToDevice();
+  search_->SetLogits(verified_logits_device_);
+
+  {
+    Metrics::Timer metrics_timer{GeneratorMetrics::Search};
+    search_->ApplyLogitsProcessors(GetLogitsProcessors());
+    if (grammar_)
+      ApplyGuidance();
+    search_->SelectTop();
+  }
+  computed_logits_ = false;
+  last_action_ = Action::generated;
+
+  // While the selected tokens match the draft, the model already processed them and the next row holds the logits after them
+  const int32_t token = search_->GetNextTokens().CopyDeviceToCpu()[0];
+  if (verified_index_ < draft_tokens_.size() && token == draft_tokens_[verified_index_] && !search_->IsDone()) {
+    verified_index_++;
+    return;
+  }
+
+  // The selected token is pending, like after a regular GenerateNextToken. Drop the rejected draft tokens from the KV cache.
+  const size_t accepted_length = round_start_length_ + verified_index_;
+  if (verified_index_ < draft_tokens_.size())
+    state_->RewindTo(accepted_length);
+  RewindDraft(accepted_length);
+  if (medusa_)
+    UpdateMedusaTokens(verified_index_);
+  verified_logits_.clear();
+}
+
+void Generator::EndSpeculativeRound() {
+  if (!IsSpeculating())
+    return;
+
+  // The last selected token matched its draft token, so keep the KV cache up to it and hand its logits to the search,
+  // which is the state after a regular ComputeLogits
+  const size_t processed_length = round_start_length_ + verified_index_;
+  if (verified_index_ < draft_tokens_.size())
+    state_->RewindTo(processed_length);
+
+  const size_t vocab_size = model_->config_->model.vocab_size;
+  copy(std::span<const float>{verified_logits_}.subspan(verified_index_ * vocab_size, vocab_size), verified_logits_device_.CpuSpan());
+  verified_logits_device_.CopyCpuToDevice();
+  search_->SetLogits(verified_logits_device_);
+  computed_logits_ = true;
+  last_action_ = Action::standard;
+
+  RewindDraft(processed_length - 1);
+  if (medusa_)
+    UpdateMedusaTokens(verified_index_);
+  verified_logits_.clear();
+}
+
+void Generator::ProposeDraftModelTokens(size_t max_count) {
+  SyncDraft();
+  while (draft_tokens_.size() < max_count && !draft_->search_->IsDone()) {
+    draft_->GenerateNextToken();
+    draft_tokens_.push_back(draft_->search_->GetNextTokens().CopyDeviceToCpu()[0]);
+  }
+}
+
+// Finds the most recent earlier occurrence of the sequence's last n tokens, trying the longest n first, and proposes the
+// tokens that followed it. Summaries and code edits tend to copy long spans of the prompt, which this predicts for free.
+void Generator::ProposePromptLookupTokens(size_t max_count) {
+  if (max_count == 0)
+    return;
+
+  std::span<const int32_t> sequence = GetSequence(0).CopyDeviceToCpu();
+  const size_t max_ngram_size = std::min(static_cast<size_t>(state_->params_->search.prompt_lookup_ngram_size), sequence.size() - 1);
+  for (size_t ngram_size = max_ngram_size; ngram_size > 0; ngram_size--) {
+    auto ngram = sequence.subspan(sequence.size() - ngram_size);
+    for (size_t start = sequence.size() - ngram_size; start-- > 0;) {
+      if (!std::equal(ngram.begin(), ngram.end(), sequence.begin() + start))
+        continue;
+      auto continuation = sequence.subspan(start + ngram_size);
+      continuation = continuation.first(std::min(max_count, continuation.size()));
+      draft_tokens_.assign(continuation.begin(), continuation.end());
+      return;
+    }
+  }
+}
+
+// The Medusa heads at the position the pending token was selected from predict the tokens after it. Only the top token
+// of each head is proposed: the decoder's attention is causal, so a tree of candidates can't be verified in one run.
+void Generator::ProposeMedusaTokens(size_t max_count) {
+  draft_tokens_.assign(medusa_tokens_.begin(), medusa_tokens_.begin() + std::min(max_count, medusa_tokens_.size()));
+}
+
+// Runs the pipeline models up to the one with the early exit head on one token at a time, and proposes the head's top
+// token while the head is confident enough. The later layers never see the draft tokens: the verification run processes
+// the pending token and the draft tokens with all layers, which also writes the skipped layers' key-value cache entries.
+void Generator::ProposeEarlyExitTokens(size_t max_count) {
+  if (max_count == 0)
+    return;
+
+  const auto& early_exit = *model_->config_->model.decoder.early_exit;
+  const auto& eos_token_ids = model_->config_->model.eos_token_ids;
+  const size_t vocab_size = model_->config_->model.vocab_size;
+
+  RestoreKeyValueCache();
+  int32_t token = search_->GetNextTokens().CopyDeviceToCpu()[0];
+  state_->early_exit_ = true;
+  while (draft_tokens_.size() < max_count) {
+    auto token_device = AllocateInputIdsOnDevice(cpu_span<const int32_t>{std::span<const int32_t>{&token, 1}});
+    state_->Run(static_cast<int>(round_start_length_ + draft_tokens_.size()), token_device, search_->GetNextIndices());
+
+    auto exit_logits = CopyOutputToCpu(*state_, *model_, model_->config_->model.decoder.outputs.exit_logits);
+    if (exit_logits.size() < vocab_size)
+      throw std::runtime_error("Expected " + model_->config_->model.decoder.outputs.exit_logits + " to have shape [batch_size, sequence_length, vocab_size]");
+    auto row = std::span<const float>{exit_logits}.last(vocab_size);
+
+    // The softmax probability of the top token is 1 / sum(exp(logit - top logit))
+    auto top = std::max_element(row.begin(), row.end());
+    float sum = 0.0f;
+    for (float logit : row)
+      sum += std::exp(logit - *top);
+    token = static_cast<int32_t>(top - row.begin());
+    if (1.0f / sum < early_exit.threshold || std::find(eos_token_ids.begin(), eos_token_ids.end(), token) != eos_token_ids.end())
+      break;
+    draft_tokens_.push_back(token);
+  }
+  state_->early_exit_ = false;
+
+  // Back to where the round started, the pending token isn't in the key-value cache yet
+  state_->RewindTo(round_start_length_ - 1);
+}
+
+void Generator::UpdateMedusaTokens(size_t row) {
+  const auto& name = model_->config_->model.decoder.outputs.medusa_logits;
+  auto shape = state_->GetOutput(name.c_str())->GetTensorTypeAndShapeInfo()->GetShape();
+  if (shape.size() != 4)
+    throw std::runtime_error("Expected " + name + " to have shape [batch_size, sequence_length, num_heads, vocab_size]");
+  const size_t head_count = static_cast<size_t>(shape[2]);
+  const size_t vocab_size = static_cast<size_t>(shape[3]);
+
+  auto heads = CopyOutputToCpu(*state_, *model_, name, row * head_count * vocab_size, head_count * vocab_size);
+  medusa_tokens_.resize(head_count);
+  for (size_t i = 0; i < head_count; i++) {
+    auto head = std::span<const float>{heads}.subspan(i * vocab_size, vocab_size);
+    medusa_tokens_[i] = static_cast<int32_t>(std::max_element(head.begin(), head.end()) - head.begin());
+  }
+}
+
+// Appends the tokens the draft is missing, its sequence is always a prefix of the model's sequence
+void Generator::SyncDraft() {
+  const size_t length = search_->GetSequenceLength();
+  if (draft_->search_->GetSequenceLength() >= length)
+    RewindDraft(length - 1);  // The draft needs at least one token to run to have logits for the next one
+
+  const size_t draft_length = draft_->search_->GetSequenceLength();
+  std::span<const int32_t> sequence = GetSequence(0).CopyDeviceToCpu();
+  draft_->AppendTokens(cpu_span<const int32_t>{sequence.subspan(draft_length, length - draft_length)});
+}
+
+// Drops the draft's tokens from 'length' on, SyncDraft appends the model's tokens before the next round
+void Generator::RewindDraft(size_t length) {
+  if (!draft_)
+    return;
+
+  auto& draft = *draft_;
+  const size_t draft_length = draft.search_->GetSequenceLength();
+  if (length >= draft_length)
+    return;
+
+  // A token selected by GenerateNextToken is pending, it isn't in the draft's KV cache yet
+  const bool has_pending_token = draft.last_action_ == Action::generated && !draft.computed_logits_;
+  if (length < draft_length - (has_pending_token ? 1 : 0))
+    draft.state_->RewindTo(length);
+  draft.search_->RewindTo(length);
+  draft.computed_logits_ = false;
+  draft.last_action_ = Action::standard;
+}
+
+}  // namespace Generators
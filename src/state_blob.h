@@ -0,0 +1,72 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// Binary snapshots of a generator (see Generator::SaveState). Values are stored in host byte order, so a snapshot can
+// only be loaded on a host of the same endianness. Sections are prefixed with their size, so a reader that can't use
+// one can skip it.
+#pragma once
+
+namespace Generators {
+
+struct StateWriter {
+  template <typename T>
+  void Write(const T& value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    WriteBytes(std::span<const uint8_t>{reinterpret_cast<const uint8_t*>(&value), sizeof(T)});
+  }
+
+  void WriteBytes(std::span<const uint8_t> bytes) { blob_.insert(blob_.end(), bytes.begin(), bytes.end()); }
+
+  void WriteString(std::string_view value) {
+    Write<uint64_t>(value.size());
+    WriteBytes(std::span<const uint8_t>{reinterpret_cast<const uint8_t*>(value.data()), value.size()});
+  }
+
+  // Reserves the size of a section, EndSection fills it in with the bytes written since
+  size_t BeginSection() {
+    Write<uint64_t>(0);
+    return blob_.size();
+  }
+  void EndSection(size_t begin) {
+    const uint64_t size = blob_.size() - begin;
+    std::memcpy(blob_.data() + begin - sizeof(size), &size, sizeof(size));
+  }
+
+  std::vector<uint8_t> blob_;
+  bool quantize_key_value_cache_{};  // The key-value cache entries are written as int8 with a scale per entry
+};
+
+struct StateReader {
+  StateReader(std::span<const uint8_t> blob) : blob_{blob} {}
+
+  template <typename T>
+  T Read() {
+    static_assert(std::is_trivially_copyable_v<T>);
+    T value;
+    std::memcpy(&value, ReadBytes(sizeof(T)).data(), sizeof(T));
+    return value;
+  }
+
+  std::span<const uint8_t> ReadBytes(size_t size) {
+    if (size > blob_.size())
+      throw std::runtime_error("The generator state is truncated");
+    auto bytes = blob_.first(size);
+    blob_ = blob_.subspan(size);
+    return bytes;
+  }
+
+  std::string ReadString() {
+    auto bytes = ReadBytes(static_cast<size_t>(Read<uint64_t>()));
+    return std::string{reinterpret_cast<const char*>(bytes.data()), bytes.size()};
+  }
+
+  // Returns a reader of the section written between BeginSection and EndSection, and skips it in this reader
+  StateReader ReadSection() { return StateReader{ReadBytes(static_cast<size_t>(Read<uint64_t>()))}; }
+
+  bool IsEmpty() const { return blob_.empty(); }
+
+ private:
+  std::span<const uint8_t> blob_;
+};
+
+}  // namespace Generators
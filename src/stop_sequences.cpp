@@ -0,0 +1,123 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "models/model.h"
+#include "search.h"
+#include "constrained_decoding.h"
+#include "stop_sequences.h"
+
+namespace Generators {
+
+void StopSequences::Automaton::Add(std::span<const int32_t> sequence) {
+  int32_t node = 0;
+  for (int32_t symbol : sequence) {
+    auto [it, added] = nodes_[node].next.try_emplace(symbol, static_cast<int32_t>(nodes_.size()));
+    node = it->second;
+    if (added)
+      nodes_.emplace_back();  // Invalidates 'it', which isn't used again
+  }
+  nodes_[node].match = true;
+}
+
+void StopSequences::Automaton::Build() {
+  // Breadth first, so the failure link of a node's parent is set before the node's
+  std::vector<int32_t> queue;
+  for (auto& [symbol, child] : nodes_[0].next)
+    queue.push_back(child);
+  for (size_t i = 0; i < queue.size(); i++) {
+    const int32_t node = queue[i];
+    for (auto& [symbol, child] : nodes_[node].next) {
+      nodes_[child].fail = Step(nodes_[node].fail, symbol);
+      nodes_[child].match |= nodes_[nodes_[child].fail].match;
+      queue.push_back(child);
+    }
+  }
+}
+
+int32_t StopSequences::Automaton::Step(int32_t node, int32_t symbol) const {
+  while (true) {
+    auto& next = nodes_[node].next;
+    if (auto it = next.find(symbol); it != next.end())
+      return it->second;
+    if (node == 0)
+      return 0;
+    node = nodes_[node].fail;
+  }
+}
+
+StopSequences::StopSequences(const Model& model, const Config::Search& search)
+    : states_(search.batch_size), finished_(search.batch_size) {
+  for (auto& sequence : search.stop_token_sequences) {
+    if (sequence.empty())
+      throw std::runtime_error("stop_token_sequences cannot contain an empty sequence");
+    for (int32_t token : sequence) {
+      if (token < 0 || token >= model.config_->model.vocab_size)
+        throw std::runtime_error("stop_token_sequences token " + std::to_string(token) + " is outside of the vocabulary");
+    }
+    tokens_.Add(sequence);
+  }
+  tokens_.Build();
+
+  for (auto& text : search.stop_strings) {
+    if (text.empty())
+      throw std::runtime_error("stop_strings cannot contain an empty string");
+    std::vector<int32_t> bytes(text.begin(), text.end());
+    for (auto& byte : bytes)
+      byte = static_cast<uint8_t>(byte);
+    text_.Add(bytes);
+  }
+  text_.Build();
+  if (!text_.Empty())
+    vocabulary_ = model.GetTokenVocabulary();
+}
+
+bool StopSequences::Advance(State& state, int32_t token) const {
+  bool stop = false;
+  if (!tokens_.Empty()) {
+    state.tokens = tokens_.Step(state.tokens, token);
+    stop |= tokens_.IsMatch(state.tokens);
+  }
+
+  // Tokens without text (special tokens and the parts of a multibyte character) leave the text state as it is
+  if (vocabulary_ && token >= 0 && static_cast<size_t>(token) < vocabulary_->tokens_.size()) {
+    for (char byte : vocabulary_->tokens_[token]) {
+      state.text = text_.Step(state.text, static_cast<uint8_t>(byte));
+      stop |= text_.IsMatch(state.text);
+    }
+  }
+  return stop;
+}
+
+void StopSequences::Advance(std::span<const int32_t> next_tokens, size_t sequence_length, Search& search) {
+  history_.emplace_back(sequence_length - 1, states_);
+  for (size_t i = 0; i < states_.size(); i++) {
+    if (!finished_[i] && Advance(states_[i], next_tokens[i])) {
+      finished_[i] = true;
+      search.FinishSequence(i);
+    }
+  }
+}
+
+void StopSequences::Reset() {
+  std::fill(states_.begin(), states_.end(), State{});
+  std::fill(finished_.begin(), finished_.end(), false);  // The search takes every sequence as not done again
+}
+
+void StopSequences::RewindTo(size_t length) {
+  while (!history_.empty() && history_.back().first >= length) {
+    states_ = std::move(history_.back().second);
+    history_.pop_back();
+  }
+  std::fill(finished_.begin(), finished_.end(), false);
+}
+
+void StopSequences::Evict(size_t begin, size_t count) {
+  std::erase_if(history_, [&](const auto& entry) { return entry.first >= begin && entry.first < begin + count; });
+  for (auto& entry : history_) {
+    if (entry.first >= begin + count)
+      entry.first -= count;
+  }
+}
+
+}  // namespace Generators
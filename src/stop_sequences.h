@@ -0,0 +1,58 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// Stop sequences: a batch entry finishes as soon as its generated tokens end with one of the search's
+// stop_token_sequences, or its generated text ends with one of its stop_strings. Both are matched by Aho-Corasick
+// automata that advance by one token per step, so the check costs the same however many stop sequences there are.
+#pragma once
+
+namespace Generators {
+
+struct TokenVocabulary;
+
+struct StopSequences {
+  StopSequences(const Model& model, const Config::Search& search);
+
+  // Advances the batch entries that aren't finished by their token of 'next_tokens', which the search just appended at
+  // sequence_length - 1. Entries that complete a stop sequence are finished through Search::FinishSequence.
+  void Advance(std::span<const int32_t> next_tokens, size_t sequence_length, Search& search);
+  bool IsFinished(size_t batch_id) const { return finished_[batch_id]; }
+
+  void Reset();                  // After appended tokens, only generated tokens are matched
+  void RewindTo(size_t length);  // Back to the states before the generated tokens past 'length'
+  void Evict(size_t begin, size_t count);  // The sequence dropped 'count' tokens from 'begin' on (see search.attention_sinks)
+
+ private:
+  // Matches sequences of symbols, token ids or bytes
+  struct Automaton {
+    void Add(std::span<const int32_t> sequence);
+    void Build();  // Computes the failure links, after the last Add
+    int32_t Step(int32_t node, int32_t symbol) const;
+    bool IsMatch(int32_t node) const { return nodes_[node].match; }
+    bool Empty() const { return nodes_.size() == 1; }
+
+   private:
+    struct Node {
+      std::unordered_map<int32_t, int32_t> next;
+      int32_t fail{};  // The node of the longest proper suffix of this node's sequence that is a prefix of a sequence
+      bool match{};    // Set if a sequence ends here, or at the node of any of its suffixes
+    };
+    std::vector<Node> nodes_{1};  // The root is node 0
+  };
+
+  // Where a batch entry is in both automata, the start state is {}
+  struct State {
+    int32_t tokens{}, text{};
+  };
+
+  bool Advance(State& state, int32_t token) const;  // Returns true if a stop sequence ends with 'token'
+
+  Automaton tokens_, text_;
+  std::shared_ptr<const TokenVocabulary> vocabulary_;  // The bytes of each token, only loaded if there are stop strings
+
+  std::vector<State> states_;                                   // shape (batch_size)
+  std::vector<std::pair<size_t, std::vector<State>>> history_;  // Sequence length and states before each generated token
+  std::vector<bool> finished_;                                  // shape (batch_size)
+};
+
+}  // namespace Generators
@@ -0,0 +1,288 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "json.h"
+#include "trace.h"
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+
+namespace Generators {
+namespace Trace {
+
+namespace {
+
+struct Event {
+  std::string name;  // Copied, the pipeline model names are gone when a model is released before the trace is written
+  const char* category;
+  Clock::duration start, duration;  // Relative to the start of the trace
+  uint32_t thread_id;
+  const void* stream;
+};
+
+struct OrtProfile {
+  std::string filename_prefix;
+  std::chrono::system_clock::time_point wall_start;  // For the file name, onnxruntime names it after its local start time
+  int64_t start_us;                                  // Relative to the start of the trace
+};
+
+}  // namespace
+
+struct Recorder {
+  std::mutex mutex_;
+  std::string filename_;
+  Clock::time_point start_;
+  std::chrono::high_resolution_clock::time_point start_high_resolution_;  // onnxruntime's profiler uses this clock
+  std::vector<Event> events_;
+  std::vector<OrtProfile> ort_profiles_;
+};
+
+namespace {
+
+Recorder& GetRecorder() {
+  static Recorder recorder;
+  return recorder;
+}
+
+uint32_t GetThreadId() {
+  static std::atomic<uint32_t> next_id{1};
+  thread_local uint32_t id = next_id++;
+  return id;
+}
+
+void WriteString(std::ostream& stream, std::string_view string) {
+  stream << '"';
+  for (char c : string) {
+    if (c == '"' || c == '\\')
+      stream << '\\' << c;
+    else if (static_cast<unsigned char>(c) >= 0x20)
+      stream << c;
+  }
+  stream << '"';
+}
+
+// The parts of an onnxruntime profile event that go into the trace, the other values and nested args are skipped
+struct OrtEvent {
+  std::string name, category, phase;
+  double ts{}, dur{}, tid{};
+  std::vector<std::pair<std::string, std::string>> args;
+};
+
+struct Skip_Element : JSON::Element {
+  void OnValue(std::string_view /*name*/, JSON::Value /*value*/) override {}
+  Element& OnArray(std::string_view /*name*/) override { return *this; }
+  Element& OnObject(std::string_view /*name*/) override { return *this; }
+};
+
+struct OrtEventArgs_Element : JSON::Element {
+  explicit OrtEventArgs_Element(OrtEvent& v) : v_{v} {}
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    if (auto* string = std::get_if<std::string_view>(&value))
+      v_.args.emplace_back(name, *string);
+  }
+  Element& OnArray(std::string_view /*name*/) override { return skip_; }
+  Element& OnObject(std::string_view /*name*/) override { return skip_; }
+
+ private:
+  OrtEvent& v_;
+  Skip_Element skip_;
+};
+
+struct OrtEvent_Element : JSON::Element {
+  explicit OrtEvent_Element(std::vector<OrtEvent>& v) : v_{v} {}
+
+  void OnValue(std::string_view name, JSON::Value value) override {
+    if (name == "name")
+      event_.name = JSON::Get<std::string_view>(value);
+    else if (name == "cat")
+      event_.category = JSON::Get<std::string_view>(value);
+    else if (name == "ph")
+      event_.phase = JSON::Get<std::string_view>(value);
+    else if (name == "ts")
+      event_.ts = JSON::Get<double>(value);
+    else if (name == "dur")
+      event_.dur = JSON::Get<double>(value);
+    else if (name == "tid" && std::holds_alternative<double>(value))
+      event_.tid = JSON::Get<double>(value);
+  }
+
+  Element& OnArray(std::string_view /*name*/) override { return skip_; }
+  Element& OnObject(std::string_view name) override {
+    if (name == "args")
+      return args_;
+    return skip_;
+  }
+
+  void OnComplete(bool /*empty*/) override {
+    if (event_.phase == "X")
+      v_.push_back(std::move(event_));
+    event_ = {};
+  }
+
+ private:
+  std::vector<OrtEvent>& v_;
+  OrtEvent event_;
+  OrtEventArgs_Element args_{event_};
+  Skip_Element skip_;
+};
+
+struct OrtProfile_Element : JSON::Element {
+  explicit OrtProfile_Element(std::vector<OrtEvent>& v) : event_{v} {}
+
+  Element& OnArray(std::string_view /*name*/) override { return *this; }
+  Element& OnObject(std::string_view /*name*/) override { return event_; }
+
+ private:
+  OrtEvent_Element event_;
+};
+
+// onnxruntime names the profile <prefix>_<local start time>.json, with the time in seconds. The recorded start time can
+// be in the second before the one the file is named after.
+std::vector<OrtEvent> ReadOrtProfile(const OrtProfile& profile) {
+  for (int delta : {0, 1, -1}) {
+    const auto time = std::chrono::system_clock::to_time_t(profile.wall_start + std::chrono::seconds{delta});
+    std::tm local_time{};
+#ifdef _WIN32
+    localtime_s(&local_time, &time);
+#else
+    localtime_r(&time, &local_time);
+#endif
+    std::ostringstream filename;
+    filename << profile.filename_prefix << '_' << std::put_time(&local_time, "%Y-%m-%d_%H-%M-%S") << ".json";
+
+    std::ifstream file = fs::path{filename.str()}.open();
+    if (!file.is_open())
+      continue;
+    std::string document{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    std::vector<OrtEvent> events;
+    OrtProfile_Element root{events};
+    JSON::Parse(root, document);
+    return events;
+  }
+
+  if (g_log.enabled && g_log.warning)
+    Log("warning", "The onnxruntime profile '" + profile.filename_prefix + "' was not written yet, release the model before the trace is written to include it");
+  return {};
+}
+
+// Requires recorder.mutex_
+void Write(Recorder& recorder) {
+  std::ofstream file = fs::path{recorder.filename_}.open_for_write();
+  if (!file.is_open())
+    throw std::runtime_error("Unable to open the trace file " + recorder.filename_);
+
+  constexpr int genai_pid = 1, onnxruntime_pid = 2;
+  const auto to_us = [](Clock::duration duration) { return std::chrono::duration<double, std::micro>(duration).count(); };
+
+  file << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << genai_pid << ",\"args\":{\"name\":\"onnxruntime-genai\"}}";
+  for (auto& event : recorder.events_) {
+    file << ",\n{\"name\":";
+    WriteString(file, event.name);
+    file << ",\"cat\":\"" << event.category << "\",\"ph\":\"X\",\"pid\":" << genai_pid << ",\"tid\":" << event.thread_id
+         << ",\"ts\":" << to_us(event.start) << ",\"dur\":" << to_us(event.duration);
+    if (event.stream)
+      file << ",\"args\":{\"stream\":\"" << event.stream << "\"}";
+    file << '}';
+  }
+
+  if (!recorder.ort_profiles_.empty())
+    file << ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << onnxruntime_pid << ",\"args\":{\"name\":\"onnxruntime\"}}";
+  for (auto& profile : recorder.ort_profiles_) {
+    for (auto& event : ReadOrtProfile(profile)) {
+      file << ",\n{\"name\":";
+      WriteString(file, event.name);
+      file << ",\"cat\":";
+      WriteString(file, event.category);
+      file << ",\"ph\":\"X\",\"pid\":" << onnxruntime_pid << ",\"tid\":" << static_cast<int64_t>(event.tid)
+           << ",\"ts\":" << profile.start_us + event.ts << ",\"dur\":" << event.dur << ",\"args\":{";
+      for (size_t i = 0; i < event.args.size(); i++) {
+        file << (i ? "," : "");
+        WriteString(file, event.args[i].first);
+        file << ':';
+        WriteString(file, event.args[i].second);
+      }
+      file << "}}";
+    }
+  }
+  file << "\n]}\n";
+}
+
+}  // namespace
+
+void Start(const std::string& filename) {
+  Stop();
+
+  auto& recorder = GetRecorder();
+  std::scoped_lock lock{recorder.mutex_};
+  recorder.filename_ = filename;
+  recorder.start_ = Clock::now();
+  recorder.start_high_resolution_ = std::chrono::high_resolution_clock::now();
+  g_enabled = true;
+}
+
+void Stop() {
+  auto& recorder = GetRecorder();
+  std::scoped_lock lock{recorder.mutex_};
+  if (!g_enabled)
+    return;
+
+  g_enabled = false;
+  Write(recorder);
+  recorder.events_.clear();
+  recorder.ort_profiles_.clear();
+}
+
+Profile::Profile(std::string filename) : recorder_{std::make_unique<Recorder>()} {
+  recorder_->filename_ = std::move(filename);
+  recorder_->start_ = Clock::now();
+}
+
+Profile::~Profile() {
+  try {
+    Write(*recorder_);
+  } catch (const std::exception& e) {
+    if (g_log.enabled && g_log.warning)
+      Log("warning", e.what());
+  }
+}
+
+void Profile::AddEvent(const char* name, const char* category, Clock::time_point start, Clock::time_point end, const void* stream) {
+  recorder_->events_.push_back({name, category, start - recorder_->start_, end - start, GetThreadId(), stream});
+}
+
+void AddEvent(const char* name, const char* category, Clock::time_point start, Clock::time_point end, const void* stream) {
+  if (t_profile)
+    t_profile->AddEvent(name, category, start, end, stream);
+  if (!IsEnabled())
+    return;
+
+  const auto thread_id = GetThreadId();
+  auto& recorder = GetRecorder();
+  std::scoped_lock lock{recorder.mutex_};
+  if (!g_enabled || start < recorder.start_)  // Started before the trace did
+    return;
+  recorder.events_.push_back({name, category, start - recorder.start_, end - start, thread_id, stream});
+}
+
+void AddOrtProfile(const std::string& profile_file_prefix, uint64_t profiling_start_time_ns) {
+  auto& recorder = GetRecorder();
+  std::scoped_lock lock{recorder.mutex_};
+  if (!g_enabled)
+    return;
+
+  const auto start = std::chrono::high_resolution_clock::time_point{
+      std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::nanoseconds{profiling_start_time_ns})};
+  const auto since_start = std::chrono::high_resolution_clock::now() - start;
+  recorder.ort_profiles_.push_back(
+      {profile_file_prefix,
+       std::chrono::system_clock::now() - std::chrono::duration_cast<std::chrono::system_clock::duration>(since_start),
+       std::chrono::duration_cast<std::chrono::microseconds>(start - recorder.start_high_resolution_).count()});
+}
+
+}  // namespace Trace
+}  // namespace Generators
@@ -0,0 +1,96 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace Generators {
+
+// Timeline of the generation in the Chrome trace event format (chrome://tracing, ui.perfetto.dev). Recording starts with
+// SetLogString("trace_filename", path) and the trace is written to the file when the option changes or at Shutdown.
+// Every event has the id of the thread it ran on, and the CUDA stream for the session runs.
+//
+// Sessions created with enable_profiling while recording get their onnxruntime profile merged into the trace, on its
+// own timeline. onnxruntime writes the profile when the session is released, so release the model before the trace is
+// written to include it.
+namespace Trace {
+
+using Clock = std::chrono::steady_clock;
+
+inline std::atomic<bool> g_enabled{};
+inline bool IsEnabled() { return g_enabled.load(std::memory_order_relaxed); }
+
+struct Recorder;
+
+// The timeline of one generator, recorded while the generator's "enable_profiling" runtime option is set and written
+// to 'filename' on destruction. Unlike the trace it only has the events of the generator's calls, on the calling thread.
+struct Profile {
+  Profile(std::string filename);
+  ~Profile();
+
+  void AddEvent(const char* name, const char* category, Clock::time_point start, Clock::time_point end, const void* stream);
+
+  Profile(const Profile&) = delete;
+  Profile& operator=(const Profile&) = delete;
+
+ private:
+  std::unique_ptr<Recorder> recorder_;
+};
+
+inline thread_local Profile* t_profile{};  // Of the generator call running on this thread, see ProfileScope
+
+// Directs the events of this thread to 'profile' for its lifetime, a null profile keeps the current one
+struct ProfileScope {
+  ProfileScope(Profile* profile) : previous_{t_profile} {
+    if (profile)
+      t_profile = profile;
+  }
+  ~ProfileScope() { t_profile = previous_; }
+
+  ProfileScope(const ProfileScope&) = delete;
+  ProfileScope& operator=(const ProfileScope&) = delete;
+
+ private:
+  Profile* previous_;
+};
+
+// True if events are recorded, to the trace or to a generator's profile
+inline bool IsRecording() { return IsEnabled() || t_profile; }
+
+void Start(const std::string& filename);  // Writes the trace in progress, if any, first
+void Stop();                              // Writes the trace in progress, if any
+
+void AddEvent(const char* name, const char* category, Clock::time_point start, Clock::time_point end, const void* stream = nullptr);
+// A session that has profiling enabled, whose profile is written to 'profile_file_prefix'_<time>.json
+void AddOrtProfile(const std::string& profile_file_prefix, uint64_t profiling_start_time_ns);
+
+// Records its lifetime as an event on the current thread
+struct Scope {
+  Scope(const char* name, const char* category, const void* stream = nullptr)
+      : name_{name}, category_{category}, stream_{stream}, active_{IsRecording()} {
+    if (active_)
+      start_ = Clock::now();
+  }
+
+  ~Scope() {
+    if (active_)
+      AddEvent(name_, category_, start_, Clock::now(), stream_);
+  }
+
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+
+ private:
+  const char* name_;
+  const char* category_;
+  const void* stream_;
+  bool active_;
+  Clock::time_point start_;
+};
+
+}  // namespace Trace
+}  // namespace Generators
@@ -11,35 +11,127 @@ namespace WebGPU {
 static Ort::Allocator* ort_allocator_{};
 const char* device_label = "WebGPU";
 
+// A single Identity node from a uint8 'input' to a uint8 'output' of length 'n'. The WebGPU EP exposes no data
+// transfer API of its own, so copies in and out of WebGPU buffers run this model with the ends bound through an
+// IoBinding, and onnxruntime does the transfers (staging and mapping the buffers) for us.
+static constexpr uint8_t identity_model_data[] = {
+    0x08, 0x07, 0x3a, 0x4e, 0x0a, 0x19, 0x0a, 0x05, 0x69, 0x6e, 0x70, 0x75, 0x74, 0x12, 0x06, 0x6f, 0x75, 0x74, 0x70,
+    0x75, 0x74, 0x22, 0x08, 0x49, 0x64, 0x65, 0x6e, 0x74, 0x69, 0x74, 0x79, 0x12, 0x04, 0x63, 0x6f, 0x70, 0x79, 0x5a,
+    0x14, 0x0a, 0x05, 0x69, 0x6e, 0x70, 0x75, 0x74, 0x12, 0x0b, 0x0a, 0x09, 0x08, 0x02, 0x12, 0x05, 0x0a, 0x03, 0x12,
+    0x01, 0x6e, 0x62, 0x15, 0x0a, 0x06, 0x6f, 0x75, 0x74, 0x70, 0x75, 0x74, 0x12, 0x0b, 0x0a, 0x09, 0x08, 0x02, 0x12,
+    0x05, 0x0a, 0x03, 0x12, 0x01, 0x6e, 0x42, 0x04, 0x0a, 0x00, 0x10, 0x0d};
+
+// Copies size_in_bytes from the start of source to the start of dest, where each is either a WebGPU buffer (as
+// described by ort_allocator_) or plain CPU memory
+static void CopyBytes(void* dest, bool dest_on_device, void* source, bool source_on_device, size_t size_in_bytes) {
+  auto& globals = *GetOrtGlobals();
+  std::call_once(globals.webgpu_copy_session_once_, [&globals] {
+    auto session_options = OrtSessionOptions::Create();
+    session_options->AppendExecutionProvider("WebGPU");
+    globals.webgpu_copy_session_ = OrtSession::Create(*globals.env_, identity_model_data, sizeof(identity_model_data), session_options.get());
+    globals.webgpu_copy_binding_ = OrtIoBinding::Create(*globals.webgpu_copy_session_);
+  });
+  auto& copy_session = *globals.webgpu_copy_session_;
+  auto& copy_binding = *globals.webgpu_copy_binding_;
+
+  static auto cpu_memory_info = OrtMemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeDefault);
+  auto& device_memory_info = ort_allocator_->GetInfo();
+  std::array<int64_t, 1> shape{static_cast<int64_t>(size_in_bytes)};
+  auto input = OrtValue::CreateTensor(source_on_device ? device_memory_info : *cpu_memory_info, source, size_in_bytes, shape, ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8);
+  auto output = OrtValue::CreateTensor(dest_on_device ? device_memory_info : *cpu_memory_info, dest, size_in_bytes, shape, ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8);
+
+  std::lock_guard<std::mutex> lock{globals.webgpu_copy_mutex_};  // The generators of the Engine copy from many threads
+  copy_binding.BindInput("input", *input);
+  copy_binding.BindOutput("output", *output);
+  copy_session.Run(nullptr, copy_binding);
+  copy_binding.SynchronizeOutputs();  // Waits for the buffer to be mapped and read when the output is on the CPU
+  copy_binding.ClearBoundInputs();
+  copy_binding.ClearBoundOutputs();
+}
+
+// Creating a WebGPU buffer is slow and the generators allocate and free many small ones, so the buffers are pooled by
+// size class and reused across allocations and generators. A pooled buffer can be larger than size_in_bytes_.
+static DeviceArena& GetBufferPool() {
+  return *GetOrtGlobals()->webgpu_buffer_pool_;
+}
+
+// The shared zero buffer that buffers up to this size are cleared from, larger ones are cleared through their CPU copy
+constexpr size_t max_zero_buffer_bytes = 64 * 1024 * 1024;
+
 struct WebGPUMemory final : DeviceBuffer {
   WebGPUMemory(size_t size) : owned_{true} {
     size_in_bytes_ = size;
-    p_cpu_ = p_device_ = static_cast<uint8_t*>(ort_allocator_->Alloc(size_in_bytes_));
+    p_device_ = static_cast<uint8_t*>(GetBufferPool().AllocBlock(size_in_bytes_));
   }
 
   WebGPUMemory(void* p, size_t size) : owned_{false} {
     size_in_bytes_ = size;
-    p_cpu_ = p_device_ = static_cast<uint8_t*>(p);
+    p_device_ = static_cast<uint8_t*>(p);
   }
 
   ~WebGPUMemory() override {
     if (owned_)
-      ort_allocator_->Free(p_device_);
+      GetBufferPool().FreeBlock(p_device_);
+    if (p_cpu_)
+      free(p_cpu_);
   }
 
   const char* GetType() const override { return device_label; }
-  void AllocateCpu() override { throw std::runtime_error("CPU can't access WebGPU memory"); }
-  void CopyDeviceToCpu() override { throw std::runtime_error("CPU can't access WebGPU memory"); }
-  void CopyCpuToDevice() override { throw std::runtime_error("CPU can't access WebGPU memory"); }
+
+  void AllocateCpu() override {
+    if (!p_cpu_)
+      p_cpu_ = static_cast<uint8_t*>(malloc(size_in_bytes_));
+  }
+
+  void CopyDeviceToCpu() override {
+    AllocateCpu();
+    if (size_in_bytes_)
+      CopyBytes(p_cpu_, false, p_device_, true, size_in_bytes_);
+  }
+
+  void CopyCpuToDevice() override {
+    assert(p_cpu_);
+    if (size_in_bytes_)
+      CopyBytes(p_device_, true, p_cpu_, false, size_in_bytes_);
+  }
+
   void CopyFrom(size_t begin_dest, DeviceBuffer& source, size_t begin_source, size_t size_in_bytes) override {
-    throw std::runtime_error("CPU can't access WebGPU memory");
+    // p_device_ is a buffer handle rather than an address, so only whole buffers can be copied on the device
+    if (source.GetType() == device_label && begin_dest == 0 && begin_source == 0 &&
+        size_in_bytes == size_in_bytes_ && size_in_bytes == source.size_in_bytes_) {
+      if (size_in_bytes)
+        CopyBytes(p_device_, true, source.p_device_, true, size_in_bytes);
+    } else
+      CopyThroughCpu(*this, begin_dest, source, begin_source, size_in_bytes);
   }
 
   void Zero() override {
-    throw std::runtime_error("Zeroing not implemented for WebGPU memory");
+    if (!size_in_bytes_)
+      return;
+    if (size_in_bytes_ > max_zero_buffer_bytes) {
+      AllocateCpu();
+      memset(p_cpu_, 0, size_in_bytes_);
+      CopyCpuToDevice();
+      return;
+    }
+
+    // A device to device copy from the zero buffer, which grows to the largest buffer cleared so far. Only its own
+    // zeros are uploaded from the CPU.
+    auto& globals = *GetOrtGlobals();
+    std::lock_guard<std::mutex> lock{globals.webgpu_zero_mutex_};
+    auto& zeros = globals.webgpu_zero_buffer_;
+    if (!zeros || zeros->size_in_bytes_ < size_in_bytes_) {
+      zeros = std::make_shared<WebGPUMemory>(size_in_bytes_);
+      zeros->AllocateCpu();
+      memset(zeros->p_cpu_, 0, size_in_bytes_);
+      zeros->CopyCpuToDevice();
+      free(zeros->p_cpu_);
+      zeros->p_cpu_ = nullptr;
+    }
+    CopyBytes(p_device_, true, zeros->p_device_, true, size_in_bytes_);
   }
 
-  bool owned_;
+  bool owned_;  // If we own the memory, we delete it on destruction
 };
 
 struct InterfaceImpl : DeviceInterface {
@@ -51,6 +143,7 @@ struct InterfaceImpl : DeviceInterface {
   void InitOrt(const OrtApi& /*api*/, Ort::Allocator& allocator) override {
     assert(!ort_allocator_);
     ort_allocator_ = &allocator;
+    GetOrtGlobals()->webgpu_buffer_pool_ = std::make_unique<DeviceArena>(allocator);
   }
 
   Ort::Allocator& GetAllocator() override {
@@ -65,6 +158,12 @@ struct InterfaceImpl : DeviceInterface {
     return std::make_shared<WebGPUMemory>(p, size);
   }
 
+  size_t GetCachedBytes() const override { return ort_allocator_ ? GetBufferPool().GetCachedBytes() : 0; }
+  void ReleaseCachedMemory() override {
+    if (ort_allocator_)
+      GetBufferPool().ReleaseFreeBlocks();
+  }
+
   std::unique_ptr<Search> CreateGreedy(const GeneratorParams& params) override { return std::make_unique<GreedySearch_Cpu>(params); }
   std::unique_ptr<Search> CreateBeam(const GeneratorParams& params) override { return std::make_unique<BeamSearch_Cpu>(params); }
 
@@ -0,0 +1,207 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "models/model.h"
+#include "whisper_stream.h"
+
+namespace Generators {
+
+WhisperStream::WhisperStream(const Model& model, std::shared_ptr<GeneratorParams> params, std::span<const int32_t> prompt_tokens,
+                             int32_t start_of_previous_token_id, size_t step_frames, size_t window_frames)
+    : model_{model.shared_from_this()},
+      params_{std::move(params)},
+      prompt_tokens_{prompt_tokens.begin(), prompt_tokens.end()},
+      start_of_previous_token_id_{start_of_previous_token_id},
+      step_frames_{step_frames},
+      window_frames_{window_frames},
+      input_features_type_{model.session_info_->GetInputDataType(std::string(Config::Defaults::InputFeaturesName))} {
+  if (model.config_->model.type != "whisper")
+    throw std::runtime_error("WhisperStream requires a whisper model, model type is " + model.config_->model.type);
+  if (params_->search.batch_size != 1)
+    throw std::runtime_error("WhisperStream requires a batch_size of 1, is " + std::to_string(params_->search.batch_size));
+  if (prompt_tokens_.empty())
+    throw std::runtime_error("WhisperStream requires decoder prompt tokens");
+  if (step_frames_ == 0 || step_frames_ > window_frames_)
+    throw std::runtime_error("step_frames must be between 1 and window_frames (" + std::to_string(window_frames_) + "), is " + std::to_string(step_frames_));
+  if (!(input_features_type_ == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT || input_features_type_ == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16))
+    throw std::runtime_error("Expected input_features to be of type float or float16. Actual: " + std::to_string(input_features_type_));
+}
+
+void WhisperStream::AddFeatures(std::span<const float> features, size_t frame_count) {
+  if (frame_count == 0)
+    return;
+  if (features.size() % frame_count != 0)
+    throw std::runtime_error("Features size (" + std::to_string(features.size()) + ") is not a multiple of the frame count (" + std::to_string(frame_count) + ")");
+  const size_t mel_count = features.size() / frame_count;
+  if (mel_count_ == 0)
+    mel_count_ = mel_count;
+  else if (mel_count != mel_count_)
+    throw std::runtime_error("Features have " + std::to_string(mel_count) + " mels, earlier features had " + std::to_string(mel_count_));
+
+  std::vector<float> frame(mel_count_);
+  for (size_t frame_index = 0; frame_index < frame_count; frame_index++) {
+    for (size_t mel = 0; mel < mel_count_; mel++)
+      frame[mel] = features[mel * frame_count + frame_index];
+    AddFrame(frame);
+  }
+}
+
+// Without voice activity detection every frame goes into the segment. With it, silent frames are held back in
+// pending_frames_ until speech follows (a short pause, or the padding before speech) or the pause gets long enough to
+// end the segment, after which only the padding for the next speech is kept.
+void WhisperStream::AddFrame(std::span<const float> frame) {
+  const size_t frame_index = frame_count_++;
+  if (!voice_activity_) {
+    AppendFrame(frame, frame_index);
+    return;
+  }
+
+  const float energy = std::accumulate(frame.begin(), frame.end(), 0.0f) / static_cast<float>(frame.size());
+  loudest_frame_ = std::max(loudest_frame_, energy);
+  if (energy >= loudest_frame_ - voice_activity_->silence_threshold) {
+    silence_frame_count_ = 0;
+    const size_t pending_count = pending_frames_.size() / mel_count_;
+    for (size_t i = 0; i < pending_count; i++)
+      AppendFrame(std::span<const float>{pending_frames_}.subspan(i * mel_count_, mel_count_), frame_index - pending_count + i);
+    pending_frames_.clear();
+    AppendFrame(frame, frame_index);
+    return;
+  }
+
+  silence_frame_count_++;
+  if (!frames_.empty() && silence_frame_count_ <= voice_activity_->padding_frames) {
+    AppendFrame(frame, frame_index);
+    return;
+  }
+  pending_frames_.insert(pending_frames_.end(), frame.begin(), frame.end());
+  if (!frames_.empty() && silence_frame_count_ > voice_activity_->min_silence_frames)
+    EndSegment(Decode());
+  if (frames_.empty() && pending_frames_.size() > voice_activity_->padding_frames * mel_count_)
+    pending_frames_.erase(pending_frames_.begin(), pending_frames_.end() - voice_activity_->padding_frames * mel_count_);
+}
+
+void WhisperStream::AppendFrame(std::span<const float> frame, size_t frame_index) {
+  if (frames_.empty())
+    segment_begin_frame_ = frame_index;
+  segment_end_frame_ = frame_index + 1;
+  frames_.insert(frames_.end(), frame.begin(), frame.end());
+  undecoded_frame_count_++;
+
+  if (frames_.size() == window_frames_ * mel_count_) {
+    EndSegment(Decode());
+    return;
+  }
+  if (undecoded_frame_count_ < step_frames_)
+    return;
+
+  // Local agreement: commit the tokens this hypothesis shares with the previous one. Committed tokens are never
+  // taken back, so a hypothesis that disagrees with them only updates previous_hypothesis_.
+  auto hypothesis = Decode();
+  const size_t agreed_count = std::mismatch(hypothesis.begin(), hypothesis.end(), previous_hypothesis_.begin(), previous_hypothesis_.end()).first - hypothesis.begin();
+  if (agreed_count > segment_tokens_.size() && std::equal(segment_tokens_.begin(), segment_tokens_.end(), hypothesis.begin()))
+    Commit(std::span<const int32_t>{hypothesis}.subspan(segment_tokens_.size(), agreed_count - segment_tokens_.size()));
+  previous_hypothesis_ = std::move(hypothesis);
+}
+
+void WhisperStream::Flush() {
+  pending_frames_.clear();  // Trailing silence
+  if (!frames_.empty())
+    EndSegment(Decode());
+}
+
+std::vector<int32_t> WhisperStream::GetNewTokens() {
+  std::scoped_lock lock{mutex_};
+  std::vector<int32_t> tokens(transcript_.begin() + new_tokens_begin_, transcript_.end());
+  new_tokens_begin_ = transcript_.size();
+  return tokens;
+}
+
+std::vector<int32_t> WhisperStream::GetTranscript() const {
+  std::scoped_lock lock{mutex_};
+  return transcript_;
+}
+
+std::vector<WhisperStream::Segment> WhisperStream::GetSegments() const {
+  std::scoped_lock lock{mutex_};
+  return segments_;
+}
+
+// Runs the encoder on the current segment and decodes it to the end, returns the generated tokens without EOS
+std::vector<int32_t> WhisperStream::Decode() {
+  undecoded_frame_count_ = 0;
+
+  // Decoder prompt is [<|startofprev|> context..., prompt...], the context is limited to half of max_length like Whisper does
+  std::vector<int32_t> input_ids;
+  if (start_of_previous_token_id_ >= 0 && !context_.empty()) {
+    const size_t max_context_length = static_cast<size_t>(params_->search.max_length) / 2 - 1;
+    input_ids.push_back(start_of_previous_token_id_);
+    input_ids.insert(input_ids.end(), context_.end() - std::min(context_.size(), max_context_length), context_.end());
+  }
+  input_ids.insert(input_ids.end(), prompt_tokens_.begin(), prompt_tokens_.end());
+
+  auto& inputs = std::get<GeneratorParams::Whisper>(params_->inputs);
+  inputs.input_features = std::make_shared<Tensor>(CreateInputFeatures());
+  params_->aux_input_ids = cpu_span<int32_t>{input_ids.data(), input_ids.size()};
+  auto generator = CreateGenerator(*model_, *params_);
+  params_->aux_input_ids = {};
+  inputs.input_features.reset();
+
+  while (!generator->IsDone())
+    generator->GenerateNextToken();
+
+  auto sequence = generator->GetSequence(0).CopyDeviceToCpu();
+  std::vector<int32_t> hypothesis(sequence.begin() + std::min(input_ids.size(), sequence.size()), sequence.end());
+  const auto& eos_token_ids = model_->config_->model.eos_token_ids;
+  const int32_t eos_token_id = model_->config_->model.eos_token_id;
+  auto eos = std::find_if(hypothesis.begin(), hypothesis.end(), [&](int32_t token) {
+    return token == eos_token_id || std::find(eos_token_ids.begin(), eos_token_ids.end(), token) != eos_token_ids.end();
+  });
+  hypothesis.erase(eos, hypothesis.end());
+  return hypothesis;
+}
+
+// The encoder only accepts full windows, the frames past the end of the segment are padded with the smallest value
+// seen, which is what log-mel of silence clamps to
+std::unique_ptr<OrtValue> WhisperStream::CreateInputFeatures() const {
+  auto& allocator = Ort::Allocator::GetWithDefaultOptions();
+  const auto shape = std::array<int64_t, 3>{1, static_cast<int64_t>(mel_count_), static_cast<int64_t>(window_frames_)};
+  auto features = OrtValue::CreateTensor<float>(allocator, shape);
+
+  auto data = std::span<float>{features->GetTensorMutableData<float>(), mel_count_ * window_frames_};
+  std::fill(data.begin(), data.end(), *std::min_element(frames_.begin(), frames_.end()));
+  const size_t frame_count = frames_.size() / mel_count_;
+  for (size_t frame = 0; frame < frame_count; frame++)
+    for (size_t mel = 0; mel < mel_count_; mel++)
+      data[mel * window_frames_ + frame] = frames_[frame * mel_count_ + mel];
+
+  if (input_features_type_ == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT)
+    return features;
+
+  std::unique_ptr<OrtValue> features_fp16;
+  Cast(*features, features_fp16, *GetDeviceInterface(DeviceType::CPU), Ort::TypeToTensorType<Ort::Float16_t>);
+  return features_fp16;
+}
+
+void WhisperStream::Commit(std::span<const int32_t> tokens) {
+  segment_tokens_.insert(segment_tokens_.end(), tokens.begin(), tokens.end());
+  std::scoped_lock lock{mutex_};
+  transcript_.insert(transcript_.end(), tokens.begin(), tokens.end());
+}
+
+// The full window's hypothesis is final: whatever follows the committed tokens is committed and becomes context
+void WhisperStream::EndSegment(std::span<const int32_t> hypothesis) {
+  Commit(hypothesis.subspan(std::min(segment_tokens_.size(), hypothesis.size())));
+  {
+    std::scoped_lock lock{mutex_};
+    segments_.push_back({segment_begin_frame_, segment_end_frame_, segment_tokens_});
+  }
+
+  context_.insert(context_.end(), segment_tokens_.begin(), segment_tokens_.end());
+  segment_tokens_.clear();
+  previous_hypothesis_.clear();
+  frames_.clear();
+  undecoded_frame_count_ = 0;
+}
+
+}  // namespace Generators
@@ -0,0 +1,100 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include "span.h"
+
+namespace Generators {
+
+// Transcribes audio that arrives in chunks with a Whisper model. The log-mel frames of the current segment are
+// re-encoded every step_frames frames (the encoder always sees a full, padded window) and decoded from scratch.
+// Tokens are committed once two consecutive hypotheses agree on them, so partial results are stable as they are
+// reported. When a segment fills the window it is committed completely and the next segment starts, with the committed
+// tokens passed to the decoder as previous context after the start_of_previous token.
+// With voice activity detection, long silences end the segment and are never encoded, so the encoder's work scales with
+// the speech in the audio rather than its length. Segment timestamps map the transcript back to the audio.
+struct WhisperStream : LeakChecked<WhisperStream> {
+  // Energy based voice activity detection on the log-mel frames. A frame is silent when its mean is more than
+  // 'silence_threshold' below the loudest frame seen so far (Whisper's features span 2.0, which is 80 dB).
+  struct VoiceActivity {
+    float silence_threshold{1.0f};
+    size_t min_silence_frames{50};  // A longer run of silent frames ends the segment
+    size_t padding_frames{10};      // Silent frames kept before and after speech
+  };
+
+  // A completed segment, frames are counted from the first frame added (Whisper's frames are 10ms)
+  struct Segment {
+    size_t begin_frame{};
+    size_t end_frame{};
+    std::vector<int32_t> tokens;
+  };
+
+  // 'prompt_tokens' are the decoder prompt of every window (e.g. <|startoftranscript|><|en|><|transcribe|><|notimestamps|>).
+  // Context is only carried across segments when start_of_previous_token_id (<|startofprev|>) is not negative.
+  WhisperStream(const Model& model, std::shared_ptr<GeneratorParams> params, std::span<const int32_t> prompt_tokens,
+                int32_t start_of_previous_token_id = -1, size_t step_frames = 100, size_t window_frames = 3000);
+
+  // Appends 'frame_count' log-mel frames, 'features' has the layout [number_of_mels, frame_count].
+  // Decodes on the calling thread whenever another step_frames frames are buffered.
+  void AddFeatures(std::span<const float> features, size_t frame_count);
+
+  // Decodes the buffered frames and commits the whole hypothesis, call once the audio has ended
+  void Flush();
+
+  // Enables voice activity detection for the frames added after this call
+  void SetVoiceActivity(const VoiceActivity& voice_activity) { voice_activity_ = voice_activity; }
+
+  // Returns the tokens committed since the last call. Safe to call while another thread adds features.
+  std::vector<int32_t> GetNewTokens();
+
+  // Returns every token committed so far
+  std::vector<int32_t> GetTranscript() const;
+
+  // Returns the segments completed so far, their tokens make up the transcript
+  std::vector<Segment> GetSegments() const;
+
+  std::shared_ptr<const Model> model_;
+  std::shared_ptr<GeneratorParams> params_;
+  std::shared_ptr<WhisperStream> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
+
+ private:
+  void AddFrame(std::span<const float> frame);
+  void AppendFrame(std::span<const float> frame, size_t frame_index);
+  std::vector<int32_t> Decode();
+  std::unique_ptr<OrtValue> CreateInputFeatures() const;
+  void Commit(std::span<const int32_t> tokens);
+  void EndSegment(std::span<const int32_t> hypothesis);
+
+  const std::vector<int32_t> prompt_tokens_;
+  const int32_t start_of_previous_token_id_;
+  const size_t step_frames_;
+  const size_t window_frames_;
+  ONNXTensorElementDataType input_features_type_;
+
+  size_t mel_count_{};                       // Set by the first AddFeatures
+  std::vector<float> frames_;                // Frames of the current segment, [frame_count, mel_count_]
+  size_t undecoded_frame_count_{};           // Frames added since the last Decode
+  std::vector<int32_t> context_;             // Committed tokens of the previous segments that are passed to the decoder
+  std::vector<int32_t> segment_tokens_;      // Committed tokens of the current segment
+  std::vector<int32_t> previous_hypothesis_;
+  size_t frame_count_{};                     // Frames added so far, the index of the next frame
+  size_t segment_begin_frame_{};
+  size_t segment_end_frame_{};
+
+  std::optional<VoiceActivity> voice_activity_;
+  float loudest_frame_{std::numeric_limits<float>::lowest()};
+  size_t silence_frame_count_{};      // Silent frames since the last speech
+  std::vector<float> pending_frames_;  // Silent frames not yet added to the segment, [frame_count, mel_count_]
+
+  mutable std::mutex mutex_;
+  std::vector<int32_t> transcript_;  // Protected by mutex_
+  std::vector<Segment> segments_;    // Protected by mutex_
+  size_t new_tokens_begin_{};        // Index into transcript_ of the first token not returned by GetNewTokens
+};
+
+}  // namespace Generators
@@ -3,15 +3,23 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <future>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <vector>
 
 namespace Generators {
 
 // A worker thread that performs the work items submitted to it.
 // A work item is something callable with signature `void WorkItem()`.
+// Work items go through a lock-free queue, and the thread spins for a short while before it sleeps, so a work item
+// enqueued shortly after the previous one finished starts without a mutex or a wake-up from the OS.
 class WorkerThread {
  public:
   using Task = std::packaged_task<void()>;
@@ -28,29 +36,20 @@ class WorkerThread {
       return;
     }
 
-    {
-      std::scoped_lock l{sync_state_.m};
-      sync_state_.stop_requested = true;
-    }
-
-    sync_state_.notify_worker_cv.notify_all();
+    stop_requested_ = true;
+    WakeWorker();
 
     thread_.join();
   }
 
-  // Enqueues Task `task` as a work item.
+  // Enqueues Task `task` as a work item. Safe to call from multiple threads.
   // The work item completion can be monitored with `task`'s associated std::future.
   void EnqueueTask(Task&& task) {
-    bool work_queue_was_empty{};
-    {
-      std::scoped_lock l{sync_state_.m};
-      work_queue_was_empty = sync_state_.work_queue.empty();
-      sync_state_.work_queue.push(std::move(task));
+    while (!work_queue_.TryPush(task)) {
+      std::this_thread::yield();  // Full, the worker is busy and will make room
     }
 
-    if (work_queue_was_empty) {
-      sync_state_.notify_worker_cv.notify_one();
-    }
+    WakeWorker();
   }
 
   // Enqueues `fn` as a work item.
@@ -65,44 +64,182 @@ class WorkerThread {
   }
 
  private:
-  struct SynchronizedState {
-    std::mutex m{};
-    std::condition_variable notify_worker_cv{};
+  // Bounded multiple producer, single consumer ring of tasks. Every cell's sequence number says whether it is free for the
+  // producer at that position (sequence == position) or holds a task for the consumer (sequence == position + 1).
+  class TaskQueue {
+   public:
+    TaskQueue() {
+      for (size_t i = 0; i < capacity_; i++) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    // Returns false if the queue is full, `task` is only moved from on success
+    bool TryPush(Task& task) {
+      size_t position = push_position_.load(std::memory_order_relaxed);
+      Cell* cell;
+      while (true) {
+        cell = &cells_[position % capacity_];
+        const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        if (sequence == position) {
+          if (push_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            break;
+          }
+        } else if (sequence < position) {
+          return false;
+        } else {
+          position = push_position_.load(std::memory_order_relaxed);
+        }
+      }
+
+      cell->task = std::move(task);
+      cell->sequence.store(position + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Only called by the worker thread
+    bool TryPop(Task& task) {
+      Cell& cell = cells_[pop_position_ % capacity_];
+      if (cell.sequence.load(std::memory_order_acquire) != pop_position_ + 1) {
+        return false;
+      }
+
+      task = std::move(cell.task);
+      cell.sequence.store(pop_position_ + capacity_, std::memory_order_release);
+      pop_position_++;
+      return true;
+    }
+
+    // Only called by the worker thread
+    bool Empty() const {
+      return cells_[pop_position_ % capacity_].sequence.load(std::memory_order_acquire) != pop_position_ + 1;
+    }
 
-    // Note: The SynchronizedState data members declared below should be accessed while SynchronizedState::m is locked.
+   private:
+    struct Cell {
+      std::atomic<size_t> sequence;
+      Task task;
+    };
 
-    bool stop_requested{false};
-    std::queue<Task> work_queue{};
+    static constexpr size_t capacity_ = 256;
+    std::array<Cell, capacity_> cells_;
+    std::atomic<size_t> push_position_{};
+    size_t pop_position_{};
   };
 
- private:
-  static void WorkerLoop(SynchronizedState& sync_state) {
+  // The worker only takes the mutex to sleep, so producers only need it if the worker is sleeping
+  void WakeWorker() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);  // Pairs with the fence in WorkerLoop
+    if (worker_sleeping_.load(std::memory_order_relaxed)) {
+      { std::scoped_lock l{sleep_mutex_}; }  // The worker is either awake or waiting on the condition variable
+      wake_worker_cv_.notify_one();
+    }
+  }
+
+  void WorkerLoop() {
+    // How long the worker keeps polling for a new work item before it sleeps
+    constexpr auto spin_duration = std::chrono::microseconds(50);
+
+    Task work_item;
     while (true) {
-      std::unique_lock l{sync_state.m};
-      sync_state.notify_worker_cv.wait(l, [&sync_state]() {
-        return sync_state.stop_requested || !sync_state.work_queue.empty();
-      });
+      const auto spin_end = std::chrono::steady_clock::now() + spin_duration;
+      while (!stop_requested_ && work_queue_.Empty() && std::chrono::steady_clock::now() < spin_end) {
+        std::this_thread::yield();
+      }
+
+      if (!stop_requested_ && work_queue_.Empty()) {
+        std::unique_lock l{sleep_mutex_};
+        worker_sleeping_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);  // Either WakeWorker sees the flag or we see its work item
+        wake_worker_cv_.wait(l, [this]() { return stop_requested_ || !work_queue_.Empty(); });
+        worker_sleeping_.store(false, std::memory_order_relaxed);
+      }
 
       // stop?
-      if (sync_state.stop_requested) {
+      if (stop_requested_) {
         break;
       }
 
-      // get work item
-      Task work_item = std::move(sync_state.work_queue.front());
-      sync_state.work_queue.pop();
+      // do work items
+      while (!stop_requested_ && work_queue_.TryPop(work_item)) {
+        work_item();
+      }
+    }
+  }
+
+ private:
+  TaskQueue work_queue_{};
+  std::atomic<bool> stop_requested_{false};
+  std::atomic<bool> worker_sleeping_{false};
+  std::mutex sleep_mutex_{};
+  std::condition_variable wake_worker_cv_{};
 
-      l.unlock();
+  std::thread thread_{&WorkerThread::WorkerLoop, this};
+};
 
-      // do work item
-      work_item();
+// A fixed set of worker threads that stay alive between calls, so parallel loops don't pay for starting threads.
+// Idle threads take the next index of a loop as soon as they finish one, so uneven work items balance out.
+class WorkerThreadPool {
+ public:
+  explicit WorkerThreadPool(size_t num_threads) {
+    for (size_t i = 0; i < num_threads; i++) {
+      workers_.push_back(std::make_unique<WorkerThread>());
     }
   }
 
- private:
-  SynchronizedState sync_state_{};
+  // Calls `fn(index)` for every index in [0, count) on the worker threads and the calling thread.
+  // Returns once every call completed, rethrowing the first exception thrown by `fn`.
+  // A ParallelFor inside of `fn` runs on the calling thread only, waiting on the workers could wait on itself.
+  template <typename Fn>
+  void ParallelFor(size_t count, Fn&& fn) {
+    if (in_parallel_for_) {
+      for (size_t index = 0; index < count; index++) {
+        fn(index);
+      }
+      return;
+    }
+
+    std::atomic<size_t> next_index{};
+    auto run = [&]() {
+      in_parallel_for_ = true;
+      struct Reset {
+        ~Reset() { in_parallel_for_ = false; }
+      } reset;
+      for (size_t index; (index = next_index++) < count;) {
+        fn(index);
+      }
+    };
+
+    std::vector<std::future<void>> futures;
+    for (size_t i = 0; i < workers_.size() && i + 1 < count; i++) {
+      futures.push_back(workers_[i]->Enqueue(run));
+    }
+
+    std::exception_ptr exception;
+    try {
+      run();
+    } catch (...) {
+      exception = std::current_exception();
+    }
+
+    for (auto& future : futures) {
+      try {
+        future.get();
+      } catch (...) {
+        if (!exception) {
+          exception = std::current_exception();
+        }
+      }
+    }
+
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+  }
 
-  std::thread thread_{&WorkerThread::WorkerLoop, std::ref(sync_state_)};
+ private:
+  std::vector<std::unique_ptr<WorkerThread>> workers_;
+  static inline thread_local bool in_parallel_for_{};  // Set while the thread runs a ParallelFor's `fn`
 };
 
 }  // namespace Generators
@@ -1,6 +1,9 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 
+#include <cmath>
+#include <fstream>
+#include <future>
 #include <iostream>
 #include <thread>
 #include <vector>
@@ -25,6 +28,9 @@
 #define PHI2_PATH MODEL_PATH "phi-2/int4/cpu"
 #endif
 #endif
+#ifndef WHISPER_PATH
+#define WHISPER_PATH MODEL_PATH "whisper-tiny/fp32/cpu"
+#endif
 TEST(CAPITests, Config) {
 #if TEST_PHI2
   // Test modifying config settings
@@ -39,6 +45,53 @@ TEST(CAPITests, Config) {
 #endif
 }
 
+TEST(CAPITests, ConfigOverlay) {
+  auto config = OgaConfig::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  config->Overlay(R"({"model": {"decoder": {"session_options": {"intra_op_num_threads": 1}}}, "search": {"max_length": 8}})");
+  EXPECT_THROW(config->Overlay(R"({"search": {"not_a_search_option": 1}})"), std::runtime_error);
+
+  auto model = OgaModel::Create(*config);
+  auto params = OgaGeneratorParams::Create(*model);
+  auto generator = OgaGenerator::Create(*model, *params);
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  while (!generator->IsDone())
+    generator->GenerateNextToken();
+  EXPECT_EQ(generator->GetSequenceCount(0), 8);
+}
+
+TEST(CAPITests, CreateModelAsync) {
+  struct Created {
+    std::promise<void> done;
+    OgaModel* model{};
+    std::string error;
+    std::vector<std::string> steps;
+  } created;
+
+  OgaCheckResult(OgaCreateModelAsync(
+      MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32", nullptr,
+      [](const char* step, void* user_data) { static_cast<Created*>(user_data)->steps.push_back(step); },
+      [](OgaResult* result, OgaModel* model, void* user_data) {
+        auto& created = *static_cast<Created*>(user_data);
+        if (result) {
+          created.error = OgaResultGetError(result);
+          OgaDestroyResult(result);
+        }
+        created.model = model;
+        created.done.set_value();
+      },
+      &created));
+  created.done.get_future().wait();
+
+  ASSERT_TRUE(created.error.empty()) << created.error;
+  std::unique_ptr<OgaModel> model{created.model};
+  EXPECT_FALSE(created.steps.empty());
+
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+  auto generator = OgaGenerator::Create(*model, *params);
+}
+
 TEST(CAPITests, TokenizerCAPI) {
 #if TEST_PHI2
   auto config = OgaConfig::Create(PHI2_PATH);
@@ -69,6 +122,28 @@ TEST(CAPITests, TokenizerCAPI) {
       tokenizer->Encode(string, *sequences);
   }
 
+  // Encode and decode as a batch
+  {
+    auto batch = tokenizer->EncodeBatch(input_strings, std::size(input_strings));
+    auto shape = batch->Shape();
+    ASSERT_EQ(shape.size(), 2);
+    ASSERT_EQ(shape[0], static_cast<int64_t>(std::size(input_strings)));
+    auto* tokens = static_cast<int32_t*>(batch->Data());
+    size_t longest = 0;
+    for (size_t i = 0; i < sequences->Count(); i++) {
+      ASSERT_TRUE(std::equal(sequences->SequenceData(i), sequences->SequenceData(i) + sequences->SequenceCount(i), tokens + i * shape[1]));
+      if (static_cast<int64_t>(sequences->SequenceCount(i)) == shape[1])
+        longest = i;
+    }
+
+    // The longest sequence has no padding, so it decodes back to its input string
+    std::array<int64_t, 1> row_shape{shape[1]};
+    auto row = OgaTensor::Create(tokens + longest * shape[1], row_shape.data(), row_shape.size(), OgaElementType_int32);
+    auto out_strings = tokenizer->DecodeBatch(*row);
+    ASSERT_EQ(out_strings->Count(), 1);
+    ASSERT_STREQ(input_strings[longest], out_strings->Get(0));
+  }
+
   // Decode one at a time
   for (size_t i = 0; i < sequences->Count(); i++) {
     auto out_string = tokenizer->Decode(sequences->SequenceData(i), sequences->SequenceCount(i));
@@ -195,6 +270,7 @@ TEST(CAPITests, EndToEndPhiBatch) {
   while (!generator->IsDone()) {
     generator->GenerateNextToken();
   }
+  EXPECT_TRUE(generator->IsDoneReady());  // IsDone already waited for the device
 
   // Decode The Batch
   for (size_t i = 0; i < 3; i++) {
@@ -220,6 +296,35 @@ TEST(CAPITests, EndToEndPhiBatch) {
 #endif
 }
 
+TEST(CAPITests, BatchGeneratePhi) {
+#if TEST_PHI2 && !USE_DML
+  auto model = OgaModel::Create(PHI2_PATH);
+
+  const char* input_strings[] = {
+      "This is a test.",
+      "The quick brown fox jumps over the lazy dog.",
+      "Rats are awesome pets!",
+  };
+
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 40);
+  params->SetSearchOption("batch_size", 2);
+
+  // Every prompt is reported once, the second batch holds the two shorter prompts
+  std::vector<int> calls(std::size(input_strings));
+  model->BatchGenerate(input_strings, std::size(input_strings), *params, [](size_t index, const int32_t*, size_t token_count, const char* text, void* user_data) {
+        auto& calls = *static_cast<std::vector<int>*>(user_data);
+        ASSERT_LT(index, calls.size());
+        EXPECT_LT(token_count, 40);
+        EXPECT_NE(text, nullptr);
+        calls[index]++;
+      },
+      &calls);
+  for (auto count : calls)
+    EXPECT_EQ(count, 1);
+#endif
+}
+
 TEST(CAPITests, EndToEndPhi) {
 #if TEST_PHI2
   auto model = OgaModel::Create(PHI2_PATH);
@@ -282,6 +387,18 @@ TEST(CAPITests, Tensor_And_AddExtraInput) {
   params->SetModelInput("test_input", *tensor);
 }
 
+TEST(CAPITests, TensorFromDeviceBuffer) {
+  std::array<float, 6> data{0, 1, 2, 3, 4, 5};
+  std::vector<int64_t> shape{2, 3};
+
+  // A "cpu" device buffer is the same as OgaCreateTensorFromBuffer
+  auto tensor = OgaTensor::Create(data.data(), shape.data(), shape.size(), OgaElementType_float32, "cpu");
+  EXPECT_EQ(tensor->Data(), data.data());
+  EXPECT_EQ(tensor->Shape(), shape);
+
+  EXPECT_THROW(OgaTensor::Create(data.data(), shape.data(), shape.size(), OgaElementType_float32, "tpu"), std::runtime_error);
+}
+
 TEST(CAPITests, Logging) {
   // Trivial test to ensure the API builds properly
   Oga::SetLogBool("enabled", true);
@@ -328,6 +445,90 @@ TEST(CAPITests, GreedySearchGptFp32CAPI) {
     EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequence_data, sequence_length * sizeof(int32_t)));
   }
 }
+
+// Greedy search selects the most likely token, so it leads the top log-probabilities of every step
+TEST(CAPITests, TopLogProbsGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+  const int batch_size = 2;
+  const int top_logprobs = 3;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+  params->SetSearchOption("batch_size", batch_size);
+  params->SetSearchOption("top_logprobs", top_logprobs);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  EXPECT_THROW(generator->GetTopLogProbs(), std::runtime_error);
+  while (!generator->IsDone()) {
+    generator->GenerateNextToken();
+    auto next_tokens = generator->GetNextTokens();
+    auto [tokens, logprobs] = generator->GetTopLogProbs();
+    ASSERT_EQ(tokens.size(), batch_size * top_logprobs);
+    for (int i = 0; i < batch_size; i++) {
+      EXPECT_EQ(tokens[i * top_logprobs], next_tokens[i]);
+      for (int j = 0; j < top_logprobs; j++) {
+        EXPECT_LE(logprobs[i * top_logprobs + j], 0.0f);
+        if (j > 0)
+          EXPECT_LE(logprobs[i * top_logprobs + j], logprobs[i * top_logprobs + j - 1]);
+      }
+    }
+  }
+}
+
+// The tokens of GreedySearchGptFp32CAPI, with stop sequences that end each batch entry early
+TEST(CAPITests, StopSequencesGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+  const int batch_size = 2;
+  const int max_length = 10;
+  const int32_t pad_token_id = 98;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+  params->SetSearchOption("batch_size", batch_size);
+  const std::vector<int32_t> stop_204{204}, stop_114_114{114, 114}, stop_195_731{195, 731};  // The last is in the prompt only
+  params->AddStopTokenSequence(stop_204.data(), stop_204.size());
+  params->AddStopTokenSequence(stop_114_114.data(), stop_114_114.size());
+  params->AddStopTokenSequence(stop_195_731.data(), stop_195_731.size());
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  while (!generator->IsDone())
+    generator->GenerateNextToken();
+
+  const std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, pad_token_id, pad_token_id,
+      0, 0, 195, 731, 731, 114, 114};
+  const size_t expected_length = expected_output.size() / batch_size;
+  for (int i = 0; i < batch_size; i++) {
+    ASSERT_EQ(generator->GetSequenceCount(i), expected_length);
+    EXPECT_TRUE(0 == std::memcmp(&expected_output[i * expected_length], generator->GetSequenceData(i), expected_length * sizeof(int32_t)));
+  }
+
+  // A stop string matches the generated text, the first generated token of the first entry ends with this one
+  auto tokenizer = OgaTokenizer::Create(*model);
+  const int32_t token_204 = 204;
+  auto stop_string = tokenizer->Decode(&token_204, 1);
+  ASSERT_NE(stop_string[0], '\0');
+
+  auto string_params = OgaGeneratorParams::Create(*model);
+  string_params->SetSearchOption("max_length", max_length);
+  string_params->SetSearchOption("batch_size", batch_size);
+  string_params->AddStopString(stop_string);
+  generator = OgaGenerator::Create(*model, *string_params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  for (int step = 0; step < 3; step++)
+    generator->GenerateNextToken();
+  const auto* sequence = generator->GetSequenceData(0);
+  EXPECT_EQ(sequence[4], 204);
+  EXPECT_EQ(sequence[5], pad_token_id);
+  EXPECT_EQ(sequence[6], pad_token_id);
+
+  EXPECT_THROW(string_params->AddStopString(""), std::runtime_error);
+  EXPECT_THROW(string_params->AddStopTokenSequence(nullptr, 0), std::runtime_error);
+}
 #endif
 
 TEST(CAPITests, GetOutputCAPI) {
@@ -465,6 +666,47 @@ TEST(CAPITests, SetLogitsCAPI) {
   }
 }
 
+TEST(CAPITests, SetAllowedTokensAndLogitsBiasCAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+  const int batch_size = 2;
+  const int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+  params->SetSearchOption("batch_size", batch_size);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+
+  // Only the labels can be selected
+  const std::vector<int32_t> labels{17, 401, 923};
+  generator->SetAllowedTokens(labels.data(), labels.size());
+  for (int step = 0; step < 3; step++) {
+    generator->GenerateNextToken();
+    for (int32_t token : generator->GetNextTokens())
+      EXPECT_NE(std::find(labels.begin(), labels.end(), token), labels.end());
+  }
+
+  // A large bias picks its token among them, and the bias stays until it's replaced
+  const int32_t biased_token = 401;
+  const float bias = 1000.0f;
+  generator->SetLogitsBias(&biased_token, &bias, 1);
+  generator->GenerateNextToken();
+  for (int32_t token : generator->GetNextTokens())
+    EXPECT_EQ(token, biased_token);
+
+  generator->SetAllowedTokens(nullptr, 0);
+  generator->GenerateNextToken();
+  for (int32_t token : generator->GetNextTokens())
+    EXPECT_EQ(token, biased_token);
+
+  const int32_t outside_token = 1000;
+  EXPECT_THROW(generator->SetAllowedTokens(&outside_token, 1), std::runtime_error);
+  EXPECT_THROW(generator->SetLogitsBias(&outside_token, &bias, 1), std::runtime_error);
+}
+
 TEST(CAPITests, SetTerminate) {
 #if TEST_PHI2
 
@@ -512,6 +754,43 @@ TEST(CAPITests, SetTerminate) {
 #endif
 }
 
+// ragged_prefill runs the padded prompts one by one, the greedy outputs don't change
+#if TEST_PHI2 && !USE_DML
+TEST(CAPITests, RaggedPrefillPhi2) {
+  auto model = OgaModel::Create(PHI2_PATH);
+  auto tokenizer = OgaTokenizer::Create(*model);
+
+  const char* input_strings[] = {
+      "This is a test.",
+      "Rats are awesome pets!",
+      "The quick brown fox jumps over the lazy dog.",
+  };
+  auto input_sequences = OgaSequences::Create();
+  for (auto& string : input_strings)
+    tokenizer->Encode(string, *input_sequences);
+
+  auto generate = [&](bool ragged_prefill) {
+    auto params = OgaGeneratorParams::Create(*model);
+    params->SetSearchOption("max_length", 20);
+    params->SetSearchOption("batch_size", 3);
+    params->SetSearchOptionBool("ragged_prefill", ragged_prefill);
+    auto generator = OgaGenerator::Create(*model, *params);
+    generator->AppendTokenSequences(*input_sequences);
+    while (!generator->IsDone())
+      generator->GenerateNextToken();
+
+    std::vector<std::vector<int32_t>> sequences;
+    for (size_t i = 0; i < 3; i++) {
+      const auto* data = generator->GetSequenceData(i);
+      sequences.emplace_back(data, data + generator->GetSequenceCount(i));
+    }
+    return sequences;
+  };
+
+  EXPECT_EQ(generate(false), generate(true));
+}
+#endif
+
 // DML Doesn't support batch_size > 1
 #if TEST_PHI2 && !USE_DML
 
@@ -721,6 +1000,92 @@ TEST(CAPITests, AdaptersTestMultipleAdapters) {
 #endif
 }
 
+TEST(CAPITests, AdaptersTestMemoryLimit) {
+#if TEST_PHI2
+  // The python unit tests create the adapter model.
+  // In order to run this test, the python unit test must have been run first.
+  auto model = OgaModel::Create(MODEL_PATH "multiple_adapters");
+  auto adapters = OgaAdapters::Create(*model);
+
+  // Room for a single adapter
+  adapters->LoadAdapter(MODEL_PATH "multiple_adapters/adapter_0.onnx_adapter", "adapter_a");
+  const size_t adapter_size = adapters->GetMemoryUsage();
+  ASSERT_GT(adapter_size, 0);
+  adapters->SetMemoryLimit(adapter_size);
+  adapters->LoadAdapter(MODEL_PATH "multiple_adapters/adapter_1.onnx_adapter", "adapter_b");
+  ASSERT_EQ(adapters->GetMemoryUsage(), adapter_size);  // adapter_b doesn't fit, it's loaded on first use
+
+  auto tokenizer = OgaTokenizer::Create(*model);
+  auto input_sequences = OgaSequences::Create();
+  tokenizer->Encode("This is a test.", *input_sequences);
+
+  for (const char* adapter_name : {"adapter_b", "adapter_a", "adapter_b"}) {
+    auto params = OgaGeneratorParams::Create(*model);
+    params->SetSearchOption("max_length", 20);
+
+    auto generator = OgaGenerator::Create(*model, *params);
+    generator->SetActiveAdapter(*adapters, adapter_name);  // Evicts the other adapter, which is no longer in use
+    generator->AppendTokenSequences(*input_sequences);
+    while (!generator->IsDone()) {
+      generator->GenerateNextToken();
+    }
+    ASSERT_LE(adapters->GetMemoryUsage(), adapter_size + adapter_size);
+  }
+  ASSERT_LE(adapters->GetMemoryUsage(), adapter_size);
+
+  // An adapter in use can't be evicted, so both are resident while two generators hold them
+  {
+    auto params = OgaGeneratorParams::Create(*model);
+    params->SetSearchOption("max_length", 20);
+    auto generator_a = OgaGenerator::Create(*model, *params);
+    auto generator_b = OgaGenerator::Create(*model, *params);
+    generator_a->SetActiveAdapter(*adapters, "adapter_a");
+    generator_b->SetActiveAdapter(*adapters, "adapter_b");
+    ASSERT_GT(adapters->GetMemoryUsage(), adapter_size);
+  }
+  ASSERT_LE(adapters->GetMemoryUsage(), adapter_size);
+
+  adapters->UnloadAdapter("adapter_a");
+  adapters->UnloadAdapter("adapter_b");
+  ASSERT_EQ(adapters->GetMemoryUsage(), 0);
+#endif
+}
+
+TEST(CAPITests, AdaptersTestPrefetch) {
+#if TEST_PHI2
+  // The python unit tests create the adapter model.
+  // In order to run this test, the python unit test must have been run first.
+  auto model = OgaModel::Create(MODEL_PATH "multiple_adapters");
+  auto adapters = OgaAdapters::Create(*model);
+  adapters->SetMemoryLimit(1);  // Nothing fits, adapters are only loaded when used or prefetched
+  adapters->LoadAdapter(MODEL_PATH "multiple_adapters/adapter_0.onnx_adapter", "adapter_a");
+  adapters->LoadAdapter(MODEL_PATH "multiple_adapters/adapter_1.onnx_adapter", "adapter_b");
+  ASSERT_FALSE(adapters->IsAdapterReady("adapter_a"));
+  ASSERT_EQ(adapters->GetMemoryUsage(), 0);
+
+  adapters->PrefetchAdapter("adapter_a");
+  while (!adapters->IsAdapterReady("adapter_a"))
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  // The prefetched adapter is pinned until it is used, so using (and releasing) another adapter doesn't evict it
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 20);
+  {
+    auto generator = OgaGenerator::Create(*model, *params);
+    generator->SetActiveAdapter(*adapters, "adapter_b");
+  }
+  ASSERT_TRUE(adapters->IsAdapterReady("adapter_a"));
+  ASSERT_FALSE(adapters->IsAdapterReady("adapter_b"));
+
+  {
+    auto generator = OgaGenerator::Create(*model, *params);
+    generator->SetActiveAdapter(*adapters, "adapter_a");
+  }
+  ASSERT_FALSE(adapters->IsAdapterReady("adapter_a"));  // No longer pinned or in use, so it's over the limit
+  ASSERT_EQ(adapters->GetMemoryUsage(), 0);
+#endif
+}
+
 void CheckResult(OgaResult* result) {
   if (result) {
     std::string string = OgaResultGetError(result);
@@ -847,3 +1212,817 @@ TEST(CAPITests, RewindGptFp32CAPI) {
   expected_output_start = &expected_output[0];
   EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequence_data, sequence_length * sizeof(int32_t)));
 }
+
+TEST(CAPITests, SetTokensGptFp32CAPI) {
+  std::vector<int32_t> expected_output{
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+  int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+
+  // The prompt as it's typed, including a token that is taken back
+  std::vector<int32_t> partial_ids{0, 0, 52};
+  generator->SetTokens(partial_ids.data(), partial_ids.size());
+  std::vector<int32_t> shorter_ids{0, 0};
+  generator->SetTokens(shorter_ids.data(), shorter_ids.size());
+  EXPECT_EQ(generator->GetSequenceCount(0), 2);
+
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+  generator->SetTokens(input_ids.data(), input_ids.size());
+  generator->SetTokens(input_ids.data(), input_ids.size());  // Nothing changed
+  while (!generator->IsDone()) {
+    generator->GenerateNextToken();
+  }
+
+  auto sequence_length = generator->GetSequenceCount(0);
+  auto* sequence_data = generator->GetSequenceData(0);
+  ASSERT_LE(sequence_length, max_length);
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence_data, sequence_length * sizeof(int32_t)));
+}
+
+TEST(CAPITests, OffloadKeyValueCacheGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  generator->GenerateNextToken();
+  generator->GenerateNextToken();
+
+  // Offload to host memory, then to a file, and continue generating from where it stopped
+  generator->OffloadKeyValueCache();
+  generator->GenerateNextToken();
+
+  const char* offload_path = "offloaded_kv_cache.bin";
+  generator->OffloadKeyValueCache(offload_path);
+  generator->RestoreKeyValueCache();
+  std::remove(offload_path);
+
+  while (!generator->IsDone()) {
+    generator->GenerateNextToken();
+  }
+
+  auto sequence_length = generator->GetSequenceCount(0);
+  auto* sequence_data = generator->GetSequenceData(0);
+
+  ASSERT_LE(sequence_length, max_length);
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence_data, sequence_length * sizeof(int32_t)));
+}
+
+TEST(CAPITests, ForkGeneratorGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  generator->GenerateNextToken();
+  generator->GenerateNextToken();
+
+  // Both generators continue from the forked sequence on their own, so greedy search gives them the same result
+  auto fork = generator->Fork();
+  ASSERT_EQ(fork->GetSequenceCount(0), generator->GetSequenceCount(0));
+
+  for (auto* g : {generator.get(), fork.get()}) {
+    while (!g->IsDone()) {
+      g->GenerateNextToken();
+    }
+
+    auto sequence_length = g->GetSequenceCount(0);
+    auto* sequence_data = g->GetSequenceData(0);
+
+    ASSERT_LE(sequence_length, max_length);
+    EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence_data, sequence_length * sizeof(int32_t)));
+  }
+}
+
+TEST(CAPITests, EngineGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      731, 114, 114, 114, 114, 114};
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+
+  auto engine = OgaEngine::Create(*model, 2);
+  std::vector<std::unique_ptr<OgaRequest>> requests;
+  for (int i = 0; i < 2; i++) {
+    requests.push_back(OgaRequest::Create(*params));
+    requests.back()->AddTokens(input_ids.data(), input_ids.size());
+    engine->AddRequest(*requests.back());
+  }
+
+  // Both requests run in the same steps and stream their generated tokens
+  std::vector<std::vector<int32_t>> generated(requests.size());
+  while (engine->HasPendingRequests()) {
+    engine->Step();
+    for (size_t i = 0; i < requests.size(); i++) {
+      auto tokens = requests[i]->GetUnseenTokens();
+      generated[i].insert(generated[i].end(), tokens->SequenceData(0), tokens->SequenceData(0) + tokens->SequenceCount(0));
+    }
+  }
+
+  for (size_t i = 0; i < requests.size(); i++) {
+    EXPECT_TRUE(requests[i]->IsDone());
+    EXPECT_EQ(generated[i], expected_output);
+  }
+}
+
+TEST(CAPITests, EmbedRequiresHiddenStatesCAPI) {
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto sequences = OgaSequences::Create();
+  std::vector<int32_t> tokens{0, 0, 195, 731};
+  sequences->Append(tokens.data(), tokens.size());
+
+  // The test model has no hidden_states output
+  EXPECT_THROW(model->Embed(*sequences, "mean"), std::runtime_error);
+}
+
+TEST(CAPITests, ScoreSequencesUnsupportedModelCAPI) {
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto prompts = OgaSequences::Create();
+  auto continuations = OgaSequences::Create();
+  std::vector<int32_t> prompt{0, 0, 195, 731};
+  std::vector<int32_t> continuation{731, 114};
+  prompts->Append(prompt.data(), prompt.size());
+  continuations->Append(continuation.data(), continuation.size());
+
+  // Scoring runs the decoder-only models, the test model is a GPT-2 model
+  EXPECT_THROW(model->ScoreSequences(*prompts, *continuations), std::runtime_error);
+}
+
+TEST(CAPITests, SaveStateGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  generator->GenerateNextToken();
+  generator->GenerateNextToken();
+
+  const char* state_path = "generator_state.bin";
+  generator->SaveState(state_path);
+  generator.reset();
+
+  // A new generator continues where the saved one stopped
+  auto loaded = OgaGenerator::Create(*model, *params);
+  loaded->LoadState(state_path);
+  std::remove(state_path);
+  ASSERT_EQ(loaded->GetSequenceCount(0), 6);
+
+  while (!loaded->IsDone()) {
+    loaded->GenerateNextToken();
+  }
+
+  auto sequence_length = loaded->GetSequenceCount(0);
+  auto* sequence_data = loaded->GetSequenceData(0);
+
+  ASSERT_LE(sequence_length, max_length);
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence_data, sequence_length * sizeof(int32_t)));
+}
+
+TEST(CAPITests, SaveStateToBufferGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+
+  // The prompt is run by one generator and decoded by another
+  auto prefill = OgaGenerator::Create(*model, *params);
+  prefill->AppendTokens(input_ids.data(), input_ids.size());
+  prefill->GenerateNextToken();
+  auto state = prefill->SaveStateToBuffer();
+  auto quantized_state = prefill->SaveStateToBuffer(true);
+  EXPECT_LT(quantized_state->Shape()[0], state->Shape()[0]);
+  prefill.reset();
+
+  // The logits of the first decoded token are computed from the loaded key-value cache
+  std::vector<std::vector<float>> first_logits;
+  for (auto* snapshot : {state.get(), quantized_state.get()}) {
+    auto decode = OgaGenerator::Create(*model, *params);
+    decode->LoadStateFromBuffer(static_cast<const uint8_t*>(snapshot->Data()), static_cast<size_t>(snapshot->Shape()[0]));
+    ASSERT_EQ(decode->GetSequenceCount(0), 5);
+
+    auto logits = decode->GetLogitsData();
+    first_logits.emplace_back(logits.begin(), logits.end());
+    while (!decode->IsDone()) {
+      decode->GenerateNextToken();
+    }
+
+    // Only the exact cache has to match the tokens of an uninterrupted generation
+    auto sequence_length = decode->GetSequenceCount(0);
+    ASSERT_LE(sequence_length, max_length);
+    if (snapshot == state.get())
+      EXPECT_TRUE(0 == std::memcmp(expected_output.data(), decode->GetSequenceData(0), sequence_length * sizeof(int32_t)));
+  }
+
+  // The int8 cache is approximate, its dequantized values give logits close to the exact cache's
+  ASSERT_EQ(first_logits[0].size(), first_logits[1].size());
+  float max_logit = 0.0f;
+  for (float logit : first_logits[0])
+    max_logit = std::max(max_logit, std::abs(logit));
+  ASSERT_GT(max_logit, 0.0f);
+  for (size_t i = 0; i < first_logits[0].size(); i++)
+    EXPECT_NEAR(first_logits[0][i], first_logits[1][i], 0.05f * max_logit) << i;
+}
+
+TEST(CAPITests, AppendStateGptFp32CAPI) {
+  std::vector<int32_t> first_document{0, 0};
+  std::vector<int32_t> second_document{195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+
+  // Each document is prefilled once by its own generator
+  const char* first_path = "first_document.bin";
+  auto prefill = OgaGenerator::Create(*model, *params);
+  prefill->AppendTokens(first_document.data(), first_document.size());
+  prefill->SaveState(first_path);
+  prefill = OgaGenerator::Create(*model, *params);
+  prefill->AppendTokens(second_document.data(), second_document.size());
+  auto second_state = prefill->SaveStateToBuffer();
+  prefill.reset();
+
+  // gpt2 has no rotary_embedding, so the second document is run after the first rather than re-encoded, which makes the
+  // sequence the same as an uninterrupted generation
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendState(first_path);
+  std::remove(first_path);
+  ASSERT_EQ(generator->GetSequenceCount(0), 2);
+  generator->AppendStateFromBuffer(static_cast<const uint8_t*>(second_state->Data()), static_cast<size_t>(second_state->Shape()[0]));
+  ASSERT_EQ(generator->GetSequenceCount(0), 4);
+
+  while (!generator->IsDone()) {
+    generator->GenerateNextToken();
+  }
+
+  auto sequence_length = generator->GetSequenceCount(0);
+  auto* sequence_data = generator->GetSequenceData(0);
+
+  ASSERT_LE(sequence_length, max_length);
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence_data, sequence_length * sizeof(int32_t)));
+}
+
+TEST(CAPITests, AttentionSinksGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+  params->SetSearchOption("attention_sinks", 2);
+  params->SetSearchOption("attention_sink_window", 3);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+
+  // Generation goes on past max_length, every eviction keeps the 2 sinks and the last 3 tokens
+  int evictions = 0;
+  for (int i = 0; i < 20; i++) {
+    const auto* data = generator->GetSequenceData(0);
+    std::vector<int32_t> previous{data, data + generator->GetSequenceCount(0)};
+    generator->GenerateNextToken();
+    ASSERT_FALSE(generator->IsDone());
+
+    const auto length = generator->GetSequenceCount(0);
+    const auto* sequence = generator->GetSequenceData(0);
+    ASSERT_LT(length, 10);
+    EXPECT_EQ(sequence[0], input_ids[0]);
+    EXPECT_EQ(sequence[1], input_ids[1]);
+    if (length < previous.size()) {
+      evictions++;
+      ASSERT_EQ(length, 2 + 3 + 1);
+      EXPECT_TRUE(0 == std::memcmp(previous.data() + previous.size() - 3, sequence + 2, 3 * sizeof(int32_t)));
+    }
+  }
+  EXPECT_GE(evictions, 4);
+}
+
+TEST(CAPITests, ChunkedPrefillGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+  params->SetSearchOption("prefill_chunk_size", 3);  // The prompt runs as a 3 token and a 1 token chunk
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  while (!generator->IsDone()) {
+    generator->GenerateNextToken();
+  }
+
+  auto sequence_length = generator->GetSequenceCount(0);
+  auto* sequence_data = generator->GetSequenceData(0);
+
+  ASSERT_LE(sequence_length, max_length);
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence_data, sequence_length * sizeof(int32_t)));
+}
+
+TEST(CAPITests, SpeculativeDecodingGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  int max_length = 10;
+
+  // The model is its own draft, so every draft token is accepted and the output matches plain greedy search
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto draft_model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+  params->SetDraftModel(*draft_model, 3);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  while (!generator->IsDone()) {
+    generator->GenerateNextToken();
+  }
+
+  auto sequence_length = generator->GetSequenceCount(0);
+  auto* sequence_data = generator->GetSequenceData(0);
+
+  ASSERT_EQ(sequence_length, max_length);
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence_data, sequence_length * sizeof(int32_t)));
+
+  // Rewinding in the middle of a round falls back to the regular path and resumes speculating afterwards
+  generator->RewindTo(6);
+  while (!generator->IsDone()) {
+    generator->GenerateNextToken();
+  }
+
+  sequence_length = generator->GetSequenceCount(0);
+  sequence_data = generator->GetSequenceData(0);
+  ASSERT_EQ(sequence_length, max_length);
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence_data, sequence_length * sizeof(int32_t)));
+}
+
+TEST(CAPITests, SpeculativeDecodingMismatchedDraftGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  int max_length = 10;
+
+  // The drafts' own search options make them disagree with the model: one never proposes the token the model repeats,
+  // the other proposes it until that would repeat a bigram. The rejected tokens must not change the greedy output.
+  const char* draft_overlays[] = {
+      R"({"search": {"logit_bias": {"114": -1000.0}}})",
+      R"({"search": {"no_repeat_ngram_size": 2}})"};
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  for (const char* draft_overlay : draft_overlays) {
+    auto draft_config = OgaConfig::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+    draft_config->Overlay(draft_overlay);
+    auto draft_model = OgaModel::Create(*draft_config);
+    auto params = OgaGeneratorParams::Create(*model);
+    params->SetSearchOption("max_length", max_length);
+    params->SetDraftModel(*draft_model, 3);
+
+    auto generator = OgaGenerator::Create(*model, *params);
+    generator->AppendTokens(input_ids.data(), input_ids.size());
+    while (!generator->IsDone()) {
+      generator->GenerateNextToken();
+    }
+
+    auto sequence_length = generator->GetSequenceCount(0);
+    auto* sequence_data = generator->GetSequenceData(0);
+    ASSERT_EQ(sequence_length, max_length);
+    EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence_data, sequence_length * sizeof(int32_t)));
+  }
+}
+
+TEST(CAPITests, PromptLookupDecodingGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  int max_length = 10;
+
+  // The repeated tokens are predicted from earlier n-grams, rejected predictions must not change the output
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+  params->SetSearchOption("prompt_lookup_num_tokens", 3);
+  params->SetSearchOption("prompt_lookup_ngram_size", 2);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  while (!generator->IsDone()) {
+    generator->GenerateNextToken();
+  }
+
+  auto sequence_length = generator->GetSequenceCount(0);
+  auto* sequence_data = generator->GetSequenceData(0);
+
+  ASSERT_EQ(sequence_length, max_length);
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence_data, sequence_length * sizeof(int32_t)));
+}
+
+TEST(CAPITests, GenerateTokensGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+
+  // The loop stops at max_length, before max_new_tokens steps. The callback gets two steps per call.
+  std::vector<int32_t> tokens(20);
+  std::vector<int32_t> streamed_tokens;
+  OgaGenerateTokensCallback callback = [](const int32_t* new_tokens, size_t token_count, void* user_data) {
+    auto& streamed = *reinterpret_cast<std::vector<int32_t>*>(user_data);
+    EXPECT_EQ(token_count, 2);
+    streamed.insert(streamed.end(), new_tokens, new_tokens + token_count);
+    return true;
+  };
+  auto count = generator->GenerateTokens(tokens.size(), tokens.data(), 2, callback, &streamed_tokens);
+
+  ASSERT_EQ(count, max_length - input_ids.size());
+  EXPECT_TRUE(generator->IsDone());
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data() + input_ids.size(), tokens.data(), count * sizeof(int32_t)));
+  EXPECT_TRUE(std::equal(streamed_tokens.begin(), streamed_tokens.end(), tokens.begin(), tokens.begin() + count));
+
+  auto sequence_length = generator->GetSequenceCount(0);
+  auto* sequence_data = generator->GetSequenceData(0);
+  ASSERT_EQ(sequence_length, max_length);
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence_data, sequence_length * sizeof(int32_t)));
+}
+
+TEST(CAPITests, GeneratorMetricsGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+  int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  while (!generator->IsDone())
+    generator->GenerateNextToken();
+
+  std::string metrics{generator->GetMetrics()};
+  EXPECT_NE(metrics.find("\"prefill\":{\"calls\":1,\"tokens\":4,"), std::string::npos) << metrics;
+  EXPECT_NE(metrics.find("\"decode\":{\"calls\":6,\"tokens\":6,"), std::string::npos) << metrics;
+  EXPECT_NE(metrics.find("\"session_run_seconds\":"), std::string::npos) << metrics;
+
+  generator->ResetMetrics();
+  metrics = generator->GetMetrics();
+  EXPECT_NE(metrics.find("\"decode\":{\"calls\":0,\"tokens\":0,"), std::string::npos) << metrics;
+}
+
+TEST(CAPITests, MetricsSinkGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  std::map<std::string, std::pair<OgaMetricType, std::vector<double>>> values;
+  auto sink = [](const char* name, OgaMetricType type, double value, void* user_data) {
+    auto& entry = (*static_cast<decltype(values)*>(user_data))[name];
+    entry.first = type;
+    entry.second.push_back(value);
+  };
+  Oga::SetMetricsSink(sink, &values);
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  while (!generator->IsDone())
+    generator->GenerateNextToken();
+  Oga::SetMetricsSink(nullptr, nullptr);
+
+  EXPECT_EQ(values["oga_prompt_tokens_total"].second, std::vector<double>{4});
+  EXPECT_EQ(values["oga_generated_tokens_total"].second.size(), 6);
+  EXPECT_EQ(values["oga_time_to_first_token_seconds"].first, OgaMetricType_Histogram);
+  EXPECT_EQ(values["oga_time_to_first_token_seconds"].second.size(), 1);
+  EXPECT_EQ(values["oga_inter_token_latency_seconds"].second.size(), 5);
+  EXPECT_GT(values["oga_kv_cache_bytes"].second.back(), 0);
+
+  // Nothing is reported once the sink is removed
+  generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  EXPECT_EQ(values["oga_prompt_tokens_total"].second.size(), 1);
+}
+
+TEST(CAPITests, TokenizerCacheGptFp32CAPI) {
+  std::map<std::string, std::vector<double>> values;
+  auto sink = [](const char* name, OgaMetricType type, double value, void* user_data) {
+    (*static_cast<decltype(values)*>(user_data))[name].push_back(value);
+  };
+  auto count = [&values](const char* name) { return values[name].size(); };
+
+  auto uncached_model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto uncached_tokenizer = OgaTokenizer::Create(*uncached_model);
+  auto config = OgaConfig::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  config->Overlay(R"({"model": {"tokenizer_cache_size": 2}})");
+  auto model = OgaModel::Create(*config);
+  auto tokenizer = OgaTokenizer::Create(*model);
+
+  // Encodes 'text' with the cached tokenizer, the tokens have to match the uncached ones whether they come from the cache
+  // or not
+  auto encode = [&](const char* text) {
+    auto expected = OgaSequences::Create();
+    uncached_tokenizer->Encode(text, *expected);
+    auto sequences = OgaSequences::Create();
+    tokenizer->Encode(text, *sequences);
+    EXPECT_EQ(std::vector<int32_t>(sequences->Get(0).begin(), sequences->Get(0).end()),
+              std::vector<int32_t>(expected->Get(0).begin(), expected->Get(0).end()))
+        << text;
+  };
+
+  Oga::SetMetricsSink(sink, &values);
+  encode("The quick brown fox");
+  encode("jumps over");
+  EXPECT_EQ(count("oga_tokenizer_cache_misses_total"), 2);
+  EXPECT_EQ(count("oga_tokenizer_cache_hits_total"), 0);
+
+  // A repeated text is a hit and becomes the most recently used
+  encode("The quick brown fox");
+  EXPECT_EQ(count("oga_tokenizer_cache_hits_total"), 1);
+
+  // At capacity a new text evicts the least recently used one, so "jumps over" is a miss again and evicts the first text
+  encode("the lazy dog");
+  encode("jumps over");
+  encode("The quick brown fox");
+  EXPECT_EQ(count("oga_tokenizer_cache_misses_total"), 5);
+  EXPECT_EQ(count("oga_tokenizer_cache_hits_total"), 1);
+
+  // The uncached tokenizer reports nothing
+  auto sequences = OgaSequences::Create();
+  uncached_tokenizer->Encode("The quick brown fox", *sequences);
+  Oga::SetMetricsSink(nullptr, nullptr);
+  EXPECT_EQ(count("oga_tokenizer_cache_misses_total") + count("oga_tokenizer_cache_hits_total"), 6);
+}
+
+TEST(CAPITests, TokenizerEncodeSegmentsGptFp32CAPI) {
+  auto config = OgaConfig::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  config->Overlay(R"({"model": {"tokenizer_cache_size": 4}})");
+  auto model = OgaModel::Create(*config);
+  auto tokenizer = OgaTokenizer::Create(*model);
+  auto& generators_tokenizer = *reinterpret_cast<const Generators::Tokenizer*>(tokenizer.get());
+
+  // Segments split where the tokenizer doesn't merge across encode to the tokens of the whole text, also when the
+  // repeated segments come from the cache
+  const std::vector<std::string> segments{"The quick brown fox", " jumps over", " the lazy dog.", " jumps over"};
+  std::string text;
+  for (auto& segment : segments)
+    text += segment;
+  auto expected = OgaSequences::Create();
+  tokenizer->Encode(text.c_str(), *expected);
+  const std::vector<int32_t> expected_tokens(expected->Get(0).begin(), expected->Get(0).end());
+
+  EXPECT_EQ(generators_tokenizer.EncodeSegments(segments), expected_tokens);
+  EXPECT_EQ(generators_tokenizer.EncodeSegments(segments), expected_tokens);
+}
+
+TEST(CAPITests, MemoryUsageGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  auto get_bytes = [](const std::string& json, const std::string& name) {
+    auto position = json.find("\"" + name + "_bytes\":");
+    EXPECT_NE(position, std::string::npos) << json;
+    return std::stoull(json.substr(position + name.size() + 9));
+  };
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  generator->GenerateNextToken();
+
+  std::string generator_usage{generator->GetMemoryUsage()};
+  EXPECT_GT(get_bytes(generator_usage, "kv_cache"), 0) << generator_usage;
+  EXPECT_GT(get_bytes(generator_usage, "logits"), 0) << generator_usage;
+  EXPECT_GT(get_bytes(generator_usage, "buffers"), 0) << generator_usage;
+  EXPECT_GE(get_bytes(generator_usage, "peak"), get_bytes(generator_usage, "total")) << generator_usage;
+
+  // The only generator, so the model's counters are the generator's
+  std::string model_usage{model->GetMemoryUsage()};
+  EXPECT_EQ(get_bytes(model_usage, "total"), get_bytes(generator_usage, "total")) << model_usage;
+  EXPECT_EQ(get_bytes(model_usage, "paged_kv_cache_pool"), 0) << model_usage;
+
+  generator.reset();
+  model_usage = model->GetMemoryUsage();
+  EXPECT_EQ(get_bytes(model_usage, "total"), 0) << model_usage;
+  EXPECT_GT(get_bytes(model_usage, "peak"), 0) << model_usage;
+
+  model->ReleaseCachedMemory();
+  model_usage = model->GetMemoryUsage();
+  EXPECT_EQ(get_bytes(model_usage, "device_arena_cached"), 0) << model_usage;
+  EXPECT_EQ(get_bytes(model_usage, "device_pool_cached"), 0) << model_usage;
+}
+
+TEST(CAPITests, TraceGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+  const char* trace_filename = "trace_gpt_fp32.json";
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+
+  Oga::SetLogString("trace_filename", trace_filename);
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  generator->GenerateNextToken();
+  Oga::SetLogString("trace_filename", "");  // Writes the trace
+
+  std::ifstream file{trace_filename};
+  std::string trace{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+  EXPECT_EQ(trace.rfind("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", 0), 0);
+  EXPECT_NE(trace.find("\"name\":\"prefill\""), std::string::npos);
+  EXPECT_NE(trace.find("\"name\":\"decode\""), std::string::npos);
+  EXPECT_NE(trace.find("\"name\":\"session_run\""), std::string::npos);
+  file.close();
+  std::remove(trace_filename);
+}
+
+TEST(CAPITests, GeneratorProfilingGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  const auto profile_filename = "profile_gpt_fp32_" + std::to_string(reinterpret_cast<Generators::Generator*>(generator.get())->id_) + ".json";
+  generator->SetRuntimeOption("enable_profiling", "profile_gpt_fp32");
+  generator->AppendTokens(input_ids.data(), input_ids.size());
+  generator->GenerateNextToken();
+  generator->SetRuntimeOption("enable_profiling", "0");  // Writes the profile
+  generator->GenerateNextToken();
+
+  std::ifstream file{profile_filename};
+  std::string profile{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+  EXPECT_EQ(profile.rfind("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", 0), 0);
+  EXPECT_NE(profile.find("\"name\":\"prefill\""), std::string::npos);
+  EXPECT_NE(profile.find("\"name\":\"session_run\""), std::string::npos);
+  // One decode call was profiled
+  const auto decode = profile.find("\"name\":\"decode\"");
+  EXPECT_NE(decode, std::string::npos);
+  EXPECT_EQ(profile.find("\"name\":\"decode\"", decode + 1), std::string::npos);
+  file.close();
+  std::remove(profile_filename.c_str());
+}
+
+#if TEST_WHISPER
+// <|startoftranscript|><|en|><|transcribe|><|notimestamps|> of the multilingual Whisper vocabulary
+static const std::vector<int32_t> whisper_prompt_tokens{50258, 50259, 50359, 50363};
+
+// Log-mel frames [mel_count, frame_count] of a tone that changes over time, in the value range of Whisper's features
+static std::vector<float> CreateWhisperFeatures(size_t mel_count, size_t frame_count) {
+  std::vector<float> features(mel_count * frame_count);
+  for (size_t mel = 0; mel < mel_count; mel++)
+    for (size_t frame = 0; frame < frame_count; frame++)
+      features[mel * frame_count + frame] = 0.5f * std::sin(0.05f * frame + 0.3f * mel) - 0.25f;
+  return features;
+}
+
+// The frames [begin, begin + count) of 'features' with the same layout
+static std::vector<float> GetWhisperFrames(std::span<const float> features, size_t frame_count, size_t begin, size_t count) {
+  const size_t mel_count = features.size() / frame_count;
+  std::vector<float> frames(mel_count * count);
+  for (size_t mel = 0; mel < mel_count; mel++)
+    std::copy_n(features.begin() + mel * frame_count + begin, count, frames.begin() + mel * count);
+  return frames;
+}
+#endif
+
+TEST(CAPITests, WhisperStreamChunkedFeatures) {
+#if TEST_WHISPER
+  auto config = OgaConfig::Create(WHISPER_PATH);
+  config->ClearProviders();
+  auto model = OgaModel::Create(*config);
+
+  constexpr size_t mel_count = 80;
+  constexpr size_t frame_count = 450;  // Four and a half decode steps
+  const auto features = CreateWhisperFeatures(mel_count, frame_count);
+
+  // Returns the transcript after Flush, checking that the tokens returned as they were committed add up to it
+  auto transcribe = [&](size_t chunk_frames) {
+    auto params = OgaGeneratorParams::Create(*model);
+    auto stream = OgaWhisperStream::Create(*model, *params, whisper_prompt_tokens.data(), whisper_prompt_tokens.size());
+    auto new_tokens = OgaSequences::Create();
+    for (size_t begin = 0; begin < frame_count; begin += chunk_frames) {
+      const size_t count = std::min(chunk_frames, frame_count - begin);
+      const auto frames = GetWhisperFrames(features, frame_count, begin, count);
+      stream->AddFeatures(frames.data(), frames.size(), count);
+      stream->GetNewTokens(*new_tokens);
+    }
+    stream->Flush();
+    stream->GetNewTokens(*new_tokens);
+
+    auto transcript = OgaSequences::Create();
+    stream->GetTranscript(*transcript);
+    std::vector<int32_t> tokens(transcript->Get(0).begin(), transcript->Get(0).end());
+    std::vector<int32_t> committed;
+    for (size_t i = 0; i < new_tokens->Count(); i++)
+      committed.insert(committed.end(), new_tokens->Get(i).begin(), new_tokens->Get(i).end());
+    EXPECT_EQ(committed, tokens);
+    return tokens;
+  };
+
+  // Decodes run every 100 frames however the features are split, so chunks that don't line up with the steps commit the
+  // same tokens as the features added in one go
+  const auto one_shot = transcribe(frame_count);
+  EXPECT_EQ(transcribe(37), one_shot);
+  EXPECT_EQ(transcribe(1), one_shot);
+#endif
+}
+
+TEST(CAPITests, WhisperStreamVoiceActivity) {
+#if TEST_WHISPER
+  auto config = OgaConfig::Create(WHISPER_PATH);
+  config->ClearProviders();
+  auto model = OgaModel::Create(*config);
+  auto params = OgaGeneratorParams::Create(*model);
+  auto stream = OgaWhisperStream::Create(*model, *params, whisper_prompt_tokens.data(), whisper_prompt_tokens.size());
+  stream->SetVoiceActivity(1.0f, 50, 10);
+
+  // Speech in frames [0, 200) and [500, 650), silence (the log-mel floor, far below the speech) everywhere else
+  constexpr size_t mel_count = 80;
+  constexpr size_t frame_count = 900;
+  auto features = CreateWhisperFeatures(mel_count, frame_count);
+  for (size_t mel = 0; mel < mel_count; mel++) {
+    for (size_t frame = 0; frame < frame_count; frame++) {
+      if ((frame >= 200 && frame < 500) || frame >= 650)
+        features[mel * frame_count + frame] = -1.5f;
+    }
+  }
+  stream->AddFeatures(features.data(), features.size(), frame_count);
+  stream->Flush();
+
+  // A segment keeps 10 frames of padding around its speech and ends after more than 50 silent frames. The encoder only
+  // sees the frames of the segments, so the rest of the silence is never encoded.
+  ASSERT_EQ(stream->GetSegmentCount(), 2);
+  auto segment_tokens = OgaSequences::Create();
+  EXPECT_EQ(stream->GetSegment(0, *segment_tokens), (std::pair<size_t, size_t>{0, 210}));
+  EXPECT_EQ(stream->GetSegment(1, *segment_tokens), (std::pair<size_t, size_t>{490, 660}));
+
+  // The segments' tokens make up the transcript
+  std::vector<int32_t> tokens;
+  for (size_t i = 0; i < segment_tokens->Count(); i++)
+    tokens.insert(tokens.end(), segment_tokens->Get(i).begin(), segment_tokens->Get(i).end());
+  auto transcript = OgaSequences::Create();
+  stream->GetTranscript(*transcript);
+  EXPECT_EQ(tokens, std::vector<int32_t>(transcript->Get(0).begin(), transcript->Get(0).end()));
+#endif
+}
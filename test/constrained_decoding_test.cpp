@@ -0,0 +1,140 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <gtest/gtest.h>
+
+#include "generators.h"
+#include "models/model.h"
+#include "search.h"
+#include "constrained_decoding.h"
+
+#ifndef MODEL_PATH
+#define MODEL_PATH "../../test/test_models/"
+#endif
+
+namespace Generators::test {
+
+// Returns the state after 'text', which is Regex::dead_state if no continuation of it can match
+int32_t Walk(Regex& regex, std::string_view text) {
+  int32_t state = Regex::start_state;
+  for (char c : text) {
+    state = regex.Step(state, static_cast<uint8_t>(c));
+    if (state == Regex::dead_state)
+      break;
+  }
+  return state;
+}
+
+bool Matches(Regex& regex, std::string_view text) {
+  const int32_t state = Walk(regex, text);
+  return state != Regex::dead_state && regex.IsAccepting(state);
+}
+
+TEST(ConstrainedDecodingTest, Regex) {
+  Regex regex{R"([0-9]{2,3}(?:-[a-z]+)?|x\.y*)"};
+  EXPECT_TRUE(Matches(regex, "12"));
+  EXPECT_TRUE(Matches(regex, "123-abc"));
+  EXPECT_TRUE(Matches(regex, "x."));
+  EXPECT_TRUE(Matches(regex, "x.yyy"));
+  EXPECT_FALSE(Matches(regex, "1"));
+  EXPECT_FALSE(Matches(regex, "1234"));
+  EXPECT_FALSE(Matches(regex, "123-"));
+  EXPECT_FALSE(Matches(regex, "xy"));
+  EXPECT_NE(Walk(regex, "123-"), Regex::dead_state);  // A prefix of a match
+  EXPECT_EQ(Walk(regex, "12a"), Regex::dead_state);
+
+  Regex classes{R"([^"\\]*\s\d\w+)"};
+  EXPECT_TRUE(Matches(classes, "any text, even \xC3\xA9 1_a"));
+  EXPECT_FALSE(Matches(classes, "a\"b 1a"));
+
+  Regex unicode{"caf\xC3\xA9+\\u00e9"};
+  EXPECT_TRUE(Matches(unicode, "caf\xC3\xA9\xC3\xA9\xC3\xA9"));
+  EXPECT_FALSE(Matches(unicode, "caf\xC3\xA9\xA9\xC3\xA9"));
+
+  EXPECT_THROW(Regex{"(a"}, std::runtime_error);
+  EXPECT_THROW(Regex{"a)"}, std::runtime_error);
+  EXPECT_THROW(Regex{"[a"}, std::runtime_error);
+  EXPECT_THROW(Regex{"*a"}, std::runtime_error);
+  EXPECT_THROW(Regex{"a{3,2}"}, std::runtime_error);
+  EXPECT_THROW(Regex{"(a)\\1"}, std::runtime_error);
+}
+
+TEST(ConstrainedDecodingTest, JsonSchema) {
+  Regex regex{JsonSchemaToRegex(R"({
+    "type": "object",
+    "properties": {
+      "name": {"type": "string", "maxLength": 8},
+      "age": {"type": "integer"},
+      "tags": {"type": "array", "items": {"enum": ["a", "b", 3]}, "minItems": 1},
+      "ok": {"type": ["boolean", "null"]}
+    },
+    "required": ["age"]
+  })")};
+
+  EXPECT_TRUE(Matches(regex, R"({"name":"Bob","age":42,"tags":["a",3],"ok":true})"));
+  EXPECT_TRUE(Matches(regex, R"({"name": "Bob", "age": -1})"));
+  EXPECT_TRUE(Matches(regex, R"({"age":0,"ok":null})"));
+  EXPECT_FALSE(Matches(regex, R"({"name":"Bob"})"));                // age is required
+  EXPECT_FALSE(Matches(regex, R"({"age":1.5})"));                   // Not an integer
+  EXPECT_FALSE(Matches(regex, R"({"age":1,"tags":[]})"));           // minItems
+  EXPECT_FALSE(Matches(regex, R"({"age":1,"tags":["c"]})"));        // Not in the enum
+  EXPECT_FALSE(Matches(regex, R"({"name":"Robert Smith","age":1})"));  // maxLength
+  EXPECT_FALSE(Matches(regex, R"({"age":1,"name":"Bob"})"));        // Properties are in their declared order
+
+  Regex any{JsonSchemaToRegex("{}")};
+  EXPECT_TRUE(Matches(any, R"({"a":[1,{"b":null}],"c":"\u00e9"})"));
+  EXPECT_FALSE(Matches(any, R"({"a":})"));
+
+  EXPECT_THROW(JsonSchemaToRegex(R"({"$ref": "#/definitions/a"})"), std::runtime_error);
+  EXPECT_THROW(JsonSchemaToRegex(R"({"type": "tuple"})"), std::runtime_error);
+}
+
+TEST(ConstrainedDecodingTest, GuidedGenerationGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  const char* pattern = "[0-9]{2,4}(?: [a-z]+)*";
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 20;
+  params->search.batch_size = 2;
+  EXPECT_THROW(params->SetGuidance("grammar", pattern), std::runtime_error);
+  EXPECT_THROW(params->SetGuidance("regex", "[0-9"), std::runtime_error);
+  params->SetGuidance("regex", pattern);
+
+  const std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+  auto generator = Generators::CreateGenerator(*model, *params);
+  generator->AppendTokens(Generators::cpu_span<const int32_t>(input_ids.data(), input_ids.size()));
+  while (!generator->IsDone())
+    generator->GenerateNextToken();
+
+  // Every generated text matches the pattern so far, and fully if the sequence ended with EOS
+  auto tokenizer = model->CreateTokenizer();
+  const int32_t eos_token_id = model->config_->model.eos_token_id;
+  Regex regex{pattern};
+  for (size_t i = 0; i < 2; i++) {
+    auto sequence = generator->GetSequence(i).CopyDeviceToCpu();
+    auto generated = std::span<const int32_t>{sequence}.subspan(input_ids.size() / 2);
+    const auto eos = std::find(generated.begin(), generated.end(), eos_token_id);
+    const std::string text = tokenizer->Decode(generated.first(eos - generated.begin()));
+    const int32_t state = Walk(regex, text);
+    ASSERT_NE(state, Regex::dead_state) << text;
+    if (eos != generated.end())
+      EXPECT_TRUE(regex.IsAccepting(state)) << text;
+  }
+
+  // Rewinding restores the grammar state, so generating again still follows the pattern
+  params->search.batch_size = 1;
+  generator = Generators::CreateGenerator(*model, *params);
+  generator->AppendTokens(Generators::cpu_span<const int32_t>(input_ids.data() + 4, 4));
+  for (int i = 0; i < 6 && !generator->IsDone(); i++)
+    generator->GenerateNextToken();
+  if (static_cast<size_t>(generator->search_->GetSequenceLength()) > 6)
+    generator->RewindToLength(6);
+  while (!generator->IsDone())
+    generator->GenerateNextToken();
+  auto sequence = generator->GetSequence(0).CopyDeviceToCpu();
+  auto generated = std::span<const int32_t>{sequence}.subspan(4);
+  const auto eos = std::find(generated.begin(), generated.end(), eos_token_id);
+  EXPECT_NE(Walk(regex, tokenizer->Decode(generated.first(eos - generated.begin()))), Regex::dead_state);
+}
+
+}  // namespace Generators::test
@@ -175,6 +175,49 @@ namespace Microsoft.ML.OnnxRuntimeGenAI.Tests
             }
         }
 
+        [Fact(DisplayName = "TestSpanViews")]
+        public void TestSpanViews()
+        {
+            ulong maxLength = 10;
+            int[] inputIDs = new int[] { 0, 0, 0, 52, 0, 0, 195, 731 };
+            ulong batchSize = 2;
+            var expectedOutput = new int[] { 0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+                                             0, 0, 195, 731, 731, 114, 114, 114, 114, 114 };
+
+            string modelPath = _tinyRandomGpt2ModelPath;
+            using (var model = new Model(modelPath))
+            using (var generatorParams = new GeneratorParams(model))
+            {
+                generatorParams.SetSearchOption("max_length", maxLength);
+                generatorParams.SetSearchOption("batch_size", batchSize);
+
+                using (var generator = new Generator(model, generatorParams))
+                {
+                    generator.AppendTokens(new ReadOnlySpan<int>(inputIDs, 0, inputIDs.Length));
+                    Assert.Equal(0, generator.GetLogits().Length % (int)batchSize);
+
+                    ulong length = 4;
+                    while (!generator.IsDone())
+                    {
+                        generator.GenerateNextToken();
+                        var nextTokens = generator.GetNextTokens();
+                        Assert.Equal((int)batchSize, nextTokens.Length);
+                        for (ulong i = 0; i < batchSize; i++)
+                        {
+                            Assert.Equal(expectedOutput[(int)(i * maxLength + length)], nextTokens[(int)i]);
+                        }
+                        length++;
+                    }
+
+                    for (ulong i = 0; i < batchSize; i++)
+                    {
+                        var sequence = generator.GetSequence(i);
+                        Assert.True(sequence.SequenceEqual(new ReadOnlySpan<int>(expectedOutput, (int)(i * maxLength), (int)maxLength)));
+                    }
+                }
+            }
+        }
+
         [IgnoreOnModelAbsenceFact(DisplayName = "TestTopKSearch")]
         public void TestTopKSearch()
         {
@@ -0,0 +1,47 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <gtest/gtest.h>
+
+#include "generators.h"
+#include "models/device_arena.h"
+
+namespace Generators::test {
+
+TEST(DeviceArenaTest, SizeClasses) {
+  EXPECT_EQ(DeviceArena::GetSizeClass(1), size_t{256});
+  EXPECT_EQ(DeviceArena::GetSizeClass(256), size_t{256});
+  EXPECT_EQ(DeviceArena::GetSizeClass(257), size_t{512});
+  EXPECT_EQ(DeviceArena::GetSizeClass(1024 * 1024), size_t{1024 * 1024});
+  EXPECT_EQ(DeviceArena::GetSizeClass(1024 * 1024 + 1), size_t{1024 * 1024 + 256 * 1024});
+  EXPECT_EQ(DeviceArena::GetSizeClass(3 * 1024 * 1024), size_t{3 * 1024 * 1024});
+}
+
+TEST(DeviceArenaTest, ReusesFreedBlocks) {
+  DeviceArena arena{GetDeviceInterface(DeviceType::CPU)->GetAllocator()};
+  auto& allocator = arena.GetAllocator();
+
+  void* p = allocator.Alloc(1000);
+  allocator.Free(p);
+  EXPECT_EQ(allocator.Alloc(900), p);  // Same size class
+  void* q = allocator.Alloc(1000);     // The cached block is in use
+  EXPECT_NE(q, p);
+  allocator.Free(p);
+  allocator.Free(q);
+  arena.ReleaseFreeBlocks();
+}
+
+TEST(DeviceArenaTest, TensorsReleaseToArena) {
+  DeviceArena arena{GetDeviceInterface(DeviceType::CPU)->GetAllocator()};
+  const std::array<int64_t, 2> shape{4, 64};
+
+  auto tensor = OrtValue::CreateTensor<float>(arena.GetAllocator(), shape);
+  void* data = tensor->GetTensorMutableRawData();
+  tensor.reset();
+
+  // A later generator asking for the same shape gets the same memory
+  tensor = OrtValue::CreateTensor<float>(arena.GetAllocator(), shape);
+  EXPECT_EQ(tensor->GetTensorMutableRawData(), data);
+}
+
+}  // namespace Generators::test
@@ -1,13 +1,19 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 
+#include <algorithm>
+#include <array>
 #include <iostream>
 #include <random>
+#include <set>
 
 #include <gtest/gtest.h>
 
 #include "generators.h"
+#include "engine.h"
 #include "models/model.h"
+#include "models/logits.h"
+#include "models/windowed_kv_cache.h"
 #include "search.h"
 #include "smartptrs.h"
 
@@ -90,6 +96,525 @@ TEST(ModelTests, GreedySearchGptFp32) {
   }
 }
 
+TEST(ModelTests, GeneratorPoolResetGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+
+  Generators::GeneratorPool pool{*model, 1};
+  for (size_t i = 0; i < 2; i++) {
+    auto generator = pool.Acquire(*params);
+    EXPECT_EQ(pool.GetIdleCount(), 0U);
+    generator->AppendTokens(Generators::cpu_span<int>(input_ids.data() + i * 4, 4));
+    while (!generator->IsDone()) {
+      generator->GenerateNextToken();
+    }
+
+    // The second request runs on the generator of the first one, reset
+    auto sequence = generator->GetSequence(0).CopyDeviceToCpu();
+    EXPECT_TRUE(0 == std::memcmp(expected_output.data() + i * params->search.max_length, sequence.data(), params->search.max_length * sizeof(int32_t)));
+    pool.Release(std::move(generator));
+    EXPECT_EQ(pool.GetIdleCount(), 1U);
+  }
+
+  // The state's buffers are sized for the batch, a generator with another batch_size can't be reset to it
+  auto batch_params = Generators::CreateGeneratorParams(*model);
+  batch_params->search.max_length = 10;
+  batch_params->search.batch_size = 2;
+  auto generator = pool.Acquire(*batch_params);
+  EXPECT_EQ(pool.GetIdleCount(), 1U);
+  EXPECT_FALSE(generator->CanReset(*params));
+  EXPECT_THROW(generator->Reset(*params), std::runtime_error);
+}
+
+TEST(ModelTests, EngineGreedySearchGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+
+  Generators::Engine engine{*model, 2};
+
+  auto first = std::make_shared<Generators::Request>(params);
+  first->AddTokens(std::span<const int32_t>(input_ids.data(), 4));
+  engine.AddRequest(first);
+  engine.Step();
+  EXPECT_EQ(engine.GetActiveRequestCount(), 1U);
+
+  // The second request joins while the first one is already decoding
+  auto second = std::make_shared<Generators::Request>(params);
+  second->AddTokens(std::span<const int32_t>(input_ids.data() + 4, 4));
+  engine.AddRequest(second);
+
+  while (engine.HasPendingRequests()) {
+    engine.Step();
+  }
+
+  EXPECT_TRUE(first->IsDone());
+  EXPECT_TRUE(second->IsDone());
+
+  auto first_sequence = first->GetSequence();
+  auto second_sequence = second->GetSequence();
+  ASSERT_EQ(first_sequence.size(), static_cast<size_t>(params->search.max_length));
+  ASSERT_EQ(second_sequence.size(), static_cast<size_t>(params->search.max_length));
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), first_sequence.data(), params->search.max_length * sizeof(int32_t)));
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data() + params->search.max_length, second_sequence.data(), params->search.max_length * sizeof(int32_t)));
+
+  // All generated tokens are reported once, the prompt is not
+  EXPECT_EQ(second->GetUnseenTokens().size(), static_cast<size_t>(params->search.max_length - 4));
+  EXPECT_TRUE(second->GetUnseenTokens().empty());
+}
+
+TEST(ModelTests, EnginePreemptionGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+
+  for (auto mode : {Generators::PreemptionMode::Swap, Generators::PreemptionMode::Recompute}) {
+    Generators::Engine engine{*model, 1};
+    engine.SetPreemptionMode(mode);
+
+    auto batch = std::make_shared<Generators::Request>(params);
+    batch->SetPriority(Generators::Request::Priority::Batch);
+    batch->AddTokens(std::span<const int32_t>(input_ids.data(), 4));
+    engine.AddRequest(batch);
+    engine.Step();
+    engine.Step();
+
+    // The interactive request takes the only slot, the batch request resumes once it's done
+    auto interactive = std::make_shared<Generators::Request>(params);
+    interactive->AddTokens(std::span<const int32_t>(input_ids.data() + 4, 4));
+    engine.AddRequest(interactive);
+    engine.Step();
+    EXPECT_TRUE(batch->IsPreempted());
+    EXPECT_EQ(engine.GetActiveRequestCount(), 1U);
+    EXPECT_EQ(engine.GetQueuedRequestCount(), 1U);
+
+    while (!interactive->IsDone()) {
+      engine.Step();
+      EXPECT_TRUE(batch->IsPreempted());
+    }
+    while (engine.HasPendingRequests()) {
+      engine.Step();
+    }
+
+    auto batch_sequence = batch->GetSequence();
+    auto interactive_sequence = interactive->GetSequence();
+    ASSERT_EQ(batch_sequence.size(), static_cast<size_t>(params->search.max_length));
+    ASSERT_EQ(interactive_sequence.size(), static_cast<size_t>(params->search.max_length));
+    EXPECT_TRUE(0 == std::memcmp(expected_output.data(), batch_sequence.data(), params->search.max_length * sizeof(int32_t)));
+    EXPECT_TRUE(0 == std::memcmp(expected_output.data() + params->search.max_length, interactive_sequence.data(), params->search.max_length * sizeof(int32_t)));
+  }
+}
+
+TEST(ModelTests, EngineStepTokenBudgetGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+
+  Generators::Engine engine{*model, 2};
+  engine.SetStepTokenBudget(3);
+
+  // The first prompt takes two steps to prefill
+  auto first = std::make_shared<Generators::Request>(params);
+  first->AddTokens(std::span<const int32_t>(input_ids.data(), 4));
+  engine.AddRequest(first);
+  engine.Step();
+  EXPECT_TRUE(first->GetSequence().empty());
+  engine.Step();
+  EXPECT_EQ(first->GetSequence().size(), 5U);
+
+  // The second one is prefilled two tokens per step next to the first one's decoding
+  auto second = std::make_shared<Generators::Request>(params);
+  second->AddTokens(std::span<const int32_t>(input_ids.data() + 4, 4));
+  engine.AddRequest(second);
+  engine.Step();
+  EXPECT_EQ(first->GetSequence().size(), 6U);
+  EXPECT_TRUE(second->GetSequence().empty());
+  engine.Step();
+  EXPECT_EQ(first->GetSequence().size(), 7U);
+  EXPECT_EQ(second->GetSequence().size(), 5U);
+
+  while (engine.HasPendingRequests()) {
+    engine.Step();
+  }
+
+  auto first_sequence = first->GetSequence();
+  auto second_sequence = second->GetSequence();
+  ASSERT_EQ(first_sequence.size(), static_cast<size_t>(params->search.max_length));
+  ASSERT_EQ(second_sequence.size(), static_cast<size_t>(params->search.max_length));
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), first_sequence.data(), params->search.max_length * sizeof(int32_t)));
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data() + params->search.max_length, second_sequence.data(), params->search.max_length * sizeof(int32_t)));
+}
+
+// The tokens of generating each prompt on its own generator, up to max_length or EOS
+static std::vector<std::vector<int32_t>> GenerateEach(const Generators::Model& model, const Generators::GeneratorParams& params,
+                                                      const std::vector<std::vector<int32_t>>& prompts) {
+  std::vector<std::vector<int32_t>> sequences;
+  for (auto& prompt : prompts) {
+    auto generator = Generators::CreateGenerator(model, params);
+    generator->AppendTokens(Generators::cpu_span<const int32_t>(prompt.data(), prompt.size()));
+    while (!generator->IsDone()) {
+      generator->GenerateNextToken();
+    }
+    auto sequence = generator->GetSequence(0).CopyDeviceToCpu();
+    sequences.emplace_back(sequence.begin(), sequence.end());
+  }
+  return sequences;
+}
+
+TEST(ModelTests, MergeGeneratorsGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 12;
+  std::vector<std::vector<int32_t>> prompts{{0, 0, 0, 52}, {195, 731}, {0, 0, 195, 731, 731}};
+  auto expected = GenerateEach(*model, *params, prompts);
+
+  // Each sequence starts on its own generator, the third one a token ahead
+  std::vector<std::unique_ptr<Generators::Generator>> generators;
+  std::vector<size_t> lengths;
+  for (auto& prompt : prompts) {
+    generators.push_back(Generators::CreateGenerator(*model, *params));
+    generators.back()->AppendTokens(Generators::cpu_span<const int32_t>(prompt.data(), prompt.size()));
+    generators.back()->GenerateNextToken();
+    lengths.push_back(prompt.size() + 1);
+  }
+  generators[2]->GenerateNextToken();
+  lengths[2]++;
+
+  auto batch_params = Generators::CreateGeneratorParams(*model);
+  batch_params->search.max_length = 32;
+  batch_params->search.batch_size = 2;
+  std::vector<Generators::Generator::Row> rows{{generators[0].get(), 0}, {generators[1].get(), 0}};
+  auto merged = Generators::Generator::Merge(*batch_params, rows);
+  ASSERT_TRUE(merged);
+  merged->GenerateNextToken();
+  lengths[0]++;
+  lengths[1]++;
+
+  // The rows of a merged batch are merged again in another order, with the third sequence joining them
+  auto batch_params3 = Generators::CreateGeneratorParams(*model);
+  batch_params3->search.max_length = 32;
+  batch_params3->search.batch_size = 3;
+  std::vector<Generators::Generator::Row> rows3{{merged.get(), 1}, {generators[2].get(), 0}, {merged.get(), 0}};
+  const std::array<size_t, 3> order{1, 2, 0};
+  auto merged3 = Generators::Generator::Merge(*batch_params3, rows3);
+  ASSERT_TRUE(merged3);
+  while (lengths[2] < static_cast<size_t>(params->search.max_length)) {
+    merged3->GenerateNextToken();
+    for (auto& length : lengths)
+      length++;
+  }
+
+  // The rows are left padded to the longest, so each ends with the tokens of its sequence
+  for (size_t row = 0; row < order.size(); row++) {
+    const size_t index = order[row];
+    auto sequence = merged3->GetSequence(row).CopyDeviceToCpu();
+    ASSERT_GE(sequence.size(), lengths[index]);
+    auto tokens = sequence.subspan(sequence.size() - lengths[index]);
+    const size_t count = std::min(tokens.size(), expected[index].size());  // After EOS the search only adds pad tokens
+    EXPECT_TRUE(std::equal(tokens.begin(), tokens.begin() + count, expected[index].begin())) << "row " << row;
+  }
+
+  // Sequences that are generating can't be merged before they selected a token
+  auto fresh = Generators::CreateGenerator(*model, *params);
+  fresh->AppendTokens(Generators::cpu_span<const int32_t>(prompts[0].data(), prompts[0].size()));
+  std::vector<Generators::Generator::Row> fresh_rows{{fresh.get(), 0}, {generators[1].get(), 0}};
+  EXPECT_THROW(Generators::Generator::Merge(*batch_params, fresh_rows), std::runtime_error);
+}
+
+TEST(ModelTests, EngineSharedBatchGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 12;
+  std::vector<std::vector<int32_t>> prompts{{0, 0, 0, 52}, {195, 731}, {0, 0, 195, 731, 731}};
+  auto expected = GenerateEach(*model, *params, prompts);
+
+  Generators::Engine engine{*model, 4};
+  std::vector<std::shared_ptr<Generators::Request>> requests;
+  auto add_request = [&](const std::vector<int32_t>& prompt) {
+    requests.push_back(std::make_shared<Generators::Request>(params));
+    requests.back()->AddTokens(prompt);
+    engine.AddRequest(requests.back());
+  };
+
+  // The requests join the shared batch at different steps, and one that is cancelled leaves it in the middle
+  add_request(prompts[0]);
+  engine.Step();
+  add_request(prompts[1]);
+  add_request(prompts[0]);
+  engine.Step();
+  engine.Step();
+  add_request(prompts[2]);
+  engine.Step();
+  requests[2]->Cancel();
+  engine.Step();
+  EXPECT_TRUE(requests[2]->IsDone());
+  EXPECT_EQ(engine.GetActiveRequestCount(), 3U);
+
+  while (engine.HasPendingRequests()) {
+    engine.Step();
+  }
+
+  // The same tokens as on generators of their own
+  EXPECT_EQ(requests[0]->GetSequence(), expected[0]);
+  EXPECT_EQ(requests[1]->GetSequence(), expected[1]);
+  EXPECT_EQ(requests[3]->GetSequence(), expected[2]);
+  auto cancelled = requests[2]->GetSequence();
+  EXPECT_LT(cancelled.size(), expected[0].size());
+  EXPECT_TRUE(std::equal(cancelled.begin(), cancelled.end(), expected[0].begin()));
+}
+
+TEST(ModelTests, ModelPoolGreedySearchGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  std::vector<std::shared_ptr<const Generators::Model>> replicas;
+  for (int i = 0; i < 2; i++)
+    replicas.push_back(Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+
+  Generators::ModelPool pool{replicas, 1};
+
+  auto search = replicas[0]->config_->search;
+  search.max_length = 10;
+  auto first = pool.AddRequest(search, std::span<const int32_t>(input_ids.data(), 4));
+  auto second = pool.AddRequest(search, std::span<const int32_t>(input_ids.data() + 4, 4));
+
+  // The second request goes to the idle replica instead of queueing behind the first one
+  EXPECT_EQ(pool.GetEngine(0).GetQueuedRequestCount(), 1U);
+  EXPECT_EQ(pool.GetEngine(1).GetQueuedRequestCount(), 1U);
+
+  while (pool.HasPendingRequests()) {
+    pool.Step();
+  }
+
+  auto first_sequence = first->GetSequence();
+  auto second_sequence = second->GetSequence();
+  ASSERT_EQ(first_sequence.size(), static_cast<size_t>(search.max_length));
+  ASSERT_EQ(second_sequence.size(), static_cast<size_t>(search.max_length));
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), first_sequence.data(), search.max_length * sizeof(int32_t)));
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data() + search.max_length, second_sequence.data(), search.max_length * sizeof(int32_t)));
+}
+
+TEST(ModelTests, WarmupGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  // The warmup generations run while the model is created, they must not change the results of the real ones
+  auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"),
+                                                     R"({"model": {"warmup": {"batch_sizes": [1, 2], "prompt_lengths": [3, 5], "decode_steps": 2}}})");
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), std::move(config));
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->search.batch_size = 2;
+
+  auto generator = Generators::CreateGenerator(*model, *params);
+  generator->AppendTokens(Generators::cpu_span<int32_t>(input_ids.data(), input_ids.size()));
+  while (!generator->IsDone()) {
+    generator->GenerateNextToken();
+  }
+
+  for (int i = 0; i < params->search.batch_size; i++) {
+    auto sequence = generator->GetSequence(i).CopyDeviceToCpu();
+    EXPECT_TRUE(0 == std::memcmp(expected_output.data() + i * params->search.max_length, sequence.data(), params->search.max_length * sizeof(int32_t)));
+  }
+}
+
+TEST(ModelTests, DecodeReusesLogitsAndPositionInputs) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 20;
+  params->search.batch_size = 2;
+
+  auto generator = Generators::CreateGenerator(*model, *params);
+  generator->AppendTokens(Generators::cpu_span<int32_t>(input_ids.data(), input_ids.size()));
+  generator->GenerateNextToken();
+  generator->GenerateNextToken();  // The first decode step replaces the prompt shaped tensors
+
+  // Count the memory the decode steps' tensors are in, every new allocation would add one
+  auto& inputs = model->config_->model.decoder.inputs;
+  std::set<void*> logits, position_ids, attention_masks;
+  while (!generator->IsDone()) {
+    generator->GenerateNextToken();
+    auto& state = *generator->state_;
+    logits.insert(state.GetOutput(model->config_->model.decoder.outputs.logits.c_str())->GetTensorMutableRawData());
+    position_ids.insert(state.GetInput(inputs.position_ids.c_str())->GetTensorMutableRawData());
+    attention_masks.insert(state.GetInput(inputs.attention_mask.c_str())->GetTensorMutableRawData());
+  }
+
+  EXPECT_EQ(logits.size(), 1U);
+  EXPECT_EQ(position_ids.size(), 1U);
+  EXPECT_EQ(attention_masks.size(), 2U);  // Every update reads the previous mask, so two buffers alternate
+}
+
+TEST(ModelTests, AttentionMaskExtendedInPlace) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto& mask_name = model->config_->model.decoder.inputs.attention_mask;
+
+  // The rows of the generator's mask after each step, as int64 whatever the mask type is
+  auto get_mask_rows = [&](Generators::Generator& generator) {
+    OrtValue& mask = *generator.state_->GetInput(mask_name.c_str());
+    auto info = mask.GetTensorTypeAndShapeInfo();
+    const size_t count = info->GetElementCount();
+    std::vector<int64_t> rows(count);
+    if (info->GetElementType() == Ort::TypeToTensorType<int32_t>)
+      std::copy_n(mask.GetTensorData<int32_t>(), count, rows.begin());
+    else
+      std::copy_n(mask.GetTensorData<int64_t>(), count, rows.begin());
+    return std::make_pair(info->GetShape()[0], rows);
+  };
+
+  // A single sequence extends its mask in place, a batch of two copies of it copies the mask into a new buffer each step
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 12;
+  auto generator = Generators::CreateGenerator(*model, *params);
+  generator->AppendTokens(Generators::cpu_span<int32_t>(input_ids.data(), input_ids.size()));
+
+  auto batch_params = Generators::CreateGeneratorParams(*model);
+  batch_params->search.max_length = 12;
+  batch_params->search.batch_size = 2;
+  std::vector<int32_t> batch_input_ids{input_ids};
+  batch_input_ids.insert(batch_input_ids.end(), input_ids.begin(), input_ids.end());
+  auto batch_generator = Generators::CreateGenerator(*model, *batch_params);
+  batch_generator->AppendTokens(Generators::cpu_span<int32_t>(batch_input_ids.data(), batch_input_ids.size()));
+
+  std::set<const void*> masks;
+  while (!generator->IsDone()) {
+    generator->GenerateNextToken();
+    batch_generator->GenerateNextToken();
+    masks.insert(generator->state_->GetInput(mask_name.c_str())->GetTensorRawData());
+
+    auto [batch_size, mask] = get_mask_rows(*generator);
+    auto [reallocated_batch_size, reallocated_mask] = get_mask_rows(*batch_generator);
+    ASSERT_EQ(batch_size, 1);
+    ASSERT_EQ(reallocated_batch_size, 2);
+    ASSERT_EQ(reallocated_mask.size(), mask.size() * 2);
+    EXPECT_TRUE(std::equal(mask.begin(), mask.end(), reallocated_mask.begin()));
+    EXPECT_TRUE(std::equal(mask.begin(), mask.end(), reallocated_mask.begin() + mask.size()));
+  }
+  EXPECT_TRUE(batch_generator->IsDone());
+  EXPECT_LE(masks.size(), 2U);  // The prompt's mask, then one buffer for every decode step
+
+  auto sequence = generator->GetSequence(0).CopyDeviceToCpu();
+  auto batch_sequence = batch_generator->GetSequence(1).CopyDeviceToCpu();
+  EXPECT_TRUE(std::equal(sequence.begin(), sequence.end(), batch_sequence.begin(), batch_sequence.end()));
+}
+
+TEST(ModelTests, OffloadKeyValueCacheOnCpu) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+
+  auto generator = Generators::CreateGenerator(*model, *params);
+  generator->AppendTokens(Generators::cpu_span<int32_t>(input_ids.data(), input_ids.size()));
+  generator->GenerateNextToken();
+
+  // The CPU cache is already in host memory, so without a file it stays where it is
+  generator->OffloadKeyValueCache();
+  EXPECT_FALSE(generator->IsKeyValueCacheOffloaded());
+  generator->OffloadKeyValueCache();  // Not offloaded, so this isn't a second offload
+
+  const char* offload_path = "offloaded_cpu_kv_cache.bin";
+  generator->OffloadKeyValueCache(offload_path);
+  EXPECT_TRUE(generator->IsKeyValueCacheOffloaded());
+  EXPECT_THROW(generator->OffloadKeyValueCache(offload_path), std::runtime_error);
+  generator->RestoreKeyValueCache();
+  EXPECT_FALSE(generator->IsKeyValueCacheOffloaded());
+  std::remove(offload_path);
+}
+
+TEST(ModelTests, CompactFinishedSequencesGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731, 0, 0, 0, 52, 41, 554, 74, 622};
+
+  // With 114 as EOS the first sequence ends after two tokens and the stop sequence ends the second after three, while
+  // the third keeps running. Dropping the finished sequences from the batch must not change any of the tokens.
+  auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"),
+                                                     R"({"model": {"eos_token_id": 114}})");
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), std::move(config));
+
+  auto generate = [&](bool compact_finished_sequences) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.max_length = 10;
+    params->search.batch_size = 3;
+    params->search.stop_token_sequences = {{204, 204, 204}};
+    params->search.compact_finished_sequences = compact_finished_sequences;
+
+    auto generator = Generators::CreateGenerator(*model, *params);
+    generator->AppendTokens(Generators::cpu_span<int32_t>(input_ids.data(), input_ids.size()));
+    while (!generator->IsDone()) {
+      generator->GenerateNextToken();
+    }
+
+    auto& input_ids_name = model->config_->model.decoder.inputs.input_ids;
+    const int64_t run_batch_size = generator->state_->GetInput(input_ids_name.c_str())->GetTensorTypeAndShapeInfo()->GetShape()[0];
+    EXPECT_EQ(run_batch_size < params->search.batch_size, compact_finished_sequences);
+
+    std::vector<int32_t> sequences;
+    for (size_t i = 0; i < static_cast<size_t>(params->search.batch_size); i++) {
+      auto sequence = generator->GetSequence(i).CopyDeviceToCpu();
+      sequences.insert(sequences.end(), sequence.begin(), sequence.end());
+    }
+    return sequences;
+  };
+
+  auto sequences = generate(false);
+  EXPECT_EQ(std::vector<int32_t>(sequences.begin(), sequences.begin() + 6), (std::vector<int32_t>{0, 0, 195, 731, 731, 114}));
+  EXPECT_EQ(generate(true), sequences);
+}
+
 TEST(ModelTests, BeamSearchGptFp32) {
   std::vector<int64_t> input_ids_shape{3, 12};
   std::vector<int32_t> input_ids{
@@ -128,8 +653,197 @@ TEST(ModelTests, BeamSearchGptFp32) {
     EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequence.data(), params->search.max_length * sizeof(int32_t)));
   }
 }
+
+TEST(ModelTests, BeamSequencesTokenTree) {
+  Generators::Config config;
+  config.model.vocab_size = 1000;
+  auto params = Generators::CreateGeneratorParams(config);
+  params->search.batch_size = 2;
+  params->search.num_beams = 2;
+  params->search.max_length = 8;
+  params->p_device = Generators::GetDeviceInterface(Generators::DeviceType::CPU);
+
+  Generators::Sequences sequences{*params};
+  sequences.UseTokenTree();
+  std::vector<int32_t> prompt{1, 2, 3, 4};  // Two tokens for each batch entry
+  auto prompt_span = params->p_device->WrapMemory<int32_t>(prompt);
+  sequences.AppendBatchTokens(prompt, 2);
+  sequences.AfterAppendNextTokens(prompt_span, 2);
+
+  // Both beams of batch entry 0 continue its beam 0 in the first step, and the beams swap in the second
+  std::vector<int32_t> tokens{5, 6, 7, 8}, beam_indices{0, 0, 2, 3};
+  auto tokens_span = params->p_device->WrapMemory<int32_t>(tokens);
+  sequences.AppendBeamTokens(tokens, beam_indices);
+  sequences.AfterAppendNextTokens(tokens_span, 4);
+  EXPECT_EQ(sequences.GetSequence(1).CopyDeviceToCpu()[2], 6);
+
+  tokens = {9, 10, 11, 12}, beam_indices = {1, 0, 3, 2};
+  sequences.AppendBeamTokens(tokens, beam_indices);
+  sequences.AfterAppendNextTokens(tokens_span, 4);
+  auto expect_sequence = [&](size_t index, std::vector<int32_t> expected) {
+    auto sequence = sequences.GetSequence(index).CopyDeviceToCpu();
+    EXPECT_EQ(std::vector<int32_t>(sequence.begin(), sequence.end()), expected);
+  };
+  expect_sequence(0, {1, 2, 6, 9});
+  expect_sequence(1, {1, 2, 5, 10});
+  expect_sequence(2, {3, 4, 8, 11});
+  expect_sequence(3, {3, 4, 7, 12});
+
+  sequences.RewindTo(3);
+  expect_sequence(0, {1, 2, 6});
+  expect_sequence(3, {3, 4, 7});
+}
+
+TEST(ModelTests, DiverseBeamSearchGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 328, 219, 328, 206, 288, 227, 896, 328};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 20;
+  params->search.num_beams = 4;
+  params->search.num_beam_groups = 3;
+  EXPECT_THROW(Generators::CreateGenerator(*model, *params), std::runtime_error);  // num_beams isn't a multiple of it
+
+  params->search.num_beam_groups = 2;
+  params->search.num_return_sequences = 4;
+  params->search.diversity_penalty = 100.0f;
+
+  auto generator = Generators::CreateGenerator(*model, *params);
+  generator->AppendTokens(Generators::cpu_span<int>(input_ids.data(), input_ids.size()));
+  while (!generator->IsDone()) {
+    generator->GenerateNextToken();
+  }
+
+  // The hypotheses of both groups are ranked together, and with a penalty this large the groups never pick the same
+  // token in a step, so they can't all be the same
+  std::vector<std::vector<int32_t>> sequences;
+  for (size_t i = 0; i < 4; i++) {
+    auto sequence = generator->GetSequence(i).CopyDeviceToCpu();
+    ASSERT_GT(sequence.size(), input_ids.size());
+    EXPECT_TRUE(std::equal(input_ids.begin(), input_ids.end(), sequence.begin()));
+    sequences.emplace_back(sequence.begin(), sequence.end());
+  }
+  EXPECT_GT(std::set<std::vector<int32_t>>(sequences.begin(), sequences.end()).size(), 1U);
+}
+
+TEST(ModelTests, BatchAdaptersGptFp32) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  // The model has no stacked adapters
+  auto model_params = Generators::CreateGeneratorParams(*model);
+  EXPECT_THROW(model_params->SetBatchAdapters(std::vector<std::string>{"", ""}), std::runtime_error);
+
+  Generators::Config config;
+  config.model.vocab_size = 1000;
+  config.model.decoder.adapter_names = {"tenant_a", "tenant_b"};
+
+  auto params = Generators::CreateGeneratorParams(config);
+  params->search.batch_size = 3;
+  params->search.max_length = 10;
+  params->p_device = Generators::GetDeviceInterface(Generators::DeviceType::CPU);
+  params->SetBatchAdapters(std::vector<std::string>{"tenant_b", "", "tenant_a"});
+  EXPECT_EQ(params->batch_adapter_ids, (std::vector<int32_t>{2, 0, 1}));
+  EXPECT_THROW(params->SetBatchAdapters(std::vector<std::string>{"tenant_c"}), std::runtime_error);
+  EXPECT_EQ(params->batch_adapter_ids, (std::vector<int32_t>{2, 0, 1}));
+
+  // The model has no adapter_ids input to select them with
+  EXPECT_THROW(Generators::CreateGenerator(*model, *params), std::runtime_error);
+  params->search.batch_size = 2;
+  EXPECT_THROW(Generators::CreateGenerator(*model, *params), std::runtime_error);
+}
 #endif
 
+TEST(ModelTests, PromptWindowSizes) {
+  Generators::Config::Model::Decoder::SlidingWindow sliding_window;
+  sliding_window.window_size = 128;
+  EXPECT_EQ(Generators::GetPromptWindowSizes(sliding_window, 130), (std::vector<int>{128, 128}));
+  EXPECT_EQ(Generators::GetPromptWindowSizes(sliding_window, 256), (std::vector<int>{128, 128}));
+
+  // The end of the prompt is covered with the least padding, then with the fewest windows
+  sliding_window.window_sizes = {32, 64};
+  EXPECT_EQ(Generators::GetPromptWindowSizes(sliding_window, 130), (std::vector<int>{128, 32}));
+  EXPECT_EQ(Generators::GetPromptWindowSizes(sliding_window, 90), (std::vector<int>{64, 32}));
+  EXPECT_EQ(Generators::GetPromptWindowSizes(sliding_window, 100), (std::vector<int>{128}));
+  EXPECT_EQ(Generators::GetPromptWindowSizes(sliding_window, 20), (std::vector<int>{32}));
+  EXPECT_EQ(Generators::GetPromptWindowSizes(sliding_window, 256), (std::vector<int>{128, 128}));
+
+  sliding_window.window_sizes = {128};
+  EXPECT_THROW(Generators::GetPromptWindowSizes(sliding_window, 130), std::runtime_error);
+}
+
+TEST(ModelTests, RewindWithinWindow) {
+  // 100 processed tokens in a window of 127, every token is still in the input caches
+  EXPECT_TRUE(Generators::IsRewindWithinWindow(60, 100, 127));
+  EXPECT_TRUE(Generators::IsRewindWithinWindow(1, 100, 127));
+
+  // 150 processed tokens, the oldest 23 have slid out of the window. A rewind would keep tokens that are gone.
+  EXPECT_FALSE(Generators::IsRewindWithinWindow(149, 150, 127));
+  EXPECT_FALSE(Generators::IsRewindWithinWindow(60, 150, 127));
+
+  // Rewinding to the current length drops nothing, and rewinding to 0 starts over
+  EXPECT_TRUE(Generators::IsRewindWithinWindow(150, 150, 127));
+  EXPECT_TRUE(Generators::IsRewindWithinWindow(0, 150, 127));
+}
+
+TEST(ModelTests, ConvertFloat16AndBFloat16) {
+  // Every finite fp16 value, repeated past the thread pool chunk size and with a tail that is not a multiple of the vector width
+  std::vector<uint16_t> fp16;
+  for (size_t i = 0; fp16.size() < 3 * 65536 + 5; i++) {
+    const uint16_t v = static_cast<uint16_t>(i);
+    if ((v & 0x7C00) != 0x7C00)
+      fp16.push_back(v);
+  }
+
+  std::vector<float> fp32(fp16.size());
+  Generators::ConvertFloat16ToFloat32(fp16, fp32);
+  for (size_t i = 0; i < fp16.size(); i++)
+    ASSERT_EQ(fp32[i], Generators::Float16ToFloat32(fp16[i]));
+
+  std::vector<uint16_t> round_trip(fp32.size());
+  Generators::ConvertFloat32ToFloat16(fp32, round_trip);
+  EXPECT_EQ(round_trip, fp16);
+
+  std::vector<float> values{1.0f, -2.5f, 3.14159f, 1e30f};
+  std::vector<uint16_t> bf16(values.size());
+  Generators::ConvertFloat32ToBFloat16(values, bf16);
+  EXPECT_EQ(bf16, (std::vector<uint16_t>{0x3F80, 0xC020, 0x4049, 0x714A}));
+
+  std::vector<float> bf16_fp32(values.size());
+  Generators::ConvertBFloat16ToFloat32(bf16, bf16_fp32);
+  EXPECT_EQ(bf16_fp32[0], 1.0f);
+  EXPECT_EQ(bf16_fp32[1], -2.5f);
+  EXPECT_NEAR(bf16_fp32[2], 3.14159f, 0.01f);
+
+  EXPECT_THROW(Generators::ConvertFloat16ToFloat32(fp16, std::span<float>{fp32.data(), 1}), std::runtime_error);
+}
+
+TEST(ModelTests, StreamingCopy) {
+  // Unaligned destinations and sizes that leave a head and a tail around the streamed part
+  std::vector<uint8_t> source(4096 + 37);
+  for (size_t i = 0; i < source.size(); i++)
+    source[i] = static_cast<uint8_t>(i * 7 + 1);
+
+  for (size_t offset = 0; offset < 17; offset++) {
+    for (size_t size : {size_t{0}, size_t{15}, size_t{64}, size_t{100}, size_t{4096}}) {
+      std::vector<uint8_t> dest(size + offset + 16);
+      Generators::StreamingCopy(dest.data() + offset, source.data() + 3, size);
+      ASSERT_TRUE(std::equal(source.begin() + 3, source.begin() + 3 + size, dest.begin() + offset)) << offset << " " << size;
+    }
+  }
+}
+
+TEST(ModelTests, ExpandTopKLogits) {
+  // Two rows of three candidates over a vocabulary of 5 tokens
+  std::vector<float> values{3.0f, 2.0f, 1.0f, 6.0f, 5.0f, 4.0f};
+  std::vector<int32_t> tokens{4, 0, 2, 1, 3, 0};
+  std::vector<float> logits(10, 7.0f);
+  Generators::ExpandTopKLogits(values, tokens, logits, 2);
+
+  constexpr float lowest = std::numeric_limits<float>::lowest();
+  EXPECT_EQ(logits, (std::vector<float>{2.0f, lowest, 1.0f, lowest, 3.0f, 4.0f, 6.0f, lowest, 5.0f, lowest}));
+}
+
 #if USE_CUDA
 
 void Test_GreedySearch_Gpt_Cuda(const char* model_path, const char* model_label) {
@@ -198,6 +912,35 @@ TEST(ModelTests, GreedySearchGptCuda) {
     Test_GreedySearch_Gpt_Cuda(model_path.first, model_path.second);
 }
 
+TEST(ModelTests, GreedySearchFp16RepetitionPenaltyCuda) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp16-cuda");
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  auto generate = [&](bool fused) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.batch_size = 2;
+    params->search.max_length = 10;
+    params->search.repetition_penalty = 1.5f;
+    if (!fused)
+      params->search.logit_bias = {{0, 0.0f}};  // Any other logits processing uses the fp32 logits
+
+    auto generator = Generators::CreateGenerator(*model, *params);
+    generator->AppendTokens(Generators::cpu_span<int>(input_ids.data(), input_ids.size()));
+    while (!generator->IsDone())
+      generator->GenerateNextToken();
+
+    std::vector<int32_t> sequences;
+    for (int i = 0; i < params->search.batch_size; i++) {
+      auto sequence = generator->GetSequence(i).CopyDeviceToCpu();
+      sequences.insert(sequences.end(), sequence.begin(), sequence.end());
+    }
+    return sequences;
+  };
+
+  // Selecting from the fp16 logits with the penalty fused in picks the same tokens as the regular path
+  EXPECT_EQ(generate(true), generate(false));
+}
+
 void Test_BeamSearch_Gpt_Cuda(const char* model_path, const char* model_label) {
   std::vector<int64_t> input_ids_shape{3, 12};
   std::vector<int32_t> input_ids{
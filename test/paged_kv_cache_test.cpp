@@ -0,0 +1,143 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <set>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "generators.h"
+#include "models/model.h"
+#include "models/paged_kv_cache.h"
+
+#ifndef MODEL_PATH
+#define MODEL_PATH "../../test/test_models/"
+#endif
+
+namespace Generators::test {
+
+// The test models have no paged attention, but the pool only needs the type of the past key input, which the dummy
+// vision-preprocessing decoder has
+static std::shared_ptr<Model> CreatePagedModel(std::string_view paged_kv_cache) {
+  auto config = std::make_unique<Config>(fs::path(MODEL_PATH "vision-preprocessing"),
+                                         R"({"model": {"decoder": {"paged_kv_cache": )" + std::string{paged_kv_cache} + "}}}");
+  return CreateModel(GetOrtEnv(), std::move(config));
+}
+
+TEST(PagedKeyValueCacheTest, AllocatesAndFreesBlocks) {
+  auto model = CreatePagedModel(R"({"block_size": 4, "num_blocks": 8})");
+  auto& pool = *model->paged_kv_cache_pool_;
+  EXPECT_EQ(pool.GetBlockSize(), 4);
+  EXPECT_EQ(pool.GetFreeBlockCount(), size_t{7});  // Block 0 is never handed out
+
+  // Three sequences of different lengths take every free block, each block goes to one sequence
+  std::vector<std::vector<int32_t>> sequences{pool.AllocateBlocks(3), pool.AllocateBlocks(2), pool.AllocateBlocks(2)};
+  std::set<int32_t> blocks;
+  for (auto& sequence : sequences)
+    blocks.insert(sequence.begin(), sequence.end());
+  EXPECT_EQ(blocks, (std::set<int32_t>{1, 2, 3, 4, 5, 6, 7}));
+  EXPECT_EQ(pool.GetFreeBlockCount(), size_t{0});
+  EXPECT_THROW(pool.AllocateBlocks(1), std::runtime_error);
+
+  // A finished sequence's blocks go to the next one
+  pool.FreeBlocks(sequences[1]);
+  EXPECT_EQ(pool.GetFreeBlockCount(), size_t{2});
+  auto next = pool.AllocateBlocks(2);
+  EXPECT_EQ(std::set<int32_t>(next.begin(), next.end()), std::set<int32_t>(sequences[1].begin(), sequences[1].end()));
+
+  pool.FreeBlocks(sequences[0]);
+  pool.FreeBlocks(sequences[2]);
+  pool.FreeBlocks(next);
+  EXPECT_EQ(pool.GetFreeBlockCount(), size_t{7});
+}
+
+// The entries of 'block' in the first layer's key cache
+static std::span<float> GetBlockEntries(PagedKeyValueCachePool& pool, int32_t block) {
+  const size_t block_entries = pool.GetBlockSizeInBytes() / size_t{2} / sizeof(float);  // The dummy decoder has one layer
+  return std::span<float>{pool.GetBlocks(0)->GetTensorMutableData<float>() + block * block_entries, block_entries};
+}
+
+TEST(PagedKeyValueCacheTest, CopiesSharedBlocksOnWrite) {
+  auto model = CreatePagedModel(R"({"block_size": 4, "num_blocks": 8})");
+  auto& pool = *model->paged_kv_cache_pool_;
+
+  const int32_t block = pool.AllocateBlocks(1)[0];
+  auto entries = GetBlockEntries(pool, block);
+  std::iota(entries.begin(), entries.end(), 1.0f);
+  EXPECT_EQ(pool.MakeWritable(block), block);  // The only holder writes in place
+
+  // A second holder (a forked sequence) gets a copy to write to, the other one then holds the block alone
+  pool.ShareBlocks(std::span<const int32_t>{&block, 1});
+  const int32_t copy = pool.MakeWritable(block);
+  EXPECT_NE(copy, block);
+  auto copy_entries = GetBlockEntries(pool, copy);
+  EXPECT_TRUE(std::equal(copy_entries.begin(), copy_entries.end(), entries.begin(), entries.end()));
+  EXPECT_EQ(pool.MakeWritable(block), block);
+  EXPECT_EQ(pool.GetFreeBlockCount(), size_t{5});
+
+  pool.FreeBlocks(std::span<const int32_t>{&block, 1});
+  pool.FreeBlocks(std::span<const int32_t>{&copy, 1});
+  EXPECT_EQ(pool.GetFreeBlockCount(), size_t{7});
+}
+
+TEST(PagedKeyValueCacheTest, MakeWritableFromManyThreads) {
+  auto model = CreatePagedModel(R"({"block_size": 4, "num_blocks": 8})");
+  auto& pool = *model->paged_kv_cache_pool_;
+
+  // Four holders of one block make it writable at once, three of them copy it and the last one keeps it
+  constexpr size_t holder_count = 4;
+  const int32_t block = pool.AllocateBlocks(1)[0];
+  for (size_t i = 1; i < holder_count; i++)
+    pool.ShareBlocks(std::span<const int32_t>{&block, 1});
+
+  std::vector<int32_t> writable(holder_count);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < holder_count; i++)
+    threads.emplace_back([&pool, &writable, block, i] { writable[i] = pool.MakeWritable(block); });
+  for (auto& thread : threads)
+    thread.join();
+
+  std::set<int32_t> blocks(writable.begin(), writable.end());
+  EXPECT_EQ(blocks.size(), holder_count);
+  EXPECT_TRUE(blocks.contains(block));
+  EXPECT_EQ(pool.GetFreeBlockCount(), size_t{7} - holder_count);
+
+  pool.FreeBlocks(writable);
+  EXPECT_EQ(pool.GetFreeBlockCount(), size_t{7});
+}
+
+TEST(PagedKeyValueCacheTest, SharesPrefixBlocks) {
+  auto model = CreatePagedModel(R"({"block_size": 2, "num_blocks": 8, "enable_prefix_cache": true})");
+  auto& pool = *model->paged_kv_cache_pool_;
+
+  // A finished sequence publishes the two full blocks of its prompt, the cache keeps them after the sequence frees them
+  const std::vector<int32_t> prompt{1, 2, 3, 4, 5};
+  auto blocks = pool.AllocateBlocks(3);
+  pool.InsertPrefix(prompt, blocks);
+  pool.FreeBlocks(blocks);
+  EXPECT_EQ(pool.GetFreeBlockCount(), size_t{5});
+
+  // Later prompts share the blocks of their longest cached prefix of full blocks
+  EXPECT_EQ(pool.MatchPrefix(std::vector<int32_t>{1, 2, 3, 4, 9}), (std::vector<int32_t>{blocks[0], blocks[1]}));
+  EXPECT_EQ(pool.MatchPrefix(std::vector<int32_t>{1, 2, 7, 7}), (std::vector<int32_t>{blocks[0]}));
+  EXPECT_TRUE(pool.MatchPrefix(std::vector<int32_t>{9, 9, 9}).empty());
+
+  // A shared prefix block is copied before it's written to, the cached one keeps its contents
+  auto entries = GetBlockEntries(pool, blocks[0]);
+  std::fill(entries.begin(), entries.end(), 1.0f);
+  const int32_t copy = pool.MakeWritable(blocks[0]);
+  EXPECT_NE(copy, blocks[0]);
+  auto copy_entries = GetBlockEntries(pool, copy);
+  std::fill(copy_entries.begin(), copy_entries.end(), 2.0f);
+  EXPECT_EQ(entries[0], 1.0f);
+
+  // Once the matches are freed the cached blocks can be evicted for new sequences
+  pool.FreeBlocks(std::vector<int32_t>{blocks[0], blocks[1], copy});
+  EXPECT_EQ(pool.GetFreeBlockCount(), size_t{5});
+  auto all_blocks = pool.AllocateBlocks(7);
+  EXPECT_EQ(pool.GetFreeBlockCount(), size_t{0});
+  EXPECT_TRUE(pool.MatchPrefix(prompt).empty());
+  pool.FreeBlocks(all_blocks);
+}
+
+}  // namespace Generators::test
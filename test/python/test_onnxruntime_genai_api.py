@@ -3,6 +3,7 @@
 
 from __future__ import annotations
 
+import json
 import os
 import sys
 import sysconfig
@@ -504,6 +505,84 @@ def test_pipeline_model(test_data_path, phi2_for, relative_model_path):
             print(f"actual = {repr(actual_output)}", flush=True)
         assert equal
 
+@pytest.mark.skipif(
+    sysconfig.get_platform().endswith("arm64"),
+    reason="ONNX is not available on ARM64",
+)
+def test_pipeline_static_shape_outputs(tmp_path):
+    # A prompt model and a token generation model write hidden_states with different static shapes, like the context
+    # and iterator models of a QNN pipeline. Each token's hidden state is one-hot, and the LM head shifts it by one.
+    vocab_size, prompt_length, max_length = 16, 4, 10
+
+    def _save_model(filename, node, inputs, outputs, initializers):
+        graph = onnx.helper.make_graph([node], Path(filename).stem, inputs, outputs, initializers)
+        onnx.save(onnx.helper.make_model(graph, opset_imports=[onnx.helper.make_opsetid("", 17)]), tmp_path / filename)
+
+    for filename, sequence_length in [("context.onnx", prompt_length), ("iterator.onnx", 1)]:
+        _save_model(
+            filename,
+            onnx.helper.make_node("Gather", ["embeddings", "input_ids"], ["hidden_states"]),
+            [onnx.helper.make_tensor_value_info("input_ids", onnx.TensorProto.INT64, [1, sequence_length])],
+            [onnx.helper.make_tensor_value_info("hidden_states", onnx.TensorProto.FLOAT, [1, sequence_length, vocab_size])],
+            [onnx.numpy_helper.from_array(np.eye(vocab_size, dtype=np.float32), "embeddings")],
+        )
+    _save_model(
+        "lm_head.onnx",
+        onnx.helper.make_node("MatMul", ["hidden_states", "weight"], ["logits"]),
+        [onnx.helper.make_tensor_value_info("hidden_states", onnx.TensorProto.FLOAT, [1, "sequence_length", vocab_size])],
+        [onnx.helper.make_tensor_value_info("logits", onnx.TensorProto.FLOAT, [1, "sequence_length", vocab_size])],
+        [onnx.numpy_helper.from_array(np.roll(np.eye(vocab_size, dtype=np.float32), 1, axis=1), "weight")],
+    )
+
+    def _pipeline_model(filename, inputs, outputs, run_on_prompt, run_on_token_gen):
+        return {
+            "filename": filename,
+            "inputs": inputs,
+            "outputs": outputs,
+            "run_on_prompt": run_on_prompt,
+            "run_on_token_gen": run_on_token_gen,
+        }
+
+    config = {
+        "model": {
+            "bos_token_id": 0,
+            "context_length": max_length,
+            "decoder": {
+                "session_options": {"log_id": "onnxruntime-genai", "provider_options": []},
+                "head_size": 1,
+                "hidden_size": vocab_size,
+                "inputs": {"input_ids": "input_ids"},
+                "outputs": {"logits": "logits"},
+                "num_attention_heads": 1,
+                "num_hidden_layers": 1,
+                "num_key_value_heads": 1,
+                "pipeline": [
+                    {"context": _pipeline_model("context.onnx", ["input_ids"], ["hidden_states"], True, False)},
+                    {"iterator": _pipeline_model("iterator.onnx", ["input_ids"], ["hidden_states"], False, True)},
+                    {"lm_head": _pipeline_model("lm_head.onnx", ["hidden_states"], ["logits"], True, True)},
+                ],
+            },
+            "eos_token_id": vocab_size - 1,
+            "pad_token_id": vocab_size - 1,
+            "type": "decoder-pipeline",
+            "vocab_size": vocab_size,
+        },
+        "search": {"max_length": max_length},
+    }
+    with open(tmp_path / "genai_config.json", "w") as f:
+        json.dump(config, f)
+
+    model = og.Model(os.fspath(tmp_path))
+    params = og.GeneratorParams(model)
+    params.set_search_options(do_sample=False, max_length=max_length, batch_size=1)
+    generator = og.Generator(model, params)
+    generator.append_tokens(np.arange(prompt_length, dtype=np.int32).reshape(1, prompt_length))
+    while not generator.is_done():
+        generator.generate_next_token()
+
+    # The iterator model's hidden_states of one row replace the context model's of the prompt's rows
+    assert np.array_equal(generator.get_sequence(0), np.arange(max_length, dtype=np.int32))
+
 @pytest.mark.parametrize("relative_model_path", [Path("vision-preprocessing")])
 @pytest.mark.parametrize("relative_image_path", [Path("images") / "sheet.png"])
 def test_vision_preprocessing(test_data_path, relative_model_path, relative_image_path):
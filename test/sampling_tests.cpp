@@ -2,11 +2,13 @@
 // Licensed under the MIT License.
 
 #include <random>
+#include <set>
 
 #include <gtest/gtest.h>
 
 #include "generators.h"
 #include "models/model.h"
+#include "models/utils.h"
 #include "search.h"
 
 // Our working directory is generators/build so one up puts us in the root directory:
@@ -289,6 +291,242 @@ TEST(SamplingTests, RandomizedSamplingTopPAndKCpu) {
   }
 }
 
+TEST(SamplingTests, TokenCounts) {
+  Generators::TokenCounts counts;
+  for (int32_t token : {3, 1, 3, 7})
+    counts.Add(token);
+  EXPECT_EQ(counts.GetCount(3), 2);
+  EXPECT_EQ(counts.GetCount(1), 1);
+  EXPECT_EQ(counts.GetCount(5), 0);
+  EXPECT_EQ(counts.GetCount(100), 0);
+  EXPECT_EQ(counts.GetTokens().size(), 3);
+
+  counts.Remove(1);
+  counts.Remove(3);
+  EXPECT_EQ(counts.GetCount(1), 0);
+  EXPECT_EQ(counts.GetCount(3), 1);
+  std::vector<int32_t> tokens(counts.GetTokens().begin(), counts.GetTokens().end());
+  std::sort(tokens.begin(), tokens.end());
+  EXPECT_EQ(tokens, (std::vector<int32_t>{3, 7}));
+
+  counts.Clear();
+  EXPECT_EQ(counts.GetCount(7), 0);
+  EXPECT_TRUE(counts.GetTokens().empty());
+}
+
+TEST(SamplingTests, RepetitionPenaltyAfterRewindCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  Generators::Config config;
+  config.model.vocab_size = 5;
+
+  auto params = Generators::CreateGeneratorParams(config);
+  params->search.max_length = 10;
+  params->search.repetition_penalty = 2.0f;
+  params->p_device = Generators::GetDeviceInterface(Generators::DeviceType::CPU);
+  auto generator = Generators::CreateGenerator(*model, *params);
+  auto& search = *generator->search_;
+
+  std::vector<int32_t> tokens{1, 3, 3};
+  auto tokens_device = params->p_device->WrapMemory<int32_t>(tokens);
+  search.AppendTokens(tokens_device);
+
+  std::vector<float> logits_cpu(5, 1.0f);
+  search.SetLogits(params->p_device->WrapMemory<float>(logits_cpu));
+  search.ApplyRepetitionPenalty(params->search.repetition_penalty);
+  EXPECT_EQ(logits_cpu, (std::vector<float>{1.0f, 0.5f, 1.0f, 0.5f, 1.0f}));
+
+  // Token 3 is no longer in the sequence after the rewind
+  search.RewindTo(1);
+  std::fill(logits_cpu.begin(), logits_cpu.end(), 1.0f);
+  search.SetLogits(params->p_device->WrapMemory<float>(logits_cpu));
+  search.ApplyRepetitionPenalty(params->search.repetition_penalty);
+  EXPECT_EQ(logits_cpu, (std::vector<float>{1.0f, 0.5f, 1.0f, 1.0f, 1.0f}));
+}
+
+TEST(SamplingTests, FrequencyPresenceAndNoRepeatNGramPenaltiesCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  Generators::Config config;
+  config.model.vocab_size = 5;
+
+  auto params = Generators::CreateGeneratorParams(config);
+  params->search.max_length = 10;
+  params->search.frequency_penalty = 0.5f;
+  params->search.presence_penalty = 0.25f;
+  params->p_device = Generators::GetDeviceInterface(Generators::DeviceType::CPU);
+  auto generator = Generators::CreateGenerator(*model, *params);
+  auto& search = *generator->search_;
+
+  std::vector<int32_t> tokens{1, 2, 1, 2, 1};
+  auto tokens_device = params->p_device->WrapMemory<int32_t>(tokens);
+  search.AppendTokens(tokens_device);
+
+  std::vector<float> logits_cpu(5, 1.0f);
+  search.SetLogits(params->p_device->WrapMemory<float>(logits_cpu));
+  search.ApplyFrequencyPenalty(params->search.frequency_penalty, params->search.presence_penalty);
+  EXPECT_EQ(logits_cpu, (std::vector<float>{1.0f, -0.75f, -0.25f, 1.0f, 1.0f}));
+
+  // The sequence ends in "2 1", which was followed by 2 before, so banning repeated trigrams bans 2
+  std::fill(logits_cpu.begin(), logits_cpu.end(), 1.0f);
+  search.SetLogits(params->p_device->WrapMemory<float>(logits_cpu));
+  search.ApplyNoRepeatNGram(3);
+  EXPECT_EQ(logits_cpu[2], std::numeric_limits<float>::lowest());
+  EXPECT_EQ(logits_cpu[0], 1.0f);
+  EXPECT_EQ(logits_cpu[1], 1.0f);
+}
+
+TEST(SamplingTests, MinPTypicalPAndLogitBiasCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  Generators::Config config;
+  config.model.vocab_size = 5;
+
+  auto params = Generators::CreateGeneratorParams(config);
+  params->search.max_length = 10;
+  params->search.logit_bias = {{3, 2.0f}};
+  params->p_device = Generators::GetDeviceInterface(Generators::DeviceType::CPU);
+  auto generator = Generators::CreateGenerator(*model, *params);
+  auto& search = *generator->search_;
+
+  const std::vector<float> probs{0.5f, 0.3f, 0.1f, 0.06f, 0.04f};
+  std::vector<float> logits_cpu(probs.size());
+  auto reset_logits = [&]() {
+    std::transform(probs.begin(), probs.end(), logits_cpu.begin(), [](float prob) { return std::log(prob); });
+    search.SetLogits(params->p_device->WrapMemory<float>(logits_cpu));
+  };
+  constexpr float lowest = std::numeric_limits<float>::lowest();
+
+  // Only tokens with at least a quarter of the top token's probability remain
+  reset_logits();
+  search.ApplyMinP(0.25f, 1.0f);
+  EXPECT_NE(logits_cpu[0], lowest);
+  EXPECT_NE(logits_cpu[1], lowest);
+  EXPECT_EQ(logits_cpu[2], lowest);
+  EXPECT_EQ(logits_cpu[3], lowest);
+  EXPECT_EQ(logits_cpu[4], lowest);
+
+  // The entropy is about 1.24 nats, token 1's information content (1.20) is the closest to it and covers 0.2 on its own
+  reset_logits();
+  search.ApplyTypicalP(0.2f, 1.0f);
+  EXPECT_EQ(logits_cpu[0], lowest);
+  EXPECT_NE(logits_cpu[1], lowest);
+  EXPECT_EQ(logits_cpu[2], lowest);
+
+  std::fill(logits_cpu.begin(), logits_cpu.end(), 1.0f);
+  search.SetLogits(params->p_device->WrapMemory<float>(logits_cpu));
+  search.ApplyLogitBias(params->search.logit_bias);
+  EXPECT_EQ(logits_cpu, (std::vector<float>{1.0f, 1.0f, 1.0f, 3.0f, 1.0f}));
+}
+
+TEST(SamplingTests, BatchSamplingParametersCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  const int batch_size = 3;
+
+  Generators::Config config;
+  config.model.vocab_size = 5;
+
+  auto params = Generators::CreateGeneratorParams(config);
+  params->search.max_length = 10;
+  params->search.do_sample = true;
+  params->search.batch_size = batch_size;
+  params->p_device = Generators::GetDeviceInterface(Generators::DeviceType::CPU);
+  // A greedy entry, a top k entry and a top p entry share the batch
+  params->SetBatchSampling(std::vector<int32_t>{1, 2, 0}, std::vector<float>{0.0f, 0.0f, 0.05f}, std::vector<float>{1.0f, 1.0f, 1.0f});
+
+  std::set<int32_t> top_k_tokens;
+  for (int i = 0; i < 50; i++) {
+    auto generator = Generators::CreateGenerator(*model, *params);
+    std::vector<float> logits_cpu{1.0f, 5.0f, 1.0f, 1.0f, 1.0f,
+                                  1.0f, 2.0f, 3.0f, 4.0f, 4.0f,
+                                  1.0f, 2.0f, 3.0f, 4.0f, 5.0f};
+    generator->SetLogits(params->p_device->WrapMemory<float>(logits_cpu));
+    generator->GenerateNextToken();
+    auto next_tokens = generator->search_->GetNextTokens().CopyDeviceToCpu();
+    EXPECT_EQ(next_tokens[0], 1);
+    EXPECT_TRUE(next_tokens[1] == 3 || next_tokens[1] == 4);
+    EXPECT_EQ(next_tokens[2], 4);
+    top_k_tokens.insert(next_tokens[1]);
+  }
+  EXPECT_EQ(top_k_tokens.size(), 2u);
+
+  std::vector<int32_t> wrong_size_top_k{1, 2};
+  std::vector<float> wrong_size_values{1.0f, 1.0f};
+  params->SetBatchSampling(wrong_size_top_k, wrong_size_values, wrong_size_values);
+  EXPECT_THROW(Generators::CreateGenerator(*model, *params), std::runtime_error);
+  EXPECT_THROW(params->SetBatchSampling(std::vector<int32_t>{1}, std::vector<float>{1.5f}, std::vector<float>{1.0f}), std::runtime_error);
+}
+
+TEST(SamplingTests, SelectTopFp16Cpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  const int batch_size = 2;
+  const int vocab_size = 3000;  // Several of SelectTopFp16's blocks, with a partial one at the end
+
+  Generators::Config config;
+  config.model.vocab_size = vocab_size;
+  config.model.eos_token_id = 2999;
+  config.model.eos_token_ids = {2999, 100, 1500};
+
+  auto params = Generators::CreateGeneratorParams(config);
+  params->search.max_length = 10;
+  params->search.batch_size = batch_size;
+  params->search.repetition_penalty = 1.5f;
+  params->p_device = Generators::GetDeviceInterface(Generators::DeviceType::CPU);
+  std::vector<int32_t> tokens{7, 1500, 0, 1200};
+
+  std::mt19937 engine{5};
+  std::normal_distribution<float> dist{0.0f, 3.0f};
+  for (int i = 0; i < 20; i++) {
+    std::vector<float> logits(batch_size * vocab_size);
+    std::generate(logits.begin(), logits.end(), [&] { return dist(engine); });
+    // Penalized tokens that would mostly win without the penalty
+    logits[7] = 12.0f;
+    logits[vocab_size + 1200] = 12.0f;
+    if (i % 3 == 0)
+      logits[1500] = 30.0f;  // A secondary EOS token wins, it becomes the primary EOS token
+    std::vector<uint16_t> logits_fp16(logits.size());
+    Generators::ConvertFloat32ToFloat16(logits, logits_fp16);
+    Generators::ConvertFloat16ToFloat32(logits_fp16, logits);
+
+    // The fp32 path, with the EOS handling of Logits::Get
+    for (int b = 0; b < batch_size; b++) {
+      auto row = std::span<float>{logits}.subspan(b * vocab_size, vocab_size);
+      float max = std::numeric_limits<float>::lowest();
+      for (auto id : config.model.eos_token_ids) {
+        max = std::max(max, row[id]);
+        row[id] = std::numeric_limits<float>::lowest();
+      }
+      row[config.model.eos_token_id] = max;
+    }
+    params->search.do_sample = false;
+    auto expected = Generators::CreateGenerator(*model, *params);
+    auto tokens_device = params->p_device->WrapMemory<int32_t>(tokens);
+    expected->search_->AppendTokens(tokens_device);
+    expected->search_->SetLogits(params->p_device->WrapMemory<float>(logits));
+    expected->search_->ApplyRepetitionPenalty(params->search.repetition_penalty);
+    expected->search_->SelectTop();
+    auto expected_tokens = expected->search_->GetNextTokens().CopyDeviceToCpu();
+
+    auto logits_device = params->p_device->WrapMemory<Ort::Float16_t>(
+        std::span<Ort::Float16_t>{reinterpret_cast<Ort::Float16_t*>(logits_fp16.data()), logits_fp16.size()});
+    auto generator = Generators::CreateGenerator(*model, *params);
+    generator->search_->AppendTokens(tokens_device);
+    generator->search_->SelectTopFp16(logits_device, params->search.repetition_penalty);
+    auto next_tokens = generator->search_->GetNextTokens().CopyDeviceToCpu();
+    EXPECT_EQ(std::vector<int32_t>(next_tokens.begin(), next_tokens.end()), std::vector<int32_t>(expected_tokens.begin(), expected_tokens.end()));
+
+    // Top k sampling only picks from the k best of the penalized scores
+    params->search.do_sample = true;
+    params->search.top_k = 5;
+    generator = Generators::CreateGenerator(*model, *params);
+    generator->search_->AppendTokens(tokens_device);
+    generator->search_->SelectTopFp16(logits_device, params->search.repetition_penalty);
+    next_tokens = generator->search_->GetNextTokens().CopyDeviceToCpu();
+    for (int b = 0; b < batch_size; b++) {
+      std::vector<float> row(logits.begin() + b * vocab_size, logits.begin() + (b + 1) * vocab_size);
+      std::nth_element(row.begin(), row.begin() + 4, row.end(), std::greater<float>{});
+      EXPECT_GE(logits[b * vocab_size + next_tokens[b]], row[4]);
+    }
+  }
+}
+
 #if USE_CUDA
 #include "tests_helper.cuh"
 
@@ -563,4 +801,86 @@ TEST(SamplingTests, RandomizedSamplingSelectTopCuda) {
   }
 }
 
+TEST(SamplingTests, BatchSamplingParametersFullVocabCuda) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  const int batch_size = 2;
+  const int vocab_size = 1024;
+
+  Generators::Config config;
+  config.model.vocab_size = vocab_size;
+
+  auto params = Generators::CreateGeneratorParams(config);
+  params->search.max_length = 10;
+  params->search.do_sample = true;
+  params->search.batch_size = batch_size;
+  params->p_device = Generators::GetDeviceInterface(Generators::DeviceType::CUDA);
+  // A top p entry and a top k entry whose candidates run over several blocks of the prefix sum kernel
+  params->SetBatchSampling(std::vector<int32_t>{0, 600}, std::vector<float>{0.9f, 0.0f}, std::vector<float>{1.0f, 1.0f});
+
+  // Nearly uniform scores that fall with the token id, so a token's id is its rank
+  std::vector<float> logits_cpu(vocab_size * batch_size);
+  for (int b = 0; b < batch_size; b++)
+    for (int i = 0; i < vocab_size; i++)
+      logits_cpu[i + vocab_size * b] = -0.001f * i;
+
+  std::vector<int32_t> max_tokens(batch_size);
+  for (int i = 0; i < 100; i++) {
+    auto generator = Generators::CreateGenerator(*model, *params);
+    generator->SetLogits(AllocateFromCpuMem<float>(*params->p_device, logits_cpu));
+    generator->GenerateNextToken();
+    auto next_tokens = generator->search_->GetNextTokens().CopyDeviceToCpu();
+    EXPECT_LT(next_tokens[0], 950);
+    EXPECT_LT(next_tokens[1], 600);
+    for (int b = 0; b < batch_size; b++)
+      max_tokens[b] = std::max(max_tokens[b], next_tokens[b]);
+  }
+  // Tokens past the first 256 are only reached when the prefix sums carry over from one block to the next
+  EXPECT_GT(max_tokens[0], 256);
+  EXPECT_GT(max_tokens[1], 256);
+}
+
+TEST(SamplingTests, FrequencyPenaltyAfterAppendAndRewindCuda) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  Generators::Config config;
+  config.model.vocab_size = 5;
+
+  auto params = Generators::CreateGeneratorParams(config);
+  params->search.max_length = 10;
+  params->search.frequency_penalty = 0.5f;
+  params->search.presence_penalty = 0.25f;
+  params->p_device = Generators::GetDeviceInterface(Generators::DeviceType::CUDA);
+  auto generator = Generators::CreateGenerator(*model, *params);
+  auto& search = *generator->search_;
+
+  auto apply_penalty = [&] {
+    std::vector<float> logits_init(5, 1.0f);
+    auto logits = AllocateFromCpuMem<float>(*params->p_device, logits_init);
+    search.SetLogits(logits);
+    search.ApplyFrequencyPenalty(params->search.frequency_penalty, params->search.presence_penalty);
+    auto logits_cpu = logits.CopyDeviceToCpu();
+    return std::vector<float>(logits_cpu.begin(), logits_cpu.end());
+  };
+
+  auto append_tokens = [&](std::vector<int32_t> tokens) {
+    auto tokens_device = params->p_device->Allocate<int32_t>(tokens.size());
+    Generators::copy(std::span<const int32_t>{tokens}, tokens_device.CpuSpan());
+    tokens_device.CopyCpuToDevice();
+    search.AppendTokens(tokens_device);
+  };
+
+  append_tokens({1, 2, 1, 2, 1});
+  EXPECT_EQ(apply_penalty(), (std::vector<float>{1.0f, -0.75f, -0.25f, 1.0f, 1.0f}));
+
+  // Only the appended tokens are counted on top of the earlier counts
+  append_tokens({3, 2});
+  EXPECT_EQ(apply_penalty(), (std::vector<float>{1.0f, -0.75f, -0.75f, 0.25f, 1.0f}));
+
+  // After a rewind the sequence is recounted, also when it grew past the counted length again
+  search.RewindTo(2);
+  append_tokens({4, 4, 4, 4, 4, 4});
+  EXPECT_EQ(apply_penalty(), (std::vector<float>{1.0f, 0.25f, 0.25f, 1.0f, -2.25f}));
+  search.RewindTo(2);
+  EXPECT_EQ(apply_penalty(), (std::vector<float>{1.0f, 0.25f, 0.25f, 1.0f, 1.0f}));
+}
+
 #endif
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include "worker_thread.h"
 
 #include <atomic>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -49,4 +51,62 @@ TEST(WorkerThreadTest, EnqueueMultipleThenWaitForMultiple) {
   EXPECT_EQ(work_counter, num_work_items);
 }
 
+TEST(WorkerThreadTest, EnqueueFromMultipleThreads) {
+  constexpr size_t num_producers = 4;
+  constexpr size_t num_work_items = 1000;  // Per producer, more than the queue holds
+
+  std::atomic<size_t> work_counter = 0;
+  auto do_work = [&work_counter]() { ++work_counter; };
+
+  WorkerThread worker{};
+  std::vector<std::thread> producers;
+  for (size_t p = 0; p < num_producers; ++p) {
+    producers.emplace_back([&]() {
+      std::vector<std::future<void>> work_item_futures;
+      for (size_t i = 0; i < num_work_items; ++i) {
+        work_item_futures.emplace_back(worker.Enqueue(do_work));
+      }
+      for (auto& work_item_future : work_item_futures) {
+        work_item_future.get();
+      }
+    });
+  }
+
+  for (auto& producer : producers) {
+    producer.join();
+  }
+
+  EXPECT_EQ(work_counter, num_producers * num_work_items);
+}
+
+TEST(WorkerThreadTest, ThreadPoolParallelForVisitsEveryIndexOnce) {
+  constexpr size_t num_indices = 1000;
+
+  std::vector<std::atomic<size_t>> visit_counts(num_indices);
+  WorkerThreadPool pool{3};
+
+  for (size_t call = 0; call < 4; ++call) {
+    pool.ParallelFor(num_indices, [&visit_counts](size_t index) { ++visit_counts[index]; });
+  }
+
+  for (auto& visit_count : visit_counts) {
+    EXPECT_EQ(visit_count, 4);
+  }
+}
+
+TEST(WorkerThreadTest, ThreadPoolParallelForRethrows) {
+  WorkerThreadPool pool{3};
+
+  EXPECT_THROW(pool.ParallelFor(64, [](size_t index) {
+    if (index == 42)
+      throw std::runtime_error("index 42");
+  }),
+               std::runtime_error);
+
+  // The pool is still usable afterwards
+  std::atomic<size_t> work_counter = 0;
+  pool.ParallelFor(64, [&work_counter](size_t) { ++work_counter; });
+  EXPECT_EQ(work_counter, 64);
+}
+
 }  // namespace Generators::test